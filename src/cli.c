@@ -76,6 +76,7 @@
 #define COMMAND_CLEAR "clear"
 #define COMMAND_INFO "info"
 #define COMMAND_ANNOTATE "annotate"
+#define COMMAND_WAL_STATS "wal-stats"
 
 #define OUTPUT_FORMAT_JSON "json"
 #define OUTPUT_FORMAT_TEXT "text"
@@ -99,6 +100,7 @@ static void help_conf(void);
 static void help_clear(void);
 static void help_info(void);
 static void help_annotate(void);
+static void help_wal_stats(void);
 static void display_helper(char* command);
 
 static int backup(SSL* ssl, int socket, char* server, int32_t output_format);
@@ -121,6 +123,7 @@ static int decompress_data(SSL* ssl, int socket, char* path, int32_t output_form
 static int compress_data(SSL* ssl, int socket, char* path, int32_t output_format);
 static int info(SSL* ssl, int socket, char* server, char* backup, int32_t output_format);
 static int annotate(SSL* ssl, int socket, char* server, char* backup, char* command, char* key, char* comment, int32_t output_format);
+static int wal_stats(SSL* ssl, int socket, char* server, char* start, char* end, int32_t output_format);
 
 static int  process_result(SSL* ssl, int socket, int32_t output_format);
 
@@ -179,6 +182,7 @@ usage(void)
    printf("  decompress               Decompress a file using configured method\n");
    printf("  info                     Information about a backup\n");
    printf("  annotate                 Annotate a backup with comments\n");
+   printf("  wal-stats                Statistics of the WAL of a server\n");
    printf("  ping                     Check if pgmoneta is alive\n");
    printf("  stop                     Stop pgmoneta\n");
    printf("  status [details]         Status of pgmoneta, with optional details\n");
@@ -351,6 +355,14 @@ const struct pgmoneta_command command_table[] = {
       .action = MANAGEMENT_ANNOTATE,
       .deprecated = false,
       .log_message = "<annotate> [%s]"
+   },
+   {
+      .command = "wal-stats",
+      .subcommand = "",
+      .accepted_argument_count = {1, 2, 3},
+      .action = MANAGEMENT_WAL_STATS,
+      .deprecated = false,
+      .log_message = "<wal-stats> [%s]"
    }
 };
 
@@ -731,6 +743,10 @@ password:
    {
       exit_code = annotate(s_ssl, socket, parsed.args[0], parsed.args[1], parsed.args[2], parsed.args[3], parsed.args[4], output_format);
    }
+   else if (parsed.cmd->action == MANAGEMENT_WAL_STATS)
+   {
+      exit_code = wal_stats(s_ssl, socket, parsed.args[0], parsed.args[1], parsed.args[2], output_format);
+   }
 
 done:
 
@@ -806,6 +822,7 @@ help_verify(void)
 {
    printf("Verify a backup for a server\n");
    printf("  pgmoneta-cli verify <server> <timestamp|oldest|newest> <directory> [failed|all]\n");
+   printf("  The backup is verified in place, and <directory> is ignored\n");
 }
 
 static void
@@ -913,6 +930,13 @@ help_annotate(void)
    printf("  pgmoneta-cli annotate <server> <timestamp|oldest|newest> <add|update|remove> <key> [comment]\n");
 }
 
+static void
+help_wal_stats(void)
+{
+   printf("Statistics of the WAL of a server\n");
+   printf("  pgmoneta-cli wal-stats <server> [<lsn|time> [<lsn|time>]]\n");
+}
+
 static void
 display_helper(char* command)
 {
@@ -992,6 +1016,10 @@ display_helper(char* command)
    {
       help_annotate();
    }
+   else if (!strcmp(command, COMMAND_WAL_STATS))
+   {
+      help_wal_stats();
+   }
    else
    {
       usage();
@@ -1398,6 +1426,26 @@ error:
    return 1;
 }
 
+static int
+wal_stats(SSL* ssl, int socket, char* server, char* start, char* end, int32_t output_format)
+{
+   if (pgmoneta_management_request_wal_stats(ssl, socket, server, start, end, output_format))
+   {
+      goto error;
+   }
+
+   if (process_result(ssl, socket, output_format))
+   {
+      goto error;
+   }
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
 static int
 process_result(SSL* ssl, int socket, int32_t output_format)
 {
@@ -1496,6 +1544,9 @@ translate_command(int32_t cmd_code)
       case MANAGEMENT_ANNOTATE:
          command_output = pgmoneta_append(command_output, COMMAND_ANNOTATE);
          break;
+      case MANAGEMENT_WAL_STATS:
+         command_output = pgmoneta_append(command_output, COMMAND_WAL_STATS);
+         break;
       default:
          break;
    }
@@ -47,6 +47,19 @@ extern "C" {
 void
 pgmoneta_archive(SSL* ssl, int client_fd, int server, struct json* request);
 
+/**
+ * Stream a stored backup as a tar archive. The files are decrypted and
+ * decompressed from the backup, and the archive is compressed and encrypted
+ * with the configured settings, so no restore of the backup is needed
+ * @param server The server
+ * @param identifier The backup identifier
+ * @param name The top directory in the archive
+ * @param fd The descriptor to write to, f.ex. a file or a socket. The descriptor is closed
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_archive_stream(int server, char* identifier, char* name, int fd);
+
 /**
  * Extract from a tar file to a given directory
  * @param file_path The tar file path
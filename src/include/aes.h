@@ -37,8 +37,67 @@ extern "C" {
 #include <json.h>
 #include <workers.h>
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <openssl/evp.h>
 #include <openssl/ssl.h>
 
+#define AES_MAGIC         "PGMAES01"
+#define AES_MAGIC_LENGTH  8
+#define AES_SALT_LENGTH   16
+#define AES_NONCE_LENGTH  8
+#define AES_TAG_LENGTH    16
+#define AES_HEADER_LENGTH (AES_MAGIC_LENGTH + 4 + 4 + AES_SALT_LENGTH + AES_NONCE_LENGTH)
+#define AES_CHUNK_SIZE    (64 * 1024)
+#define AES_BATCH         16
+
+struct aes_file;
+
+/** @struct aes_chunk
+ * Defines a chunk of an encrypted file
+ */
+struct aes_chunk
+{
+   struct aes_file* aes; /**< The file */
+   uint64_t index;       /**< The index of the chunk in the file */
+   unsigned char* plain; /**< The plaintext */
+   unsigned char* data;  /**< The ciphertext followed by the tag */
+   size_t length;        /**< The length of the plaintext */
+   bool final;           /**< Is this the last chunk of the file */
+   bool failed;          /**< Did the chunk fail */
+};
+
+/** @struct aes_file
+ * Defines a file in the chunked encryption format. Every chunk is encrypted
+ * with AES-GCM on its own, so chunks can be handled in parallel and read in
+ * any order.
+ *
+ * The file starts with a header of the magic, the mode, the chunk size, the salt
+ * of the data key and the nonce of the file. The nonce of a chunk is the nonce of
+ * the file followed by the index of the chunk
+ */
+struct aes_file
+{
+   FILE* file;                                /**< The file */
+   bool encrypt;                              /**< Are we encrypting */
+   int mode;                                  /**< The encryption mode */
+   unsigned char header[AES_HEADER_LENGTH];   /**< The header */
+   unsigned char key[EVP_MAX_KEY_LENGTH];     /**< The data key */
+   uint32_t chunk_size;                       /**< The size of a chunk */
+   uint64_t number_of_chunks;                 /**< The number of chunks, when decrypting */
+   uint64_t last_length;                      /**< The length of the last record, when decrypting */
+   uint64_t chunk;                            /**< The index of the first chunk in the buffer */
+   int batch;                                 /**< The number of chunks in the buffer */
+   unsigned char* plain;                      /**< The plaintext buffer */
+   unsigned char* data;                       /**< The ciphertext buffer */
+   size_t length;                             /**< The length of the plaintext in the buffer */
+   size_t position;                           /**< The position in the plaintext buffer */
+   struct aes_chunk chunks[AES_BATCH];        /**< The chunks of the buffer */
+   struct workers* workers;                   /**< The optional workers */
+};
+
 /**
  * Encrypt a string
  * @param plaintext The string
@@ -100,10 +159,11 @@ pgmoneta_encrypt_request(SSL* ssl, int client_fd, struct json* payload);
  * Encrypt a single file, also remove the original file
  * @param from The from file
  * @param to The to file
+ * @param workers The optional workers
  * @return 0 upon success, otherwise 1
  */
 int
-pgmoneta_encrypt_file(char* from, char* to);
+pgmoneta_encrypt_file(char* from, char* to, struct workers* workers);
 
 /**
  * Decrypt the files under the directory in place, also remove encrypted files.
@@ -114,6 +174,16 @@ pgmoneta_encrypt_file(char* from, char* to);
 int
 pgmoneta_decrypt_directory(char* d, struct workers* workers);
 
+/**
+ * Create a cipher context for the master key
+ * @param mode The encryption mode
+ * @param enc 1 for encryption, 0 for decryption
+ * @param ctx The resulting cipher context
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_create_cipher_context(int mode, int enc, EVP_CIPHER_CTX** ctx);
+
 /**
  * Decrypt a single file, also remove encrypted file
  * @param ssl The SSL
@@ -123,6 +193,87 @@ pgmoneta_decrypt_directory(char* d, struct workers* workers);
 void
 pgmoneta_decrypt_request(SSL* ssl, int client_fd, struct json* payload);
 
+/**
+ * Is the file in the chunked encryption format. The position of the file is kept
+ * @param file The file
+ * @return true if the file starts with the header, otherwise false
+ */
+bool
+pgmoneta_aes_is_chunked(FILE* file);
+
+/**
+ * Start writing a file in the chunked encryption format
+ * @param file The file
+ * @param mode The encryption mode
+ * @param workers The optional workers used to encrypt chunks in parallel
+ * @param aes [out] The encrypted file
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_aes_writer_create(FILE* file, int mode, struct workers* workers, struct aes_file** aes);
+
+/**
+ * Start reading a file in the chunked encryption format
+ * @param file The file, positioned at the header
+ * @param workers The optional workers used to decrypt chunks in parallel
+ * @param aes [out] The encrypted file
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_aes_reader_create(FILE* file, struct workers* workers, struct aes_file** aes);
+
+/**
+ * Encrypt and write data
+ * @param aes The encrypted file
+ * @param buffer The data
+ * @param size The size of the data
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_aes_write(struct aes_file* aes, void* buffer, size_t size);
+
+/**
+ * Read and decrypt data
+ * @param aes The encrypted file
+ * @param buffer The buffer
+ * @param size The size of the buffer
+ * @param length [out] The number of bytes read, 0 at the end of the file
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_aes_read(struct aes_file* aes, void* buffer, size_t size, size_t* length);
+
+/**
+ * Move to a position in the plaintext. Only the chunk holding the
+ * position is decrypted
+ * @param aes The encrypted file
+ * @param offset The offset in the plaintext
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_aes_seek(struct aes_file* aes, uint64_t offset);
+
+/**
+ * Write the last chunk of the file
+ * @param aes The encrypted file
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_aes_finish(struct aes_file* aes);
+
+/**
+ * Destroy an encrypted file. The file itself isn't closed
+ * @param aes The encrypted file
+ */
+void
+pgmoneta_aes_destroy(struct aes_file* aes);
+
+/**
+ * Forget the data keys of the process, f.ex. when the master key has changed
+ */
+void
+pgmoneta_aes_reset_keys(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGMONETA_DEDUP_H
+#define PGMONETA_DEDUP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <workers.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define DEDUP_MAGIC        "PGMCHK01"
+#define DEDUP_MAGIC_LENGTH 8
+#define DEDUP_SUFFIX       ".chunks"
+#define DEDUP_HASH_LENGTH  32
+
+/** @struct dedup_chunk
+ * Defines a chunk of a file
+ */
+struct dedup_chunk
+{
+   unsigned char hash[DEDUP_HASH_LENGTH]; /**< The SHA-256 of the chunk */
+   uint32_t length;                       /**< The length of the chunk */
+   uint64_t offset;                       /**< The offset of the chunk in the file */
+};
+
+/** @struct dedup_map
+ * Defines the chunks that a file is made of.
+ *
+ * The file is stored as <file>.chunks in the backup, and the chunks are stored
+ * in the chunk store as <store>/<2 first hex digits>/<hex>, compressed and
+ * encrypted like the files of the backup
+ */
+struct dedup_map
+{
+   int algorithm;                /**< The chunking algorithm */
+   uint32_t chunk_size;          /**< The (average) chunk size */
+   uint64_t size;                /**< The size of the file */
+   char* store;                  /**< The chunk store, relative to base_dir */
+   uint64_t number_of_chunks;    /**< The number of chunks */
+   struct dedup_chunk* chunks;   /**< The chunks */
+};
+
+/** @struct dedup_statistics
+ * Defines the statistics of a deduplication
+ */
+struct dedup_statistics
+{
+   atomic_ulong files;           /**< The number of files */
+   atomic_ulong chunks;          /**< The number of chunks */
+   atomic_ulong new_chunks;      /**< The number of chunks that were stored */
+   atomic_ulong bytes;           /**< The number of bytes */
+   atomic_ulong new_bytes;       /**< The number of bytes that were stored */
+};
+
+/**
+ * Deduplicate the files of a directory recursively into the chunk store of
+ * the server, or into the shared chunk store with global_deduplication. Every
+ * file of at least a chunk is replaced by its chunk map
+ * @param server The server
+ * @param directory The directory
+ * @param statistics The statistics
+ * @param workers The optional workers
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_dedup_directory(int server, char* directory, struct dedup_statistics* statistics, struct workers* workers);
+
+/**
+ * Read a chunk map
+ * @param path The stored map file, possibly compressed and encrypted
+ * @param map The map
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_dedup_read_map(char* path, struct dedup_map** map);
+
+/**
+ * Destroy a chunk map
+ * @param map The map
+ */
+void
+pgmoneta_dedup_map_destroy(struct dedup_map* map);
+
+/**
+ * Get the stored file of a chunk
+ * @param map The map
+ * @param chunk The chunk
+ * @param stored The stored file
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_dedup_get_chunk(struct dedup_map* map, struct dedup_chunk* chunk, char** stored);
+
+/**
+ * Is a stored file a chunk map
+ * @param path The path
+ * @return True if the file is a chunk map
+ */
+bool
+pgmoneta_dedup_is_map(char* path);
+
+/**
+ * Delete the chunks of the server, and of the shared chunk store, that no backup refers to
+ * @param server The server
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_dedup_collect(int server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -80,6 +80,25 @@ pgmoneta_http_set_request_option(CURL* handle, bool request_type);
 int
 pgmoneta_http_set_url_option(CURL* handle, char* url);
 
+/**
+ * Collect the body of the response
+ * @param handle A CURL easy handle
+ * @param response The body, which must be NULL or allocated
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_http_set_response_option(CURL* handle, char** response);
+
+/**
+ * Get the value of the next element with a tag in a XML document
+ * @param xml The position in the document
+ * @param tag The tag
+ * @param value The unescaped value
+ * @return The position after the element, or NULL if there is no element
+ */
+char*
+pgmoneta_http_xml_element(char* xml, char* tag, char** value);
+
 #ifdef __cplusplus
 }
 #endif
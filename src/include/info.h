@@ -194,6 +194,17 @@ pgmoneta_get_backup_file(char* fn, struct backup** backup);
 int
 pgmoneta_get_number_of_valid_backups(int server);
 
+/**
+ * Get the label of a backup. An identifier that isn't known locally is
+ * returned as is, as the backup may only exist in a remote storage engine
+ * @param server The server
+ * @param identifier The identifier (oldest, newest, latest, a label or the prefix of a label)
+ * @param label The label
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_get_backup_label(int server, char* identifier, char** label);
+
 /**
  * Create an info request
  * @param ssl The SSL connection
@@ -68,6 +68,23 @@ pgmoneta_relink(char* from, char* to, struct workers* workers);
 void
 pgmoneta_link_comparefiles(char* from, char* to, struct workers* workers);
 
+/**
+ * Hardlink the files of a backup to identical files in the backups of all
+ * servers, through the digest index of the manifest checksums
+ * @param server The server
+ * @param identifier The identifier
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_link_global(int server, char* identifier);
+
+/**
+ * Delete the entries of the digest index that no backup links to
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_link_global_collect(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -72,6 +72,7 @@ extern "C" {
 #define MANAGEMENT_INFO           18
 #define MANAGEMENT_VERIFY         19
 #define MANAGEMENT_ANNOTATE       20
+#define MANAGEMENT_WAL_STATS      21
 
 /**
  * Management categories
@@ -97,11 +98,14 @@ extern "C" {
 #define MANAGEMENT_ARGUMENT_COMMENT               "Comment"
 #define MANAGEMENT_ARGUMENT_COMMENTS              "Comments"
 #define MANAGEMENT_ARGUMENT_COMPRESSION           "Compression"
+#define MANAGEMENT_ARGUMENT_DATABASE              "Database"
+#define MANAGEMENT_ARGUMENT_DATABASES             "Databases"
 #define MANAGEMENT_ARGUMENT_DELTA                 "Delta"
 #define MANAGEMENT_ARGUMENT_DESTINATION_FILE      "DestinationFile"
 #define MANAGEMENT_ARGUMENT_DIRECTORY             "Directory"
 #define MANAGEMENT_ARGUMENT_ELAPSED               "Elapsed"
 #define MANAGEMENT_ARGUMENT_ENCRYPTION            "Encryption"
+#define MANAGEMENT_ARGUMENT_END                   "End"
 #define MANAGEMENT_ARGUMENT_END_HILSN             "EndHiLSN"
 #define MANAGEMENT_ARGUMENT_END_LOLSN             "EndLoLSN"
 #define MANAGEMENT_ARGUMENT_END_TIMELINE          "EndTimeline"
@@ -109,6 +113,7 @@ extern "C" {
 #define MANAGEMENT_ARGUMENT_FAILED                "Failed"
 #define MANAGEMENT_ARGUMENT_FILENAME              "FileName"
 #define MANAGEMENT_ARGUMENT_FILES                 "Files"
+#define MANAGEMENT_ARGUMENT_FPI_BYTES             "FPIBytes"
 #define MANAGEMENT_ARGUMENT_FREE_SPACE            "FreeSpace"
 #define MANAGEMENT_ARGUMENT_HASH_ALGORITHM        "HashAlgorithm"
 #define MANAGEMENT_ARGUMENT_HOT_STANDBY_SIZE      "HotStandbySize"
@@ -123,17 +128,27 @@ extern "C" {
 #define MANAGEMENT_ARGUMENT_ORIGINAL              "Original"
 #define MANAGEMENT_ARGUMENT_OUTPUT                "Output"
 #define MANAGEMENT_ARGUMENT_POSITION              "Position"
+#define MANAGEMENT_ARGUMENT_RECORDS               "Records"
+#define MANAGEMENT_ARGUMENT_RECORD_BYTES          "RecordBytes"
+#define MANAGEMENT_ARGUMENT_RECORD_TYPES          "RecordTypes"
+#define MANAGEMENT_ARGUMENT_RELATION              "Relation"
+#define MANAGEMENT_ARGUMENT_RELATIONS             "Relations"
+#define MANAGEMENT_ARGUMENT_RESOURCE_MANAGER      "ResourceManager"
+#define MANAGEMENT_ARGUMENT_RESOURCE_MANAGERS     "ResourceManagers"
 #define MANAGEMENT_ARGUMENT_RESTART               "Restart"
 #define MANAGEMENT_ARGUMENT_RESTORE_SIZE          "RestoreSize"
 #define MANAGEMENT_ARGUMENT_RETENTION_DAYS        "RetentionDays"
 #define MANAGEMENT_ARGUMENT_RETENTION_MONTHS      "RetentionMonths"
 #define MANAGEMENT_ARGUMENT_RETENTION_WEEKS       "RetentionWeeks"
 #define MANAGEMENT_ARGUMENT_RETENTION_YEARS       "RetentionYears"
+#define MANAGEMENT_ARGUMENT_SEGMENTS              "Segments"
 #define MANAGEMENT_ARGUMENT_SERVER                "Server"
 #define MANAGEMENT_ARGUMENT_SERVERS               "Servers"
 #define MANAGEMENT_ARGUMENT_SERVER_SIZE           "ServerSize"
 #define MANAGEMENT_ARGUMENT_SERVER_VERSION        "ServerVersion"
+#define MANAGEMENT_ARGUMENT_SKIPPED               "Skipped"
 #define MANAGEMENT_ARGUMENT_SOURCE_FILE           "SourceFile"
+#define MANAGEMENT_ARGUMENT_START                 "Start"
 #define MANAGEMENT_ARGUMENT_START_HILSN           "StartHiLSN"
 #define MANAGEMENT_ARGUMENT_START_LOLSN           "StartLoLSN"
 #define MANAGEMENT_ARGUMENT_START_TIMELINE        "StartTimeline"
@@ -144,6 +159,7 @@ extern "C" {
 #define MANAGEMENT_ARGUMENT_TIME                  "Time"
 #define MANAGEMENT_ARGUMENT_TIMESTAMP             "Timestamp"
 #define MANAGEMENT_ARGUMENT_TOTAL_SPACE           "TotalSpace"
+#define MANAGEMENT_ARGUMENT_TYPE                  "Type"
 #define MANAGEMENT_ARGUMENT_USED_SPACE            "UsedSpace"
 #define MANAGEMENT_ARGUMENT_VALID                 "Valid"
 #define MANAGEMENT_ARGUMENT_WAL                   "WAL"
@@ -266,6 +282,12 @@ extern "C" {
 #define MANAGEMENT_ERROR_ANNOTATE_NETWORK  2004
 #define MANAGEMENT_ERROR_ANNOTATE_ERROR    2005
 
+#define MANAGEMENT_ERROR_WAL_STATS_NOSERVER 2100
+#define MANAGEMENT_ERROR_WAL_STATS_NOFORK   2101
+#define MANAGEMENT_ERROR_WAL_STATS_RANGE    2102
+#define MANAGEMENT_ERROR_WAL_STATS_NETWORK  2103
+#define MANAGEMENT_ERROR_WAL_STATS_ERROR    2104
+
 /**
  * Output formats
  */
@@ -315,7 +337,7 @@ pgmoneta_management_request_restore(SSL* ssl, int socket, char* server, char* ba
  * @param socket The socket descriptor
  * @param server The server
  * @param backup_id The backup
- * @param directory The directory
+ * @param directory The directory, which is ignored
  * @param files The files filter
  * @param output_format The output format
  * @return 0 upon success, otherwise 1
@@ -504,6 +526,19 @@ pgmoneta_management_request_info(SSL* ssl, int socket, char* server, char* backu
 int
 pgmoneta_management_request_annotate(SSL* ssl, int socket, char* server, char* backup_id, char* action, char* key, char* comment, int32_t output_format);
 
+/**
+ * Create a WAL statistics request
+ * @param ssl The SSL connection
+ * @param socket The socket descriptor
+ * @param server The server
+ * @param start The start of the range, a LSN or a time
+ * @param end The end of the range, a LSN or a time
+ * @param output_format The output format
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_management_request_wal_stats(SSL* ssl, int socket, char* server, char* start, char* end, int32_t output_format);
+
 /**
  * Create an ok response
  * @param ssl The SSL connection
@@ -112,6 +112,15 @@ extern "C" {
 #define STORAGE_ENGINE_S3    1 << 2
 #define STORAGE_ENGINE_AZURE 1 << 3
 
+#define STORAGE_FORMAT_DIRECTORY 0
+#define STORAGE_FORMAT_TAR       1
+
+#define DEDUPLICATION_OFF     0
+#define DEDUPLICATION_PAGE    1
+#define DEDUPLICATION_CONTENT 2
+
+#define DEDUPLICATION_DEFAULT_CHUNK_SIZE (64 * 1024)
+
 #define UPDATE_PROCESS_TITLE_NEVER   0
 #define UPDATE_PROCESS_TITLE_STRICT  1
 #define UPDATE_PROCESS_TITLE_MINIMAL 2
@@ -233,6 +242,14 @@ struct server
    uint32_t cur_timeline;                   /**< Current timeline the server is on*/
    atomic_llong last_operation_time;        /**< Last operation time of the server */
    atomic_llong last_failed_operation_time; /**< Last failed operation time of the server */
+   atomic_ulong wal_verified_segments;      /**< The number of verified WAL segments of the server */
+   atomic_ulong wal_corrupt_segments;       /**< The number of corrupt WAL segments of the server */
+   atomic_ulong wal_decoded_records;        /**< The number of records decoded from the replication stream */
+   atomic_ulong wal_decoded_bytes;          /**< The bytes of the records decoded from the replication stream */
+   atomic_ulong wal_decoded_fpi_bytes;      /**< The bytes of the full page images decoded from the replication stream */
+   atomic_ulong wal_decode_errors;          /**< The number of errors decoding the replication stream */
+   atomic_llong wal_last_commit_time;       /**< The time of the latest commit decoded from the replication stream */
+   atomic_ulong wal_missing_segments;       /**< The number of missing WAL segments in the segment index */
    char wal_shipping[MAX_PATH];             /**< The WAL shipping directory */
    char hot_standby[MAX_PATH];              /**< The hot standby directory */
    char hot_standby_overrides[MAX_PATH];    /**< The hot standby overrides directory */
@@ -315,9 +332,21 @@ struct configuration
    int create_slot;                    /**< Create a slot */
 
    int storage_engine;  /**< The storage engine */
+   int storage_format;  /**< The storage format of the backups */
+
+   int deduplication;            /**< The deduplication of the backup files */
+   int deduplication_chunk_size; /**< The (average) size of a deduplication chunk */
+   bool global_deduplication;    /**< Deduplicate the backup files across all servers */
 
    int encryption; /**< The AES encryption mode */
 
+   bool verify_wal;     /**< Verify the CRC of the WAL records before the WAL is archived */
+   bool wal_time_index; /**< Index the commit times of the WAL before the WAL is archived */
+   bool wal_summary;    /**< Summarize the modified blocks of the WAL before the WAL is archived */
+   bool wal_stats;      /**< Add the WAL to the statistics of the WAL before the WAL is archived */
+   bool wal_tap;        /**< Decode the WAL of the replication stream while it is received */
+   bool wal_index;      /**< Keep an index of the archived WAL segments */
+
    char ssh_hostname[MISC_LENGTH]; /**< The SSH hostname */
    char ssh_username[MISC_LENGTH]; /**< The SSH username */
    char ssh_base_dir[MAX_PATH];    /**< The SSH base directory */
@@ -328,11 +357,13 @@ struct configuration
    char s3_secret_access_key[MISC_LENGTH];  /**< The IAM Secret Access Key */
    char s3_bucket[MISC_LENGTH];          /**< The S3 bucket */
    char s3_base_dir[MAX_PATH];           /**< The S3 base directory */
+   char s3_endpoint[MAX_PATH];           /**< The S3 endpoint */
 
    char azure_storage_account[MISC_LENGTH];    /**< The Azure storage account name */
    char azure_container[MISC_LENGTH];          /**< The Azure container name */
    char azure_shared_key[MISC_LENGTH];         /**< The Azure storage account key */
    char azure_base_dir[MAX_PATH];              /**< The Azure base directory */
+   char azure_endpoint[MAX_PATH];              /**< The Azure Blob service endpoint */
 
    int retention_days;                  /**< The retention days for the server */
    int retention_weeks;                 /**< The retention weeks for the server */
@@ -89,6 +89,12 @@ pgmoneta_remote_management_scram_sha256(char* username, char* password, int serv
 int
 pgmoneta_get_master_key(char** masterkey);
 
+/**
+ * Forget the cached master key, so it is read again from master.key
+ */
+void
+pgmoneta_reset_master_key(void);
+
 /**
  * Is the TLS configuration valid
  * @return 0 upon success, otherwise 1
@@ -167,6 +173,26 @@ int
 pgmoneta_create_crc32c_buffer(void* buffer, size_t size, uint32_t* crc_buf);
 
 /**
+ * Generate CRC32C for a buffer without the CRC32C instructions of the CPU
+ * @param buffer The buffer
+ * @param size The size of the buffer
+ * @param crc The hash value
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_create_crc32c_buffer_software(void* buffer, size_t size, uint32_t* crc);
+
+/**
+ * Get the string representation of a CRC32C value as used in the backup manifest
+ * @param crc The CRC32C value
+ * @param crc_string [out] The string
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_create_crc32c_string(uint32_t crc, char** crc_string);
+
+/**
+ * Generate CRC32C for a file
  * @param path The file path.
  * @param crc The hash value.
  * @return 0 upon success, otherwise 1.
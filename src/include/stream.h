@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGMONETA_STREAM_H
+#define PGMONETA_STREAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <openssl/evp.h>
+
+#define STREAM_BUFFER_SIZE (1024 * 1024)
+
+#define STREAM_COMPRESSION_NONE  0
+#define STREAM_COMPRESSION_GZIP  1
+#define STREAM_COMPRESSION_ZSTD  2
+#define STREAM_COMPRESSION_LZ4   3
+#define STREAM_COMPRESSION_BZIP2 4
+
+/** @struct stream_reader
+ * Defines a reader that returns the plaintext of a stored file.
+ * The file is read once, and decrypted and decompressed in memory
+ */
+struct stream_reader
+{
+   FILE* file;                   /**< The file */
+   int compression;              /**< The compression of the file */
+   bool encrypted;               /**< Is the file encrypted */
+   bool eof;                     /**< Has the end of the file been reached */
+   bool finished;                /**< Has the end of the plaintext been reached */
+   bool end_of_frame;            /**< Was the last data at the end of a frame (ZSTD) */
+   EVP_CIPHER_CTX* cipher;       /**< The cipher context, for files from before the chunked format */
+   struct aes_file* aes;         /**< The chunked encryption, or NULL */
+   unsigned char* raw;           /**< The data read from the file */
+   unsigned char* input;         /**< The decrypted data */
+   size_t input_length;          /**< The length of the decrypted data */
+   size_t input_position;        /**< The position in the decrypted data */
+   void* decompressor;           /**< The decompression context */
+   char* block;                  /**< The compressed block (LZ4) */
+   char* output;                 /**< The decompressed blocks (LZ4) */
+   int output_index;             /**< The current decompressed block (LZ4) */
+   size_t output_length;         /**< The length of the current decompressed block (LZ4) */
+   size_t output_position;       /**< The position in the current decompressed block (LZ4) */
+   struct dedup_map* map;        /**< The chunk map, or NULL */
+   uint64_t map_index;           /**< The current chunk of the map */
+   uint64_t map_position;        /**< The position in the file of the map */
+   uint64_t chunk_position;      /**< The position in the current chunk */
+   bool chunk_verify;            /**< Is the current chunk read from its start, so it can be verified */
+   struct stream_reader* chunk;  /**< The reader of the current chunk */
+   EVP_MD_CTX* chunk_md;         /**< The digest of the current chunk */
+};
+
+/** @struct stream_writer
+ * Defines a writer that compresses data into a stored file as a
+ * sequence of independently decompressible frames
+ */
+struct stream_writer
+{
+   FILE* file;                   /**< The file */
+   int compression;              /**< The compression of the file */
+   int level;                    /**< The compression level */
+   bool in_frame;                /**< Is a frame open */
+   uint64_t offset;              /**< The number of bytes written to the file */
+   uint64_t frame_offset;        /**< The offset of the current frame in the file */
+   uint64_t frame_length;        /**< The number of uncompressed bytes in the current frame */
+   void* compressor;             /**< The compression context */
+   char* output;                 /**< The compressed data */
+   char* block;                  /**< The uncompressed blocks (LZ4) */
+   int block_index;              /**< The current uncompressed block (LZ4) */
+   size_t block_length;          /**< The length of the current uncompressed block (LZ4) */
+   struct aes_file* aes;         /**< The chunked encryption, or NULL */
+};
+
+/** @struct stream_hash
+ * Defines an incremental hash over plaintext data
+ */
+struct stream_hash
+{
+   int algorithm;                /**< The hash algorithm */
+   EVP_MD_CTX* md;               /**< The message digest context */
+   uint32_t crc;                 /**< The CRC32C value */
+};
+
+/**
+ * Initialize a stream reader. The compression and encryption
+ * are detected from the suffix of the file. A chunk map returns
+ * the file assembled from its chunks
+ * @param path The path to the stored file
+ * @param reader The reader
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_stream_reader_init(char* path, struct stream_reader** reader);
+
+/**
+ * Initialize a stream reader that returns the stored data of a file,
+ * also for a chunk map
+ * @param path The path to the stored file
+ * @param reader The reader
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_stream_reader_init_raw(char* path, struct stream_reader** reader);
+
+/**
+ * Read plaintext from a stream reader
+ * @param reader The reader
+ * @param buffer The buffer
+ * @param size The size of the buffer
+ * @param length [out] The number of bytes read, 0 at the end of the stream
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_stream_reader_read(struct stream_reader* reader, void* buffer, size_t size, size_t* length);
+
+/**
+ * Position a stream reader at the start of a frame. The offset must be
+ * one reported by a stream writer for the same file. For a chunk map
+ * the offset is any offset in the file
+ * @param reader The reader
+ * @param offset The offset of the frame in the stored file
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_stream_reader_seek(struct stream_reader* reader, uint64_t offset);
+
+/**
+ * Skip plaintext in a stream reader
+ * @param reader The reader
+ * @param size The number of bytes to skip
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_stream_reader_skip(struct stream_reader* reader, uint64_t size);
+
+/**
+ * Destroy a stream reader
+ * @param reader The reader
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_stream_reader_destroy(struct stream_reader* reader);
+
+/**
+ * Initialize a stream writer
+ * @param path The path to the stored file
+ * @param compression The compression, one of STREAM_COMPRESSION_*
+ * @param level The compression level
+ * @param writer The writer
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_stream_writer_init(char* path, int compression, int level, struct stream_writer** writer);
+
+/**
+ * Initialize a stream writer on a file descriptor, f.ex. a file or a socket.
+ * The writer takes ownership of the descriptor
+ * @param fd The file descriptor
+ * @param compression The compression, one of STREAM_COMPRESSION_*
+ * @param level The compression level
+ * @param encryption The encryption of the compressed data, one of ENCRYPTION_*
+ * @param writer The writer
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_stream_writer_init_fd(int fd, int compression, int level, int encryption, struct stream_writer** writer);
+
+/**
+ * Write plaintext to a stream writer. A new frame is started
+ * at writer->offset if no frame is open
+ * @param writer The writer
+ * @param buffer The buffer
+ * @param size The size of the buffer
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_stream_writer_write(struct stream_writer* writer, void* buffer, size_t size);
+
+/**
+ * End the current frame of a stream writer, so that the data
+ * that follows can be decompressed on its own
+ * @param writer The writer
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_stream_writer_end_frame(struct stream_writer* writer);
+
+/**
+ * Destroy a stream writer. The current frame is ended, and the
+ * file is synchronized to disk if it is a file
+ * @param writer The writer
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_stream_writer_destroy(struct stream_writer* writer);
+
+/**
+ * Get the stream compression that matches the compression setting
+ * @param compression_type The compression type, one of COMPRESSION_*
+ * @return The stream compression
+ */
+int
+pgmoneta_stream_compression(int compression_type);
+
+/**
+ * Get the file suffix of a stream compression
+ * @param compression The stream compression
+ * @return The suffix, e.g. ".zstd"
+ */
+char*
+pgmoneta_stream_compression_suffix(int compression);
+
+/**
+ * Find the stored version of a file, e.g. base/1/1259 could be
+ * stored as base/1/1259.zstd.aes
+ * @param path The path of the file without any suffix
+ * @param stored [out] The path of the stored file
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_stream_get_stored_file(char* path, char** stored);
+
+/**
+ * Get the plain name of a stored file, e.g. 1259.zstd.aes becomes 1259
+ * @param name The name of the stored file
+ * @return The plain name
+ */
+char*
+pgmoneta_stream_plain_name(char* name);
+
+/**
+ * Initialize an incremental hash
+ * @param algorithm The hash algorithm
+ * @param hash [out] The hash
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_stream_hash_init(int algorithm, struct stream_hash** hash);
+
+/**
+ * Add data to an incremental hash
+ * @param hash The hash
+ * @param buffer The buffer
+ * @param size The size of the buffer
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_stream_hash_update(struct stream_hash* hash, void* buffer, size_t size);
+
+/**
+ * Finish an incremental hash
+ * @param hash The hash
+ * @param value [out] The hash value
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_stream_hash_final(struct stream_hash* hash, char** value);
+
+/**
+ * Destroy an incremental hash
+ * @param hash The hash
+ */
+void
+pgmoneta_stream_hash_destroy(struct stream_hash* hash);
+
+/**
+ * Create a hash of the plaintext of a stored file
+ * @param algorithm The hash algorithm
+ * @param path The path to the stored file
+ * @param hash [out] The hash value
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_stream_create_file_hash(int algorithm, char* path, char** hash);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGMONETA_TAR_STORAGE_H
+#define PGMONETA_TAR_STORAGE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <art.h>
+#include <csv.h>
+#include <stream.h>
+
+/* system */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TAR_BLOCK_SIZE 512
+
+#define TAR_STORAGE_FRAME_SIZE (4 * 1024 * 1024)
+#define TAR_STORAGE_INDEX_SUFFIX ".index"
+
+/** @struct tar_storage_member
+ * Defines a member of a stored tar file
+ */
+struct tar_storage_member
+{
+   char path[MAX_PATH];       /**< The path of the member */
+   char link[MAX_PATH];       /**< The target of a link */
+   char type;                 /**< The tar type flag */
+   int mode;                  /**< The mode */
+   uint64_t frame;            /**< The offset of the frame holding the member in the stored file */
+   uint64_t offset;           /**< The offset of the data in the uncompressed frame */
+   uint64_t size;             /**< The size of the data */
+};
+
+/** @struct tar_storage_writer
+ * Defines a writer that stores a tar stream from the server as a framed,
+ * compressed tar file together with an index of its members
+ */
+struct tar_storage_writer
+{
+   char directory[MAX_PATH];     /**< The directory */
+   char tar[MAX_PATH];           /**< The path of the stored tar file */
+   char index_path[MAX_PATH];    /**< The path of the index */
+   int input;                    /**< The compression of the received data */
+   void* decompressor;           /**< The decompression context of the received data */
+   char* buffer;                 /**< The decompressed data */
+   struct stream_writer* stream; /**< The stored tar file */
+   struct csv_writer* index;     /**< The index */
+   char header[TAR_BLOCK_SIZE];  /**< The current header */
+   size_t header_length;         /**< The length of the current header */
+   uint64_t data;                /**< The remaining data of the current member */
+   uint64_t padding;             /**< The remaining padding of the current member */
+   bool long_name;               /**< Is the current member a GNU long name */
+   char name[MAX_PATH];          /**< The GNU long name of the next member */
+   size_t name_length;           /**< The length of the GNU long name */
+   FILE* extract;                /**< The plain copy of the current member */
+};
+
+/** @struct tar_storage_reader
+ * Defines a reader of a stored tar file
+ */
+struct tar_storage_reader
+{
+   char* index;                        /**< The path of the index */
+   struct stream_reader* stream;       /**< The stored tar file */
+   struct tar_storage_member member;   /**< The current member */
+   uint64_t data;                      /**< The remaining data of the current member */
+   uint64_t padding;                   /**< The remaining padding of the current member */
+   struct art* members;                /**< The index, loaded on the first lookup */
+   struct tar_storage_member* entries; /**< The members in the index */
+   uint64_t number_of_entries;         /**< The number of members in the index */
+};
+
+/**
+ * Callback for each member of the stored tar files of a backup
+ * @param path The path of the member relative to the data directory
+ * @param member The member
+ * @param reader The reader, positioned at the data of the member
+ * @param data The callback data
+ * @return 0 upon success, otherwise 1
+ */
+typedef int (*tar_storage_callback)(char* path, struct tar_storage_member* member, struct tar_storage_reader* reader, void* data);
+
+/**
+ * Initialize a tar storage writer. The tar file is stored as <name>.tar
+ * with the suffix of the compression, and the index as <name>.tar.index
+ * @param directory The directory
+ * @param name The name of the tar file
+ * @param writer [out] The writer
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_tar_storage_writer_init(char* directory, char* name, struct tar_storage_writer** writer);
+
+/**
+ * Write data received from the server to a tar storage writer
+ * @param writer The writer
+ * @param data The data
+ * @param length The length of the data
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_tar_storage_writer_write(struct tar_storage_writer* writer, void* data, size_t length);
+
+/**
+ * Destroy a tar storage writer, and complete the stored tar file and its index.
+ * Incomplete tar data aborts the writer instead
+ * @param writer The writer
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_tar_storage_writer_destroy(struct tar_storage_writer* writer);
+
+/**
+ * Abort a tar storage writer, and remove the stored tar file, its index
+ * and the files that were extracted from it
+ * @param writer The writer
+ */
+void
+pgmoneta_tar_storage_writer_abort(struct tar_storage_writer* writer);
+
+/**
+ * Is a directory stored in the tar format
+ * @param directory The directory
+ * @return True if there is a tar index, otherwise false
+ */
+bool
+pgmoneta_tar_storage_exists(char* directory);
+
+/**
+ * Initialize a tar storage reader
+ * @param directory The directory
+ * @param reader [out] The reader
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_tar_storage_reader_init(char* directory, struct tar_storage_reader** reader);
+
+/**
+ * Move to the next member of a stored tar file
+ * @param reader The reader
+ * @param member [out] The member, or NULL at the end of the file
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_tar_storage_reader_next(struct tar_storage_reader* reader, struct tar_storage_member** member);
+
+/**
+ * Move to a member of a stored tar file through the index
+ * @param reader The reader
+ * @param path The path of the member
+ * @param member [out] The member
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_tar_storage_reader_find(struct tar_storage_reader* reader, char* path, struct tar_storage_member** member);
+
+/**
+ * Read the data of the current member
+ * @param reader The reader
+ * @param buffer The buffer
+ * @param size The size of the buffer
+ * @param length [out] The number of bytes read, 0 at the end of the member
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_tar_storage_reader_read(struct tar_storage_reader* reader, void* buffer, size_t size, size_t* length);
+
+/**
+ * Destroy a tar storage reader
+ * @param reader The reader
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_tar_storage_reader_destroy(struct tar_storage_reader* reader);
+
+/**
+ * Visit each member of the stored tar files of a backup data directory,
+ * including the tablespaces linked from pg_tblspc
+ * @param directory The data directory
+ * @param callback The callback
+ * @param data The callback data
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_tar_storage_foreach(char* directory, tar_storage_callback callback, void* data);
+
+/**
+ * Extract a stored tar file. Members under pg_tblspc are skipped
+ * @param directory The directory
+ * @param to The destination directory
+ * @param excluded The paths to skip, NULL terminated, can be NULL
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_tar_storage_extract(char* directory, char* to, char** excluded);
+
+/**
+ * Extract a single file from the stored tar files of a backup data directory
+ * @param directory The data directory
+ * @param path The path of the file relative to the data directory
+ * @param to The destination file
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_tar_storage_extract_file(char* directory, char* path, char* to);
+
+/**
+ * Get the size of the files in a stored tar file
+ * @param directory The directory
+ * @param size [out] The size
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_tar_storage_size(char* directory, uint64_t* size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
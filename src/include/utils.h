@@ -723,6 +723,28 @@ pgmoneta_copy_directory(char* from, char* to, char** restore_last_paths, struct
 int
 pgmoneta_copy_file(char* from, char* to, struct workers* workers);
 
+/**
+ * Copy a stored directory. Files are decrypted and decompressed while they
+ * are copied, and are written under their plain names
+ * @param from The from directory
+ * @param to The to directory
+ * @param restore_last_paths The string array of plain file names that should be excluded from being copied in this round
+ * @param workers The workers
+ * @return The result
+ */
+int
+pgmoneta_copy_stored_directory(char* from, char* to, char** restore_last_paths, struct workers* workers);
+
+/**
+ * Copy a stored file, decrypting and decompressing it in a single pass
+ * @param from The stored file, e.g. base/1/1259.zstd.aes
+ * @param to The plain file, e.g. base/1/1259
+ * @param workers The workers
+ * @return The result
+ */
+int
+pgmoneta_copy_stored_file(char* from, char* to, struct workers* workers);
+
 /**
  * Move a file
  * @param from The from file
@@ -808,17 +830,6 @@ pgmoneta_is_symlink(char* file);
 char*
 pgmoneta_get_symlink(char* symlink);
 
-/**
- * Copy WAL files
- * @param from The from directory
- * @param to The to directory
- * @param start The start file
- * @param workers The optional workers
- * @return The result
- */
-int
-pgmoneta_copy_wal_files(char* from, char* to, char* start, struct workers* workers);
-
 /**
  * Get the number of WAL files
  * @param directory The directory
@@ -940,6 +951,13 @@ pgmoneta_read_checkpoint_info(char* directory, char** chkptpos);
 char*
 pgmoneta_get_server(int server);
 
+/**
+ * Get the directory that is shared by all servers
+ * @return The directory
+ */
+char*
+pgmoneta_get_global(void);
+
 /**
  * Get the backup directory for a server
  * @param server The server
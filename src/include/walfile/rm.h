@@ -42,6 +42,37 @@ typedef struct block_id_data* block_id;
 #define XLR_INFO_MASK           0x0F
 #define XLR_RMGR_INFO_MASK      0xF0
 
+/**
+ * @enum rmgr_ids
+ * @brief The resource manager IDs, in the order of RmgrTable.
+ */
+enum rmgr_ids
+{
+   RM_XLOG_ID,
+   RM_XACT_ID,
+   RM_SMGR_ID,
+   RM_CLOG_ID,
+   RM_DBASE_ID,
+   RM_TBLSPC_ID,
+   RM_MULTIXACT_ID,
+   RM_RELMAP_ID,
+   RM_STANDBY_ID,
+   RM_HEAP2_ID,
+   RM_HEAP_ID,
+   RM_BTREE_ID,
+   RM_HASH_ID,
+   RM_GIN_ID,
+   RM_GIST_ID,
+   RM_SEQ_ID,
+   RM_SPGIST_ID,
+   RM_BRIN_ID,
+   RM_COMMIT_TS_ID,
+   RM_REPLORIGIN_ID,
+   RM_GENERIC_ID,
+   RM_LOGICALMSG_ID,
+   RM_NEXT_ID
+};
+
 // #define Macros
 /**
  * @def ITEM_POINTER_GET_OFFSET_NUMBER_NO_CHECK(pointer)
@@ -38,6 +38,11 @@ extern "C" {
 #define XLOG_SMGR_CREATE   0x10   /**< XLOG opcode for creating a storage manager file. */
 #define XLOG_SMGR_TRUNCATE 0x20   /**< XLOG opcode for truncating a storage manager file. */
 
+#define SMGR_TRUNCATE_HEAP 0x0001 /**< The main fork is truncated. */
+#define SMGR_TRUNCATE_VM   0x0002 /**< The visibility map is truncated. */
+#define SMGR_TRUNCATE_FSM  0x0004 /**< The free space map is truncated. */
+#define SMGR_TRUNCATE_ALL  (SMGR_TRUNCATE_HEAP | SMGR_TRUNCATE_VM | SMGR_TRUNCATE_FSM) /**< All forks are truncated. */
+
 /**
  * @struct xl_smgr_create
  * @brief Represents a storage manager create operation in XLOG.
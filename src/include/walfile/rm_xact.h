@@ -630,4 +630,17 @@ pgmoneta_wal_format_xl_xact_parsed_abort_v14(struct xl_xact_parsed_abort* wrappe
 char*
 pgmoneta_wal_format_xl_xact_parsed_abort_v15(struct xl_xact_parsed_abort* wrapper, char* rec, char* buf);
 
+/**
+ * Get the relations dropped by a commit or abort record.
+ *
+ * The relations point into the main data of the record.
+ *
+ * @param record The decoded commit or abort record.
+ * @param nrels [out] The number of dropped relations.
+ * @param xnodes [out] The dropped relations.
+ * @return 0 on success, 1 if the record isn't a commit or abort record.
+ */
+int
+pgmoneta_wal_xact_dropped_relations(struct decoded_xlog_record* record, int* nrels, struct rel_file_node** xnodes);
+
 #endif // PGMONETA_RM_XACT_H
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGMONETA_WAL_INDEX_H
+#define PGMONETA_WAL_INDEX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <walfile/wal_reader.h>
+
+/* system */
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @struct wal_index_entry
+ * @brief An archived WAL segment.
+ *
+ * Fields:
+ * - timeline: The timeline of the WAL segment.
+ * - segno: The number of the WAL segment.
+ * - size: The size of the stored file.
+ * - compression: The compression of the stored file, COMPRESSION_NONE or a COMPRESSION_CLIENT_* value.
+ * - encrypted: Is the stored file encrypted.
+ * - has_checksum: Is the checksum known.
+ * - checksum: The CRC32C of the WAL segment as it was received.
+ * - verified: Were the records of the WAL segment verified.
+ */
+struct wal_index_entry
+{
+   uint32_t timeline;   /**< The timeline of the WAL segment. */
+   xlog_seg_no segno;   /**< The number of the WAL segment. */
+   uint64_t size;       /**< The size of the stored file. */
+   int compression;     /**< The compression of the stored file. */
+   bool encrypted;      /**< Is the stored file encrypted. */
+   bool has_checksum;   /**< Is the checksum known. */
+   uint32_t checksum;   /**< The CRC32C of the WAL segment as it was received. */
+   bool verified;       /**< Were the records of the WAL segment verified. */
+};
+
+/**
+ * Add a WAL segment to the segment index of a server once it is received.
+ *
+ * The entry is appended to the journal of the index, so the WAL receiver
+ * doesn't read the index, and only waits while an update merges the journal.
+ *
+ * @param server The server index
+ * @param timeline The timeline of the WAL segment
+ * @param segno The number of the WAL segment
+ * @param checksum The CRC32C of the WAL segment
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_index_add(int server, uint32_t timeline, xlog_seg_no segno, uint32_t checksum);
+
+/**
+ * Bring the segment index of a server up to date with its WAL directory.
+ *
+ * The stored size, compression and encryption of every WAL segment are
+ * updated, WAL segments that were archived without the index are added, and
+ * the WAL segments that were removed by retention are removed. The journal is
+ * merged into the index and truncated. The gaps on the
+ * timeline path of the server are counted in its metrics and logged.
+ *
+ * @param server The server index
+ * @param directory The WAL directory of the server
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_index_update(int server, char* directory);
+
+/**
+ * Read the segment index of a server.
+ *
+ * @param server The server index
+ * @param number_of_entries [out] The number of entries
+ * @param entries [out] The entries, sorted by timeline and WAL segment
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_index_read(int server, int* number_of_entries, struct wal_index_entry** entries);
+
+/**
+ * Check that the WAL from a start LSN to an end LSN is archived without a gap
+ * on the path to a timeline.
+ *
+ * A WAL segment is taken from the latest timeline of the path that starts in
+ * it, like recovery does.
+ *
+ * @param server The server index
+ * @param timeline The target timeline
+ * @param start The start LSN, f.ex. the start of a backup
+ * @param end The end LSN, UINT64_MAX for the latest archived WAL
+ * @param restorable [out] Is the WAL complete
+ * @param missing [out] The name of the first missing WAL segment, or NULL
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_index_restorable(int server, uint32_t timeline, xlog_rec_ptr start, xlog_rec_ptr end, bool* restorable, char** missing);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
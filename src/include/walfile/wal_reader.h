@@ -82,6 +82,10 @@ typedef oid rel_file_number;
 #define BKPIMAGE_COMPRESS_PGLZ     0x04
 #define BKPIMAGE_COMPRESS_LZ4      0x08
 #define BKPIMAGE_COMPRESS_ZSTD     0x10
+#define XLP_FIRST_IS_CONTRECORD    0x0001  /* The page starts with the rest of a record */
+#define XLP_LONG_HEADER            0x0002  /* The page has a long header */
+#define WAL_SEGMENT_NAME_SIZE      24      /* The length of the name of a WAL segment */
+#define WAL_SEGMENT_MAX_SIZE       (1024 * 1024 * 1024)  /* The largest WAL segment size */
 
 #define SIZE_OF_XLOG_LONG_PHD      MAXALIGN(sizeof(struct xlog_long_page_header_data))
 #define SIZE_OF_XLOG_SHORT_PHD     MAXALIGN(sizeof(struct xlog_page_header_data))
@@ -319,6 +323,68 @@ struct rel_file_node
    oid relNode;      /**< Relation OID. */
 };
 
+/**
+ * @struct wal_iterator
+ * @brief Iterates over the records of a memory mapped WAL segment.
+ *
+ * A compressed and/or encrypted WAL segment is decrypted and decompressed
+ * into memory owned by the iterator instead of being mapped.
+ *
+ * The page headers are read in place. A record that fits on its page is
+ * decoded where it is, a record that crosses a page boundary is reassembled
+ * into a scratch buffer that is reused by the following records. Main data and
+ * block data that aren't aligned are copied into a second reusable buffer, so
+ * the resource managers can read them as structures.
+ *
+ * The current record, and everything it points to, is only valid until the
+ * next call to pgmoneta_wal_iterator_next().
+ *
+ * Fields:
+ * - server_info: The server structure for context.
+ * - data: The WAL segment.
+ * - size: The size of the WAL segment.
+ * - mapped_size: The size of the memory mapping, 0 if the WAL segment isn't mapped.
+ * - allocated: Is the WAL segment decompressed into memory owned by the iterator.
+ * - block_size: The WAL block size.
+ * - magic: The page magic of the WAL segment.
+ * - segment_start: The LSN of the start of the WAL segment.
+ * - position: The offset of the next record in the WAL segment.
+ * - follow: The path of the next WAL segment, for the record that continues in it.
+ * - followed: Has the iterator moved into the next WAL segment.
+ * - scratch: The buffer for records crossing a page boundary.
+ * - scratch_size: The size of the scratch buffer.
+ * - aligned: The buffer for unaligned main data and block data.
+ * - aligned_size: The size of the aligned buffer.
+ * - verify: Check the CRC of each record before it is decoded.
+ * - error: Did the iteration stop on invalid data.
+ * - incomplete: Did the iteration stop on a record that the next WAL segment doesn't complete.
+ * - decoded: The storage of the current record.
+ * - record: The current record.
+ */
+struct wal_iterator
+{
+   struct server* server_info;             /**< The server structure for context. */
+   char* data;                             /**< The WAL segment. */
+   size_t size;                            /**< The size of the WAL segment. */
+   size_t mapped_size;                     /**< The size of the memory mapping, 0 if the WAL segment isn't mapped. */
+   bool allocated;                         /**< Is the WAL segment decompressed into memory owned by the iterator. */
+   uint32_t block_size;                    /**< The WAL block size. */
+   uint16_t magic;                         /**< The page magic of the WAL segment. */
+   xlog_rec_ptr segment_start;             /**< The LSN of the start of the WAL segment. */
+   size_t position;                        /**< The offset of the next record in the WAL segment. */
+   char* follow;                           /**< The path of the next WAL segment, for the record that continues in it. */
+   bool followed;                          /**< Has the iterator moved into the next WAL segment. */
+   char* scratch;                          /**< The buffer for records crossing a page boundary. */
+   size_t scratch_size;                    /**< The size of the scratch buffer. */
+   char* aligned;                          /**< The buffer for unaligned main data and block data. */
+   size_t aligned_size;                    /**< The size of the aligned buffer. */
+   bool verify;                            /**< Check the CRC of each record before it is decoded. */
+   bool error;                             /**< Did the iteration stop on invalid data. */
+   bool incomplete;                        /**< Did the iteration stop on a record that the next WAL segment doesn't complete. */
+   struct decoded_xlog_record decoded;     /**< The storage of the current record. */
+   struct decoded_xlog_record* record;     /**< The current record. */
+};
+
 /* External variables */
 extern struct server* server_config;
 
@@ -335,6 +401,73 @@ extern struct server* server_config;
 int
 pgmoneta_wal_parse_wal_file(char* path, struct server* server_info, struct walfile* wal_file);
 
+/**
+ * Create an iterator over the records of a WAL segment.
+ *
+ * The WAL segment is memory mapped, and no memory is allocated per record.
+ * A compressed and/or encrypted WAL segment is read through a stream reader
+ * into memory, so no decompressed copy is written to disk. The follow path
+ * may be compressed and/or encrypted as well.
+ *
+ * @param path The file path of the WAL segment.
+ * @param server_info The server structure for context.
+ * @param iterator [out] The iterator.
+ * @return 0 on success, otherwise 1.
+ */
+int
+pgmoneta_wal_iterator_create(char* path, struct server* server_info, struct wal_iterator** iterator);
+
+/**
+ * Create an iterator without a WAL segment, for records that are reassembled
+ * by the caller, f.ex. from the replication stream, and decoded one at a time
+ * with pgmoneta_wal_iterator_decode().
+ *
+ * @param block_size The WAL block size.
+ * @param server_info The server structure for context.
+ * @param iterator [out] The iterator.
+ * @return 0 on success, otherwise 1.
+ */
+int
+pgmoneta_wal_iterator_create_stream(uint32_t block_size, struct server* server_info, struct wal_iterator** iterator);
+
+/**
+ * Decode a complete record into the current record of the iterator.
+ *
+ * The CRC of the record is checked first when the verify flag of the iterator
+ * is set. The current record is valid until the next record is decoded.
+ *
+ * @param iterator The iterator.
+ * @param record The record, without page headers.
+ * @param lsn The LSN of the record.
+ * @param next_lsn The LSN of the next record.
+ * @return 0 on success, otherwise 1.
+ */
+int
+pgmoneta_wal_iterator_decode(struct wal_iterator* iterator, char* record, xlog_rec_ptr lsn, xlog_rec_ptr next_lsn);
+
+/**
+ * Move the iterator to the next record.
+ *
+ * The iteration ends at the end of the WAL, at the end of the WAL segment,
+ * or at invalid data in which case the error flag of the iterator is set.
+ * When the follow path of the iterator is set, the record that continues in
+ * the next WAL segment is completed from it before the iteration ends,
+ * otherwise the incomplete flag of the iterator is set.
+ *
+ * @param iterator The iterator.
+ * @return true if the iterator has a record, otherwise false.
+ */
+bool
+pgmoneta_wal_iterator_next(struct wal_iterator* iterator);
+
+/**
+ * Destroy an iterator.
+ *
+ * @param iterator The iterator.
+ */
+void
+pgmoneta_wal_iterator_destroy(struct wal_iterator* iterator);
+
 /**
  * Decodes an XLOG record from a buffer.
  *
@@ -358,6 +491,40 @@ pgmoneta_wal_decode_xlog_record(char* buffer, struct decoded_xlog_record* decode
 void
 pgmoneta_wal_get_record_length(struct decoded_xlog_record* record, uint32_t* rec_len, uint32_t* fpi_len);
 
+/**
+ * Is the file a complete WAL segment that the iterator can decode, either as
+ * it was streamed or compressed and/or encrypted.
+ *
+ * @param name The file name.
+ * @return true if the file is a WAL segment, otherwise false.
+ */
+bool
+pgmoneta_wal_is_segment(char* name);
+
+/**
+ * Get the path of the completed WAL segment that follows a WAL segment, as it
+ * was streamed or compressed and/or encrypted. A WAL segment that is still
+ * streamed isn't used, since its tail may not be written yet.
+ *
+ * @param directory The directory of the WAL segments.
+ * @param name The name of the WAL segment.
+ * @param segsize The WAL segment size.
+ * @param number_of_files The number of files in the directory.
+ * @param files The files in the directory.
+ * @return The path of the next WAL segment, or NULL if it isn't completed.
+ */
+char*
+pgmoneta_wal_get_next_segment(char* directory, char* name, int segsize, int number_of_files, char** files);
+
+/**
+ * Retrieves the name of a resource manager.
+ *
+ * @param rmid The resource manager ID.
+ * @return The name, or NULL for an unknown resource manager.
+ */
+char*
+pgmoneta_wal_get_rmgr_name(uint8_t rmid);
+
 /**
  * Displays the decoded XLOG record.
  *
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGMONETA_WAL_SCAN_H
+#define PGMONETA_WAL_SCAN_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <walfile/wal_reader.h>
+
+/* system */
+#include <stdbool.h>
+
+/**
+ * @struct wal_consumer
+ * @brief Consumes the records of a WAL scan.
+ *
+ * Every WAL segment of a scan gets its own state, so the WAL segments can be
+ * decoded in parallel. Once all WAL segments are decoded the states are merged
+ * in LSN order by the calling thread.
+ *
+ * Fields:
+ * - create: Create the state of a WAL segment, NULL on failure.
+ * - record: Consume a record into the state of its WAL segment, 0 on success.
+ * - merge: Merge the state of a WAL segment into the result, 0 on success.
+ * - destroy: Destroy the state of a WAL segment.
+ * - data: The result of the scan, passed to create and merge.
+ */
+struct wal_consumer
+{
+   void* (*create)(void* data);                                    /**< Create the state of a WAL segment. */
+   int (*record)(void* state, struct decoded_xlog_record* record); /**< Consume a record. */
+   int (*merge)(void* data, void* state);                          /**< Merge the state of a WAL segment. */
+   void (*destroy)(void* state);                                   /**< Destroy the state of a WAL segment. */
+   void* data;                                                     /**< The result of the scan. */
+};
+
+/**
+ * Scan a range of WAL segments.
+ *
+ * The WAL segments are decoded in parallel by the workers of the server.
+ * Each WAL segment owns the records that start in it, and the record that
+ * continues in the next WAL segment is completed from that WAL segment, so
+ * every record is consumed exactly once. The next WAL segment is the completed
+ * one in the directory, never the WAL segment that is still streamed.
+ *
+ * When number_of_merged is given, the newest WAL segment isn't merged while
+ * its last record continues in a WAL segment that isn't completed yet, so it
+ * can be scanned again once it is.
+ *
+ * @param server The server index
+ * @param directory The directory of the WAL segments
+ * @param number_of_files The number of WAL segments
+ * @param files The names of the WAL segments, in order
+ * @param consumer The consumer of the records
+ * @param number_of_merged [out] The number of WAL segments that were merged, in order, or NULL to merge all
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_scan(int server, char* directory, int number_of_files, char** files, struct wal_consumer* consumer, int* number_of_merged);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
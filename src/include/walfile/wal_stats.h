@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef PGMONETA_WAL_STATS_H
+#define PGMONETA_WAL_STATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <art.h>
+#include <json.h>
+#include <walfile/rm.h>
+#include <walfile/wal_reader.h>
+
+/* system */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <openssl/ssl.h>
+
+#define WAL_STATS_RECORD_TYPES   16
+#define WAL_STATS_RELATIONS      100
+
+/**
+ * @struct wal_stats_counter
+ * @brief The volume of a set of records.
+ *
+ * Fields:
+ * - records: The number of records.
+ * - record_bytes: The bytes of the records without their full page images.
+ * - fpi_bytes: The bytes of the full page images.
+ */
+struct wal_stats_counter
+{
+   uint64_t records;      /**< The number of records. */
+   uint64_t record_bytes; /**< The bytes of the records without their full page images. */
+   uint64_t fpi_bytes;    /**< The bytes of the full page images. */
+};
+
+/**
+ * @struct wal_stats_relation
+ * @brief The write volume of a relation.
+ *
+ * The records are the records that reference a block of the relation, and
+ * the bytes are the block data and full page images of those blocks.
+ *
+ * Fields:
+ * - rlocator: The relation.
+ * - counter: The write volume.
+ */
+struct wal_stats_relation
+{
+   struct rel_file_locator rlocator; /**< The relation. */
+   struct wal_stats_counter counter; /**< The write volume. */
+};
+
+/**
+ * @struct wal_stats_database
+ * @brief The write volume of a database, like a relation.
+ *
+ * Fields:
+ * - dbOid: The database, 0 for the shared relations.
+ * - counter: The write volume.
+ */
+struct wal_stats_database
+{
+   oid dbOid;                        /**< The database. */
+   struct wal_stats_counter counter; /**< The write volume. */
+};
+
+/**
+ * @struct wal_stats
+ * @brief The statistics of the records in a range of LSNs.
+ *
+ * The records are counted by resource manager and record type, where the
+ * record type is the upper 4 bits of xl_info.
+ *
+ * Fields:
+ * - start: The first LSN of the range.
+ * - end: The LSN after the range, 0 for no end.
+ * - last: The last WAL segment of the cumulative statistics.
+ * - segments: The number of decoded WAL segments.
+ * - skipped: The number of WAL segments that couldn't be decoded.
+ * - total: The volume of all records.
+ * - rmgrs: The volume of every resource manager and record type.
+ * - number_of_relations: The number of relations.
+ * - relations_size: The allocated number of relations.
+ * - relations: The relations.
+ * - relation_index: The index of the relations.
+ * - number_of_databases: The number of databases.
+ * - databases_size: The allocated number of databases.
+ * - databases: The databases.
+ * - database_index: The index of the databases.
+ */
+struct wal_stats
+{
+   xlog_rec_ptr start;                                                   /**< The first LSN of the range. */
+   xlog_rec_ptr end;                                                     /**< The LSN after the range. */
+   char last[WAL_SEGMENT_NAME_SIZE + 1];                              /**< The last WAL segment. */
+   uint32_t segments;                                                    /**< The number of decoded WAL segments. */
+   uint32_t skipped;                                                     /**< The number of skipped WAL segments. */
+   struct wal_stats_counter total;                                       /**< The volume of all records. */
+   struct wal_stats_counter rmgrs[RM_NEXT_ID][WAL_STATS_RECORD_TYPES];  /**< The volume by record type. */
+   uint32_t number_of_relations;                                         /**< The number of relations. */
+   uint32_t relations_size;                                              /**< The allocated number of relations. */
+   struct wal_stats_relation* relations;                                 /**< The relations. */
+   struct art* relation_index;                                           /**< The index of the relations. */
+   uint32_t number_of_databases;                                         /**< The number of databases. */
+   uint32_t databases_size;                                              /**< The allocated number of databases. */
+   struct wal_stats_database* databases;                                 /**< The databases. */
+   struct art* database_index;                                           /**< The index of the databases. */
+};
+
+/**
+ * Create the statistics of a range of LSNs.
+ *
+ * @param start The first LSN of the range
+ * @param end The LSN after the range, 0 for no end
+ * @param stats [out] The statistics
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_stats_create(xlog_rec_ptr start, xlog_rec_ptr end, struct wal_stats** stats);
+
+/**
+ * Add a record to the statistics, when it starts in their range.
+ *
+ * @param stats The statistics
+ * @param record The record
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_stats_add(struct wal_stats* stats, struct decoded_xlog_record* record);
+
+/**
+ * Add the statistics of other records to the statistics.
+ *
+ * @param stats The statistics
+ * @param other The other statistics
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_stats_merge(struct wal_stats* stats, struct wal_stats* other);
+
+/**
+ * Destroy the statistics.
+ *
+ * @param stats The statistics
+ */
+void
+pgmoneta_wal_stats_destroy(struct wal_stats* stats);
+
+/**
+ * Collect the statistics of a range of LSNs from the WAL of a server.
+ *
+ * The WAL segments of the range are decoded in parallel by the workers of
+ * the server, the compressed and encrypted WAL segments in memory. Where there
+ * are WAL segments of several timelines for the same LSNs, the WAL segment of
+ * the latest timeline is used. The files that aren't WAL segments are
+ * counted as skipped.
+ *
+ * @param server The server index
+ * @param directory The WAL directory of the server
+ * @param start The first LSN of the range
+ * @param end The LSN after the range, 0 for no end
+ * @param stats [out] The statistics
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_stats_collect(int server, char* directory, xlog_rec_ptr start, xlog_rec_ptr end, struct wal_stats** stats);
+
+/**
+ * Add the completed WAL segments of a server to its cumulative statistics.
+ *
+ * Only WAL segments after the last WAL segment of the statistics are
+ * decoded. The statistics by resource manager, record type
+ * and database are kept in base_dir/<server>/wal_stats.
+ *
+ * @param server The server index
+ * @param directory The WAL directory of the server
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_stats_update(int server, char* directory);
+
+/**
+ * Read the cumulative statistics of a server.
+ *
+ * @param server The server index
+ * @param stats [out] The statistics, NULL when there are none
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_stats_read(int server, struct wal_stats** stats);
+
+/**
+ * Create the statistics of the WAL of a server over a range
+ * @param ssl The SSL connection
+ * @param client_fd The client
+ * @param server The server
+ * @param payload The payload
+ */
+void
+pgmoneta_wal_stats_request(SSL* ssl, int client_fd, int server, struct json* payload);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef PGMONETA_WAL_SUMMARY_H
+#define PGMONETA_WAL_SUMMARY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <art.h>
+#include <walfile/wal_reader.h>
+
+/* system */
+#include <stdbool.h>
+#include <stdint.h>
+
+#define InvalidBlockNumber        ((block_number) 0xFFFFFFFF)
+
+#define BLOCKS_PER_CHUNK          (1 << 16)
+#define MAX_ENTRIES_PER_CHUNK     (BLOCKS_PER_CHUNK / 16)
+
+#define WAL_SUMMARY_MAGIC         0x504D5753
+#define WAL_SUMMARY_VERSION       1
+
+/**
+ * @struct block_ref_chunk
+ * @brief The modified blocks of 65536 consecutive blocks of a relation fork.
+ *
+ * A chunk holds the offsets of the modified blocks until it has
+ * MAX_ENTRIES_PER_CHUNK of them, then it becomes a bitmap of the same size.
+ *
+ * Fields:
+ * - bitmap: Is the chunk a bitmap.
+ * - used: The number of offsets, or of set bits for a bitmap.
+ * - size: The number of allocated offsets.
+ * - data: The offsets or the bitmap.
+ */
+struct block_ref_chunk
+{
+   bool bitmap;      /**< Is the chunk a bitmap. */
+   uint32_t used;    /**< The number of offsets, or of set bits for a bitmap. */
+   uint32_t size;    /**< The number of allocated offsets. */
+   uint16_t* data;   /**< The offsets or the bitmap. */
+};
+
+/**
+ * @struct block_ref_entry
+ * @brief The modified blocks of a relation fork.
+ *
+ * Fields:
+ * - rlocator: The relation.
+ * - forknum: The fork.
+ * - limit_block: The relation fork was truncated to, or created with, this size. All blocks from it are modified.
+ * - number_of_chunks: The number of chunks.
+ * - chunks: The chunks, by block number / BLOCKS_PER_CHUNK.
+ */
+struct block_ref_entry
+{
+   struct rel_file_locator rlocator;   /**< The relation. */
+   enum fork_number forknum;           /**< The fork. */
+   block_number limit_block;           /**< All blocks from this one are modified. */
+   uint32_t number_of_chunks;          /**< The number of chunks. */
+   struct block_ref_chunk* chunks;     /**< The chunks. */
+};
+
+/**
+ * @struct block_ref_table
+ * @brief The modified blocks of a range of WAL, per relation fork.
+ *
+ * Fields:
+ * - index: The entries by relation fork.
+ * - number_of_entries: The number of entries.
+ * - size: The number of allocated entries.
+ * - entries: The entries.
+ */
+struct block_ref_table
+{
+   struct art* index;                  /**< The entries by relation fork. */
+   uint32_t number_of_entries;         /**< The number of entries. */
+   uint32_t size;                      /**< The number of allocated entries. */
+   struct block_ref_entry* entries;    /**< The entries. */
+};
+
+/**
+ * Create a block reference table
+ * @param table [out] The table
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_block_ref_table_create(struct block_ref_table** table);
+
+/**
+ * Mark a block as modified
+ * @param table The table
+ * @param rlocator The relation
+ * @param forknum The fork
+ * @param blkno The block
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_block_ref_table_mark_block_modified(struct block_ref_table* table, struct rel_file_locator* rlocator,
+                                             enum fork_number forknum, block_number blkno);
+
+/**
+ * Set the limit block of a relation fork. The modified blocks from the
+ * limit block are removed, since all of them are modified
+ * @param table The table
+ * @param rlocator The relation
+ * @param forknum The fork
+ * @param limit_block The limit block
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_block_ref_table_set_limit_block(struct block_ref_table* table, struct rel_file_locator* rlocator,
+                                         enum fork_number forknum, block_number limit_block);
+
+/**
+ * Get the entry of a relation fork
+ * @param table The table
+ * @param rlocator The relation
+ * @param forknum The fork
+ * @return The entry, or NULL if the relation fork wasn't modified
+ */
+struct block_ref_entry*
+pgmoneta_block_ref_table_get_entry(struct block_ref_table* table, struct rel_file_locator* rlocator, enum fork_number forknum);
+
+/**
+ * Get the modified blocks of a relation fork in a range, in order
+ * @param entry The entry
+ * @param start The first block
+ * @param stop The block after the last block
+ * @param blocks [out] The modified blocks
+ * @param number_of_blocks [out] The number of modified blocks
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_block_ref_entry_get_blocks(struct block_ref_entry* entry, block_number start, block_number stop,
+                                    block_number** blocks, uint32_t* number_of_blocks);
+
+/**
+ * Get the number of modified blocks of a relation fork, not counting
+ * the blocks from the limit block
+ * @param entry The entry
+ * @return The number of modified blocks
+ */
+uint64_t
+pgmoneta_block_ref_entry_count(struct block_ref_entry* entry);
+
+/**
+ * Merge the modified blocks of the following range of WAL into a table
+ * @param table The table
+ * @param next The table of the following range of WAL
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_block_ref_table_merge(struct block_ref_table* table, struct block_ref_table* next);
+
+/**
+ * Write a table as a WAL summary
+ * @param table The table
+ * @param path The path of the WAL summary
+ * @param timeline The timeline
+ * @param start The start LSN
+ * @param end The end LSN
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_block_ref_table_write(struct block_ref_table* table, char* path, uint32_t timeline, xlog_rec_ptr start, xlog_rec_ptr end);
+
+/**
+ * Read a WAL summary
+ * @param path The path of the WAL summary
+ * @param table [out] The table
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_block_ref_table_read(char* path, struct block_ref_table** table);
+
+/**
+ * Destroy a table
+ * @param table The table
+ */
+void
+pgmoneta_block_ref_table_destroy(struct block_ref_table* table);
+
+/**
+ * Summarize the completed WAL segments of a server.
+ *
+ * Only WAL segments without a WAL summary are decoded, in parallel by the
+ * workers of the server. Compressed and encrypted WAL segments are decoded
+ * in memory. Every WAL segment gets its own
+ * WAL summary in the summaries directory of the server, named like the
+ * WAL summaries of PostgreSQL by timeline, start LSN and end LSN.
+ *
+ * @param server The server index
+ * @param directory The WAL directory of the server
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_summary_update(int server, char* directory);
+
+/**
+ * Get the modified blocks of a range of WAL on a timeline.
+ *
+ * @param server The server index
+ * @param timeline The timeline
+ * @param start The start LSN
+ * @param end The end LSN
+ * @param table [out] The modified blocks
+ * @return 0 upon success, 1 if the WAL summaries don't cover the range
+ */
+int
+pgmoneta_wal_summary_read(int server, uint32_t timeline, xlog_rec_ptr start, xlog_rec_ptr end, struct block_ref_table** table);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGMONETA_WAL_TAP_H
+#define PGMONETA_WAL_TAP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <walfile.h>
+#include <walfile/wal_reader.h>
+#include <walfile/wal_time.h>
+
+/* system */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WAL_TAP_PENDING 64
+
+/**
+ * @struct wal_tap_segment
+ * @brief A WAL segment that was decoded from the replication stream.
+ *
+ * Fields:
+ * - name: The name of the WAL segment.
+ * - indexed: Does the WAL segment have a time index entry.
+ * - verified: Were all records of the WAL segment verified.
+ * - entry: The time index entry of the WAL segment.
+ */
+struct wal_tap_segment
+{
+   char name[WAL_SEGMENT_NAME_SIZE + 1]; /**< The name of the WAL segment. */
+   bool indexed;                         /**< Does the WAL segment have a time index entry. */
+   bool verified;                        /**< Were all records of the WAL segment verified. */
+   struct wal_time_entry entry;          /**< The time index entry of the WAL segment. */
+};
+
+/**
+ * @struct wal_tap
+ * @brief Decodes the WAL of the replication stream while it is received.
+ *
+ * The WAL arrives in CopyData messages that split pages and records at any
+ * byte, so page headers and records are collected across messages. Only one
+ * record is kept in memory at a time. The tap synchronizes at the start of a
+ * WAL segment, and loses the synchronization on a gap in the stream or on
+ * invalid data until the next WAL segment.
+ *
+ * Fields:
+ * - server: The server index.
+ * - directory: The WAL directory of the server.
+ * - timeline: The timeline of the stream.
+ * - segsize: The WAL segment size.
+ * - block_size: The WAL block size, 0 until the first page header.
+ * - magic: The page magic of the WAL.
+ * - synced: Is the tap at a known page and record position.
+ * - lsn: The LSN of the next byte of the stream.
+ * - header: The page header that is collected.
+ * - header_size: The size of the page header that is collected, 0 if none.
+ * - header_length: The collected bytes of the page header.
+ * - skip: The bytes of the rest of a record that started before the tap did.
+ * - record: The record that is collected.
+ * - record_size: The size of the record buffer.
+ * - record_length: The total length of the record, 0 until it is known.
+ * - copied: The collected bytes of the record.
+ * - record_lsn: The LSN of the record.
+ * - iterator: The iterator that decodes the records.
+ * - segno: The WAL segment of the records.
+ * - segment_open: Is a WAL segment decoded.
+ * - segment_valid: Were all bytes of the WAL segment decoded without errors.
+ * - entry: The time index entry of the WAL segment.
+ * - number_of_pending: The number of decoded WAL segments that aren't in the journal yet.
+ * - pending: The decoded WAL segments that aren't in the journal yet.
+ */
+struct wal_tap
+{
+   int server;                                      /**< The server index. */
+   char* directory;                                 /**< The WAL directory of the server. */
+   uint32_t timeline;                               /**< The timeline of the stream. */
+   uint32_t segsize;                                /**< The WAL segment size. */
+   uint32_t block_size;                             /**< The WAL block size. */
+   uint16_t magic;                                  /**< The page magic of the WAL. */
+   bool synced;                                     /**< Is the tap at a known page and record position. */
+   xlog_rec_ptr lsn;                                /**< The LSN of the next byte of the stream. */
+   char header[SIZE_OF_XLOG_LONG_PHD];              /**< The page header that is collected. */
+   uint32_t header_size;                            /**< The size of the page header that is collected. */
+   uint32_t header_length;                          /**< The collected bytes of the page header. */
+   uint32_t skip;                                   /**< The bytes of a record that started before the tap. */
+   char* record;                                    /**< The record that is collected. */
+   size_t record_size;                              /**< The size of the record buffer. */
+   uint32_t record_length;                          /**< The total length of the record. */
+   uint32_t copied;                                 /**< The collected bytes of the record. */
+   xlog_rec_ptr record_lsn;                         /**< The LSN of the record. */
+   struct wal_iterator* iterator;                   /**< The iterator that decodes the records. */
+   xlog_seg_no segno;                               /**< The WAL segment of the records. */
+   bool segment_open;                               /**< Is a WAL segment decoded. */
+   bool segment_valid;                              /**< Were all bytes of the WAL segment decoded. */
+   struct wal_time_entry entry;                     /**< The time index entry of the WAL segment. */
+   int number_of_pending;                           /**< The number of WAL segments that aren't stored. */
+   struct wal_tap_segment pending[WAL_TAP_PENDING]; /**< The WAL segments that aren't stored. */
+};
+
+/**
+ * Create a tap on the replication stream of a server.
+ *
+ * The records are verified when verify_wal is on, and the completed WAL
+ * segments are appended to the journal of the tap, so the WAL processing
+ * doesn't read them again.
+ *
+ * @param server The server index
+ * @param directory The WAL directory of the server
+ * @param timeline The timeline of the stream
+ * @param tap [out] The tap
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_tap_create(int server, char* directory, uint32_t timeline, struct wal_tap** tap);
+
+/**
+ * Feed the WAL of a CopyData message to a tap.
+ *
+ * Invalid WAL is logged and counted, and the tap synchronizes again at the
+ * next WAL segment.
+ *
+ * @param tap The tap
+ * @param lsn The LSN of the data
+ * @param data The data
+ * @param length The length of the data
+ * @return 0 upon success, 1 if the tap can't continue
+ */
+int
+pgmoneta_wal_tap_feed(struct wal_tap* tap, xlog_rec_ptr lsn, char* data, size_t length);
+
+/**
+ * Destroy a tap. The completed WAL segments are appended to the journal.
+ *
+ * @param tap The tap
+ */
+void
+pgmoneta_wal_tap_destroy(struct wal_tap* tap);
+
+/**
+ * Merge the journal of the taps of a server into its time index and its
+ * verified WAL segments, and truncate the journal.
+ *
+ * The caller must hold the WAL flag of the server.
+ *
+ * @param server The server index
+ * @param directory The WAL directory of the server
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_tap_merge(int server, char* directory);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
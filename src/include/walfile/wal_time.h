@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef PGMONETA_WAL_TIME_H
+#define PGMONETA_WAL_TIME_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <walfile/rm_xlog.h>
+#include <walfile/wal_reader.h>
+
+/* system */
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The seconds between 1970-01-01 and 2000-01-01 */
+#define POSTGRES_EPOCH_SECS ((int64_t)(POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY)
+
+/**
+ * @struct wal_time_entry
+ * @brief The commit times of a WAL segment.
+ *
+ * Recovery to a time target stops at the first commit or abort record after
+ * the target, so the first WAL segment whose latest commit is at or after the
+ * target holds the end of the recovery.
+ *
+ * Fields:
+ * - segment: The name of the WAL segment.
+ * - timeline: The timeline of the WAL segment.
+ * - start: The LSN of the start of the WAL segment.
+ * - first: The earliest commit or abort time, 0 if there are none.
+ * - last: The latest commit or abort time, 0 if there are none.
+ * - end: The end LSN of the last commit or abort record that starts in the WAL segment.
+ * - transactions: The number of commit and abort records.
+ * - checkpoint: The time of the latest checkpoint, 0 if there are none.
+ */
+struct wal_time_entry
+{
+   char segment[WAL_SEGMENT_NAME_SIZE + 1]; /**< The name of the WAL segment. */
+   uint32_t timeline;                         /**< The timeline of the WAL segment. */
+   xlog_rec_ptr start;                        /**< The LSN of the start of the WAL segment. */
+   timestamp_tz first;                        /**< The earliest commit or abort time. */
+   timestamp_tz last;                         /**< The latest commit or abort time. */
+   xlog_rec_ptr end;                          /**< The end LSN of the last commit or abort record. */
+   uint32_t transactions;                     /**< The number of commit and abort records. */
+   timestamp_tz checkpoint;                   /**< The time of the latest checkpoint. */
+};
+
+/**
+ * Add the completed WAL segments of a server to its time index.
+ *
+ * Only WAL segments that aren't in the index are decoded, in parallel by
+ * the workers of the server. Compressed and encrypted WAL segments are
+ * decoded in memory.
+ *
+ * @param server The server index
+ * @param directory The WAL directory of the server
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_time_index_update(int server, char* directory);
+
+/**
+ * Add entries to the time index of a server, f.ex. of the WAL segments that
+ * were decoded from the replication stream.
+ *
+ * The entries of WAL segments that are already in the index are ignored.
+ * The caller must hold the WAL flag of the server.
+ *
+ * @param server The server index
+ * @param directory The WAL directory of the server
+ * @param number_of_new The number of entries
+ * @param new_entries The entries
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_time_index_add(int server, char* directory, int number_of_new, struct wal_time_entry* new_entries);
+
+/**
+ * Add a record to the time index entry of its WAL segment.
+ *
+ * @param entry The entry
+ * @param record The record
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_time_index_record(struct wal_time_entry* entry, struct decoded_xlog_record* record);
+
+/**
+ * Read the time index of a server.
+ *
+ * The entries are ordered by LSN and timeline.
+ *
+ * @param server The server index
+ * @param number_of_entries [out] The number of entries
+ * @param entries [out] The entries
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_time_index_read(int server, int* number_of_entries, struct wal_time_entry** entries);
+
+/**
+ * Parse a recovery target time.
+ *
+ * The time is YYYY-MM-DD HH:MM:SS with optional fractional seconds and an
+ * optional Z, UTC or +HH[:MM] time zone.
+ *
+ * @param str The time
+ * @param time [out] The time in microseconds since 2000-01-01 UTC
+ * @param zone [out] Did the time have a time zone
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_time_parse(char* str, timestamp_tz* time, bool* zone);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef PGMONETA_WAL_VERIFY_H
+#define PGMONETA_WAL_VERIFY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <art.h>
+
+/* system */
+#include <stdint.h>
+
+/**
+ * Verify the CRC of every record in a WAL segment.
+ *
+ * The record at the end of the WAL segment is completed from the next
+ * WAL segment when it is given.
+ *
+ * @param path The path of the WAL segment
+ * @param next_path The path of the next WAL segment, or NULL
+ * @param server_info The server
+ * @param records [out] The number of verified records
+ * @param incomplete [out] Does the last record continue in the next WAL segment, which isn't given
+ * @return 0 if the WAL segment is valid, otherwise 1
+ */
+int
+pgmoneta_wal_verify_segment(char* path, char* next_path, struct server* server_info, uint64_t* records, bool* incomplete);
+
+/**
+ * Verify the completed WAL segments of a server.
+ *
+ * Only WAL segments that weren't verified before are read, in parallel by
+ * the workers of the server. Compressed and encrypted WAL segments are
+ * decoded in memory. The result of each WAL segment is
+ * kept in the wal_verified file of the server, and corrupt WAL segments are
+ * logged and counted in the metrics of the server.
+ *
+ * @param server The server index
+ * @param directory The WAL directory of the server
+ * @return 0 if all WAL segments are valid, otherwise 1
+ */
+int
+pgmoneta_wal_verify(int server, char* directory);
+
+/**
+ * Mark WAL segments of a server as valid, f.ex. the WAL segments whose
+ * records were verified from the replication stream.
+ *
+ * WAL segments that already have a result are left as they are.
+ * The caller must hold the WAL flag of the server.
+ *
+ * @param server The server index
+ * @param directory The WAL directory of the server
+ * @param number_of_segments The number of WAL segments
+ * @param names The names of the WAL segments
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_verify_add(int server, char* directory, int number_of_segments, char** names);
+
+/**
+ * Read the results of the WAL verification of a server.
+ *
+ * @param server The server index
+ * @param verified [out] The WAL segment names, with true for the valid ones
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgmoneta_wal_verify_read(int server, struct art** verified);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -172,6 +172,13 @@ pgmoneta_workflow_create_bzip2(bool compress);
 struct workflow*
 pgmoneta_workflow_create_link(void);
 
+/**
+ * Create a workflow for deduplicating the files of a backup into the chunk store
+ * @return The workflow
+ */
+struct workflow*
+pgmoneta_workflow_create_dedup(void);
+
 /**
  * Create a workflow for recovery info
  * @return The workflow
@@ -31,15 +31,67 @@
 #include <logging.h>
 #include <management.h>
 #include <security.h>
+#include <tar_storage.h>
 #include <utils.h>
 #include <workers.h>
 
 /* System */
 #include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/rand.h>
+#include <openssl/sha.h>
 
 #define ENC_BUF_SIZE (1024 * 1024)
 
-static int encrypt_file(char* from, char* to, int enc);
+#define AES_KDF_ITERATIONS 10000
+#define AES_KEY_CACHE      8
+
+/** @struct data_key
+ * Defines a data key derived from the master key
+ */
+struct data_key
+{
+   bool used;                                /**< Is the entry used */
+   int mode;                                 /**< The encryption mode */
+   unsigned char salt[AES_SALT_LENGTH];      /**< The salt */
+   unsigned char key[EVP_MAX_KEY_LENGTH];    /**< The key */
+};
+
+/** @struct derived_key
+ * Defines a key and IV derived from a password
+ */
+struct derived_key
+{
+   bool used;                                      /**< Is the entry used */
+   int mode;                                       /**< The encryption mode */
+   unsigned char digest[SHA256_DIGEST_LENGTH];     /**< The digest of the password */
+   unsigned char key[EVP_MAX_KEY_LENGTH];          /**< The key */
+   unsigned char iv[EVP_MAX_IV_LENGTH];            /**< The IV */
+};
+
+static pthread_mutex_t data_keys_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct data_key data_keys[AES_KEY_CACHE];
+static struct derived_key derived_keys[AES_KEY_CACHE];
+static pthread_once_t aes_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cipher_context_key;
+static unsigned char write_salt[AES_SALT_LENGTH];
+static pid_t write_salt_pid = 0;
+
+static int encrypt_file(char* from, char* to, int enc, struct workers* workers);
+static int get_data_key(int mode, unsigned char* salt, bool create, unsigned char* key);
+static const EVP_CIPHER* get_chunk_cipher(int mode);
+static int aes_buffer(struct aes_file* aes);
+static int aes_flush(struct aes_file* aes, bool final);
+static int aes_load(struct aes_file* aes, uint64_t chunk);
+static void aes_chunk(void* arg);
+static void aes_initialize(void);
+static void aes_wipe(void);
+static EVP_CIPHER_CTX* get_cipher_context(void);
+static void free_cipher_context(void* ctx);
 static int derive_key_iv(char* password, unsigned char* key, unsigned char* iv, int mode);
 static int aes_encrypt(char* plaintext, unsigned char* key, unsigned char* iv, char** ciphertext, int* ciphertext_length, int mode);
 static int aes_decrypt(char* ciphertext, int ciphertext_length, unsigned char* key, unsigned char* iv, char** plaintext, int mode);
@@ -82,7 +134,8 @@ pgmoneta_encrypt_data(char* d, struct workers* workers)
              !pgmoneta_ends_with(entry->d_name, ".partial") &&
              !pgmoneta_ends_with(entry->d_name, ".history") &&
              !pgmoneta_ends_with(entry->d_name, "backup_label") &&
-             !pgmoneta_ends_with(entry->d_name, "backup_manifest"))
+             !pgmoneta_ends_with(entry->d_name, "backup_manifest") &&
+             !pgmoneta_ends_with(entry->d_name, TAR_STORAGE_INDEX_SUFFIX))
          {
             from = NULL;
 
@@ -131,7 +184,7 @@ do_encrypt_file(void* arg)
 
    wi = (struct worker_input*)arg;
 
-   encrypt_file(wi->from, wi->to, 1);
+   encrypt_file(wi->from, wi->to, 1, NULL);
    pgmoneta_delete_file(wi->from, NULL);
 
    free(wi);
@@ -177,6 +230,7 @@ pgmoneta_encrypt_wal(char* d)
    DIR* dir;
    struct dirent* entry;
    char* compress_suffix = NULL;
+   struct workers* workers = NULL;
    struct configuration* config;
 
    config = (struct configuration*)shmem;
@@ -209,6 +263,13 @@ pgmoneta_encrypt_wal(char* d)
    {
       return 1;
    }
+
+   /* The chunks of a segment are encrypted in parallel */
+   if (config->workers > 0)
+   {
+      pgmoneta_workers_initialize(config->workers, &workers);
+   }
+
    while ((entry = readdir(dir)) != NULL)
    {
       if (entry->d_type == DT_REG)
@@ -233,7 +294,7 @@ pgmoneta_encrypt_wal(char* d)
 
          if (pgmoneta_exists(from))
          {
-            encrypt_file(from, to, 1);
+            encrypt_file(from, to, 1, workers);
             pgmoneta_delete_file(from, NULL);
             pgmoneta_permission(to, 6, 0, 0);
          }
@@ -244,6 +305,12 @@ pgmoneta_encrypt_wal(char* d)
    }
 
    closedir(dir);
+
+   if (workers != NULL)
+   {
+      pgmoneta_workers_destroy(workers);
+   }
+
    return 0;
 }
 
@@ -258,6 +325,8 @@ pgmoneta_encrypt_request(SSL* ssl, int client_fd, struct json* payload)
    int total_seconds;
    struct json* req = NULL;
    struct json* response = NULL;
+   struct workers* workers = NULL;
+   struct configuration* config;
 
    start_time = time(NULL);
 
@@ -274,7 +343,14 @@ pgmoneta_encrypt_request(SSL* ssl, int client_fd, struct json* payload)
    to = pgmoneta_append(to, from);
    to = pgmoneta_append(to, ".aes");
 
-   if (encrypt_file(from, to, 1))
+   config = (struct configuration*)shmem;
+
+   if (config->workers > 0)
+   {
+      pgmoneta_workers_initialize(config->workers, &workers);
+   }
+
+   if (encrypt_file(from, to, 1, workers))
    {
       pgmoneta_management_response_error(NULL, client_fd, NULL, MANAGEMENT_ERROR_ENCRYPT_ERROR, payload);
       pgmoneta_log_error("Encrypt: Error encrypting %s", from);
@@ -305,6 +381,11 @@ pgmoneta_encrypt_request(SSL* ssl, int client_fd, struct json* payload)
 
    pgmoneta_log_info("Encrypt: %s (Elapsed: %s)", from, elapsed);
 
+   if (workers != NULL)
+   {
+      pgmoneta_workers_destroy(workers);
+   }
+
    free(to);
    free(elapsed);
 
@@ -312,6 +393,11 @@ pgmoneta_encrypt_request(SSL* ssl, int client_fd, struct json* payload)
 
 error:
 
+   if (workers != NULL)
+   {
+      pgmoneta_workers_destroy(workers);
+   }
+
    free(to);
    free(elapsed);
 
@@ -319,7 +405,7 @@ error:
 }
 
 int
-pgmoneta_encrypt_file(char* from, char* to)
+pgmoneta_encrypt_file(char* from, char* to, struct workers* workers)
 {
    int flag = 0;
    if (!pgmoneta_exists(from))
@@ -335,7 +421,7 @@ pgmoneta_encrypt_file(char* from, char* to)
       flag = 1;
    }
 
-   encrypt_file(from, to, 1);
+   encrypt_file(from, to, 1, workers);
    pgmoneta_delete_file(from, NULL);
    if (flag)
    {
@@ -441,7 +527,7 @@ do_decrypt_file(void* arg)
 
    wi = (struct worker_input*)arg;
 
-   encrypt_file(wi->from, wi->to, 0);
+   encrypt_file(wi->from, wi->to, 0, NULL);
    pgmoneta_delete_file(wi->from, NULL);
 
    free(wi);
@@ -458,6 +544,8 @@ pgmoneta_decrypt_request(SSL* ssl, int client_fd, struct json* payload)
    int total_seconds;
    struct json* req = NULL;
    struct json* response = NULL;
+   struct workers* workers = NULL;
+   struct configuration* config;
 
    start_time = time(NULL);
 
@@ -482,7 +570,14 @@ pgmoneta_decrypt_request(SSL* ssl, int client_fd, struct json* payload)
    memset(to, 0, strlen(from) - 3);
    memcpy(to, from, strlen(from) - 4);
 
-   if (encrypt_file(from, to, 0))
+   config = (struct configuration*)shmem;
+
+   if (config->workers > 0)
+   {
+      pgmoneta_workers_initialize(config->workers, &workers);
+   }
+
+   if (encrypt_file(from, to, 0, workers))
    {
       pgmoneta_management_response_error(NULL, client_fd, NULL, MANAGEMENT_ERROR_DECRYPT_ERROR, payload);
       pgmoneta_log_error("Decrypt: Error decrypting %s", from);
@@ -513,6 +608,11 @@ pgmoneta_decrypt_request(SSL* ssl, int client_fd, struct json* payload)
 
    pgmoneta_log_info("Decrypt: %s (Elapsed: %s)", from, elapsed);
 
+   if (workers != NULL)
+   {
+      pgmoneta_workers_destroy(workers);
+   }
+
    free(to);
    free(elapsed);
 
@@ -520,6 +620,11 @@ pgmoneta_decrypt_request(SSL* ssl, int client_fd, struct json* payload)
 
 error:
 
+   if (workers != NULL)
+   {
+      pgmoneta_workers_destroy(workers);
+   }
+
    free(to);
    free(elapsed);
 
@@ -560,20 +665,207 @@ pgmoneta_decrypt(char* ciphertext, int ciphertext_length, char* password, char**
    return aes_decrypt(ciphertext, ciphertext_length, key, iv, plaintext, mode);
 }
 
+int
+pgmoneta_create_cipher_context(int mode, int enc, EVP_CIPHER_CTX** ctx)
+{
+   unsigned char key[EVP_MAX_KEY_LENGTH];
+   unsigned char iv[EVP_MAX_IV_LENGTH];
+   char* master_key = NULL;
+   EVP_CIPHER_CTX* c = NULL;
+
+   *ctx = NULL;
+
+   if (pgmoneta_get_master_key(&master_key))
+   {
+      pgmoneta_log_fatal("pgmoneta_get_master_key: Invalid master key");
+      goto error;
+   }
+
+   memset(&key, 0, sizeof(key));
+   memset(&iv, 0, sizeof(iv));
+
+   if (derive_key_iv(master_key, key, iv, mode) != 0)
+   {
+      pgmoneta_log_fatal("derive_key_iv: Failed to derive key and iv");
+      goto error;
+   }
+
+   if (!(c = EVP_CIPHER_CTX_new()))
+   {
+      pgmoneta_log_fatal("EVP_CIPHER_CTX_new: Failed to get context");
+      goto error;
+   }
+
+   if (EVP_CipherInit_ex(c, get_cipher(mode)(), NULL, key, iv, enc) == 0)
+   {
+      pgmoneta_log_error("EVP_CipherInit_ex: Failed to initialize context");
+      goto error;
+   }
+
+   OPENSSL_cleanse(key, sizeof(key));
+   OPENSSL_cleanse(iv, sizeof(iv));
+   free(master_key);
+
+   *ctx = c;
+
+   return 0;
+
+error:
+
+   OPENSSL_cleanse(key, sizeof(key));
+   OPENSSL_cleanse(iv, sizeof(iv));
+   free(master_key);
+
+   if (c != NULL)
+   {
+      EVP_CIPHER_CTX_free(c);
+   }
+
+   return 1;
+}
+
 // [private]
 static int
 derive_key_iv(char* password, unsigned char* key, unsigned char* iv, int mode)
 {
+   unsigned char digest[SHA256_DIGEST_LENGTH];
+   int slot = -1;
+
+   pthread_once(&aes_once, aes_initialize);
+
+   /* The derivation is kept per password, so the many files of a backup only do it once */
+   if (EVP_Digest(password, strlen(password), &digest[0], NULL, EVP_sha256(), NULL) != 1)
+   {
+      return 1;
+   }
+
+   pthread_mutex_lock(&data_keys_lock);
+
+   for (int i = 0; i < AES_KEY_CACHE; i++)
+   {
+      if (derived_keys[i].used && derived_keys[i].mode == mode &&
+          !memcmp(&derived_keys[i].digest[0], &digest[0], sizeof(digest)))
+      {
+         memcpy(key, &derived_keys[i].key[0], EVP_MAX_KEY_LENGTH);
+         memcpy(iv, &derived_keys[i].iv[0], EVP_MAX_IV_LENGTH);
+         pthread_mutex_unlock(&data_keys_lock);
+         OPENSSL_cleanse(&digest[0], sizeof(digest));
+         return 0;
+      }
+
+      if (slot == -1 && !derived_keys[i].used)
+      {
+         slot = i;
+      }
+   }
+
+   if (slot == -1)
+   {
+      slot = 0;
+   }
+
+   memset(&derived_keys[slot], 0, sizeof(struct derived_key));
+
    if (!EVP_BytesToKey(get_cipher(mode)(), EVP_sha1(), NULL,
                        (unsigned char*) password, strlen(password), 1,
-                       key, iv))
+                       &derived_keys[slot].key[0], &derived_keys[slot].iv[0]))
    {
+      OPENSSL_cleanse(&derived_keys[slot], sizeof(struct derived_key));
+      pthread_mutex_unlock(&data_keys_lock);
+      OPENSSL_cleanse(&digest[0], sizeof(digest));
       return 1;
    }
 
+   derived_keys[slot].used = true;
+   derived_keys[slot].mode = mode;
+   memcpy(&derived_keys[slot].digest[0], &digest[0], sizeof(digest));
+
+   memcpy(key, &derived_keys[slot].key[0], EVP_MAX_KEY_LENGTH);
+   memcpy(iv, &derived_keys[slot].iv[0], EVP_MAX_IV_LENGTH);
+
+   pthread_mutex_unlock(&data_keys_lock);
+
+   OPENSSL_cleanse(&digest[0], sizeof(digest));
+
    return 0;
 }
 
+void
+pgmoneta_aes_reset_keys(void)
+{
+   pthread_mutex_lock(&data_keys_lock);
+
+   OPENSSL_cleanse(&data_keys[0], sizeof(data_keys));
+   OPENSSL_cleanse(&derived_keys[0], sizeof(derived_keys));
+   OPENSSL_cleanse(&write_salt[0], sizeof(write_salt));
+   write_salt_pid = 0;
+
+   pthread_mutex_unlock(&data_keys_lock);
+}
+
+static void
+aes_initialize(void)
+{
+   pthread_key_create(&cipher_context_key, free_cipher_context);
+   atexit(aes_wipe);
+}
+
+/**
+ * Wipe the keys of the process when it exits
+ */
+static void
+aes_wipe(void)
+{
+   EVP_CIPHER_CTX* ctx = NULL;
+
+   pgmoneta_aes_reset_keys();
+
+   ctx = (EVP_CIPHER_CTX*)pthread_getspecific(cipher_context_key);
+
+   if (ctx != NULL)
+   {
+      pthread_setspecific(cipher_context_key, NULL);
+      free_cipher_context(ctx);
+   }
+}
+
+/**
+ * Get the cipher context of the thread. The context is reset, and
+ * kept until the thread ends
+ */
+static EVP_CIPHER_CTX*
+get_cipher_context(void)
+{
+   EVP_CIPHER_CTX* ctx = NULL;
+
+   pthread_once(&aes_once, aes_initialize);
+
+   ctx = (EVP_CIPHER_CTX*)pthread_getspecific(cipher_context_key);
+
+   if (ctx == NULL)
+   {
+      ctx = EVP_CIPHER_CTX_new();
+
+      if (ctx == NULL || pthread_setspecific(cipher_context_key, ctx))
+      {
+         EVP_CIPHER_CTX_free(ctx);
+         return NULL;
+      }
+   }
+   else
+   {
+      EVP_CIPHER_CTX_reset(ctx);
+   }
+
+   return ctx;
+}
+
+static void
+free_cipher_context(void* ctx)
+{
+   EVP_CIPHER_CTX_free((EVP_CIPHER_CTX*)ctx);
+}
+
 // [private]
 static int
 aes_encrypt(char* plaintext, unsigned char* key, unsigned char* iv, char** ciphertext, int* ciphertext_length, int mode)
@@ -584,7 +876,7 @@ aes_encrypt(char* plaintext, unsigned char* key, unsigned char* iv, char** ciphe
    unsigned char* ct = NULL;
    int ct_length;
    const EVP_CIPHER* (* cipher_fp)(void) = get_cipher(mode);
-   if (!(ctx = EVP_CIPHER_CTX_new()))
+   if (!(ctx = get_cipher_context()))
    {
       goto error;
    }
@@ -620,18 +912,12 @@ aes_encrypt(char* plaintext, unsigned char* key, unsigned char* iv, char** ciphe
 
    ct_length += length;
 
-   EVP_CIPHER_CTX_free(ctx);
-
    *ciphertext = (char*)ct;
    *ciphertext_length = ct_length;
 
    return 0;
 
 error:
-   if (ctx)
-   {
-      EVP_CIPHER_CTX_free(ctx);
-   }
 
    free(ct);
 
@@ -649,7 +935,7 @@ aes_decrypt(char* ciphertext, int ciphertext_length, unsigned char* key, unsigne
    char* pt = NULL;
    const EVP_CIPHER* (* cipher_fp)(void) = get_cipher(mode);
 
-   if (!(ctx = EVP_CIPHER_CTX_new()))
+   if (!(ctx = get_cipher_context()))
    {
       goto error;
    }
@@ -685,18 +971,12 @@ aes_decrypt(char* ciphertext, int ciphertext_length, unsigned char* key, unsigne
 
    plaintext_length += length;
 
-   EVP_CIPHER_CTX_free(ctx);
-
    pt[plaintext_length] = 0;
    *plaintext = pt;
 
    return 0;
 
 error:
-   if (ctx)
-   {
-      EVP_CIPHER_CTX_free(ctx);
-   }
 
    free(pt);
 
@@ -732,123 +1012,823 @@ static const EVP_CIPHER* (*get_cipher(int mode))(void)
    return &EVP_aes_256_cbc;
 }
 
-// enc: 1 for encrypt, 0 for decrypt
-static int
-encrypt_file(char* from, char* to, int enc)
+bool
+pgmoneta_aes_is_chunked(FILE* file)
 {
-   unsigned char key[EVP_MAX_KEY_LENGTH];
-   unsigned char iv[EVP_MAX_IV_LENGTH];
-   char* master_key = NULL;
-   EVP_CIPHER_CTX* ctx = NULL;
-   struct configuration* config;
-   const EVP_CIPHER* (* cipher_fp)(void) = NULL;
-   int cipher_block_size = 0;
-   int inbuf_size = 0;
-   int outbuf_size = 0;
-   FILE* in = NULL;
-   FILE* out = NULL;
-   int inl = 0;
-   int outl = 0;
-   int f_len = 0;
+   char magic[AES_MAGIC_LENGTH];
+   off_t position;
+   bool chunked = false;
 
-   config = (struct configuration*)shmem;
-   cipher_fp = get_cipher(config->encryption);
-   cipher_block_size = EVP_CIPHER_block_size(cipher_fp());
-   inbuf_size = ENC_BUF_SIZE;
-   outbuf_size = inbuf_size + cipher_block_size - 1;
-   unsigned char inbuf[inbuf_size];
-   unsigned char outbuf[outbuf_size];
+   position = ftello(file);
 
-   if (pgmoneta_get_master_key(&master_key))
+   if (fread(&magic[0], 1, AES_MAGIC_LENGTH, file) == AES_MAGIC_LENGTH &&
+       !memcmp(&magic[0], AES_MAGIC, AES_MAGIC_LENGTH))
+   {
+      chunked = true;
+   }
+
+   fseeko(file, position, SEEK_SET);
+
+   return chunked;
+}
+
+int
+pgmoneta_aes_writer_create(FILE* file, int mode, struct workers* workers, struct aes_file** aes)
+{
+   struct aes_file* a = NULL;
+   unsigned char* h = NULL;
+
+   *aes = NULL;
+
+   a = (struct aes_file*)malloc(sizeof(struct aes_file));
+
+   if (a == NULL)
    {
-      pgmoneta_log_fatal("pgmoneta_get_master_key: Invalid master key");
       goto error;
    }
-   memset(&key, 0, sizeof(key));
-   memset(&iv, 0, sizeof(iv));
-   if (derive_key_iv(master_key, key, iv, config->encryption) != 0)
+
+   memset(a, 0, sizeof(struct aes_file));
+
+   a->file = file;
+   a->encrypt = true;
+   a->mode = mode;
+   a->chunk_size = AES_CHUNK_SIZE;
+   a->workers = workers;
+   a->batch = workers != NULL ? AES_BATCH : 1;
+
+   h = &a->header[0];
+   memcpy(h, AES_MAGIC, AES_MAGIC_LENGTH);
+   pgmoneta_write_int32(h + AES_MAGIC_LENGTH, mode);
+   pgmoneta_write_int32(h + AES_MAGIC_LENGTH + 4, a->chunk_size);
+
+   if (get_data_key(mode, h + AES_MAGIC_LENGTH + 8, true, &a->key[0]))
    {
-      pgmoneta_log_fatal("derive_key_iv: Failed to derive key and iv");
       goto error;
    }
 
-   if (!(ctx = EVP_CIPHER_CTX_new()))
+   if (RAND_bytes(h + AES_MAGIC_LENGTH + 8 + AES_SALT_LENGTH, AES_NONCE_LENGTH) != 1)
    {
-      pgmoneta_log_fatal("EVP_CIPHER_CTX_new: Failed to get context");
+      pgmoneta_log_error("AES: Could not create a nonce");
       goto error;
    }
 
-   in = fopen(from, "rb");
-   if (in == NULL)
+   if (aes_buffer(a))
    {
-      pgmoneta_log_error("fopen: Could not open %s", from);
       goto error;
    }
 
-   out = fopen(to, "w");
-   if (out == NULL)
+   if (fwrite(h, 1, AES_HEADER_LENGTH, file) != AES_HEADER_LENGTH)
    {
-      pgmoneta_log_error("fopen: Could not open %s", to);
+      pgmoneta_log_error("AES: Could not write the header: %s", strerror(errno));
       goto error;
    }
 
-   if (EVP_CipherInit_ex(ctx, cipher_fp(), NULL, key, iv, enc) == 0)
+   *aes = a;
+
+   return 0;
+
+error:
+
+   pgmoneta_aes_destroy(a);
+
+   return 1;
+}
+
+int
+pgmoneta_aes_reader_create(FILE* file, struct workers* workers, struct aes_file** aes)
+{
+   struct aes_file* a = NULL;
+   unsigned char* h = NULL;
+   uint64_t record = 0;
+   uint64_t data = 0;
+   struct stat st;
+
+   *aes = NULL;
+
+   a = (struct aes_file*)malloc(sizeof(struct aes_file));
+
+   if (a == NULL)
    {
-      pgmoneta_log_error("EVP_CipherInit_ex: ailed to initialize context");
       goto error;
    }
 
-   while ((inl = fread(inbuf, sizeof(char), inbuf_size, in)) > 0)
+   memset(a, 0, sizeof(struct aes_file));
+
+   a->file = file;
+   a->encrypt = false;
+   a->workers = workers;
+   a->batch = workers != NULL ? AES_BATCH : 1;
+
+   h = &a->header[0];
+
+   if (fread(h, 1, AES_HEADER_LENGTH, file) != AES_HEADER_LENGTH ||
+       memcmp(h, AES_MAGIC, AES_MAGIC_LENGTH))
    {
-      if (EVP_CipherUpdate(ctx, outbuf, &outl, inbuf, inl) == 0)
-      {
-         pgmoneta_log_error("EVP_CipherUpdate: failed to process block");
-         goto error;
-      }
-      if (fwrite(outbuf, sizeof(char), outl, out) != (size_t)outl)
-      {
-         pgmoneta_log_error("fwrite: failed to write cipher");
-         goto error;
-      }
+      pgmoneta_log_error("AES: Invalid header");
+      goto error;
    }
 
-   if (ferror(in))
+   a->mode = pgmoneta_read_int32(h + AES_MAGIC_LENGTH);
+   a->chunk_size = (uint32_t)pgmoneta_read_int32(h + AES_MAGIC_LENGTH + 4);
+
+   if (a->chunk_size == 0 || a->chunk_size > 64 * 1024 * 1024)
    {
-      pgmoneta_log_error("fread: error reading from file: %s", from);
+      pgmoneta_log_error("AES: Invalid chunk size %u", a->chunk_size);
       goto error;
    }
 
-   if (EVP_CipherFinal_ex(ctx, outbuf, &f_len) == 0)
+   if (fstat(fileno(file), &st) || st.st_size < AES_HEADER_LENGTH + AES_TAG_LENGTH)
    {
-      pgmoneta_log_error("EVP_CipherFinal_ex: failed to process final cipher block");
+      pgmoneta_log_error("AES: Truncated file");
       goto error;
    }
 
-   if (f_len)
+   record = (uint64_t)a->chunk_size + AES_TAG_LENGTH;
+   data = (uint64_t)st.st_size - AES_HEADER_LENGTH;
+
+   a->number_of_chunks = (data + record - 1) / record;
+   a->last_length = data - (a->number_of_chunks - 1) * record;
+
+   if (a->last_length < AES_TAG_LENGTH)
    {
-      if (fwrite(outbuf, sizeof(char), f_len, out) != (size_t)f_len)
-      {
-         pgmoneta_log_error("fwrite: failed to write final block");
-         goto error;
-      }
+      pgmoneta_log_error("AES: Truncated file");
+      goto error;
    }
 
-   if (ctx)
+   if (get_data_key(a->mode, h + AES_MAGIC_LENGTH + 8, false, &a->key[0]))
    {
-      EVP_CIPHER_CTX_free(ctx);
+      goto error;
    }
-   free(master_key);
-   fclose(in);
-   fclose(out);
+
+   if (aes_buffer(a))
+   {
+      goto error;
+   }
+
+   *aes = a;
+
    return 0;
 
 error:
-   if (ctx)
+
+   pgmoneta_aes_destroy(a);
+
+   return 1;
+}
+
+int
+pgmoneta_aes_write(struct aes_file* aes, void* buffer, size_t size)
+{
+   size_t capacity = 0;
+   size_t n = 0;
+
+   capacity = (size_t)aes->batch * aes->chunk_size;
+
+   while (size > 0)
    {
-      EVP_CIPHER_CTX_free(ctx);
-   }
+      /* Only encrypt a full buffer once we know it isn't the end of the file */
+      if (aes->length == capacity)
+      {
+         if (aes_flush(aes, false))
+         {
+            return 1;
+         }
+      }
+
+      n = MIN(size, capacity - aes->length);
+
+      memcpy(aes->plain + aes->length, buffer, n);
+
+      aes->length += n;
+      buffer = (char*)buffer + n;
+      size -= n;
+   }
+
+   return 0;
+}
+
+int
+pgmoneta_aes_read(struct aes_file* aes, void* buffer, size_t size, size_t* length)
+{
+   size_t n = 0;
+
+   *length = 0;
+
+   while (*length < size)
+   {
+      if (aes->position == aes->length)
+      {
+         if (aes->chunk + aes->batch >= aes->number_of_chunks && aes->length > 0)
+         {
+            break;
+         }
+
+         if (aes_load(aes, aes->length > 0 ? aes->chunk + aes->batch : aes->chunk))
+         {
+            return 1;
+         }
+
+         if (aes->length == 0)
+         {
+            break;
+         }
+      }
+
+      n = MIN(size - *length, aes->length - aes->position);
+
+      memcpy((char*)buffer + *length, aes->plain + aes->position, n);
+
+      aes->position += n;
+      *length += n;
+   }
+
+   return 0;
+}
+
+int
+pgmoneta_aes_seek(struct aes_file* aes, uint64_t offset)
+{
+   uint64_t chunk = 0;
+
+   if (aes == NULL || aes->encrypt)
+   {
+      return 1;
+   }
+
+   chunk = offset / aes->chunk_size;
+
+   if (chunk >= aes->number_of_chunks)
+   {
+      pgmoneta_log_error("AES: Seek beyond the end of the file");
+      return 1;
+   }
+
+   if (aes_load(aes, chunk))
+   {
+      return 1;
+   }
+
+   aes->position = MIN((size_t)(offset % aes->chunk_size), aes->length);
+
+   return 0;
+}
+
+int
+pgmoneta_aes_finish(struct aes_file* aes)
+{
+   if (aes == NULL || !aes->encrypt)
+   {
+      return 1;
+   }
+
+   return aes_flush(aes, true);
+}
+
+void
+pgmoneta_aes_destroy(struct aes_file* aes)
+{
+   if (aes == NULL)
+   {
+      return;
+   }
+
+   OPENSSL_cleanse(&aes->key[0], sizeof(aes->key));
+
+   if (aes->plain != NULL)
+   {
+      OPENSSL_cleanse(aes->plain, (size_t)aes->batch * aes->chunk_size);
+   }
+
+   free(aes->plain);
+   free(aes->data);
+   free(aes);
+}
+
+static int
+aes_buffer(struct aes_file* aes)
+{
+   aes->plain = (unsigned char*)malloc((size_t)aes->batch * aes->chunk_size);
+   aes->data = (unsigned char*)malloc((size_t)aes->batch * (aes->chunk_size + AES_TAG_LENGTH));
+
+   if (aes->plain == NULL || aes->data == NULL)
+   {
+      return 1;
+   }
+
+   for (int i = 0; i < aes->batch; i++)
+   {
+      aes->chunks[i].aes = aes;
+      aes->chunks[i].plain = aes->plain + (size_t)i * aes->chunk_size;
+      aes->chunks[i].data = aes->data + (size_t)i * (aes->chunk_size + AES_TAG_LENGTH);
+   }
+
+   return 0;
+}
+
+/**
+ * Encrypt the chunks in the buffer and write them
+ */
+static int
+aes_flush(struct aes_file* aes, bool final)
+{
+   int count = 0;
+   size_t remaining = aes->length;
+
+   /* An empty file still has a final chunk, so a truncation can be detected */
+   do
+   {
+      struct aes_chunk* c = &aes->chunks[count];
+
+      c->index = aes->chunk + count;
+      c->length = MIN(remaining, (size_t)aes->chunk_size);
+      c->failed = false;
+      remaining -= c->length;
+      c->final = final && remaining == 0;
+
+      count++;
+   }
+   while (remaining > 0);
+
+   for (int i = 0; i < count; i++)
+   {
+      if (aes->workers != NULL && count > 1)
+      {
+         pgmoneta_workers_add(aes->workers, aes_chunk, (void*)&aes->chunks[i]);
+      }
+      else
+      {
+         aes_chunk(&aes->chunks[i]);
+      }
+   }
+
+   if (aes->workers != NULL && count > 1)
+   {
+      pgmoneta_workers_wait(aes->workers);
+   }
+
+   for (int i = 0; i < count; i++)
+   {
+      struct aes_chunk* c = &aes->chunks[i];
+
+      if (c->failed)
+      {
+         pgmoneta_log_error("AES: Could not encrypt chunk %" PRIu64, c->index);
+         return 1;
+      }
+
+      if (fwrite(c->data, 1, c->length + AES_TAG_LENGTH, aes->file) != c->length + AES_TAG_LENGTH)
+      {
+         pgmoneta_log_error("AES: Write error: %s", strerror(errno));
+         return 1;
+      }
+   }
+
+   aes->chunk += count;
+   aes->length = 0;
+
+   return 0;
+}
+
+/**
+ * Read and decrypt the chunks of the buffer starting at a chunk
+ */
+static int
+aes_load(struct aes_file* aes, uint64_t chunk)
+{
+   int count = 0;
+   uint64_t record = (uint64_t)aes->chunk_size + AES_TAG_LENGTH;
+
+   aes->chunk = chunk;
+   aes->length = 0;
+   aes->position = 0;
+
+   if (chunk >= aes->number_of_chunks)
+   {
+      return 0;
+   }
+
+   if (fseeko(aes->file, (off_t)(AES_HEADER_LENGTH + chunk * record), SEEK_SET))
+   {
+      pgmoneta_log_error("AES: Seek error: %s", strerror(errno));
+      return 1;
+   }
+
+   for (count = 0; count < aes->batch && chunk + count < aes->number_of_chunks; count++)
+   {
+      struct aes_chunk* c = &aes->chunks[count];
+      size_t r = 0;
+
+      c->index = chunk + count;
+      c->final = c->index == aes->number_of_chunks - 1;
+      c->failed = false;
+
+      r = c->final ? (size_t)aes->last_length : (size_t)record;
+
+      if (fread(c->data, 1, r, aes->file) != r)
+      {
+         pgmoneta_log_error("AES: Read error for chunk %" PRIu64, c->index);
+         return 1;
+      }
+
+      c->length = r - AES_TAG_LENGTH;
+   }
+
+   for (int i = 0; i < count; i++)
+   {
+      if (aes->workers != NULL && count > 1)
+      {
+         pgmoneta_workers_add(aes->workers, aes_chunk, (void*)&aes->chunks[i]);
+      }
+      else
+      {
+         aes_chunk(&aes->chunks[i]);
+      }
+   }
+
+   if (aes->workers != NULL && count > 1)
+   {
+      pgmoneta_workers_wait(aes->workers);
+   }
+
+   for (int i = 0; i < count; i++)
+   {
+      struct aes_chunk* c = &aes->chunks[i];
+
+      if (c->failed)
+      {
+         pgmoneta_log_error("AES: Authentication failed for chunk %" PRIu64, c->index);
+         aes->length = 0;
+         return 1;
+      }
+
+      /* Chunks are full except the last one, so the plaintext is contiguous */
+      aes->length += c->length;
+   }
+
+   return 0;
+}
+
+/**
+ * Encrypt or decrypt a chunk with AES-GCM. The header and whether the chunk
+ * is the last one are authenticated too
+ */
+static void
+aes_chunk(void* arg)
+{
+   struct aes_chunk* c = (struct aes_chunk*)arg;
+   struct aes_file* aes = c->aes;
+   EVP_CIPHER_CTX* ctx = NULL;
+   unsigned char iv[AES_NONCE_LENGTH + 4];
+   unsigned char final = c->final ? 1 : 0;
+   int length = 0;
+
+   c->failed = true;
+
+   memcpy(&iv[0], &aes->header[AES_MAGIC_LENGTH + 8 + AES_SALT_LENGTH], AES_NONCE_LENGTH);
+   pgmoneta_write_int32(&iv[AES_NONCE_LENGTH], (int32_t)c->index);
+
+   if (!(ctx = get_cipher_context()))
+   {
+      goto done;
+   }
+
+   if (EVP_CipherInit_ex(ctx, get_chunk_cipher(aes->mode), NULL, NULL, NULL, aes->encrypt ? 1 : 0) != 1 ||
+       EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, sizeof(iv), NULL) != 1 ||
+       EVP_CipherInit_ex(ctx, NULL, NULL, &aes->key[0], &iv[0], aes->encrypt ? 1 : 0) != 1)
+   {
+      goto done;
+   }
+
+   if (EVP_CipherUpdate(ctx, NULL, &length, &aes->header[0], AES_HEADER_LENGTH) != 1 ||
+       EVP_CipherUpdate(ctx, NULL, &length, &final, 1) != 1)
+   {
+      goto done;
+   }
+
+   if (aes->encrypt)
+   {
+      if ((c->length > 0 && EVP_CipherUpdate(ctx, c->data, &length, c->plain, (int)c->length) != 1) ||
+          EVP_CipherFinal_ex(ctx, c->data + c->length, &length) != 1 ||
+          EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, AES_TAG_LENGTH, c->data + c->length) != 1)
+      {
+         goto done;
+      }
+   }
+   else
+   {
+      if ((c->length > 0 && EVP_CipherUpdate(ctx, c->plain, &length, c->data, (int)c->length) != 1) ||
+          EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, AES_TAG_LENGTH, c->data + c->length) != 1 ||
+          EVP_CipherFinal_ex(ctx, c->plain + c->length, &length) != 1)
+      {
+         goto done;
+      }
+   }
+
+   c->failed = false;
+
+done:
+
+   return;
+}
+
+/**
+ * Get the data key for a salt. The key is derived from the master key with
+ * PBKDF2 once, and kept for the process. When creating, the salt of this
+ * process is used, so every backup gets its own data key
+ */
+static int
+get_data_key(int mode, unsigned char* salt, bool create, unsigned char* key)
+{
+   int length = 0;
+   int slot = -1;
+   char* master_key = NULL;
+
+   length = EVP_CIPHER_key_length(get_chunk_cipher(mode));
+
+   pthread_once(&aes_once, aes_initialize);
+
+   pthread_mutex_lock(&data_keys_lock);
+
+   if (create)
+   {
+      if (write_salt_pid != getpid())
+      {
+         if (RAND_bytes(&write_salt[0], AES_SALT_LENGTH) != 1)
+         {
+            pgmoneta_log_error("AES: Could not create a salt");
+            goto error;
+         }
+
+         write_salt_pid = getpid();
+      }
+
+      memcpy(salt, &write_salt[0], AES_SALT_LENGTH);
+   }
+
+   for (int i = 0; i < AES_KEY_CACHE; i++)
+   {
+      if (data_keys[i].used && data_keys[i].mode == mode &&
+          !memcmp(&data_keys[i].salt[0], salt, AES_SALT_LENGTH))
+      {
+         memcpy(key, &data_keys[i].key[0], length);
+         pthread_mutex_unlock(&data_keys_lock);
+         return 0;
+      }
+
+      if (slot == -1 && !data_keys[i].used)
+      {
+         slot = i;
+      }
+   }
+
+   if (slot == -1)
+   {
+      slot = 0;
+   }
+
+   if (pgmoneta_get_master_key(&master_key))
+   {
+      pgmoneta_log_fatal("pgmoneta_get_master_key: Invalid master key");
+      goto error;
+   }
+
+   if (PKCS5_PBKDF2_HMAC(master_key, strlen(master_key), salt, AES_SALT_LENGTH,
+                         AES_KDF_ITERATIONS, EVP_sha256(), length, &data_keys[slot].key[0]) != 1)
+   {
+      pgmoneta_log_error("AES: Could not derive the data key");
+      goto error;
+   }
+
+   data_keys[slot].used = true;
+   data_keys[slot].mode = mode;
+   memcpy(&data_keys[slot].salt[0], salt, AES_SALT_LENGTH);
+   memcpy(key, &data_keys[slot].key[0], length);
+
+   pthread_mutex_unlock(&data_keys_lock);
+
+   OPENSSL_cleanse(master_key, strlen(master_key));
+   free(master_key);
+
+   return 0;
+
+error:
+
+   pthread_mutex_unlock(&data_keys_lock);
+
+   if (master_key != NULL)
+   {
+      OPENSSL_cleanse(master_key, strlen(master_key));
+   }
+   free(master_key);
+
+   return 1;
+}
+
+/**
+ * The chunks use AES-GCM with the key length of the configured mode
+ */
+static const EVP_CIPHER*
+get_chunk_cipher(int mode)
+{
+   if (mode == ENCRYPTION_AES_192_CBC || mode == ENCRYPTION_AES_192_CTR)
+   {
+      return EVP_aes_192_gcm();
+   }
+   if (mode == ENCRYPTION_AES_128_CBC || mode == ENCRYPTION_AES_128_CTR)
+   {
+      return EVP_aes_128_gcm();
+   }
+   return EVP_aes_256_gcm();
+}
+
+// enc: 1 for encrypt, 0 for decrypt
+static int
+encrypt_file(char* from, char* to, int enc, struct workers* workers)
+{
+   unsigned char key[EVP_MAX_KEY_LENGTH];
+   unsigned char iv[EVP_MAX_IV_LENGTH];
+   char* master_key = NULL;
+   EVP_CIPHER_CTX* ctx = NULL;
+   struct aes_file* aes = NULL;
+   struct configuration* config;
+   const EVP_CIPHER* (* cipher_fp)(void) = NULL;
+   int cipher_block_size = 0;
+   int inbuf_size = 0;
+   int outbuf_size = 0;
+   FILE* in = NULL;
+   FILE* out = NULL;
+   int inl = 0;
+   int outl = 0;
+   int f_len = 0;
+   size_t length = 0;
+
+   config = (struct configuration*)shmem;
+   cipher_fp = get_cipher(config->encryption);
+   cipher_block_size = EVP_CIPHER_block_size(cipher_fp());
+   inbuf_size = ENC_BUF_SIZE;
+   outbuf_size = inbuf_size + cipher_block_size - 1;
+   unsigned char* inbuf = NULL;
+   unsigned char* outbuf = NULL;
+
+   memset(&key, 0, sizeof(key));
+   memset(&iv, 0, sizeof(iv));
+
+   inbuf = (unsigned char*)malloc(inbuf_size);
+   outbuf = (unsigned char*)malloc(outbuf_size);
+
+   if (inbuf == NULL || outbuf == NULL)
+   {
+      goto error;
+   }
+
+   in = fopen(from, "rb");
+   if (in == NULL)
+   {
+      pgmoneta_log_error("fopen: Could not open %s", from);
+      goto error;
+   }
+
+   out = fopen(to, "w");
+   if (out == NULL)
+   {
+      pgmoneta_log_error("fopen: Could not open %s", to);
+      goto error;
+   }
+
+   if (enc)
+   {
+      if (pgmoneta_aes_writer_create(out, config->encryption, workers, &aes))
+      {
+         goto error;
+      }
+
+      while ((inl = fread(inbuf, sizeof(char), inbuf_size, in)) > 0)
+      {
+         if (pgmoneta_aes_write(aes, inbuf, (size_t)inl))
+         {
+            goto error;
+         }
+      }
+
+      if (ferror(in))
+      {
+         pgmoneta_log_error("fread: error reading from file: %s", from);
+         goto error;
+      }
+
+      if (pgmoneta_aes_finish(aes))
+      {
+         goto error;
+      }
+   }
+   else if (pgmoneta_aes_is_chunked(in))
+   {
+      if (pgmoneta_aes_reader_create(in, workers, &aes))
+      {
+         goto error;
+      }
+
+      do
+      {
+         if (pgmoneta_aes_read(aes, inbuf, inbuf_size, &length))
+         {
+            goto error;
+         }
+
+         if (length > 0 && fwrite(inbuf, sizeof(char), length, out) != length)
+         {
+            pgmoneta_log_error("fwrite: failed to write plaintext");
+            goto error;
+         }
+      }
+      while (length > 0);
+   }
+   else
+   {
+      /* Files encrypted before the chunked format */
+      if (pgmoneta_get_master_key(&master_key))
+      {
+         pgmoneta_log_fatal("pgmoneta_get_master_key: Invalid master key");
+         goto error;
+      }
+
+      if (derive_key_iv(master_key, key, iv, config->encryption) != 0)
+      {
+         pgmoneta_log_fatal("derive_key_iv: Failed to derive key and iv");
+         goto error;
+      }
+
+      if (!(ctx = get_cipher_context()))
+      {
+         pgmoneta_log_fatal("EVP_CIPHER_CTX_new: Failed to get context");
+         goto error;
+      }
+
+      if (EVP_CipherInit_ex(ctx, cipher_fp(), NULL, key, iv, enc) == 0)
+      {
+         pgmoneta_log_error("EVP_CipherInit_ex: Failed to initialize context");
+         goto error;
+      }
+
+      while ((inl = fread(inbuf, sizeof(char), inbuf_size, in)) > 0)
+      {
+         if (EVP_CipherUpdate(ctx, outbuf, &outl, inbuf, inl) == 0)
+         {
+            pgmoneta_log_error("EVP_CipherUpdate: failed to process block");
+            goto error;
+         }
+         if (fwrite(outbuf, sizeof(char), outl, out) != (size_t)outl)
+         {
+            pgmoneta_log_error("fwrite: failed to write cipher");
+            goto error;
+         }
+      }
+
+      if (ferror(in))
+      {
+         pgmoneta_log_error("fread: error reading from file: %s", from);
+         goto error;
+      }
+
+      if (EVP_CipherFinal_ex(ctx, outbuf, &f_len) == 0)
+      {
+         pgmoneta_log_error("EVP_CipherFinal_ex: failed to process final cipher block");
+         goto error;
+      }
+
+      if (f_len)
+      {
+         if (fwrite(outbuf, sizeof(char), f_len, out) != (size_t)f_len)
+         {
+            pgmoneta_log_error("fwrite: failed to write final block");
+            goto error;
+         }
+      }
+   }
+
+   if (fclose(out))
+   {
+      out = NULL;
+      goto error;
+   }
+
+   pgmoneta_aes_destroy(aes);
+   OPENSSL_cleanse(key, sizeof(key));
+   OPENSSL_cleanse(iv, sizeof(iv));
+   free(master_key);
+   free(inbuf);
+   free(outbuf);
+   fclose(in);
+   return 0;
+
+error:
 
+   pgmoneta_aes_destroy(aes);
+   OPENSSL_cleanse(key, sizeof(key));
+   OPENSSL_cleanse(iv, sizeof(iv));
    free(master_key);
+   free(inbuf);
+   free(outbuf);
 
    if (in != NULL)
    {
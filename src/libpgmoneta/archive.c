@@ -29,6 +29,7 @@
 /* pgmoneta */
 #include <pgmoneta.h>
 #include <achv.h>
+#include <art.h>
 #include <deque.h>
 #include <gzip_compression.h>
 #include <info.h>
@@ -38,18 +39,73 @@
 #include <management.h>
 #include <network.h>
 #include <restore.h>
+#include <stream.h>
+#include <tar_storage.h>
 #include <utils.h>
+#include <workers.h>
 #include <workflow.h>
 #include <zstandard_compression.h>
 
 #include <archive.h>
 #include <archive_entry.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+
+#define ARCHIVE_BATCH_FILES  64
+#define ARCHIVE_BATCH_SIZE   (64 * 1024 * 1024)
+#define ARCHIVE_BUFFER_LIMIT (8 * 1024 * 1024)
+
+/** @struct archive_member
+ * Defines a member of a streamed archive
+ */
+struct archive_member
+{
+   char* path;               /**< The stored file */
+   char* name;               /**< The name in the archive */
+   char link[MAX_PATH];      /**< The link target */
+   unsigned int type;        /**< The file type */
+   int mode;                 /**< The permissions */
+   int64_t size;             /**< The size from the manifest, or -1 */
+   bool decoded;             /**< Has the file been decoded into memory */
+   char* data;               /**< The decoded data */
+   size_t length;            /**< The length of the decoded data */
+};
+
+/** @struct archive_stream
+ * Defines an archive that is streamed from a stored backup
+ */
+struct archive_stream
+{
+   struct archive* archive;                            /**< The tar archive */
+   char* data;                                         /**< The data directory of the backup */
+   char* name;                                         /**< The top directory in the archive */
+   char* label;                                        /**< The server and the identifier */
+   struct art* sizes;                                  /**< The file sizes from the manifest */
+   struct workers* workers;                            /**< The workers */
+   struct archive_member* members[ARCHIVE_BATCH_FILES]; /**< The current batch */
+   int number_of_members;                              /**< The number of members in the batch */
+   size_t batch_size;                                  /**< The size of the files to decode */
+};
 
 static void write_tar_file(struct archive* a, char* current_real_path, char* current_save_path);
 
+static int archive_stored_backup(int server, char* identifier, char* destination, char** tarfile, char** label);
+static la_ssize_t stream_write_cb(struct archive* a, void* client_data, const void* buffer, size_t length);
+static int stream_load_sizes(struct archive_stream* s);
+static int stream_directory(struct archive_stream* s, char* directory, char* name, char* manifest, bool root);
+static int stream_tablespaces(struct archive_stream* s, char* directory, char* name, bool walk);
+static int stream_tar_member(char* path, struct tar_storage_member* member, struct tar_storage_reader* reader, void* data);
+static int stream_add(struct archive_stream* s, char* path, char* name, unsigned int type, int mode, int64_t size, char* link);
+static int stream_flush(struct archive_stream* s);
+static int stream_write_member(struct archive_stream* s, struct archive_member* m);
+static int stream_write_header(struct archive* a, char* name, unsigned int type, int mode, int64_t size, char* link);
+static void stream_decode(void* arg);
+static int stream_read_file(char* path, char** data, size_t* length);
+
 void
 pgmoneta_archive(SSL* ssl, int client_fd, int server, struct json* payload)
 {
@@ -136,13 +192,30 @@ pgmoneta_archive(SSL* ssl, int client_fd, int server, struct json* payload)
       goto error;
    }
 
-   memset(real_directory, 0, sizeof(real_directory));
-   snprintf(real_directory, sizeof(real_directory), "%s/archive-%s-%s", directory, config->servers[server].name, id);
+   if (position == NULL || strlen(position) == 0)
+   {
+      /* Without a recovery position the archive is streamed directly from the stored backup */
+      if (archive_stored_backup(server, id, directory, &filename, &id))
+      {
+         pgmoneta_management_response_error(NULL, client_fd, config->servers[server].name, MANAGEMENT_ERROR_ARCHIVE_ERROR, payload);
+         pgmoneta_log_error("Archive: Unable to archive %s/%s", config->servers[server].name, backup_id);
+         goto error;
+      }
+   }
+   else
+   {
+      memset(real_directory, 0, sizeof(real_directory));
+      snprintf(real_directory, sizeof(real_directory), "%s/archive-%s-%s", directory, config->servers[server].name, id);
 
-   pgmoneta_deque_create(false, &nodes);
+      pgmoneta_deque_create(false, &nodes);
+
+      if (pgmoneta_restore_backup(server, backup_id, position, real_directory, &output, &id))
+      {
+         pgmoneta_management_response_error(NULL, client_fd, config->servers[server].name, MANAGEMENT_ERROR_ARCHIVE_ERROR, payload);
+         pgmoneta_log_error("Archive: Unable to restore %s/%s", config->servers[server].name, backup_id);
+         goto error;
+      }
 
-   if (!pgmoneta_restore_backup(server, backup_id, position, real_directory, &output, &id))
-   {
       if (pgmoneta_deque_add(nodes, "directory", (uintptr_t)real_directory, ValueString))
       {
          goto error;
@@ -195,50 +268,51 @@ pgmoneta_archive(SSL* ssl, int client_fd, int server, struct json* payload)
          current = current->next;
       }
 
-      if (pgmoneta_management_create_response(payload, server, &response))
-      {
-         pgmoneta_management_response_error(NULL, client_fd, config->servers[server].name, MANAGEMENT_ERROR_ALLOCATION, payload);
-
-         goto error;
-      }
-
       filename = pgmoneta_append(filename, (char*)pgmoneta_deque_get(nodes, "tarfile"));
-      if (config->compression_type == COMPRESSION_CLIENT_GZIP || config->compression_type == COMPRESSION_SERVER_GZIP)
-      {
-         filename = pgmoneta_append(filename, ".gz");
-      }
-      else if (config->compression_type == COMPRESSION_CLIENT_ZSTD || config->compression_type == COMPRESSION_SERVER_ZSTD)
-      {
-         filename = pgmoneta_append(filename, ".zstd");
-      }
-      else if (config->compression_type == COMPRESSION_CLIENT_LZ4 || config->compression_type == COMPRESSION_SERVER_LZ4)
-      {
-         filename = pgmoneta_append(filename, ".lz4");
-      }
-      else if (config->compression_type == COMPRESSION_CLIENT_BZIP2)
-      {
-         filename = pgmoneta_append(filename, ".bz2");
-      }
+   }
 
-      pgmoneta_json_put(response, MANAGEMENT_ARGUMENT_SERVER, (uintptr_t)config->servers[server].name, ValueString);
-      pgmoneta_json_put(response, MANAGEMENT_ARGUMENT_BACKUP, (uintptr_t)id, ValueString);
-      pgmoneta_json_put(response, MANAGEMENT_ARGUMENT_FILENAME, (uintptr_t)filename, ValueString);
+   if (pgmoneta_management_create_response(payload, server, &response))
+   {
+      pgmoneta_management_response_error(NULL, client_fd, config->servers[server].name, MANAGEMENT_ERROR_ALLOCATION, payload);
 
-      end_time = time(NULL);
+      goto error;
+   }
 
-      if (pgmoneta_management_response_ok(NULL, client_fd, start_time, end_time, payload))
-      {
-         pgmoneta_management_response_error(NULL, client_fd, config->servers[server].name, MANAGEMENT_ERROR_ARCHIVE_NETWORK, payload);
-         pgmoneta_log_error("Archive: Error sending response for %s/%s", config->servers[server].name, backup_id);
+   if (config->compression_type == COMPRESSION_CLIENT_GZIP || config->compression_type == COMPRESSION_SERVER_GZIP)
+   {
+      filename = pgmoneta_append(filename, ".gz");
+   }
+   else if (config->compression_type == COMPRESSION_CLIENT_ZSTD || config->compression_type == COMPRESSION_SERVER_ZSTD)
+   {
+      filename = pgmoneta_append(filename, ".zstd");
+   }
+   else if (config->compression_type == COMPRESSION_CLIENT_LZ4 || config->compression_type == COMPRESSION_SERVER_LZ4)
+   {
+      filename = pgmoneta_append(filename, ".lz4");
+   }
+   else if (config->compression_type == COMPRESSION_CLIENT_BZIP2)
+   {
+      filename = pgmoneta_append(filename, ".bz2");
+   }
 
-         goto error;
-      }
+   pgmoneta_json_put(response, MANAGEMENT_ARGUMENT_SERVER, (uintptr_t)config->servers[server].name, ValueString);
+   pgmoneta_json_put(response, MANAGEMENT_ARGUMENT_BACKUP, (uintptr_t)id, ValueString);
+   pgmoneta_json_put(response, MANAGEMENT_ARGUMENT_FILENAME, (uintptr_t)filename, ValueString);
+
+   end_time = time(NULL);
 
-      elapsed = pgmoneta_get_timestamp_string(start_time, end_time, &total_seconds);
+   if (pgmoneta_management_response_ok(NULL, client_fd, start_time, end_time, payload))
+   {
+      pgmoneta_management_response_error(NULL, client_fd, config->servers[server].name, MANAGEMENT_ERROR_ARCHIVE_NETWORK, payload);
+      pgmoneta_log_error("Archive: Error sending response for %s/%s", config->servers[server].name, backup_id);
 
-      pgmoneta_log_info("Archive: %s/%s (Elapsed: %s)", config->servers[server].name, id, elapsed);
+      goto error;
    }
 
+   elapsed = pgmoneta_get_timestamp_string(start_time, end_time, &total_seconds);
+
+   pgmoneta_log_info("Archive: %s/%s (Elapsed: %s)", config->servers[server].name, id, elapsed);
+
    for (int i = 0; i < number_of_backups; i++)
    {
       free(backups[i]);
@@ -405,6 +479,153 @@ error:
    return 1;
 }
 
+int
+pgmoneta_archive_stream(int server, char* identifier, char* name, int fd)
+{
+   int number_of_workers = 0;
+   char* tblspc = NULL;
+   char* top = NULL;
+   struct stream_writer* writer = NULL;
+   struct archive_stream s;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   memset(&s, 0, sizeof(struct archive_stream));
+
+   s.data = pgmoneta_get_server_backup_identifier_data(server, identifier);
+
+   s.name = pgmoneta_append(s.name, "./");
+   s.name = pgmoneta_append(s.name, name);
+
+   s.label = pgmoneta_append(s.label, config->servers[server].name);
+   s.label = pgmoneta_append(s.label, "-");
+   s.label = pgmoneta_append(s.label, identifier);
+
+   top = pgmoneta_append(top, s.name);
+   top = pgmoneta_append(top, "/");
+   top = pgmoneta_append(top, s.label);
+
+   tblspc = pgmoneta_append(tblspc, s.data);
+   tblspc = pgmoneta_append(tblspc, "pg_tblspc");
+
+   if (pgmoneta_stream_writer_init_fd(fd, pgmoneta_stream_compression(config->compression_type),
+                                      config->compression_level, config->encryption, &writer))
+   {
+      goto error;
+   }
+
+   s.archive = archive_write_new();
+   archive_write_set_format_ustar(s.archive);
+
+   if (archive_write_open(s.archive, writer, NULL, stream_write_cb, NULL) != ARCHIVE_OK)
+   {
+      pgmoneta_log_error("Archive: Could not open the archive: %s", archive_error_string(s.archive));
+      goto error;
+   }
+
+   if (stream_write_header(s.archive, s.name, AE_IFDIR, 0700, 0, NULL) ||
+       stream_write_header(s.archive, top, AE_IFDIR, 0700, 0, NULL))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_tar_storage_exists(s.data))
+   {
+      /* The members are decompressed in order from the tar files */
+      if (pgmoneta_tar_storage_foreach(s.data, stream_tar_member, &s))
+      {
+         goto error;
+      }
+
+      if (pgmoneta_exists(tblspc) && stream_tablespaces(&s, tblspc, top, false))
+      {
+         goto error;
+      }
+   }
+   else
+   {
+      number_of_workers = pgmoneta_get_number_of_workers(server);
+      if (number_of_workers > 0)
+      {
+         pgmoneta_workers_initialize(number_of_workers, &s.workers);
+      }
+
+      if (stream_load_sizes(&s))
+      {
+         goto error;
+      }
+
+      if (stream_directory(&s, s.data, top, "", true) || stream_flush(&s))
+      {
+         goto error;
+      }
+   }
+
+   if (archive_write_close(s.archive) != ARCHIVE_OK)
+   {
+      pgmoneta_log_error("Archive: Could not close the archive: %s", archive_error_string(s.archive));
+      goto error;
+   }
+
+   archive_write_free(s.archive);
+   s.archive = NULL;
+
+   if (pgmoneta_stream_writer_destroy(writer))
+   {
+      writer = NULL;
+      goto error;
+   }
+
+   if (s.workers != NULL)
+   {
+      pgmoneta_workers_destroy(s.workers);
+   }
+
+   pgmoneta_art_destroy(s.sizes);
+
+   free(s.data);
+   free(s.name);
+   free(s.label);
+   free(top);
+   free(tblspc);
+
+   return 0;
+
+error:
+
+   for (int i = 0; i < s.number_of_members; i++)
+   {
+      free(s.members[i]->path);
+      free(s.members[i]->name);
+      free(s.members[i]->data);
+      free(s.members[i]);
+   }
+
+   if (s.archive != NULL)
+   {
+      archive_write_free(s.archive);
+   }
+
+   pgmoneta_stream_writer_destroy(writer);
+
+   if (s.workers != NULL)
+   {
+      pgmoneta_workers_wait(s.workers);
+      pgmoneta_workers_destroy(s.workers);
+   }
+
+   pgmoneta_art_destroy(s.sizes);
+
+   free(s.data);
+   free(s.name);
+   free(s.label);
+   free(top);
+   free(tblspc);
+
+   return 1;
+}
+
 static void
 write_tar_file(struct archive* a, char* current_real_path, char* current_save_path)
 {
@@ -495,3 +716,866 @@ write_tar_file(struct archive* a, char* current_real_path, char* current_save_pa
 
    closedir(dir);
 }
+
+static int
+archive_stored_backup(int server, char* identifier, char* destination, char** tarfile, char** label)
+{
+   char* root = NULL;
+   char* base = NULL;
+   char* id = NULL;
+   char* name = NULL;
+   char* tar = NULL;
+   char* path = NULL;
+   int fd = -1;
+   int number_of_backups = 0;
+   struct backup** backups = NULL;
+   struct backup* backup = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *tarfile = NULL;
+   *label = NULL;
+
+   root = pgmoneta_get_server_backup(server);
+   base = pgmoneta_get_server_backup_identifier(server, identifier);
+
+   id = identifier;
+
+   if (!pgmoneta_exists(base))
+   {
+      if (pgmoneta_get_backups(root, &number_of_backups, &backups))
+      {
+         goto error;
+      }
+
+      id = NULL;
+
+      for (int i = 0; id == NULL && i < number_of_backups; i++)
+      {
+         if (backups[i]->valid == VALID_TRUE && pgmoneta_starts_with(backups[i]->label, identifier))
+         {
+            id = backups[i]->label;
+         }
+      }
+
+      if (id == NULL)
+      {
+         pgmoneta_log_error("Archive: Unknown identifier for %s/%s", config->servers[server].name, identifier);
+         goto error;
+      }
+   }
+
+   if (pgmoneta_get_backup(root, id, &backup) || backup->valid != VALID_TRUE)
+   {
+      pgmoneta_log_error("Archive: Invalid backup for %s/%s", config->servers[server].name, id);
+      goto error;
+   }
+
+   name = pgmoneta_append(name, "archive-");
+   name = pgmoneta_append(name, config->servers[server].name);
+   name = pgmoneta_append(name, "-");
+   name = pgmoneta_append(name, id);
+
+   tar = pgmoneta_append(tar, destination);
+   tar = pgmoneta_append(tar, "/");
+   tar = pgmoneta_append(tar, name);
+   tar = pgmoneta_append(tar, ".tar");
+
+   path = pgmoneta_append(path, tar);
+   path = pgmoneta_append(path, pgmoneta_stream_compression_suffix(pgmoneta_stream_compression(config->compression_type)));
+   if (config->encryption != ENCRYPTION_NONE)
+   {
+      path = pgmoneta_append(path, ".aes");
+   }
+
+   fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+   if (fd == -1)
+   {
+      pgmoneta_log_error("Archive: Could not create %s: %s", path, strerror(errno));
+      goto error;
+   }
+
+   if (pgmoneta_archive_stream(server, id, name, fd))
+   {
+      pgmoneta_delete_file(path, NULL);
+      goto error;
+   }
+
+   *tarfile = tar;
+   *label = pgmoneta_append(NULL, id);
+
+   for (int i = 0; i < number_of_backups; i++)
+   {
+      free(backups[i]);
+   }
+   free(backups);
+
+   free(backup);
+   free(root);
+   free(base);
+   free(name);
+   free(path);
+
+   return 0;
+
+error:
+
+   for (int i = 0; i < number_of_backups; i++)
+   {
+      free(backups[i]);
+   }
+   free(backups);
+
+   free(backup);
+   free(root);
+   free(base);
+   free(name);
+   free(tar);
+   free(path);
+
+   return 1;
+}
+
+static la_ssize_t
+stream_write_cb(struct archive* a, void* client_data, const void* buffer, size_t length)
+{
+   if (pgmoneta_stream_writer_write((struct stream_writer*)client_data, (void*)buffer, length))
+   {
+      archive_set_error(a, EIO, "Could not write the archive");
+      return -1;
+   }
+
+   return (la_ssize_t)length;
+}
+
+static int
+stream_load_sizes(struct archive_stream* s)
+{
+   char* manifest = NULL;
+   char* stored = NULL;
+   char* data = NULL;
+   size_t length = 0;
+   struct json* j = NULL;
+   struct json* files = NULL;
+   struct json_iterator* iter = NULL;
+
+   if (pgmoneta_art_create(&s->sizes))
+   {
+      goto error;
+   }
+
+   manifest = pgmoneta_append(manifest, s->data);
+   manifest = pgmoneta_append(manifest, "backup_manifest");
+
+   if (pgmoneta_stream_get_stored_file(manifest, &stored))
+   {
+      /* Without the sizes every file is decoded in memory before it is added */
+      pgmoneta_log_warn("Archive: No manifest in %s", s->data);
+      free(manifest);
+      return 0;
+   }
+
+   if (stream_read_file(stored, &data, &length) || pgmoneta_json_parse_string(data, &j))
+   {
+      pgmoneta_log_error("Archive: Could not read %s", stored);
+      goto error;
+   }
+
+   files = (struct json*)pgmoneta_json_get(j, "Files");
+
+   if (files != NULL && !pgmoneta_json_iterator_create(files, &iter))
+   {
+      while (pgmoneta_json_iterator_next(iter))
+      {
+         struct json* file = (struct json*)pgmoneta_value_data(iter->value);
+         char* path = (char*)pgmoneta_json_get(file, "Path");
+
+         if (path != NULL)
+         {
+            pgmoneta_art_insert(s->sizes, (unsigned char*)path, strlen(path) + 1,
+                                pgmoneta_json_get(file, "Size"), ValueInt64);
+         }
+      }
+
+      pgmoneta_json_iterator_destroy(iter);
+   }
+
+   pgmoneta_json_destroy(j);
+
+   free(manifest);
+   free(stored);
+   free(data);
+
+   return 0;
+
+error:
+
+   pgmoneta_json_destroy(j);
+
+   free(manifest);
+   free(stored);
+   free(data);
+
+   return 1;
+}
+
+static int
+stream_directory(struct archive_stream* s, char* directory, char* name, char* manifest, bool root)
+{
+   DIR* dir = NULL;
+   char* path = NULL;
+   char* stored = NULL;
+   char* member = NULL;
+   char* key = NULL;
+   struct dirent* entry = NULL;
+   struct stat st;
+
+   dir = opendir(directory);
+
+   if (dir == NULL)
+   {
+      pgmoneta_log_error("Archive: Could not open directory %s", directory);
+      goto error;
+   }
+
+   while ((entry = readdir(dir)) != NULL)
+   {
+      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      {
+         continue;
+      }
+
+      path = pgmoneta_append(path, directory);
+      if (!pgmoneta_ends_with(path, "/"))
+      {
+         path = pgmoneta_append(path, "/");
+      }
+      path = pgmoneta_append(path, entry->d_name);
+
+      stored = pgmoneta_stream_plain_name(entry->d_name);
+
+      member = pgmoneta_append(member, name);
+      member = pgmoneta_append(member, "/");
+      member = pgmoneta_append(member, stored);
+
+      key = pgmoneta_append(key, manifest);
+      key = pgmoneta_append(key, stored);
+
+      if (lstat(path, &st))
+      {
+         pgmoneta_log_error("Archive: Could not stat %s", path);
+         goto error;
+      }
+
+      if (S_ISDIR(st.st_mode))
+      {
+         if (stream_add(s, NULL, member, AE_IFDIR, st.st_mode & 07777, 0, NULL))
+         {
+            goto error;
+         }
+
+         if (root && !strcmp(entry->d_name, "pg_tblspc"))
+         {
+            if (stream_tablespaces(s, path, name, true))
+            {
+               goto error;
+            }
+         }
+         else
+         {
+            key = pgmoneta_append(key, "/");
+
+            if (stream_directory(s, path, member, key, false))
+            {
+               goto error;
+            }
+         }
+      }
+      else if (S_ISLNK(st.st_mode))
+      {
+         char target[MAX_PATH];
+
+         memset(&target[0], 0, sizeof(target));
+
+         if (readlink(path, &target[0], sizeof(target) - 1) == -1)
+         {
+            pgmoneta_log_error("Archive: Could not read link %s", path);
+            goto error;
+         }
+
+         if (stream_add(s, NULL, member, AE_IFLNK, st.st_mode & 07777, 0, &target[0]))
+         {
+            goto error;
+         }
+      }
+      else if (S_ISREG(st.st_mode))
+      {
+         int64_t size = -1;
+
+         if (pgmoneta_art_contains_key(s->sizes, (unsigned char*)key, strlen(key) + 1))
+         {
+            size = (int64_t)pgmoneta_art_search(s->sizes, (unsigned char*)key, strlen(key) + 1);
+         }
+
+         if (stream_add(s, path, member, AE_IFREG, st.st_mode & 07777, size, NULL))
+         {
+            goto error;
+         }
+      }
+
+      free(path);
+      free(stored);
+      free(member);
+      free(key);
+
+      path = NULL;
+      stored = NULL;
+      member = NULL;
+      key = NULL;
+   }
+
+   closedir(dir);
+
+   return 0;
+
+error:
+
+   if (dir != NULL)
+   {
+      closedir(dir);
+   }
+
+   free(path);
+   free(stored);
+   free(member);
+   free(key);
+
+   return 1;
+}
+
+static int
+stream_tablespaces(struct archive_stream* s, char* directory, char* name, bool walk)
+{
+   DIR* dir = NULL;
+   char* path = NULL;
+   char* link = NULL;
+   char* member = NULL;
+   char* tblspc = NULL;
+   char* manifest = NULL;
+   struct dirent* entry = NULL;
+
+   dir = opendir(directory);
+
+   if (dir == NULL)
+   {
+      pgmoneta_log_error("Archive: Could not open directory %s", directory);
+      goto error;
+   }
+
+   while ((entry = readdir(dir)) != NULL)
+   {
+      char target[MAX_PATH];
+      char* tblspc_name = NULL;
+
+      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      {
+         continue;
+      }
+
+      path = pgmoneta_append(path, directory);
+      if (!pgmoneta_ends_with(path, "/"))
+      {
+         path = pgmoneta_append(path, "/");
+      }
+      path = pgmoneta_append(path, entry->d_name);
+
+      memset(&target[0], 0, sizeof(target));
+
+      if (readlink(path, &target[0], sizeof(target) - 1) == -1)
+      {
+         pgmoneta_log_error("Archive: Could not read link %s", path);
+         goto error;
+      }
+
+      if (pgmoneta_ends_with(&target[0], "/"))
+      {
+         target[strlen(&target[0]) - 1] = '\0';
+      }
+
+      tblspc_name = strrchr(&target[0], '/') != NULL ? strrchr(&target[0], '/') + 1 : &target[0];
+
+      /* The same relative link as a restore creates */
+      link = pgmoneta_append(link, "../../");
+      link = pgmoneta_append(link, s->label);
+      link = pgmoneta_append(link, "-");
+      link = pgmoneta_append(link, tblspc_name);
+      link = pgmoneta_append(link, "/");
+
+      member = pgmoneta_append(member, name);
+      member = pgmoneta_append(member, "/pg_tblspc/");
+      member = pgmoneta_append(member, entry->d_name);
+
+      if (stream_add(s, NULL, member, AE_IFLNK, 0777, 0, link))
+      {
+         goto error;
+      }
+
+      if (walk)
+      {
+         tblspc = pgmoneta_append(tblspc, s->name);
+         tblspc = pgmoneta_append(tblspc, "/");
+         tblspc = pgmoneta_append(tblspc, s->label);
+         tblspc = pgmoneta_append(tblspc, "-");
+         tblspc = pgmoneta_append(tblspc, tblspc_name);
+
+         manifest = pgmoneta_append(manifest, "pg_tblspc/");
+         manifest = pgmoneta_append(manifest, entry->d_name);
+         manifest = pgmoneta_append(manifest, "/");
+
+         if (stream_add(s, NULL, tblspc, AE_IFDIR, 0700, 0, NULL) ||
+             stream_directory(s, path, tblspc, manifest, false))
+         {
+            goto error;
+         }
+      }
+
+      free(path);
+      free(link);
+      free(member);
+      free(tblspc);
+      free(manifest);
+
+      path = NULL;
+      link = NULL;
+      member = NULL;
+      tblspc = NULL;
+      manifest = NULL;
+   }
+
+   closedir(dir);
+
+   return 0;
+
+error:
+
+   if (dir != NULL)
+   {
+      closedir(dir);
+   }
+
+   free(path);
+   free(link);
+   free(member);
+   free(tblspc);
+   free(manifest);
+
+   return 1;
+}
+
+static int
+stream_tar_member(char* path, struct tar_storage_member* member, struct tar_storage_reader* reader, void* data)
+{
+   char buffer[DEFAULT_BUFFER_SIZE];
+   char* name = NULL;
+   size_t length = 0;
+   uint64_t total = 0;
+   unsigned int type = 0;
+   struct archive_stream* s = NULL;
+
+   s = (struct archive_stream*)data;
+
+   if (member->type == '0' || member->type == '7')
+   {
+      type = AE_IFREG;
+   }
+   else if (member->type == '5')
+   {
+      type = AE_IFDIR;
+   }
+   else if (member->type == '2')
+   {
+      type = AE_IFLNK;
+   }
+   else
+   {
+      return 0;
+   }
+
+   if (pgmoneta_starts_with(path, "pg_tblspc/"))
+   {
+      char link[MAX_PATH];
+      char target[MAX_PATH];
+      char* oid = path + strlen("pg_tblspc/");
+      char* slash = strchr(oid, '/');
+      char* tblspc_name = NULL;
+
+      /* The links to the tablespaces are added afterwards */
+      if (slash == NULL || *(slash + 1) == '\0')
+      {
+         return 0;
+      }
+
+      memset(&link[0], 0, sizeof(link));
+      memset(&target[0], 0, sizeof(target));
+
+      snprintf(&link[0], sizeof(link), "%spg_tblspc/%.*s", s->data, (int)(slash - oid), oid);
+
+      if (readlink(&link[0], &target[0], sizeof(target) - 1) == -1)
+      {
+         pgmoneta_log_error("Archive: Could not read link %s", &link[0]);
+         goto error;
+      }
+
+      if (pgmoneta_ends_with(&target[0], "/"))
+      {
+         target[strlen(&target[0]) - 1] = '\0';
+      }
+
+      tblspc_name = strrchr(&target[0], '/') != NULL ? strrchr(&target[0], '/') + 1 : &target[0];
+
+      name = pgmoneta_append(name, s->name);
+      name = pgmoneta_append(name, "/");
+      name = pgmoneta_append(name, s->label);
+      name = pgmoneta_append(name, "-");
+      name = pgmoneta_append(name, tblspc_name);
+      name = pgmoneta_append(name, slash);
+   }
+   else
+   {
+      name = pgmoneta_append(name, s->name);
+      name = pgmoneta_append(name, "/");
+      name = pgmoneta_append(name, s->label);
+      name = pgmoneta_append(name, "/");
+      name = pgmoneta_append(name, path);
+   }
+
+   if (stream_write_header(s->archive, name, type, member->mode & 07777, (int64_t)member->size, member->link))
+   {
+      goto error;
+   }
+
+   if (type == AE_IFREG)
+   {
+      do
+      {
+         if (pgmoneta_tar_storage_reader_read(reader, &buffer[0], sizeof(buffer), &length))
+         {
+            goto error;
+         }
+
+         if (length > 0 && archive_write_data(s->archive, &buffer[0], length) < 0)
+         {
+            pgmoneta_log_error("Archive: Could not write %s: %s", name, archive_error_string(s->archive));
+            goto error;
+         }
+
+         total += length;
+      }
+      while (length > 0);
+
+      if (total != member->size)
+      {
+         pgmoneta_log_error("Archive: Expected %" PRIu64 " bytes for %s, got %" PRIu64, member->size, path, total);
+         goto error;
+      }
+   }
+
+   free(name);
+
+   return 0;
+
+error:
+
+   free(name);
+
+   return 1;
+}
+
+static int
+stream_add(struct archive_stream* s, char* path, char* name, unsigned int type, int mode, int64_t size, char* link)
+{
+   struct archive_member* m = NULL;
+
+   m = (struct archive_member*)malloc(sizeof(struct archive_member));
+
+   if (m == NULL)
+   {
+      return 1;
+   }
+
+   memset(m, 0, sizeof(struct archive_member));
+
+   if (path != NULL)
+   {
+      m->path = pgmoneta_append(m->path, path);
+   }
+   m->name = pgmoneta_append(m->name, name);
+   if (link != NULL)
+   {
+      snprintf(&m->link[0], sizeof(m->link), "%s", link);
+   }
+   m->type = type;
+   m->mode = mode;
+   m->size = size;
+
+   s->members[s->number_of_members++] = m;
+
+   if (type == AE_IFREG && size <= ARCHIVE_BUFFER_LIMIT)
+   {
+      s->batch_size += size > 0 ? (size_t)size : 0;
+   }
+
+   if (s->number_of_members == ARCHIVE_BATCH_FILES || s->batch_size >= ARCHIVE_BATCH_SIZE)
+   {
+      return stream_flush(s);
+   }
+
+   return 0;
+}
+
+static int
+stream_flush(struct archive_stream* s)
+{
+   int ret = 0;
+
+   /* The small files are decompressed in parallel, and added in order */
+   for (int i = 0; i < s->number_of_members; i++)
+   {
+      struct archive_member* m = s->members[i];
+
+      if (m->type == AE_IFREG && m->size <= ARCHIVE_BUFFER_LIMIT)
+      {
+         if (s->workers != NULL)
+         {
+            pgmoneta_workers_add(s->workers, stream_decode, (void*)m);
+         }
+         else
+         {
+            stream_decode((void*)m);
+         }
+      }
+   }
+
+   if (s->workers != NULL)
+   {
+      pgmoneta_workers_wait(s->workers);
+   }
+
+   for (int i = 0; i < s->number_of_members; i++)
+   {
+      struct archive_member* m = s->members[i];
+
+      if (ret == 0 && stream_write_member(s, m))
+      {
+         ret = 1;
+      }
+
+      free(m->path);
+      free(m->name);
+      free(m->data);
+      free(m);
+
+      s->members[i] = NULL;
+   }
+
+   s->number_of_members = 0;
+   s->batch_size = 0;
+
+   return ret;
+}
+
+static int
+stream_write_member(struct archive_stream* s, struct archive_member* m)
+{
+   char buffer[DEFAULT_BUFFER_SIZE];
+   size_t length = 0;
+   int64_t total = 0;
+   struct stream_reader* reader = NULL;
+
+   if (m->type != AE_IFREG)
+   {
+      return stream_write_header(s->archive, m->name, m->type, m->mode, 0, m->link);
+   }
+
+   if (m->decoded)
+   {
+      if (stream_write_header(s->archive, m->name, m->type, m->mode, (int64_t)m->length, NULL))
+      {
+         goto error;
+      }
+
+      if (m->length > 0 && archive_write_data(s->archive, m->data, m->length) < 0)
+      {
+         pgmoneta_log_error("Archive: Could not write %s: %s", m->name, archive_error_string(s->archive));
+         goto error;
+      }
+
+      return 0;
+   }
+
+   if (m->size <= ARCHIVE_BUFFER_LIMIT)
+   {
+      pgmoneta_log_error("Archive: Could not read %s", m->path);
+      goto error;
+   }
+
+   /* Large files are streamed, so the size comes from the manifest */
+   if (stream_write_header(s->archive, m->name, m->type, m->mode, m->size, NULL))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_stream_reader_init(m->path, &reader))
+   {
+      goto error;
+   }
+
+   do
+   {
+      if (pgmoneta_stream_reader_read(reader, &buffer[0], sizeof(buffer), &length))
+      {
+         goto error;
+      }
+
+      if (total + (int64_t)length > m->size)
+      {
+         break;
+      }
+
+      if (length > 0 && archive_write_data(s->archive, &buffer[0], length) < 0)
+      {
+         pgmoneta_log_error("Archive: Could not write %s: %s", m->name, archive_error_string(s->archive));
+         goto error;
+      }
+
+      total += length;
+   }
+   while (length > 0);
+
+   if (total != m->size || length > 0)
+   {
+      pgmoneta_log_error("Archive: %s doesn't match the size in the manifest", m->path);
+      goto error;
+   }
+
+   pgmoneta_stream_reader_destroy(reader);
+
+   return 0;
+
+error:
+
+   pgmoneta_stream_reader_destroy(reader);
+
+   return 1;
+}
+
+static int
+stream_write_header(struct archive* a, char* name, unsigned int type, int mode, int64_t size, char* link)
+{
+   struct archive_entry* entry = NULL;
+
+   entry = archive_entry_new();
+
+   archive_entry_copy_pathname(entry, name);
+   archive_entry_set_filetype(entry, type);
+   archive_entry_set_perm(entry, mode);
+
+   if (type == AE_IFREG)
+   {
+      archive_entry_set_size(entry, size);
+   }
+   else if (type == AE_IFLNK)
+   {
+      archive_entry_set_symlink(entry, link);
+   }
+
+   if (archive_write_header(a, entry) != ARCHIVE_OK)
+   {
+      pgmoneta_log_error("Archive: Could not write header for %s: %s", name, archive_error_string(a));
+      archive_entry_free(entry);
+      return 1;
+   }
+
+   archive_entry_free(entry);
+
+   return 0;
+}
+
+static void
+stream_decode(void* arg)
+{
+   struct archive_member* m = (struct archive_member*)arg;
+
+   if (!stream_read_file(m->path, &m->data, &m->length))
+   {
+      m->decoded = true;
+   }
+}
+
+static int
+stream_read_file(char* path, char** data, size_t* length)
+{
+   char* d = NULL;
+   size_t capacity = DEFAULT_BUFFER_SIZE;
+   size_t l = 0;
+   size_t n = 0;
+   struct stream_reader* reader = NULL;
+
+   *data = NULL;
+   *length = 0;
+
+   if (pgmoneta_stream_reader_init(path, &reader))
+   {
+      goto error;
+   }
+
+   d = (char*)malloc(capacity);
+
+   if (d == NULL)
+   {
+      goto error;
+   }
+
+   do
+   {
+      if (l + 1 == capacity)
+      {
+         char* tmp = (char*)realloc(d, capacity * 2);
+
+         if (tmp == NULL)
+         {
+            goto error;
+         }
+
+         d = tmp;
+         capacity *= 2;
+      }
+
+      if (pgmoneta_stream_reader_read(reader, d + l, capacity - l - 1, &n))
+      {
+         goto error;
+      }
+
+      l += n;
+   }
+   while (n > 0);
+
+   d[l] = '\0';
+
+   pgmoneta_stream_reader_destroy(reader);
+
+   *data = d;
+   *length = l;
+
+   return 0;
+
+error:
+
+   pgmoneta_stream_reader_destroy(reader);
+
+   free(d);
+
+   return 1;
+}
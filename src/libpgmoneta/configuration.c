@@ -63,6 +63,8 @@ static int as_logging_mode(char* str);
 static int as_hugepage(char* str);
 static int as_compression(char* str);
 static int as_storage_engine(char* str);
+static int as_storage_format(char* str);
+static int as_deduplication(char* str);
 static char* as_ciphers(char* str);
 static int as_encryption_mode(char* str);
 static unsigned int as_update_process_title(char* str, unsigned int default_policy);
@@ -103,6 +105,17 @@ pgmoneta_init_configuration(void* shm)
    config->encryption = ENCRYPTION_NONE;
 
    config->storage_engine = STORAGE_ENGINE_LOCAL;
+   config->storage_format = STORAGE_FORMAT_DIRECTORY;
+
+   config->deduplication = DEDUPLICATION_OFF;
+   config->deduplication_chunk_size = DEDUPLICATION_DEFAULT_CHUNK_SIZE;
+   config->global_deduplication = false;
+   config->verify_wal = false;
+   config->wal_time_index = false;
+   config->wal_summary = false;
+   config->wal_stats = false;
+   config->wal_tap = false;
+   config->wal_index = false;
 
    config->workers = 0;
 
@@ -224,6 +237,14 @@ pgmoneta_read_configuration(void* shm, char* filename)
                   atomic_init(&srv.failed_operation_count, 0);
                   atomic_init(&srv.last_operation_time, 0);
                   atomic_init(&srv.last_failed_operation_time, 0);
+                  atomic_init(&srv.wal_verified_segments, 0);
+                  atomic_init(&srv.wal_corrupt_segments, 0);
+                  atomic_init(&srv.wal_decoded_records, 0);
+                  atomic_init(&srv.wal_decoded_bytes, 0);
+                  atomic_init(&srv.wal_decoded_fpi_bytes, 0);
+                  atomic_init(&srv.wal_decode_errors, 0);
+                  atomic_init(&srv.wal_last_commit_time, 0);
+                  atomic_init(&srv.wal_missing_segments, 0);
                   memset(srv.wal_shipping, 0, MAX_PATH);
                   srv.workers = -1;
                   srv.backup_max_rate = -1;
@@ -953,6 +974,56 @@ pgmoneta_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "storage_format"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     config->storage_format = as_storage_format(value);
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "deduplication"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     config->deduplication = as_deduplication(value);
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "deduplication_chunk_size"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     if (as_bytes(value, &config->deduplication_chunk_size, DEDUPLICATION_DEFAULT_CHUNK_SIZE))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "global_deduplication"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     if (as_bool(value, &config->global_deduplication))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "ssh_hostname"))
                {
                   if (!strcmp(section, "pgmoneta"))
@@ -1101,6 +1172,22 @@ pgmoneta_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "s3_endpoint"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     max = strlen(value);
+                     if (max > MAX_PATH - 1)
+                     {
+                        max = MAX_PATH - 1;
+                     }
+                     memcpy(config->s3_endpoint, value, max);
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "azure_storage_account"))
                {
                   if (!strcmp(section, "pgmoneta"))
@@ -1165,6 +1252,22 @@ pgmoneta_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "azure_endpoint"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     max = strlen(value);
+                     if (max > MAX_PATH - 1)
+                     {
+                        max = MAX_PATH - 1;
+                     }
+                     memcpy(config->azure_endpoint, value, max);
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "retention"))
                {
                   if (!strcmp(section, "pgmoneta"))
@@ -1211,6 +1314,90 @@ pgmoneta_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "verify_wal"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     if (as_bool(value, &config->verify_wal))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "wal_time_index"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     if (as_bool(value, &config->wal_time_index))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "wal_summary"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     if (as_bool(value, &config->wal_summary))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "wal_stats"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     if (as_bool(value, &config->wal_stats))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "wal_tap"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     if (as_bool(value, &config->wal_tap))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "wal_index"))
+               {
+                  if (!strcmp(section, "pgmoneta"))
+                  {
+                     if (as_bool(value, &config->wal_index))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "backup_max_rate"))
                {
                   if (!strcmp(section, "pgmoneta"))
@@ -1438,6 +1625,26 @@ pgmoneta_validate_configuration(void* shm)
       config->backlog = 16;
    }
 
+   if (config->deduplication != DEDUPLICATION_OFF)
+   {
+      if (config->deduplication_chunk_size < 8192 || config->deduplication_chunk_size > 8 * 1024 * 1024 ||
+          config->deduplication_chunk_size % 8192 != 0)
+      {
+         pgmoneta_log_fatal("deduplication_chunk_size must be a multiple of 8kB between 8kB and 8MB");
+         return 1;
+      }
+
+      if (config->storage_format != STORAGE_FORMAT_DIRECTORY || config->storage_engine != STORAGE_ENGINE_LOCAL)
+      {
+         pgmoneta_log_warn("deduplication is only used with storage_format = directory and storage_engine = local");
+      }
+   }
+
+   if (config->global_deduplication && (config->storage_format != STORAGE_FORMAT_DIRECTORY || config->storage_engine != STORAGE_ENGINE_LOCAL))
+   {
+      pgmoneta_log_warn("global_deduplication is only used with storage_format = directory and storage_engine = local");
+   }
+
    if (config->number_of_servers <= 0)
    {
       pgmoneta_log_fatal("No servers defined");
@@ -1508,6 +1715,12 @@ pgmoneta_validate_configuration(void* shm)
          return 1;
       }
 
+      if (config->global_deduplication && !strcmp(config->servers[i].name, "global"))
+      {
+         pgmoneta_log_fatal("global is a reserved word for a host when global_deduplication is enabled");
+         return 1;
+      }
+
       if (strlen(config->servers[i].host) == 0)
       {
          pgmoneta_log_fatal("No host defined for %s", config->servers[i].name);
@@ -1958,6 +2171,10 @@ pgmoneta_reload_configuration(bool* restart)
 
    pgmoneta_init_configuration((void*)reload);
 
+   /* The master key may have been rotated, so the processes forked from now on read it again */
+   pgmoneta_reset_master_key();
+   pgmoneta_aes_reset_keys();
+
    if (pgmoneta_read_configuration((void*)reload, config->configuration_path))
    {
       goto error;
@@ -2627,6 +2844,32 @@ as_storage_engine(char* str)
    return STORAGE_ENGINE_TYPES;
 }
 
+static int
+as_storage_format(char* str)
+{
+   if (!strcasecmp(str, "tar"))
+   {
+      return STORAGE_FORMAT_TAR;
+   }
+
+   return STORAGE_FORMAT_DIRECTORY;
+}
+
+static int
+as_deduplication(char* str)
+{
+   if (!strcasecmp(str, "page") || !strcasecmp(str, "on"))
+   {
+      return DEDUPLICATION_PAGE;
+   }
+   else if (!strcasecmp(str, "content"))
+   {
+      return DEDUPLICATION_CONTENT;
+   }
+
+   return DEDUPLICATION_OFF;
+}
+
 static char*
 as_ciphers(char* str)
 {
@@ -3060,6 +3303,16 @@ transfer_configuration(struct configuration* config, struct configuration* reloa
    config->create_slot = reload->create_slot;
    config->compression_type = reload->compression_type;
    config->compression_level = reload->compression_level;
+   config->storage_format = reload->storage_format;
+   config->deduplication = reload->deduplication;
+   config->deduplication_chunk_size = reload->deduplication_chunk_size;
+   config->global_deduplication = reload->global_deduplication;
+   config->verify_wal = reload->verify_wal;
+   config->wal_time_index = reload->wal_time_index;
+   config->wal_summary = reload->wal_summary;
+   config->wal_stats = reload->wal_stats;
+   config->wal_tap = reload->wal_tap;
+   config->wal_index = reload->wal_index;
    config->retention_days = reload->retention_days;
    config->retention_weeks = reload->retention_weeks;
    config->retention_months = reload->retention_months;
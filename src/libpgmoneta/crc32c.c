@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is compiled with -msse4.2 or -march=armv8-a+crc, so only code
+ * that is called after pgmoneta_crc32c_hardware_available() belongs here
+ */
+
+/* pgmoneta */
+#include <crc32c.h>
+
+/* system */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(HAVE_SSE42)
+#include <nmmintrin.h>
+#elif defined(HAVE_ARMV8_CRC32C)
+#include <arm_acle.h>
+#if defined(HAVE_LINUX)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+bool
+pgmoneta_crc32c_hardware_available(void)
+{
+#if defined(HAVE_SSE42)
+   __builtin_cpu_init();
+   return __builtin_cpu_supports("sse4.2");
+#elif defined(HAVE_ARMV8_CRC32C)
+#if defined(HAVE_LINUX) && defined(HWCAP_CRC32)
+   return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#elif defined(__APPLE__)
+   return true;
+#else
+   return false;
+#endif
+#else
+   return false;
+#endif
+}
+
+uint32_t
+pgmoneta_crc32c_hardware(uint32_t crc, const void* buffer, size_t size)
+{
+   const unsigned char* p = (const unsigned char*)buffer;
+
+#if defined(HAVE_SSE42)
+#if defined(__x86_64__)
+   uint64_t crc64 = crc;
+   uint64_t word;
+
+   while (size > 0 && ((uintptr_t)p & 7) != 0)
+   {
+      crc64 = _mm_crc32_u8((uint32_t)crc64, *p++);
+      size--;
+   }
+
+   while (size >= 8)
+   {
+      memcpy(&word, p, 8);
+      crc64 = _mm_crc32_u64(crc64, word);
+      p += 8;
+      size -= 8;
+   }
+
+   crc = (uint32_t)crc64;
+#else
+   uint32_t word;
+
+   while (size >= 4)
+   {
+      memcpy(&word, p, 4);
+      crc = _mm_crc32_u32(crc, word);
+      p += 4;
+      size -= 4;
+   }
+#endif
+
+   while (size > 0)
+   {
+      crc = _mm_crc32_u8(crc, *p++);
+      size--;
+   }
+#elif defined(HAVE_ARMV8_CRC32C)
+   uint64_t word;
+
+   while (size > 0 && ((uintptr_t)p & 7) != 0)
+   {
+      crc = __crc32cb(crc, *p++);
+      size--;
+   }
+
+   while (size >= 8)
+   {
+      memcpy(&word, p, 8);
+      crc = __crc32cd(crc, word);
+      p += 8;
+      size -= 8;
+   }
+
+   while (size > 0)
+   {
+      crc = __crc32cb(crc, *p++);
+      size--;
+   }
+#else
+   (void)p;
+   (void)size;
+#endif
+
+   return crc;
+}
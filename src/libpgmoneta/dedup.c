@@ -0,0 +1,1217 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <art.h>
+#include <dedup.h>
+#include <logging.h>
+#include <stream.h>
+#include <utils.h>
+#include <workers.h>
+
+/* system */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <openssl/evp.h>
+
+#define DEDUP_HEADER_LENGTH (DEDUP_MAGIC_LENGTH + 4 + 4 + 8 + 8 + 2)
+#define DEDUP_ENTRY_LENGTH  (DEDUP_HASH_LENGTH + 4)
+
+/** @struct dedup_input
+ * Defines the input of the deduplication of a file
+ */
+struct dedup_input
+{
+   char* path;                              /**< The file */
+   char* store;                             /**< The chunk store */
+   char* store_name;                        /**< The chunk store, relative to base_dir */
+   struct dedup_statistics* statistics;     /**< The statistics */
+};
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static int dedup_walk(char* directory, char* store, char* store_name, struct dedup_statistics* statistics, struct workers* workers);
+static void dedup_file(void* arg);
+static size_t find_boundary(unsigned char* data, size_t length, bool eof, int algorithm, size_t chunk_size);
+static int store_chunk(char* store, unsigned char* hash, unsigned char* data, size_t length, bool* created);
+static char* chunk_base(char* store, unsigned char* hash);
+static void hash_to_hex(unsigned char* hash, char* hex);
+static int write_map(char* path, struct dedup_map* map, mode_t mode);
+static int collect_store(char* store, int server);
+static int collect_maps(char* directory, struct art* referenced);
+static int collect_chunks(char* store, struct art* referenced, time_t start, uint64_t* deleted, uint64_t* bytes);
+static int lock_store(char* store, int operation);
+static void unlock_store(int fd);
+static void gear_initialize(void);
+
+int
+pgmoneta_dedup_directory(int server, char* directory, struct dedup_statistics* statistics, struct workers* workers)
+{
+   char* store = NULL;
+   char* store_name = NULL;
+   int lock = -1;
+   int ret = 0;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (config->global_deduplication)
+   {
+      store = pgmoneta_get_global();
+      store = pgmoneta_append(store, "chunks");
+
+      store_name = pgmoneta_append(store_name, "global/chunks");
+   }
+   else
+   {
+      store = pgmoneta_get_server(server);
+      store = pgmoneta_append(store, "chunks");
+
+      store_name = pgmoneta_append(store_name, config->servers[server].name);
+      store_name = pgmoneta_append(store_name, "/chunks");
+   }
+
+   if (pgmoneta_mkdir(store))
+   {
+      pgmoneta_log_error("Deduplication: Could not create %s", store);
+      goto error;
+   }
+
+   /* The chunks aren't collected until the maps of the backup refer to them */
+   lock = lock_store(store, LOCK_SH);
+   if (lock == -1)
+   {
+      pgmoneta_log_error("Deduplication: Could not lock %s", store);
+      goto error;
+   }
+
+   ret = dedup_walk(directory, store, store_name, statistics, workers);
+
+   if (workers != NULL)
+   {
+      pgmoneta_workers_wait(workers);
+   }
+
+   unlock_store(lock);
+
+   free(store);
+   free(store_name);
+
+   return ret;
+
+error:
+
+   unlock_store(lock);
+
+   free(store);
+   free(store_name);
+
+   return 1;
+}
+
+int
+pgmoneta_dedup_read_map(char* path, struct dedup_map** map)
+{
+   size_t size = 0;
+   size_t capacity = 0;
+   size_t length = 0;
+   size_t position = 0;
+   uint16_t store_length = 0;
+   uint64_t offset = 0;
+   unsigned char* data = NULL;
+   struct dedup_map* m = NULL;
+   struct stream_reader* reader = NULL;
+
+   *map = NULL;
+
+   if (pgmoneta_stream_reader_init_raw(path, &reader))
+   {
+      goto error;
+   }
+
+   do
+   {
+      if (size + 65536 > capacity)
+      {
+         unsigned char* d = NULL;
+
+         capacity = capacity == 0 ? 65536 * 2 : capacity * 2;
+         d = (unsigned char*)realloc(data, capacity);
+
+         if (d == NULL)
+         {
+            goto error;
+         }
+
+         data = d;
+      }
+
+      if (pgmoneta_stream_reader_read(reader, data + size, capacity - size, &length))
+      {
+         goto error;
+      }
+
+      size += length;
+   }
+   while (length > 0);
+
+   if (size < DEDUP_HEADER_LENGTH || memcmp(data, DEDUP_MAGIC, DEDUP_MAGIC_LENGTH))
+   {
+      pgmoneta_log_error("Deduplication: Invalid chunk map %s", path);
+      goto error;
+   }
+
+   m = (struct dedup_map*)malloc(sizeof(struct dedup_map));
+
+   if (m == NULL)
+   {
+      goto error;
+   }
+
+   memset(m, 0, sizeof(struct dedup_map));
+
+   position = DEDUP_MAGIC_LENGTH;
+   m->algorithm = (int)pgmoneta_read_uint32(data + position);
+   position += 4;
+   m->chunk_size = pgmoneta_read_uint32(data + position);
+   position += 4;
+   m->size = pgmoneta_read_uint64(data + position);
+   position += 8;
+   m->number_of_chunks = pgmoneta_read_uint64(data + position);
+   position += 8;
+   store_length = pgmoneta_read_uint16(data + position);
+   position += 2;
+
+   if (size != position + store_length + m->number_of_chunks * DEDUP_ENTRY_LENGTH)
+   {
+      pgmoneta_log_error("Deduplication: Truncated chunk map %s", path);
+      goto error;
+   }
+
+   m->store = (char*)malloc(store_length + 1);
+   m->chunks = (struct dedup_chunk*)malloc(MAX(m->number_of_chunks, 1) * sizeof(struct dedup_chunk));
+
+   if (m->store == NULL || m->chunks == NULL)
+   {
+      goto error;
+   }
+
+   memcpy(m->store, data + position, store_length);
+   m->store[store_length] = '\0';
+   position += store_length;
+
+   for (uint64_t i = 0; i < m->number_of_chunks; i++)
+   {
+      memcpy(&m->chunks[i].hash[0], data + position, DEDUP_HASH_LENGTH);
+      m->chunks[i].length = pgmoneta_read_uint32(data + position + DEDUP_HASH_LENGTH);
+      m->chunks[i].offset = offset;
+
+      offset += m->chunks[i].length;
+      position += DEDUP_ENTRY_LENGTH;
+   }
+
+   if (offset != m->size)
+   {
+      pgmoneta_log_error("Deduplication: Invalid chunk map %s", path);
+      goto error;
+   }
+
+   pgmoneta_stream_reader_destroy(reader);
+   free(data);
+
+   *map = m;
+
+   return 0;
+
+error:
+
+   pgmoneta_stream_reader_destroy(reader);
+   pgmoneta_dedup_map_destroy(m);
+   free(data);
+
+   return 1;
+}
+
+void
+pgmoneta_dedup_map_destroy(struct dedup_map* map)
+{
+   if (map == NULL)
+   {
+      return;
+   }
+
+   free(map->store);
+   free(map->chunks);
+   free(map);
+}
+
+int
+pgmoneta_dedup_get_chunk(struct dedup_map* map, struct dedup_chunk* chunk, char** stored)
+{
+   char* store = NULL;
+   char* base = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *stored = NULL;
+
+   store = pgmoneta_append(store, config->base_dir);
+   if (!pgmoneta_ends_with(store, "/"))
+   {
+      store = pgmoneta_append(store, "/");
+   }
+   store = pgmoneta_append(store, map->store);
+
+   base = chunk_base(store, &chunk->hash[0]);
+
+   if (base == NULL || pgmoneta_stream_get_stored_file(base, stored))
+   {
+      pgmoneta_log_error("Deduplication: Missing chunk %s", base != NULL ? base : "");
+      goto error;
+   }
+
+   free(store);
+   free(base);
+
+   return 0;
+
+error:
+
+   free(store);
+   free(base);
+
+   return 1;
+}
+
+bool
+pgmoneta_dedup_is_map(char* path)
+{
+   char* suffixes[] = {".zstd", ".gz", ".lz4", ".bz2"};
+   char* n = NULL;
+   bool map = false;
+
+   n = pgmoneta_append(n, path);
+
+   if (pgmoneta_ends_with(n, ".aes"))
+   {
+      n[strlen(n) - strlen(".aes")] = '\0';
+   }
+
+   for (int i = 0; i < (int)(sizeof(suffixes) / sizeof(suffixes[0])); i++)
+   {
+      if (pgmoneta_ends_with(n, suffixes[i]))
+      {
+         n[strlen(n) - strlen(suffixes[i])] = '\0';
+         break;
+      }
+   }
+
+   map = pgmoneta_ends_with(n, DEDUP_SUFFIX);
+
+   free(n);
+
+   return map;
+}
+
+int
+pgmoneta_dedup_collect(int server)
+{
+   char* store = NULL;
+   int ret = 0;
+
+   store = pgmoneta_get_server(server);
+   store = pgmoneta_append(store, "chunks");
+
+   if (collect_store(store, server))
+   {
+      ret = 1;
+   }
+
+   free(store);
+   store = NULL;
+
+   /* The shared store is also collected after global_deduplication is turned off */
+   store = pgmoneta_get_global();
+   store = pgmoneta_append(store, "chunks");
+
+   if (collect_store(store, -1))
+   {
+      ret = 1;
+   }
+
+   free(store);
+
+   return ret;
+}
+
+static int
+dedup_walk(char* directory, char* store, char* store_name, struct dedup_statistics* statistics, struct workers* workers)
+{
+   DIR* dir = NULL;
+   char* path = NULL;
+   struct dirent* entry;
+   struct stat st;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (!(dir = opendir(directory)))
+   {
+      return 1;
+   }
+
+   while ((entry = readdir(dir)) != NULL)
+   {
+      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      {
+         continue;
+      }
+
+      path = pgmoneta_append(path, directory);
+      if (!pgmoneta_ends_with(path, "/"))
+      {
+         path = pgmoneta_append(path, "/");
+      }
+      path = pgmoneta_append(path, entry->d_name);
+
+      if (!lstat(path, &st))
+      {
+         if (S_ISDIR(st.st_mode))
+         {
+            dedup_walk(path, store, store_name, statistics, workers);
+         }
+         else if (S_ISREG(st.st_mode) &&
+                  st.st_size >= config->deduplication_chunk_size &&
+                  !pgmoneta_ends_with(entry->d_name, "backup_label") &&
+                  !pgmoneta_is_file_archive(entry->d_name) &&
+                  !pgmoneta_dedup_is_map(entry->d_name))
+         {
+            struct dedup_input* di = NULL;
+
+            di = (struct dedup_input*)malloc(sizeof(struct dedup_input));
+
+            if (di != NULL)
+            {
+               di->path = path;
+               di->store = store;
+               di->store_name = store_name;
+               di->statistics = statistics;
+
+               path = NULL;
+
+               if (workers != NULL)
+               {
+                  pgmoneta_workers_add(workers, dedup_file, (void*)di);
+               }
+               else
+               {
+                  dedup_file(di);
+               }
+            }
+         }
+      }
+
+      free(path);
+      path = NULL;
+   }
+
+   closedir(dir);
+
+   return 0;
+}
+
+static void
+dedup_file(void* arg)
+{
+   int fd = -1;
+   int algorithm;
+   size_t chunk_size;
+   size_t capacity;
+   size_t available = 0;
+   size_t cut = 0;
+   ssize_t n = 0;
+   bool eof = false;
+   bool created = false;
+   uint64_t max_chunks = 0;
+   unsigned char* buffer = NULL;
+   struct stat st;
+   struct dedup_map map;
+   struct dedup_chunk* chunk = NULL;
+   struct dedup_input* di = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   di = (struct dedup_input*)arg;
+
+   memset(&map, 0, sizeof(struct dedup_map));
+
+   algorithm = config->deduplication;
+   chunk_size = (size_t)config->deduplication_chunk_size;
+
+   /* Content defined chunks are between a quarter and four times the average size */
+   capacity = algorithm == DEDUPLICATION_CONTENT ? 8 * chunk_size : 2 * chunk_size;
+
+   fd = open(di->path, O_RDONLY);
+
+   if (fd < 0 || fstat(fd, &st))
+   {
+      goto error;
+   }
+
+   buffer = (unsigned char*)malloc(capacity);
+
+   if (buffer == NULL)
+   {
+      goto error;
+   }
+
+   map.algorithm = algorithm;
+   map.chunk_size = (uint32_t)chunk_size;
+   map.store = di->store_name;
+
+   while (!eof || available > 0)
+   {
+      while (!eof && available < capacity)
+      {
+         n = read(fd, buffer + available, capacity - available);
+
+         if (n < 0)
+         {
+            if (errno == EINTR)
+            {
+               continue;
+            }
+
+            goto error;
+         }
+
+         if (n == 0)
+         {
+            eof = true;
+         }
+
+         available += (size_t)n;
+      }
+
+      if (available == 0)
+      {
+         break;
+      }
+
+      cut = find_boundary(buffer, available, eof, algorithm, chunk_size);
+
+      if (map.number_of_chunks == max_chunks)
+      {
+         struct dedup_chunk* c = NULL;
+
+         max_chunks = max_chunks == 0 ? 1024 : max_chunks * 2;
+         c = (struct dedup_chunk*)realloc(map.chunks, max_chunks * sizeof(struct dedup_chunk));
+
+         if (c == NULL)
+         {
+            goto error;
+         }
+
+         map.chunks = c;
+      }
+
+      chunk = &map.chunks[map.number_of_chunks];
+
+      if (EVP_Digest(buffer, cut, &chunk->hash[0], NULL, EVP_sha256(), NULL) != 1)
+      {
+         goto error;
+      }
+
+      chunk->length = (uint32_t)cut;
+      chunk->offset = map.size;
+
+      if (store_chunk(di->store, &chunk->hash[0], buffer, cut, &created))
+      {
+         goto error;
+      }
+
+      atomic_fetch_add(&di->statistics->chunks, 1);
+      atomic_fetch_add(&di->statistics->bytes, cut);
+
+      if (created)
+      {
+         atomic_fetch_add(&di->statistics->new_chunks, 1);
+         atomic_fetch_add(&di->statistics->new_bytes, cut);
+      }
+
+      map.size += cut;
+      map.number_of_chunks++;
+
+      memmove(buffer, buffer + cut, available - cut);
+      available -= cut;
+   }
+
+   close(fd);
+   fd = -1;
+
+   if (map.size != (uint64_t)st.st_size)
+   {
+      pgmoneta_log_error("Deduplication: %s changed while it was read", di->path);
+      goto error;
+   }
+
+   if (write_map(di->path, &map, st.st_mode & 07777))
+   {
+      goto error;
+   }
+
+   pgmoneta_delete_file(di->path, NULL);
+
+   atomic_fetch_add(&di->statistics->files, 1);
+
+   free(map.chunks);
+   free(buffer);
+   free(di->path);
+   free(di);
+
+   return;
+
+error:
+
+   /* The file is kept as it is */
+   pgmoneta_log_error("Deduplication: Could not deduplicate %s", di->path);
+
+   if (fd >= 0)
+   {
+      close(fd);
+   }
+
+   free(map.chunks);
+   free(buffer);
+   free(di->path);
+   free(di);
+}
+
+/**
+ * Find the end of the next chunk. Page chunks have a fixed size, so a
+ * changed page only changes its own chunk. Content defined chunks end where
+ * a rolling gear hash matches, so inserted data only changes the chunks
+ * around it
+ */
+static size_t
+find_boundary(unsigned char* data, size_t length, bool eof, int algorithm, size_t chunk_size)
+{
+   size_t minimum;
+   size_t maximum;
+   uint64_t mask = 0;
+   uint64_t hash = 0;
+
+   if (algorithm != DEDUPLICATION_CONTENT)
+   {
+      return MIN(length, chunk_size);
+   }
+
+   pthread_once(&gear_once, gear_initialize);
+
+   minimum = chunk_size / 4;
+   maximum = chunk_size * 4;
+
+   if (length <= minimum)
+   {
+      return length;
+   }
+
+   /* The mask has as many bits as the average size, taken from the top of the hash */
+   for (size_t s = chunk_size; s > 1; s >>= 1)
+   {
+      mask = (mask >> 1) | (1ULL << 63);
+   }
+
+   for (size_t i = 0; i < MIN(length, maximum); i++)
+   {
+      hash = (hash << 1) + gear[data[i]];
+
+      if (i >= minimum && (hash & mask) == 0)
+      {
+         return i + 1;
+      }
+   }
+
+   return eof ? MIN(length, maximum) : maximum;
+}
+
+static int
+store_chunk(char* store, unsigned char* hash, unsigned char* data, size_t length, bool* created)
+{
+   int fd = -1;
+   int compression;
+   char* base = NULL;
+   char* stored = NULL;
+   char* target = NULL;
+   char* tmp = NULL;
+   char* directory = NULL;
+   struct stream_writer* writer = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *created = false;
+
+   base = chunk_base(store, hash);
+
+   if (base == NULL)
+   {
+      goto error;
+   }
+
+   if (!pgmoneta_stream_get_stored_file(base, &stored))
+   {
+      /* Refresh the chunk, so a concurrent collection keeps it */
+      utimensat(AT_FDCWD, stored, NULL, 0);
+
+      free(stored);
+      free(base);
+
+      return 0;
+   }
+
+   directory = pgmoneta_append(directory, base);
+   directory[strlen(directory) - DEDUP_HASH_LENGTH * 2 - 1] = '\0';
+
+   if (pgmoneta_mkdir(directory))
+   {
+      goto error;
+   }
+
+   compression = pgmoneta_stream_compression(config->compression_type);
+
+   target = pgmoneta_append(target, base);
+   target = pgmoneta_append(target, pgmoneta_stream_compression_suffix(compression));
+   if (config->encryption != ENCRYPTION_NONE)
+   {
+      target = pgmoneta_append(target, ".aes");
+   }
+
+   /* Chunks are written next to the store and renamed, so a chunk is never seen half written */
+   tmp = pgmoneta_append(tmp, target);
+   tmp = pgmoneta_append(tmp, ".XXXXXX");
+
+   fd = mkstemp(tmp);
+
+   if (fd < 0)
+   {
+      goto error;
+   }
+
+   fchmod(fd, 0600);
+
+   if (pgmoneta_stream_writer_init_fd(fd, compression, config->compression_level, config->encryption, &writer))
+   {
+      fd = -1;
+      goto error;
+   }
+
+   fd = -1;
+
+   if (pgmoneta_stream_writer_write(writer, data, length))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_stream_writer_destroy(writer))
+   {
+      writer = NULL;
+      goto error;
+   }
+
+   writer = NULL;
+
+   if (rename(tmp, target))
+   {
+      goto error;
+   }
+
+   *created = true;
+
+   free(directory);
+   free(target);
+   free(tmp);
+   free(base);
+
+   return 0;
+
+error:
+
+   pgmoneta_log_error("Deduplication: Could not store chunk %s", base != NULL ? base : "");
+
+   if (fd >= 0)
+   {
+      close(fd);
+   }
+
+   pgmoneta_stream_writer_destroy(writer);
+
+   if (tmp != NULL)
+   {
+      unlink(tmp);
+   }
+
+   free(directory);
+   free(target);
+   free(tmp);
+   free(base);
+
+   return 1;
+}
+
+static char*
+chunk_base(char* store, unsigned char* hash)
+{
+   char hex[DEDUP_HASH_LENGTH * 2 + 1];
+   char* base = NULL;
+
+   hash_to_hex(hash, &hex[0]);
+
+   base = pgmoneta_append(base, store);
+   if (!pgmoneta_ends_with(base, "/"))
+   {
+      base = pgmoneta_append(base, "/");
+   }
+   base = pgmoneta_append_char(base, hex[0]);
+   base = pgmoneta_append_char(base, hex[1]);
+   base = pgmoneta_append(base, "/");
+   base = pgmoneta_append(base, &hex[0]);
+
+   return base;
+}
+
+static void
+hash_to_hex(unsigned char* hash, char* hex)
+{
+   for (int i = 0; i < DEDUP_HASH_LENGTH; i++)
+   {
+      sprintf(hex + i * 2, "%02x", hash[i]);
+   }
+
+   hex[DEDUP_HASH_LENGTH * 2] = '\0';
+}
+
+static int
+write_map(char* path, struct dedup_map* map, mode_t mode)
+{
+   int fd = -1;
+   size_t size = 0;
+   size_t position = 0;
+   size_t offset = 0;
+   ssize_t written = 0;
+   uint16_t store_length = 0;
+   char* target = NULL;
+   unsigned char* data = NULL;
+
+   store_length = (uint16_t)strlen(map->store);
+
+   size = DEDUP_HEADER_LENGTH + store_length + map->number_of_chunks * DEDUP_ENTRY_LENGTH;
+   data = (unsigned char*)malloc(size);
+
+   if (data == NULL)
+   {
+      goto error;
+   }
+
+   memcpy(data, DEDUP_MAGIC, DEDUP_MAGIC_LENGTH);
+   position = DEDUP_MAGIC_LENGTH;
+   pgmoneta_write_uint32(data + position, (uint32_t)map->algorithm);
+   position += 4;
+   pgmoneta_write_uint32(data + position, map->chunk_size);
+   position += 4;
+   pgmoneta_write_uint64(data + position, map->size);
+   position += 8;
+   pgmoneta_write_uint64(data + position, map->number_of_chunks);
+   position += 8;
+   pgmoneta_write_uint16(data + position, store_length);
+   position += 2;
+   memcpy(data + position, map->store, store_length);
+   position += store_length;
+
+   for (uint64_t i = 0; i < map->number_of_chunks; i++)
+   {
+      memcpy(data + position, &map->chunks[i].hash[0], DEDUP_HASH_LENGTH);
+      pgmoneta_write_uint32(data + position + DEDUP_HASH_LENGTH, map->chunks[i].length);
+      position += DEDUP_ENTRY_LENGTH;
+   }
+
+   target = pgmoneta_append(target, path);
+   target = pgmoneta_append(target, DEDUP_SUFFIX);
+
+   fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, mode);
+
+   if (fd < 0)
+   {
+      goto error;
+   }
+
+   while (offset < size)
+   {
+      written = write(fd, data + offset, size - offset);
+
+      if (written < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+
+         goto error;
+      }
+
+      offset += (size_t)written;
+   }
+
+   if (fsync(fd) || close(fd))
+   {
+      fd = -1;
+      goto error;
+   }
+
+   free(target);
+   free(data);
+
+   return 0;
+
+error:
+
+   if (fd >= 0)
+   {
+      close(fd);
+   }
+
+   if (target != NULL)
+   {
+      unlink(target);
+   }
+
+   free(target);
+   free(data);
+
+   return 1;
+}
+
+static int
+collect_store(char* store, int server)
+{
+   char* backups = NULL;
+   int lock = -1;
+   time_t start;
+   uint64_t deleted = 0;
+   uint64_t bytes = 0;
+   struct art* referenced = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (!pgmoneta_exists(store))
+   {
+      return 0;
+   }
+
+   /* A backup that deduplicates into the store may reuse any chunk */
+   lock = lock_store(store, LOCK_EX | LOCK_NB);
+   if (lock == -1)
+   {
+      pgmoneta_log_debug("Deduplication: %s is in use, chunks are collected later", store);
+      return 0;
+   }
+
+   /* An active backup may refer to chunks that aren't in a map yet */
+   for (int i = 0; i < config->number_of_servers; i++)
+   {
+      if ((server == -1 || server == i) && atomic_load(&config->servers[i].backup))
+      {
+         pgmoneta_log_debug("Deduplication: Backup active for %s, chunks are collected later", config->servers[i].name);
+         unlock_store(lock);
+         return 0;
+      }
+   }
+
+   start = time(NULL);
+
+   if (pgmoneta_art_create(&referenced))
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < config->number_of_servers; i++)
+   {
+      if (server == -1 || server == i)
+      {
+         backups = pgmoneta_get_server_backup(i);
+
+         if (collect_maps(backups, referenced))
+         {
+            pgmoneta_log_error("Deduplication: Could not read the chunk maps of %s", config->servers[i].name);
+            goto error;
+         }
+
+         free(backups);
+         backups = NULL;
+      }
+   }
+
+   if (collect_chunks(store, referenced, start, &deleted, &bytes))
+   {
+      goto error;
+   }
+
+   pgmoneta_log_debug("Deduplication: Deleted %" PRIu64 " chunks (%" PRIu64 " bytes) from %s",
+                      deleted, bytes, store);
+
+   pgmoneta_art_destroy(referenced);
+   unlock_store(lock);
+
+   return 0;
+
+error:
+
+   pgmoneta_art_destroy(referenced);
+   free(backups);
+   unlock_store(lock);
+
+   return 1;
+}
+
+static int
+collect_maps(char* directory, struct art* referenced)
+{
+   DIR* dir = NULL;
+   char* path = NULL;
+   char hex[DEDUP_HASH_LENGTH * 2 + 1];
+   struct dirent* entry;
+   struct stat st;
+   struct dedup_map* map = NULL;
+   int ret = 0;
+
+   if (!(dir = opendir(directory)))
+   {
+      return 0;
+   }
+
+   while (ret == 0 && (entry = readdir(dir)) != NULL)
+   {
+      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      {
+         continue;
+      }
+
+      path = pgmoneta_append(path, directory);
+      if (!pgmoneta_ends_with(path, "/"))
+      {
+         path = pgmoneta_append(path, "/");
+      }
+      path = pgmoneta_append(path, entry->d_name);
+
+      /* Linked maps are read in the backup they link to */
+      if (!lstat(path, &st))
+      {
+         if (S_ISDIR(st.st_mode))
+         {
+            ret = collect_maps(path, referenced);
+         }
+         else if (S_ISREG(st.st_mode) && pgmoneta_dedup_is_map(entry->d_name))
+         {
+            if (pgmoneta_dedup_read_map(path, &map))
+            {
+               ret = 1;
+            }
+            else
+            {
+               for (uint64_t i = 0; i < map->number_of_chunks; i++)
+               {
+                  hash_to_hex(&map->chunks[i].hash[0], &hex[0]);
+                  pgmoneta_art_insert(referenced, (unsigned char*)&hex[0], strlen(&hex[0]) + 1, (uintptr_t)true, ValueBool);
+               }
+
+               pgmoneta_dedup_map_destroy(map);
+               map = NULL;
+            }
+         }
+      }
+
+      free(path);
+      path = NULL;
+   }
+
+   closedir(dir);
+
+   return ret;
+}
+
+static int
+collect_chunks(char* store, struct art* referenced, time_t start, uint64_t* deleted, uint64_t* bytes)
+{
+   DIR* dir = NULL;
+   DIR* sub = NULL;
+   char* directory = NULL;
+   char* path = NULL;
+   char hex[DEDUP_HASH_LENGTH * 2 + 1];
+   struct dirent* entry;
+   struct dirent* chunk;
+   struct stat st;
+
+   if (!(dir = opendir(store)))
+   {
+      return 1;
+   }
+
+   while ((entry = readdir(dir)) != NULL)
+   {
+      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      {
+         continue;
+      }
+
+      directory = pgmoneta_append(directory, store);
+      directory = pgmoneta_append(directory, "/");
+      directory = pgmoneta_append(directory, entry->d_name);
+
+      if ((sub = opendir(directory)) != NULL)
+      {
+         while ((chunk = readdir(sub)) != NULL)
+         {
+            if (!strcmp(chunk->d_name, ".") || !strcmp(chunk->d_name, ".."))
+            {
+               continue;
+            }
+
+            memset(&hex[0], 0, sizeof(hex));
+            memcpy(&hex[0], chunk->d_name, MIN(strlen(chunk->d_name), DEDUP_HASH_LENGTH * 2));
+
+            path = pgmoneta_append(path, directory);
+            path = pgmoneta_append(path, "/");
+            path = pgmoneta_append(path, chunk->d_name);
+
+            /* Chunks written after the start may belong to a backup that just started */
+            if (!lstat(path, &st) && S_ISREG(st.st_mode) && st.st_mtime < start &&
+                !pgmoneta_art_contains_key(referenced, (unsigned char*)&hex[0], strlen(&hex[0]) + 1))
+            {
+               if (!unlink(path))
+               {
+                  *deleted += 1;
+                  *bytes += (uint64_t)st.st_size;
+               }
+            }
+
+            free(path);
+            path = NULL;
+         }
+
+         closedir(sub);
+      }
+
+      free(directory);
+      directory = NULL;
+   }
+
+   closedir(dir);
+
+   return 0;
+}
+
+static int
+lock_store(char* store, int operation)
+{
+   int fd = -1;
+   char* path = NULL;
+
+   path = pgmoneta_append(path, store);
+   path = pgmoneta_append(path, "/lock");
+
+   fd = open(path, O_RDWR | O_CREAT, 0600);
+   if (fd == -1)
+   {
+      goto error;
+   }
+
+   /* The lock is released by the kernel when a process ends */
+   if (flock(fd, operation) == -1)
+   {
+      goto error;
+   }
+
+   free(path);
+
+   return fd;
+
+error:
+
+   if (fd != -1)
+   {
+      close(fd);
+   }
+
+   free(path);
+
+   return -1;
+}
+
+static void
+unlock_store(int fd)
+{
+   if (fd != -1)
+   {
+      flock(fd, LOCK_UN);
+      close(fd);
+   }
+}
+
+static void
+gear_initialize(void)
+{
+   /* A fixed seed, so the boundaries are the same in every backup */
+   uint64_t x = 0x9E3779B97F4A7C15ULL;
+
+   for (int i = 0; i < 256; i++)
+   {
+      uint64_t z;
+
+      x += 0x9E3779B97F4A7C15ULL;
+      z = x;
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+      gear[i] = z ^ (z >> 31);
+   }
+}
@@ -31,6 +31,12 @@
 #include <http.h>
 #include "utils.h"
 
+/* system */
+#include <stdlib.h>
+#include <string.h>
+
+static size_t http_collect(char* buffer, size_t size, size_t nitems, void* userdata);
+
 struct curl_slist*
 pgmoneta_http_add_header(struct curl_slist* chunk, char* header, char* value)
 {
@@ -124,4 +130,161 @@ pgmoneta_http_set_url_option(CURL* handle, char* url)
 error:
 
    return 1;
-}
\ No newline at end of file
+}
+int
+pgmoneta_http_set_response_option(CURL* handle, char** response)
+{
+   if (handle == NULL || response == NULL)
+   {
+      goto error;
+   }
+
+   if (curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, http_collect) != CURLE_OK)
+   {
+      goto error;
+   }
+
+   if (curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void*)response) != CURLE_OK)
+   {
+      goto error;
+   }
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+char*
+pgmoneta_http_xml_element(char* xml, char* tag, char** value)
+{
+   char* start = NULL;
+   char* end = NULL;
+   char* open_tag = NULL;
+   char* close_tag = NULL;
+   char* v = NULL;
+   size_t length = 0;
+   size_t j = 0;
+
+   *value = NULL;
+
+   if (xml == NULL)
+   {
+      return NULL;
+   }
+
+   open_tag = pgmoneta_append(open_tag, "<");
+   open_tag = pgmoneta_append(open_tag, tag);
+   open_tag = pgmoneta_append(open_tag, ">");
+
+   close_tag = pgmoneta_append(close_tag, "</");
+   close_tag = pgmoneta_append(close_tag, tag);
+   close_tag = pgmoneta_append(close_tag, ">");
+
+   start = strstr(xml, open_tag);
+
+   if (start == NULL)
+   {
+      goto done;
+   }
+
+   start += strlen(open_tag);
+   end = strstr(start, close_tag);
+
+   if (end == NULL)
+   {
+      goto done;
+   }
+
+   length = end - start;
+   v = (char*)malloc(length + 1);
+
+   if (v == NULL)
+   {
+      end = NULL;
+      goto done;
+   }
+
+   /* The predefined entities are the only escapes in the responses */
+   for (size_t i = 0; i < length; i++)
+   {
+      if (start[i] == '&')
+      {
+         if (!strncmp(start + i, "&amp;", 5))
+         {
+            v[j++] = '&';
+            i += 4;
+            continue;
+         }
+         else if (!strncmp(start + i, "&lt;", 4))
+         {
+            v[j++] = '<';
+            i += 3;
+            continue;
+         }
+         else if (!strncmp(start + i, "&gt;", 4))
+         {
+            v[j++] = '>';
+            i += 3;
+            continue;
+         }
+         else if (!strncmp(start + i, "&quot;", 6))
+         {
+            v[j++] = '"';
+            i += 5;
+            continue;
+         }
+         else if (!strncmp(start + i, "&apos;", 6))
+         {
+            v[j++] = '\'';
+            i += 5;
+            continue;
+         }
+      }
+
+      v[j++] = start[i];
+   }
+   v[j] = '\0';
+
+   *value = v;
+   end += strlen(close_tag);
+
+done:
+
+   free(open_tag);
+   free(close_tag);
+
+   return *value != NULL ? end : NULL;
+}
+
+static size_t
+http_collect(char* buffer, size_t size, size_t nitems, void* userdata)
+{
+   char** response = NULL;
+   char* r = NULL;
+   size_t length;
+   size_t current = 0;
+
+   response = (char**)userdata;
+   length = size * nitems;
+
+   if (*response != NULL)
+   {
+      current = strlen(*response);
+   }
+
+   r = (char*)realloc(*response, current + length + 1);
+
+   if (r == NULL)
+   {
+      return 0;
+   }
+
+   memcpy(r + current, buffer, length);
+   r[current + length] = '\0';
+
+   *response = r;
+
+   return length;
+}
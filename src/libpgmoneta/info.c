@@ -870,6 +870,97 @@ error:
    return 0;
 }
 
+int
+pgmoneta_get_backup_label(int server, char* identifier, char** label)
+{
+   char* server_path = NULL;
+   char* base = NULL;
+   char* l = NULL;
+   int number_of_backups = 0;
+   struct backup** backups = NULL;
+
+   *label = NULL;
+
+   server_path = pgmoneta_get_server_backup(server);
+
+   if (pgmoneta_get_backups(server_path, &number_of_backups, &backups))
+   {
+      goto error;
+   }
+
+   if (!strcmp(identifier, "oldest"))
+   {
+      for (int i = 0; l == NULL && i < number_of_backups; i++)
+      {
+         if (backups[i]->valid == VALID_TRUE)
+         {
+            l = pgmoneta_append(l, backups[i]->label);
+         }
+      }
+   }
+   else if (!strcmp(identifier, "latest") || !strcmp(identifier, "newest"))
+   {
+      for (int i = number_of_backups - 1; l == NULL && i >= 0; i--)
+      {
+         if (backups[i]->valid == VALID_TRUE)
+         {
+            l = pgmoneta_append(l, backups[i]->label);
+         }
+      }
+   }
+   else
+   {
+      base = pgmoneta_get_server_backup_identifier(server, identifier);
+
+      if (!pgmoneta_exists(base))
+      {
+         for (int i = 0; l == NULL && i < number_of_backups; i++)
+         {
+            if (backups[i]->valid == VALID_TRUE && pgmoneta_starts_with(backups[i]->label, identifier))
+            {
+               l = pgmoneta_append(l, backups[i]->label);
+            }
+         }
+      }
+
+      if (l == NULL)
+      {
+         l = pgmoneta_append(l, identifier);
+      }
+   }
+
+   if (l == NULL)
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < number_of_backups; i++)
+   {
+      free(backups[i]);
+   }
+   free(backups);
+
+   free(base);
+   free(server_path);
+
+   *label = l;
+
+   return 0;
+
+error:
+
+   for (int i = 0; i < number_of_backups; i++)
+   {
+      free(backups[i]);
+   }
+   free(backups);
+
+   free(base);
+   free(server_path);
+
+   return 1;
+}
+
 void
 pgmoneta_info_request(SSL* ssl, int client_fd, int server, struct json* payload)
 {
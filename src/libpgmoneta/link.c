@@ -28,16 +28,24 @@
 
 /* pgmoneta */
 #include <pgmoneta.h>
+#include <csv.h>
+#include <dedup.h>
 #include <info.h>
 #include <link.h>
 #include <logging.h>
+#include <manifest.h>
+#include <security.h>
+#include <stream.h>
 #include <utils.h>
 #include <workers.h>
 
 /* system */
 #include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -46,6 +54,8 @@ static void do_link(void* arg);
 static void do_relink(void* arg);
 static void do_comparefiles(void* arg);
 static char* trim_suffix(char* str);
+static int link_digest(char* digests, char* checksum, char* stored, uint64_t* linked, uint64_t* bytes);
+static bool is_hex(char* str);
 
 void
 pgmoneta_link_manifest(char* base_from, char* base_to, char* from, struct art* changed, struct art* added, struct workers* workers)
@@ -239,7 +249,7 @@ done:
 static void
 do_relink(void* arg)
 {
-   char* link = NULL;
+   char* target = NULL;
    struct worker_input* wi = NULL;
 
    wi = (struct worker_input*)arg;
@@ -249,16 +259,21 @@ do_relink(void* arg)
       if (pgmoneta_is_file(wi->from))
       {
          pgmoneta_delete_file(wi->to, NULL);
-         pgmoneta_copy_file(wi->from, wi->to, wi->workers);
+
+         /* A hardlink keeps the file shared with the other backups that link to it */
+         if (link(wi->from, wi->to))
+         {
+            pgmoneta_copy_file(wi->from, wi->to, wi->workers);
+         }
       }
       else
       {
-         link = pgmoneta_get_symlink(wi->from);
+         target = pgmoneta_get_symlink(wi->from);
 
          pgmoneta_delete_file(wi->to, NULL);
-         pgmoneta_symlink_file(wi->to, link);
+         pgmoneta_symlink_file(wi->to, target);
 
-         free(link);
+         free(target);
       }
    }
 
@@ -359,42 +374,306 @@ do_comparefiles(void* arg)
    free(wi);
 }
 
-static char*
-trim_suffix(char* str)
+int
+pgmoneta_link_global(int server, char* identifier)
 {
-   char* res = NULL;
+   char* root = NULL;
+   char* manifest = NULL;
+   char* digests = NULL;
+   char* path = NULL;
+   char* stored = NULL;
+   char** columns = NULL;
+   int number_of_columns = 0;
+   int hash;
+   uint64_t linked = 0;
+   uint64_t bytes = 0;
+   struct csv_reader* reader = NULL;
    struct configuration* config;
 
-   config = (struct configuration*) shmem;
-   int len = 0;
+   config = (struct configuration*)shmem;
+
+   hash = config->servers[server].manifest;
+   if (hash == HASH_ALGORITHM_DEFAULT)
+   {
+      hash = config->manifest;
+   }
+
+   /* A CRC-32C checksum doesn't identify the content of a file */
+   if (hash == HASH_ALGORITHM_CRC32C)
+   {
+      pgmoneta_log_debug("Global deduplication: %s/%s uses a CRC-32C manifest", config->servers[server].name, identifier);
+      return 0;
+   }
+
+   root = pgmoneta_get_server_backup_identifier(server, identifier);
+
+   manifest = pgmoneta_append(manifest, root);
+   manifest = pgmoneta_append(manifest, "backup.manifest");
+
+   digests = pgmoneta_get_global();
+   digests = pgmoneta_append(digests, "digests/");
+
+   if (pgmoneta_csv_reader_init(manifest, &reader))
+   {
+      pgmoneta_log_error("Global deduplication: Could not read %s", manifest);
+      goto error;
+   }
+
+   while (pgmoneta_csv_next_row(reader, &number_of_columns, &columns))
+   {
+      if (number_of_columns == MANIFEST_COLUMN_COUNT && is_hex(columns[MANIFEST_CHECKSUM_INDEX]))
+      {
+         path = pgmoneta_append(path, root);
+         path = pgmoneta_append(path, "data/");
+         path = pgmoneta_append(path, columns[MANIFEST_PATH_INDEX]);
+
+         if (!pgmoneta_stream_get_stored_file(path, &stored))
+         {
+            link_digest(digests, columns[MANIFEST_CHECKSUM_INDEX], stored, &linked, &bytes);
+         }
+
+         free(path);
+         free(stored);
+         path = NULL;
+         stored = NULL;
+      }
+
+      free(columns);
+      columns = NULL;
+   }
+
+   pgmoneta_log_debug("Global deduplication: %s/%s linked %" PRIu64 " files (%" PRIu64 " bytes)",
+                      config->servers[server].name, identifier, linked, bytes);
+
+   pgmoneta_csv_reader_destroy(reader);
+   free(root);
+   free(manifest);
+   free(digests);
+
+   return 0;
+
+error:
+
+   pgmoneta_csv_reader_destroy(reader);
+   free(root);
+   free(manifest);
+   free(digests);
+
+   return 1;
+}
+
+int
+pgmoneta_link_global_collect(void)
+{
+   DIR* dir = NULL;
+   DIR* sub = NULL;
+   char* digests = NULL;
+   char* directory = NULL;
+   char* path = NULL;
+   uint64_t deleted = 0;
+   struct dirent* entry;
+   struct dirent* digest;
+   struct stat st;
+
+   digests = pgmoneta_get_global();
+   digests = pgmoneta_append(digests, "digests/");
+
+   if (!(dir = opendir(digests)))
+   {
+      free(digests);
+      return 0;
+   }
+
+   while ((entry = readdir(dir)) != NULL)
+   {
+      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      {
+         continue;
+      }
+
+      directory = pgmoneta_append(directory, digests);
+      directory = pgmoneta_append(directory, entry->d_name);
+
+      if ((sub = opendir(directory)) != NULL)
+      {
+         while ((digest = readdir(sub)) != NULL)
+         {
+            if (!strcmp(digest->d_name, ".") || !strcmp(digest->d_name, ".."))
+            {
+               continue;
+            }
+
+            path = pgmoneta_append(path, directory);
+            path = pgmoneta_append(path, "/");
+            path = pgmoneta_append(path, digest->d_name);
+
+            /* An entry that is its only link doesn't belong to a backup anymore */
+            if (!lstat(path, &st) && S_ISREG(st.st_mode) && st.st_nlink == 1)
+            {
+               if (!unlink(path))
+               {
+                  deleted++;
+               }
+            }
+
+            free(path);
+            path = NULL;
+         }
+
+         closedir(sub);
+      }
+
+      free(directory);
+      directory = NULL;
+   }
+
+   closedir(dir);
+
+   pgmoneta_log_debug("Global deduplication: Deleted %" PRIu64 " digests", deleted);
+
+   free(digests);
+
+   return 0;
+}
+
+static int
+link_digest(char* digests, char* checksum, char* stored, uint64_t* linked, uint64_t* bytes)
+{
+   char* plain = NULL;
+   char* directory = NULL;
+   char* entry = NULL;
+   char* tmp = NULL;
+   char prefix[3];
+   int error = 0;
+   struct stat file_st;
+   struct stat entry_st;
+
+   /* Symlinks point to an earlier backup, and chunk maps name the store of their chunks */
+   if (lstat(stored, &file_st) || !S_ISREG(file_st.st_mode) || pgmoneta_dedup_is_map(stored))
+   {
+      return 0;
+   }
+
+   /* The entry keeps the compression and encryption suffixes, so it is only shared with the same kind */
+   plain = pgmoneta_stream_plain_name(stored);
+
+   memset(&prefix[0], 0, sizeof(prefix));
+   memcpy(&prefix[0], checksum, 2);
+
+   directory = pgmoneta_append(directory, digests);
+   directory = pgmoneta_append(directory, &prefix[0]);
+
+   entry = pgmoneta_append(entry, directory);
+   entry = pgmoneta_append(entry, "/");
+   entry = pgmoneta_append(entry, checksum);
+   entry = pgmoneta_append(entry, stored + strlen(plain));
+
+   if (!lstat(entry, &entry_st))
+   {
+      if (entry_st.st_dev == file_st.st_dev && entry_st.st_ino == file_st.st_ino)
+      {
+         goto done;
+      }
+
+      /* The file is replaced in one step, so the backup never misses it */
+      tmp = pgmoneta_append(tmp, stored);
+      tmp = pgmoneta_append(tmp, ".global");
+
+      unlink(tmp);
+
+      if (link(entry, tmp))
+      {
+         error = errno;
+      }
+      else if (rename(tmp, stored))
+      {
+         error = errno;
+         unlink(tmp);
+      }
+      else
+      {
+         *linked += 1;
+         *bytes += (uint64_t)file_st.st_size;
+         goto done;
+      }
+
+      errno = 0;
+
+      if (error != ENOENT)
+      {
+         pgmoneta_log_debug("Global deduplication: Could not link %s to %s (%s)", stored, entry, strerror(error));
+         goto done;
+      }
+
+      /* The entry was collected, so the file takes its place */
+   }
+
+   if (pgmoneta_mkdir(directory))
+   {
+      goto error;
+   }
+
+   if (link(stored, entry) && errno != EEXIST)
+   {
+      pgmoneta_log_debug("Global deduplication: Could not add %s (%s)", stored, strerror(errno));
+   }
+   errno = 0;
+
+done:
+
+   free(plain);
+   free(directory);
+   free(entry);
+   free(tmp);
+
+   return 0;
+
+error:
+
+   free(plain);
+   free(directory);
+   free(entry);
+   free(tmp);
+
+   return 1;
+}
+
+static bool
+is_hex(char* str)
+{
+   size_t length;
+
    if (str == NULL)
    {
-      return NULL;
+      return false;
+   }
+
+   length = strlen(str);
+
+   if (length < 2)
+   {
+      return false;
    }
-   len = strlen(str) + 1;
-   switch (config->compression_type)
+
+   for (size_t i = 0; i < length; i++)
    {
-      case COMPRESSION_CLIENT_GZIP:
-      case COMPRESSION_SERVER_GZIP:
-         len -= 3;
-         break;
-      case COMPRESSION_CLIENT_ZSTD:
-      case COMPRESSION_SERVER_ZSTD:
-         len -= 5;
-         break;
-      case COMPRESSION_CLIENT_LZ4:
-      case COMPRESSION_SERVER_LZ4:
-      case COMPRESSION_CLIENT_BZIP2:
-         len -= 4;
-         break;
+      if (!((str[i] >= '0' && str[i] <= '9') || (str[i] >= 'a' && str[i] <= 'f')))
+      {
+         return false;
+      }
    }
-   if (config->encryption != ENCRYPTION_NONE)
+
+   return true;
+}
+
+static char*
+trim_suffix(char* str)
+{
+   if (str == NULL)
    {
-      len -= 4;
+      return NULL;
    }
 
-   res = malloc(len);
-   memset(res, 0, len);
-   memcpy(res, str, len - 1);
-   return res;
+   /* The compression, encryption and chunk map suffixes */
+   return pgmoneta_stream_plain_name(str);
 }
\ No newline at end of file
@@ -738,6 +738,42 @@ error:
    return 1;
 }
 
+int
+pgmoneta_management_request_wal_stats(SSL* ssl, int socket, char* server, char* start, char* end, int32_t output_format)
+{
+   struct json* j = NULL;
+   struct json* request = NULL;
+
+   if (create_header(MANAGEMENT_WAL_STATS, output_format, &j))
+   {
+      goto error;
+   }
+
+   if (create_request(j, &request))
+   {
+      goto error;
+   }
+
+   pgmoneta_json_put(request, MANAGEMENT_ARGUMENT_SERVER, (uintptr_t)server, ValueString);
+   pgmoneta_json_put(request, MANAGEMENT_ARGUMENT_START, (uintptr_t)(start != NULL ? start : ""), ValueString);
+   pgmoneta_json_put(request, MANAGEMENT_ARGUMENT_END, (uintptr_t)(end != NULL ? end : ""), ValueString);
+
+   if (pgmoneta_management_write_json(ssl, socket, j))
+   {
+      goto error;
+   }
+
+   pgmoneta_json_destroy(j);
+
+   return 0;
+
+error:
+
+   pgmoneta_json_destroy(j);
+
+   return 1;
+}
+
 int
 pgmoneta_management_create_response(struct json* json, int server, struct json** response)
 {
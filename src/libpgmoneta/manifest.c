@@ -34,11 +34,14 @@
 #include <logging.h>
 #include <manifest.h>
 #include <security.h>
+#include <stream.h>
+#include <tar_storage.h>
 #include <utils.h>
 
 /* system */
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 static void
 build_deque(struct deque* deque, struct csv_reader* reader, char** f);
@@ -46,6 +49,12 @@ build_deque(struct deque* deque, struct csv_reader* reader, char** f);
 static void
 build_tree(struct art* tree, struct csv_reader* reader, char** f);
 
+static int
+checksum_verify_tar(char* root, struct json_reader* reader);
+
+static int
+checksum_verify_member(char* path, struct tar_storage_member* member, struct tar_storage_reader* reader, void* data);
+
 int
 pgmoneta_manifest_checksum_verify(char* root)
 {
@@ -72,6 +81,15 @@ pgmoneta_manifest_checksum_verify(char* root)
       pgmoneta_log_error("cannot locate files array in manifest %s", manifest_path);
       goto error;
    }
+   if (pgmoneta_tar_storage_exists(root))
+   {
+      if (checksum_verify_tar(root, reader))
+      {
+         goto error;
+      }
+      pgmoneta_json_reader_close(reader);
+      return 0;
+   }
    while (pgmoneta_json_next_array_item(reader, &file))
    {
       char file_path[MAX_PATH];
@@ -95,10 +113,17 @@ pgmoneta_manifest_checksum_verify(char* root)
       file_size_manifest = (int64_t)pgmoneta_json_get(file, "Size");
       if (file_size != file_size_manifest)
       {
-         pgmoneta_log_error("File size mismatch: %s, getting %lu, should be %lu", file_size, file_size_manifest);
+         pgmoneta_log_error("File size mismatch: %s, getting %lu, should be %lu", file_path, file_size, file_size_manifest);
       }
 
       algorithm = (char*)pgmoneta_json_get(file, "Checksum-Algorithm");
+      if (algorithm == NULL || !strcasecmp(algorithm, "NONE"))
+      {
+         pgmoneta_json_destroy(file);
+         file = NULL;
+         continue;
+      }
+
       if (pgmoneta_create_file_hash(pgmoneta_get_hash_algorithm(algorithm), file_path, &hash))
       {
          pgmoneta_log_error("Unable to generate hash for file %s with algorithm %s", file_path, algorithm);
@@ -363,3 +388,124 @@ build_tree(struct art* tree, struct csv_reader* reader, char** f)
       free(entry);
    }
 }
+
+/**
+ * Verify the files of a backup in the tar storage format. The stored
+ * tar files are read once, and each member is checked against the manifest
+ */
+static int
+checksum_verify_tar(char* root, struct json_reader* reader)
+{
+   char* path = NULL;
+   struct json* file = NULL;
+   struct art* files = NULL;
+   struct art_iterator* iter = NULL;
+   bool missing = false;
+
+   if (pgmoneta_art_create(&files))
+   {
+      goto error;
+   }
+
+   while (pgmoneta_json_next_array_item(reader, &file))
+   {
+      path = (char*)pgmoneta_json_get(file, "Path");
+      pgmoneta_art_insert(files, (unsigned char*)path, strlen(path) + 1, (uintptr_t)file, ValueJSON);
+      file = NULL;
+   }
+
+   if (pgmoneta_tar_storage_foreach(root, checksum_verify_member, files))
+   {
+      goto error;
+   }
+
+   pgmoneta_art_iterator_create(files, &iter);
+   while (pgmoneta_art_iterator_next(iter))
+   {
+      pgmoneta_log_error("File missing from the tar files: %s", (char*)iter->key);
+      missing = true;
+   }
+   pgmoneta_art_iterator_destroy(iter);
+
+   pgmoneta_art_destroy(files);
+
+   return missing ? 1 : 0;
+
+error:
+   pgmoneta_art_destroy(files);
+   pgmoneta_json_destroy(file);
+   return 1;
+}
+
+static int
+checksum_verify_member(char* path, struct tar_storage_member* member, struct tar_storage_reader* reader, void* data)
+{
+   char buffer[8192];
+   size_t length = 0;
+   size_t file_size_manifest = 0;
+   char* hash = NULL;
+   char* algorithm = NULL;
+   char* checksum = NULL;
+   struct json* file = NULL;
+   struct stream_hash* h = NULL;
+   struct art* files = (struct art*)data;
+
+   if (member->type != '0' && member->type != '7')
+   {
+      return 0;
+   }
+
+   file = (struct json*)pgmoneta_art_search(files, (unsigned char*)path, strlen(path) + 1);
+   if (file == NULL)
+   {
+      return 0;
+   }
+
+   file_size_manifest = (int64_t)pgmoneta_json_get(file, "Size");
+   if (member->size != file_size_manifest)
+   {
+      pgmoneta_log_error("File size mismatch: %s, getting %lu, should be %lu", path, member->size, file_size_manifest);
+   }
+
+   algorithm = (char*)pgmoneta_json_get(file, "Checksum-Algorithm");
+   if (algorithm != NULL && strcasecmp(algorithm, "NONE"))
+   {
+      if (pgmoneta_stream_hash_init(pgmoneta_get_hash_algorithm(algorithm), &h))
+      {
+         goto error;
+      }
+
+      do
+      {
+         if (pgmoneta_tar_storage_reader_read(reader, buffer, sizeof(buffer), &length) ||
+             pgmoneta_stream_hash_update(h, buffer, length))
+         {
+            goto error;
+         }
+      }
+      while (length > 0);
+
+      if (pgmoneta_stream_hash_final(h, &hash))
+      {
+         pgmoneta_log_error("Unable to generate hash for file %s with algorithm %s", path, algorithm);
+         goto error;
+      }
+
+      checksum = (char*)pgmoneta_json_get(file, "Checksum");
+      if (!pgmoneta_compare_string(hash, checksum))
+      {
+         pgmoneta_log_error("File checksum mismatch, path: %s. Getting %s, should be %s", path, hash, checksum);
+      }
+   }
+
+   pgmoneta_art_delete(files, (unsigned char*)path, strlen(path) + 1);
+
+   pgmoneta_stream_hash_destroy(h);
+   free(hash);
+   return 0;
+
+error:
+   pgmoneta_stream_hash_destroy(h);
+   free(hash);
+   return 1;
+}
@@ -36,6 +36,7 @@
 #include <message.h>
 #include <network.h>
 #include <security.h>
+#include <tar_storage.h>
 #include <utils.h>
 
 #include <assert.h>
@@ -2219,9 +2220,13 @@ pgmoneta_receive_archive_files(SSL* ssl, int socket, struct stream_buffer* buffe
    char link_path[MAX_PATH];
    char null_buffer[2 * 512]; // 2 tar block size of terminator null bytes
    FILE* file = NULL;
+   struct tar_storage_writer* writer = NULL;
    struct query_response* response = NULL;
    struct message* msg = (struct message*)malloc(sizeof (struct message));
    struct tuple* tup = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
 
    memset(msg, 0, sizeof (struct message));
 
@@ -2235,6 +2240,7 @@ pgmoneta_receive_archive_files(SSL* ssl, int socket, struct stream_buffer* buffe
    {
       char file_path[MAX_PATH];
       char directory[MAX_PATH];
+      char* name = "base";
       memset(file_path, 0, sizeof(file_path));
       memset(directory, 0, sizeof(directory));
       if (tup->data[1] == NULL)
@@ -2264,6 +2270,7 @@ pgmoneta_receive_archive_files(SSL* ssl, int socket, struct stream_buffer* buffe
             }
             tblspc = tblspc->next;
          }
+         name = tblspc->name;
          if (pgmoneta_ends_with(basedir, "/"))
          {
             snprintf(file_path, sizeof(file_path), "%stblspc_%s/%s.tar", basedir, tblspc->name, tblspc->name);
@@ -2276,11 +2283,22 @@ pgmoneta_receive_archive_files(SSL* ssl, int socket, struct stream_buffer* buffe
          }
       }
       pgmoneta_mkdir(directory);
-      file = fopen(file_path, "wb");
-      if (file == NULL)
+      if (config->storage_format == STORAGE_FORMAT_TAR)
       {
-         pgmoneta_log_error("Could not create archive tar file");
-         goto error;
+         if (pgmoneta_tar_storage_writer_init(directory, name, &writer))
+         {
+            pgmoneta_log_error("Could not create archive tar file");
+            goto error;
+         }
+      }
+      else
+      {
+         file = fopen(file_path, "wb");
+         if (file == NULL)
+         {
+            pgmoneta_log_error("Could not create archive tar file");
+            goto error;
+         }
       }
       // get the copy out response
       while (msg == NULL || msg->kind != 'H')
@@ -2290,8 +2308,6 @@ pgmoneta_receive_archive_files(SSL* ssl, int socket, struct stream_buffer* buffe
          {
             pgmoneta_log_copyfail_message(msg);
             pgmoneta_log_error_response_message(msg);
-            fflush(file);
-            fclose(file);
             goto error;
          }
          pgmoneta_consume_copy_stream_end(buffer, msg);
@@ -2303,8 +2319,6 @@ pgmoneta_receive_archive_files(SSL* ssl, int socket, struct stream_buffer* buffe
          {
             pgmoneta_log_copyfail_message(msg);
             pgmoneta_log_error_response_message(msg);
-            fflush(file);
-            fclose(file);
             goto error;
          }
 
@@ -2327,31 +2341,49 @@ pgmoneta_receive_archive_files(SSL* ssl, int socket, struct stream_buffer* buffe
             }
 
             // copy data
-            if (fwrite(msg->data, msg->length, 1, file) != 1)
+            if (writer != NULL)
+            {
+               if (pgmoneta_tar_storage_writer_write(writer, msg->data, msg->length))
+               {
+                  pgmoneta_log_error("could not write to file %s", file_path);
+                  goto error;
+               }
+            }
+            else if (fwrite(msg->data, msg->length, 1, file) != 1)
             {
                pgmoneta_log_error("could not write to file %s", file_path);
-               fflush(file);
-               fclose(file);
                goto error;
             }
          }
          pgmoneta_consume_copy_stream_end(buffer, msg);
       }
-      //append two blocks of null bytes to the end of the tar file
-      memset(null_buffer, 0, 2 * 512);
-      if (fwrite(null_buffer, 2 * 512, 1, file) != 1)
+      if (writer != NULL)
       {
-         pgmoneta_log_error("could not write to file %s", file_path);
+         // the tar file is kept, and completed with an index
+         if (pgmoneta_tar_storage_writer_destroy(writer))
+         {
+            writer = NULL;
+            goto error;
+         }
+         writer = NULL;
+      }
+      else
+      {
+         //append two blocks of null bytes to the end of the tar file
+         memset(null_buffer, 0, 2 * 512);
+         if (fwrite(null_buffer, 2 * 512, 1, file) != 1)
+         {
+            pgmoneta_log_error("could not write to file %s", file_path);
+            goto error;
+         }
          fflush(file);
          fclose(file);
-         goto error;
-      }
-      fflush(file);
-      fclose(file);
+         file = NULL;
 
-      // extract the file
-      pgmoneta_extract_tar_file(file_path, directory);
-      remove(file_path);
+         // extract the file
+         pgmoneta_extract_tar_file(file_path, directory);
+         remove(file_path);
+      }
       pgmoneta_free_message(msg);
 
       msg = NULL;
@@ -2370,6 +2402,18 @@ pgmoneta_receive_archive_files(SSL* ssl, int socket, struct stream_buffer* buffe
       memset(link_path, 0, sizeof(link_path));
       memset(directory, 0, sizeof(directory));
 
+      if (pgmoneta_ends_with(basedir, "/"))
+      {
+         snprintf(directory, sizeof(directory), "%sdata/pg_tblspc/", basedir);
+      }
+      else
+      {
+         snprintf(directory, sizeof(directory), "%s/data/pg_tblspc/", basedir);
+      }
+      pgmoneta_mkdir(directory);
+
+      memset(directory, 0, sizeof(directory));
+
       if (pgmoneta_ends_with(basedir, "/"))
       {
          snprintf(link_path, sizeof(link_path), "%sdata/pg_tblspc/%d", basedir, tblspc->oid);
@@ -2413,6 +2457,12 @@ error:
    {
       pgmoneta_disconnect(socket);
    }
+   if (file != NULL)
+   {
+      fflush(file);
+      fclose(file);
+   }
+   pgmoneta_tar_storage_writer_abort(writer);
    pgmoneta_free_query_response(response);
    pgmoneta_free_message(msg);
    return 1;
@@ -2439,6 +2489,10 @@ pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buff
    memset(null_buffer, 0, 2 * 512);
    char type;
    FILE* file = NULL;
+   struct tar_storage_writer* writer = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
 
    if (msg == NULL)
    {
@@ -2481,7 +2535,17 @@ pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buff
             case 'n':
             {
                // append two blocks of null buffer and extract the tar file
-               if (file != NULL)
+               if (writer != NULL)
+               {
+                  // the tar file is kept, and completed with an index
+                  if (pgmoneta_tar_storage_writer_destroy(writer))
+                  {
+                     writer = NULL;
+                     goto error;
+                  }
+                  writer = NULL;
+               }
+               else if (file != NULL)
                {
                   if ((!is_server_side_compression()) && fwrite(null_buffer, 2 * 512, 1, file) != 1)
                   {
@@ -2499,6 +2563,7 @@ pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buff
                }
                // new tablespace or main directory tar file
                char* archive_name = pgmoneta_read_string(msg->data + 1);
+               char* name = "base";
                char* archive_path = pgmoneta_read_string(msg->data + 1 + strlen(archive_name) + 1);
 
                memset(file_path, 0, sizeof(file_path));
@@ -2540,6 +2605,7 @@ pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buff
                      }
                      tblspc = tblspc->next;
                   }
+                  name = tblspc->name;
                   if (pgmoneta_ends_with(basedir, "/"))
                   {
                      snprintf(file_path, sizeof(file_path), "%stblspc_%s/%s.tar", basedir, tblspc->name, tblspc->name);
@@ -2552,18 +2618,39 @@ pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buff
                   }
                }
                pgmoneta_mkdir(directory);
-               file = fopen(file_path, "wb");
-               if (file == NULL)
+               if (config->storage_format == STORAGE_FORMAT_TAR)
                {
-                  pgmoneta_log_error("Could not create archive tar file");
-                  goto error;
+                  if (pgmoneta_tar_storage_writer_init(directory, name, &writer))
+                  {
+                     pgmoneta_log_error("Could not create archive tar file");
+                     goto error;
+                  }
+               }
+               else
+               {
+                  file = fopen(file_path, "wb");
+                  if (file == NULL)
+                  {
+                     pgmoneta_log_error("Could not create archive tar file");
+                     goto error;
+                  }
                }
                break;
             }
             case 'm':
             {
                // start of manifest, finish off previous data archive receiving
-               if (file != NULL)
+               if (writer != NULL)
+               {
+                  // the tar file is kept, and completed with an index
+                  if (pgmoneta_tar_storage_writer_destroy(writer))
+                  {
+                     writer = NULL;
+                     goto error;
+                  }
+                  writer = NULL;
+               }
+               else if (file != NULL)
                {
                   if ((!is_server_side_compression()) && fwrite(null_buffer, 2 * 512, 1, file) != 1)
                   {
@@ -2615,7 +2702,15 @@ pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buff
                   }
                }
 
-               if (fwrite(msg->data + 1, msg->length - 1, 1, file) != 1)
+               if (writer != NULL)
+               {
+                  if (pgmoneta_tar_storage_writer_write(writer, msg->data + 1, msg->length - 1))
+                  {
+                     pgmoneta_log_error("could not write to file %s", file_path);
+                     goto error;
+                  }
+               }
+               else if (fwrite(msg->data + 1, msg->length - 1, 1, file) != 1)
                {
                   pgmoneta_log_error("could not write to file %s", file_path);
                   goto error;
@@ -2658,6 +2753,16 @@ pgmoneta_receive_archive_stream(SSL* ssl, int socket, struct stream_buffer* buff
       memset(link_path, 0, sizeof(link_path));
       memset(directory, 0, sizeof(directory));
       if (pgmoneta_ends_with(basedir, "/"))
+      {
+         snprintf(directory, sizeof(directory), "%sdata/pg_tblspc/", basedir);
+      }
+      else
+      {
+         snprintf(directory, sizeof(directory), "%s/data/pg_tblspc/", basedir);
+      }
+      pgmoneta_mkdir(directory);
+      memset(directory, 0, sizeof(directory));
+      if (pgmoneta_ends_with(basedir, "/"))
       {
          snprintf(link_path, sizeof(link_path), "%sdata/pg_tblspc/%d", basedir, tblspc->oid);
          snprintf(directory, sizeof(directory), "%stblspc_%s/", basedir, tblspc->name);
@@ -2704,6 +2809,7 @@ error:
       fflush(file);
       fclose(file);
    }
+   pgmoneta_tar_storage_writer_abort(writer);
    pgmoneta_free_query_response(response);
    pgmoneta_free_message(msg);
    return 1;
@@ -37,6 +37,8 @@
 #include <shmem.h>
 #include <utils.h>
 #include <wal.h>
+#include <walfile/wal_reader.h>
+#include <walfile/wal_stats.h>
 
 /* system */
 #include <ev.h>
@@ -62,6 +64,8 @@ static int bad_request(int client_fd);
 static void general_information(int client_fd);
 static void backup_information(int client_fd);
 static void size_information(int client_fd);
+static void wal_stats_information(int client_fd);
+static uint64_t wal_stats_value(struct wal_stats_counter* counter, int metric);
 
 static int send_chunk(int client_fd, char* data);
 
@@ -381,6 +385,48 @@ home_page(int client_fd)
    data = pgmoneta_append(data, "  <h2>pgmoneta_server_last_failed_operation_time</h2>\n");
    data = pgmoneta_append(data, "  The time of the latest failed client operation of a server \n");
    data = pgmoneta_append(data, "  <p>\n");
+   data = pgmoneta_append(data, "  <h2>pgmoneta_wal_verified_segments</h2>\n");
+   data = pgmoneta_append(data, "  The count of verified WAL segments of a server\n");
+   data = pgmoneta_append(data, "  <p>\n");
+   data = pgmoneta_append(data, "  <h2>pgmoneta_wal_corrupt_segments</h2>\n");
+   data = pgmoneta_append(data, "  The count of corrupt WAL segments of a server\n");
+   data = pgmoneta_append(data, "  <p>\n");
+   data = pgmoneta_append(data, "  <h2>pgmoneta_wal_decoded_records</h2>\n");
+   data = pgmoneta_append(data, "  The count of WAL records decoded from the replication stream of a server\n");
+   data = pgmoneta_append(data, "  <p>\n");
+   data = pgmoneta_append(data, "  <h2>pgmoneta_wal_decoded_bytes</h2>\n");
+   data = pgmoneta_append(data, "  The bytes of WAL records decoded from the replication stream of a server, without full page images\n");
+   data = pgmoneta_append(data, "  <p>\n");
+   data = pgmoneta_append(data, "  <h2>pgmoneta_wal_decoded_fpi_bytes</h2>\n");
+   data = pgmoneta_append(data, "  The bytes of full page images decoded from the replication stream of a server\n");
+   data = pgmoneta_append(data, "  <p>\n");
+   data = pgmoneta_append(data, "  <h2>pgmoneta_wal_decode_errors</h2>\n");
+   data = pgmoneta_append(data, "  The count of errors decoding the replication stream of a server\n");
+   data = pgmoneta_append(data, "  <p>\n");
+   data = pgmoneta_append(data, "  <h2>pgmoneta_wal_last_commit_time</h2>\n");
+   data = pgmoneta_append(data, "  The time of the latest commit decoded from the replication stream of a server in seconds since the epoch\n");
+   data = pgmoneta_append(data, "  <p>\n");
+   data = pgmoneta_append(data, "  <h2>pgmoneta_wal_missing_segments</h2>\n");
+   data = pgmoneta_append(data, "  The count of missing WAL segments in the WAL index of a server\n");
+   data = pgmoneta_append(data, "  <p>\n");
+   data = pgmoneta_append(data, "  <h2>pgmoneta_wal_records</h2>\n");
+   data = pgmoneta_append(data, "  The count of archived WAL records of a server by resource manager\n");
+   data = pgmoneta_append(data, "  <p>\n");
+   data = pgmoneta_append(data, "  <h2>pgmoneta_wal_record_bytes</h2>\n");
+   data = pgmoneta_append(data, "  The bytes of archived WAL records of a server by resource manager, without full page images\n");
+   data = pgmoneta_append(data, "  <p>\n");
+   data = pgmoneta_append(data, "  <h2>pgmoneta_wal_fpi_bytes</h2>\n");
+   data = pgmoneta_append(data, "  The bytes of archived full page images of a server by resource manager\n");
+   data = pgmoneta_append(data, "  <p>\n");
+   data = pgmoneta_append(data, "  <h2>pgmoneta_wal_database_records</h2>\n");
+   data = pgmoneta_append(data, "  The count of archived WAL records of a server by database\n");
+   data = pgmoneta_append(data, "  <p>\n");
+   data = pgmoneta_append(data, "  <h2>pgmoneta_wal_database_record_bytes</h2>\n");
+   data = pgmoneta_append(data, "  The bytes of block data of archived WAL records of a server by database\n");
+   data = pgmoneta_append(data, "  <p>\n");
+   data = pgmoneta_append(data, "  <h2>pgmoneta_wal_database_fpi_bytes</h2>\n");
+   data = pgmoneta_append(data, "  The bytes of archived full page images of a server by database\n");
+   data = pgmoneta_append(data, "  <p>\n");
    data = pgmoneta_append(data, "  <h2>pgmoneta_wal_shipping</h2>\n");
    data = pgmoneta_append(data, "  The disk space used for WAL shipping for a server\n");
    data = pgmoneta_append(data, "  <p>\n");
@@ -933,6 +979,7 @@ retry_cache_locking:
          general_information(client_fd);
          backup_information(client_fd);
          size_information(client_fd);
+         wal_stats_information(client_fd);
 
          /* Footer */
          data = pgmoneta_append(data, "0\r\n\r\n");
@@ -1656,6 +1703,134 @@ general_information(int client_fd)
    }
    data = pgmoneta_append(data, "\n");
 
+   data = pgmoneta_append(data, "#HELP pgmoneta_wal_verified_segments The count of verified WAL segments of a server\n");
+   data = pgmoneta_append(data, "#TYPE pgmoneta_wal_verified_segments gauge\n");
+   for (int i = 0; i < config->number_of_servers; i++)
+   {
+      data = pgmoneta_append(data, "pgmoneta_wal_verified_segments{");
+
+      data = pgmoneta_append(data, "name=\"");
+      data = pgmoneta_append(data, config->servers[i].name);
+      data = pgmoneta_append(data, "\"} ");
+
+      data = pgmoneta_append_ulong(data, atomic_load(&config->servers[i].wal_verified_segments));
+
+      data = pgmoneta_append(data, "\n");
+   }
+   data = pgmoneta_append(data, "\n");
+
+   data = pgmoneta_append(data, "#HELP pgmoneta_wal_corrupt_segments The count of corrupt WAL segments of a server\n");
+   data = pgmoneta_append(data, "#TYPE pgmoneta_wal_corrupt_segments gauge\n");
+   for (int i = 0; i < config->number_of_servers; i++)
+   {
+      data = pgmoneta_append(data, "pgmoneta_wal_corrupt_segments{");
+
+      data = pgmoneta_append(data, "name=\"");
+      data = pgmoneta_append(data, config->servers[i].name);
+      data = pgmoneta_append(data, "\"} ");
+
+      data = pgmoneta_append_ulong(data, atomic_load(&config->servers[i].wal_corrupt_segments));
+
+      data = pgmoneta_append(data, "\n");
+   }
+   data = pgmoneta_append(data, "\n");
+
+   data = pgmoneta_append(data, "#HELP pgmoneta_wal_decoded_records The count of WAL records decoded from the replication stream of a server\n");
+   data = pgmoneta_append(data, "#TYPE pgmoneta_wal_decoded_records counter\n");
+   for (int i = 0; i < config->number_of_servers; i++)
+   {
+      data = pgmoneta_append(data, "pgmoneta_wal_decoded_records{");
+
+      data = pgmoneta_append(data, "name=\"");
+      data = pgmoneta_append(data, config->servers[i].name);
+      data = pgmoneta_append(data, "\"} ");
+
+      data = pgmoneta_append_ulong(data, atomic_load(&config->servers[i].wal_decoded_records));
+
+      data = pgmoneta_append(data, "\n");
+   }
+   data = pgmoneta_append(data, "\n");
+
+   data = pgmoneta_append(data, "#HELP pgmoneta_wal_decoded_bytes The bytes of WAL records decoded from the replication stream of a server, without full page images\n");
+   data = pgmoneta_append(data, "#TYPE pgmoneta_wal_decoded_bytes counter\n");
+   for (int i = 0; i < config->number_of_servers; i++)
+   {
+      data = pgmoneta_append(data, "pgmoneta_wal_decoded_bytes{");
+
+      data = pgmoneta_append(data, "name=\"");
+      data = pgmoneta_append(data, config->servers[i].name);
+      data = pgmoneta_append(data, "\"} ");
+
+      data = pgmoneta_append_ulong(data, atomic_load(&config->servers[i].wal_decoded_bytes));
+
+      data = pgmoneta_append(data, "\n");
+   }
+   data = pgmoneta_append(data, "\n");
+
+   data = pgmoneta_append(data, "#HELP pgmoneta_wal_decoded_fpi_bytes The bytes of full page images decoded from the replication stream of a server\n");
+   data = pgmoneta_append(data, "#TYPE pgmoneta_wal_decoded_fpi_bytes counter\n");
+   for (int i = 0; i < config->number_of_servers; i++)
+   {
+      data = pgmoneta_append(data, "pgmoneta_wal_decoded_fpi_bytes{");
+
+      data = pgmoneta_append(data, "name=\"");
+      data = pgmoneta_append(data, config->servers[i].name);
+      data = pgmoneta_append(data, "\"} ");
+
+      data = pgmoneta_append_ulong(data, atomic_load(&config->servers[i].wal_decoded_fpi_bytes));
+
+      data = pgmoneta_append(data, "\n");
+   }
+   data = pgmoneta_append(data, "\n");
+
+   data = pgmoneta_append(data, "#HELP pgmoneta_wal_decode_errors The count of errors decoding the replication stream of a server\n");
+   data = pgmoneta_append(data, "#TYPE pgmoneta_wal_decode_errors counter\n");
+   for (int i = 0; i < config->number_of_servers; i++)
+   {
+      data = pgmoneta_append(data, "pgmoneta_wal_decode_errors{");
+
+      data = pgmoneta_append(data, "name=\"");
+      data = pgmoneta_append(data, config->servers[i].name);
+      data = pgmoneta_append(data, "\"} ");
+
+      data = pgmoneta_append_ulong(data, atomic_load(&config->servers[i].wal_decode_errors));
+
+      data = pgmoneta_append(data, "\n");
+   }
+   data = pgmoneta_append(data, "\n");
+
+   data = pgmoneta_append(data, "#HELP pgmoneta_wal_last_commit_time The time of the latest commit decoded from the replication stream of a server in seconds since the epoch\n");
+   data = pgmoneta_append(data, "#TYPE pgmoneta_wal_last_commit_time gauge\n");
+   for (int i = 0; i < config->number_of_servers; i++)
+   {
+      data = pgmoneta_append(data, "pgmoneta_wal_last_commit_time{");
+
+      data = pgmoneta_append(data, "name=\"");
+      data = pgmoneta_append(data, config->servers[i].name);
+      data = pgmoneta_append(data, "\"} ");
+
+      data = pgmoneta_append_ulong(data, (unsigned long)atomic_load(&config->servers[i].wal_last_commit_time));
+
+      data = pgmoneta_append(data, "\n");
+   }
+   data = pgmoneta_append(data, "\n");
+
+   data = pgmoneta_append(data, "#HELP pgmoneta_wal_missing_segments The count of missing WAL segments in the WAL index of a server\n");
+   data = pgmoneta_append(data, "#TYPE pgmoneta_wal_missing_segments gauge\n");
+   for (int i = 0; i < config->number_of_servers; i++)
+   {
+      data = pgmoneta_append(data, "pgmoneta_wal_missing_segments{");
+
+      data = pgmoneta_append(data, "name=\"");
+      data = pgmoneta_append(data, config->servers[i].name);
+      data = pgmoneta_append(data, "\"} ");
+
+      data = pgmoneta_append_ulong(data, atomic_load(&config->servers[i].wal_missing_segments));
+
+      data = pgmoneta_append(data, "\n");
+   }
+   data = pgmoneta_append(data, "\n");
+
    if (data != NULL)
    {
       send_chunk(client_fd, data);
@@ -1665,6 +1840,148 @@ general_information(int client_fd)
    }
 }
 
+static void
+wal_stats_information(int client_fd)
+{
+   char* data = NULL;
+   char* name = NULL;
+   struct wal_stats* stats[NUMBER_OF_SERVERS];
+   struct wal_stats_counter sum;
+   struct configuration* config;
+   char* rmgr_metrics[] = {"pgmoneta_wal_records", "pgmoneta_wal_record_bytes", "pgmoneta_wal_fpi_bytes"};
+   char* rmgr_help[] = {"#HELP pgmoneta_wal_records The count of archived WAL records of a server by resource manager\n",
+                        "#HELP pgmoneta_wal_record_bytes The bytes of archived WAL records of a server by resource manager, without full page images\n",
+                        "#HELP pgmoneta_wal_fpi_bytes The bytes of archived full page images of a server by resource manager\n"};
+   char* database_metrics[] = {"pgmoneta_wal_database_records", "pgmoneta_wal_database_record_bytes", "pgmoneta_wal_database_fpi_bytes"};
+   char* database_help[] = {"#HELP pgmoneta_wal_database_records The count of archived WAL records of a server by database\n",
+                            "#HELP pgmoneta_wal_database_record_bytes The bytes of block data of archived WAL records of a server by database\n",
+                            "#HELP pgmoneta_wal_database_fpi_bytes The bytes of archived full page images of a server by database\n"};
+
+   config = (struct configuration*)shmem;
+
+   if (!config->wal_stats)
+   {
+      return;
+   }
+
+   for (int i = 0; i < config->number_of_servers; i++)
+   {
+      stats[i] = NULL;
+      pgmoneta_wal_stats_read(i, &stats[i]);
+   }
+
+   for (int metric = 0; metric < 3; metric++)
+   {
+      data = pgmoneta_append(data, rmgr_help[metric]);
+      data = pgmoneta_append(data, "#TYPE ");
+      data = pgmoneta_append(data, rmgr_metrics[metric]);
+      data = pgmoneta_append(data, " counter\n");
+      for (int i = 0; i < config->number_of_servers; i++)
+      {
+         if (stats[i] == NULL)
+         {
+            continue;
+         }
+
+         for (int rmid = 0; rmid < RM_NEXT_ID; rmid++)
+         {
+            memset(&sum, 0, sizeof(struct wal_stats_counter));
+            for (int type = 0; type < WAL_STATS_RECORD_TYPES; type++)
+            {
+               sum.records += stats[i]->rmgrs[rmid][type].records;
+               sum.record_bytes += stats[i]->rmgrs[rmid][type].record_bytes;
+               sum.fpi_bytes += stats[i]->rmgrs[rmid][type].fpi_bytes;
+            }
+
+            if (sum.records == 0)
+            {
+               continue;
+            }
+
+            name = pgmoneta_wal_get_rmgr_name((uint8_t)rmid);
+
+            data = pgmoneta_append(data, rmgr_metrics[metric]);
+            data = pgmoneta_append(data, "{");
+
+            data = pgmoneta_append(data, "name=\"");
+            data = pgmoneta_append(data, config->servers[i].name);
+            data = pgmoneta_append(data, "\",");
+
+            data = pgmoneta_append(data, "rmgr=\"");
+            data = pgmoneta_append(data, name != NULL ? name : "");
+            data = pgmoneta_append(data, "\"} ");
+
+            data = pgmoneta_append_ulong(data, wal_stats_value(&sum, metric));
+
+            data = pgmoneta_append(data, "\n");
+         }
+      }
+      data = pgmoneta_append(data, "\n");
+   }
+
+   for (int metric = 0; metric < 3; metric++)
+   {
+      data = pgmoneta_append(data, database_help[metric]);
+      data = pgmoneta_append(data, "#TYPE ");
+      data = pgmoneta_append(data, database_metrics[metric]);
+      data = pgmoneta_append(data, " counter\n");
+      for (int i = 0; i < config->number_of_servers; i++)
+      {
+         if (stats[i] == NULL)
+         {
+            continue;
+         }
+
+         for (uint32_t j = 0; j < stats[i]->number_of_databases; j++)
+         {
+            data = pgmoneta_append(data, database_metrics[metric]);
+            data = pgmoneta_append(data, "{");
+
+            data = pgmoneta_append(data, "name=\"");
+            data = pgmoneta_append(data, config->servers[i].name);
+            data = pgmoneta_append(data, "\",");
+
+            data = pgmoneta_append(data, "database=\"");
+            data = pgmoneta_append_ulong(data, stats[i]->databases[j].dbOid);
+            data = pgmoneta_append(data, "\"} ");
+
+            data = pgmoneta_append_ulong(data, wal_stats_value(&stats[i]->databases[j].counter, metric));
+
+            data = pgmoneta_append(data, "\n");
+         }
+      }
+      data = pgmoneta_append(data, "\n");
+   }
+
+   if (data != NULL)
+   {
+      send_chunk(client_fd, data);
+      metrics_cache_append(data);
+      free(data);
+      data = NULL;
+   }
+
+   for (int i = 0; i < config->number_of_servers; i++)
+   {
+      pgmoneta_wal_stats_destroy(stats[i]);
+   }
+}
+
+static uint64_t
+wal_stats_value(struct wal_stats_counter* counter, int metric)
+{
+   if (metric == 0)
+   {
+      return counter->records;
+   }
+   else if (metric == 1)
+   {
+      return counter->record_bytes;
+   }
+
+   return counter->fpi_bytes;
+}
+
 static void
 backup_information(int client_fd)
 {
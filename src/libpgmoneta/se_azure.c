@@ -28,6 +28,7 @@
 
 /* pgmoneta */
 #include <pgmoneta.h>
+#include <deque.h>
 #include <dirent.h>
 #include <http.h>
 #include <info.h>
@@ -38,31 +39,137 @@
 #include <utils.h>
 
 /* system */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define AZURE_VERSION      "2021-08-06"
+#define AZURE_BLOCK_SIZE   (8 * 1024 * 1024)
+#define AZURE_MAX_RETRIES  3
+#define AZURE_EMPTY_MARKER "/.pgmoneta"
+
+#define AZURE_PUT_BLOB       0
+#define AZURE_PUT_BLOCK      1
+#define AZURE_PUT_BLOCK_LIST 2
+#define AZURE_GET_BLOB       3
+
+/** @struct azure_file
+ * Defines a file that is uploaded or downloaded
+ */
+struct azure_file
+{
+   char* relative_path;  /**< The path relative to the backup */
+   int fd;               /**< The file descriptor, or -1 for an empty file */
+   size_t size;          /**< The size */
+   int number_of_blocks; /**< The number of blocks, or 0 for a single request */
+   int next_block;       /**< The next block to send */
+   int completed_blocks; /**< The number of blocks that were stored */
+   int references;       /**< The number of requests and schedulers that use the file */
+};
+
+/** @struct azure_request
+ * Defines a request that is in flight
+ */
+struct azure_request
+{
+   int type;                    /**< The type of the request */
+   struct azure_file* file;     /**< The file */
+   int block;                   /**< The block */
+   size_t offset;               /**< The offset of the data in the file */
+   size_t length;               /**< The length of the data */
+   size_t position;             /**< The number of bytes that were sent */
+   char* body;                  /**< The body of a block list */
+   int retries;                 /**< The number of retries */
+   CURL* handle;                /**< The curl handle */
+   struct curl_slist* headers;  /**< The headers */
+   char* url;                   /**< The URL */
+};
+
+/** @struct azure_transfer
+ * Defines the upload or the download of a backup
+ */
+struct azure_transfer
+{
+   char* local_root;           /**< The local root */
+   char* azure_root;           /**< The root in the container */
+   char* endpoint;             /**< The endpoint including the container */
+   char* resource;             /**< The canonicalized resource of the container */
+   char* signing_key;          /**< The decoded shared key */
+   size_t signing_key_length;  /**< The length of the decoded shared key */
+   struct deque* files;        /**< The files that are left */
+   struct azure_file* current; /**< The file whose blocks are being transferred */
+   CURLM* multi;               /**< The multi handle */
+   CURL** idle;                /**< The idle curl handles */
+   int number_of_idle;         /**< The number of idle curl handles */
+   int max_transfers;          /**< The maximum number of requests in flight */
+   int running;                /**< The number of requests in flight */
+   int number_of_files;        /**< The number of files */
+   int transferred;            /**< The number of files that were transferred */
+   uint64_t bytes;             /**< The number of bytes that were transferred */
+   bool download;              /**< Is it a download */
+   bool error;                 /**< Did the transfer fail */
+};
 
 static int azure_storage_setup(int, char*, struct deque*);
-static int azure_storage_execute(int, char*, struct deque*);
-static int azure_storage_teardown(int, char*, struct deque*);
-
-static int azure_upload_files(char* local_root, char* azure_root, char* relative_path);
-static int azure_send_upload_request(char* local_root, char* azure_root, char* relative_path);
-
-static char* azure_get_host(void);
+static int azure_storage_backup_execute(int, char*, struct deque*);
+static int azure_storage_fetch_execute(int, char*, struct deque*);
+static int azure_storage_backup_teardown(int, char*, struct deque*);
+static int azure_storage_fetch_teardown(int, char*, struct deque*);
+
+static int azure_upload_files(char* local_root, char* relative_path, struct deque* files);
+static int azure_download_files(struct azure_transfer* transfer);
+static int azure_prepare(int server, struct azure_transfer* transfer);
+static void azure_release(struct azure_transfer* transfer);
+static int azure_perform(int server, struct azure_transfer* transfer);
+static struct azure_request* azure_next_request(struct azure_transfer* transfer);
+static int azure_send_request(struct azure_transfer* transfer, struct azure_request* request);
+static void azure_complete_request(struct azure_transfer* transfer, CURL* handle, CURLcode result);
+static void azure_free_request(struct azure_transfer* transfer, struct azure_request* request);
+static void azure_release_file(struct azure_file* file);
+static char* azure_block_id(int block);
+static char* azure_sign(struct azure_transfer* transfer, char* verb, size_t content_length, char* headers, char* resource);
+static size_t azure_read(char* buffer, size_t size, size_t nitems, void* userdata);
+static size_t azure_write(char* buffer, size_t size, size_t nitems, void* userdata);
+static size_t azure_discard(char* buffer, size_t size, size_t nitems, void* userdata);
+
+static char* azure_get_endpoint(void);
 static char* azure_get_basepath(int server, char* identifier);
 
-static CURL* curl = NULL;
+static char* fetched_label = NULL;
 
 struct workflow*
-pgmoneta_storage_create_azure(void)
+pgmoneta_storage_create_azure(int workflow_type)
 {
    struct workflow* wf = NULL;
 
    wf = (struct workflow*)malloc(sizeof(struct workflow));
 
+   if (wf == NULL)
+   {
+      return NULL;
+   }
+
    wf->setup = &azure_storage_setup;
-   wf->execute = &azure_storage_execute;
-   wf->teardown = &azure_storage_teardown;
+
+   switch (workflow_type)
+   {
+      case WORKFLOW_TYPE_BACKUP:
+         wf->execute = &azure_storage_backup_execute;
+         wf->teardown = &azure_storage_backup_teardown;
+         break;
+      case WORKFLOW_TYPE_RESTORE:
+      case WORKFLOW_TYPE_VERIFY:
+         wf->execute = &azure_storage_fetch_execute;
+         wf->teardown = &azure_storage_fetch_teardown;
+         break;
+      default:
+         break;
+   }
    wf->next = NULL;
 
    return wf;
@@ -75,56 +182,178 @@ azure_storage_setup(int server, char* identifier, struct deque* nodes)
 
    config = (struct configuration*)shmem;
 
-   curl = curl_easy_init();
-   if (curl == NULL)
+   pgmoneta_log_debug("Azure storage engine (setup): %s/%s", config->servers[server].name, identifier);
+   pgmoneta_deque_list(nodes);
+
+   return 0;
+}
+
+static int
+azure_storage_backup_execute(int server, char* identifier, struct deque* nodes)
+{
+   char* local_root = NULL;
+   char* azure_root = NULL;
+   struct deque* files = NULL;
+   struct azure_transfer transfer;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   memset(&transfer, 0, sizeof(struct azure_transfer));
+
+   local_root = pgmoneta_get_server_backup_identifier(server, identifier);
+   azure_root = azure_get_basepath(server, identifier);
+
+   pgmoneta_log_debug("Azure storage engine (execute): %s/%s", config->servers[server].name, identifier);
+   pgmoneta_deque_list(nodes);
+
+   if (pgmoneta_deque_create(false, &files))
    {
       goto error;
    }
 
-   pgmoneta_log_debug("Azure storage engine (setup): %s/%s", config->servers[server].name, identifier);
-   pgmoneta_deque_list(nodes);
+   if (azure_upload_files(local_root, "", files))
+   {
+      goto error;
+   }
+
+   transfer.local_root = local_root;
+   transfer.azure_root = azure_root;
+   transfer.files = files;
+   transfer.number_of_files = (int)pgmoneta_deque_size(files);
+
+   if (azure_prepare(server, &transfer))
+   {
+      goto error;
+   }
+
+   if (azure_perform(server, &transfer))
+   {
+      goto error;
+   }
+
+   azure_release(&transfer);
+
+   pgmoneta_deque_destroy(files);
+
+   free(local_root);
+   free(azure_root);
 
    return 0;
 
 error:
+
+   azure_release(&transfer);
+
+   pgmoneta_deque_destroy(files);
+
+   free(local_root);
+   free(azure_root);
+
    return 1;
 }
 
 static int
-azure_storage_execute(int server, char* identifier, struct deque* nodes)
+azure_storage_fetch_execute(int server, char* identifier, struct deque* nodes)
 {
+   char* label = NULL;
    char* local_root = NULL;
    char* azure_root = NULL;
+   char* data = NULL;
+   bool local_backup = false;
+   struct deque* files = NULL;
+   struct azure_transfer transfer;
    struct configuration* config;
 
    config = (struct configuration*)shmem;
 
-   local_root = pgmoneta_get_server_backup_identifier(server, identifier);
-   azure_root = azure_get_basepath(server, identifier);
+   memset(&transfer, 0, sizeof(struct azure_transfer));
 
-   pgmoneta_log_debug("Azure storage engine (execute): %s/%s", config->servers[server].name, identifier);
+   pgmoneta_log_debug("Azure storage engine (fetch/execute): %s/%s", config->servers[server].name, identifier);
    pgmoneta_deque_list(nodes);
 
-   if (azure_upload_files(local_root, azure_root, ""))
+   if (pgmoneta_get_backup_label(server, identifier, &label))
+   {
+      pgmoneta_log_error("Azure storage engine: No identifier for %s/%s", config->servers[server].name, identifier);
+      goto error;
+   }
+
+   data = pgmoneta_get_server_backup_identifier_data(server, label);
+
+   /* The data of the backup is only removed once it is in the container */
+   if (pgmoneta_exists(data))
+   {
+      goto done;
+   }
+
+   local_root = pgmoneta_get_server_backup_identifier(server, label);
+   azure_root = azure_get_basepath(server, label);
+
+   local_backup = pgmoneta_exists(local_root);
+
+   if (pgmoneta_deque_create(false, &files))
+   {
+      goto error;
+   }
+
+   transfer.local_root = local_root;
+   transfer.azure_root = azure_root;
+   transfer.files = files;
+   transfer.download = true;
+
+   if (azure_prepare(server, &transfer))
+   {
+      goto error;
+   }
+
+   if (azure_download_files(&transfer))
+   {
+      goto error;
+   }
+
+   if (azure_perform(server, &transfer))
    {
       goto error;
    }
 
+   fetched_label = label;
+   label = NULL;
+
+done:
+
+   azure_release(&transfer);
+
+   pgmoneta_deque_destroy(files);
+
+   free(label);
    free(local_root);
    free(azure_root);
+   free(data);
 
    return 0;
 
 error:
 
+   /* A partial download is never used as a backup */
+   if (local_root != NULL)
+   {
+      pgmoneta_delete_directory(local_backup ? data : local_root);
+   }
+
+   azure_release(&transfer);
+
+   pgmoneta_deque_destroy(files);
+
+   free(label);
    free(local_root);
    free(azure_root);
+   free(data);
 
    return 1;
 }
 
 static int
-azure_storage_teardown(int server, char* identifier, struct deque* nodes)
+azure_storage_backup_teardown(int server, char* identifier, struct deque* nodes)
 {
    char* root = NULL;
    struct configuration* config;
@@ -135,8 +364,6 @@ azure_storage_teardown(int server, char* identifier, struct deque* nodes)
 
    pgmoneta_delete_directory(root);
 
-   curl_easy_cleanup(curl);
-
    pgmoneta_log_debug("Azure storage engine (teardown): %s/%s", config->servers[server].name, identifier);
    pgmoneta_deque_list(nodes);
 
@@ -146,11 +373,37 @@ azure_storage_teardown(int server, char* identifier, struct deque* nodes)
 }
 
 static int
-azure_upload_files(char* local_root, char* azure_root, char* relative_path)
+azure_storage_fetch_teardown(int server, char* identifier, struct deque* nodes)
+{
+   char* root = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   pgmoneta_log_debug("Azure storage engine (fetch/teardown): %s/%s", config->servers[server].name, identifier);
+   pgmoneta_deque_list(nodes);
+
+   /* The backup is back to the state after its upload */
+   if (fetched_label != NULL)
+   {
+      root = pgmoneta_get_server_backup_identifier_data(server, fetched_label);
+
+      pgmoneta_delete_directory(root);
+
+      free(fetched_label);
+      fetched_label = NULL;
+   }
+
+   free(root);
+
+   return 0;
+}
+
+static int
+azure_upload_files(char* local_root, char* relative_path, struct deque* files)
 {
    char* local_path = NULL;
    char* relative_file;
-   char* new_file;
    bool copied_files = false;
    DIR* dir;
    struct dirent* entry;
@@ -176,7 +429,10 @@ azure_upload_files(char* local_root, char* azure_root, char* relative_path)
 
          snprintf(relative_dir, sizeof(relative_dir), "%s/%s", relative_path, entry->d_name);
 
-         azure_upload_files(local_root, azure_root, relative_dir);
+         if (azure_upload_files(local_root, relative_dir, files))
+         {
+            goto error;
+         }
       }
       else
       {
@@ -188,41 +444,23 @@ azure_upload_files(char* local_root, char* azure_root, char* relative_path)
          relative_file = pgmoneta_append(relative_file, "/");
          relative_file = pgmoneta_append(relative_file, entry->d_name);
 
-         if (azure_send_upload_request(local_root, azure_root, relative_file))
-         {
-            free(relative_file);
-            goto error;
-         }
+         pgmoneta_deque_add(files, NULL, (uintptr_t)relative_file, ValueString);
 
          free(relative_file);
       }
    }
 
    // In case no files are copied, then the directory is empty.
-   // Create a .pgmoneta file for uploading.
+   // Upload an empty .pgmoneta file, so the directory exists.
    if (!copied_files)
    {
       relative_file = NULL;
 
       relative_file = pgmoneta_append(relative_file, relative_path);
-      relative_file = pgmoneta_append(relative_file, "/.pgmoneta");
-
-      new_file = NULL;
-
-      new_file = pgmoneta_append(new_file, local_root);
-      new_file = pgmoneta_append(new_file, relative_file);
-
-      FILE* file = fopen(new_file, "w");
+      relative_file = pgmoneta_append(relative_file, AZURE_EMPTY_MARKER);
 
-      pgmoneta_permission(new_file, 6, 4, 4);
+      pgmoneta_deque_add(files, NULL, (uintptr_t)relative_file, ValueString);
 
-      azure_send_upload_request(local_root, azure_root, relative_file);
-
-      fclose(file);
-
-      remove(new_file);
-
-      free(new_file);
       free(relative_file);
    }
 
@@ -234,7 +472,10 @@ azure_upload_files(char* local_root, char* azure_root, char* relative_path)
 
 error:
 
-   closedir(dir);
+   if (dir != NULL)
+   {
+      closedir(dir);
+   }
 
    free(local_path);
 
@@ -242,222 +483,1080 @@ error:
 }
 
 static int
-azure_send_upload_request(char* local_root, char* azure_root, char* relative_path)
+azure_download_files(struct azure_transfer* transfer)
 {
-   char utc_date[UTC_TIME_LENGTH];
-   char* string_to_sign = NULL;
-   char* signing_key = NULL;
-   char* signature = NULL;
-   char* base64_signature = NULL;
-   size_t base64_signature_length;
+   char* url = NULL;
+   char* prefix = NULL;
+   char* marker = NULL;
+   char* escaped_prefix = NULL;
+   char* escaped_marker = NULL;
+   char* resource = NULL;
+   char* headers = NULL;
+   char* authorization = NULL;
+   char* response = NULL;
+   char* position = NULL;
+   char* name = NULL;
+   char* length = NULL;
+   char* relative_path = NULL;
    char* local_path = NULL;
-   char* azure_path = NULL;
-   char* azure_host = NULL;
-   char* azure_url = NULL;
-   char* auth_value = NULL;
-   unsigned char* signature_hmac = NULL;
-   unsigned char* signature_hex = NULL;
-   int hmac_length = 0;
-   size_t signing_key_length = 0;
-   FILE* file = NULL;
-   struct stat file_info;
-   CURLcode res = -1;
+   char utc_date[UTC_TIME_LENGTH];
+   long code = 0;
+   int fd = -1;
+   int number_of_blobs = 0;
+   CURL* handle = NULL;
+   CURLcode res;
    struct curl_slist* chunk = NULL;
-   struct configuration* config;
-
-   config = (struct configuration*)shmem;
-
-   local_path = pgmoneta_append(local_path, local_root);
-   local_path = pgmoneta_append(local_path, relative_path);
 
-   azure_path = pgmoneta_append(azure_path, azure_root);
-   azure_path = pgmoneta_append(azure_path, relative_path);
+   prefix = pgmoneta_append(prefix, transfer->azure_root);
+   prefix = pgmoneta_append(prefix, "/");
 
-   memset(&utc_date[0], 0, sizeof(utc_date));
+   handle = curl_easy_init();
 
-   if (pgmoneta_get_timestamp_UTC_format(utc_date))
+   if (handle == NULL)
    {
       goto error;
    }
 
-   file = fopen(local_path, "rb");
-   if (file == NULL)
-   {
-      goto error;
-   }
+   escaped_prefix = curl_easy_escape(handle, prefix, 0);
 
-   if (fstat(fileno(file), &file_info) != 0)
+   if (escaped_prefix == NULL)
    {
       goto error;
    }
 
-   // Construct string to sign.
-   if (file_info.st_size == 0)
-   {
-      string_to_sign = pgmoneta_append(string_to_sign, "PUT\n\n\n\n\n\n\n\n\n\n\n\nx-ms-blob-type:BlockBlob\nx-ms-date:");
-   }
-   else
+   /* The blobs are listed in pages */
+   do
    {
-      string_to_sign = pgmoneta_append(string_to_sign, "PUT\n\n\n");
-      string_to_sign = pgmoneta_append(string_to_sign, (char*)file_info.st_size);
-      string_to_sign = pgmoneta_append(string_to_sign, "\n\n\n\n\n\n\n\n\nx-ms-blob-type:BlockBlob\nx-ms-date:");
-   }
+      memset(&utc_date[0], 0, sizeof(utc_date));
 
-   string_to_sign = pgmoneta_append(string_to_sign, utc_date);
-   string_to_sign = pgmoneta_append(string_to_sign, "\nx-ms-version:2021-08-06\n/");
-   string_to_sign = pgmoneta_append(string_to_sign, config->azure_storage_account);
-   string_to_sign = pgmoneta_append(string_to_sign, "/");
-   string_to_sign = pgmoneta_append(string_to_sign, config->azure_container);
-   string_to_sign = pgmoneta_append(string_to_sign, "/");
-   string_to_sign = pgmoneta_append(string_to_sign, azure_path);
+      if (pgmoneta_get_timestamp_UTC_format(utc_date))
+      {
+         goto error;
+      }
 
-   // Decode the Azure storage account shared key.
-   pgmoneta_base64_decode(config->azure_shared_key, strlen(config->azure_shared_key), (void**)&signing_key, &signing_key_length);
+      url = pgmoneta_append(url, transfer->endpoint);
+      url = pgmoneta_append(url, "?restype=container&comp=list&prefix=");
+      url = pgmoneta_append(url, escaped_prefix);
 
-   // Construct the signature.
-   if (pgmoneta_generate_string_hmac_sha256_hash(signing_key, signing_key_length, string_to_sign, strlen(string_to_sign), &signature_hmac, &hmac_length))
-   {
-      goto error;
-   }
+      resource = pgmoneta_append(resource, transfer->resource);
+      resource = pgmoneta_append(resource, "\ncomp:list");
 
-   // Encode the signature.
-   pgmoneta_base64_encode((char*) signature_hmac, hmac_length, &base64_signature, &base64_signature_length);
+      if (marker != NULL)
+      {
+         escaped_marker = curl_easy_escape(handle, marker, 0);
 
-   // Construct the authorization header.
-   auth_value = pgmoneta_append(auth_value, "SharedKey ");
-   auth_value = pgmoneta_append(auth_value, config->azure_storage_account);
-   auth_value = pgmoneta_append(auth_value, ":");
-   auth_value = pgmoneta_append(auth_value, base64_signature);
+         if (escaped_marker == NULL)
+         {
+            goto error;
+         }
 
-   chunk = pgmoneta_http_add_header(chunk, "Authorization", auth_value);
+         url = pgmoneta_append(url, "&marker=");
+         url = pgmoneta_append(url, escaped_marker);
 
-   chunk = pgmoneta_http_add_header(chunk, "x-ms-blob-type", "BlockBlob");
+         resource = pgmoneta_append(resource, "\nmarker:");
+         resource = pgmoneta_append(resource, marker);
 
-   chunk = pgmoneta_http_add_header(chunk, "x-ms-date", utc_date);
+         curl_free(escaped_marker);
+         escaped_marker = NULL;
+      }
 
-   chunk = pgmoneta_http_add_header(chunk, "x-ms-version", "2021-08-06");
+      resource = pgmoneta_append(resource, "\nprefix:");
+      resource = pgmoneta_append(resource, prefix);
+      resource = pgmoneta_append(resource, "\nrestype:container");
 
-   if (pgmoneta_http_set_header_option(curl, chunk))
-   {
-      goto error;
-   }
+      headers = pgmoneta_append(headers, "x-ms-date:");
+      headers = pgmoneta_append(headers, utc_date);
+      headers = pgmoneta_append(headers, "\nx-ms-version:");
+      headers = pgmoneta_append(headers, AZURE_VERSION);
+      headers = pgmoneta_append(headers, "\n");
+
+      authorization = azure_sign(transfer, "GET", 0, headers, resource);
+
+      if (authorization == NULL)
+      {
+         goto error;
+      }
+
+      chunk = pgmoneta_http_add_header(chunk, "Authorization", authorization);
+      chunk = pgmoneta_http_add_header(chunk, "x-ms-date", utc_date);
+      chunk = pgmoneta_http_add_header(chunk, "x-ms-version", AZURE_VERSION);
+
+      curl_easy_reset(handle);
+
+      pgmoneta_http_set_request_option(handle, HTTP_GET);
+      pgmoneta_http_set_url_option(handle, url);
+      pgmoneta_http_set_header_option(handle, chunk);
+      pgmoneta_http_set_response_option(handle, &response);
+
+      res = curl_easy_perform(handle);
+      curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+
+      if (res != CURLE_OK || code != 200 || response == NULL)
+      {
+         pgmoneta_log_error("Azure storage engine: Could not list %s (%s, %ld)", prefix, curl_easy_strerror(res), code);
+         goto error;
+      }
+
+      position = response;
+
+      while ((position = pgmoneta_http_xml_element(position, "Name", &name)) != NULL)
+      {
+         position = pgmoneta_http_xml_element(position, "Content-Length", &length);
+
+         if (position == NULL || !pgmoneta_starts_with(name, prefix))
+         {
+            goto error;
+         }
+
+         number_of_blobs++;
+
+         relative_path = pgmoneta_append(relative_path, name + strlen(transfer->azure_root));
+
+         local_path = pgmoneta_append(local_path, transfer->local_root);
+         local_path = pgmoneta_append(local_path, relative_path);
+
+         /* The directory of the file is created right away, as is an empty directory */
+         *strrchr(local_path, '/') = '\0';
+
+         if (pgmoneta_mkdir(local_path))
+         {
+            pgmoneta_log_error("Azure storage engine: Could not create %s: %s", local_path, strerror(errno));
+            goto error;
+         }
+
+         local_path[strlen(local_path)] = '/';
+
+         /* A file that is local is kept, as it is newer than the blob */
+         if (!pgmoneta_ends_with(relative_path, AZURE_EMPTY_MARKER) && !pgmoneta_exists(local_path))
+         {
+            if (strtoull(length, NULL, 10) == 0)
+            {
+               fd = open(local_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+               if (fd == -1)
+               {
+                  pgmoneta_log_error("Azure storage engine: Could not create %s: %s", local_path, strerror(errno));
+                  goto error;
+               }
+
+               close(fd);
+               fd = -1;
+            }
+            else
+            {
+               pgmoneta_deque_add(transfer->files, relative_path, (uintptr_t)strtoull(length, NULL, 10), ValueUInt64);
+            }
+         }
+
+         free(name);
+         name = NULL;
 
-   azure_host = azure_get_host();
+         free(length);
+         length = NULL;
 
-   azure_url = pgmoneta_append(azure_url, "https://");
-   azure_url = pgmoneta_append(azure_url, azure_host);
-   azure_url = pgmoneta_append(azure_url, "/");
-   azure_url = pgmoneta_append(azure_url, azure_path);
+         free(relative_path);
+         relative_path = NULL;
 
-   pgmoneta_http_set_request_option(curl, HTTP_PUT);
+         free(local_path);
+         local_path = NULL;
+      }
+
+      free(marker);
+      marker = NULL;
+
+      pgmoneta_http_xml_element(response, "NextMarker", &marker);
+
+      free(url);
+      url = NULL;
 
-   pgmoneta_http_set_url_option(curl, azure_url);
+      free(resource);
+      resource = NULL;
 
-   curl_easy_setopt(curl, CURLOPT_READDATA, (void*) file);
+      free(headers);
+      headers = NULL;
 
-   curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)file_info.st_size);
+      free(authorization);
+      authorization = NULL;
+
+      free(response);
+      response = NULL;
+
+      curl_slist_free_all(chunk);
+      chunk = NULL;
+   }
+   while (marker != NULL && strlen(marker) > 0);
 
-   res = curl_easy_perform(curl);
-   if (res != CURLE_OK)
+   if (number_of_blobs == 0)
    {
-      fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+      pgmoneta_log_error("Azure storage engine: No backup in %s", prefix);
       goto error;
    }
 
-   free(local_path);
-   free(azure_path);
-   free(azure_url);
-   free(azure_host);
-   free(signature);
-   free(base64_signature);
-   free(signature_hmac);
-   free(signature_hex);
-   free(string_to_sign);
-   free(auth_value);
+   transfer->number_of_files = (int)pgmoneta_deque_size(transfer->files);
 
-   curl_slist_free_all(chunk);
+   curl_free(escaped_prefix);
+   curl_easy_cleanup(handle);
+
+   free(prefix);
+   free(marker);
 
-   fclose(file);
    return 0;
 
 error:
 
-   if (local_path != NULL)
+   if (escaped_prefix != NULL)
    {
-      free(local_path);
+      curl_free(escaped_prefix);
    }
 
-   if (azure_path != NULL)
+   if (handle != NULL)
    {
-      free(azure_path);
+      curl_easy_cleanup(handle);
    }
 
-   if (azure_url != NULL)
-   {
-      free(azure_url);
-   }
+   curl_slist_free_all(chunk);
 
-   if (azure_host != NULL)
-   {
-      free(azure_host);
-   }
+   free(url);
+   free(prefix);
+   free(marker);
+   free(resource);
+   free(headers);
+   free(authorization);
+   free(response);
+   free(name);
+   free(length);
+   free(relative_path);
+   free(local_path);
 
-   if (signature != NULL)
-   {
-      free(signature);
-   }
+   return 1;
+}
 
-   if (base64_signature != NULL)
-   {
-      free(base64_signature);
-   }
+static int
+azure_prepare(int server, struct azure_transfer* transfer)
+{
+   char* path = NULL;
+   int number_of_workers;
+   struct configuration* config;
 
-   if (signature_hmac != NULL)
-   {
-      free(signature_hmac);
-   }
+   config = (struct configuration*)shmem;
 
-   if (signature_hex != NULL)
-   {
-      free(signature_hex);
-   }
+   /* The signing material is the same for every request */
+   transfer->endpoint = azure_get_endpoint();
 
-   if (string_to_sign != NULL)
-   {
-      free(string_to_sign);
-   }
+   path = strstr(transfer->endpoint, "://");
+   path = path != NULL ? strchr(path + 3, '/') : NULL;
 
-   if (auth_value != NULL)
-   {
-      free(auth_value);
-   }
+   transfer->resource = pgmoneta_append(transfer->resource, "/");
+   transfer->resource = pgmoneta_append(transfer->resource, config->azure_storage_account);
+   transfer->resource = pgmoneta_append(transfer->resource, path != NULL ? path : "");
 
-   if (chunk != NULL)
-   {
-      curl_slist_free_all(chunk);
-   }
+   transfer->endpoint = pgmoneta_append(transfer->endpoint, "/");
+   transfer->endpoint = pgmoneta_append(transfer->endpoint, config->azure_container);
 
-   if (file != NULL)
+   transfer->resource = pgmoneta_append(transfer->resource, "/");
+   transfer->resource = pgmoneta_append(transfer->resource, config->azure_container);
+
+   if (pgmoneta_base64_decode(config->azure_shared_key, strlen(config->azure_shared_key),
+                              (void**)&transfer->signing_key, &transfer->signing_key_length))
    {
-      fclose(file);
+      pgmoneta_log_error("Azure storage engine: Invalid azure_shared_key");
+      return 1;
    }
 
-   return 1;
+   number_of_workers = pgmoneta_get_number_of_workers(server);
+   transfer->max_transfers = MAX(number_of_workers, 1);
+
+   return 0;
 }
 
-static char*
-azure_get_host()
+static void
+azure_release(struct azure_transfer* transfer)
+{
+   free(transfer->endpoint);
+   free(transfer->resource);
+   free(transfer->signing_key);
+
+   transfer->endpoint = NULL;
+   transfer->resource = NULL;
+   transfer->signing_key = NULL;
+}
+
+static int
+azure_perform(int server, struct azure_transfer* transfer)
 {
-   char* host = NULL;
+   int completed;
+   int left;
+   time_t start_time;
+   CURLMsg* message = NULL;
+   struct azure_request* request = NULL;
    struct configuration* config;
 
    config = (struct configuration*)shmem;
 
-   host = pgmoneta_append(host, config->azure_storage_account);
-   host = pgmoneta_append(host, ".blob.core.windows.net/");
-   host = pgmoneta_append(host, config->azure_container);
+   start_time = time(NULL);
+
+   transfer->idle = (CURL**)calloc(transfer->max_transfers, sizeof(CURL*));
+   transfer->multi = curl_multi_init();
+
+   if (transfer->idle == NULL || transfer->multi == NULL)
+   {
+      goto error;
+   }
+
+   /* The requests share the connections of the multi handle */
+   curl_multi_setopt(transfer->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)transfer->max_transfers);
+
+   while (true)
+   {
+      while (!transfer->error && transfer->running < transfer->max_transfers &&
+             (request = azure_next_request(transfer)) != NULL)
+      {
+         if (azure_send_request(transfer, request))
+         {
+            transfer->error = true;
+            azure_free_request(transfer, request);
+         }
+      }
+
+      if (transfer->running == 0)
+      {
+         break;
+      }
+
+      curl_multi_perform(transfer->multi, &left);
+
+      completed = 0;
+      while ((message = curl_multi_info_read(transfer->multi, &left)) != NULL)
+      {
+         if (message->msg == CURLMSG_DONE)
+         {
+            azure_complete_request(transfer, message->easy_handle, message->data.result);
+            completed++;
+         }
+      }
+
+      if (completed == 0)
+      {
+         curl_multi_poll(transfer->multi, NULL, 0, 1000, NULL);
+      }
+   }
+
+   if (transfer->current != NULL)
+   {
+      azure_release_file(transfer->current);
+      transfer->current = NULL;
+   }
+
+   if (transfer->error)
+   {
+      goto error;
+   }
+
+   pgmoneta_log_debug("Azure storage engine: %s %d files (%" PRIu64 " bytes) for %s (Elapsed: %.0f s)",
+                      transfer->download ? "Downloaded" : "Uploaded", transfer->transferred, transfer->bytes,
+                      config->servers[server].name, difftime(time(NULL), start_time));
+
+   for (int i = 0; i < transfer->number_of_idle; i++)
+   {
+      curl_easy_cleanup(transfer->idle[i]);
+   }
+   free(transfer->idle);
+   curl_multi_cleanup(transfer->multi);
+
+   return 0;
+
+error:
+
+   if (transfer->current != NULL)
+   {
+      azure_release_file(transfer->current);
+      transfer->current = NULL;
+   }
+
+   if (transfer->idle != NULL)
+   {
+      for (int i = 0; i < transfer->number_of_idle; i++)
+      {
+         curl_easy_cleanup(transfer->idle[i]);
+      }
+   }
+   free(transfer->idle);
+   if (transfer->multi != NULL)
+   {
+      curl_multi_cleanup(transfer->multi);
+   }
+
+   return 1;
+}
+
+static struct azure_request*
+azure_next_request(struct azure_transfer* transfer)
+{
+   char* relative_path = NULL;
+   char* local_path = NULL;
+   size_t size = 0;
+   struct stat st;
+   struct azure_file* file = NULL;
+   struct azure_request* request = NULL;
+
+   /* The blocks of a large file are transferred before the next file is started */
+   if (transfer->current != NULL && transfer->current->next_block >= transfer->current->number_of_blocks)
+   {
+      azure_release_file(transfer->current);
+      transfer->current = NULL;
+   }
+
+   if (transfer->current == NULL)
+   {
+      if (transfer->download)
+      {
+         size = (size_t)pgmoneta_deque_poll(transfer->files, &relative_path);
+      }
+      else
+      {
+         relative_path = (char*)pgmoneta_deque_poll(transfer->files, NULL);
+      }
+
+      if (relative_path == NULL)
+      {
+         return NULL;
+      }
+
+      file = (struct azure_file*)calloc(1, sizeof(struct azure_file));
+
+      if (file == NULL)
+      {
+         goto error;
+      }
+
+      file->relative_path = relative_path;
+      file->fd = -1;
+      file->references = 1;
+      relative_path = NULL;
+
+      if (transfer->download)
+      {
+         local_path = pgmoneta_append(local_path, transfer->local_root);
+         local_path = pgmoneta_append(local_path, file->relative_path);
+
+         file->fd = open(local_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+         if (file->fd == -1)
+         {
+            pgmoneta_log_error("Azure storage engine: Could not create %s: %s", local_path, strerror(errno));
+            goto error;
+         }
+
+         file->size = size;
+
+         free(local_path);
+         local_path = NULL;
+      }
+      else if (!pgmoneta_ends_with(file->relative_path, AZURE_EMPTY_MARKER))
+      {
+         local_path = pgmoneta_append(local_path, transfer->local_root);
+         local_path = pgmoneta_append(local_path, file->relative_path);
+
+         file->fd = open(local_path, O_RDONLY);
+
+         if (file->fd == -1 || fstat(file->fd, &st))
+         {
+            pgmoneta_log_error("Azure storage engine: Could not open %s: %s", local_path, strerror(errno));
+            goto error;
+         }
+
+         file->size = (size_t)st.st_size;
+
+         free(local_path);
+         local_path = NULL;
+      }
+
+      if (file->size > AZURE_BLOCK_SIZE)
+      {
+         file->number_of_blocks = (int)((file->size + AZURE_BLOCK_SIZE - 1) / AZURE_BLOCK_SIZE);
+      }
+
+      transfer->current = file;
+   }
+
+   file = transfer->current;
+
+   request = (struct azure_request*)calloc(1, sizeof(struct azure_request));
+
+   if (request == NULL)
+   {
+      file = NULL;
+      goto error;
+   }
+
+   request->file = file;
+   file->references++;
+
+   if (file->number_of_blocks == 0)
+   {
+      request->type = transfer->download ? AZURE_GET_BLOB : AZURE_PUT_BLOB;
+      request->length = file->size;
+
+      /* A small file is a single request */
+      file->next_block = 1;
+   }
+   else
+   {
+      /* A large file is downloaded in ranges of the size of a block */
+      request->type = transfer->download ? AZURE_GET_BLOB : AZURE_PUT_BLOCK;
+      request->block = file->next_block;
+      request->offset = (size_t)file->next_block * AZURE_BLOCK_SIZE;
+      request->length = MIN((size_t)AZURE_BLOCK_SIZE, file->size - request->offset);
+
+      file->next_block++;
+   }
+
+   return request;
+
+error:
+
+   transfer->error = true;
+
+   if (file != NULL)
+   {
+      if (transfer->current == file)
+      {
+         transfer->current = NULL;
+      }
+
+      azure_release_file(file);
+   }
+
+   free(relative_path);
+   free(local_path);
+
+   return NULL;
+}
+
+static int
+azure_send_request(struct azure_transfer* transfer, struct azure_request* request)
+{
+   char utc_date[UTC_TIME_LENGTH];
+   char range[64];
+   char* block_id = NULL;
+   char* headers = NULL;
+   char* resource = NULL;
+   char* authorization = NULL;
+   char* blob = NULL;
+
+   memset(&utc_date[0], 0, sizeof(utc_date));
+
+   if (pgmoneta_get_timestamp_UTC_format(utc_date))
+   {
+      goto error;
+   }
+
+   blob = pgmoneta_append(blob, "/");
+   blob = pgmoneta_append(blob, transfer->azure_root);
+   blob = pgmoneta_append(blob, request->file->relative_path);
+
+   free(request->url);
+   request->url = NULL;
+   request->url = pgmoneta_append(request->url, transfer->endpoint);
+   request->url = pgmoneta_append(request->url, blob);
+
+   resource = pgmoneta_append(resource, transfer->resource);
+   resource = pgmoneta_append(resource, blob);
+
+   if (request->type == AZURE_PUT_BLOB)
+   {
+      headers = pgmoneta_append(headers, "x-ms-blob-type:BlockBlob\n");
+   }
+   else if (request->type == AZURE_PUT_BLOCK)
+   {
+      /* The identifiers of the blocks only contain characters that are safe in a URL */
+      block_id = azure_block_id(request->block);
+
+      request->url = pgmoneta_append(request->url, "?comp=block&blockid=");
+      request->url = pgmoneta_append(request->url, block_id);
+
+      resource = pgmoneta_append(resource, "\nblockid:");
+      resource = pgmoneta_append(resource, block_id);
+      resource = pgmoneta_append(resource, "\ncomp:block");
+   }
+   else if (request->type == AZURE_PUT_BLOCK_LIST)
+   {
+      request->url = pgmoneta_append(request->url, "?comp=blocklist");
+
+      resource = pgmoneta_append(resource, "\ncomp:blocklist");
+   }
+
+   memset(&range[0], 0, sizeof(range));
+   snprintf(&range[0], sizeof(range), "bytes=%zu-%zu", request->offset, request->offset + request->length - 1);
+
+   headers = pgmoneta_append(headers, "x-ms-date:");
+   headers = pgmoneta_append(headers, utc_date);
+   if (request->type == AZURE_GET_BLOB)
+   {
+      headers = pgmoneta_append(headers, "\nx-ms-range:");
+      headers = pgmoneta_append(headers, &range[0]);
+   }
+   headers = pgmoneta_append(headers, "\nx-ms-version:");
+   headers = pgmoneta_append(headers, AZURE_VERSION);
+   headers = pgmoneta_append(headers, "\n");
+
+   if (request->type == AZURE_GET_BLOB)
+   {
+      authorization = azure_sign(transfer, "GET", 0, headers, resource);
+   }
+   else
+   {
+      authorization = azure_sign(transfer, "PUT", request->length, headers, resource);
+   }
+
+   if (authorization == NULL)
+   {
+      goto error;
+   }
+
+   curl_slist_free_all(request->headers);
+   request->headers = NULL;
+
+   request->headers = pgmoneta_http_add_header(request->headers, "Authorization", authorization);
+   if (request->type == AZURE_PUT_BLOB)
+   {
+      request->headers = pgmoneta_http_add_header(request->headers, "x-ms-blob-type", "BlockBlob");
+   }
+   request->headers = pgmoneta_http_add_header(request->headers, "x-ms-date", utc_date);
+   if (request->type == AZURE_GET_BLOB)
+   {
+      request->headers = pgmoneta_http_add_header(request->headers, "x-ms-range", &range[0]);
+   }
+   request->headers = pgmoneta_http_add_header(request->headers, "x-ms-version", AZURE_VERSION);
+   if (request->type != AZURE_GET_BLOB)
+   {
+      /* The body is sent right away */
+      request->headers = pgmoneta_http_add_header(request->headers, "Expect", "");
+   }
+
+   if (transfer->number_of_idle > 0)
+   {
+      request->handle = transfer->idle[--transfer->number_of_idle];
+   }
+   else
+   {
+      request->handle = curl_easy_init();
+   }
+
+   if (request->handle == NULL)
+   {
+      goto error;
+   }
+
+   request->position = 0;
+
+   pgmoneta_http_set_url_option(request->handle, request->url);
+   pgmoneta_http_set_header_option(request->handle, request->headers);
+
+   if (request->type == AZURE_GET_BLOB)
+   {
+      pgmoneta_http_set_request_option(request->handle, HTTP_GET);
+
+      curl_easy_setopt(request->handle, CURLOPT_WRITEFUNCTION, azure_write);
+      curl_easy_setopt(request->handle, CURLOPT_WRITEDATA, (void*)request);
+   }
+   else
+   {
+      pgmoneta_http_set_request_option(request->handle, HTTP_PUT);
+
+      curl_easy_setopt(request->handle, CURLOPT_READFUNCTION, azure_read);
+      curl_easy_setopt(request->handle, CURLOPT_READDATA, (void*)request);
+      curl_easy_setopt(request->handle, CURLOPT_INFILESIZE_LARGE, (curl_off_t)request->length);
+      curl_easy_setopt(request->handle, CURLOPT_WRITEFUNCTION, azure_discard);
+   }
+   curl_easy_setopt(request->handle, CURLOPT_PRIVATE, (void*)request);
+
+   if (curl_multi_add_handle(transfer->multi, request->handle) != CURLM_OK)
+   {
+      goto error;
+   }
+
+   transfer->running++;
+
+   free(block_id);
+   free(headers);
+   free(resource);
+   free(authorization);
+   free(blob);
+
+   return 0;
+
+error:
+
+   free(block_id);
+   free(headers);
+   free(resource);
+   free(authorization);
+   free(blob);
+
+   return 1;
+}
+
+static void
+azure_complete_request(struct azure_transfer* transfer, CURL* handle, CURLcode result)
+{
+   long code = 0;
+   char* block_id = NULL;
+   struct azure_request* request = NULL;
+   struct azure_request* list = NULL;
+   struct azure_file* file = NULL;
+
+   curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char**)&request);
+   curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+
+   /* A range is only complete with all of its bytes */
+   if (request->type == AZURE_GET_BLOB && result == CURLE_OK && code == 206 && request->position != request->length)
+   {
+      result = CURLE_PARTIAL_FILE;
+   }
+
+   curl_multi_remove_handle(transfer->multi, handle);
+   transfer->running--;
+
+   curl_easy_reset(handle);
+   transfer->idle[transfer->number_of_idle++] = handle;
+   request->handle = NULL;
+
+   file = request->file;
+
+   if (result != CURLE_OK || code != (request->type == AZURE_GET_BLOB ? 206 : 201))
+   {
+      if (!transfer->error && request->retries < AZURE_MAX_RETRIES && (result != CURLE_OK || code >= 500 || code == 408))
+      {
+         request->retries++;
+
+         pgmoneta_log_debug("Azure storage engine: Retrying %s (%s, %ld)", file->relative_path, curl_easy_strerror(result), code);
+
+         if (!azure_send_request(transfer, request))
+         {
+            return;
+         }
+      }
+
+      pgmoneta_log_error("Azure storage engine: Could not %s %s (%s, %ld)", transfer->download ? "download" : "upload",
+                         file->relative_path, curl_easy_strerror(result), code);
+      transfer->error = true;
+      azure_free_request(transfer, request);
+      return;
+   }
+
+   if (request->type == AZURE_GET_BLOB)
+   {
+      transfer->bytes += request->length;
+      file->completed_blocks++;
+
+      if (file->completed_blocks == MAX(file->number_of_blocks, 1))
+      {
+         transfer->transferred++;
+
+         pgmoneta_log_trace("Azure storage engine: %s (%zu bytes, %d/%d)", file->relative_path, file->size,
+                            transfer->transferred, transfer->number_of_files);
+      }
+   }
+   else if (request->type == AZURE_PUT_BLOCK)
+   {
+      transfer->bytes += request->length;
+      file->completed_blocks++;
+
+      /* The blob is committed once all of its blocks are stored */
+      if (file->completed_blocks == file->number_of_blocks && !transfer->error)
+      {
+         list = (struct azure_request*)calloc(1, sizeof(struct azure_request));
+
+         if (list == NULL)
+         {
+            transfer->error = true;
+         }
+         else
+         {
+            list->type = AZURE_PUT_BLOCK_LIST;
+            list->file = file;
+            file->references++;
+
+            list->body = pgmoneta_append(list->body, "<?xml version=\"1.0\" encoding=\"utf-8\"?><BlockList>");
+            for (int i = 0; i < file->number_of_blocks; i++)
+            {
+               block_id = azure_block_id(i);
+
+               list->body = pgmoneta_append(list->body, "<Latest>");
+               list->body = pgmoneta_append(list->body, block_id);
+               list->body = pgmoneta_append(list->body, "</Latest>");
+
+               free(block_id);
+               block_id = NULL;
+            }
+            list->body = pgmoneta_append(list->body, "</BlockList>");
+            list->length = strlen(list->body);
+
+            if (azure_send_request(transfer, list))
+            {
+               transfer->error = true;
+               azure_free_request(transfer, list);
+            }
+         }
+      }
+   }
+   else
+   {
+      if (request->type == AZURE_PUT_BLOB)
+      {
+         transfer->bytes += request->length;
+      }
+
+      transfer->transferred++;
+
+      pgmoneta_log_trace("Azure storage engine: %s (%zu bytes, %d/%d)", file->relative_path, file->size,
+                         transfer->transferred, transfer->number_of_files);
+   }
+
+   azure_free_request(transfer, request);
+}
+
+static void
+azure_free_request(struct azure_transfer* transfer, struct azure_request* request)
+{
+   if (request == NULL)
+   {
+      return;
+   }
+
+   if (request->handle != NULL)
+   {
+      curl_multi_remove_handle(transfer->multi, request->handle);
+      curl_easy_cleanup(request->handle);
+   }
+
+   azure_release_file(request->file);
+
+   curl_slist_free_all(request->headers);
+   free(request->url);
+   free(request->body);
+   free(request);
+}
+
+static void
+azure_release_file(struct azure_file* file)
+{
+   if (file == NULL)
+   {
+      return;
+   }
+
+   file->references--;
+
+   if (file->references <= 0)
+   {
+      if (file->fd != -1)
+      {
+         close(file->fd);
+      }
+
+      free(file->relative_path);
+      free(file);
+   }
+}
+
+static char*
+azure_block_id(int block)
+{
+   char id[16];
+   char* encoded = NULL;
+   size_t encoded_length = 0;
+
+   /* All identifiers of a blob must have the same length */
+   memset(&id[0], 0, sizeof(id));
+   snprintf(&id[0], sizeof(id), "%06d", block);
+
+   if (pgmoneta_base64_encode(&id[0], strlen(&id[0]), &encoded, &encoded_length))
+   {
+      return NULL;
+   }
+
+   return encoded;
+}
+
+static char*
+azure_sign(struct azure_transfer* transfer, char* verb, size_t content_length, char* headers, char* resource)
+{
+   char length[32];
+   char* string_to_sign = NULL;
+   char* base64_signature = NULL;
+   char* authorization = NULL;
+   unsigned char* signature_hmac = NULL;
+   int hmac_length = 0;
+   size_t base64_signature_length = 0;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   memset(&length[0], 0, sizeof(length));
+   if (content_length > 0)
+   {
+      snprintf(&length[0], sizeof(length), "%zu", content_length);
+   }
+
+   // Construct string to sign.
+   string_to_sign = pgmoneta_append(string_to_sign, verb);
+   string_to_sign = pgmoneta_append(string_to_sign, "\n\n\n");
+   string_to_sign = pgmoneta_append(string_to_sign, &length[0]);
+   string_to_sign = pgmoneta_append(string_to_sign, "\n\n\n\n\n\n\n\n\n");
+   string_to_sign = pgmoneta_append(string_to_sign, headers);
+   string_to_sign = pgmoneta_append(string_to_sign, resource);
+
+   // Construct the signature.
+   if (pgmoneta_generate_string_hmac_sha256_hash(transfer->signing_key, transfer->signing_key_length, string_to_sign,
+                                                 strlen(string_to_sign), &signature_hmac, &hmac_length))
+   {
+      goto error;
+   }
+
+   // Encode the signature.
+   if (pgmoneta_base64_encode((char*)signature_hmac, hmac_length, &base64_signature, &base64_signature_length))
+   {
+      goto error;
+   }
+
+   // Construct the authorization header.
+   authorization = pgmoneta_append(authorization, "SharedKey ");
+   authorization = pgmoneta_append(authorization, config->azure_storage_account);
+   authorization = pgmoneta_append(authorization, ":");
+   authorization = pgmoneta_append(authorization, base64_signature);
+
+   free(string_to_sign);
+   free(signature_hmac);
+   free(base64_signature);
+
+   return authorization;
+
+error:
+
+   free(string_to_sign);
+   free(signature_hmac);
+   free(base64_signature);
+
+   return NULL;
+}
+
+static size_t
+azure_read(char* buffer, size_t size, size_t nitems, void* userdata)
+{
+   size_t length;
+   ssize_t r;
+   struct azure_request* request = NULL;
+
+   request = (struct azure_request*)userdata;
+
+   length = MIN(size * nitems, request->length - request->position);
+
+   if (length == 0)
+   {
+      return 0;
+   }
+
+   if (request->body != NULL)
+   {
+      memcpy(buffer, request->body + request->position, length);
+   }
+   else
+   {
+      r = pread(request->file->fd, buffer, length, (off_t)(request->offset + request->position));
+
+      if (r <= 0)
+      {
+         return CURL_READFUNC_ABORT;
+      }
+
+      length = (size_t)r;
+   }
+
+   request->position += length;
+
+   return length;
+}
+
+static size_t
+azure_write(char* buffer, size_t size, size_t nitems, void* userdata)
+{
+   long code = 0;
+   size_t length;
+   size_t written = 0;
+   ssize_t w;
+   struct azure_request* request = NULL;
+
+   request = (struct azure_request*)userdata;
+
+   length = size * nitems;
+
+   /* The body of an error isn't part of the blob */
+   curl_easy_getinfo(request->handle, CURLINFO_RESPONSE_CODE, &code);
+
+   if (code != 206)
+   {
+      return length;
+   }
+
+   if (request->position + length > request->length)
+   {
+      return 0;
+   }
+
+   while (written < length)
+   {
+      w = pwrite(request->file->fd, buffer + written, length - written,
+                 (off_t)(request->offset + request->position + written));
+
+      if (w <= 0)
+      {
+         return 0;
+      }
+
+      written += (size_t)w;
+   }
+
+   request->position += length;
+
+   return length;
+}
+
+static size_t
+azure_discard(char* buffer, size_t size, size_t nitems, void* userdata)
+{
+   (void)buffer;
+   (void)userdata;
+
+   return size * nitems;
+}
+
+static char*
+azure_get_endpoint(void)
+{
+   char* endpoint = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (strlen(config->azure_endpoint) > 0)
+   {
+      endpoint = pgmoneta_append(endpoint, config->azure_endpoint);
+
+      while (pgmoneta_ends_with(endpoint, "/"))
+      {
+         endpoint[strlen(endpoint) - 1] = '\0';
+      }
+   }
+   else
+   {
+      endpoint = pgmoneta_append(endpoint, "https://");
+      endpoint = pgmoneta_append(endpoint, config->azure_storage_account);
+      endpoint = pgmoneta_append(endpoint, ".blob.core.windows.net");
+   }
 
-   return host;
+   return endpoint;
 }
 
 static char*
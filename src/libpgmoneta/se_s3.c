@@ -28,6 +28,7 @@
 
 /* pgmoneta */
 #include <pgmoneta.h>
+#include <deque.h>
 #include <dirent.h>
 #include <http.h>
 #include <info.h>
@@ -38,31 +39,126 @@
 #include <utils.h>
 
 /* system */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define S3_PART_SIZE    (8 * 1024 * 1024)
+#define S3_MAX_RETRIES  3
+#define S3_EMPTY_MARKER "/.pgmoneta"
+#define S3_EMPTY_SHA256 "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
+
+/** @struct s3_file
+ * Defines a file that is downloaded
+ */
+struct s3_file
+{
+   char* relative_path;  /**< The path relative to the backup */
+   int fd;               /**< The file descriptor */
+   size_t size;          /**< The size */
+   int number_of_parts;  /**< The number of parts */
+   int next_part;        /**< The next part to request */
+   int completed_parts;  /**< The number of parts that were stored */
+   int references;       /**< The number of requests and schedulers that use the file */
+};
+
+/** @struct s3_request
+ * Defines a ranged request that is in flight
+ */
+struct s3_request
+{
+   struct s3_file* file;        /**< The file */
+   size_t offset;               /**< The offset of the part in the file */
+   size_t length;               /**< The length of the part */
+   size_t position;             /**< The number of bytes that were received */
+   int retries;                 /**< The number of retries */
+   CURL* handle;                /**< The curl handle */
+   struct curl_slist* headers;  /**< The headers */
+   char* url;                   /**< The URL */
+};
+
+/** @struct s3_download
+ * Defines the download of a backup
+ */
+struct s3_download
+{
+   char* local_root;           /**< The local root */
+   char* s3_root;              /**< The root in the bucket */
+   struct deque* files;        /**< The files that are left */
+   struct s3_file* current;    /**< The file whose parts are being requested */
+   CURLM* multi;               /**< The multi handle */
+   CURL** idle;                /**< The idle curl handles */
+   int number_of_idle;         /**< The number of idle curl handles */
+   int max_transfers;          /**< The maximum number of requests in flight */
+   int running;                /**< The number of requests in flight */
+   int number_of_files;        /**< The number of files */
+   int downloaded;             /**< The number of files that were downloaded */
+   uint64_t bytes;             /**< The number of bytes that were downloaded */
+   bool error;                 /**< Did the download fail */
+};
 
 static int s3_storage_setup(int, char*, struct deque*);
-static int s3_storage_execute(int, char*, struct deque*);
-static int s3_storage_teardown(int, char*, struct deque*);
+static int s3_storage_backup_execute(int, char*, struct deque*);
+static int s3_storage_fetch_execute(int, char*, struct deque*);
+static int s3_storage_backup_teardown(int, char*, struct deque*);
+static int s3_storage_fetch_teardown(int, char*, struct deque*);
 
 static int s3_upload_files(char* local_root, char* s3_root, char* relative_path);
 static int s3_send_upload_request(char* local_root, char* s3_root, char* relative_path);
+static int s3_download_files(struct s3_download* download);
+static int s3_perform(int server, struct s3_download* download);
+static struct s3_request* s3_next_request(struct s3_download* download);
+static int s3_send_request(struct s3_download* download, struct s3_request* request);
+static void s3_complete_request(struct s3_download* download, CURL* handle, CURLcode result);
+static void s3_free_request(struct s3_download* download, struct s3_request* request);
+static void s3_release_file(struct s3_file* file);
+static char* s3_sign(char* method, char* path, char* query, char* headers, char* signed_headers,
+                     char* payload_sha256, char* short_date, char* long_date);
+static size_t s3_read(char* buffer, size_t size, size_t nitems, void* userdata);
+static size_t s3_write(char* buffer, size_t size, size_t nitems, void* userdata);
 
 static char* s3_get_host(void);
+static char* s3_get_path(char* key);
+static char* s3_get_url(char* path);
 static char* s3_get_basepath(int server, char* identifier);
 
 static CURL* curl = NULL;
 
+static char* fetched_label = NULL;
+
 struct workflow*
-pgmoneta_storage_create_s3(void)
+pgmoneta_storage_create_s3(int workflow_type)
 {
    struct workflow* wf = NULL;
 
    wf = (struct workflow*)malloc(sizeof(struct workflow));
 
+   if (wf == NULL)
+   {
+      return NULL;
+   }
+
    wf->setup = &s3_storage_setup;
-   wf->execute = &s3_storage_execute;
-   wf->teardown = &s3_storage_teardown;
+
+   switch (workflow_type)
+   {
+      case WORKFLOW_TYPE_BACKUP:
+         wf->execute = &s3_storage_backup_execute;
+         wf->teardown = &s3_storage_backup_teardown;
+         break;
+      case WORKFLOW_TYPE_RESTORE:
+      case WORKFLOW_TYPE_VERIFY:
+         wf->execute = &s3_storage_fetch_execute;
+         wf->teardown = &s3_storage_fetch_teardown;
+         break;
+      default:
+         break;
+   }
    wf->next = NULL;
 
    return wf;
@@ -91,7 +187,7 @@ error:
 }
 
 static int
-s3_storage_execute(int server, char* identifier, struct deque* nodes)
+s3_storage_backup_execute(int server, char* identifier, struct deque* nodes)
 {
    char* local_root = NULL;
    char* s3_root = NULL;
@@ -124,7 +220,97 @@ error:
 }
 
 static int
-s3_storage_teardown(int server, char* identifier, struct deque* nodes)
+s3_storage_fetch_execute(int server, char* identifier, struct deque* nodes)
+{
+   char* label = NULL;
+   char* local_root = NULL;
+   char* s3_root = NULL;
+   char* data = NULL;
+   bool local_backup = false;
+   struct deque* files = NULL;
+   struct s3_download download;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   memset(&download, 0, sizeof(struct s3_download));
+
+   pgmoneta_log_debug("S3 storage engine (fetch/execute): %s/%s", config->servers[server].name, identifier);
+   pgmoneta_deque_list(nodes);
+
+   if (pgmoneta_get_backup_label(server, identifier, &label))
+   {
+      pgmoneta_log_error("S3 storage engine: No identifier for %s/%s", config->servers[server].name, identifier);
+      goto error;
+   }
+
+   data = pgmoneta_get_server_backup_identifier_data(server, label);
+
+   /* The data of the backup is only removed once it is in the bucket */
+   if (pgmoneta_exists(data))
+   {
+      goto done;
+   }
+
+   local_root = pgmoneta_get_server_backup_identifier(server, label);
+   s3_root = s3_get_basepath(server, label);
+
+   local_backup = pgmoneta_exists(local_root);
+
+   if (pgmoneta_deque_create(false, &files))
+   {
+      goto error;
+   }
+
+   download.local_root = local_root;
+   download.s3_root = s3_root;
+   download.files = files;
+   download.max_transfers = MAX(pgmoneta_get_number_of_workers(server), 1);
+
+   if (s3_download_files(&download))
+   {
+      goto error;
+   }
+
+   if (s3_perform(server, &download))
+   {
+      goto error;
+   }
+
+   fetched_label = label;
+   label = NULL;
+
+done:
+
+   pgmoneta_deque_destroy(files);
+
+   free(label);
+   free(local_root);
+   free(s3_root);
+   free(data);
+
+   return 0;
+
+error:
+
+   /* A partial download is never used as a backup */
+   if (local_root != NULL)
+   {
+      pgmoneta_delete_directory(local_backup ? data : local_root);
+   }
+
+   pgmoneta_deque_destroy(files);
+
+   free(label);
+   free(local_root);
+   free(s3_root);
+   free(data);
+
+   return 1;
+}
+
+static int
+s3_storage_backup_teardown(int server, char* identifier, struct deque* nodes)
 {
    char* root = NULL;
    struct configuration* config;
@@ -145,11 +331,41 @@ s3_storage_teardown(int server, char* identifier, struct deque* nodes)
    return 0;
 }
 
+static int
+s3_storage_fetch_teardown(int server, char* identifier, struct deque* nodes)
+{
+   char* root = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   pgmoneta_log_debug("S3 storage engine (fetch/teardown): %s/%s", config->servers[server].name, identifier);
+   pgmoneta_deque_list(nodes);
+
+   /* The backup is back to the state after its upload */
+   if (fetched_label != NULL)
+   {
+      root = pgmoneta_get_server_backup_identifier_data(server, fetched_label);
+
+      pgmoneta_delete_directory(root);
+
+      free(fetched_label);
+      fetched_label = NULL;
+   }
+
+   curl_easy_cleanup(curl);
+
+   free(root);
+
+   return 0;
+}
+
 static int
 s3_upload_files(char* local_root, char* s3_root, char* relative_path)
 {
    char* local_path = NULL;
    char* relative_file;
+   bool copied_files = false;
    DIR* dir;
    struct dirent* entry;
 
@@ -178,6 +394,8 @@ s3_upload_files(char* local_root, char* s3_root, char* relative_path)
       }
       else
       {
+         copied_files = true;
+
          relative_file = NULL;
 
          relative_file = pgmoneta_append(relative_file, relative_path);
@@ -194,6 +412,24 @@ s3_upload_files(char* local_root, char* s3_root, char* relative_path)
       }
    }
 
+   // In case no files are copied, then the directory is empty.
+   // Upload an empty .pgmoneta object, so the directory is restored.
+   if (!copied_files)
+   {
+      relative_file = NULL;
+
+      relative_file = pgmoneta_append(relative_file, relative_path);
+      relative_file = pgmoneta_append(relative_file, S3_EMPTY_MARKER);
+
+      if (s3_send_upload_request(local_root, s3_root, relative_file))
+      {
+         free(relative_file);
+         goto error;
+      }
+
+      free(relative_file);
+   }
+
    closedir(dir);
 
    free(local_path);
@@ -202,7 +438,10 @@ s3_upload_files(char* local_root, char* s3_root, char* relative_path)
 
 error:
 
-   closedir(dir);
+   if (dir != NULL)
+   {
+      closedir(dir);
+   }
 
    free(local_path);
 
@@ -214,30 +453,19 @@ s3_send_upload_request(char* local_root, char* s3_root, char* relative_path)
 {
    char short_date[SHORT_TIME_LENGHT];
    char long_date[LONG_TIME_LENGHT];
-   char* canonical_request = NULL;
+   char* headers = NULL;
    char* auth_value = NULL;
-   char* string_to_sign = NULL;
    char* s3_host = NULL;
    char* s3_url = NULL;
    char* file_sha256 = NULL;
-   char* canonical_request_sha256 = NULL;
-   char* key = NULL;
    char* local_path = NULL;
    char* s3_path = NULL;
-   unsigned char* date_key_hmac = NULL;
-   unsigned char* date_region_key_hmac = NULL;
-   unsigned char* date_region_service_key_hmac = NULL;
-   unsigned char* signing_key_hmac = NULL;
-   unsigned char* signature_hmac = NULL;
-   unsigned char* signature_hex = NULL;
-   int hmac_length = 0;
+   char* path = NULL;
    FILE* file = NULL;
+   size_t file_size = 0;
    struct stat file_info;
    CURLcode res = -1;
    struct curl_slist* chunk = NULL;
-   struct configuration* config;
-
-   config = (struct configuration*)shmem;
 
    local_path = pgmoneta_append(local_path, local_root);
    local_path = pgmoneta_append(local_path, relative_path);
@@ -253,73 +481,53 @@ s3_send_upload_request(char* local_root, char* s3_root, char* relative_path)
       goto error;
    }
 
-   pgmoneta_create_sha256_file(local_path, &file_sha256);
-
-   s3_host = s3_get_host();
-
-   // Construct canonical request.
-   canonical_request = pgmoneta_append(canonical_request, "PUT\n/");
-   canonical_request = pgmoneta_append(canonical_request, s3_path);
-   canonical_request = pgmoneta_append(canonical_request, "\n\nhost:");
-   canonical_request = pgmoneta_append(canonical_request, s3_host);
-   canonical_request = pgmoneta_append(canonical_request, "\nx-amz-content-sha256:");
-   canonical_request = pgmoneta_append(canonical_request, file_sha256);
-   canonical_request = pgmoneta_append(canonical_request, "\nx-amz-date:");
-   canonical_request = pgmoneta_append(canonical_request, long_date);
-   canonical_request = pgmoneta_append(canonical_request, "\nx-amz-storage-class:REDUCED_REDUNDANCY\n\nhost;x-amz-content-sha256;x-amz-date;x-amz-storage-class\n");
-   canonical_request = pgmoneta_append(canonical_request, file_sha256);
-
-   pgmoneta_generate_string_sha256_hash(canonical_request, &canonical_request_sha256);
+   /* The marker of an empty directory has no body */
+   if (pgmoneta_ends_with(relative_path, S3_EMPTY_MARKER))
+   {
+      file_sha256 = pgmoneta_append(file_sha256, S3_EMPTY_SHA256);
+   }
+   else
+   {
+      pgmoneta_create_sha256_file(local_path, &file_sha256);
 
-   // Construct string to sign.
-   string_to_sign = pgmoneta_append(string_to_sign, "AWS4-HMAC-SHA256\n");
-   string_to_sign = pgmoneta_append(string_to_sign, long_date);
-   string_to_sign = pgmoneta_append(string_to_sign, "\n");
-   string_to_sign = pgmoneta_append(string_to_sign, short_date);
-   string_to_sign = pgmoneta_append(string_to_sign, "/");
-   string_to_sign = pgmoneta_append(string_to_sign, config->s3_aws_region);
-   string_to_sign = pgmoneta_append(string_to_sign, "/s3/aws4_request\n");
-   string_to_sign = pgmoneta_append(string_to_sign, canonical_request_sha256);
+      file = fopen(local_path, "rb");
+      if (file == NULL)
+      {
+         goto error;
+      }
 
-   key = pgmoneta_append(key, "AWS4");
-   key = pgmoneta_append(key, config->s3_secret_access_key);
+      if (fstat(fileno(file), &file_info) != 0)
+      {
+         goto error;
+      }
 
-   if (pgmoneta_generate_string_hmac_sha256_hash(key, strlen(key), short_date, SHORT_TIME_LENGHT - 1, &date_key_hmac, &hmac_length))
-   {
-      goto error;
+      file_size = (size_t)file_info.st_size;
    }
 
-   if (pgmoneta_generate_string_hmac_sha256_hash((char*)date_key_hmac, hmac_length, config->s3_aws_region, strlen(config->s3_aws_region), &date_region_key_hmac, &hmac_length))
+   if (file_sha256 == NULL)
    {
       goto error;
    }
 
-   if (pgmoneta_generate_string_hmac_sha256_hash((char*)date_region_key_hmac, hmac_length, "s3", strlen("s3"), &date_region_service_key_hmac, &hmac_length))
-   {
-      goto error;
-   }
+   s3_host = s3_get_host();
+   path = s3_get_path(s3_path);
 
-   if (pgmoneta_generate_string_hmac_sha256_hash((char*)date_region_service_key_hmac, hmac_length, "aws4_request", strlen("aws4_request"), &signing_key_hmac, &hmac_length))
-   {
-      goto error;
-   }
+   headers = pgmoneta_append(headers, "host:");
+   headers = pgmoneta_append(headers, s3_host);
+   headers = pgmoneta_append(headers, "\nx-amz-content-sha256:");
+   headers = pgmoneta_append(headers, file_sha256);
+   headers = pgmoneta_append(headers, "\nx-amz-date:");
+   headers = pgmoneta_append(headers, long_date);
+   headers = pgmoneta_append(headers, "\nx-amz-storage-class:REDUCED_REDUNDANCY\n");
 
-   if (pgmoneta_generate_string_hmac_sha256_hash((char*)signing_key_hmac, hmac_length, string_to_sign, strlen(string_to_sign), &signature_hmac, &hmac_length))
+   auth_value = s3_sign("PUT", path, "", headers, "host;x-amz-content-sha256;x-amz-date;x-amz-storage-class",
+                        file_sha256, short_date, long_date);
+
+   if (auth_value == NULL)
    {
       goto error;
    }
 
-   pgmoneta_convert_base32_to_hex(signature_hmac, hmac_length, &signature_hex);
-
-   auth_value = pgmoneta_append(auth_value, "AWS4-HMAC-SHA256 Credential=");
-   auth_value = pgmoneta_append(auth_value, config->s3_access_key_id);
-   auth_value = pgmoneta_append(auth_value, "/");
-   auth_value = pgmoneta_append(auth_value, short_date);
-   auth_value = pgmoneta_append(auth_value, "/");
-   auth_value = pgmoneta_append(auth_value, config->s3_aws_region);
-   auth_value = pgmoneta_append(auth_value, "/s3/aws4_request,SignedHeaders=host;x-amz-content-sha256;x-amz-date;x-amz-storage-class,Signature=");
-   auth_value = pgmoneta_append(auth_value, (char*)signature_hex);
-
    chunk = pgmoneta_http_add_header(chunk, "Authorization", auth_value);
 
    chunk = pgmoneta_http_add_header(chunk, "Host", s3_host);
@@ -335,29 +543,17 @@ s3_send_upload_request(char* local_root, char* s3_root, char* relative_path)
       goto error;
    }
 
-   s3_url = pgmoneta_append(s3_url, "https://");
-   s3_url = pgmoneta_append(s3_url, s3_host);
-   s3_url = pgmoneta_append(s3_url, "/");
-   s3_url = pgmoneta_append(s3_url, s3_path);
-
-   file = fopen(local_path, "rb");
-   if (file == NULL)
-   {
-      goto error;
-   }
-
-   if (fstat(fileno(file), &file_info) != 0)
-   {
-      goto error;
-   }
+   s3_url = s3_get_url(path);
 
    pgmoneta_http_set_request_option(curl, HTTP_PUT);
 
    pgmoneta_http_set_url_option(curl, s3_url);
 
+   curl_easy_setopt(curl, CURLOPT_READFUNCTION, s3_read);
+
    curl_easy_setopt(curl, CURLOPT_READDATA, (void*) file);
 
-   curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)file_info.st_size);
+   curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)file_size);
 
    curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 
@@ -371,136 +567,966 @@ s3_send_upload_request(char* local_root, char* s3_root, char* relative_path)
    free(s3_url);
    free(s3_host);
    free(file_sha256);
-   free(signature_hex);
-   free(signature_hmac);
-   free(signing_key_hmac);
-   free(date_region_service_key_hmac);
-   free(date_region_key_hmac);
-   free(date_key_hmac);
-   free(key);
    free(local_path);
    free(s3_path);
-   free(canonical_request_sha256);
-   free(canonical_request);
-   free(string_to_sign);
+   free(path);
+   free(headers);
    free(auth_value);
 
    curl_slist_free_all(chunk);
 
-   fclose(file);
+   if (file != NULL)
+   {
+      fclose(file);
+   }
+
    return 0;
 
 error:
 
-   if (s3_url != NULL)
-   {
-      free(s3_url);
-   }
+   free(s3_url);
+   free(s3_host);
+   free(file_sha256);
+   free(local_path);
+   free(s3_path);
+   free(path);
+   free(headers);
+   free(auth_value);
 
-   if (s3_host != NULL)
+   if (chunk != NULL)
    {
-      free(s3_host);
+      curl_slist_free_all(chunk);
    }
 
-   if (signature_hex != NULL)
+   if (file != NULL)
    {
-      free(signature_hex);
+      fclose(file);
    }
 
-   if (signature_hmac != NULL)
-   {
-      free(signature_hmac);
-   }
+   return 1;
+}
 
-   if (signing_key_hmac != NULL)
-   {
-      free(signing_key_hmac);
-   }
+static int
+s3_download_files(struct s3_download* download)
+{
+   char short_date[SHORT_TIME_LENGHT];
+   char long_date[LONG_TIME_LENGHT];
+   char* prefix = NULL;
+   char* escaped_prefix = NULL;
+   char* token = NULL;
+   char* escaped_token = NULL;
+   char* query = NULL;
+   char* path = NULL;
+   char* url = NULL;
+   char* s3_host = NULL;
+   char* headers = NULL;
+   char* auth_value = NULL;
+   char* response = NULL;
+   char* position = NULL;
+   char* key = NULL;
+   char* size = NULL;
+   char* relative_path = NULL;
+   char* local_path = NULL;
+   long code = 0;
+   int fd = -1;
+   int number_of_objects = 0;
+   CURLcode res;
+   struct curl_slist* chunk = NULL;
 
-   if (date_region_service_key_hmac != NULL)
-   {
-      free(date_region_service_key_hmac);
-   }
+   prefix = pgmoneta_append(prefix, download->s3_root);
+   prefix = pgmoneta_append(prefix, "/");
 
-   if (date_region_key_hmac != NULL)
-   {
-      free(date_region_key_hmac);
-   }
+   escaped_prefix = curl_easy_escape(curl, prefix, 0);
 
-   if (date_key_hmac != NULL)
+   if (escaped_prefix == NULL)
    {
-      free(date_region_key_hmac);
+      goto error;
    }
 
-   if (key != NULL)
-   {
-      free(key);
-   }
+   s3_host = s3_get_host();
+   path = s3_get_path(NULL);
 
-   if (local_path != NULL)
+   /* The objects are listed in pages */
+   do
    {
-      free(local_path);
-   }
+      memset(&short_date[0], 0, sizeof(short_date));
+      memset(&long_date[0], 0, sizeof(long_date));
 
-   if (s3_path != NULL)
-   {
-      free(s3_path);
-   }
+      if (pgmoneta_get_timestamp_ISO8601_format(short_date, long_date))
+      {
+         goto error;
+      }
 
-   if (canonical_request_sha256 != NULL)
-   {
-      free(canonical_request_sha256);
-   }
+      /* The parameters of the query are sorted */
+      if (token != NULL)
+      {
+         escaped_token = curl_easy_escape(curl, token, 0);
 
-   if (file_sha256 != NULL)
-   {
-      free(file_sha256);
-   }
+         if (escaped_token == NULL)
+         {
+            goto error;
+         }
 
-   if (canonical_request != NULL)
-   {
-      free(canonical_request);
-   }
+         query = pgmoneta_append(query, "continuation-token=");
+         query = pgmoneta_append(query, escaped_token);
+         query = pgmoneta_append(query, "&");
 
-   if (string_to_sign != NULL)
-   {
-      free(string_to_sign);
-   }
+         curl_free(escaped_token);
+         escaped_token = NULL;
+      }
+      query = pgmoneta_append(query, "list-type=2&prefix=");
+      query = pgmoneta_append(query, escaped_prefix);
 
-   if (auth_value != NULL)
-   {
-      free(auth_value);
-   }
+      headers = pgmoneta_append(headers, "host:");
+      headers = pgmoneta_append(headers, s3_host);
+      headers = pgmoneta_append(headers, "\nx-amz-content-sha256:");
+      headers = pgmoneta_append(headers, S3_EMPTY_SHA256);
+      headers = pgmoneta_append(headers, "\nx-amz-date:");
+      headers = pgmoneta_append(headers, long_date);
+      headers = pgmoneta_append(headers, "\n");
 
-   if (chunk != NULL)
-   {
-      curl_slist_free_all(chunk);
-   }
+      auth_value = s3_sign("GET", path, query, headers, "host;x-amz-content-sha256;x-amz-date",
+                           S3_EMPTY_SHA256, short_date, long_date);
 
-   if (file != NULL)
-   {
-      fclose(file);
-   }
+      if (auth_value == NULL)
+      {
+         goto error;
+      }
+
+      chunk = pgmoneta_http_add_header(chunk, "Authorization", auth_value);
+      chunk = pgmoneta_http_add_header(chunk, "Host", s3_host);
+      chunk = pgmoneta_http_add_header(chunk, "x-amz-content-sha256", S3_EMPTY_SHA256);
+      chunk = pgmoneta_http_add_header(chunk, "x-amz-date", long_date);
+
+      url = s3_get_url(path);
+      url = pgmoneta_append(url, "?");
+      url = pgmoneta_append(url, query);
+
+      curl_easy_reset(curl);
+
+      pgmoneta_http_set_request_option(curl, HTTP_GET);
+      pgmoneta_http_set_url_option(curl, url);
+      pgmoneta_http_set_header_option(curl, chunk);
+      pgmoneta_http_set_response_option(curl, &response);
+
+      res = curl_easy_perform(curl);
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+
+      if (res != CURLE_OK || code != 200 || response == NULL)
+      {
+         pgmoneta_log_error("S3 storage engine: Could not list %s (%s, %ld)", prefix, curl_easy_strerror(res), code);
+         goto error;
+      }
+
+      position = response;
+
+      while ((position = pgmoneta_http_xml_element(position, "Key", &key)) != NULL)
+      {
+         position = pgmoneta_http_xml_element(position, "Size", &size);
+
+         if (position == NULL || !pgmoneta_starts_with(key, prefix))
+         {
+            goto error;
+         }
+
+         number_of_objects++;
+
+         relative_path = pgmoneta_append(relative_path, key + strlen(download->s3_root));
+
+         local_path = pgmoneta_append(local_path, download->local_root);
+         local_path = pgmoneta_append(local_path, relative_path);
+
+         /* The directory of the file is created right away, as is an empty directory */
+         *strrchr(local_path, '/') = '\0';
+
+         if (pgmoneta_mkdir(local_path))
+         {
+            pgmoneta_log_error("S3 storage engine: Could not create %s: %s", local_path, strerror(errno));
+            goto error;
+         }
+
+         local_path[strlen(local_path)] = '/';
+
+         /* A file that is local is kept, as it is newer than the object */
+         if (!pgmoneta_ends_with(relative_path, S3_EMPTY_MARKER) && !pgmoneta_exists(local_path))
+         {
+            if (strtoull(size, NULL, 10) == 0)
+            {
+               fd = open(local_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+               if (fd == -1)
+               {
+                  pgmoneta_log_error("S3 storage engine: Could not create %s: %s", local_path, strerror(errno));
+                  goto error;
+               }
+
+               close(fd);
+               fd = -1;
+            }
+            else
+            {
+               pgmoneta_deque_add(download->files, relative_path, (uintptr_t)strtoull(size, NULL, 10), ValueUInt64);
+            }
+         }
+
+         free(key);
+         key = NULL;
+
+         free(size);
+         size = NULL;
+
+         free(relative_path);
+         relative_path = NULL;
+
+         free(local_path);
+         local_path = NULL;
+      }
+
+      free(token);
+      token = NULL;
+
+      pgmoneta_http_xml_element(response, "NextContinuationToken", &token);
+
+      free(query);
+      query = NULL;
+
+      free(url);
+      url = NULL;
+
+      free(headers);
+      headers = NULL;
+
+      free(auth_value);
+      auth_value = NULL;
+
+      free(response);
+      response = NULL;
+
+      curl_slist_free_all(chunk);
+      chunk = NULL;
+   }
+   while (token != NULL && strlen(token) > 0);
+
+   if (number_of_objects == 0)
+   {
+      pgmoneta_log_error("S3 storage engine: No backup in %s", prefix);
+      goto error;
+   }
+
+   download->number_of_files = (int)pgmoneta_deque_size(download->files);
+
+   curl_free(escaped_prefix);
+
+   free(prefix);
+   free(token);
+   free(s3_host);
+   free(path);
+
+   return 0;
+
+error:
+
+   if (escaped_prefix != NULL)
+   {
+      curl_free(escaped_prefix);
+   }
+
+   curl_slist_free_all(chunk);
+
+   free(prefix);
+   free(token);
+   free(query);
+   free(path);
+   free(url);
+   free(s3_host);
+   free(headers);
+   free(auth_value);
+   free(response);
+   free(key);
+   free(size);
+   free(relative_path);
+   free(local_path);
+
+   return 1;
+}
+
+static int
+s3_perform(int server, struct s3_download* download)
+{
+   int completed;
+   int left;
+   time_t start_time;
+   CURLMsg* message = NULL;
+   struct s3_request* request = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   start_time = time(NULL);
+
+   download->idle = (CURL**)calloc(download->max_transfers, sizeof(CURL*));
+   download->multi = curl_multi_init();
+
+   if (download->idle == NULL || download->multi == NULL)
+   {
+      goto error;
+   }
+
+   /* The requests share the connections of the multi handle */
+   curl_multi_setopt(download->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)download->max_transfers);
+
+   while (true)
+   {
+      while (!download->error && download->running < download->max_transfers &&
+             (request = s3_next_request(download)) != NULL)
+      {
+         if (s3_send_request(download, request))
+         {
+            download->error = true;
+            s3_free_request(download, request);
+         }
+      }
+
+      if (download->running == 0)
+      {
+         break;
+      }
+
+      curl_multi_perform(download->multi, &left);
+
+      completed = 0;
+      while ((message = curl_multi_info_read(download->multi, &left)) != NULL)
+      {
+         if (message->msg == CURLMSG_DONE)
+         {
+            s3_complete_request(download, message->easy_handle, message->data.result);
+            completed++;
+         }
+      }
+
+      if (completed == 0)
+      {
+         curl_multi_poll(download->multi, NULL, 0, 1000, NULL);
+      }
+   }
+
+   if (download->current != NULL)
+   {
+      s3_release_file(download->current);
+      download->current = NULL;
+   }
+
+   if (download->error)
+   {
+      goto error;
+   }
+
+   pgmoneta_log_debug("S3 storage engine: Downloaded %d files (%" PRIu64 " bytes) for %s (Elapsed: %.0f s)",
+                      download->downloaded, download->bytes, config->servers[server].name, difftime(time(NULL), start_time));
+
+   for (int i = 0; i < download->number_of_idle; i++)
+   {
+      curl_easy_cleanup(download->idle[i]);
+   }
+   free(download->idle);
+   curl_multi_cleanup(download->multi);
+
+   return 0;
+
+error:
+
+   if (download->current != NULL)
+   {
+      s3_release_file(download->current);
+      download->current = NULL;
+   }
+
+   if (download->idle != NULL)
+   {
+      for (int i = 0; i < download->number_of_idle; i++)
+      {
+         curl_easy_cleanup(download->idle[i]);
+      }
+   }
+   free(download->idle);
+   if (download->multi != NULL)
+   {
+      curl_multi_cleanup(download->multi);
+   }
 
    return 1;
 }
 
+static struct s3_request*
+s3_next_request(struct s3_download* download)
+{
+   char* relative_path = NULL;
+   char* local_path = NULL;
+   size_t size = 0;
+   struct s3_file* file = NULL;
+   struct s3_request* request = NULL;
+
+   /* The parts of a large file are requested before the next file is started */
+   if (download->current != NULL && download->current->next_part >= download->current->number_of_parts)
+   {
+      s3_release_file(download->current);
+      download->current = NULL;
+   }
+
+   if (download->current == NULL)
+   {
+      size = (size_t)pgmoneta_deque_poll(download->files, &relative_path);
+
+      if (relative_path == NULL)
+      {
+         return NULL;
+      }
+
+      file = (struct s3_file*)calloc(1, sizeof(struct s3_file));
+
+      if (file == NULL)
+      {
+         goto error;
+      }
+
+      file->relative_path = relative_path;
+      file->size = size;
+      file->number_of_parts = (int)((size + S3_PART_SIZE - 1) / S3_PART_SIZE);
+      file->references = 1;
+      relative_path = NULL;
+
+      local_path = pgmoneta_append(local_path, download->local_root);
+      local_path = pgmoneta_append(local_path, file->relative_path);
+
+      file->fd = open(local_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+      if (file->fd == -1)
+      {
+         pgmoneta_log_error("S3 storage engine: Could not create %s: %s", local_path, strerror(errno));
+         goto error;
+      }
+
+      free(local_path);
+      local_path = NULL;
+
+      download->current = file;
+   }
+
+   file = download->current;
+
+   request = (struct s3_request*)calloc(1, sizeof(struct s3_request));
+
+   if (request == NULL)
+   {
+      file = NULL;
+      goto error;
+   }
+
+   request->file = file;
+   file->references++;
+
+   request->offset = (size_t)file->next_part * S3_PART_SIZE;
+   request->length = MIN((size_t)S3_PART_SIZE, file->size - request->offset);
+
+   file->next_part++;
+
+   return request;
+
+error:
+
+   download->error = true;
+
+   if (file != NULL)
+   {
+      if (download->current == file)
+      {
+         download->current = NULL;
+      }
+
+      s3_release_file(file);
+   }
+
+   free(relative_path);
+   free(local_path);
+
+   return NULL;
+}
+
+static int
+s3_send_request(struct s3_download* download, struct s3_request* request)
+{
+   char short_date[SHORT_TIME_LENGHT];
+   char long_date[LONG_TIME_LENGHT];
+   char range[64];
+   char* s3_path = NULL;
+   char* path = NULL;
+   char* s3_host = NULL;
+   char* headers = NULL;
+   char* auth_value = NULL;
+
+   memset(&short_date[0], 0, sizeof(short_date));
+   memset(&long_date[0], 0, sizeof(long_date));
+
+   if (pgmoneta_get_timestamp_ISO8601_format(short_date, long_date))
+   {
+      goto error;
+   }
+
+   s3_path = pgmoneta_append(s3_path, download->s3_root);
+   s3_path = pgmoneta_append(s3_path, request->file->relative_path);
+
+   s3_host = s3_get_host();
+   path = s3_get_path(s3_path);
+
+   free(request->url);
+   request->url = s3_get_url(path);
+
+   /* The range isn't signed */
+   headers = pgmoneta_append(headers, "host:");
+   headers = pgmoneta_append(headers, s3_host);
+   headers = pgmoneta_append(headers, "\nx-amz-content-sha256:");
+   headers = pgmoneta_append(headers, S3_EMPTY_SHA256);
+   headers = pgmoneta_append(headers, "\nx-amz-date:");
+   headers = pgmoneta_append(headers, long_date);
+   headers = pgmoneta_append(headers, "\n");
+
+   auth_value = s3_sign("GET", path, "", headers, "host;x-amz-content-sha256;x-amz-date",
+                        S3_EMPTY_SHA256, short_date, long_date);
+
+   if (auth_value == NULL)
+   {
+      goto error;
+   }
+
+   memset(&range[0], 0, sizeof(range));
+   snprintf(&range[0], sizeof(range), "bytes=%zu-%zu", request->offset, request->offset + request->length - 1);
+
+   curl_slist_free_all(request->headers);
+   request->headers = NULL;
+
+   request->headers = pgmoneta_http_add_header(request->headers, "Authorization", auth_value);
+   request->headers = pgmoneta_http_add_header(request->headers, "Host", s3_host);
+   request->headers = pgmoneta_http_add_header(request->headers, "Range", &range[0]);
+   request->headers = pgmoneta_http_add_header(request->headers, "x-amz-content-sha256", S3_EMPTY_SHA256);
+   request->headers = pgmoneta_http_add_header(request->headers, "x-amz-date", long_date);
+
+   if (download->number_of_idle > 0)
+   {
+      request->handle = download->idle[--download->number_of_idle];
+   }
+   else
+   {
+      request->handle = curl_easy_init();
+   }
+
+   if (request->handle == NULL)
+   {
+      goto error;
+   }
+
+   request->position = 0;
+
+   pgmoneta_http_set_request_option(request->handle, HTTP_GET);
+   pgmoneta_http_set_url_option(request->handle, request->url);
+   pgmoneta_http_set_header_option(request->handle, request->headers);
+
+   curl_easy_setopt(request->handle, CURLOPT_WRITEFUNCTION, s3_write);
+   curl_easy_setopt(request->handle, CURLOPT_WRITEDATA, (void*)request);
+   curl_easy_setopt(request->handle, CURLOPT_PRIVATE, (void*)request);
+
+   if (curl_multi_add_handle(download->multi, request->handle) != CURLM_OK)
+   {
+      goto error;
+   }
+
+   download->running++;
+
+   free(s3_path);
+   free(path);
+   free(s3_host);
+   free(headers);
+   free(auth_value);
+
+   return 0;
+
+error:
+
+   free(s3_path);
+   free(path);
+   free(s3_host);
+   free(headers);
+   free(auth_value);
+
+   return 1;
+}
+
+static void
+s3_complete_request(struct s3_download* download, CURL* handle, CURLcode result)
+{
+   long code = 0;
+   struct s3_request* request = NULL;
+   struct s3_file* file = NULL;
+
+   curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char**)&request);
+   curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+
+   curl_multi_remove_handle(download->multi, handle);
+   download->running--;
+
+   curl_easy_reset(handle);
+   download->idle[download->number_of_idle++] = handle;
+   request->handle = NULL;
+
+   file = request->file;
+
+   /* A part is only complete with all of its bytes */
+   if (result == CURLE_OK && code == 206 && request->position != request->length)
+   {
+      result = CURLE_PARTIAL_FILE;
+   }
+
+   if (result != CURLE_OK || code != 206)
+   {
+      if (!download->error && request->retries < S3_MAX_RETRIES && (result != CURLE_OK || code >= 500 || code == 408))
+      {
+         request->retries++;
+
+         pgmoneta_log_debug("S3 storage engine: Retrying %s (%s, %ld)", file->relative_path, curl_easy_strerror(result), code);
+
+         if (!s3_send_request(download, request))
+         {
+            return;
+         }
+      }
+
+      pgmoneta_log_error("S3 storage engine: Could not download %s (%s, %ld)", file->relative_path, curl_easy_strerror(result), code);
+      download->error = true;
+      s3_free_request(download, request);
+      return;
+   }
+
+   download->bytes += request->length;
+   file->completed_parts++;
+
+   if (file->completed_parts == file->number_of_parts)
+   {
+      download->downloaded++;
+
+      pgmoneta_log_trace("S3 storage engine: %s (%zu bytes, %d/%d)", file->relative_path, file->size,
+                         download->downloaded, download->number_of_files);
+   }
+
+   s3_free_request(download, request);
+}
+
+static void
+s3_free_request(struct s3_download* download, struct s3_request* request)
+{
+   if (request == NULL)
+   {
+      return;
+   }
+
+   if (request->handle != NULL)
+   {
+      curl_multi_remove_handle(download->multi, request->handle);
+      curl_easy_cleanup(request->handle);
+   }
+
+   s3_release_file(request->file);
+
+   curl_slist_free_all(request->headers);
+   free(request->url);
+   free(request);
+}
+
+static void
+s3_release_file(struct s3_file* file)
+{
+   if (file == NULL)
+   {
+      return;
+   }
+
+   file->references--;
+
+   if (file->references <= 0)
+   {
+      if (file->fd != -1)
+      {
+         close(file->fd);
+      }
+
+      free(file->relative_path);
+      free(file);
+   }
+}
+
+static char*
+s3_sign(char* method, char* path, char* query, char* headers, char* signed_headers,
+        char* payload_sha256, char* short_date, char* long_date)
+{
+   char* canonical_request = NULL;
+   char* canonical_request_sha256 = NULL;
+   char* string_to_sign = NULL;
+   char* key = NULL;
+   char* auth_value = NULL;
+   unsigned char* date_key_hmac = NULL;
+   unsigned char* date_region_key_hmac = NULL;
+   unsigned char* date_region_service_key_hmac = NULL;
+   unsigned char* signing_key_hmac = NULL;
+   unsigned char* signature_hmac = NULL;
+   unsigned char* signature_hex = NULL;
+   int hmac_length = 0;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   // Construct canonical request.
+   canonical_request = pgmoneta_append(canonical_request, method);
+   canonical_request = pgmoneta_append(canonical_request, "\n");
+   canonical_request = pgmoneta_append(canonical_request, path);
+   canonical_request = pgmoneta_append(canonical_request, "\n");
+   canonical_request = pgmoneta_append(canonical_request, query);
+   canonical_request = pgmoneta_append(canonical_request, "\n");
+   canonical_request = pgmoneta_append(canonical_request, headers);
+   canonical_request = pgmoneta_append(canonical_request, "\n");
+   canonical_request = pgmoneta_append(canonical_request, signed_headers);
+   canonical_request = pgmoneta_append(canonical_request, "\n");
+   canonical_request = pgmoneta_append(canonical_request, payload_sha256);
+
+   pgmoneta_generate_string_sha256_hash(canonical_request, &canonical_request_sha256);
+
+   if (canonical_request_sha256 == NULL)
+   {
+      goto error;
+   }
+
+   // Construct string to sign.
+   string_to_sign = pgmoneta_append(string_to_sign, "AWS4-HMAC-SHA256\n");
+   string_to_sign = pgmoneta_append(string_to_sign, long_date);
+   string_to_sign = pgmoneta_append(string_to_sign, "\n");
+   string_to_sign = pgmoneta_append(string_to_sign, short_date);
+   string_to_sign = pgmoneta_append(string_to_sign, "/");
+   string_to_sign = pgmoneta_append(string_to_sign, config->s3_aws_region);
+   string_to_sign = pgmoneta_append(string_to_sign, "/s3/aws4_request\n");
+   string_to_sign = pgmoneta_append(string_to_sign, canonical_request_sha256);
+
+   key = pgmoneta_append(key, "AWS4");
+   key = pgmoneta_append(key, config->s3_secret_access_key);
+
+   if (pgmoneta_generate_string_hmac_sha256_hash(key, strlen(key), short_date, SHORT_TIME_LENGHT - 1, &date_key_hmac, &hmac_length))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_generate_string_hmac_sha256_hash((char*)date_key_hmac, hmac_length, config->s3_aws_region, strlen(config->s3_aws_region), &date_region_key_hmac, &hmac_length))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_generate_string_hmac_sha256_hash((char*)date_region_key_hmac, hmac_length, "s3", strlen("s3"), &date_region_service_key_hmac, &hmac_length))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_generate_string_hmac_sha256_hash((char*)date_region_service_key_hmac, hmac_length, "aws4_request", strlen("aws4_request"), &signing_key_hmac, &hmac_length))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_generate_string_hmac_sha256_hash((char*)signing_key_hmac, hmac_length, string_to_sign, strlen(string_to_sign), &signature_hmac, &hmac_length))
+   {
+      goto error;
+   }
+
+   pgmoneta_convert_base32_to_hex(signature_hmac, hmac_length, &signature_hex);
+
+   auth_value = pgmoneta_append(auth_value, "AWS4-HMAC-SHA256 Credential=");
+   auth_value = pgmoneta_append(auth_value, config->s3_access_key_id);
+   auth_value = pgmoneta_append(auth_value, "/");
+   auth_value = pgmoneta_append(auth_value, short_date);
+   auth_value = pgmoneta_append(auth_value, "/");
+   auth_value = pgmoneta_append(auth_value, config->s3_aws_region);
+   auth_value = pgmoneta_append(auth_value, "/s3/aws4_request,SignedHeaders=");
+   auth_value = pgmoneta_append(auth_value, signed_headers);
+   auth_value = pgmoneta_append(auth_value, ",Signature=");
+   auth_value = pgmoneta_append(auth_value, (char*)signature_hex);
+
+   free(canonical_request);
+   free(canonical_request_sha256);
+   free(string_to_sign);
+   free(key);
+   free(date_key_hmac);
+   free(date_region_key_hmac);
+   free(date_region_service_key_hmac);
+   free(signing_key_hmac);
+   free(signature_hmac);
+   free(signature_hex);
+
+   return auth_value;
+
+error:
+
+   free(canonical_request);
+   free(canonical_request_sha256);
+   free(string_to_sign);
+   free(key);
+   free(date_key_hmac);
+   free(date_region_key_hmac);
+   free(date_region_service_key_hmac);
+   free(signing_key_hmac);
+   free(signature_hmac);
+   free(signature_hex);
+
+   return NULL;
+}
+
+static size_t
+s3_read(char* buffer, size_t size, size_t nitems, void* userdata)
+{
+   if (userdata == NULL)
+   {
+      return 0;
+   }
+
+   return fread(buffer, size, nitems, (FILE*)userdata);
+}
+
+static size_t
+s3_write(char* buffer, size_t size, size_t nitems, void* userdata)
+{
+   long code = 0;
+   size_t length;
+   size_t written = 0;
+   ssize_t w;
+   struct s3_request* request = NULL;
+
+   request = (struct s3_request*)userdata;
+
+   length = size * nitems;
+
+   /* The body of an error isn't part of the object */
+   curl_easy_getinfo(request->handle, CURLINFO_RESPONSE_CODE, &code);
+
+   if (code != 206)
+   {
+      return length;
+   }
+
+   if (request->position + length > request->length)
+   {
+      return 0;
+   }
+
+   while (written < length)
+   {
+      w = pwrite(request->file->fd, buffer + written, length - written,
+                 (off_t)(request->offset + request->position + written));
+
+      if (w <= 0)
+      {
+         return 0;
+      }
+
+      written += (size_t)w;
+   }
+
+   request->position += length;
+
+   return length;
+}
+
 static char*
 s3_get_host(void)
 {
    char* host = NULL;
+   char* start = NULL;
    struct configuration* config;
 
    config = (struct configuration*)shmem;
 
-   host = pgmoneta_append(host, config->s3_bucket);
-   host = pgmoneta_append(host, ".s3.");
-   host = pgmoneta_append(host, config->s3_aws_region);
-   host = pgmoneta_append(host, ".amazonaws.com");
+   if (strlen(config->s3_endpoint) > 0)
+   {
+      start = strstr(config->s3_endpoint, "://");
+      start = start != NULL ? start + 3 : config->s3_endpoint;
+
+      host = pgmoneta_append(host, start);
+
+      if (strchr(host, '/') != NULL)
+      {
+         *strchr(host, '/') = '\0';
+      }
+   }
+   else
+   {
+      host = pgmoneta_append(host, config->s3_bucket);
+      host = pgmoneta_append(host, ".s3.");
+      host = pgmoneta_append(host, config->s3_aws_region);
+      host = pgmoneta_append(host, ".amazonaws.com");
+   }
 
    return host;
 }
 
+static char*
+s3_get_path(char* key)
+{
+   char* path = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   /* An endpoint addresses the bucket in the path */
+   if (strlen(config->s3_endpoint) > 0)
+   {
+      path = pgmoneta_append(path, "/");
+      path = pgmoneta_append(path, config->s3_bucket);
+
+      if (key != NULL)
+      {
+         path = pgmoneta_append(path, "/");
+         path = pgmoneta_append(path, key);
+      }
+   }
+   else
+   {
+      path = pgmoneta_append(path, "/");
+      path = pgmoneta_append(path, key);
+   }
+
+   return path;
+}
+
+static char*
+s3_get_url(char* path)
+{
+   char* url = NULL;
+   char* host = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   host = s3_get_host();
+
+   if (strlen(config->s3_endpoint) > 0 && strstr(config->s3_endpoint, "://") != NULL)
+   {
+      url = pgmoneta_append(url, config->s3_endpoint);
+      *(strstr(url, "://") + 3) = '\0';
+   }
+   else
+   {
+      url = pgmoneta_append(url, "https://");
+   }
+
+   url = pgmoneta_append(url, host);
+   url = pgmoneta_append(url, path);
+
+   free(host);
+
+   return url;
+}
+
 static char*
 s3_get_basepath(int server, char* identifier)
 {
@@ -31,36 +31,107 @@
 /* pgmoneta */
 #include <pgmoneta.h>
 #include <art.h>
+#include <deque.h>
 #include <info.h>
 #include <logging.h>
 #include <string.h>
 #include <utils.h>
 #include <security.h>
 #include <storage.h>
+#include <workers.h>
 
 /* system */
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <libssh/libssh.h>
 #include <libssh/sftp.h>
 
+#define SFTP_BUFFER_SIZE  16384
+#define SFTP_MAX_WRITE    262144
+#define SFTP_MAX_REQUESTS 32
+
+/** @struct sftp_upload
+ * Defines the files of a backup that are uploaded
+ */
+struct sftp_upload
+{
+   char* local_root;      /**< The local root */
+   char* remote_root;     /**< The remote root */
+   struct art* current;   /**< The SHA-256 of the files of the backup */
+   struct deque* files;   /**< The files that are left */
+   int number_of_files;   /**< The number of files */
+   atomic_int uploaded;   /**< The number of files that were uploaded */
+   atomic_ulong bytes;    /**< The number of bytes that were uploaded */
+   atomic_bool error;     /**< Did an upload fail */
+};
+
+/** @struct sftp_uploader
+ * Defines an SFTP session that uploads files
+ */
+struct sftp_uploader
+{
+   ssh_session session;        /**< The SSH session */
+   sftp_session sftp;          /**< The SFTP session */
+   struct sftp_upload* upload; /**< The upload */
+};
+
+/** @struct sftp_download
+ * Defines the files of a backup that are downloaded
+ */
+struct sftp_download
+{
+   char* local_root;      /**< The local root */
+   char* remote_root;     /**< The remote root */
+   struct art* sha256;    /**< The SHA-256 of the files of the backup */
+   struct deque* files;   /**< The files that are left, with their size */
+   int number_of_files;   /**< The number of files */
+   atomic_int downloaded; /**< The number of files that were downloaded */
+   atomic_ulong bytes;    /**< The number of bytes that were downloaded */
+   atomic_bool error;     /**< Did a download fail */
+};
+
+/** @struct sftp_downloader
+ * Defines an SFTP session that downloads files
+ */
+struct sftp_downloader
+{
+   ssh_session session;            /**< The SSH session */
+   sftp_session sftp;              /**< The SFTP session */
+   struct sftp_download* download; /**< The download */
+};
+
 static int ssh_storage_setup(int, char*, struct deque*);
 static int ssh_storage_backup_execute(int, char*, struct deque*);
 static int ssh_storage_wal_shipping_execute(int, char*, struct deque*);
+static int ssh_storage_fetch_execute(int, char*, struct deque*);
 static int ssh_storage_backup_teardown(int, char*, struct deque*);
 static int ssh_storage_wal_shipping_teardown(int, char*, struct deque*);
+static int ssh_storage_fetch_teardown(int, char*, struct deque*);
 
 static char* get_remote_server_basepath(int server);
 static char* get_remote_server_backup(int server);
 static char* get_remote_server_backup_identifier(int server, char* identifier);
 static char* get_remote_server_wal(int server);
 
-static int read_latest_backup_sha256(char* path);
+static int read_backup_sha256(char* path, struct art* map);
+
+static int ssh_open(ssh_session* ssh, sftp_session* sf);
+static void ssh_close(ssh_session ssh, sftp_session sf);
 
 static int sftp_make_directory(char* local_dir, char* remote_dir);
-static int sftp_copy_directory(char* local_root, char* remote_root, char* relative_path);
-static int sftp_copy_file(char* local_root, char* remote_root, char* relative_path);
+static int sftp_copy_directory(char* local_root, char* remote_root, char* relative_path, struct deque* files);
+static int sftp_copy_files(int server, struct sftp_upload* upload);
+static void do_upload(void* arg);
+static int sftp_copy_file(sftp_session sf, char* local_root, char* remote_root, char* relative_path, struct art* current, size_t* bytes);
+static int sftp_write_file(sftp_session sf, FILE* sfile, sftp_file dfile, size_t* bytes);
+static int sftp_list_directory(char* local_root, char* remote_root, char* relative_path, struct deque* files);
+static int sftp_fetch_files(int server, struct sftp_download* download);
+static void do_download(void* arg);
+static int sftp_fetch_file(sftp_session sf, char* remote_path, char* local_path, size_t* bytes);
+static int sftp_read_file(sftp_session sf, sftp_file sfile, int dfile, size_t* bytes);
 static int sftp_wal_prepare(sftp_file* file, int segsize);
 static bool sftp_exists(char* path);
 static int sftp_get_file_size(char* file_path, size_t* file_size);
@@ -75,6 +146,8 @@ static bool is_error = false;
 
 static char* latest_remote_root = NULL;
 
+static char* fetched_label = NULL;
+
 struct workflow*
 pgmoneta_storage_create_ssh(int workflow_type)
 {
@@ -99,6 +172,11 @@ pgmoneta_storage_create_ssh(int workflow_type)
          wf->execute = &ssh_storage_wal_shipping_execute;
          wf->teardown = &ssh_storage_wal_shipping_teardown;
          break;
+      case WORKFLOW_TYPE_RESTORE:
+      case WORKFLOW_TYPE_VERIFY:
+         wf->execute = &ssh_storage_fetch_execute;
+         wf->teardown = &ssh_storage_fetch_teardown;
+         break;
       default:
          break;
    }
@@ -110,6 +188,29 @@ pgmoneta_storage_create_ssh(int workflow_type)
 static int
 ssh_storage_setup(int server, char* identifier, struct deque* nodes)
 {
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   pgmoneta_log_debug("SSH storage engine (setup): %s/%s", config->servers[server].name, identifier);
+   pgmoneta_deque_list(nodes);
+
+   if (ssh_open(&session, &sftp))
+   {
+      is_error = true;
+      return 1;
+   }
+
+   is_error = false;
+
+   return 0;
+}
+
+static int
+ssh_open(ssh_session* ssh, sftp_session* sf)
+{
+   ssh_session s = NULL;
+   sftp_session f = NULL;
    ssh_key srv_pubkey = NULL;
    ssh_key client_pubkey = NULL;
    ssh_key client_privkey = NULL;
@@ -127,41 +228,41 @@ ssh_storage_setup(int server, char* identifier, struct deque* nodes)
 
    config = (struct configuration*)shmem;
 
-   pgmoneta_log_debug("SSH storage engine (setup): %s/%s", config->servers[server].name, identifier);
-   pgmoneta_deque_list(nodes);
+   *ssh = NULL;
+   *sf = NULL;
 
    homedir = getenv("HOME");
    pubkey_path = "/.ssh/id_rsa.pub";
    privkey_path = "/.ssh/id_rsa";
 
-   session = ssh_new();
+   s = ssh_new();
 
-   if (session == NULL)
+   if (s == NULL)
    {
       goto error;
    }
 
-   ssh_options_set(session, SSH_OPTIONS_USER, config->ssh_username);
-   ssh_options_set(session, SSH_OPTIONS_HOST, config->ssh_hostname);
+   ssh_options_set(s, SSH_OPTIONS_USER, config->ssh_username);
+   ssh_options_set(s, SSH_OPTIONS_HOST, config->ssh_hostname);
 
    if (strlen(config->ssh_ciphers) == 0)
    {
-      ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, "aes256-ctr,aes192-ctr,aes128-ctr");
+      ssh_options_set(s, SSH_OPTIONS_CIPHERS_C_S, "aes256-ctr,aes192-ctr,aes128-ctr");
    }
    else
    {
-      ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, config->ssh_ciphers);
+      ssh_options_set(s, SSH_OPTIONS_CIPHERS_C_S, config->ssh_ciphers);
    }
 
-   rc = ssh_connect(session);
+   rc = ssh_connect(s);
    if (rc != SSH_OK)
    {
       pgmoneta_log_error("Remote Backup: Error connecting to %s: %s\n",
-                         config->ssh_hostname, ssh_get_error(session));
+                         config->ssh_hostname, ssh_get_error(s));
       goto error;
    }
 
-   rc = ssh_get_server_publickey(session, &srv_pubkey);
+   rc = ssh_get_server_publickey(s, &srv_pubkey);
    if (rc < 0)
    {
       goto error;
@@ -174,7 +275,7 @@ ssh_storage_setup(int server, char* identifier, struct deque* nodes)
       goto error;
    }
 
-   state = ssh_session_is_known_server(session);
+   state = ssh_session_is_known_server(s);
    switch (state)
    {
       case SSH_KNOWN_HOSTS_OK:
@@ -189,7 +290,7 @@ ssh_storage_setup(int server, char* identifier, struct deque* nodes)
          pgmoneta_log_error("could not find known host file: %s", strerror(errno));
          goto error;
       case SSH_KNOWN_HOSTS_UNKNOWN:
-         rc = ssh_session_update_known_hosts(session);
+         rc = ssh_session_update_known_hosts(s);
          if (rc < 0)
          {
             pgmoneta_log_error("could not update known_hosts file: %s", strerror(errno));
@@ -222,30 +323,28 @@ ssh_storage_setup(int server, char* identifier, struct deque* nodes)
       goto error;
    }
 
-   rc = ssh_userauth_publickey(session, NULL, client_privkey);
+   rc = ssh_userauth_publickey(s, NULL, client_privkey);
    if (rc != SSH_AUTH_SUCCESS)
    {
       pgmoneta_log_error("could not authenticate with public/private key: %s", strerror(errno));
       goto error;
    }
 
-   sftp = sftp_new(session);
+   f = sftp_new(s);
 
-   if (sftp == NULL)
+   if (f == NULL)
    {
-      pgmoneta_log_error("Error: %s\n", ssh_get_error(session));
+      pgmoneta_log_error("Error: %s\n", ssh_get_error(s));
       goto error;
    }
 
-   rc = sftp_init(sftp);
+   rc = sftp_init(f);
    if (rc != SSH_OK)
    {
-      pgmoneta_log_error("Error: %s\n", sftp_get_error(sftp));
+      pgmoneta_log_error("Error: %s\n", sftp_get_error(f));
       goto error;
    }
 
-   is_error = false;
-
    ssh_string_free_char(hexa);
    ssh_clean_pubkey_hash(&srv_pubkey_hash);
    ssh_key_free(srv_pubkey);
@@ -255,12 +354,13 @@ ssh_storage_setup(int server, char* identifier, struct deque* nodes)
    free(pubkey_full_path);
    free(privkey_full_path);
 
+   *ssh = s;
+   *sf = f;
+
    return 0;
 
 error:
 
-   is_error = true;
-
    ssh_string_free_char(hexa);
    ssh_clean_pubkey_hash(&srv_pubkey_hash);
    ssh_key_free(srv_pubkey);
@@ -270,13 +370,29 @@ error:
    free(pubkey_full_path);
    free(privkey_full_path);
 
-   sftp_free(sftp);
+   sftp_free(f);
+
+   if (s != NULL)
+   {
+      ssh_disconnect(s);
+      ssh_free(s);
+   }
 
-   ssh_disconnect(session);
-   ssh_free(session);
    return 1;
 }
 
+static void
+ssh_close(ssh_session ssh, sftp_session sf)
+{
+   sftp_free(sf);
+
+   if (ssh != NULL)
+   {
+      ssh_disconnect(ssh);
+      ssh_free(ssh);
+   }
+}
+
 static int
 ssh_storage_backup_execute(int server, char* identifier,
                            struct deque* nodes)
@@ -285,9 +401,13 @@ ssh_storage_backup_execute(int server, char* identifier,
    char* local_root = NULL;
    char* remote_root = NULL;
    char* latest_backup_sha256 = NULL;
+   char* backup_sha256 = NULL;
    int next_newest = -1;
    int number_of_backups = 0;
    struct backup** backups = NULL;
+   struct art* current = NULL;
+   struct deque* files = NULL;
+   struct sftp_upload upload;
    struct configuration* config;
 
    config = (struct configuration*)shmem;
@@ -295,6 +415,8 @@ ssh_storage_backup_execute(int server, char* identifier,
    pgmoneta_log_debug("SSH storage engine (execute): %s/%s", config->servers[server].name, identifier);
    pgmoneta_deque_list(nodes);
 
+   memset(&upload, 0, sizeof(struct sftp_upload));
+
    remote_root = get_remote_server_backup_identifier(server, identifier);
 
    local_root = pgmoneta_get_server_backup_identifier(server, identifier);
@@ -335,21 +457,53 @@ ssh_storage_backup_execute(int server, char* identifier,
       latest_backup_sha256 = pgmoneta_get_server_backup_identifier(server, backups[next_newest]->label);
       latest_backup_sha256 = pgmoneta_append(latest_backup_sha256, "backup.sha256");
 
-      if (read_latest_backup_sha256(latest_backup_sha256))
+      if (read_backup_sha256(latest_backup_sha256, tree_map))
       {
          goto error;
       }
    }
 
-   sftp_copy_file(local_root, remote_root, "/backup.info");
-   sftp_copy_file(local_root, remote_root, "/backup.sha256");
+   /* The SHA-256 of the files were calculated by the workflow before */
+   if (pgmoneta_art_create(&current))
+   {
+      goto error;
+   }
+
+   backup_sha256 = pgmoneta_append(backup_sha256, local_root);
+   backup_sha256 = pgmoneta_append(backup_sha256, "backup.sha256");
+
+   if (read_backup_sha256(backup_sha256, current))
+   {
+      pgmoneta_log_debug("SSH storage engine: No SHA-256 for %s/%s", config->servers[server].name, identifier);
+   }
+
+   sftp_copy_file(sftp, local_root, remote_root, "/backup.info", NULL, NULL);
+   sftp_copy_file(sftp, local_root, remote_root, "/backup.manifest", NULL, NULL);
+   sftp_copy_file(sftp, local_root, remote_root, "/backup.sha256", NULL, NULL);
 
    local_root = pgmoneta_append(local_root, "/data");
    remote_root = pgmoneta_append(remote_root, "/data");
 
-   if (sftp_copy_directory(local_root, remote_root, "") != 0)
+   if (pgmoneta_deque_create(true, &files))
+   {
+      goto error;
+   }
+
+   if (sftp_copy_directory(local_root, remote_root, "", files) != 0)
+   {
+      pgmoneta_log_error("failed to create the backup directories in the remote server: %s", ssh_get_error(session));
+      goto error;
+   }
+
+   upload.local_root = local_root;
+   upload.remote_root = remote_root;
+   upload.current = current;
+   upload.files = files;
+   upload.number_of_files = (int)pgmoneta_deque_size(files);
+
+   if (sftp_copy_files(server, &upload) != 0)
    {
-      pgmoneta_log_error("failed to transfer the backup directory from the local host to the remote server: %s", strerror(errno));
+      pgmoneta_log_error("failed to transfer the backup directory from the local host to the remote server");
       goto error;
    }
 
@@ -361,10 +515,11 @@ ssh_storage_backup_execute(int server, char* identifier,
    }
    free(backups);
 
-   if (latest_backup_sha256 != NULL)
-   {
-      free(latest_backup_sha256);
-   }
+   free(latest_backup_sha256);
+   free(backup_sha256);
+
+   pgmoneta_art_destroy(current);
+   pgmoneta_deque_destroy(files);
 
    free(server_path);
    free(remote_root);
@@ -382,10 +537,11 @@ error:
    }
    free(backups);
 
-   if (latest_backup_sha256 != NULL)
-   {
-      free(latest_backup_sha256);
-   }
+   free(latest_backup_sha256);
+   free(backup_sha256);
+
+   pgmoneta_art_destroy(current);
+   pgmoneta_deque_destroy(files);
 
    free(server_path);
    free(remote_root);
@@ -429,6 +585,152 @@ error:
    return 1;
 }
 
+static int
+ssh_storage_fetch_execute(int server, char* identifier, struct deque* nodes)
+{
+   char* label = NULL;
+   char* local_root = NULL;
+   char* remote_root = NULL;
+   char* data = NULL;
+   char* from = NULL;
+   char* to = NULL;
+   char* backup_sha256 = NULL;
+   bool local_backup = false;
+   struct art* sha256 = NULL;
+   struct deque* files = NULL;
+   struct sftp_download download;
+   struct configuration* config;
+   char* metadata[] = {"backup.info", "backup.manifest", "backup.sha256"};
+
+   config = (struct configuration*)shmem;
+
+   memset(&download, 0, sizeof(struct sftp_download));
+
+   pgmoneta_log_debug("SSH storage engine (fetch/execute): %s/%s", config->servers[server].name, identifier);
+   pgmoneta_deque_list(nodes);
+
+   if (pgmoneta_get_backup_label(server, identifier, &label))
+   {
+      pgmoneta_log_error("SSH storage engine: No identifier for %s/%s", config->servers[server].name, identifier);
+      goto error;
+   }
+
+   data = pgmoneta_get_server_backup_identifier_data(server, label);
+
+   /* The data of the backup is only removed once it is on the remote server */
+   if (pgmoneta_exists(data))
+   {
+      goto done;
+   }
+
+   local_root = pgmoneta_get_server_backup_identifier(server, label);
+   remote_root = get_remote_server_backup_identifier(server, label);
+
+   local_backup = pgmoneta_exists(local_root);
+
+   if (pgmoneta_mkdir(local_root))
+   {
+      goto error;
+   }
+
+   /* A file that is local is kept, as it is newer than the remote file */
+   for (int i = 0; i < (int)(sizeof(metadata) / sizeof(metadata[0])); i++)
+   {
+      from = pgmoneta_append(from, remote_root);
+      from = pgmoneta_append(from, "/");
+      from = pgmoneta_append(from, metadata[i]);
+
+      to = pgmoneta_append(to, local_root);
+      to = pgmoneta_append(to, metadata[i]);
+
+      if (!pgmoneta_exists(to) && sftp_fetch_file(sftp, from, to, NULL))
+      {
+         pgmoneta_log_debug("SSH storage engine: No %s for %s/%s", metadata[i], config->servers[server].name, label);
+         pgmoneta_delete_file(to, NULL);
+      }
+
+      free(from);
+      from = NULL;
+
+      free(to);
+      to = NULL;
+   }
+
+   if (pgmoneta_art_create(&sha256))
+   {
+      goto error;
+   }
+
+   backup_sha256 = pgmoneta_append(backup_sha256, local_root);
+   backup_sha256 = pgmoneta_append(backup_sha256, "backup.sha256");
+
+   if (read_backup_sha256(backup_sha256, sha256))
+   {
+      pgmoneta_log_debug("SSH storage engine: No SHA-256 for %s/%s", config->servers[server].name, label);
+   }
+
+   remote_root = pgmoneta_append(remote_root, "/data");
+
+   if (pgmoneta_deque_create(true, &files))
+   {
+      goto error;
+   }
+
+   if (sftp_list_directory(data, remote_root, "", files))
+   {
+      pgmoneta_log_error("SSH storage engine: No backup in %s: %s", remote_root, ssh_get_error(session));
+      goto error;
+   }
+
+   download.local_root = data;
+   download.remote_root = remote_root;
+   download.sha256 = sha256;
+   download.files = files;
+   download.number_of_files = (int)pgmoneta_deque_size(files);
+
+   if (sftp_fetch_files(server, &download))
+   {
+      goto error;
+   }
+
+   fetched_label = label;
+   label = NULL;
+
+done:
+
+   pgmoneta_art_destroy(sha256);
+   pgmoneta_deque_destroy(files);
+
+   free(label);
+   free(local_root);
+   free(remote_root);
+   free(data);
+   free(backup_sha256);
+
+   return 0;
+
+error:
+
+   /* A partial download is never used as a backup */
+   if (local_root != NULL)
+   {
+      pgmoneta_delete_directory(local_backup ? data : local_root);
+   }
+
+   pgmoneta_art_destroy(sha256);
+   pgmoneta_deque_destroy(files);
+
+   free(label);
+   free(local_root);
+   free(remote_root);
+   free(data);
+   free(from);
+   free(to);
+   free(backup_sha256);
+
+   return 1;
+}
+
 static int
 ssh_storage_backup_teardown(int server, char* identifier, struct deque* nodes)
 {
@@ -457,9 +759,42 @@ ssh_storage_backup_teardown(int server, char* identifier, struct deque* nodes)
 
    free(latest_remote_root);
 
-   sftp_free(sftp);
+   ssh_close(session, sftp);
+
+   session = NULL;
+   sftp = NULL;
+
+   return 0;
+}
+
+static int
+ssh_storage_fetch_teardown(int server, char* identifier, struct deque* nodes)
+{
+   char* root = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   pgmoneta_log_debug("SSH storage engine (fetch/teardown): %s/%s", config->servers[server].name, identifier);
+   pgmoneta_deque_list(nodes);
+
+   /* The backup is back to the state after its upload */
+   if (fetched_label != NULL)
+   {
+      root = pgmoneta_get_server_backup_identifier_data(server, fetched_label);
+
+      pgmoneta_delete_directory(root);
+
+      free(fetched_label);
+      fetched_label = NULL;
+   }
+
+   free(root);
+
+   ssh_close(session, sftp);
 
-   ssh_free(session);
+   session = NULL;
+   sftp = NULL;
 
    return 0;
 }
@@ -474,9 +809,10 @@ ssh_storage_wal_shipping_teardown(int server, char* identifier, struct deque* no
    pgmoneta_log_debug("SSH storage engine (WAL shipping/teardown): %s/%s", config->servers[server].name, identifier);
    pgmoneta_deque_list(nodes);
 
-   sftp_free(sftp);
+   ssh_close(session, sftp);
 
-   ssh_free(session);
+   session = NULL;
+   sftp = NULL;
 
    return 0;
 }
@@ -526,7 +862,7 @@ error:
 }
 
 static int
-sftp_copy_directory(char* local_root, char* remote_root, char* relative_path)
+sftp_copy_directory(char* local_root, char* remote_root, char* relative_path, struct deque* files)
 {
    char* from = NULL;
    char* to = NULL;
@@ -571,7 +907,10 @@ sftp_copy_directory(char* local_root, char* remote_root, char* relative_path)
 
          snprintf(relative_dir, sizeof(relative_dir), "%s/%s", relative_path, entry->d_name);
 
-         sftp_copy_directory(local_root, remote_root, relative_dir);
+         if (sftp_copy_directory(local_root, remote_root, relative_dir, files))
+         {
+            goto error;
+         }
       }
       else
       {
@@ -581,11 +920,8 @@ sftp_copy_directory(char* local_root, char* remote_root, char* relative_path)
          relative_file = pgmoneta_append(relative_file, "/");
          relative_file = pgmoneta_append(relative_file, entry->d_name);
 
-         if (sftp_copy_file(local_root, remote_root, relative_file))
-         {
-            free(relative_file);
-            goto error;
-         }
+         /* The files are uploaded once all directories exist */
+         pgmoneta_deque_add(files, NULL, (uintptr_t)relative_file, ValueString);
 
          free(relative_file);
       }
@@ -600,7 +936,10 @@ sftp_copy_directory(char* local_root, char* remote_root, char* relative_path)
 
 error:
 
-   closedir(dir);
+   if (dir != NULL)
+   {
+      closedir(dir);
+   }
 
    free(from);
    free(to);
@@ -609,117 +948,861 @@ error:
 }
 
 static int
-sftp_copy_file(char* local_root, char* remote_root, char* relative_path)
+sftp_copy_files(int server, struct sftp_upload* upload)
 {
-   char* s = NULL;
-   char* d = NULL;
-   char* sha256 = NULL;
-   char* latest_sha256 = NULL;
-   char* latest_backup_path = NULL;
-   char buffer[16384];
-   FILE* sfile = NULL;
-   sftp_file dfile = NULL;
-   unsigned long read_bytes = 0;
-   mode_t mode = 0;
-   bool is_link = false;
+   int number_of_sessions = 1;
+   int number_of_workers = 0;
+   time_t start_time;
+   struct workers* workers = NULL;
+   struct sftp_uploader* uploaders = NULL;
+   struct configuration* config;
 
-   s = pgmoneta_append(s, local_root);
-   s = pgmoneta_append(s, relative_path);
+   config = (struct configuration*)shmem;
 
-   d = pgmoneta_append(d, remote_root);
-   d = pgmoneta_append(d, relative_path);
+   start_time = time(NULL);
 
-   pgmoneta_create_sha256_file(s, &sha256);
+   number_of_workers = pgmoneta_get_number_of_workers(server);
 
-   if (latest_remote_root != NULL)
+   if (number_of_workers > 1 && upload->number_of_files > 1)
    {
-      latest_backup_path = pgmoneta_append(latest_backup_path, latest_remote_root);
-      latest_backup_path = pgmoneta_append(latest_backup_path, relative_path);
-
-      if ((latest_sha256 = (char*)pgmoneta_art_search(tree_map, (unsigned char*)relative_path, strlen(relative_path) + 1)) != NULL)
-      {
-         if (!strcmp(latest_sha256, sha256))
-         {
-            is_link = true;
-         }
-      }
+      number_of_sessions = MIN(number_of_workers, upload->number_of_files);
    }
 
-   if (is_link)
+   uploaders = (struct sftp_uploader*)calloc(number_of_sessions, sizeof(struct sftp_uploader));
+
+   if (uploaders == NULL)
    {
-      if (sftp_symlink(sftp, latest_backup_path, d) < 0)
-      {
-         pgmoneta_log_error("Failed to link remotely: %s", ssh_get_error(session));
-         goto error;
-      }
+      goto error;
    }
-   else
-   {
-      mode = pgmoneta_get_permission(s);
 
-      sfile = fopen(s, "rb");
+   /* Each worker uploads over its own session, as a session can't be shared between threads */
+   uploaders[0].session = session;
+   uploaders[0].sftp = sftp;
+   uploaders[0].upload = upload;
 
-      if (sfile == NULL)
+   for (int i = 1; i < number_of_sessions; i++)
+   {
+      if (ssh_open(&uploaders[i].session, &uploaders[i].sftp))
       {
-         goto error;
+         pgmoneta_log_warn("SSH storage engine: Using %d sessions for %s", i, config->servers[server].name);
+         number_of_sessions = i;
+         break;
       }
 
-      dfile = sftp_open(sftp, d, O_WRONLY | O_CREAT | O_TRUNC, mode);
+      uploaders[i].upload = upload;
+   }
 
-      if (dfile == NULL)
+   if (number_of_sessions > 1)
+   {
+      if (pgmoneta_workers_initialize(number_of_sessions, &workers))
       {
          goto error;
       }
 
-      memset(buffer, 0, sizeof(buffer));
-
-      while ((read_bytes = fread(buffer, 1, sizeof(buffer), sfile)) > 0)
+      for (int i = 0; i < number_of_sessions; i++)
       {
-         sftp_write(dfile, buffer, read_bytes);
+         pgmoneta_workers_add(workers, do_upload, (void*)&uploaders[i]);
       }
-   }
 
-   if (sfile != NULL)
-   {
-      fclose(sfile);
+      pgmoneta_workers_wait(workers);
+      pgmoneta_workers_destroy(workers);
+      workers = NULL;
    }
-
-   if (dfile != NULL)
+   else
    {
-      sftp_close(dfile);
+      do_upload((void*)&uploaders[0]);
    }
 
-   free(s);
-   free(d);
-   free(sha256);
+   pgmoneta_log_debug("SSH storage engine: Uploaded %d/%d files (%lu bytes) over %d sessions for %s (Elapsed: %.0f s)",
+                      atomic_load(&upload->uploaded), upload->number_of_files, atomic_load(&upload->bytes),
+                      number_of_sessions, config->servers[server].name, difftime(time(NULL), start_time));
 
-   if (latest_backup_path != NULL)
+   for (int i = 1; i < number_of_sessions; i++)
    {
-      free(latest_backup_path);
+      ssh_close(uploaders[i].session, uploaders[i].sftp);
    }
 
-   return 0;
+   free(uploaders);
+
+   return atomic_load(&upload->error) ? 1 : 0;
 
 error:
 
-   if (sfile != NULL)
+   if (uploaders != NULL)
    {
-      fclose(sfile);
+      for (int i = 1; i < number_of_sessions; i++)
+      {
+         ssh_close(uploaders[i].session, uploaders[i].sftp);
+      }
    }
 
-   if (dfile != NULL)
-   {
-      sftp_close(dfile);
-   }
+   free(uploaders);
 
-   free(s);
-   free(d);
-   free(sha256);
+   return 1;
+}
 
-   if (latest_backup_path != NULL)
+static void
+do_upload(void* arg)
+{
+   char* relative_path = NULL;
+   size_t bytes = 0;
+   int uploaded;
+   struct sftp_uploader* uploader = NULL;
+   struct sftp_upload* upload = NULL;
+
+   uploader = (struct sftp_uploader*)arg;
+   upload = uploader->upload;
+
+   while (!atomic_load(&upload->error) &&
+          (relative_path = (char*)pgmoneta_deque_poll(upload->files, NULL)) != NULL)
    {
-      free(latest_backup_path);
-   }
+      bytes = 0;
+
+      if (sftp_copy_file(uploader->sftp, upload->local_root, upload->remote_root, relative_path, upload->current, &bytes))
+      {
+         pgmoneta_log_error("SSH storage engine: Could not upload %s: %s", relative_path, ssh_get_error(uploader->session));
+         atomic_store(&upload->error, true);
+      }
+      else
+      {
+         uploaded = atomic_fetch_add(&upload->uploaded, 1) + 1;
+         atomic_fetch_add(&upload->bytes, bytes);
+
+         pgmoneta_log_trace("SSH storage engine: %s (%zu bytes, %d/%d)", relative_path, bytes, uploaded, upload->number_of_files);
+      }
+
+      free(relative_path);
+      relative_path = NULL;
+   }
+}
+
+static int
+sftp_copy_file(sftp_session sf, char* local_root, char* remote_root, char* relative_path, struct art* current, size_t* bytes)
+{
+   char* s = NULL;
+   char* d = NULL;
+   char* sha256 = NULL;
+   char* latest_sha256 = NULL;
+   char* latest_backup_path = NULL;
+   FILE* sfile = NULL;
+   sftp_file dfile = NULL;
+   size_t written = 0;
+   mode_t mode = 0;
+   bool is_link = false;
+
+   s = pgmoneta_append(s, local_root);
+   s = pgmoneta_append(s, relative_path);
+
+   d = pgmoneta_append(d, remote_root);
+   d = pgmoneta_append(d, relative_path);
+
+   if (latest_remote_root != NULL)
+   {
+      latest_backup_path = pgmoneta_append(latest_backup_path, latest_remote_root);
+      latest_backup_path = pgmoneta_append(latest_backup_path, relative_path);
+
+      if ((latest_sha256 = (char*)pgmoneta_art_search(tree_map, (unsigned char*)relative_path, strlen(relative_path) + 1)) != NULL)
+      {
+         if (current != NULL)
+         {
+            sha256 = pgmoneta_append(sha256, (char*)pgmoneta_art_search(current, (unsigned char*)relative_path, strlen(relative_path) + 1));
+         }
+
+         if (sha256 == NULL)
+         {
+            pgmoneta_create_sha256_file(s, &sha256);
+         }
+
+         if (sha256 != NULL && !strcmp(latest_sha256, sha256))
+         {
+            is_link = true;
+         }
+      }
+   }
+
+   if (is_link)
+   {
+      if (sftp_symlink(sf, latest_backup_path, d) < 0)
+      {
+         pgmoneta_log_error("Failed to link remotely: %s", d);
+         goto error;
+      }
+   }
+   else
+   {
+      mode = pgmoneta_get_permission(s);
+
+      sfile = fopen(s, "rb");
+
+      if (sfile == NULL)
+      {
+         goto error;
+      }
+
+      dfile = sftp_open(sf, d, O_WRONLY | O_CREAT | O_TRUNC, mode);
+
+      if (dfile == NULL)
+      {
+         goto error;
+      }
+
+      if (sftp_write_file(sf, sfile, dfile, &written))
+      {
+         goto error;
+      }
+   }
+
+   if (bytes != NULL)
+   {
+      *bytes = written;
+   }
+
+   if (sfile != NULL)
+   {
+      fclose(sfile);
+      sfile = NULL;
+   }
+
+   if (dfile != NULL && sftp_close(dfile) != SSH_OK)
+   {
+      dfile = NULL;
+      goto error;
+   }
+
+   free(s);
+   free(d);
+   free(sha256);
+   free(latest_backup_path);
+
+   return 0;
+
+error:
+
+   if (sfile != NULL)
+   {
+      fclose(sfile);
+   }
+
+   if (dfile != NULL)
+   {
+      sftp_close(dfile);
+   }
+
+   free(s);
+   free(d);
+   free(sha256);
+   free(latest_backup_path);
+
+   return 1;
+}
+
+static int
+sftp_write_file(sftp_session sf, FILE* sfile, sftp_file dfile, size_t* bytes)
+{
+   char* buffer = NULL;
+   size_t buffer_size = SFTP_BUFFER_SIZE;
+   size_t read_bytes = 0;
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 11, 0)
+   sftp_aio requests[SFTP_MAX_REQUESTS];
+   size_t lengths[SFTP_MAX_REQUESTS];
+   sftp_limits_t limits = NULL;
+   int first = 0;
+   int in_flight = 0;
+   bool eof = false;
+#endif
+
+   *bytes = 0;
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 11, 0)
+   /* Keep many writes in flight, so an upload isn't limited to one round trip per write */
+   limits = sftp_limits(sf);
+   if (limits != NULL)
+   {
+      buffer_size = MIN(MAX(limits->max_write_length, SFTP_BUFFER_SIZE), SFTP_MAX_WRITE);
+      sftp_limits_free(limits);
+   }
+#else
+   (void)sf;
+#endif
+
+   buffer = (char*)malloc(buffer_size);
+
+   if (buffer == NULL)
+   {
+      goto error;
+   }
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 11, 0)
+   while (!eof || in_flight > 0)
+   {
+      while (!eof && in_flight < SFTP_MAX_REQUESTS)
+      {
+         int slot = (first + in_flight) % SFTP_MAX_REQUESTS;
+
+         read_bytes = fread(buffer, 1, buffer_size, sfile);
+
+         if (read_bytes == 0)
+         {
+            if (ferror(sfile))
+            {
+               goto error;
+            }
+
+            eof = true;
+            break;
+         }
+
+         /* The data is copied into the request, so the buffer can be reused */
+         if (sftp_aio_begin_write(dfile, buffer, read_bytes, &requests[slot]) < 0)
+         {
+            goto error;
+         }
+
+         lengths[slot] = read_bytes;
+         in_flight++;
+      }
+
+      if (in_flight > 0)
+      {
+         ssize_t written = sftp_aio_wait_write(&requests[first]);
+
+         if (written < 0 || (size_t)written != lengths[first])
+         {
+            in_flight--;
+            first = (first + 1) % SFTP_MAX_REQUESTS;
+            goto error;
+         }
+
+         *bytes += (size_t)written;
+
+         in_flight--;
+         first = (first + 1) % SFTP_MAX_REQUESTS;
+      }
+   }
+#else
+   while ((read_bytes = fread(buffer, 1, buffer_size, sfile)) > 0)
+   {
+      if (sftp_write(dfile, buffer, read_bytes) != (ssize_t)read_bytes)
+      {
+         goto error;
+      }
+
+      *bytes += read_bytes;
+   }
+
+   if (ferror(sfile))
+   {
+      goto error;
+   }
+#endif
+
+   free(buffer);
+
+   return 0;
+
+error:
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 11, 0)
+   /* The replies of the requests that are still in flight are consumed */
+   while (in_flight > 0)
+   {
+      sftp_aio_wait_write(&requests[first]);
+      in_flight--;
+      first = (first + 1) % SFTP_MAX_REQUESTS;
+   }
+#endif
+
+   free(buffer);
+
+   return 1;
+}
+
+static int
+sftp_list_directory(char* local_root, char* remote_root, char* relative_path, struct deque* files)
+{
+   char* from = NULL;
+   char* to = NULL;
+   char* relative_file = NULL;
+   sftp_dir dir = NULL;
+   sftp_attributes attributes = NULL;
+   sftp_attributes target = NULL;
+
+   from = pgmoneta_append(from, remote_root);
+   from = pgmoneta_append(from, relative_path);
+
+   to = pgmoneta_append(to, local_root);
+   to = pgmoneta_append(to, relative_path);
+
+   if (pgmoneta_mkdir(to))
+   {
+      goto error;
+   }
+
+   dir = sftp_opendir(sftp, from);
+
+   if (dir == NULL)
+   {
+      goto error;
+   }
+
+   while ((attributes = sftp_readdir(sftp, dir)) != NULL)
+   {
+      if (strcmp(attributes->name, ".") == 0 || strcmp(attributes->name, "..") == 0)
+      {
+         sftp_attributes_free(attributes);
+         continue;
+      }
+
+      relative_file = pgmoneta_append(relative_file, relative_path);
+      relative_file = pgmoneta_append(relative_file, "/");
+      relative_file = pgmoneta_append(relative_file, attributes->name);
+
+      /* A file that is the same as in the previous backup is a link to it */
+      if (attributes->type == SSH_FILEXFER_TYPE_SYMLINK)
+      {
+         free(from);
+         from = NULL;
+
+         from = pgmoneta_append(from, remote_root);
+         from = pgmoneta_append(from, relative_file);
+
+         target = sftp_stat(sftp, from);
+
+         if (target == NULL)
+         {
+            pgmoneta_log_error("SSH storage engine: Broken link %s", from);
+            goto error;
+         }
+
+         attributes->type = target->type;
+         attributes->size = target->size;
+
+         sftp_attributes_free(target);
+         target = NULL;
+      }
+
+      if (attributes->type == SSH_FILEXFER_TYPE_DIRECTORY)
+      {
+         if (sftp_list_directory(local_root, remote_root, relative_file, files))
+         {
+            goto error;
+         }
+      }
+      else
+      {
+         /* The files are downloaded once all directories exist */
+         pgmoneta_deque_add(files, relative_file, (uintptr_t)attributes->size, ValueUInt64);
+      }
+
+      free(relative_file);
+      relative_file = NULL;
+
+      sftp_attributes_free(attributes);
+      attributes = NULL;
+   }
+
+   if (!sftp_dir_eof(dir))
+   {
+      goto error;
+   }
+
+   sftp_closedir(dir);
+
+   free(from);
+   free(to);
+
+   return 0;
+
+error:
+
+   sftp_attributes_free(attributes);
+
+   if (dir != NULL)
+   {
+      sftp_closedir(dir);
+   }
+
+   free(from);
+   free(to);
+   free(relative_file);
+
+   return 1;
+}
+
+static int
+sftp_fetch_files(int server, struct sftp_download* download)
+{
+   int number_of_sessions = 1;
+   int number_of_workers = 0;
+   time_t start_time;
+   struct workers* workers = NULL;
+   struct sftp_downloader* downloaders = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   start_time = time(NULL);
+
+   number_of_workers = pgmoneta_get_number_of_workers(server);
+
+   if (number_of_workers > 1 && download->number_of_files > 1)
+   {
+      number_of_sessions = MIN(number_of_workers, download->number_of_files);
+   }
+
+   downloaders = (struct sftp_downloader*)calloc(number_of_sessions, sizeof(struct sftp_downloader));
+
+   if (downloaders == NULL)
+   {
+      goto error;
+   }
+
+   /* Each worker downloads over its own session, as a session can't be shared between threads */
+   downloaders[0].session = session;
+   downloaders[0].sftp = sftp;
+   downloaders[0].download = download;
+
+   for (int i = 1; i < number_of_sessions; i++)
+   {
+      if (ssh_open(&downloaders[i].session, &downloaders[i].sftp))
+      {
+         pgmoneta_log_warn("SSH storage engine: Using %d sessions for %s", i, config->servers[server].name);
+         number_of_sessions = i;
+         break;
+      }
+
+      downloaders[i].download = download;
+   }
+
+   if (number_of_sessions > 1)
+   {
+      if (pgmoneta_workers_initialize(number_of_sessions, &workers))
+      {
+         goto error;
+      }
+
+      for (int i = 0; i < number_of_sessions; i++)
+      {
+         pgmoneta_workers_add(workers, do_download, (void*)&downloaders[i]);
+      }
+
+      pgmoneta_workers_wait(workers);
+      pgmoneta_workers_destroy(workers);
+      workers = NULL;
+   }
+   else
+   {
+      do_download((void*)&downloaders[0]);
+   }
+
+   pgmoneta_log_debug("SSH storage engine: Downloaded %d/%d files (%lu bytes) over %d sessions for %s (Elapsed: %.0f s)",
+                      atomic_load(&download->downloaded), download->number_of_files, atomic_load(&download->bytes),
+                      number_of_sessions, config->servers[server].name, difftime(time(NULL), start_time));
+
+   for (int i = 1; i < number_of_sessions; i++)
+   {
+      ssh_close(downloaders[i].session, downloaders[i].sftp);
+   }
+
+   free(downloaders);
+
+   return atomic_load(&download->error) ? 1 : 0;
+
+error:
+
+   if (downloaders != NULL)
+   {
+      for (int i = 1; i < number_of_sessions; i++)
+      {
+         ssh_close(downloaders[i].session, downloaders[i].sftp);
+      }
+   }
+
+   free(downloaders);
+
+   return 1;
+}
+
+static void
+do_download(void* arg)
+{
+   char* relative_path = NULL;
+   char* from = NULL;
+   char* to = NULL;
+   char* sha256 = NULL;
+   char* expected = NULL;
+   size_t size = 0;
+   size_t bytes = 0;
+   int downloaded;
+   struct sftp_downloader* downloader = NULL;
+   struct sftp_download* download = NULL;
+
+   downloader = (struct sftp_downloader*)arg;
+   download = downloader->download;
+
+   while (!atomic_load(&download->error))
+   {
+      relative_path = NULL;
+      size = (size_t)pgmoneta_deque_poll(download->files, &relative_path);
+
+      if (relative_path == NULL)
+      {
+         break;
+      }
+
+      bytes = 0;
+
+      from = pgmoneta_append(from, download->remote_root);
+      from = pgmoneta_append(from, relative_path);
+
+      to = pgmoneta_append(to, download->local_root);
+      to = pgmoneta_append(to, relative_path);
+
+      if (sftp_fetch_file(downloader->sftp, from, to, &bytes))
+      {
+         pgmoneta_log_error("SSH storage engine: Could not download %s: %s", relative_path, ssh_get_error(downloader->session));
+         atomic_store(&download->error, true);
+      }
+      else if (bytes != size)
+      {
+         pgmoneta_log_error("SSH storage engine: Size of %s is %zu, expected %zu", relative_path, bytes, size);
+         atomic_store(&download->error, true);
+      }
+      else
+      {
+         /* The file is verified against the SHA-256 from its upload */
+         expected = (char*)pgmoneta_art_search(download->sha256, (unsigned char*)relative_path, strlen(relative_path) + 1);
+
+         if (expected != NULL)
+         {
+            pgmoneta_create_sha256_file(to, &sha256);
+
+            if (sha256 == NULL || strcmp(sha256, expected))
+            {
+               pgmoneta_log_error("SSH storage engine: SHA-256 mismatch for %s", relative_path);
+               atomic_store(&download->error, true);
+            }
+         }
+
+         if (!atomic_load(&download->error))
+         {
+            downloaded = atomic_fetch_add(&download->downloaded, 1) + 1;
+            atomic_fetch_add(&download->bytes, bytes);
+
+            pgmoneta_log_trace("SSH storage engine: %s (%zu bytes, %d/%d)", relative_path, bytes, downloaded, download->number_of_files);
+         }
+      }
+
+      free(sha256);
+      sha256 = NULL;
+
+      free(from);
+      from = NULL;
+
+      free(to);
+      to = NULL;
+
+      free(relative_path);
+      relative_path = NULL;
+   }
+}
+
+static int
+sftp_fetch_file(sftp_session sf, char* remote_path, char* local_path, size_t* bytes)
+{
+   sftp_file sfile = NULL;
+   int dfile = -1;
+   size_t read = 0;
+
+   sfile = sftp_open(sf, remote_path, O_RDONLY, 0);
+
+   if (sfile == NULL)
+   {
+      goto error;
+   }
+
+   dfile = open(local_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+   if (dfile == -1)
+   {
+      goto error;
+   }
+
+   if (sftp_read_file(sf, sfile, dfile, &read))
+   {
+      goto error;
+   }
+
+   if (bytes != NULL)
+   {
+      *bytes = read;
+   }
+
+   sftp_close(sfile);
+
+   if (close(dfile) != 0)
+   {
+      return 1;
+   }
+
+   return 0;
+
+error:
+
+   if (sfile != NULL)
+   {
+      sftp_close(sfile);
+   }
+
+   if (dfile != -1)
+   {
+      close(dfile);
+   }
+
+   return 1;
+}
+
+static int
+sftp_read_file(sftp_session sf, sftp_file sfile, int dfile, size_t* bytes)
+{
+   char* buffer = NULL;
+   size_t buffer_size = SFTP_BUFFER_SIZE;
+   ssize_t read_bytes = 0;
+   size_t written = 0;
+   ssize_t w;
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 11, 0)
+   sftp_aio requests[SFTP_MAX_REQUESTS];
+   size_t lengths[SFTP_MAX_REQUESTS];
+   sftp_limits_t limits = NULL;
+   sftp_attributes attributes = NULL;
+   size_t size = 0;
+   size_t requested = 0;
+   int first = 0;
+   int in_flight = 0;
+#endif
+
+   *bytes = 0;
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 11, 0)
+   /* Keep many reads in flight, so a download isn't limited to one round trip per read */
+   limits = sftp_limits(sf);
+   if (limits != NULL)
+   {
+      buffer_size = MIN(MAX(limits->max_read_length, SFTP_BUFFER_SIZE), SFTP_MAX_WRITE);
+      sftp_limits_free(limits);
+   }
+
+   attributes = sftp_fstat(sfile);
+
+   if (attributes == NULL)
+   {
+      goto error;
+   }
+
+   size = attributes->size;
+   sftp_attributes_free(attributes);
+#else
+   (void)sf;
+#endif
+
+   buffer = (char*)malloc(buffer_size);
+
+   if (buffer == NULL)
+   {
+      goto error;
+   }
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 11, 0)
+   while (requested < size || in_flight > 0)
+   {
+      while (requested < size && in_flight < SFTP_MAX_REQUESTS)
+      {
+         int slot = (first + in_flight) % SFTP_MAX_REQUESTS;
+
+         lengths[slot] = MIN(buffer_size, size - requested);
+
+         if (sftp_aio_begin_read(sfile, lengths[slot], &requests[slot]) < 0)
+         {
+            goto error;
+         }
+
+         requested += lengths[slot];
+         in_flight++;
+      }
+
+      if (in_flight > 0)
+      {
+         read_bytes = sftp_aio_wait_read(&requests[first], buffer, buffer_size);
+
+         in_flight--;
+
+         /* The reads are at consecutive offsets, so a short read would leave a hole */
+         if (read_bytes < 0 || (size_t)read_bytes != lengths[first])
+         {
+            first = (first + 1) % SFTP_MAX_REQUESTS;
+            goto error;
+         }
+
+         first = (first + 1) % SFTP_MAX_REQUESTS;
+
+         written = 0;
+         while (written < (size_t)read_bytes)
+         {
+            w = write(dfile, buffer + written, (size_t)read_bytes - written);
+
+            if (w <= 0)
+            {
+               goto error;
+            }
+
+            written += (size_t)w;
+         }
+
+         *bytes += (size_t)read_bytes;
+      }
+   }
+#else
+   while ((read_bytes = sftp_read(sfile, buffer, buffer_size)) > 0)
+   {
+      written = 0;
+      while (written < (size_t)read_bytes)
+      {
+         w = write(dfile, buffer + written, (size_t)read_bytes - written);
+
+         if (w <= 0)
+         {
+            goto error;
+         }
+
+         written += (size_t)w;
+      }
+
+      *bytes += (size_t)read_bytes;
+   }
+
+   if (read_bytes < 0)
+   {
+      goto error;
+   }
+#endif
+
+   free(buffer);
+
+   return 0;
+
+error:
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 11, 0)
+   /* The replies of the requests that are still in flight are consumed */
+   while (in_flight > 0)
+   {
+      sftp_aio_wait_read(&requests[first], buffer, buffer_size);
+      in_flight--;
+      first = (first + 1) % SFTP_MAX_REQUESTS;
+   }
+#endif
+
+   free(buffer);
 
    return 1;
 }
@@ -749,7 +1832,7 @@ sftp_wal_prepare(sftp_file* file, int segsize)
 }
 
 static int
-read_latest_backup_sha256(char* path)
+read_backup_sha256(char* path, struct art* map)
 {
    char buffer[4096];
    FILE* file = NULL;
@@ -792,7 +1875,7 @@ read_latest_backup_sha256(char* path)
       memset(hash, 0, strlen(ptr));
       memcpy(hash, ptr, strlen(ptr) - 1);
 
-      pgmoneta_art_insert(tree_map, (unsigned char*)file_path, strlen(file_path) + 1, (uintptr_t)hash, ValueString);
+      pgmoneta_art_insert(map, (unsigned char*)file_path, strlen(file_path) + 1, (uintptr_t)hash, ValueString);
       free(file_path);
    }
 
@@ -28,6 +28,7 @@
 
 /* pgmoneta */
 #include <pgmoneta.h>
+#include <crc32c.h>
 #include <logging.h>
 #include <memory.h>
 #include <message.h>
@@ -37,6 +38,9 @@
 #include <utils.h>
 
 /* system */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -57,9 +61,6 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
-#ifdef HAVE_SSE42
-#include <immintrin.h>
-#endif
 
 #define SECURITY_INVALID  -2
 #define SECURITY_REJECT   -1
@@ -72,10 +73,17 @@
 #define NUMBER_OF_SECURITY_MESSAGES    5
 #define SECURITY_BUFFER_SIZE        1024
 
+#define HASH_BUFFER_SIZE (1024 * 1024)
+
 static signed char has_security;
 static ssize_t security_lengths[NUMBER_OF_SECURITY_MESSAGES];
 static char security_messages[NUMBER_OF_SECURITY_MESSAGES][SECURITY_BUFFER_SIZE];
 
+static pthread_mutex_t master_key_lock = PTHREAD_MUTEX_INITIALIZER;
+static char* master_key = NULL;
+static size_t master_key_length = 0;
+static bool master_key_wipe = false;
+
 static int get_auth_type(struct message* msg, int* auth_type);
 static int get_salt(void* data, char** salt);
 static int generate_md5(char* str, int length, char** md5);
@@ -89,6 +97,9 @@ static int server_scram256(char* username, char* password, SSL* ssl, int server_
 
 static char* get_admin_password(char* username);
 
+static int read_master_key(char** masterkey, size_t* masterkey_length);
+static void wipe_master_key(void);
+
 static int sasl_prep(char* password, char** password_prep);
 static int generate_nounce(char** nounce);
 static int get_scram_attribute(char attribute, char* input, size_t size, char** value);
@@ -115,6 +126,13 @@ static int  create_ssl_server(SSL_CTX* ctx, int socket, SSL** ssl);
 
 static int create_hash_file(char* filename, const char* algorithm, char** hash);
 
+static void crc32c_init(void);
+static uint32_t crc32c_slicing_by_8(uint32_t crc, const void* buffer, size_t size);
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_function)(uint32_t crc, const void* buffer, size_t size) = NULL;
+
 int
 pgmoneta_remote_management_auth(int client_fd, char* address, SSL** client_ssl)
 {
@@ -1733,6 +1751,76 @@ get_admin_password(char* username)
 
 int
 pgmoneta_get_master_key(char** masterkey)
+{
+   char* mk = NULL;
+
+   *masterkey = NULL;
+
+   pthread_mutex_lock(&master_key_lock);
+
+   /* The key is only read from the file once, and is wiped when the process exits */
+   if (master_key == NULL)
+   {
+      if (read_master_key(&master_key, &master_key_length))
+      {
+         goto error;
+      }
+
+      if (!master_key_wipe)
+      {
+         atexit(wipe_master_key);
+         master_key_wipe = true;
+      }
+   }
+
+   mk = (char*)malloc(master_key_length + 1);
+
+   if (mk == NULL)
+   {
+      goto error;
+   }
+
+   memcpy(mk, master_key, master_key_length);
+   mk[master_key_length] = '\0';
+
+   pthread_mutex_unlock(&master_key_lock);
+
+   *masterkey = mk;
+
+   return 0;
+
+error:
+
+   pthread_mutex_unlock(&master_key_lock);
+
+   return 1;
+}
+
+void
+pgmoneta_reset_master_key(void)
+{
+   pthread_mutex_lock(&master_key_lock);
+
+   wipe_master_key();
+
+   pthread_mutex_unlock(&master_key_lock);
+}
+
+static void
+wipe_master_key(void)
+{
+   if (master_key != NULL)
+   {
+      OPENSSL_cleanse(master_key, master_key_length);
+      free(master_key);
+
+      master_key = NULL;
+      master_key_length = 0;
+   }
+}
+
+static int
+read_master_key(char** masterkey, size_t* masterkey_length)
 {
    FILE* master_key_file = NULL;
    char buf[MISC_LENGTH];
@@ -1798,7 +1886,10 @@ pgmoneta_get_master_key(char** masterkey)
 
    pgmoneta_base64_decode(&line[0], strlen(&line[0]), (void**)&mk, &mk_length);
 
+   OPENSSL_cleanse(&line[0], sizeof(line));
+
    *masterkey = mk;
+   *masterkey_length = mk_length;
 
    fclose(master_key_file);
 
@@ -2945,156 +3036,112 @@ pgmoneta_create_crc32c_buffer(void* buffer, size_t size, uint32_t* crc)
       return 1;
    }
 
-   #ifdef HAVE_SSE42
+   pthread_once(&crc32c_once, &crc32c_init);
 
-   uint64_t crc_long = (uint64_t) ~(*crc);
+   *crc = ~crc32c_function(~(*crc), buffer, size);
 
-   for (int i = 0; i < size / 8; i++)
-   {
-      crc_long = _mm_crc32_u64(crc_long, *((uint64_t*)buffer));
-      buffer += 8;
-   }
-   for (int i = 0; i < (size % 8); i++)
+   return 0;
+}
+
+int
+pgmoneta_create_crc32c_buffer_software(void* buffer, size_t size, uint32_t* crc)
+{
+   if (buffer == NULL)
    {
-      crc_long = (uint64_t)_mm_crc32_u8((uint32_t)crc_long, *((unsigned char*)buffer));
-      buffer++;
+      return 1;
    }
 
-   crc_long = ~crc_long;
+   pthread_once(&crc32c_once, &crc32c_init);
+
+   *crc = ~crc32c_slicing_by_8(~(*crc), buffer, size);
 
-   *crc = (uint32_t)crc_long;
    return 0;
+}
+
+int
+pgmoneta_create_crc32c_string(uint32_t crc, char** crc_string)
+{
+   char* s = NULL;
+   unsigned char* b = (unsigned char*)&crc;
 
-   #else
-   uint32_t crc_int = ~(*crc);
-
-   static const uint32_t crc32_tab[256] = {
-      0x00000000L, 0xF26B8303L, 0xE13B70F7L, 0x1350F3F4L,
-      0xC79A971FL, 0x35F1141CL, 0x26A1E7E8L, 0xD4CA64EBL,
-      0x8AD958CFL, 0x78B2DBCCL, 0x6BE22838L, 0x9989AB3BL,
-      0x4D43CFD0L, 0xBF284CD3L, 0xAC78BF27L, 0x5E133C24L,
-      0x105EC76FL, 0xE235446CL, 0xF165B798L, 0x030E349BL,
-      0xD7C45070L, 0x25AFD373L, 0x36FF2087L, 0xC494A384L,
-      0x9A879FA0L, 0x68EC1CA3L, 0x7BBCEF57L, 0x89D76C54L,
-      0x5D1D08BFL, 0xAF768BBCL, 0xBC267848L, 0x4E4DFB4BL,
-      0x20BD8EDEL, 0xD2D60DDDL, 0xC186FE29L, 0x33ED7D2AL,
-      0xE72719C1L, 0x154C9AC2L, 0x061C6936L, 0xF477EA35L,
-      0xAA64D611L, 0x580F5512L, 0x4B5FA6E6L, 0xB93425E5L,
-      0x6DFE410EL, 0x9F95C20DL, 0x8CC531F9L, 0x7EAEB2FAL,
-      0x30E349B1L, 0xC288CAB2L, 0xD1D83946L, 0x23B3BA45L,
-      0xF779DEAEL, 0x05125DADL, 0x1642AE59L, 0xE4292D5AL,
-      0xBA3A117EL, 0x4851927DL, 0x5B016189L, 0xA96AE28AL,
-      0x7DA08661L, 0x8FCB0562L, 0x9C9BF696L, 0x6EF07595L,
-      0x417B1DBCL, 0xB3109EBFL, 0xA0406D4BL, 0x522BEE48L,
-      0x86E18AA3L, 0x748A09A0L, 0x67DAFA54L, 0x95B17957L,
-      0xCBA24573L, 0x39C9C670L, 0x2A993584L, 0xD8F2B687L,
-      0x0C38D26CL, 0xFE53516FL, 0xED03A29BL, 0x1F682198L,
-      0x5125DAD3L, 0xA34E59D0L, 0xB01EAA24L, 0x42752927L,
-      0x96BF4DCCL, 0x64D4CECFL, 0x77843D3BL, 0x85EFBE38L,
-      0xDBFC821CL, 0x2997011FL, 0x3AC7F2EBL, 0xC8AC71E8L,
-      0x1C661503L, 0xEE0D9600L, 0xFD5D65F4L, 0x0F36E6F7L,
-      0x61C69362L, 0x93AD1061L, 0x80FDE395L, 0x72966096L,
-      0xA65C047DL, 0x5437877EL, 0x4767748AL, 0xB50CF789L,
-      0xEB1FCBADL, 0x197448AEL, 0x0A24BB5AL, 0xF84F3859L,
-      0x2C855CB2L, 0xDEEEDFB1L, 0xCDBE2C45L, 0x3FD5AF46L,
-      0x7198540DL, 0x83F3D70EL, 0x90A324FAL, 0x62C8A7F9L,
-      0xB602C312L, 0x44694011L, 0x5739B3E5L, 0xA55230E6L,
-      0xFB410CC2L, 0x092A8FC1L, 0x1A7A7C35L, 0xE811FF36L,
-      0x3CDB9BDDL, 0xCEB018DEL, 0xDDE0EB2AL, 0x2F8B6829L,
-      0x82F63B78L, 0x709DB87BL, 0x63CD4B8FL, 0x91A6C88CL,
-      0x456CAC67L, 0xB7072F64L, 0xA457DC90L, 0x563C5F93L,
-      0x082F63B7L, 0xFA44E0B4L, 0xE9141340L, 0x1B7F9043L,
-      0xCFB5F4A8L, 0x3DDE77ABL, 0x2E8E845FL, 0xDCE5075CL,
-      0x92A8FC17L, 0x60C37F14L, 0x73938CE0L, 0x81F80FE3L,
-      0x55326B08L, 0xA759E80BL, 0xB4091BFFL, 0x466298FCL,
-      0x1871A4D8L, 0xEA1A27DBL, 0xF94AD42FL, 0x0B21572CL,
-      0xDFEB33C7L, 0x2D80B0C4L, 0x3ED04330L, 0xCCBBC033L,
-      0xA24BB5A6L, 0x502036A5L, 0x4370C551L, 0xB11B4652L,
-      0x65D122B9L, 0x97BAA1BAL, 0x84EA524EL, 0x7681D14DL,
-      0x2892ED69L, 0xDAF96E6AL, 0xC9A99D9EL, 0x3BC21E9DL,
-      0xEF087A76L, 0x1D63F975L, 0x0E330A81L, 0xFC588982L,
-      0xB21572C9L, 0x407EF1CAL, 0x532E023EL, 0xA145813DL,
-      0x758FE5D6L, 0x87E466D5L, 0x94B49521L, 0x66DF1622L,
-      0x38CC2A06L, 0xCAA7A905L, 0xD9F75AF1L, 0x2B9CD9F2L,
-      0xFF56BD19L, 0x0D3D3E1AL, 0x1E6DCDEEL, 0xEC064EEDL,
-      0xC38D26C4L, 0x31E6A5C7L, 0x22B65633L, 0xD0DDD530L,
-      0x0417B1DBL, 0xF67C32D8L, 0xE52CC12CL, 0x1747422FL,
-      0x49547E0BL, 0xBB3FFD08L, 0xA86F0EFCL, 0x5A048DFFL,
-      0x8ECEE914L, 0x7CA56A17L, 0x6FF599E3L, 0x9D9E1AE0L,
-      0xD3D3E1ABL, 0x21B862A8L, 0x32E8915CL, 0xC083125FL,
-      0x144976B4L, 0xE622F5B7L, 0xF5720643L, 0x07198540L,
-      0x590AB964L, 0xAB613A67L, 0xB831C993L, 0x4A5A4A90L,
-      0x9E902E7BL, 0x6CFBAD78L, 0x7FAB5E8CL, 0x8DC0DD8FL,
-      0xE330A81AL, 0x115B2B19L, 0x020BD8EDL, 0xF0605BEEL,
-      0x24AA3F05L, 0xD6C1BC06L, 0xC5914FF2L, 0x37FACCF1L,
-      0x69E9F0D5L, 0x9B8273D6L, 0x88D28022L, 0x7AB90321L,
-      0xAE7367CAL, 0x5C18E4C9L, 0x4F48173DL, 0xBD23943EL,
-      0xF36E6F75L, 0x0105EC76L, 0x12551F82L, 0xE03E9C81L,
-      0x34F4F86AL, 0xC69F7B69L, 0xD5CF889DL, 0x27A40B9EL,
-      0x79B737BAL, 0x8BDCB4B9L, 0x988C474DL, 0x6AE7C44EL,
-      0xBE2DA0A5L, 0x4C4623A6L, 0x5F16D052L, 0xAD7D5351L
-   };
+   *crc_string = NULL;
 
-   for (size_t i = 0; i < size; i++)
+   s = malloc(9);
+
+   if (s == NULL)
    {
-      crc_int = crc32_tab[(((unsigned char)crc_int) ^ ((unsigned char*)buffer)[i])] ^ (crc_int >> 8);
+      return 1;
    }
-   crc_int = ~crc_int;
 
-   *crc = crc_int;
+   /* Same as PostgreSQL: the bytes of the value in memory order */
+   snprintf(s, 9, "%02x%02x%02x%02x", b[0], b[1], b[2], b[3]);
+
+   *crc_string = s;
 
    return 0;
-   #endif
 }
 
 int
 pgmoneta_create_crc32c_file(char* path, char** crc)
 {
-   FILE* file = NULL;
-   char read_buf[16384];
-   unsigned long read_bytes = 0;
-   char* crc_string;
+   int fd = -1;
+   char* read_buf = NULL;
+   ssize_t read_bytes = 0;
    uint32_t crc_buf = 0;
 
-   file = fopen(path, "rb");
+   *crc = NULL;
 
-   if (file == NULL)
+   fd = open(path, O_RDONLY);
+
+   if (fd == -1)
    {
       goto error;
    }
 
-   memset(read_buf, 0, sizeof(read_buf));
-
-   while ((read_bytes = fread(read_buf, 1, sizeof(read_buf), file)) > 0)
-   {
-      pgmoneta_create_crc32c_buffer(read_buf, read_bytes, &crc_buf);
-   }
+#ifdef HAVE_LINUX
+   posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
-   crc_string = malloc(9);
+   read_buf = malloc(HASH_BUFFER_SIZE);
 
-   if (crc_string == NULL)
+   if (read_buf == NULL)
    {
       goto error;
    }
 
-   memset(crc_string, 0, 9);
-
-   for (int i = 0; i < 8; i++)
+   while ((read_bytes = read(fd, read_buf, HASH_BUFFER_SIZE)) != 0)
    {
-      sprintf(crc_string, "%08x", crc_buf);
+      if (read_bytes < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+
+         pgmoneta_log_error("Unable to read %s: %s", path, strerror(errno));
+         goto error;
+      }
+
+      pgmoneta_create_crc32c_buffer(read_buf, read_bytes, &crc_buf);
    }
 
-   *crc = crc_string;
+   if (pgmoneta_create_crc32c_string(crc_buf, crc))
+   {
+      goto error;
+   }
 
-   fclose(file);
+   free(read_buf);
+   close(fd);
 
    return 0;
 
 error:
 
-   if (file != NULL)
+   free(read_buf);
+
+   if (fd != -1)
    {
-      fclose(file);
+      close(fd);
    }
 
    return 1;
@@ -3107,7 +3154,7 @@ pgmoneta_create_file_hash(int algorithm, char* file_path, char** hash)
    switch (algorithm)
    {
       case HASH_ALGORITHM_CRC32C:
-         pgmoneta_create_crc32c_file(file_path, hash);
+         stat = pgmoneta_create_crc32c_file(file_path, hash);
          break;
       case HASH_ALGORITHM_SHA224:
          stat = pgmoneta_create_sha224_file(file_path, hash);
@@ -3175,3 +3222,88 @@ pgmoneta_get_hash_algorithm(char* algorithm)
 
    return HASH_ALGORITHM_SHA256;
 }
+
+static void
+crc32c_init(void)
+{
+   uint32_t crc;
+
+   for (int i = 0; i < 256; i++)
+   {
+      crc = (uint32_t)i;
+
+      for (int j = 0; j < 8; j++)
+      {
+         crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+      }
+
+      crc32c_table[0][i] = crc;
+   }
+
+   for (int i = 0; i < 256; i++)
+   {
+      crc = crc32c_table[0][i];
+
+      for (int j = 1; j < 8; j++)
+      {
+         crc = crc32c_table[0][crc & 0xFF] ^ (crc >> 8);
+         crc32c_table[j][i] = crc;
+      }
+   }
+
+   if (pgmoneta_crc32c_hardware_available())
+   {
+      crc32c_function = &pgmoneta_crc32c_hardware;
+   }
+   else
+   {
+      crc32c_function = &crc32c_slicing_by_8;
+   }
+}
+
+static uint32_t
+crc32c_slicing_by_8(uint32_t crc, const void* buffer, size_t size)
+{
+   const unsigned char* p = (const unsigned char*)buffer;
+   uint32_t word1;
+   uint32_t word2;
+
+   while (size > 0 && ((uintptr_t)p & 3) != 0)
+   {
+      crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+      size--;
+   }
+
+   while (size >= 8)
+   {
+      memcpy(&word1, p, 4);
+      memcpy(&word2, p + 4, 4);
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      word1 = __builtin_bswap32(word1);
+      word2 = __builtin_bswap32(word2);
+#endif
+
+      word1 ^= crc;
+
+      crc = crc32c_table[7][word1 & 0xFF] ^
+            crc32c_table[6][(word1 >> 8) & 0xFF] ^
+            crc32c_table[5][(word1 >> 16) & 0xFF] ^
+            crc32c_table[4][word1 >> 24] ^
+            crc32c_table[3][word2 & 0xFF] ^
+            crc32c_table[2][(word2 >> 8) & 0xFF] ^
+            crc32c_table[1][(word2 >> 16) & 0xFF] ^
+            crc32c_table[0][word2 >> 24];
+
+      p += 8;
+      size -= 8;
+   }
+
+   while (size > 0)
+   {
+      crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+      size--;
+   }
+
+   return crc;
+}
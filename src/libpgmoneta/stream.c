@@ -0,0 +1,2002 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <aes.h>
+#include <dedup.h>
+#include <logging.h>
+#include <lz4_compression.h>
+#include <security.h>
+#include <stream.h>
+#include <utils.h>
+
+/* system */
+#include <bzlib.h>
+#include <errno.h>
+#include <lz4.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#include <openssl/evp.h>
+
+static int fill_input(struct stream_reader* reader);
+static int take_input(struct stream_reader* reader, void* buffer, size_t size, size_t* length);
+
+static int read_none(struct stream_reader* reader, char* buffer, size_t size, size_t* length);
+static int read_gzip(struct stream_reader* reader, char* buffer, size_t size, size_t* length);
+static int read_zstd(struct stream_reader* reader, char* buffer, size_t size, size_t* length);
+static int read_lz4(struct stream_reader* reader, char* buffer, size_t size, size_t* length);
+static int read_bzip2(struct stream_reader* reader, char* buffer, size_t size, size_t* length);
+static int read_map(struct stream_reader* reader, char* buffer, size_t size, size_t* length);
+static int seek_map(struct stream_reader* reader, uint64_t offset);
+static int open_chunk(struct stream_reader* reader);
+static int close_chunk(struct stream_reader* reader, bool verify);
+
+static int writer_create(FILE* file, int compression, int level, int encryption, struct stream_writer** writer);
+static int write_output(struct stream_writer* writer, void* buffer, size_t size);
+static int write_file(struct stream_writer* writer, void* buffer, size_t size);
+static int write_lz4_block(struct stream_writer* writer);
+
+static char* compression_suffixes[] = {".zstd", ".gz", ".lz4", ".bz2", ""};
+
+int
+pgmoneta_stream_reader_init(char* path, struct stream_reader** reader)
+{
+   struct stream_reader* r = NULL;
+
+   if (!pgmoneta_dedup_is_map(path))
+   {
+      return pgmoneta_stream_reader_init_raw(path, reader);
+   }
+
+   *reader = NULL;
+
+   r = (struct stream_reader*)malloc(sizeof(struct stream_reader));
+
+   if (r == NULL)
+   {
+      goto error;
+   }
+
+   memset(r, 0, sizeof(struct stream_reader));
+
+   if (pgmoneta_dedup_read_map(path, &r->map))
+   {
+      goto error;
+   }
+
+   r->chunk_md = EVP_MD_CTX_new();
+
+   if (r->chunk_md == NULL)
+   {
+      goto error;
+   }
+
+   *reader = r;
+
+   return 0;
+
+error:
+
+   pgmoneta_stream_reader_destroy(r);
+
+   return 1;
+}
+
+int
+pgmoneta_stream_reader_init_raw(char* path, struct stream_reader** reader)
+{
+   char* name = NULL;
+   struct stream_reader* r = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *reader = NULL;
+
+   r = (struct stream_reader*)malloc(sizeof(struct stream_reader));
+
+   if (r == NULL)
+   {
+      goto error;
+   }
+
+   memset(r, 0, sizeof(struct stream_reader));
+
+   name = pgmoneta_append(name, path);
+
+   if (pgmoneta_ends_with(name, ".aes"))
+   {
+      r->encrypted = true;
+      name[strlen(name) - 4] = '\0';
+   }
+
+   if (pgmoneta_ends_with(name, ".zstd"))
+   {
+      r->compression = STREAM_COMPRESSION_ZSTD;
+   }
+   else if (pgmoneta_ends_with(name, ".gz"))
+   {
+      r->compression = STREAM_COMPRESSION_GZIP;
+   }
+   else if (pgmoneta_ends_with(name, ".lz4"))
+   {
+      r->compression = STREAM_COMPRESSION_LZ4;
+   }
+   else if (pgmoneta_ends_with(name, ".bz2"))
+   {
+      r->compression = STREAM_COMPRESSION_BZIP2;
+   }
+   else
+   {
+      r->compression = STREAM_COMPRESSION_NONE;
+   }
+
+   r->file = fopen(path, "rb");
+
+   if (r->file == NULL)
+   {
+      pgmoneta_log_error("Stream: Could not open %s", path);
+      goto error;
+   }
+
+   r->input = (unsigned char*)malloc(STREAM_BUFFER_SIZE + EVP_MAX_BLOCK_LENGTH);
+
+   if (r->input == NULL)
+   {
+      goto error;
+   }
+
+   if (r->encrypted)
+   {
+      r->raw = (unsigned char*)malloc(STREAM_BUFFER_SIZE);
+
+      if (r->raw == NULL)
+      {
+         goto error;
+      }
+
+      if (pgmoneta_aes_is_chunked(r->file))
+      {
+         if (pgmoneta_aes_reader_create(r->file, NULL, &r->aes))
+         {
+            pgmoneta_log_error("Stream: Could not read the encryption of %s", path);
+            goto error;
+         }
+      }
+      else if (pgmoneta_create_cipher_context(config->encryption, 0, &r->cipher))
+      {
+         pgmoneta_log_error("Stream: Could not create cipher context for %s", path);
+         goto error;
+      }
+   }
+
+   if (r->compression == STREAM_COMPRESSION_ZSTD)
+   {
+      r->decompressor = ZSTD_createDCtx();
+
+      if (r->decompressor == NULL)
+      {
+         goto error;
+      }
+   }
+   else if (r->compression == STREAM_COMPRESSION_GZIP)
+   {
+      z_stream* zs = NULL;
+
+      zs = (z_stream*)malloc(sizeof(z_stream));
+
+      if (zs == NULL)
+      {
+         goto error;
+      }
+
+      memset(zs, 0, sizeof(z_stream));
+
+      /* 15 + 32 detects the gzip header */
+      if (inflateInit2(zs, 15 + 32) != Z_OK)
+      {
+         free(zs);
+         goto error;
+      }
+
+      r->decompressor = zs;
+   }
+   else if (r->compression == STREAM_COMPRESSION_LZ4)
+   {
+      LZ4_streamDecode_t* lz4 = NULL;
+
+      lz4 = (LZ4_streamDecode_t*)malloc(sizeof(LZ4_streamDecode_t));
+      r->block = (char*)malloc(LZ4_COMPRESSBOUND(BLOCK_BYTES));
+      r->output = (char*)malloc(2 * BLOCK_BYTES);
+
+      if (lz4 == NULL || r->block == NULL || r->output == NULL)
+      {
+         free(lz4);
+         goto error;
+      }
+
+      LZ4_setStreamDecode(lz4, NULL, 0);
+
+      r->decompressor = lz4;
+   }
+   else if (r->compression == STREAM_COMPRESSION_BZIP2)
+   {
+      bz_stream* bz = NULL;
+
+      bz = (bz_stream*)malloc(sizeof(bz_stream));
+
+      if (bz == NULL)
+      {
+         goto error;
+      }
+
+      memset(bz, 0, sizeof(bz_stream));
+
+      if (BZ2_bzDecompressInit(bz, 0, 0) != BZ_OK)
+      {
+         free(bz);
+         goto error;
+      }
+
+      r->decompressor = bz;
+   }
+
+   free(name);
+
+   *reader = r;
+
+   return 0;
+
+error:
+
+   pgmoneta_stream_reader_destroy(r);
+
+   free(name);
+
+   return 1;
+}
+
+int
+pgmoneta_stream_reader_read(struct stream_reader* reader, void* buffer, size_t size, size_t* length)
+{
+   *length = 0;
+
+   if (reader == NULL || buffer == NULL)
+   {
+      return 1;
+   }
+
+   if (reader->finished || size == 0)
+   {
+      return 0;
+   }
+
+   if (reader->map != NULL)
+   {
+      return read_map(reader, (char*)buffer, size, length);
+   }
+
+   switch (reader->compression)
+   {
+      case STREAM_COMPRESSION_GZIP:
+         return read_gzip(reader, (char*)buffer, size, length);
+      case STREAM_COMPRESSION_ZSTD:
+         return read_zstd(reader, (char*)buffer, size, length);
+      case STREAM_COMPRESSION_LZ4:
+         return read_lz4(reader, (char*)buffer, size, length);
+      case STREAM_COMPRESSION_BZIP2:
+         return read_bzip2(reader, (char*)buffer, size, length);
+      default:
+         break;
+   }
+
+   return read_none(reader, (char*)buffer, size, length);
+}
+
+int
+pgmoneta_stream_reader_seek(struct stream_reader* reader, uint64_t offset)
+{
+   uint64_t position = 0;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (reader == NULL)
+   {
+      goto error;
+   }
+
+   if (reader->map != NULL)
+   {
+      return seek_map(reader, offset);
+   }
+
+   reader->input_position = 0;
+   reader->input_length = 0;
+   reader->eof = false;
+   reader->finished = false;
+   reader->end_of_frame = false;
+
+   if (!reader->encrypted)
+   {
+      if (fseeko(reader->file, (off_t)offset, SEEK_SET))
+      {
+         pgmoneta_log_error("Stream: Seek error: %s", strerror(errno));
+         goto error;
+      }
+   }
+   else if (reader->aes != NULL)
+   {
+      /* The chunks are encrypted on their own, so start at the chunk of the offset */
+      if (pgmoneta_aes_seek(reader->aes, offset))
+      {
+         goto error;
+      }
+   }
+   else
+   {
+      /* The cipher can't start in the middle of the file, so decrypt up to the offset */
+      rewind(reader->file);
+
+      EVP_CIPHER_CTX_free(reader->cipher);
+      reader->cipher = NULL;
+
+      if (pgmoneta_create_cipher_context(config->encryption, 0, &reader->cipher))
+      {
+         goto error;
+      }
+
+      while (position < offset)
+      {
+         if (fill_input(reader))
+         {
+            goto error;
+         }
+
+         if (reader->input_length == 0)
+         {
+            pgmoneta_log_error("Stream: Seek beyond the end of the file");
+            goto error;
+         }
+
+         if (position + reader->input_length > offset)
+         {
+            reader->input_position = (size_t)(offset - position);
+            position = offset;
+         }
+         else
+         {
+            reader->input_position = reader->input_length;
+            position += reader->input_length;
+         }
+      }
+   }
+
+   if (reader->compression == STREAM_COMPRESSION_ZSTD)
+   {
+      ZSTD_DCtx_reset((ZSTD_DCtx*)reader->decompressor, ZSTD_reset_session_only);
+   }
+   else if (reader->compression == STREAM_COMPRESSION_GZIP)
+   {
+      if (inflateReset((z_stream*)reader->decompressor) != Z_OK)
+      {
+         goto error;
+      }
+   }
+   else if (reader->compression == STREAM_COMPRESSION_LZ4)
+   {
+      LZ4_setStreamDecode((LZ4_streamDecode_t*)reader->decompressor, NULL, 0);
+      reader->output_length = 0;
+      reader->output_position = 0;
+   }
+   else if (reader->compression == STREAM_COMPRESSION_BZIP2)
+   {
+      BZ2_bzDecompressEnd((bz_stream*)reader->decompressor);
+      memset(reader->decompressor, 0, sizeof(bz_stream));
+
+      if (BZ2_bzDecompressInit((bz_stream*)reader->decompressor, 0, 0) != BZ_OK)
+      {
+         goto error;
+      }
+   }
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+int
+pgmoneta_stream_reader_skip(struct stream_reader* reader, uint64_t size)
+{
+   char buffer[8192];
+   size_t length = 0;
+
+   if (reader != NULL && reader->map != NULL)
+   {
+      if (reader->map_position + size > reader->map->size)
+      {
+         pgmoneta_log_error("Stream: Unexpected end of data");
+         return 1;
+      }
+
+      return seek_map(reader, reader->map_position + size);
+   }
+
+   while (size > 0)
+   {
+      if (pgmoneta_stream_reader_read(reader, buffer, (size_t)MIN(size, sizeof(buffer)), &length))
+      {
+         return 1;
+      }
+
+      if (length == 0)
+      {
+         pgmoneta_log_error("Stream: Unexpected end of data");
+         return 1;
+      }
+
+      size -= length;
+   }
+
+   return 0;
+}
+
+int
+pgmoneta_stream_reader_destroy(struct stream_reader* reader)
+{
+   if (reader == NULL)
+   {
+      return 0;
+   }
+
+   pgmoneta_stream_reader_destroy(reader->chunk);
+   pgmoneta_dedup_map_destroy(reader->map);
+
+   if (reader->chunk_md != NULL)
+   {
+      EVP_MD_CTX_free(reader->chunk_md);
+   }
+
+   if (reader->decompressor != NULL)
+   {
+      if (reader->compression == STREAM_COMPRESSION_ZSTD)
+      {
+         ZSTD_freeDCtx((ZSTD_DCtx*)reader->decompressor);
+      }
+      else if (reader->compression == STREAM_COMPRESSION_GZIP)
+      {
+         inflateEnd((z_stream*)reader->decompressor);
+         free(reader->decompressor);
+      }
+      else if (reader->compression == STREAM_COMPRESSION_BZIP2)
+      {
+         BZ2_bzDecompressEnd((bz_stream*)reader->decompressor);
+         free(reader->decompressor);
+      }
+      else
+      {
+         free(reader->decompressor);
+      }
+   }
+
+   if (reader->cipher != NULL)
+   {
+      EVP_CIPHER_CTX_free(reader->cipher);
+   }
+
+   pgmoneta_aes_destroy(reader->aes);
+
+   if (reader->file != NULL)
+   {
+      fclose(reader->file);
+   }
+
+   free(reader->raw);
+   free(reader->input);
+   free(reader->block);
+   free(reader->output);
+   free(reader);
+
+   return 0;
+}
+
+int
+pgmoneta_stream_get_stored_file(char* path, char** stored)
+{
+   char* f = NULL;
+
+   *stored = NULL;
+
+   /* The file itself, or its chunk map */
+   for (int m = 0; m < 2; m++)
+   {
+      for (int i = 0; i < (int)(sizeof(compression_suffixes) / sizeof(compression_suffixes[0])); i++)
+      {
+         f = pgmoneta_append(f, path);
+         if (m == 1)
+         {
+            f = pgmoneta_append(f, DEDUP_SUFFIX);
+         }
+         f = pgmoneta_append(f, compression_suffixes[i]);
+         f = pgmoneta_append(f, ".aes");
+
+         if (pgmoneta_exists(f))
+         {
+            *stored = f;
+            return 0;
+         }
+
+         f[strlen(f) - 4] = '\0';
+
+         if (pgmoneta_exists(f))
+         {
+            *stored = f;
+            return 0;
+         }
+
+         free(f);
+         f = NULL;
+      }
+   }
+
+   return 1;
+}
+
+char*
+pgmoneta_stream_plain_name(char* name)
+{
+   char* n = NULL;
+
+   n = pgmoneta_append(n, name);
+
+   if (pgmoneta_ends_with(n, ".aes"))
+   {
+      n[strlen(n) - strlen(".aes")] = '\0';
+   }
+
+   for (int i = 0; i < (int)(sizeof(compression_suffixes) / sizeof(compression_suffixes[0])); i++)
+   {
+      if (strlen(compression_suffixes[i]) > 0 && pgmoneta_ends_with(n, compression_suffixes[i]))
+      {
+         n[strlen(n) - strlen(compression_suffixes[i])] = '\0';
+         break;
+      }
+   }
+
+   if (pgmoneta_ends_with(n, DEDUP_SUFFIX))
+   {
+      n[strlen(n) - strlen(DEDUP_SUFFIX)] = '\0';
+   }
+
+   return n;
+}
+
+int
+pgmoneta_stream_writer_init(char* path, int compression, int level, struct stream_writer** writer)
+{
+   FILE* file = NULL;
+
+   *writer = NULL;
+
+   file = fopen(path, "wb");
+
+   if (file == NULL)
+   {
+      pgmoneta_log_error("Stream: Could not create %s", path);
+      return 1;
+   }
+
+   return writer_create(file, compression, level, ENCRYPTION_NONE, writer);
+}
+
+int
+pgmoneta_stream_writer_init_fd(int fd, int compression, int level, int encryption, struct stream_writer** writer)
+{
+   FILE* file = NULL;
+
+   *writer = NULL;
+
+   file = fdopen(fd, "wb");
+
+   if (file == NULL)
+   {
+      pgmoneta_log_error("Stream: Could not open descriptor %d: %s", fd, strerror(errno));
+      close(fd);
+      return 1;
+   }
+
+   return writer_create(file, compression, level, encryption, writer);
+}
+
+int
+pgmoneta_stream_writer_write(struct stream_writer* writer, void* buffer, size_t size)
+{
+   size_t s = 0;
+
+   if (writer == NULL)
+   {
+      goto error;
+   }
+
+   if (size == 0)
+   {
+      return 0;
+   }
+
+   if (!writer->in_frame)
+   {
+      writer->in_frame = true;
+      writer->frame_offset = writer->offset;
+      writer->frame_length = 0;
+   }
+
+   writer->frame_length += size;
+
+   if (writer->compression == STREAM_COMPRESSION_ZSTD)
+   {
+      size_t ret = 0;
+      ZSTD_inBuffer in = {buffer, size, 0};
+
+      while (in.pos < in.size)
+      {
+         ZSTD_outBuffer out = {writer->output, STREAM_BUFFER_SIZE, 0};
+
+         ret = ZSTD_compressStream2((ZSTD_CCtx*)writer->compressor, &out, &in, ZSTD_e_continue);
+
+         if (ZSTD_isError(ret))
+         {
+            pgmoneta_log_error("Stream: ZSTD_compressStream2 error: %s", ZSTD_getErrorName(ret));
+            goto error;
+         }
+
+         if (write_output(writer, writer->output, out.pos))
+         {
+            goto error;
+         }
+      }
+   }
+   else if (writer->compression == STREAM_COMPRESSION_GZIP)
+   {
+      z_stream* zs = (z_stream*)writer->compressor;
+
+      zs->next_in = (Bytef*)buffer;
+      zs->avail_in = (uInt)size;
+
+      do
+      {
+         zs->next_out = (Bytef*)writer->output;
+         zs->avail_out = STREAM_BUFFER_SIZE;
+
+         if (deflate(zs, Z_NO_FLUSH) == Z_STREAM_ERROR)
+         {
+            pgmoneta_log_error("Stream: deflate error");
+            goto error;
+         }
+
+         if (write_output(writer, writer->output, STREAM_BUFFER_SIZE - zs->avail_out))
+         {
+            goto error;
+         }
+      }
+      while (zs->avail_in > 0 || zs->avail_out == 0);
+   }
+   else if (writer->compression == STREAM_COMPRESSION_LZ4)
+   {
+      while (size > 0)
+      {
+         s = MIN(size, BLOCK_BYTES - writer->block_length);
+
+         memcpy(writer->block + (writer->block_index * BLOCK_BYTES) + writer->block_length, buffer, s);
+
+         writer->block_length += s;
+         buffer = (char*)buffer + s;
+         size -= s;
+
+         if (writer->block_length == BLOCK_BYTES)
+         {
+            if (write_lz4_block(writer))
+            {
+               goto error;
+            }
+         }
+      }
+   }
+   else if (writer->compression == STREAM_COMPRESSION_BZIP2)
+   {
+      bz_stream* bz = (bz_stream*)writer->compressor;
+
+      bz->next_in = (char*)buffer;
+      bz->avail_in = (unsigned int)size;
+
+      do
+      {
+         bz->next_out = writer->output;
+         bz->avail_out = STREAM_BUFFER_SIZE;
+
+         if (BZ2_bzCompress(bz, BZ_RUN) != BZ_RUN_OK)
+         {
+            pgmoneta_log_error("Stream: BZ2_bzCompress error");
+            goto error;
+         }
+
+         if (write_output(writer, writer->output, STREAM_BUFFER_SIZE - bz->avail_out))
+         {
+            goto error;
+         }
+      }
+      while (bz->avail_in > 0 || bz->avail_out == 0);
+   }
+   else
+   {
+      if (write_output(writer, buffer, size))
+      {
+         goto error;
+      }
+   }
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+int
+pgmoneta_stream_writer_end_frame(struct stream_writer* writer)
+{
+   int ret = 0;
+
+   if (writer == NULL)
+   {
+      goto error;
+   }
+
+   if (!writer->in_frame)
+   {
+      return 0;
+   }
+
+   if (writer->compression == STREAM_COMPRESSION_ZSTD)
+   {
+      size_t remaining = 0;
+      ZSTD_inBuffer in = {NULL, 0, 0};
+
+      do
+      {
+         ZSTD_outBuffer out = {writer->output, STREAM_BUFFER_SIZE, 0};
+
+         remaining = ZSTD_compressStream2((ZSTD_CCtx*)writer->compressor, &out, &in, ZSTD_e_end);
+
+         if (ZSTD_isError(remaining))
+         {
+            pgmoneta_log_error("Stream: ZSTD_compressStream2 error: %s", ZSTD_getErrorName(remaining));
+            goto error;
+         }
+
+         if (write_output(writer, writer->output, out.pos))
+         {
+            goto error;
+         }
+      }
+      while (remaining != 0);
+   }
+   else if (writer->compression == STREAM_COMPRESSION_GZIP)
+   {
+      z_stream* zs = (z_stream*)writer->compressor;
+
+      zs->next_in = NULL;
+      zs->avail_in = 0;
+
+      do
+      {
+         zs->next_out = (Bytef*)writer->output;
+         zs->avail_out = STREAM_BUFFER_SIZE;
+
+         ret = deflate(zs, Z_FINISH);
+
+         if (ret == Z_STREAM_ERROR)
+         {
+            pgmoneta_log_error("Stream: deflate error");
+            goto error;
+         }
+
+         if (write_output(writer, writer->output, STREAM_BUFFER_SIZE - zs->avail_out))
+         {
+            goto error;
+         }
+      }
+      while (ret != Z_STREAM_END);
+
+      /* The next frame is a new gzip member */
+      if (deflateReset(zs) != Z_OK)
+      {
+         goto error;
+      }
+   }
+   else if (writer->compression == STREAM_COMPRESSION_LZ4)
+   {
+      if (writer->block_length > 0 && write_lz4_block(writer))
+      {
+         goto error;
+      }
+
+      /* Forget the dictionary, so the next block doesn't refer to this frame */
+      LZ4_freeStream((LZ4_stream_t*)writer->compressor);
+      writer->compressor = LZ4_createStream();
+
+      if (writer->compressor == NULL)
+      {
+         goto error;
+      }
+   }
+   else if (writer->compression == STREAM_COMPRESSION_BZIP2)
+   {
+      bz_stream* bz = (bz_stream*)writer->compressor;
+
+      bz->next_in = NULL;
+      bz->avail_in = 0;
+
+      do
+      {
+         bz->next_out = writer->output;
+         bz->avail_out = STREAM_BUFFER_SIZE;
+
+         ret = BZ2_bzCompress(bz, BZ_FINISH);
+
+         if (ret != BZ_FINISH_OK && ret != BZ_STREAM_END)
+         {
+            pgmoneta_log_error("Stream: BZ2_bzCompress error %d", ret);
+            goto error;
+         }
+
+         if (write_output(writer, writer->output, STREAM_BUFFER_SIZE - bz->avail_out))
+         {
+            goto error;
+         }
+      }
+      while (ret != BZ_STREAM_END);
+
+      /* The next frame is a new bzip2 stream */
+      BZ2_bzCompressEnd(bz);
+      memset(bz, 0, sizeof(bz_stream));
+
+      if (BZ2_bzCompressInit(bz, writer->level, 0, 0) != BZ_OK)
+      {
+         goto error;
+      }
+   }
+
+   writer->in_frame = false;
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+int
+pgmoneta_stream_writer_destroy(struct stream_writer* writer)
+{
+   int ret = 0;
+
+   if (writer == NULL)
+   {
+      return 0;
+   }
+
+   if (writer->file != NULL && (writer->compressor != NULL || writer->compression == STREAM_COMPRESSION_NONE))
+   {
+      if (pgmoneta_stream_writer_end_frame(writer))
+      {
+         ret = 1;
+      }
+   }
+
+   if (writer->compressor != NULL)
+   {
+      if (writer->compression == STREAM_COMPRESSION_ZSTD)
+      {
+         ZSTD_freeCCtx((ZSTD_CCtx*)writer->compressor);
+      }
+      else if (writer->compression == STREAM_COMPRESSION_GZIP)
+      {
+         deflateEnd((z_stream*)writer->compressor);
+         free(writer->compressor);
+      }
+      else if (writer->compression == STREAM_COMPRESSION_LZ4)
+      {
+         LZ4_freeStream((LZ4_stream_t*)writer->compressor);
+      }
+      else if (writer->compression == STREAM_COMPRESSION_BZIP2)
+      {
+         BZ2_bzCompressEnd((bz_stream*)writer->compressor);
+         free(writer->compressor);
+      }
+   }
+
+   if (writer->file != NULL && writer->aes != NULL)
+   {
+      if (pgmoneta_aes_finish(writer->aes))
+      {
+         pgmoneta_log_error("Stream: Could not finish the encryption");
+         ret = 1;
+      }
+   }
+
+   if (writer->file != NULL)
+   {
+      /* Sockets and pipes can't be synchronized */
+      if (fflush(writer->file) || (fsync(fileno(writer->file)) && errno != EINVAL))
+      {
+         pgmoneta_log_error("Stream: Could not synchronize file: %s", strerror(errno));
+         ret = 1;
+      }
+
+      if (fclose(writer->file))
+      {
+         ret = 1;
+      }
+   }
+
+   pgmoneta_aes_destroy(writer->aes);
+
+   free(writer->output);
+   free(writer->block);
+   free(writer);
+
+   return ret;
+}
+
+int
+pgmoneta_stream_compression(int compression_type)
+{
+   switch (compression_type)
+   {
+      case COMPRESSION_CLIENT_GZIP:
+      case COMPRESSION_SERVER_GZIP:
+         return STREAM_COMPRESSION_GZIP;
+      case COMPRESSION_CLIENT_ZSTD:
+      case COMPRESSION_SERVER_ZSTD:
+         return STREAM_COMPRESSION_ZSTD;
+      case COMPRESSION_CLIENT_LZ4:
+      case COMPRESSION_SERVER_LZ4:
+         return STREAM_COMPRESSION_LZ4;
+      case COMPRESSION_CLIENT_BZIP2:
+         return STREAM_COMPRESSION_BZIP2;
+      default:
+         break;
+   }
+
+   return STREAM_COMPRESSION_NONE;
+}
+
+char*
+pgmoneta_stream_compression_suffix(int compression)
+{
+   switch (compression)
+   {
+      case STREAM_COMPRESSION_GZIP:
+         return ".gz";
+      case STREAM_COMPRESSION_ZSTD:
+         return ".zstd";
+      case STREAM_COMPRESSION_LZ4:
+         return ".lz4";
+      case STREAM_COMPRESSION_BZIP2:
+         return ".bz2";
+      default:
+         break;
+   }
+
+   return "";
+}
+
+int
+pgmoneta_stream_hash_init(int algorithm, struct stream_hash** hash)
+{
+   const EVP_MD* md = NULL;
+   struct stream_hash* h = NULL;
+
+   *hash = NULL;
+
+   h = (struct stream_hash*)malloc(sizeof(struct stream_hash));
+
+   if (h == NULL)
+   {
+      goto error;
+   }
+
+   memset(h, 0, sizeof(struct stream_hash));
+
+   h->algorithm = algorithm;
+
+   if (algorithm != HASH_ALGORITHM_CRC32C)
+   {
+      switch (algorithm)
+      {
+         case HASH_ALGORITHM_SHA224:
+            md = EVP_sha224();
+            break;
+         case HASH_ALGORITHM_DEFAULT:
+         case HASH_ALGORITHM_SHA256:
+            md = EVP_sha256();
+            break;
+         case HASH_ALGORITHM_SHA384:
+            md = EVP_sha384();
+            break;
+         case HASH_ALGORITHM_SHA512:
+            md = EVP_sha512();
+            break;
+         default:
+            pgmoneta_log_error("Unrecognized hash algorithm: %d", algorithm);
+            goto error;
+      }
+
+      h->md = EVP_MD_CTX_new();
+
+      if (h->md == NULL || !EVP_DigestInit_ex(h->md, md, NULL))
+      {
+         pgmoneta_log_error("Message digest initialization failed");
+         goto error;
+      }
+   }
+
+   *hash = h;
+
+   return 0;
+
+error:
+
+   pgmoneta_stream_hash_destroy(h);
+
+   return 1;
+}
+
+int
+pgmoneta_stream_hash_update(struct stream_hash* hash, void* buffer, size_t size)
+{
+   if (size == 0)
+   {
+      return 0;
+   }
+
+   if (hash->md != NULL)
+   {
+      if (!EVP_DigestUpdate(hash->md, buffer, size))
+      {
+         pgmoneta_log_error("Message digest update failed");
+         return 1;
+      }
+
+      return 0;
+   }
+
+   return pgmoneta_create_crc32c_buffer(buffer, size, &hash->crc);
+}
+
+int
+pgmoneta_stream_hash_final(struct stream_hash* hash, char** value)
+{
+   unsigned char md_value[EVP_MAX_MD_SIZE];
+   unsigned int md_len = 0;
+   char* h = NULL;
+
+   *value = NULL;
+
+   if (hash->md == NULL)
+   {
+      return pgmoneta_create_crc32c_string(hash->crc, value);
+   }
+
+   if (!EVP_DigestFinal_ex(hash->md, md_value, &md_len))
+   {
+      pgmoneta_log_error("Message digest finalization failed");
+      return 1;
+   }
+
+   h = (char*)malloc(2 * md_len + 1);
+
+   if (h == NULL)
+   {
+      return 1;
+   }
+
+   for (unsigned int i = 0; i < md_len; i++)
+   {
+      sprintf(h + (i * 2), "%02x", md_value[i]);
+   }
+   h[2 * md_len] = '\0';
+
+   *value = h;
+
+   return 0;
+}
+
+void
+pgmoneta_stream_hash_destroy(struct stream_hash* hash)
+{
+   if (hash == NULL)
+   {
+      return;
+   }
+
+   EVP_MD_CTX_free(hash->md);
+   free(hash);
+}
+
+int
+pgmoneta_stream_create_file_hash(int algorithm, char* path, char** hash)
+{
+   char* buffer = NULL;
+   size_t length = 0;
+   struct stream_hash* h = NULL;
+   struct stream_reader* reader = NULL;
+
+   *hash = NULL;
+
+   if (pgmoneta_stream_hash_init(algorithm, &h))
+   {
+      goto error;
+   }
+
+   buffer = (char*)malloc(STREAM_BUFFER_SIZE);
+
+   if (buffer == NULL)
+   {
+      goto error;
+   }
+
+   if (pgmoneta_stream_reader_init(path, &reader))
+   {
+      goto error;
+   }
+
+   do
+   {
+      if (pgmoneta_stream_reader_read(reader, buffer, STREAM_BUFFER_SIZE, &length))
+      {
+         goto error;
+      }
+
+      if (pgmoneta_stream_hash_update(h, buffer, length))
+      {
+         goto error;
+      }
+   }
+   while (length > 0);
+
+   if (pgmoneta_stream_hash_final(h, hash))
+   {
+      goto error;
+   }
+
+   pgmoneta_stream_reader_destroy(reader);
+   pgmoneta_stream_hash_destroy(h);
+   free(buffer);
+
+   return 0;
+
+error:
+
+   pgmoneta_stream_reader_destroy(reader);
+   pgmoneta_stream_hash_destroy(h);
+   free(buffer);
+
+   return 1;
+}
+
+/**
+ * Refill the input buffer with decrypted data from the file
+ */
+static int
+fill_input(struct stream_reader* reader)
+{
+   size_t n = 0;
+   int outl = 0;
+
+   reader->input_position = 0;
+   reader->input_length = 0;
+
+   if (reader->aes != NULL)
+   {
+      if (reader->eof)
+      {
+         return 0;
+      }
+
+      if (pgmoneta_aes_read(reader->aes, reader->input, STREAM_BUFFER_SIZE, &n))
+      {
+         return 1;
+      }
+
+      reader->input_length = n;
+      reader->eof = n == 0;
+
+      return 0;
+   }
+
+   while (reader->input_length == 0 && !reader->eof)
+   {
+      n = fread(reader->encrypted ? reader->raw : reader->input, 1, STREAM_BUFFER_SIZE, reader->file);
+
+      if (n == 0)
+      {
+         if (ferror(reader->file))
+         {
+            pgmoneta_log_error("Stream: Read error: %s", strerror(errno));
+            return 1;
+         }
+
+         reader->eof = true;
+
+         if (reader->encrypted)
+         {
+            if (EVP_CipherFinal_ex(reader->cipher, reader->input, &outl) == 0)
+            {
+               pgmoneta_log_error("EVP_CipherFinal_ex: failed to process final cipher block");
+               return 1;
+            }
+
+            reader->input_length = (size_t)outl;
+         }
+      }
+      else if (reader->encrypted)
+      {
+         if (EVP_CipherUpdate(reader->cipher, reader->input, &outl, reader->raw, (int)n) == 0)
+         {
+            pgmoneta_log_error("EVP_CipherUpdate: failed to process block");
+            return 1;
+         }
+
+         reader->input_length = (size_t)outl;
+      }
+      else
+      {
+         reader->input_length = n;
+      }
+   }
+
+   return 0;
+}
+
+/**
+ * Copy exactly size bytes of input, unless the end of the file is reached
+ */
+static int
+take_input(struct stream_reader* reader, void* buffer, size_t size, size_t* length)
+{
+   size_t s = 0;
+
+   *length = 0;
+
+   while (*length < size)
+   {
+      if (reader->input_position == reader->input_length)
+      {
+         if (fill_input(reader))
+         {
+            return 1;
+         }
+
+         if (reader->input_length == 0)
+         {
+            break;
+         }
+      }
+
+      s = MIN(size - *length, reader->input_length - reader->input_position);
+
+      memcpy((char*)buffer + *length, reader->input + reader->input_position, s);
+
+      reader->input_position += s;
+      *length += s;
+   }
+
+   return 0;
+}
+
+static int
+read_none(struct stream_reader* reader, char* buffer, size_t size, size_t* length)
+{
+   if (take_input(reader, buffer, size, length))
+   {
+      return 1;
+   }
+
+   if (*length < size)
+   {
+      reader->finished = true;
+   }
+
+   return 0;
+}
+
+static int
+read_gzip(struct stream_reader* reader, char* buffer, size_t size, size_t* length)
+{
+   int ret = 0;
+   z_stream* zs = (z_stream*)reader->decompressor;
+
+   zs->next_out = (Bytef*)buffer;
+   zs->avail_out = (uInt)size;
+
+   while (zs->avail_out > 0 && !reader->finished)
+   {
+      if (reader->input_position == reader->input_length)
+      {
+         if (fill_input(reader))
+         {
+            goto error;
+         }
+      }
+
+      zs->next_in = reader->input + reader->input_position;
+      zs->avail_in = (uInt)(reader->input_length - reader->input_position);
+
+      ret = inflate(zs, Z_NO_FLUSH);
+
+      reader->input_position = reader->input_length - zs->avail_in;
+
+      if (ret == Z_STREAM_END)
+      {
+         /* Concatenated members */
+         if (reader->input_position == reader->input_length)
+         {
+            if (fill_input(reader))
+            {
+               goto error;
+            }
+         }
+
+         if (reader->input_position == reader->input_length)
+         {
+            reader->finished = true;
+         }
+         else if (inflateReset(zs) != Z_OK)
+         {
+            goto error;
+         }
+      }
+      else if (ret == Z_BUF_ERROR)
+      {
+         if (reader->input_position == reader->input_length && reader->eof)
+         {
+            pgmoneta_log_error("Stream: Truncated gzip data");
+            goto error;
+         }
+      }
+      else if (ret != Z_OK)
+      {
+         pgmoneta_log_error("Stream: inflate error %d", ret);
+         goto error;
+      }
+   }
+
+   *length = size - zs->avail_out;
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+static int
+read_zstd(struct stream_reader* reader, char* buffer, size_t size, size_t* length)
+{
+   size_t ret = 0;
+   size_t before = 0;
+   size_t consumed = 0;
+   ZSTD_inBuffer in = {reader->input, reader->input_length, reader->input_position};
+   ZSTD_outBuffer out = {buffer, size, 0};
+
+   while (out.pos < out.size && !reader->finished)
+   {
+      if (in.pos == in.size && !reader->eof)
+      {
+         if (fill_input(reader))
+         {
+            goto error;
+         }
+
+         in.src = reader->input;
+         in.size = reader->input_length;
+         in.pos = 0;
+      }
+
+      before = out.pos;
+      consumed = in.pos;
+
+      ret = ZSTD_decompressStream((ZSTD_DCtx*)reader->decompressor, &out, &in);
+
+      if (ZSTD_isError(ret))
+      {
+         pgmoneta_log_error("Stream: ZSTD_decompressStream error: %s", ZSTD_getErrorName(ret));
+         goto error;
+      }
+
+      if (in.pos != consumed || out.pos != before)
+      {
+         reader->end_of_frame = ret == 0;
+      }
+
+      if (in.pos == in.size && reader->eof && out.pos == before)
+      {
+         if (!reader->end_of_frame)
+         {
+            pgmoneta_log_error("Stream: Truncated zstd data");
+            goto error;
+         }
+
+         reader->finished = true;
+      }
+   }
+
+   reader->input_position = in.pos;
+   *length = out.pos;
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+static int
+read_lz4(struct stream_reader* reader, char* buffer, size_t size, size_t* length)
+{
+   int compressed = 0;
+   int decompressed = 0;
+   size_t n = 0;
+   size_t s = 0;
+
+   while (*length < size)
+   {
+      if (reader->output_position == reader->output_length)
+      {
+         /* Each block is prefixed with its compressed size, see lz4_compression.c */
+         if (take_input(reader, &compressed, sizeof(compressed), &n))
+         {
+            goto error;
+         }
+
+         if (n == 0)
+         {
+            reader->finished = true;
+            break;
+         }
+
+         if (n != sizeof(compressed) || compressed <= 0 || compressed > (int)LZ4_COMPRESSBOUND(BLOCK_BYTES))
+         {
+            pgmoneta_log_error("Stream: Invalid lz4 block");
+            goto error;
+         }
+
+         if (take_input(reader, reader->block, (size_t)compressed, &n) || n != (size_t)compressed)
+         {
+            pgmoneta_log_error("Stream: Truncated lz4 block");
+            goto error;
+         }
+
+         decompressed = LZ4_decompress_safe_continue((LZ4_streamDecode_t*)reader->decompressor, reader->block,
+                                                     reader->output + (reader->output_index * BLOCK_BYTES),
+                                                     compressed, BLOCK_BYTES);
+
+         if (decompressed <= 0)
+         {
+            pgmoneta_log_error("Stream: LZ4_decompress_safe_continue error");
+            goto error;
+         }
+
+         reader->output_length = (size_t)decompressed;
+         reader->output_position = 0;
+      }
+
+      s = MIN(size - *length, reader->output_length - reader->output_position);
+
+      memcpy(buffer + *length, reader->output + (reader->output_index * BLOCK_BYTES) + reader->output_position, s);
+
+      reader->output_position += s;
+      *length += s;
+
+      if (reader->output_position == reader->output_length)
+      {
+         reader->output_index = (reader->output_index + 1) % 2;
+      }
+   }
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+static int
+read_bzip2(struct stream_reader* reader, char* buffer, size_t size, size_t* length)
+{
+   int ret = 0;
+   unsigned int before = 0;
+   bz_stream* bz = (bz_stream*)reader->decompressor;
+
+   bz->next_out = buffer;
+   bz->avail_out = (unsigned int)size;
+
+   while (bz->avail_out > 0 && !reader->finished)
+   {
+      if (reader->input_position == reader->input_length && !reader->eof)
+      {
+         if (fill_input(reader))
+         {
+            goto error;
+         }
+      }
+
+      bz->next_in = (char*)reader->input + reader->input_position;
+      bz->avail_in = (unsigned int)(reader->input_length - reader->input_position);
+
+      before = bz->avail_out;
+
+      ret = BZ2_bzDecompress(bz);
+
+      reader->input_position = reader->input_length - bz->avail_in;
+
+      if (ret == BZ_STREAM_END)
+      {
+         char* next_out = bz->next_out;
+         unsigned int avail_out = bz->avail_out;
+
+         /* Concatenated streams */
+         if (reader->input_position == reader->input_length)
+         {
+            if (fill_input(reader))
+            {
+               goto error;
+            }
+         }
+
+         if (reader->input_position == reader->input_length)
+         {
+            reader->finished = true;
+         }
+         else
+         {
+            BZ2_bzDecompressEnd(bz);
+            memset(bz, 0, sizeof(bz_stream));
+
+            if (BZ2_bzDecompressInit(bz, 0, 0) != BZ_OK)
+            {
+               goto error;
+            }
+
+            bz->next_out = next_out;
+            bz->avail_out = avail_out;
+         }
+      }
+      else if (ret != BZ_OK)
+      {
+         pgmoneta_log_error("Stream: BZ2_bzDecompress error %d", ret);
+         goto error;
+      }
+      else if (reader->input_position == reader->input_length && reader->eof && bz->avail_out == before)
+      {
+         pgmoneta_log_error("Stream: Truncated bzip2 data");
+         goto error;
+      }
+   }
+
+   *length = size - bz->avail_out;
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+/**
+ * Read a file from the chunks of its map. Chunks read from their start
+ * are verified against their hash
+ */
+static int
+read_map(struct stream_reader* reader, char* buffer, size_t size, size_t* length)
+{
+   size_t n = 0;
+   struct dedup_chunk* chunk = NULL;
+
+   while (*length < size && reader->map_index < reader->map->number_of_chunks)
+   {
+      chunk = &reader->map->chunks[reader->map_index];
+
+      if (reader->chunk == NULL && open_chunk(reader))
+      {
+         return 1;
+      }
+
+      if (reader->chunk_position == chunk->length)
+      {
+         if (close_chunk(reader, true))
+         {
+            return 1;
+         }
+
+         reader->map_index++;
+         continue;
+      }
+
+      if (pgmoneta_stream_reader_read(reader->chunk, buffer + *length,
+                                      MIN(size - *length, (size_t)(chunk->length - reader->chunk_position)), &n))
+      {
+         return 1;
+      }
+
+      if (n == 0)
+      {
+         pgmoneta_log_error("Stream: Chunk %" PRIu64 " is truncated", reader->map_index);
+         return 1;
+      }
+
+      if (reader->chunk_verify && EVP_DigestUpdate(reader->chunk_md, buffer + *length, n) != 1)
+      {
+         return 1;
+      }
+
+      reader->chunk_position += n;
+      reader->map_position += n;
+      *length += n;
+   }
+
+   if (reader->map_index >= reader->map->number_of_chunks)
+   {
+      reader->finished = true;
+   }
+
+   return 0;
+}
+
+static int
+seek_map(struct stream_reader* reader, uint64_t offset)
+{
+   uint64_t low = 0;
+   uint64_t high = 0;
+   struct dedup_map* map = reader->map;
+
+   if (offset > map->size)
+   {
+      pgmoneta_log_error("Stream: Seek beyond the end of the file");
+      return 1;
+   }
+
+   close_chunk(reader, false);
+
+   reader->finished = false;
+   reader->map_position = offset;
+
+   if (offset == map->size)
+   {
+      reader->map_index = map->number_of_chunks;
+      reader->finished = true;
+      return 0;
+   }
+
+   /* The last chunk that starts at or before the offset */
+   high = map->number_of_chunks - 1;
+
+   while (low < high)
+   {
+      uint64_t middle = low + (high - low + 1) / 2;
+
+      if (map->chunks[middle].offset <= offset)
+      {
+         low = middle;
+      }
+      else
+      {
+         high = middle - 1;
+      }
+   }
+
+   reader->map_index = low;
+
+   if (open_chunk(reader))
+   {
+      return 1;
+   }
+
+   if (offset > map->chunks[low].offset)
+   {
+      reader->chunk_verify = false;
+
+      if (pgmoneta_stream_reader_skip(reader->chunk, offset - map->chunks[low].offset))
+      {
+         return 1;
+      }
+
+      reader->chunk_position = offset - map->chunks[low].offset;
+   }
+
+   return 0;
+}
+
+static int
+open_chunk(struct stream_reader* reader)
+{
+   char* stored = NULL;
+   struct dedup_chunk* chunk = &reader->map->chunks[reader->map_index];
+
+   if (pgmoneta_dedup_get_chunk(reader->map, chunk, &stored))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_stream_reader_init_raw(stored, &reader->chunk))
+   {
+      goto error;
+   }
+
+   if (EVP_DigestInit_ex(reader->chunk_md, EVP_sha256(), NULL) != 1)
+   {
+      goto error;
+   }
+
+   reader->chunk_position = 0;
+   reader->chunk_verify = true;
+
+   free(stored);
+
+   return 0;
+
+error:
+
+   free(stored);
+
+   return 1;
+}
+
+static int
+close_chunk(struct stream_reader* reader, bool verify)
+{
+   unsigned char hash[EVP_MAX_MD_SIZE];
+   unsigned int length = 0;
+   int ret = 0;
+
+   if (reader->chunk == NULL)
+   {
+      return 0;
+   }
+
+   if (verify && reader->chunk_verify)
+   {
+      if (EVP_DigestFinal_ex(reader->chunk_md, &hash[0], &length) != 1 ||
+          length != DEDUP_HASH_LENGTH ||
+          memcmp(&hash[0], &reader->map->chunks[reader->map_index].hash[0], DEDUP_HASH_LENGTH))
+      {
+         pgmoneta_log_error("Stream: Chunk %" PRIu64 " doesn't match its hash", reader->map_index);
+         ret = 1;
+      }
+   }
+
+   pgmoneta_stream_reader_destroy(reader->chunk);
+   reader->chunk = NULL;
+   reader->chunk_position = 0;
+
+   return ret;
+}
+
+static int
+writer_create(FILE* file, int compression, int level, int encryption, struct stream_writer** writer)
+{
+   struct stream_writer* w = NULL;
+
+   w = (struct stream_writer*)malloc(sizeof(struct stream_writer));
+
+   if (w == NULL)
+   {
+      fclose(file);
+      return 1;
+   }
+
+   memset(w, 0, sizeof(struct stream_writer));
+
+   w->file = file;
+   w->compression = compression;
+   w->level = level;
+
+   if (compression == STREAM_COMPRESSION_ZSTD)
+   {
+      w->level = MAX(1, MIN(19, level));
+   }
+   else if (compression == STREAM_COMPRESSION_GZIP || compression == STREAM_COMPRESSION_BZIP2)
+   {
+      w->level = MAX(1, MIN(9, level));
+   }
+
+   w->output = (char*)malloc(STREAM_BUFFER_SIZE);
+
+   if (w->output == NULL)
+   {
+      goto error;
+   }
+
+   if (compression == STREAM_COMPRESSION_ZSTD)
+   {
+      w->compressor = ZSTD_createCCtx();
+
+      if (w->compressor == NULL)
+      {
+         goto error;
+      }
+
+      ZSTD_CCtx_setParameter((ZSTD_CCtx*)w->compressor, ZSTD_c_compressionLevel, w->level);
+   }
+   else if (compression == STREAM_COMPRESSION_GZIP)
+   {
+      z_stream* zs = NULL;
+
+      zs = (z_stream*)malloc(sizeof(z_stream));
+
+      if (zs == NULL)
+      {
+         goto error;
+      }
+
+      memset(zs, 0, sizeof(z_stream));
+
+      /* 15 + 16 writes a gzip header */
+      if (deflateInit2(zs, w->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      {
+         free(zs);
+         goto error;
+      }
+
+      w->compressor = zs;
+   }
+   else if (compression == STREAM_COMPRESSION_LZ4)
+   {
+      w->block = (char*)malloc(2 * BLOCK_BYTES);
+      w->compressor = LZ4_createStream();
+
+      if (w->block == NULL || w->compressor == NULL)
+      {
+         goto error;
+      }
+   }
+   else if (compression == STREAM_COMPRESSION_BZIP2)
+   {
+      bz_stream* bz = NULL;
+
+      bz = (bz_stream*)malloc(sizeof(bz_stream));
+
+      if (bz == NULL)
+      {
+         goto error;
+      }
+
+      memset(bz, 0, sizeof(bz_stream));
+
+      if (BZ2_bzCompressInit(bz, w->level, 0, 0) != BZ_OK)
+      {
+         free(bz);
+         goto error;
+      }
+
+      w->compressor = bz;
+   }
+
+   if (encryption != ENCRYPTION_NONE)
+   {
+      if (pgmoneta_aes_writer_create(file, encryption, NULL, &w->aes))
+      {
+         goto error;
+      }
+   }
+
+   *writer = w;
+
+   return 0;
+
+error:
+
+   pgmoneta_stream_writer_destroy(w);
+
+   return 1;
+}
+
+static int
+write_output(struct stream_writer* writer, void* buffer, size_t size)
+{
+   if (writer->aes == NULL)
+   {
+      if (write_file(writer, buffer, size))
+      {
+         return 1;
+      }
+   }
+   else if (pgmoneta_aes_write(writer->aes, buffer, size))
+   {
+      pgmoneta_log_error("Stream: Could not encrypt");
+      return 1;
+   }
+
+   writer->offset += size;
+
+   return 0;
+}
+
+static int
+write_file(struct stream_writer* writer, void* buffer, size_t size)
+{
+   if (size > 0 && fwrite(buffer, 1, size, writer->file) != size)
+   {
+      pgmoneta_log_error("Stream: Write error: %s", strerror(errno));
+      return 1;
+   }
+
+   return 0;
+}
+
+/**
+ * Compress the current block, prefixed with its compressed size as in lz4_compression.c
+ */
+static int
+write_lz4_block(struct stream_writer* writer)
+{
+   int compressed = 0;
+
+   compressed = LZ4_compress_fast_continue((LZ4_stream_t*)writer->compressor,
+                                           writer->block + (writer->block_index * BLOCK_BYTES),
+                                           writer->output + sizeof(compressed),
+                                           (int)writer->block_length, LZ4_COMPRESSBOUND(BLOCK_BYTES), 1);
+
+   if (compressed <= 0)
+   {
+      pgmoneta_log_error("Stream: LZ4_compress_fast_continue error");
+      return 1;
+   }
+
+   memcpy(writer->output, &compressed, sizeof(compressed));
+
+   if (write_output(writer, writer->output, sizeof(compressed) + (size_t)compressed))
+   {
+      return 1;
+   }
+
+   writer->block_index = (writer->block_index + 1) % 2;
+   writer->block_length = 0;
+
+   return 0;
+}
@@ -0,0 +1,1536 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <art.h>
+#include <csv.h>
+#include <logging.h>
+#include <stream.h>
+#include <tar_storage.h>
+#include <utils.h>
+
+/* system */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <lz4frame.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <zstd.h>
+#include <sys/stat.h>
+
+static int decode_input(struct tar_storage_writer* writer, char* data, size_t length);
+static int process_tar(struct tar_storage_writer* writer, char* data, size_t length);
+static int start_member(struct tar_storage_writer* writer);
+static int finish_member(struct tar_storage_writer* writer);
+static void writer_free(struct tar_storage_writer* writer);
+
+static int find_index(char* directory, char** index, char** tar);
+static int load_index(struct tar_storage_reader* reader);
+static int read_exact(struct stream_reader* stream, void* buffer, size_t size, size_t* length);
+static int foreach_member(char* directory, char* prefix, tar_storage_callback callback, void* data);
+static int write_member(struct tar_storage_reader* reader, char* to, int mode);
+
+static bool is_zero_block(char* block);
+static uint64_t parse_number(char* field, size_t size);
+static void parse_name(char* header, char* name, size_t size);
+static uint64_t padding(uint64_t size);
+
+int
+pgmoneta_tar_storage_writer_init(char* directory, char* name, struct tar_storage_writer** writer)
+{
+   char* tar = NULL;
+   char* index = NULL;
+   int compression = STREAM_COMPRESSION_NONE;
+   struct tar_storage_writer* w = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *writer = NULL;
+
+   w = (struct tar_storage_writer*)malloc(sizeof(struct tar_storage_writer));
+
+   if (w == NULL)
+   {
+      goto error;
+   }
+
+   memset(w, 0, sizeof(struct tar_storage_writer));
+
+   snprintf(w->directory, sizeof(w->directory), "%s", directory);
+   if (!pgmoneta_ends_with(w->directory, "/"))
+   {
+      snprintf(w->directory, sizeof(w->directory), "%s/", directory);
+   }
+
+   /* Server side compression is decoded in memory, since a single compressed stream can't be seeked */
+   switch (config->compression_type)
+   {
+      case COMPRESSION_SERVER_GZIP:
+         w->input = STREAM_COMPRESSION_GZIP;
+         break;
+      case COMPRESSION_SERVER_ZSTD:
+         w->input = STREAM_COMPRESSION_ZSTD;
+         break;
+      case COMPRESSION_SERVER_LZ4:
+         w->input = STREAM_COMPRESSION_LZ4;
+         break;
+      default:
+         w->input = STREAM_COMPRESSION_NONE;
+         break;
+   }
+
+   if (w->input != STREAM_COMPRESSION_NONE)
+   {
+      w->buffer = (char*)malloc(STREAM_BUFFER_SIZE);
+
+      if (w->buffer == NULL)
+      {
+         goto error;
+      }
+   }
+
+   if (w->input == STREAM_COMPRESSION_GZIP)
+   {
+      z_stream* zs = NULL;
+
+      zs = (z_stream*)malloc(sizeof(z_stream));
+
+      if (zs == NULL)
+      {
+         goto error;
+      }
+
+      memset(zs, 0, sizeof(z_stream));
+
+      if (inflateInit2(zs, 15 + 32) != Z_OK)
+      {
+         free(zs);
+         goto error;
+      }
+
+      w->decompressor = zs;
+   }
+   else if (w->input == STREAM_COMPRESSION_ZSTD)
+   {
+      w->decompressor = ZSTD_createDCtx();
+
+      if (w->decompressor == NULL)
+      {
+         goto error;
+      }
+   }
+   else if (w->input == STREAM_COMPRESSION_LZ4)
+   {
+      LZ4F_dctx* dctx = NULL;
+
+      if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+      {
+         goto error;
+      }
+
+      w->decompressor = dctx;
+   }
+
+   compression = pgmoneta_stream_compression(config->compression_type);
+
+   tar = pgmoneta_append(tar, w->directory);
+   tar = pgmoneta_append(tar, name);
+   tar = pgmoneta_append(tar, ".tar");
+
+   index = pgmoneta_append(index, tar);
+   index = pgmoneta_append(index, TAR_STORAGE_INDEX_SUFFIX);
+
+   tar = pgmoneta_append(tar, pgmoneta_stream_compression_suffix(compression));
+
+   snprintf(w->tar, sizeof(w->tar), "%s", tar);
+   snprintf(w->index_path, sizeof(w->index_path), "%s", index);
+
+   if (pgmoneta_stream_writer_init(tar, compression, config->compression_level, &w->stream))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_csv_writer_init(index, &w->index))
+   {
+      pgmoneta_log_error("Tar storage: Could not create %s", index);
+      goto error;
+   }
+
+   pgmoneta_log_debug("Tar storage: %s", tar);
+
+   free(tar);
+   free(index);
+
+   *writer = w;
+
+   return 0;
+
+error:
+
+   pgmoneta_tar_storage_writer_abort(w);
+
+   free(tar);
+   free(index);
+
+   return 1;
+}
+
+int
+pgmoneta_tar_storage_writer_write(struct tar_storage_writer* writer, void* data, size_t length)
+{
+   if (writer == NULL)
+   {
+      return 1;
+   }
+
+   return decode_input(writer, (char*)data, length);
+}
+
+int
+pgmoneta_tar_storage_writer_destroy(struct tar_storage_writer* writer)
+{
+   char end[2 * TAR_BLOCK_SIZE];
+   int ret = 0;
+
+   if (writer == NULL)
+   {
+      return 0;
+   }
+
+   if (writer->header_length > 0 || writer->data > 0 || writer->padding > 0)
+   {
+      pgmoneta_log_error("Tar storage: Incomplete tar data in %s", writer->directory);
+      goto error;
+   }
+
+   /* The server doesn't send the end of the archive */
+   memset(end, 0, sizeof(end));
+
+   if (pgmoneta_stream_writer_write(writer->stream, end, sizeof(end)))
+   {
+      goto error;
+   }
+
+   ret = pgmoneta_stream_writer_destroy(writer->stream);
+   writer->stream = NULL;
+
+   if (ret)
+   {
+      goto error;
+   }
+
+   writer_free(writer);
+
+   return 0;
+
+error:
+
+   pgmoneta_tar_storage_writer_abort(writer);
+
+   return 1;
+}
+
+void
+pgmoneta_tar_storage_writer_abort(struct tar_storage_writer* writer)
+{
+   char* f = NULL;
+
+   if (writer == NULL)
+   {
+      return;
+   }
+
+   if (writer->stream != NULL)
+   {
+      pgmoneta_stream_writer_destroy(writer->stream);
+      writer->stream = NULL;
+   }
+
+   if (strlen(writer->tar) > 0)
+   {
+      remove(writer->tar);
+   }
+
+   if (strlen(writer->index_path) > 0)
+   {
+      remove(writer->index_path);
+   }
+
+   /* The files that were extracted belong to the removed tar file */
+   f = pgmoneta_append(f, writer->directory);
+   f = pgmoneta_append(f, "backup_label");
+   remove(f);
+   free(f);
+   f = NULL;
+
+   f = pgmoneta_append(f, writer->directory);
+   f = pgmoneta_append(f, "tablespace_map");
+   remove(f);
+   free(f);
+
+   writer_free(writer);
+}
+
+bool
+pgmoneta_tar_storage_exists(char* directory)
+{
+   char* index = NULL;
+   char* tar = NULL;
+   bool exists = false;
+
+   if (!find_index(directory, &index, &tar))
+   {
+      exists = true;
+   }
+
+   free(index);
+   free(tar);
+
+   return exists;
+}
+
+int
+pgmoneta_tar_storage_reader_init(char* directory, struct tar_storage_reader** reader)
+{
+   char* tar = NULL;
+   struct tar_storage_reader* r = NULL;
+
+   *reader = NULL;
+
+   r = (struct tar_storage_reader*)malloc(sizeof(struct tar_storage_reader));
+
+   if (r == NULL)
+   {
+      goto error;
+   }
+
+   memset(r, 0, sizeof(struct tar_storage_reader));
+
+   if (find_index(directory, &r->index, &tar))
+   {
+      pgmoneta_log_error("Tar storage: No tar file in %s", directory);
+      goto error;
+   }
+
+   if (pgmoneta_stream_reader_init(tar, &r->stream))
+   {
+      goto error;
+   }
+
+   free(tar);
+
+   *reader = r;
+
+   return 0;
+
+error:
+
+   pgmoneta_tar_storage_reader_destroy(r);
+
+   free(tar);
+
+   return 1;
+}
+
+int
+pgmoneta_tar_storage_reader_next(struct tar_storage_reader* reader, struct tar_storage_member** member)
+{
+   char header[TAR_BLOCK_SIZE];
+   char name[MAX_PATH];
+   size_t length = 0;
+   uint64_t size = 0;
+   bool long_name = false;
+
+   *member = NULL;
+
+   if (pgmoneta_stream_reader_skip(reader->stream, reader->data + reader->padding))
+   {
+      goto error;
+   }
+
+   reader->data = 0;
+   reader->padding = 0;
+
+   while (true)
+   {
+      if (read_exact(reader->stream, header, sizeof(header), &length))
+      {
+         goto error;
+      }
+
+      if (length == 0 || is_zero_block(header))
+      {
+         return 0;
+      }
+
+      if (length != sizeof(header))
+      {
+         pgmoneta_log_error("Tar storage: Truncated tar header");
+         goto error;
+      }
+
+      size = parse_number(header + 124, 12);
+
+      if (header[156] == 'L')
+      {
+         /* GNU long name for the next member */
+         memset(name, 0, sizeof(name));
+
+         if (read_exact(reader->stream, name, (size_t)MIN(size, sizeof(name) - 1), &length) ||
+             pgmoneta_stream_reader_skip(reader->stream, size - length + padding(size)))
+         {
+            goto error;
+         }
+
+         long_name = true;
+         continue;
+      }
+
+      if (header[156] == 'x' || header[156] == 'g')
+      {
+         /* pax headers aren't written by PostgreSQL */
+         if (pgmoneta_stream_reader_skip(reader->stream, size + padding(size)))
+         {
+            goto error;
+         }
+
+         continue;
+      }
+
+      break;
+   }
+
+   memset(&reader->member, 0, sizeof(struct tar_storage_member));
+
+   if (long_name)
+   {
+      memcpy(reader->member.path, name, sizeof(reader->member.path));
+   }
+   else
+   {
+      parse_name(header, reader->member.path, sizeof(reader->member.path));
+   }
+
+   memcpy(reader->member.link, header + 157, 100);
+   reader->member.type = header[156] == '\0' ? '0' : header[156];
+   reader->member.mode = (int)parse_number(header + 100, 8);
+   reader->member.size = size;
+
+   reader->data = size;
+   reader->padding = padding(size);
+
+   *member = &reader->member;
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+int
+pgmoneta_tar_storage_reader_find(struct tar_storage_reader* reader, char* path, struct tar_storage_member** member)
+{
+   uintptr_t position = 0;
+   struct tar_storage_member* m = NULL;
+
+   *member = NULL;
+
+   if (reader->members == NULL && load_index(reader))
+   {
+      goto error;
+   }
+
+   position = pgmoneta_art_search(reader->members, (unsigned char*)path, strlen(path) + 1);
+
+   if (position == 0)
+   {
+      goto error;
+   }
+
+   m = &reader->entries[position - 1];
+
+   /* Only the frame holding the member is decompressed */
+   if (pgmoneta_stream_reader_seek(reader->stream, m->frame) ||
+       pgmoneta_stream_reader_skip(reader->stream, m->offset))
+   {
+      goto error;
+   }
+
+   memcpy(&reader->member, m, sizeof(struct tar_storage_member));
+
+   reader->data = m->size;
+   reader->padding = padding(m->size);
+
+   *member = &reader->member;
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+int
+pgmoneta_tar_storage_reader_read(struct tar_storage_reader* reader, void* buffer, size_t size, size_t* length)
+{
+   *length = 0;
+
+   if (reader->data == 0)
+   {
+      return 0;
+   }
+
+   if (pgmoneta_stream_reader_read(reader->stream, buffer, (size_t)MIN(size, reader->data), length))
+   {
+      return 1;
+   }
+
+   if (*length == 0)
+   {
+      pgmoneta_log_error("Tar storage: Truncated data for %s", reader->member.path);
+      return 1;
+   }
+
+   reader->data -= *length;
+
+   return 0;
+}
+
+int
+pgmoneta_tar_storage_reader_destroy(struct tar_storage_reader* reader)
+{
+   if (reader == NULL)
+   {
+      return 0;
+   }
+
+   pgmoneta_stream_reader_destroy(reader->stream);
+   pgmoneta_art_destroy(reader->members);
+
+   free(reader->entries);
+   free(reader->index);
+   free(reader);
+
+   return 0;
+}
+
+int
+pgmoneta_tar_storage_foreach(char* directory, tar_storage_callback callback, void* data)
+{
+   char* tblspc = NULL;
+   char* d = NULL;
+   char* prefix = NULL;
+   DIR* dir = NULL;
+   struct dirent* entry = NULL;
+
+   if (foreach_member(directory, "", callback, data))
+   {
+      goto error;
+   }
+
+   tblspc = pgmoneta_append(tblspc, directory);
+   if (!pgmoneta_ends_with(tblspc, "/"))
+   {
+      tblspc = pgmoneta_append(tblspc, "/");
+   }
+   tblspc = pgmoneta_append(tblspc, "pg_tblspc/");
+
+   dir = opendir(tblspc);
+
+   if (dir != NULL)
+   {
+      while ((entry = readdir(dir)) != NULL)
+      {
+         if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+         {
+            continue;
+         }
+
+         d = pgmoneta_append(d, tblspc);
+         d = pgmoneta_append(d, entry->d_name);
+
+         prefix = pgmoneta_append(prefix, "pg_tblspc/");
+         prefix = pgmoneta_append(prefix, entry->d_name);
+         prefix = pgmoneta_append(prefix, "/");
+
+         if (pgmoneta_tar_storage_exists(d))
+         {
+            if (foreach_member(d, prefix, callback, data))
+            {
+               goto error;
+            }
+         }
+
+         free(d);
+         d = NULL;
+
+         free(prefix);
+         prefix = NULL;
+      }
+
+      closedir(dir);
+      dir = NULL;
+   }
+
+   free(tblspc);
+
+   return 0;
+
+error:
+
+   if (dir != NULL)
+   {
+      closedir(dir);
+   }
+
+   free(tblspc);
+   free(d);
+   free(prefix);
+
+   return 1;
+}
+
+int
+pgmoneta_tar_storage_extract(char* directory, char* to, char** excluded)
+{
+   char* target = NULL;
+   char* path = NULL;
+   bool skip = false;
+   struct tar_storage_member* member = NULL;
+   struct tar_storage_reader* reader = NULL;
+
+   if (pgmoneta_tar_storage_reader_init(directory, &reader))
+   {
+      goto error;
+   }
+
+   pgmoneta_mkdir(to);
+
+   while (true)
+   {
+      if (pgmoneta_tar_storage_reader_next(reader, &member))
+      {
+         goto error;
+      }
+
+      if (member == NULL)
+      {
+         break;
+      }
+
+      path = member->path;
+
+      /* The tablespace links are created by the caller */
+      skip = pgmoneta_starts_with(path, "pg_tblspc/") && strlen(path) > strlen("pg_tblspc/");
+
+      for (int i = 0; !skip && excluded != NULL && excluded[i] != NULL; i++)
+      {
+         char* e = excluded[i];
+
+         if (*e == '/')
+         {
+            e++;
+         }
+
+         skip = !strcmp(path, e);
+      }
+
+      if (skip)
+      {
+         continue;
+      }
+
+      target = pgmoneta_append(target, to);
+      if (!pgmoneta_ends_with(target, "/"))
+      {
+         target = pgmoneta_append(target, "/");
+      }
+      target = pgmoneta_append(target, path);
+
+      if (pgmoneta_ends_with(target, "/"))
+      {
+         target[strlen(target) - 1] = '\0';
+      }
+
+      if (member->type == '5')
+      {
+         if (pgmoneta_mkdir(target))
+         {
+            pgmoneta_log_error("Tar storage: Could not create directory %s", target);
+            goto error;
+         }
+      }
+      else if (member->type == '2')
+      {
+         unlink(target);
+
+         if (symlink(member->link, target))
+         {
+            pgmoneta_log_error("Tar storage: Could not create link %s: %s", target, strerror(errno));
+            goto error;
+         }
+      }
+      else if (member->type == '0' || member->type == '7')
+      {
+         if (write_member(reader, target, member->mode))
+         {
+            goto error;
+         }
+      }
+
+      free(target);
+      target = NULL;
+   }
+
+   pgmoneta_tar_storage_reader_destroy(reader);
+
+   return 0;
+
+error:
+
+   pgmoneta_tar_storage_reader_destroy(reader);
+
+   free(target);
+
+   return 1;
+}
+
+int
+pgmoneta_tar_storage_extract_file(char* directory, char* path, char* to)
+{
+   char* d = NULL;
+   char* p = NULL;
+   char* slash = NULL;
+   struct tar_storage_member* member = NULL;
+   struct tar_storage_reader* reader = NULL;
+
+   while (*path == '/')
+   {
+      path++;
+   }
+
+   d = pgmoneta_append(d, directory);
+   if (!pgmoneta_ends_with(d, "/"))
+   {
+      d = pgmoneta_append(d, "/");
+   }
+
+   p = pgmoneta_append(p, path);
+
+   /* Tablespace files are in the tar file of the tablespace */
+   if (pgmoneta_starts_with(p, "pg_tblspc/") &&
+       (slash = strchr(p + strlen("pg_tblspc/"), '/')) != NULL)
+   {
+      *slash = '\0';
+      d = pgmoneta_append(d, p);
+
+      memmove(p, slash + 1, strlen(slash + 1) + 1);
+   }
+
+   if (pgmoneta_tar_storage_reader_init(d, &reader))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_tar_storage_reader_find(reader, p, &member))
+   {
+      pgmoneta_log_error("Tar storage: %s not found in %s", path, d);
+      goto error;
+   }
+
+   if (write_member(reader, to, member->mode))
+   {
+      goto error;
+   }
+
+   pgmoneta_tar_storage_reader_destroy(reader);
+
+   free(d);
+   free(p);
+
+   return 0;
+
+error:
+
+   pgmoneta_tar_storage_reader_destroy(reader);
+
+   free(d);
+   free(p);
+
+   return 1;
+}
+
+int
+pgmoneta_tar_storage_size(char* directory, uint64_t* size)
+{
+   struct tar_storage_reader* reader = NULL;
+
+   *size = 0;
+
+   if (pgmoneta_tar_storage_reader_init(directory, &reader))
+   {
+      goto error;
+   }
+
+   if (load_index(reader))
+   {
+      goto error;
+   }
+
+   for (uint64_t i = 0; i < reader->number_of_entries; i++)
+   {
+      *size += reader->entries[i].size;
+   }
+
+   pgmoneta_tar_storage_reader_destroy(reader);
+
+   return 0;
+
+error:
+
+   pgmoneta_tar_storage_reader_destroy(reader);
+
+   return 1;
+}
+
+static int
+decode_input(struct tar_storage_writer* writer, char* data, size_t length)
+{
+   if (writer->input == STREAM_COMPRESSION_GZIP)
+   {
+      int ret = 0;
+      z_stream* zs = (z_stream*)writer->decompressor;
+
+      zs->next_in = (Bytef*)data;
+      zs->avail_in = (uInt)length;
+
+      do
+      {
+         zs->next_out = (Bytef*)writer->buffer;
+         zs->avail_out = STREAM_BUFFER_SIZE;
+
+         ret = inflate(zs, Z_NO_FLUSH);
+
+         if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+         {
+            pgmoneta_log_error("Tar storage: inflate error %d", ret);
+            goto error;
+         }
+
+         if (process_tar(writer, writer->buffer, STREAM_BUFFER_SIZE - zs->avail_out))
+         {
+            goto error;
+         }
+
+         if (ret == Z_STREAM_END && zs->avail_in > 0 && inflateReset(zs) != Z_OK)
+         {
+            goto error;
+         }
+      }
+      while (zs->avail_in > 0 || zs->avail_out == 0);
+   }
+   else if (writer->input == STREAM_COMPRESSION_ZSTD)
+   {
+      size_t ret = 0;
+      ZSTD_inBuffer in = {data, length, 0};
+      ZSTD_outBuffer out = {writer->buffer, STREAM_BUFFER_SIZE, 0};
+
+      do
+      {
+         out.pos = 0;
+
+         ret = ZSTD_decompressStream((ZSTD_DCtx*)writer->decompressor, &out, &in);
+
+         if (ZSTD_isError(ret))
+         {
+            pgmoneta_log_error("Tar storage: ZSTD_decompressStream error: %s", ZSTD_getErrorName(ret));
+            goto error;
+         }
+
+         if (process_tar(writer, writer->buffer, out.pos))
+         {
+            goto error;
+         }
+      }
+      while (in.pos < in.size || out.pos == out.size);
+   }
+   else if (writer->input == STREAM_COMPRESSION_LZ4)
+   {
+      size_t ret = 0;
+      size_t position = 0;
+      size_t in = 0;
+      size_t out = 0;
+
+      do
+      {
+         in = length - position;
+         out = STREAM_BUFFER_SIZE;
+
+         ret = LZ4F_decompress((LZ4F_dctx*)writer->decompressor, writer->buffer, &out, data + position, &in, NULL);
+
+         if (LZ4F_isError(ret))
+         {
+            pgmoneta_log_error("Tar storage: LZ4F_decompress error: %s", LZ4F_getErrorName(ret));
+            goto error;
+         }
+
+         position += in;
+
+         if (process_tar(writer, writer->buffer, out))
+         {
+            goto error;
+         }
+      }
+      while (position < length || out == STREAM_BUFFER_SIZE);
+   }
+   else
+   {
+      return process_tar(writer, data, length);
+   }
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+/**
+ * Store the tar data, and track the member boundaries for the index
+ */
+static int
+process_tar(struct tar_storage_writer* writer, char* data, size_t length)
+{
+   size_t s = 0;
+
+   while (length > 0)
+   {
+      if (writer->data == 0 && writer->padding == 0)
+      {
+         s = MIN(length, TAR_BLOCK_SIZE - writer->header_length);
+
+         memcpy(writer->header + writer->header_length, data, s);
+         writer->header_length += s;
+
+         if (writer->header_length == TAR_BLOCK_SIZE)
+         {
+            writer->header_length = 0;
+
+            /* The end of the archive is written when the writer is destroyed */
+            if (!is_zero_block(writer->header) && start_member(writer))
+            {
+               goto error;
+            }
+         }
+      }
+      else if (writer->data > 0)
+      {
+         s = (size_t)MIN(length, writer->data);
+
+         if (pgmoneta_stream_writer_write(writer->stream, data, s))
+         {
+            goto error;
+         }
+
+         if (writer->long_name)
+         {
+            size_t n = MIN(s, sizeof(writer->name) - 1 - writer->name_length);
+
+            memcpy(writer->name + writer->name_length, data, n);
+            writer->name_length += n;
+         }
+
+         if (writer->extract != NULL && fwrite(data, 1, s, writer->extract) != s)
+         {
+            pgmoneta_log_error("Tar storage: Write error: %s", strerror(errno));
+            goto error;
+         }
+
+         writer->data -= s;
+
+         if (writer->data == 0 && finish_member(writer))
+         {
+            goto error;
+         }
+      }
+      else
+      {
+         s = (size_t)MIN(length, writer->padding);
+
+         if (pgmoneta_stream_writer_write(writer->stream, data, s))
+         {
+            goto error;
+         }
+
+         writer->padding -= s;
+      }
+
+      data += s;
+      length -= s;
+   }
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+static int
+start_member(struct tar_storage_writer* writer)
+{
+   char path[MAX_PATH];
+   char type[2];
+   char frame[MISC_LENGTH];
+   char offset[MISC_LENGTH];
+   char size[MISC_LENGTH];
+   char* columns[5];
+   char* f = NULL;
+   uint64_t s = 0;
+
+   s = parse_number(writer->header + 124, 12);
+
+   /* Frames start at member boundaries, so each member can be read from the start of its frame */
+   if (writer->stream->in_frame && writer->stream->frame_length >= TAR_STORAGE_FRAME_SIZE && writer->name_length == 0)
+   {
+      if (pgmoneta_stream_writer_end_frame(writer->stream))
+      {
+         goto error;
+      }
+   }
+
+   if (pgmoneta_stream_writer_write(writer->stream, writer->header, TAR_BLOCK_SIZE))
+   {
+      goto error;
+   }
+
+   writer->data = s;
+   writer->padding = padding(s);
+
+   if (writer->header[156] == 'L')
+   {
+      writer->long_name = true;
+      writer->name_length = 0;
+      memset(writer->name, 0, sizeof(writer->name));
+   }
+   else
+   {
+      memset(path, 0, sizeof(path));
+
+      if (writer->name_length > 0)
+      {
+         memcpy(path, writer->name, sizeof(path));
+         writer->name_length = 0;
+      }
+      else
+      {
+         parse_name(writer->header, path, sizeof(path));
+      }
+
+      memset(type, 0, sizeof(type));
+      type[0] = writer->header[156] == '\0' ? '0' : writer->header[156];
+
+      snprintf(frame, sizeof(frame), "%" PRIu64, writer->stream->frame_offset);
+      snprintf(offset, sizeof(offset), "%" PRIu64, writer->stream->frame_length);
+      snprintf(size, sizeof(size), "%" PRIu64, s);
+
+      columns[0] = path;
+      columns[1] = type;
+      columns[2] = frame;
+      columns[3] = offset;
+      columns[4] = size;
+
+      if (pgmoneta_csv_write(writer->index, 5, columns))
+      {
+         goto error;
+      }
+
+      /* The backup label is read from the data directory */
+      if (!strcmp(path, "backup_label") || !strcmp(path, "tablespace_map"))
+      {
+         f = pgmoneta_append(f, writer->directory);
+         f = pgmoneta_append(f, path);
+
+         writer->extract = fopen(f, "wb");
+
+         if (writer->extract == NULL)
+         {
+            pgmoneta_log_error("Tar storage: Could not create %s", f);
+            goto error;
+         }
+      }
+   }
+
+   if (writer->data == 0 && finish_member(writer))
+   {
+      goto error;
+   }
+
+   free(f);
+
+   return 0;
+
+error:
+
+   free(f);
+
+   return 1;
+}
+
+static int
+finish_member(struct tar_storage_writer* writer)
+{
+   if (writer->long_name)
+   {
+      writer->long_name = false;
+      writer->name[writer->name_length] = '\0';
+      writer->name_length = strlen(writer->name);
+   }
+
+   if (writer->extract != NULL)
+   {
+      if (fclose(writer->extract))
+      {
+         writer->extract = NULL;
+         return 1;
+      }
+
+      writer->extract = NULL;
+   }
+
+   return 0;
+}
+
+static void
+writer_free(struct tar_storage_writer* writer)
+{
+   pgmoneta_csv_writer_destroy(writer->index);
+
+   if (writer->extract != NULL)
+   {
+      fclose(writer->extract);
+   }
+
+   if (writer->decompressor != NULL)
+   {
+      if (writer->input == STREAM_COMPRESSION_GZIP)
+      {
+         inflateEnd((z_stream*)writer->decompressor);
+         free(writer->decompressor);
+      }
+      else if (writer->input == STREAM_COMPRESSION_ZSTD)
+      {
+         ZSTD_freeDCtx((ZSTD_DCtx*)writer->decompressor);
+      }
+      else if (writer->input == STREAM_COMPRESSION_LZ4)
+      {
+         LZ4F_freeDecompressionContext((LZ4F_dctx*)writer->decompressor);
+      }
+   }
+
+   free(writer->buffer);
+   free(writer);
+}
+
+/**
+ * Find the index in a directory, and the stored tar file it belongs to
+ */
+static int
+find_index(char* directory, char** index, char** tar)
+{
+   char* i = NULL;
+   char* t = NULL;
+   DIR* dir = NULL;
+   struct dirent* entry = NULL;
+
+   *index = NULL;
+   *tar = NULL;
+
+   dir = opendir(directory);
+
+   if (dir == NULL)
+   {
+      goto error;
+   }
+
+   while (i == NULL && (entry = readdir(dir)) != NULL)
+   {
+      if (pgmoneta_ends_with(entry->d_name, ".tar" TAR_STORAGE_INDEX_SUFFIX))
+      {
+         i = pgmoneta_append(i, directory);
+         if (!pgmoneta_ends_with(i, "/"))
+         {
+            i = pgmoneta_append(i, "/");
+         }
+         i = pgmoneta_append(i, entry->d_name);
+      }
+   }
+
+   closedir(dir);
+
+   if (i == NULL)
+   {
+      goto error;
+   }
+
+   i[strlen(i) - strlen(TAR_STORAGE_INDEX_SUFFIX)] = '\0';
+
+   if (pgmoneta_stream_get_stored_file(i, &t))
+   {
+      goto error;
+   }
+
+   i = pgmoneta_append(i, TAR_STORAGE_INDEX_SUFFIX);
+
+   *index = i;
+   *tar = t;
+
+   return 0;
+
+error:
+
+   free(i);
+
+   return 1;
+}
+
+static int
+load_index(struct tar_storage_reader* reader)
+{
+   int number_of_columns = 0;
+   char** columns = NULL;
+   struct tar_storage_member* m = NULL;
+   struct csv_reader* csv = NULL;
+
+   if (pgmoneta_art_create(&reader->members))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_csv_reader_init(reader->index, &csv))
+   {
+      pgmoneta_log_error("Tar storage: Could not open %s", reader->index);
+      goto error;
+   }
+
+   while (pgmoneta_csv_next_row(csv, &number_of_columns, &columns))
+   {
+      if (number_of_columns != 5)
+      {
+         pgmoneta_log_error("Tar storage: Incorrect number of columns in %s", reader->index);
+         free(columns);
+         goto error;
+      }
+
+      m = (struct tar_storage_member*)realloc(reader->entries, (reader->number_of_entries + 1) * sizeof(struct tar_storage_member));
+
+      if (m == NULL)
+      {
+         free(columns);
+         goto error;
+      }
+
+      reader->entries = m;
+      m = &reader->entries[reader->number_of_entries];
+
+      memset(m, 0, sizeof(struct tar_storage_member));
+      snprintf(m->path, sizeof(m->path), "%s", columns[0]);
+      m->type = columns[1][0];
+      m->mode = 0600;
+      m->frame = strtoull(columns[2], NULL, 10);
+      m->offset = strtoull(columns[3], NULL, 10);
+      m->size = strtoull(columns[4], NULL, 10);
+
+      reader->number_of_entries++;
+
+      /* The position is stored off by one, since 0 means not found */
+      pgmoneta_art_insert(reader->members, (unsigned char*)m->path, strlen(m->path) + 1,
+                          (uintptr_t)reader->number_of_entries, ValueUInt64);
+
+      free(columns);
+      columns = NULL;
+   }
+
+   pgmoneta_csv_reader_destroy(csv);
+
+   return 0;
+
+error:
+
+   pgmoneta_csv_reader_destroy(csv);
+
+   return 1;
+}
+
+/**
+ * Read until the buffer is full, or the end of the stream
+ */
+static int
+read_exact(struct stream_reader* stream, void* buffer, size_t size, size_t* length)
+{
+   size_t n = 0;
+
+   *length = 0;
+
+   while (*length < size)
+   {
+      if (pgmoneta_stream_reader_read(stream, (char*)buffer + *length, size - *length, &n))
+      {
+         return 1;
+      }
+
+      if (n == 0)
+      {
+         break;
+      }
+
+      *length += n;
+   }
+
+   return 0;
+}
+
+static int
+foreach_member(char* directory, char* prefix, tar_storage_callback callback, void* data)
+{
+   char* path = NULL;
+   struct tar_storage_member* member = NULL;
+   struct tar_storage_reader* reader = NULL;
+
+   if (pgmoneta_tar_storage_reader_init(directory, &reader))
+   {
+      goto error;
+   }
+
+   while (true)
+   {
+      if (pgmoneta_tar_storage_reader_next(reader, &member))
+      {
+         goto error;
+      }
+
+      if (member == NULL)
+      {
+         break;
+      }
+
+      path = pgmoneta_append(path, prefix);
+      path = pgmoneta_append(path, member->path);
+
+      if (callback(path, member, reader, data))
+      {
+         goto error;
+      }
+
+      free(path);
+      path = NULL;
+   }
+
+   pgmoneta_tar_storage_reader_destroy(reader);
+
+   return 0;
+
+error:
+
+   pgmoneta_tar_storage_reader_destroy(reader);
+
+   free(path);
+
+   return 1;
+}
+
+/**
+ * Write the data of the current member to a file
+ */
+static int
+write_member(struct tar_storage_reader* reader, char* to, int mode)
+{
+   char* buffer = NULL;
+   char* parent = NULL;
+   char* slash = NULL;
+   size_t length = 0;
+   int fd = -1;
+
+   parent = pgmoneta_append(parent, to);
+   slash = strrchr(parent, '/');
+
+   if (slash != NULL && slash != parent)
+   {
+      *slash = '\0';
+      pgmoneta_mkdir(parent);
+   }
+
+   buffer = (char*)malloc(STREAM_BUFFER_SIZE);
+
+   if (buffer == NULL)
+   {
+      goto error;
+   }
+
+   fd = open(to, O_WRONLY | O_CREAT | O_TRUNC, (mode & 0777) != 0 ? (mode & 0777) : 0600);
+
+   if (fd == -1)
+   {
+      pgmoneta_log_error("Tar storage: Could not create %s: %s", to, strerror(errno));
+      goto error;
+   }
+
+   do
+   {
+      if (pgmoneta_tar_storage_reader_read(reader, buffer, STREAM_BUFFER_SIZE, &length))
+      {
+         goto error;
+      }
+
+      for (size_t written = 0; written < length;)
+      {
+         ssize_t w = write(fd, buffer + written, length - written);
+
+         if (w < 0)
+         {
+            if (errno == EINTR)
+            {
+               continue;
+            }
+
+            pgmoneta_log_error("Tar storage: Could not write %s: %s", to, strerror(errno));
+            goto error;
+         }
+
+         written += (size_t)w;
+      }
+   }
+   while (length > 0);
+
+   if (fsync(fd))
+   {
+      pgmoneta_log_error("Tar storage: Could not synchronize %s: %s", to, strerror(errno));
+      goto error;
+   }
+
+   close(fd);
+
+   free(buffer);
+   free(parent);
+
+   return 0;
+
+error:
+
+   if (fd != -1)
+   {
+      close(fd);
+   }
+
+   free(buffer);
+   free(parent);
+
+   return 1;
+}
+
+static bool
+is_zero_block(char* block)
+{
+   for (int i = 0; i < TAR_BLOCK_SIZE; i++)
+   {
+      if (block[i] != 0)
+      {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+/**
+ * Parse a numeric header field, either octal or GNU base-256
+ */
+static uint64_t
+parse_number(char* field, size_t size)
+{
+   uint64_t value = 0;
+
+   if ((unsigned char)field[0] & 0x80)
+   {
+      for (size_t i = 1; i < size; i++)
+      {
+         value = (value << 8) | (unsigned char)field[i];
+      }
+
+      return value;
+   }
+
+   for (size_t i = 0; i < size && field[i] != '\0'; i++)
+   {
+      if (field[i] >= '0' && field[i] <= '7')
+      {
+         value = (value << 3) | (uint64_t)(field[i] - '0');
+      }
+   }
+
+   return value;
+}
+
+/**
+ * Parse the name of a member, including the ustar prefix
+ */
+static void
+parse_name(char* header, char* name, size_t size)
+{
+   char prefix[156];
+   char n[101];
+
+   memset(prefix, 0, sizeof(prefix));
+   memset(n, 0, sizeof(n));
+
+   memcpy(n, header, 100);
+
+   if (!memcmp(header + 257, "ustar", 5) && header[345] != '\0')
+   {
+      memcpy(prefix, header + 345, 155);
+      snprintf(name, size, "%s/%s", prefix, n);
+   }
+   else
+   {
+      snprintf(name, size, "%s", n);
+   }
+}
+
+static uint64_t
+padding(uint64_t size)
+{
+   return (TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+}
@@ -31,6 +31,8 @@
 #include <info.h>
 #include <logging.h>
 #include <restore.h>
+#include <stream.h>
+#include <tar_storage.h>
 #include <utils.h>
 #include <workers.h>
 
@@ -57,6 +59,21 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#ifdef HAVE_LINUX
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
+#ifdef HAVE_LINUX
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define COPY_CHUNK_SIZE  (1024 * 1024 * 1024)
+
 #ifndef EVBACKEND_LINUXAIO
 #define EVBACKEND_LINUXAIO 0x00000040U
 #endif
@@ -83,6 +100,9 @@ static int copy_tablespaces_hotstandby(char* from, char* to, char* tblspc_mappin
 static int get_permissions(char* from, int* permissions);
 
 static void copy_file(void* arg);
+static int copy_file_data(int fd_from, int fd_to);
+static void copy_stored_file(void* arg);
+static bool is_restore_last_file(char* directory, char* name, char** restore_last_files_names);
 static void delete_file(void* arg);
 
 int32_t
@@ -1812,16 +1832,20 @@ pgmoneta_copy_postgresql_restore(char* from, char* to, char* base, char* server,
    DIR* d = opendir(from);
    char* from_buffer = NULL;
    char* to_buffer = NULL;
+   char* plain = NULL;
    struct dirent* entry;
    struct stat statbuf;
    char** restore_last_files_names = NULL;
+   bool tar = false;
 
    if (pgmoneta_get_restore_last_files_names(&restore_last_files_names))
    {
       goto error;
    }
 
-   if (restore_last_files_names != NULL)
+   tar = pgmoneta_tar_storage_exists(from);
+
+   if (restore_last_files_names != NULL && !tar)
    {
       for (int i = 0; restore_last_files_names[i] != NULL; i++)
       {
@@ -1841,7 +1865,24 @@ pgmoneta_copy_postgresql_restore(char* from, char* to, char* base, char* server,
 
    pgmoneta_mkdir(to);
 
-   if (d)
+   if (tar)
+   {
+      if (d)
+      {
+         closedir(d);
+      }
+
+      if (pgmoneta_tar_storage_extract(from, to, restore_last_files_names))
+      {
+         goto error;
+      }
+
+      if (copy_tablespaces_restore(from, to, base, server, id, backup, workers))
+      {
+         goto error;
+      }
+   }
+   else if (d)
    {
       while ((entry = readdir(d)))
       {
@@ -1864,31 +1905,38 @@ pgmoneta_copy_postgresql_restore(char* from, char* to, char* base, char* server,
             {
                if (!strcmp(entry->d_name, "pg_tblspc"))
                {
-                  copy_tablespaces_restore(from, to, base, server, id, backup, workers);
+                  if (copy_tablespaces_restore(from, to, base, server, id, backup, workers))
+                  {
+                     free(from_buffer);
+                     free(to_buffer);
+                     closedir(d);
+
+                     goto error;
+                  }
                }
                else
                {
-                  pgmoneta_copy_directory(from_buffer, to_buffer, restore_last_files_names, workers);
+                  pgmoneta_copy_stored_directory(from_buffer, to_buffer, restore_last_files_names, workers);
                }
             }
             else
             {
-               bool file_is_excluded = false;
-               if (restore_last_files_names != NULL)
-               {
-                  for (int i = 0; restore_last_files_names[i] != NULL; i++)
-                  {
-                     file_is_excluded = !strcmp(from_buffer, restore_last_files_names[i]);
-                  }
-                  if (!file_is_excluded)
-                  {
-                     pgmoneta_copy_file(from_buffer, to_buffer, workers);
-                  }
-               }
-               else
+               plain = pgmoneta_stream_plain_name(entry->d_name);
+
+               free(to_buffer);
+               to_buffer = NULL;
+
+               to_buffer = pgmoneta_append(to_buffer, to);
+               to_buffer = pgmoneta_append(to_buffer, "/");
+               to_buffer = pgmoneta_append(to_buffer, plain);
+
+               if (!is_restore_last_file(from, plain, restore_last_files_names))
                {
-                  pgmoneta_copy_file(from_buffer, to_buffer, workers);
+                  pgmoneta_copy_stored_file(from_buffer, to_buffer, workers);
                }
+
+               free(plain);
+               plain = NULL;
             }
          }
 
@@ -1940,7 +1988,24 @@ pgmoneta_copy_postgresql_hotstandby(char* from, char* to, char* tblspc_mappings,
 
    pgmoneta_mkdir(to);
 
-   if (d)
+   if (pgmoneta_tar_storage_exists(from))
+   {
+      if (d)
+      {
+         closedir(d);
+      }
+
+      if (pgmoneta_tar_storage_extract(from, to, NULL))
+      {
+         goto error;
+      }
+
+      if (copy_tablespaces_hotstandby(from, to, tblspc_mappings, backup, workers))
+      {
+         goto error;
+      }
+   }
+   else if (d)
    {
       while ((entry = readdir(d)))
       {
@@ -1963,7 +2028,14 @@ pgmoneta_copy_postgresql_hotstandby(char* from, char* to, char* tblspc_mappings,
             {
                if (!strcmp(entry->d_name, "pg_tblspc"))
                {
-                  copy_tablespaces_hotstandby(from, to, tblspc_mappings, backup, workers);
+                  if (copy_tablespaces_hotstandby(from, to, tblspc_mappings, backup, workers))
+                  {
+                     free(from_buffer);
+                     free(to_buffer);
+                     closedir(d);
+
+                     goto error;
+                  }
                }
                else
                {
@@ -2106,7 +2178,25 @@ copy_tablespaces_restore(char* from, char* to, char* base, char* server, char* i
             pgmoneta_mkdir(to_directory);
             pgmoneta_symlink_at_file(to_oid, relative_directory);
 
-            pgmoneta_copy_directory(&path[0], to_directory, NULL, workers);
+            if (pgmoneta_tar_storage_exists(&path[0]))
+            {
+               if (pgmoneta_tar_storage_extract(&path[0], to_directory, NULL))
+               {
+                  pgmoneta_log_error("Could not extract tablespace %s", tblspc_name);
+
+                  free(to_oid);
+                  free(to_directory);
+                  free(relative_directory);
+                  free(link);
+                  closedir(d);
+
+                  goto error;
+               }
+            }
+            else
+            {
+               pgmoneta_copy_stored_directory(&path[0], to_directory, NULL, workers);
+            }
 
             free(to_oid);
             free(to_directory);
@@ -2245,7 +2335,23 @@ copy_tablespaces_hotstandby(char* from, char* to, char* tblspc_mappings, struct
             }
          }
 
-         pgmoneta_copy_directory(src, dst, NULL, workers);
+         if (pgmoneta_tar_storage_exists(src))
+         {
+            if (pgmoneta_tar_storage_extract(src, dst, NULL))
+            {
+               pgmoneta_log_error("Could not extract tablespace %s", backup->tablespaces[i]);
+
+               free(src);
+               free(dst);
+               free(link);
+
+               goto error;
+            }
+         }
+         else
+         {
+            pgmoneta_copy_directory(src, dst, NULL, workers);
+         }
 
          free(src);
          free(dst);
@@ -2341,6 +2447,230 @@ error:
    return 1;
 }
 
+int
+pgmoneta_copy_stored_directory(char* from, char* to, char** restore_last_files_names, struct workers* workers)
+{
+   DIR* d = opendir(from);
+   char* from_buffer = NULL;
+   char* to_buffer = NULL;
+   char* plain = NULL;
+   struct dirent* entry;
+   struct stat statbuf;
+
+   pgmoneta_mkdir(to);
+
+   if (d == NULL)
+   {
+      goto error;
+   }
+
+   while ((entry = readdir(d)))
+   {
+      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      {
+         continue;
+      }
+
+      from_buffer = pgmoneta_append(from_buffer, from);
+      from_buffer = pgmoneta_append(from_buffer, "/");
+      from_buffer = pgmoneta_append(from_buffer, entry->d_name);
+
+      if (!stat(from_buffer, &statbuf))
+      {
+         if (S_ISDIR(statbuf.st_mode))
+         {
+            plain = pgmoneta_append(plain, entry->d_name);
+         }
+         else
+         {
+            plain = pgmoneta_stream_plain_name(entry->d_name);
+         }
+
+         to_buffer = pgmoneta_append(to_buffer, to);
+         to_buffer = pgmoneta_append(to_buffer, "/");
+         to_buffer = pgmoneta_append(to_buffer, plain);
+
+         if (S_ISDIR(statbuf.st_mode))
+         {
+            pgmoneta_copy_stored_directory(from_buffer, to_buffer, restore_last_files_names, workers);
+         }
+         else if (!is_restore_last_file(from, plain, restore_last_files_names))
+         {
+            pgmoneta_copy_stored_file(from_buffer, to_buffer, workers);
+         }
+      }
+
+      free(from_buffer);
+      free(to_buffer);
+      free(plain);
+
+      from_buffer = NULL;
+      to_buffer = NULL;
+      plain = NULL;
+   }
+
+   closedir(d);
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+int
+pgmoneta_copy_stored_file(char* from, char* to, struct workers* workers)
+{
+   char* plain = NULL;
+   bool stored = false;
+   struct worker_input* fi = NULL;
+
+   plain = pgmoneta_stream_plain_name(from);
+   stored = strlen(plain) != strlen(from);
+   free(plain);
+
+   if (!stored)
+   {
+      /* Nothing to decode, so keep the fast paths of copy_file() */
+      return pgmoneta_copy_file(from, to, workers);
+   }
+
+   if (pgmoneta_create_worker_input(NULL, from, to, 0, workers, &fi))
+   {
+      return 1;
+   }
+
+   if (workers != NULL)
+   {
+      pgmoneta_workers_add(workers, copy_stored_file, (void*)fi);
+   }
+   else
+   {
+      copy_stored_file(fi);
+   }
+
+   return 0;
+}
+
+static void
+copy_stored_file(void* arg)
+{
+   int fd_to = -1;
+   int permissions = -1;
+   char* buffer = NULL;
+   size_t length = 0;
+   size_t offset = 0;
+   ssize_t written = 0;
+   struct stream_reader* reader = NULL;
+   struct worker_input* fi = NULL;
+
+   fi = (struct worker_input*)arg;
+
+   if (get_permissions(fi->from, &permissions))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_stream_reader_init(fi->from, &reader))
+   {
+      goto error;
+   }
+
+   buffer = (char*)malloc(DEFAULT_BUFFER_SIZE);
+
+   if (buffer == NULL)
+   {
+      goto error;
+   }
+
+   fd_to = open(fi->to, O_WRONLY | O_CREAT | O_TRUNC, permissions);
+
+   if (fd_to < 0)
+   {
+      goto error;
+   }
+
+   do
+   {
+      if (pgmoneta_stream_reader_read(reader, buffer, DEFAULT_BUFFER_SIZE, &length))
+      {
+         goto error;
+      }
+
+      offset = 0;
+
+      while (offset < length)
+      {
+         written = write(fd_to, buffer + offset, length - offset);
+
+         if (written < 0)
+         {
+            if (errno == EINTR)
+            {
+               continue;
+            }
+
+            goto error;
+         }
+
+         offset += written;
+      }
+   }
+   while (length > 0);
+
+   fsync(fd_to);
+
+   if (close(fd_to) < 0)
+   {
+      fd_to = -1;
+      goto error;
+   }
+
+   pgmoneta_stream_reader_destroy(reader);
+   free(buffer);
+   free(fi);
+
+   return;
+
+error:
+
+   pgmoneta_log_error("Could not restore %s -> %s", fi->from, fi->to);
+
+   if (fd_to >= 0)
+   {
+      close(fd_to);
+   }
+
+   pgmoneta_stream_reader_destroy(reader);
+   free(buffer);
+   free(fi);
+}
+
+static bool
+is_restore_last_file(char* directory, char* name, char** restore_last_files_names)
+{
+   bool excluded = false;
+   char* path = NULL;
+
+   if (restore_last_files_names == NULL)
+   {
+      return false;
+   }
+
+   path = pgmoneta_append(path, directory);
+   path = pgmoneta_append(path, "/");
+   path = pgmoneta_append(path, name);
+
+   for (int i = 0; !excluded && restore_last_files_names[i] != NULL; i++)
+   {
+      excluded = !strcmp(path, restore_last_files_names[i]);
+   }
+
+   free(path);
+
+   return excluded;
+}
+
 static int
 get_permissions(char* from, int* permissions)
 {
@@ -2383,8 +2713,6 @@ copy_file(void* arg)
 {
    int fd_from = -1;
    int fd_to = -1;
-   char buffer[8192];
-   ssize_t nread = -1;
    int saved_errno = -1;
    int permissions = -1;
    struct worker_input* fi = NULL;
@@ -2410,11 +2738,160 @@ copy_file(void* arg)
       goto error;
    }
 
-   while ((nread = read(fd_from, buffer, sizeof(buffer))) > 0)
+   if (copy_file_data(fd_from, fd_to))
+   {
+      goto error;
+   }
+
+   fsync(fd_to);
+
+   if (close(fd_to) < 0)
+   {
+      fd_to = -1;
+      goto error;
+   }
+   close(fd_from);
+
+   free(fi);
+
+   return;
+
+error:
+   saved_errno = errno;
+
+   pgmoneta_log_debug("copy_file: %s -> %s (%s)", fi->from, fi->to, strerror(saved_errno));
+
+   if (fd_from >= 0)
+   {
+      close(fd_from);
+   }
+   if (fd_to >= 0)
+   {
+      close(fd_to);
+   }
+
+   errno = saved_errno;
+
+   free(fi);
+}
+
+/**
+ * Copy the content of a file. A reflink is used when the file system supports it,
+ * then copy_file_range() and sendfile() which stay in the kernel, and last
+ * a read / write loop
+ */
+static int
+copy_file_data(int fd_from, int fd_to)
+{
+   char* buffer = NULL;
+   ssize_t nread = -1;
+#ifdef HAVE_LINUX
+   struct stat st;
+   off_t remaining = 0;
+   ssize_t n = 0;
+   bool kernel_copy = true;
+
+   if (ioctl(fd_to, FICLONE, fd_from) == 0)
+   {
+      return 0;
+   }
+
+   if (fstat(fd_from, &st) == -1)
+   {
+      return 1;
+   }
+
+   remaining = st.st_size;
+
+   while (kernel_copy && remaining > 0)
+   {
+      n = copy_file_range(fd_from, NULL, fd_to, NULL, MIN((size_t)remaining, COPY_CHUNK_SIZE), 0);
+
+      if (n > 0)
+      {
+         remaining -= n;
+      }
+      else if (n == 0)
+      {
+         /* The file became shorter */
+         remaining = 0;
+      }
+      else if (errno == EINTR)
+      {
+         continue;
+      }
+      else if (remaining == st.st_size &&
+               (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL))
+      {
+         kernel_copy = false;
+      }
+      else
+      {
+         return 1;
+      }
+   }
+
+   if (kernel_copy)
+   {
+      return 0;
+   }
+
+   kernel_copy = true;
+
+   while (kernel_copy && remaining > 0)
+   {
+      n = sendfile(fd_to, fd_from, NULL, MIN((size_t)remaining, COPY_CHUNK_SIZE));
+
+      if (n > 0)
+      {
+         remaining -= n;
+      }
+      else if (n == 0)
+      {
+         remaining = 0;
+      }
+      else if (errno == EINTR)
+      {
+         continue;
+      }
+      else if (remaining == st.st_size && (errno == ENOSYS || errno == EINVAL))
+      {
+         kernel_copy = false;
+      }
+      else
+      {
+         return 1;
+      }
+   }
+
+   if (kernel_copy)
+   {
+      return 0;
+   }
+#endif
+
+   buffer = malloc(COPY_BUFFER_SIZE);
+
+   if (buffer == NULL)
+   {
+      return 1;
+   }
+
+   while ((nread = read(fd_from, buffer, COPY_BUFFER_SIZE)) != 0)
    {
-      char* out = &buffer[0];
+      char* out = buffer;
       ssize_t nwritten;
 
+      if (nread < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+
+         goto error;
+      }
+
       do
       {
          nwritten = write(fd_to, out, nread);
@@ -2432,34 +2909,15 @@ copy_file(void* arg)
       while (nread > 0);
    }
 
-   if (nread == 0)
-   {
-      fsync(fd_to);
-
-      if (close(fd_to) < 0)
-      {
-         fd_to = -1;
-         goto error;
-      }
-      close(fd_from);
-   }
-
-   free(fi);
+   free(buffer);
 
-   return;
+   return 0;
 
 error:
-   saved_errno = errno;
-
-   close(fd_from);
-   if (fd_to >= 0)
-   {
-      close(fd_to);
-   }
 
-   errno = saved_errno;
+   free(buffer);
 
-   free(fi);
+   return 1;
 }
 
 int
@@ -2775,77 +3233,6 @@ error:
    return NULL;
 }
 
-int
-pgmoneta_copy_wal_files(char* from, char* to, char* start, struct workers* workers)
-{
-   int number_of_wal_files = 0;
-   char** wal_files = NULL;
-   char* basename = NULL;
-   char* ff = NULL;
-   char* tf = NULL;
-
-   pgmoneta_get_files(from, &number_of_wal_files, &wal_files);
-
-   for (int i = 0; i < number_of_wal_files; i++)
-   {
-      pgmoneta_basename_file(wal_files[i], &basename);
-
-      if (strcmp(wal_files[i], start) >= 0)
-      {
-         if (pgmoneta_ends_with(wal_files[i], ".partial"))
-         {
-            ff = pgmoneta_append(ff, from);
-            if (!pgmoneta_ends_with(ff, "/"))
-            {
-               ff = pgmoneta_append(ff, "/");
-            }
-            ff = pgmoneta_append(ff, wal_files[i]);
-
-            tf = pgmoneta_append(tf, to);
-            if (!pgmoneta_ends_with(tf, "/"))
-            {
-               tf = pgmoneta_append(tf, "/");
-            }
-            tf = pgmoneta_append(tf, basename);
-         }
-         else
-         {
-            ff = pgmoneta_append(ff, from);
-            if (!pgmoneta_ends_with(ff, "/"))
-            {
-               ff = pgmoneta_append(ff, "/");
-            }
-            ff = pgmoneta_append(ff, wal_files[i]);
-
-            tf = pgmoneta_append(tf, to);
-            if (!pgmoneta_ends_with(tf, "/"))
-            {
-               tf = pgmoneta_append(tf, "/");
-            }
-            tf = pgmoneta_append(tf, wal_files[i]);
-         }
-
-         pgmoneta_copy_file(ff, tf, workers);
-      }
-
-      free(basename);
-      free(ff);
-      free(tf);
-
-      basename = NULL;
-      ff = NULL;
-      tf = NULL;
-   }
-
-   for (int i = 0; i < number_of_wal_files; i++)
-   {
-      free(wal_files[i]);
-   }
-   free(wal_files);
-
-   return 0;
-}
-
 int
 pgmoneta_number_of_wal_files(char* directory, char* from, char* to)
 {
@@ -3238,6 +3625,24 @@ pgmoneta_get_server(int server)
    return get_server_basepath(server);
 }
 
+char*
+pgmoneta_get_global(void)
+{
+   char* d = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   d = pgmoneta_append(d, config->base_dir);
+   if (!pgmoneta_ends_with(config->base_dir, "/"))
+   {
+      d = pgmoneta_append(d, "/");
+   }
+   d = pgmoneta_append(d, "global/");
+
+   return d;
+}
+
 char*
 pgmoneta_get_server_backup(int server)
 {
@@ -47,7 +47,6 @@ void
 pgmoneta_verify(SSL* ssl, int client_fd, int server, struct json* payload)
 {
    char* backup_id = NULL;
-   char* directory = NULL;
    char* files = NULL;
    char* elapsed = NULL;
    time_t start_time;
@@ -76,7 +75,6 @@ pgmoneta_verify(SSL* ssl, int client_fd, int server, struct json* payload)
 
    req = (struct json*)pgmoneta_json_get(payload, MANAGEMENT_CATEGORY_REQUEST);
    backup_id = (char*)pgmoneta_json_get(req, MANAGEMENT_ARGUMENT_BACKUP);
-   directory = (char*)pgmoneta_json_get(req, MANAGEMENT_ARGUMENT_DIRECTORY);
    files = (char*)pgmoneta_json_get(req, MANAGEMENT_ARGUMENT_FILES);
 
    if (pgmoneta_deque_create(true, &nodes))
@@ -89,11 +87,6 @@ pgmoneta_verify(SSL* ssl, int client_fd, int server, struct json* payload)
       goto error;
    }
 
-   if (pgmoneta_deque_add(nodes, "directory", (uintptr_t)directory, ValueString))
-   {
-      goto error;
-   }
-
    if (pgmoneta_deque_add(nodes, "files", (uintptr_t)files, ValueString))
    {
       goto error;
@@ -40,6 +40,8 @@
 #include <workflow.h>
 #include <utils.h>
 #include <storage.h>
+#include <walfile/wal_index.h>
+#include <walfile/wal_tap.h>
 
 /* system */
 #include <ctype.h>
@@ -90,7 +92,9 @@ pgmoneta_wal(int srv, char** argv)
    char cmd[MISC_LENGTH];
    size_t xlogpos_size = 0;
    size_t xlogptr = 0;
-   size_t segno;
+   size_t tapptr = 0;
+   size_t segno = 0;
+   uint32_t wal_crc = 0;
    size_t xlogoff;
    size_t curr_xlogoff = 0;
    size_t segsize;
@@ -111,6 +115,7 @@ pgmoneta_wal(int srv, char** argv)
    struct workflow* head = NULL;
    struct workflow* current = NULL;
    struct deque* nodes = NULL;
+   struct wal_tap* tap = NULL;
 
    config = (struct configuration*) shmem;
 
@@ -279,6 +284,15 @@ pgmoneta_wal(int srv, char** argv)
       memset(config->servers[srv].current_wal_lsn, 0, MISC_LENGTH);
       snprintf(config->servers[srv].current_wal_lsn, MISC_LENGTH, "%s", cmd);
 
+      // decode the WAL of the timeline while it is received
+      pgmoneta_wal_tap_destroy(tap);
+      tap = NULL;
+      if (config->wal_tap && pgmoneta_wal_tap_create(srv, d, timeline, &tap))
+      {
+         pgmoneta_log_warn("Could not decode the WAL stream of server %s", config->servers[srv].name);
+         tap = NULL;
+      }
+
       type = 0;
 
       // wait for the CopyBothResponse message
@@ -342,6 +356,7 @@ pgmoneta_wal(int srv, char** argv)
                      goto error;
                   }
                   xlogptr = pgmoneta_read_int64(msg->data + 1);
+                  tapptr = xlogptr;
                   xlogoff = wal_xlog_offset(xlogptr, segsize);
 
                   if (wal_file == NULL)
@@ -356,6 +371,7 @@ pgmoneta_wal(int srv, char** argv)
                         // new wal file
                         segno = xlogptr / segsize;
                         curr_xlogoff = 0;
+                        wal_crc = 0;
                         filename = wal_file_name(timeline, segno, segsize);
                         if ((wal_file = wal_open(d, filename, segsize)) == NULL)
                         {
@@ -384,6 +400,7 @@ pgmoneta_wal(int srv, char** argv)
                         {
                            curr_xlogoff += bytes_left;
                            fwrite(remain_buffer, 1, bytes_left, wal_file);
+                           pgmoneta_create_crc32c_buffer(remain_buffer, bytes_left, &wal_crc);
                            if (sftp_wal_file != NULL)
                            {
                               sftp_write(sftp_wal_file, remain_buffer, bytes_left);
@@ -421,6 +438,7 @@ pgmoneta_wal(int srv, char** argv)
                         pgmoneta_log_error("Could not write %d bytes to WAL file %s", bytes_to_write, filename);
                         goto error;
                      }
+                     pgmoneta_create_crc32c_buffer(msg->data + hdrlen + bytes_written, bytes_to_write, &wal_crc);
                      if (sftp_wal_file != NULL)
                      {
                         sftp_write(sftp_wal_file, msg->data + hdrlen + bytes_written, bytes_to_write);
@@ -441,7 +459,11 @@ pgmoneta_wal(int srv, char** argv)
                      {
                         // the end of WAL segment
                         fflush(wal_file);
-                        wal_close(d, filename, false, wal_file);
+                        if (!wal_close(d, filename, false, wal_file) && config->wal_index)
+                        {
+                           /* The WAL segment that ends at this position */
+                           pgmoneta_wal_index_add(srv, timeline, (xlogptr - 1) / segsize, wal_crc);
+                        }
                         if (sftp_wal_file != NULL)
                         {
                            pgmoneta_sftp_wal_close(srv, filename, false, &sftp_wal_file);
@@ -475,7 +497,7 @@ pgmoneta_wal(int srv, char** argv)
                               remain_buffer_alloc_size = bytes_left;
                            }
                            memset(remain_buffer, 0, remain_buffer_alloc_size);
-                           memcpy(remain_buffer, msg->data + bytes_written, bytes_left);
+                           memcpy(remain_buffer, msg->data + hdrlen + bytes_written, bytes_left);
                         }
                         break;
                      }
@@ -483,6 +505,14 @@ pgmoneta_wal(int srv, char** argv)
                   // update LSN after a message data is written to the segment
                   update_wal_lsn(srv, xlogptr);
 
+                  // the archived WAL never depends on the decoding
+                  if (tap != NULL && pgmoneta_wal_tap_feed(tap, tapptr, msg->data + hdrlen, msg->length - hdrlen))
+                  {
+                     pgmoneta_log_warn("Stopped decoding the WAL stream of server %s", config->servers[srv].name);
+                     pgmoneta_wal_tap_destroy(tap);
+                     tap = NULL;
+                  }
+
                   wal_send_status_report(ssl, socket, xlogptr, xlogptr, 0);
                   break;
                }
@@ -553,6 +583,7 @@ pgmoneta_wal(int srv, char** argv)
    }
 
    config->servers[srv].wal_streaming = false;
+   pgmoneta_wal_tap_destroy(tap);
    pgmoneta_close_ssl(ssl);
    if (socket != -1)
    {
@@ -603,6 +634,7 @@ pgmoneta_wal(int srv, char** argv)
 
 error:
    config->servers[srv].wal_streaming = false;
+   pgmoneta_wal_tap_destroy(tap);
    pgmoneta_close_ssl(ssl);
    if (socket != -1)
    {
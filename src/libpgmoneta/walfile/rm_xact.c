@@ -408,6 +408,61 @@ xact_desc_subxacts(char* buf, int nsubxacts, transaction_id* subxacts)
    return buf;
 }
 
+int
+pgmoneta_wal_xact_dropped_relations(struct decoded_xlog_record* record, int* nrels, struct rel_file_node** xnodes)
+{
+   char* rec = XLOG_REC_GET_DATA(record);
+   uint8_t info = XLOG_REC_GET_INFO(record) & XLOG_XACT_OPMASK;
+
+   *nrels = 0;
+   *xnodes = NULL;
+
+   if (info == XLOG_XACT_COMMIT || info == XLOG_XACT_COMMIT_PREPARED)
+   {
+      struct xl_xact_commit* xlrec = (struct xl_xact_commit*) rec;
+
+      if (server_config->version >= 15)
+      {
+         struct xl_xact_parsed_commit_v15 parsed;
+         parse_commit_record_v15(XLOG_REC_GET_INFO(record), xlrec, &parsed);
+         *nrels = parsed.nrels;
+         *xnodes = parsed.xnodes;
+      }
+      else
+      {
+         struct xl_xact_parsed_commit_v14 parsed;
+         parse_commit_record_v14(XLOG_REC_GET_INFO(record), xlrec, &parsed);
+         *nrels = parsed.nrels;
+         *xnodes = parsed.xnodes;
+      }
+   }
+   else if (info == XLOG_XACT_ABORT || info == XLOG_XACT_ABORT_PREPARED)
+   {
+      struct xl_xact_abort* xlrec = (struct xl_xact_abort*) rec;
+
+      if (server_config->version >= 15)
+      {
+         struct xl_xact_parsed_abort_v15 parsed;
+         parse_abort_record_v15(XLOG_REC_GET_INFO(record), xlrec, &parsed);
+         *nrels = parsed.nrels;
+         *xnodes = parsed.xnodes;
+      }
+      else
+      {
+         struct xl_xact_parsed_abort_v14 parsed;
+         parse_abort_record_v14(XLOG_REC_GET_INFO(record), xlrec, &parsed);
+         *nrels = parsed.nrels;
+         *xnodes = parsed.xnodes;
+      }
+   }
+   else
+   {
+      return 1;
+   }
+
+   return 0;
+}
+
 char*
 pgmoneta_wal_xact_desc(char* buf, struct decoded_xlog_record* record)
 {
@@ -0,0 +1,926 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <art.h>
+#include <logging.h>
+#include <utils.h>
+#include <value.h>
+#include <wal.h>
+#include <walfile/wal_index.h>
+#include <walfile/wal_reader.h>
+#include <walfile/wal_verify.h>
+
+/* system */
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+static char* get_index_path(int server);
+static char* get_journal_path(int server);
+static int lock_journal(int server, int flags);
+static void segment_name(uint32_t timeline, xlog_seg_no segno, uint64_t segsize, char* name);
+static int read_index(int server, bool journal_only, int* number_of_entries, struct wal_index_entry** entries);
+static int write_index(char* path, int number_of_entries, struct wal_index_entry* entries, uint64_t segsize);
+static int get_path(int server, uint32_t timeline, int* number_of_timelines, uint32_t** timelines, uint64_t** begins);
+static uint32_t get_owner(xlog_seg_no segno, uint64_t segsize, int number_of_timelines, uint32_t* timelines, uint64_t* begins);
+static char* compression_name(int compression);
+static int compression_type(char* name);
+static int compare_entries(const void* a, const void* b);
+
+int
+pgmoneta_wal_index_add(int server, uint32_t timeline, xlog_seg_no segno, uint32_t checksum)
+{
+   char name[WAL_SEGMENT_NAME_SIZE + 1];
+   char line[MISC_LENGTH];
+   int fd = -1;
+   int length = 0;
+   char* path = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   path = get_journal_path(server);
+   segment_name(timeline, segno, config->servers[server].wal_size, &name[0]);
+
+   memset(&line[0], 0, sizeof(line));
+   length = snprintf(&line[0], sizeof(line), "%s %d none none %08X no\n", &name[0], config->servers[server].wal_size, checksum);
+
+   /* An update only holds the journal while it writes the index */
+   fd = lock_journal(server, O_WRONLY | O_APPEND);
+   if (fd == -1)
+   {
+      pgmoneta_log_error("WAL index: Could not lock %s", path);
+      goto error;
+   }
+
+   if (write(fd, &line[0], length) != length)
+   {
+      pgmoneta_log_error("WAL index: Could not write %s", path);
+      goto error;
+   }
+
+   close(fd);
+   free(path);
+
+   return 0;
+
+error:
+   if (fd != -1)
+   {
+      close(fd);
+   }
+   free(path);
+
+   return 1;
+}
+
+int
+pgmoneta_wal_index_update(int server, char* directory)
+{
+   char name[WAL_SEGMENT_NAME_SIZE + 1];
+   int number_of_files = 0;
+   int number_of_entries = 0;
+   int number_of_appended = 0;
+   int number_of_segments = 0;
+   int number_of_timelines = 0;
+   int fd = -1;
+   uint32_t timeline = 0;
+   uint32_t owner = 0;
+   uint32_t log = 0;
+   uint32_t seg = 0;
+   uint64_t segsize = 0;
+   uint64_t missing = 0;
+   bool found = false;
+   xlog_seg_no first = 0;
+   xlog_seg_no last = 0;
+   uintptr_t position = 0;
+   char* path = NULL;
+   char* file_path = NULL;
+   char* first_missing = NULL;
+   char** files = NULL;
+   uint32_t* timelines = NULL;
+   uint64_t* begins = NULL;
+   struct art* indexed = NULL;
+   struct art* archived = NULL;
+   struct art* verified = NULL;
+   struct wal_index_entry* entries = NULL;
+   struct wal_index_entry* appended = NULL;
+   struct wal_index_entry* segments = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   segsize = (uint64_t)config->servers[server].wal_size;
+   if (segsize == 0)
+   {
+      return 1;
+   }
+
+   path = get_index_path(server);
+
+   if (read_index(server, false, &number_of_entries, &entries))
+   {
+      pgmoneta_log_warn("WAL index: Could not read %s", path);
+   }
+
+   if (pgmoneta_art_create(&indexed) || pgmoneta_art_create(&archived))
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < number_of_entries; i++)
+   {
+      segment_name(entries[i].timeline, entries[i].segno, segsize, &name[0]);
+      pgmoneta_art_insert(indexed, (unsigned char*)&name[0], strlen(&name[0]) + 1, (uintptr_t)(i + 1), ValueInt32);
+   }
+
+   if (config->verify_wal && pgmoneta_wal_verify_read(server, &verified))
+   {
+      verified = NULL;
+   }
+
+   if (pgmoneta_get_wal_files(directory, &number_of_files, &files))
+   {
+      goto error;
+   }
+
+   if (number_of_files > 0)
+   {
+      segments = (struct wal_index_entry*)calloc(number_of_files, sizeof(struct wal_index_entry));
+      if (segments == NULL)
+      {
+         goto error;
+      }
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      struct wal_index_entry* segment = NULL;
+
+      /* A WAL segment that is still received isn't archived yet */
+      if (!pgmoneta_wal_is_segment(files[i]))
+      {
+         continue;
+      }
+
+      memset(&name[0], 0, sizeof(name));
+      memcpy(&name[0], files[i], WAL_SEGMENT_NAME_SIZE);
+
+      if (sscanf(&name[0], "%08X%08X%08X", &timeline, &log, &seg) != 3)
+      {
+         continue;
+      }
+
+      /* The compressed file replaces the WAL segment, and sorts after it */
+      if (number_of_segments > 0 && pgmoneta_art_contains_key(archived, (unsigned char*)&name[0], strlen(&name[0]) + 1))
+      {
+         segment = &segments[number_of_segments - 1];
+      }
+      else
+      {
+         segment = &segments[number_of_segments++];
+         pgmoneta_art_insert(archived, (unsigned char*)&name[0], strlen(&name[0]) + 1, (uintptr_t)number_of_segments, ValueInt32);
+      }
+
+      position = pgmoneta_art_search(indexed, (unsigned char*)&name[0], strlen(&name[0]) + 1);
+      if (position != 0)
+      {
+         memcpy(segment, &entries[position - 1], sizeof(struct wal_index_entry));
+      }
+      else
+      {
+         memset(segment, 0, sizeof(struct wal_index_entry));
+      }
+
+      segment->timeline = timeline;
+      segment->segno = (uint64_t)log * (0x100000000ULL / segsize) + seg;
+
+      file_path = pgmoneta_append(file_path, directory);
+      if (!pgmoneta_ends_with(directory, "/"))
+      {
+         file_path = pgmoneta_append_char(file_path, '/');
+      }
+      file_path = pgmoneta_append(file_path, files[i]);
+
+      segment->size = (uint64_t)pgmoneta_get_file_size(file_path);
+      segment->compression = compression_type(files[i] + WAL_SEGMENT_NAME_SIZE);
+      segment->encrypted = pgmoneta_ends_with(files[i], ".aes");
+      segment->verified = verified != NULL &&
+                          (bool)pgmoneta_art_search(verified, (unsigned char*)&name[0], strlen(&name[0]) + 1);
+
+      free(file_path);
+      file_path = NULL;
+   }
+
+   /* The WAL receiver waits while the journal is merged into the index */
+   fd = lock_journal(server, O_RDWR);
+   if (fd == -1)
+   {
+      pgmoneta_log_error("WAL index: Could not lock the journal of %s", config->servers[server].name);
+      goto error;
+   }
+
+   /* The lines that the WAL receiver appended since the index was read are kept */
+   if (read_index(server, true, &number_of_appended, &appended))
+   {
+      pgmoneta_log_error("WAL index: Could not read the journal of %s", config->servers[server].name);
+      goto error;
+   }
+
+   if (number_of_appended > 0)
+   {
+      struct wal_index_entry* tmp = NULL;
+
+      tmp = (struct wal_index_entry*)realloc(segments, (number_of_segments + number_of_appended) * sizeof(struct wal_index_entry));
+      if (tmp == NULL)
+      {
+         goto error;
+      }
+      segments = tmp;
+   }
+
+   for (int i = 0; i < number_of_appended; i++)
+   {
+      segment_name(appended[i].timeline, appended[i].segno, segsize, &name[0]);
+
+      position = pgmoneta_art_search(archived, (unsigned char*)&name[0], strlen(&name[0]) + 1);
+      if (position != 0)
+      {
+         if (appended[i].has_checksum)
+         {
+            segments[position - 1].has_checksum = true;
+            segments[position - 1].checksum = appended[i].checksum;
+         }
+      }
+      else if (!pgmoneta_art_contains_key(indexed, (unsigned char*)&name[0], strlen(&name[0]) + 1))
+      {
+         memcpy(&segments[number_of_segments++], &appended[i], sizeof(struct wal_index_entry));
+      }
+   }
+
+   if (write_index(path, number_of_segments, segments, segsize))
+   {
+      pgmoneta_log_error("WAL index: Could not write %s", path);
+      goto error;
+   }
+
+   /* Every line of the journal is in the index now */
+   if (ftruncate(fd, 0))
+   {
+      pgmoneta_log_warn("WAL index: Could not truncate the journal of %s", config->servers[server].name);
+   }
+
+   close(fd);
+   fd = -1;
+
+   /* The gaps on the timeline path of the server */
+   timeline = config->servers[server].cur_timeline;
+   for (int i = 0; timeline == 0 && i < number_of_segments; i++)
+   {
+      timeline = MAX(timeline, segments[i].timeline);
+   }
+
+   if (number_of_segments > 0 && !get_path(server, timeline, &number_of_timelines, &timelines, &begins))
+   {
+      for (int i = 0; i < number_of_segments; i++)
+      {
+         if (get_owner(segments[i].segno, segsize, number_of_timelines, timelines, begins) == segments[i].timeline)
+         {
+            first = found ? MIN(first, segments[i].segno) : segments[i].segno;
+            last = found ? MAX(last, segments[i].segno) : segments[i].segno;
+            found = true;
+         }
+      }
+
+      for (xlog_seg_no segno = first; found && segno <= last; segno++)
+      {
+         owner = get_owner(segno, segsize, number_of_timelines, timelines, begins);
+         segment_name(owner, segno, segsize, &name[0]);
+
+         if (!pgmoneta_art_contains_key(archived, (unsigned char*)&name[0], strlen(&name[0]) + 1))
+         {
+            if (missing == 0)
+            {
+               first_missing = pgmoneta_append(first_missing, &name[0]);
+            }
+            missing++;
+         }
+      }
+   }
+
+   if (missing > 0 && missing != atomic_load(&config->servers[server].wal_missing_segments))
+   {
+      pgmoneta_log_error("WAL index: %s is missing %" PRIu64 " WAL segments from %s", config->servers[server].name, missing, first_missing);
+   }
+
+   atomic_store(&config->servers[server].wal_missing_segments, missing);
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+
+   free(first_missing);
+   free(timelines);
+   free(begins);
+   free(segments);
+   free(entries);
+   free(appended);
+   pgmoneta_art_destroy(indexed);
+   pgmoneta_art_destroy(archived);
+   pgmoneta_art_destroy(verified);
+   free(path);
+
+   return 0;
+
+error:
+   if (fd != -1)
+   {
+      close(fd);
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+
+   free(file_path);
+   free(first_missing);
+   free(timelines);
+   free(begins);
+   free(segments);
+   free(entries);
+   free(appended);
+   pgmoneta_art_destroy(indexed);
+   pgmoneta_art_destroy(archived);
+   pgmoneta_art_destroy(verified);
+   free(path);
+
+   return 1;
+}
+
+int
+pgmoneta_wal_index_read(int server, int* number_of_entries, struct wal_index_entry** entries)
+{
+   return read_index(server, false, number_of_entries, entries);
+}
+
+int
+pgmoneta_wal_index_restorable(int server, uint32_t timeline, xlog_rec_ptr start, xlog_rec_ptr end, bool* restorable, char** missing)
+{
+   char name[WAL_SEGMENT_NAME_SIZE + 1];
+   int number_of_entries = 0;
+   int number_of_timelines = 0;
+   uint32_t owner = 0;
+   uint64_t segsize = 0;
+   bool found = false;
+   xlog_seg_no first = 0;
+   xlog_seg_no last = 0;
+   uint32_t* timelines = NULL;
+   uint64_t* begins = NULL;
+   struct art* indexed = NULL;
+   struct wal_index_entry* entries = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *restorable = false;
+   *missing = NULL;
+
+   segsize = (uint64_t)config->servers[server].wal_size;
+   if (segsize == 0 || end < start)
+   {
+      goto error;
+   }
+
+   if (read_index(server, false, &number_of_entries, &entries))
+   {
+      goto error;
+   }
+
+   if (get_path(server, timeline, &number_of_timelines, &timelines, &begins))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_art_create(&indexed))
+   {
+      goto error;
+   }
+
+   first = start / segsize;
+
+   for (int i = 0; i < number_of_entries; i++)
+   {
+      segment_name(entries[i].timeline, entries[i].segno, segsize, &name[0]);
+      pgmoneta_art_insert(indexed, (unsigned char*)&name[0], strlen(&name[0]) + 1, (uintptr_t)true, ValueBool);
+
+      if (end == UINT64_MAX && entries[i].segno >= first &&
+          get_owner(entries[i].segno, segsize, number_of_timelines, timelines, begins) == entries[i].timeline)
+      {
+         last = found ? MAX(last, entries[i].segno) : entries[i].segno;
+         found = true;
+      }
+   }
+
+   if (end != UINT64_MAX)
+   {
+      /* Recovery reads the record after the end, which may start in the next WAL segment */
+      last = end / segsize + 1;
+      found = true;
+   }
+
+   if (!found)
+   {
+      /* Not even the first WAL segment is archived */
+      last = first;
+   }
+
+   *restorable = true;
+
+   for (xlog_seg_no segno = first; segno <= last; segno++)
+   {
+      owner = get_owner(segno, segsize, number_of_timelines, timelines, begins);
+      segment_name(owner, segno, segsize, &name[0]);
+
+      if (!pgmoneta_art_contains_key(indexed, (unsigned char*)&name[0], strlen(&name[0]) + 1))
+      {
+         *restorable = false;
+         *missing = pgmoneta_append(*missing, &name[0]);
+         break;
+      }
+   }
+
+   free(timelines);
+   free(begins);
+   free(entries);
+   pgmoneta_art_destroy(indexed);
+
+   return 0;
+
+error:
+   free(timelines);
+   free(begins);
+   free(entries);
+   pgmoneta_art_destroy(indexed);
+
+   return 1;
+}
+
+static char*
+get_index_path(int server)
+{
+   char* path = NULL;
+
+   path = pgmoneta_get_server(server);
+   path = pgmoneta_append(path, "wal_index");
+
+   return path;
+}
+
+static char*
+get_journal_path(int server)
+{
+   char* path = NULL;
+
+   path = pgmoneta_get_server(server);
+   path = pgmoneta_append(path, "wal_index.journal");
+
+   return path;
+}
+
+static int
+lock_journal(int server, int flags)
+{
+   int fd = -1;
+   char* path = NULL;
+
+   path = get_journal_path(server);
+
+   fd = open(path, flags | O_CREAT, 0600);
+   if (fd == -1)
+   {
+      goto error;
+   }
+
+   /* The lock is released by the kernel when the descriptor is closed */
+   if (flock(fd, LOCK_EX) == -1)
+   {
+      goto error;
+   }
+
+   free(path);
+
+   return fd;
+
+error:
+   if (fd != -1)
+   {
+      close(fd);
+   }
+
+   free(path);
+
+   return -1;
+}
+
+static void
+segment_name(uint32_t timeline, xlog_seg_no segno, uint64_t segsize, char* name)
+{
+   uint64_t segments_per_id = 0x100000000ULL / segsize;
+
+   snprintf(name, WAL_SEGMENT_NAME_SIZE + 1, "%08X%08X%08X", timeline,
+            (uint32_t)(segno / segments_per_id), (uint32_t)(segno % segments_per_id));
+}
+
+static int
+read_index(int server, bool journal_only, int* number_of_entries, struct wal_index_entry** entries)
+{
+   char line[MISC_LENGTH];
+   char name[MISC_LENGTH];
+   char compression[MISC_LENGTH];
+   char encryption[MISC_LENGTH];
+   char checksum[MISC_LENGTH];
+   char verified[MISC_LENGTH];
+   int number = 0;
+   int size = 0;
+   uint32_t timeline = 0;
+   uint32_t log = 0;
+   uint32_t seg = 0;
+   uint64_t segsize = 0;
+   uint64_t stored = 0;
+   uintptr_t position = 0;
+   char* paths[2];
+   FILE* file = NULL;
+   struct art* indexed = NULL;
+   struct wal_index_entry* e = NULL;
+   struct wal_index_entry entry;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *number_of_entries = 0;
+   *entries = NULL;
+
+   segsize = (uint64_t)config->servers[server].wal_size;
+
+   /* The lines of the journal are newer than the index */
+   paths[0] = journal_only ? NULL : get_index_path(server);
+   paths[1] = get_journal_path(server);
+
+   if (segsize == 0)
+   {
+      goto error;
+   }
+
+   if (pgmoneta_art_create(&indexed))
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < 2; i++)
+   {
+      if (paths[i] == NULL || !pgmoneta_exists(paths[i]))
+      {
+         continue;
+      }
+
+      file = fopen(paths[i], "r");
+      if (file == NULL)
+      {
+         goto error;
+      }
+
+      memset(&line[0], 0, sizeof(line));
+      while (fgets(&line[0], sizeof(line), file) != NULL)
+      {
+         memset(&entry, 0, sizeof(struct wal_index_entry));
+
+         /* A line that is being appended is incomplete */
+         if (sscanf(&line[0], "%127s %" SCNu64 " %127s %127s %127s %127s",
+                    &name[0], &stored, &compression[0], &encryption[0], &checksum[0], &verified[0]) != 6 ||
+             !pgmoneta_wal_is_segment(&name[0]) || strlen(&name[0]) != WAL_SEGMENT_NAME_SIZE ||
+             sscanf(&name[0], "%08X%08X%08X", &timeline, &log, &seg) != 3)
+         {
+            memset(&line[0], 0, sizeof(line));
+            continue;
+         }
+
+         entry.timeline = timeline;
+         entry.segno = (uint64_t)log * (0x100000000ULL / segsize) + seg;
+         entry.size = stored;
+         entry.compression = compression_type(&compression[0]);
+         entry.encrypted = !strcmp(&encryption[0], "aes");
+         entry.has_checksum = sscanf(&checksum[0], "%08X", &entry.checksum) == 1;
+         entry.verified = !strcmp(&verified[0], "yes");
+
+         /* The latest line of a WAL segment counts */
+         position = pgmoneta_art_search(indexed, (unsigned char*)&name[0], strlen(&name[0]) + 1);
+         if (position != 0)
+         {
+            if (!entry.has_checksum && e[position - 1].has_checksum)
+            {
+               entry.has_checksum = true;
+               entry.checksum = e[position - 1].checksum;
+            }
+
+            memcpy(&e[position - 1], &entry, sizeof(struct wal_index_entry));
+         }
+         else
+         {
+            if (number == size)
+            {
+               struct wal_index_entry* tmp = NULL;
+
+               size = size == 0 ? 1024 : size * 2;
+               tmp = (struct wal_index_entry*)realloc(e, size * sizeof(struct wal_index_entry));
+               if (tmp == NULL)
+               {
+                  goto error;
+               }
+               e = tmp;
+            }
+
+            memcpy(&e[number], &entry, sizeof(struct wal_index_entry));
+            number++;
+
+            pgmoneta_art_insert(indexed, (unsigned char*)&name[0], strlen(&name[0]) + 1, (uintptr_t)number, ValueInt32);
+         }
+
+         memset(&line[0], 0, sizeof(line));
+      }
+
+      fclose(file);
+      file = NULL;
+   }
+
+   if (number > 0)
+   {
+      qsort(e, number, sizeof(struct wal_index_entry), compare_entries);
+   }
+
+   *number_of_entries = number;
+   *entries = e;
+
+   pgmoneta_art_destroy(indexed);
+   free(paths[0]);
+   free(paths[1]);
+
+   return 0;
+
+error:
+   if (file != NULL)
+   {
+      fclose(file);
+   }
+
+   free(e);
+   pgmoneta_art_destroy(indexed);
+   free(paths[0]);
+   free(paths[1]);
+
+   return 1;
+}
+
+static int
+write_index(char* path, int number_of_entries, struct wal_index_entry* entries, uint64_t segsize)
+{
+   char name[WAL_SEGMENT_NAME_SIZE + 1];
+   char checksum[9];
+   char* tmp = NULL;
+   FILE* file = NULL;
+
+   qsort(entries, number_of_entries, sizeof(struct wal_index_entry), compare_entries);
+
+   tmp = pgmoneta_append(tmp, path);
+   tmp = pgmoneta_append(tmp, ".tmp");
+
+   file = fopen(tmp, "w");
+   if (file == NULL)
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < number_of_entries; i++)
+   {
+      segment_name(entries[i].timeline, entries[i].segno, segsize, &name[0]);
+
+      memset(&checksum[0], 0, sizeof(checksum));
+      if (entries[i].has_checksum)
+      {
+         snprintf(&checksum[0], sizeof(checksum), "%08X", entries[i].checksum);
+      }
+      else
+      {
+         checksum[0] = '-';
+      }
+
+      fprintf(file, "%s %" PRIu64 " %s %s %s %s\n", &name[0], entries[i].size,
+              compression_name(entries[i].compression), entries[i].encrypted ? "aes" : "none",
+              &checksum[0], entries[i].verified ? "yes" : "no");
+   }
+
+   fflush(file);
+   fclose(file);
+   file = NULL;
+
+   /* The index is read while it is written */
+   if (rename(tmp, path))
+   {
+      goto error;
+   }
+
+   free(tmp);
+
+   return 0;
+
+error:
+   if (file != NULL)
+   {
+      fclose(file);
+   }
+
+   if (tmp != NULL)
+   {
+      remove(tmp);
+   }
+   free(tmp);
+
+   return 1;
+}
+
+static int
+get_path(int server, uint32_t timeline, int* number_of_timelines, uint32_t** timelines, uint64_t** begins)
+{
+   int number = 1;
+   uint32_t* t = NULL;
+   uint64_t* b = NULL;
+   struct timeline_history* history = NULL;
+
+   *number_of_timelines = 0;
+   *timelines = NULL;
+   *begins = NULL;
+
+   if (pgmoneta_get_timeline_history(server, timeline, &history))
+   {
+      goto error;
+   }
+
+   for (struct timeline_history* h = history; h != NULL; h = h->next)
+   {
+      number++;
+   }
+
+   t = (uint32_t*)malloc(number * sizeof(uint32_t));
+   b = (uint64_t*)malloc(number * sizeof(uint64_t));
+
+   if (t == NULL || b == NULL)
+   {
+      goto error;
+   }
+
+   /* Every history entry ends its parent timeline at the switch position */
+   number = 0;
+   for (struct timeline_history* h = history; h != NULL; h = h->next)
+   {
+      t[number] = h->parent_tli;
+      b[number] = number == 0 ? 0 : b[number];
+      number++;
+      b[number] = ((uint64_t)h->switchpos_hi << 32) + h->switchpos_lo;
+   }
+
+   t[number] = timeline;
+   if (number == 0)
+   {
+      b[number] = 0;
+   }
+   number++;
+
+   pgmoneta_free_timeline_history(history);
+
+   *number_of_timelines = number;
+   *timelines = t;
+   *begins = b;
+
+   return 0;
+
+error:
+   pgmoneta_free_timeline_history(history);
+   free(t);
+   free(b);
+
+   return 1;
+}
+
+static uint32_t
+get_owner(xlog_seg_no segno, uint64_t segsize, int number_of_timelines, uint32_t* timelines, uint64_t* begins)
+{
+   uint32_t owner = timelines[0];
+
+   /* A WAL segment with a switch position is archived on the new timeline */
+   for (int i = 1; i < number_of_timelines; i++)
+   {
+      if (begins[i] < (segno + 1) * segsize)
+      {
+         owner = timelines[i];
+      }
+   }
+
+   return owner;
+}
+
+static char*
+compression_name(int compression)
+{
+   switch (compression)
+   {
+      case COMPRESSION_CLIENT_GZIP:
+         return "gzip";
+      case COMPRESSION_CLIENT_ZSTD:
+         return "zstd";
+      case COMPRESSION_CLIENT_LZ4:
+         return "lz4";
+      case COMPRESSION_CLIENT_BZIP2:
+         return "bzip2";
+      default:
+         return "none";
+   }
+}
+
+static int
+compression_type(char* name)
+{
+   /* Either the name in the index or the suffix of the file */
+   if (!strcmp(name, "gzip") || strstr(name, ".gz") != NULL)
+   {
+      return COMPRESSION_CLIENT_GZIP;
+   }
+   else if (!strcmp(name, "zstd") || strstr(name, ".zstd") != NULL)
+   {
+      return COMPRESSION_CLIENT_ZSTD;
+   }
+   else if (!strcmp(name, "lz4") || strstr(name, ".lz4") != NULL)
+   {
+      return COMPRESSION_CLIENT_LZ4;
+   }
+   else if (!strcmp(name, "bzip2") || strstr(name, ".bz2") != NULL)
+   {
+      return COMPRESSION_CLIENT_BZIP2;
+   }
+
+   return COMPRESSION_NONE;
+}
+
+static int
+compare_entries(const void* a, const void* b)
+{
+   const struct wal_index_entry* ea = (const struct wal_index_entry*)a;
+   const struct wal_index_entry* eb = (const struct wal_index_entry*)b;
+
+   if (ea->timeline != eb->timeline)
+   {
+      return ea->timeline < eb->timeline ? -1 : 1;
+   }
+
+   if (ea->segno != eb->segno)
+   {
+      return ea->segno < eb->segno ? -1 : 1;
+   }
+
+   return 0;
+}
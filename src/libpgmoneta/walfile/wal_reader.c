@@ -27,16 +27,38 @@
  */
 
 #include <logging.h>
+#include <security.h>
+#include <stream.h>
 #include <utils.h>
 #include <walfile/rmgr.h>
 #include <walfile/wal_reader.h>
 #include <walfile.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 struct server* server_config;
 
+static int decode_xlog_record(char* buffer, struct decoded_xlog_record* decoded, struct xlog_record* record, uint32_t block_size, struct server* server_info,
+                              struct wal_iterator* iterator);
+static int wal_iterator_map(struct wal_iterator* iterator, char* path, size_t limit);
+static int wal_iterator_read(struct wal_iterator* iterator, char* path, size_t limit);
+static void wal_iterator_release(struct wal_iterator* iterator);
+static int wal_iterator_init(struct wal_iterator* iterator, char* data, size_t size);
+static int wal_iterator_follow(struct wal_iterator* iterator, uint32_t remaining);
+static bool wal_iterator_valid_page_header(struct wal_iterator* iterator, struct xlog_page_header_data* page_header);
+static bool wal_iterator_skip_page_header(struct wal_iterator* iterator);
+static bool wal_iterator_valid_crc(char* record, uint32_t total_length);
+static int wal_iterator_decode(struct wal_iterator* iterator, char* record, uint32_t total_length, xlog_rec_ptr lsn, xlog_rec_ptr next_lsn);
+static char* wal_iterator_align(struct wal_iterator* iterator, char* ptr, size_t length, size_t* used);
+static int copy_decoded_record(struct decoded_xlog_record* record, struct decoded_xlog_record** copy);
+static void free_decoded_record(struct decoded_xlog_record* record);
+
 void
 print_short_page_header(struct xlog_page_header_data* header)
 {
@@ -120,191 +142,756 @@ pgmoneta_wal_array_desc(char* buf, void* array,
    return buf;
 }
 
-void
-read_all_page_headers(FILE* file, struct xlog_long_page_header_data* long_header, struct walfile* wal_file)
+int
+pgmoneta_wal_parse_wal_file(char* path, struct server* server_info, struct walfile* wal_file)
 {
-   int page_number = 1;
-   while (true)
+   struct wal_iterator* iterator = NULL;
+   struct xlog_long_page_header_data* long_header = NULL;
+   struct xlog_page_header_data* page_header = NULL;
+   struct decoded_xlog_record* decoded = NULL;
+   int count = 0;
+
+   if (pgmoneta_wal_iterator_create(path, server_info, &iterator))
    {
-      fseek(file, page_number * long_header->xlp_xlog_blcksz, SEEK_SET);
-      struct xlog_page_header_data* page_header = NULL;
+      goto error;
+   }
+
+   long_header = malloc(SIZE_OF_XLOG_LONG_PHD);
+   if (long_header == NULL)
+   {
+      goto error;
+   }
+
+   memcpy(long_header, iterator->data, SIZE_OF_XLOG_LONG_PHD);
+   wal_file->long_phd = long_header;
+
+   for (size_t offset = iterator->block_size; offset < iterator->size; offset += iterator->block_size)
+   {
+      if (((struct xlog_page_header_data*)(iterator->data + offset))->xlp_magic == 0)
+      {
+         break;
+      }
+
       page_header = malloc(SIZE_OF_XLOG_SHORT_PHD);
-      size_t bytes_read = fread(page_header, SIZE_OF_XLOG_SHORT_PHD, 1, file);
-      if (bytes_read < 0)
+      if (page_header == NULL)
+      {
+         goto error;
+      }
+
+      memcpy(page_header, iterator->data + offset, SIZE_OF_XLOG_SHORT_PHD);
+
+      if (pgmoneta_deque_add(wal_file->page_headers, NULL, (uintptr_t) page_header, ValueRef))
+      {
+         goto error;
+      }
+      page_header = NULL;
+   }
+
+   while (pgmoneta_wal_iterator_next(iterator))
+   {
+      if (copy_decoded_record(iterator->record, &decoded))
       {
-         pgmoneta_log_error("Error: Failed to read the complete data");
          goto error;
       }
-      if (page_header->xlp_magic == 0)
+
+      pgmoneta_wal_display_decoded_record(decoded, ++count, server_info);
+
+      if (pgmoneta_deque_add(wal_file->records, NULL, (uintptr_t) decoded, ValueRef))
       {
-         free(page_header);
-         return;
+         goto error;
       }
-      pgmoneta_deque_add(wal_file->page_headers, NULL, (uintptr_t) page_header, ValueRef);
-      page_number++;
+      decoded = NULL;
+   }
+
+   if (iterator->error)
+   {
+      goto error;
    }
-   return;
+
+   pgmoneta_wal_iterator_destroy(iterator);
+
+   return 0;
+
 error:
-   pgmoneta_log_fatal("Error: Could not read all page headers\n");
-   return;
+   pgmoneta_log_error("Could not parse WAL file %s", path);
+
+   free(page_header);
+   free_decoded_record(decoded);
+   pgmoneta_wal_iterator_destroy(iterator);
+
+   return 1;
 }
 
 int
-pgmoneta_wal_parse_wal_file(char* path, struct server* server_info, struct walfile* wal_file)
+pgmoneta_wal_iterator_create(char* path, struct server* server_info, struct wal_iterator** iterator)
 {
-#define MALLOC(pointer, size) \
-        pointer = malloc(size); \
-        if (pointer == NULL) \
-        { \
-           pgmoneta_log_fatal("Error: Could not allocate memory for %s\n", #pointer); \
-           goto error; \
-        }
+   struct wal_iterator* iter = NULL;
 
-   struct xlog_record* record = NULL;
-   struct xlog_long_page_header_data* long_header = NULL;
-   char* buffer = NULL;
-   struct decoded_xlog_record* decoded = NULL;
-   struct xlog_page_header_data* page_header = NULL;
-   int count = 0;
-   server_config = server_info;
+   *iterator = NULL;
 
-   FILE* file = fopen(path, "rb");
-   if (file == NULL)
+   iter = calloc(1, sizeof(struct wal_iterator));
+   if (iter == NULL)
    {
-      pgmoneta_log_fatal("Error: Could not open file %s\n", path);
+      goto error;
    }
 
-   MALLOC(long_header, SIZE_OF_XLOG_LONG_PHD);
-   size_t bytes_read = fread(long_header, SIZE_OF_XLOG_LONG_PHD, 1, file);
+   iter->server_info = server_info;
 
-   if (bytes_read < 0)
+   if (wal_iterator_map(iter, path, 0))
    {
-      pgmoneta_log_error("Error: Failed to read the complete data");
       goto error;
    }
 
-   uint32_t next_record = ftell(file);
-   int page_number = 0;
-   wal_file->long_phd = long_header;
+   *iterator = iter;
+
+   return 0;
+
+error:
+   free(iter);
+
+   return 1;
+}
+
+int
+pgmoneta_wal_iterator_create_stream(uint32_t block_size, struct server* server_info, struct wal_iterator** iterator)
+{
+   struct wal_iterator* iter = NULL;
+
+   *iterator = NULL;
+
+   iter = calloc(1, sizeof(struct wal_iterator));
+   if (iter == NULL)
+   {
+      return 1;
+   }
+
+   iter->server_info = server_info;
+   iter->block_size = block_size;
+
+   *iterator = iter;
+
+   return 0;
+}
+
+int
+pgmoneta_wal_iterator_decode(struct wal_iterator* iterator, char* record, xlog_rec_ptr lsn, xlog_rec_ptr next_lsn)
+{
+   uint32_t total_length = 0;
+
+   iterator->record = NULL;
+
+   memcpy(&total_length, record, sizeof(uint32_t));
+
+   if (total_length < SIZE_OF_XLOG_RECORD)
+   {
+      pgmoneta_log_error("Invalid record length %u at %X/%X", total_length, LSN_FORMAT_ARGS(lsn));
+      return 1;
+   }
+
+   return wal_iterator_decode(iterator, record, total_length, lsn, next_lsn);
+}
+
+bool
+pgmoneta_wal_iterator_next(struct wal_iterator* iterator)
+{
+   uint32_t total_length = 0;
+   uint32_t copied = 0;
+   size_t start = 0;
+   size_t page_end = 0;
+   size_t length = 0;
+   size_t header_size = 0;
+   xlog_rec_ptr lsn = 0;
+   char* record = NULL;
+   struct xlog_page_header_data* page_header = NULL;
 
-   read_all_page_headers(file, long_header, wal_file);
-   fseek(file, next_record, SEEK_SET);
+   iterator->record = NULL;
 
-   while (true)
+   /* The records of the next WAL segment belong to its own iterator */
+   if (iterator->error || iterator->followed || !wal_iterator_skip_page_header(iterator))
    {
-      // Check if next record is beyond the current page
-      if (next_record >= (long_header->xlp_xlog_blcksz * (page_number + 1)))
+      return false;
+   }
+
+   if (iterator->position >= iterator->size)
+   {
+      return false;
+   }
+
+   /* Records are aligned, so the length is always on the page */
+   memcpy(&total_length, iterator->data + iterator->position, sizeof(uint32_t));
+
+   if (total_length == 0)
+   {
+      /* End of WAL */
+      return false;
+   }
+
+   if (total_length < SIZE_OF_XLOG_RECORD)
+   {
+      pgmoneta_log_error("Invalid record length %u at %X/%X", total_length,
+                         LSN_FORMAT_ARGS(iterator->segment_start + iterator->position));
+      goto error;
+   }
+
+   start = iterator->position;
+   lsn = iterator->segment_start + start;
+   page_end = (iterator->position / iterator->block_size + 1) * iterator->block_size;
+
+   if (iterator->position + total_length <= page_end)
+   {
+      record = iterator->data + iterator->position;
+      iterator->position += total_length;
+   }
+   else
+   {
+      if (iterator->scratch_size < total_length)
       {
-         page_number++;
-         fseek(file, page_number * long_header->xlp_xlog_blcksz, SEEK_SET);
-         MALLOC(page_header, SIZE_OF_XLOG_SHORT_PHD);
-         size_t bytes_read = fread(page_header, SIZE_OF_XLOG_SHORT_PHD, 1, file);
-         if (bytes_read < 0)
+         char* scratch = realloc(iterator->scratch, total_length);
+
+         if (scratch == NULL)
          {
-            pgmoneta_log_error("Error: Failed to read the complete data");
             goto error;
          }
-         next_record = MAXALIGN(ftell(file) + page_header->xlp_rem_len);
-         free(page_header);
-         continue;
+
+         iterator->scratch = scratch;
+         iterator->scratch_size = total_length;
       }
-      fseek(file, next_record, SEEK_SET);
 
-      // Check if record crosses the page boundary
-      if (ftell(file) + SIZE_OF_XLOG_RECORD > long_header->xlp_xlog_blcksz * (page_number + 1))
+      copied = page_end - iterator->position;
+      memcpy(iterator->scratch, iterator->data + iterator->position, copied);
+      iterator->position = page_end;
+
+      while (copied < total_length)
       {
-         char* temp_buffer = NULL;
-         MALLOC(temp_buffer, SIZE_OF_XLOG_RECORD)
-         uint32_t end_of_page = (page_number + 1) * long_header->xlp_xlog_blcksz;
-         size_t bytes_read = fread(temp_buffer, 1, end_of_page - ftell(file), file);
+         if (iterator->position >= iterator->size)
+         {
+            /* The record continues in the next WAL segment */
+            if (iterator->follow == NULL || iterator->followed)
+            {
+               iterator->incomplete = true;
+               return false;
+            }
 
-         fseek(file, SIZE_OF_XLOG_SHORT_PHD, SEEK_CUR);
-         bytes_read += fread(temp_buffer + bytes_read, 1, SIZE_OF_XLOG_RECORD - bytes_read, file);
+            if (wal_iterator_follow(iterator, total_length - copied))
+            {
+               goto error;
+            }
 
-         assert(bytes_read == SIZE_OF_XLOG_RECORD);
-         record = (struct xlog_record*) temp_buffer;
-         page_number++;
-      }
-      else
-      {
-         MALLOC(record, SIZE_OF_XLOG_RECORD)
-         size_t bytes_read = fread(record, SIZE_OF_XLOG_RECORD, 1, file);
-         if (bytes_read < 0)
+            if (iterator->followed == false)
+            {
+               iterator->incomplete = true;
+               return false;
+            }
+         }
+
+         page_header = (struct xlog_page_header_data*)(iterator->data + iterator->position);
+
+         if (!wal_iterator_valid_page_header(iterator, page_header))
+         {
+            return false;
+         }
+
+         if (!(page_header->xlp_info & XLP_FIRST_IS_CONTRECORD) || page_header->xlp_rem_len != total_length - copied)
          {
-            pgmoneta_log_error("Error: Failed to read the complete data");
+            pgmoneta_log_error("Invalid continuation record at %X/%X",
+                               LSN_FORMAT_ARGS(iterator->segment_start + iterator->position));
             goto error;
          }
+
+         header_size = iterator->position == 0 ? SIZE_OF_XLOG_LONG_PHD : SIZE_OF_XLOG_SHORT_PHD;
+         iterator->position += header_size;
+
+         length = MIN(total_length - copied, iterator->block_size - header_size);
+         memcpy(iterator->scratch + copied, iterator->data + iterator->position, length);
+         copied += length;
+         iterator->position += length;
       }
 
-      if (record->xl_tot_len == 0)
+      record = iterator->scratch;
+   }
+
+   iterator->position = MAXALIGN(iterator->position);
+
+   if (wal_iterator_decode(iterator, record, total_length, lsn, iterator->segment_start + iterator->position))
+   {
+      goto error;
+   }
+
+   return true;
+
+error:
+   iterator->error = true;
+
+   return false;
+}
+
+void
+pgmoneta_wal_iterator_destroy(struct wal_iterator* iterator)
+{
+   if (iterator == NULL)
+   {
+      return;
+   }
+
+   wal_iterator_release(iterator);
+
+   free(iterator->scratch);
+   free(iterator->aligned);
+   free(iterator);
+}
+
+static int
+wal_iterator_map(struct wal_iterator* iterator, char* path, size_t limit)
+{
+   int fd = -1;
+   struct stat st;
+   void* data = MAP_FAILED;
+
+   /* A compressed or encrypted WAL segment can't be mapped */
+   if (pgmoneta_is_file_archive(path))
+   {
+      return wal_iterator_read(iterator, path, limit);
+   }
+
+   fd = open(path, O_RDONLY);
+   if (fd == -1)
+   {
+      pgmoneta_log_error("Could not open WAL file %s: %s", path, strerror(errno));
+      goto error;
+   }
+
+   if (fstat(fd, &st) || st.st_size < (off_t)SIZE_OF_XLOG_LONG_PHD)
+   {
+      pgmoneta_log_error("Invalid WAL file %s", path);
+      goto error;
+   }
+
+   data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (data == MAP_FAILED)
+   {
+      pgmoneta_log_error("Could not map WAL file %s: %s", path, strerror(errno));
+      goto error;
+   }
+
+   close(fd);
+   fd = -1;
+
+   madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+   if (wal_iterator_init(iterator, data, st.st_size))
+   {
+      pgmoneta_log_error("Invalid WAL file header in %s", path);
+      goto error;
+   }
+
+   iterator->mapped_size = st.st_size;
+
+   return 0;
+
+error:
+   if (data != MAP_FAILED)
+   {
+      munmap(data, st.st_size);
+   }
+
+   if (fd != -1)
+   {
+      close(fd);
+   }
+
+   return 1;
+}
+
+static int
+wal_iterator_read(struct wal_iterator* iterator, char* path, size_t limit)
+{
+   size_t length = 0;
+   size_t size = 0;
+   size_t total = 0;
+   char* data = NULL;
+   struct xlog_long_page_header_data long_header;
+   struct stream_reader* reader = NULL;
+
+   if (pgmoneta_stream_reader_init(path, &reader))
+   {
+      pgmoneta_log_error("Could not open WAL file %s", path);
+      goto error;
+   }
+
+   /* The long page header has the size of the WAL segment */
+   while (total < SIZE_OF_XLOG_LONG_PHD)
+   {
+      if (pgmoneta_stream_reader_read(reader, (char*)&long_header + total, SIZE_OF_XLOG_LONG_PHD - total, &length))
+      {
+         pgmoneta_log_error("Could not read WAL file %s", path);
+         goto error;
+      }
+
+      if (length == 0)
+      {
+         pgmoneta_log_error("Invalid WAL file %s", path);
+         goto error;
+      }
+
+      total += length;
+   }
+
+   size = long_header.xlp_seg_size;
+
+   if (size < SIZE_OF_XLOG_LONG_PHD || size > WAL_SEGMENT_MAX_SIZE)
+   {
+      pgmoneta_log_error("Invalid WAL file header in %s", path);
+      goto error;
+   }
+
+   if (limit > 0 && limit < size)
+   {
+      size = limit;
+   }
+
+   data = (char*)malloc(size);
+   if (data == NULL)
+   {
+      goto error;
+   }
+
+   memcpy(data, &long_header, SIZE_OF_XLOG_LONG_PHD);
+
+   while (total < size)
+   {
+      if (pgmoneta_stream_reader_read(reader, data + total, size - total, &length))
+      {
+         pgmoneta_log_error("Could not read WAL file %s", path);
+         goto error;
+      }
+
+      if (length == 0)
       {
-         free(record);
          break;
       }
-      uint32_t data_length = record->xl_tot_len - SIZE_OF_XLOG_RECORD;
-      next_record = ftell(file) + MAXALIGN(record->xl_tot_len - SIZE_OF_XLOG_RECORD);
-      uint32_t end_of_page = (page_number + 1) * long_header->xlp_xlog_blcksz;
 
-      MALLOC(buffer, data_length)
+      total += length;
+   }
+
+   pgmoneta_stream_reader_destroy(reader);
+   reader = NULL;
+
+   if (wal_iterator_init(iterator, data, total))
+   {
+      pgmoneta_log_error("Invalid WAL file header in %s", path);
+      goto error;
+   }
+
+   iterator->allocated = true;
+
+   return 0;
+
+error:
+   if (reader != NULL)
+   {
+      pgmoneta_stream_reader_destroy(reader);
+   }
+   free(data);
+
+   return 1;
+}
+
+static void
+wal_iterator_release(struct wal_iterator* iterator)
+{
+   if (iterator->mapped_size > 0)
+   {
+      munmap(iterator->data, iterator->mapped_size);
+   }
+   else if (iterator->allocated)
+   {
+      free(iterator->data);
+   }
+
+   iterator->data = NULL;
+   iterator->size = 0;
+   iterator->mapped_size = 0;
+   iterator->allocated = false;
+}
+
+static int
+wal_iterator_init(struct wal_iterator* iterator, char* data, size_t size)
+{
+   struct xlog_long_page_header_data* long_header = (struct xlog_long_page_header_data*)data;
+
+   if (!(long_header->std.xlp_info & XLP_LONG_HEADER) ||
+       long_header->xlp_xlog_blcksz < SIZE_OF_XLOG_LONG_PHD ||
+       (long_header->xlp_xlog_blcksz & (long_header->xlp_xlog_blcksz - 1)) != 0)
+   {
+      return 1;
+   }
 
-      // Read record data, possibly across page boundaries
-      if (data_length + ftell(file) >= end_of_page)
+   iterator->data = data;
+   iterator->size = MIN(size, (size_t)long_header->xlp_seg_size);
+   iterator->size -= iterator->size % long_header->xlp_xlog_blcksz;
+   iterator->mapped_size = 0;
+   iterator->allocated = false;
+   iterator->block_size = long_header->xlp_xlog_blcksz;
+   iterator->magic = long_header->std.xlp_magic;
+   iterator->segment_start = long_header->std.xlp_pageaddr;
+   iterator->position = 0;
+
+   return 0;
+}
+
+static int
+wal_iterator_follow(struct wal_iterator* iterator, uint32_t remaining)
+{
+   xlog_rec_ptr segment_end = iterator->segment_start + iterator->size;
+   uint32_t block_size = iterator->block_size;
+   uint16_t magic = iterator->magic;
+   size_t limit = 0;
+
+   wal_iterator_release(iterator);
+
+   /* Only the pages that hold the rest of the record are decompressed */
+   limit = ((size_t)remaining / (block_size - SIZE_OF_XLOG_LONG_PHD) + 1) * block_size;
+
+   if (wal_iterator_map(iterator, iterator->follow, limit))
+   {
+      return 1;
+   }
+
+   /* Only a WAL segment that continues this one can complete the record */
+   if (iterator->segment_start == segment_end && iterator->block_size == block_size && iterator->magic == magic)
+   {
+      iterator->followed = true;
+   }
+
+   return 0;
+}
+
+static bool
+wal_iterator_valid_page_header(struct wal_iterator* iterator, struct xlog_page_header_data* page_header)
+{
+   /* A recycled segment has the pages of an older segment after the end of WAL */
+   return page_header->xlp_magic == iterator->magic &&
+          page_header->xlp_pageaddr == iterator->segment_start + ((char*)page_header - iterator->data);
+}
+
+static bool
+wal_iterator_skip_page_header(struct wal_iterator* iterator)
+{
+   struct xlog_page_header_data* page_header = NULL;
+   size_t header_size = 0;
+
+   while (iterator->position < iterator->size && iterator->position % iterator->block_size == 0)
+   {
+      page_header = (struct xlog_page_header_data*)(iterator->data + iterator->position);
+
+      if (!wal_iterator_valid_page_header(iterator, page_header))
       {
-         size_t bytes_read = 0;
-         size_t total_bytes_read = 0;
-         uint32_t remaining_data_length = data_length;
-         bytes_read = fread(buffer, 1, end_of_page - ftell(file), file);
-         total_bytes_read += bytes_read;
-         remaining_data_length -= bytes_read;
-         while (remaining_data_length != 0)
+         return false;
+      }
+
+      header_size = iterator->position == 0 ? SIZE_OF_XLOG_LONG_PHD : SIZE_OF_XLOG_SHORT_PHD;
+
+      if (page_header->xlp_info & XLP_FIRST_IS_CONTRECORD)
+      {
+         /* The rest of a record that started before the iterator did */
+         if (header_size + page_header->xlp_rem_len >= iterator->block_size)
+         {
+            iterator->position += iterator->block_size;
+         }
+         else
          {
-            fseek(file, SIZE_OF_XLOG_SHORT_PHD, SEEK_CUR);
-            bytes_read = fread(buffer + total_bytes_read, 1,
-                               MIN(remaining_data_length, long_header->xlp_xlog_blcksz - SIZE_OF_XLOG_SHORT_PHD), file);
-            remaining_data_length -= bytes_read;
-            total_bytes_read += bytes_read;
+            iterator->position = MAXALIGN(iterator->position + header_size + page_header->xlp_rem_len);
          }
-         assert(total_bytes_read == data_length);
       }
       else
       {
-         size_t bytes_read = fread(buffer, 1, data_length, file);
+         iterator->position += header_size;
+      }
+   }
 
-         if (bytes_read != data_length)
-         {
-            pgmoneta_log_error("Error: Actual bytes read do not match the expected length");
-            goto error;
-         }
+   return true;
+}
+
+static bool
+wal_iterator_valid_crc(char* record, uint32_t total_length)
+{
+   uint32_t crc = 0;
+   struct xlog_record* header = (struct xlog_record*)record;
+
+   /* Like PostgreSQL, the CRC covers the data and then the header up to xl_crc */
+   pgmoneta_create_crc32c_buffer(record + SIZE_OF_XLOG_RECORD, total_length - SIZE_OF_XLOG_RECORD, &crc);
+   pgmoneta_create_crc32c_buffer(record, offsetof(struct xlog_record, xl_crc), &crc);
+
+   return crc == header->xl_crc;
+}
+
+static int
+wal_iterator_decode(struct wal_iterator* iterator, char* record, uint32_t total_length, xlog_rec_ptr lsn, xlog_rec_ptr next_lsn)
+{
+   size_t length = 0;
+   struct xlog_record header;
+
+   if (iterator->verify && !wal_iterator_valid_crc(record, total_length))
+   {
+      pgmoneta_log_error("Invalid CRC of record at %X/%X", LSN_FORMAT_ARGS(lsn));
+      return 1;
+   }
+
+   /* Main data and block data need at most one alignment padding each */
+   length = total_length + (XLR_MAX_BLOCK_ID + 2) * MAXIMUM_ALIGNOF;
+
+   if (iterator->aligned_size < length)
+   {
+      char* aligned = realloc(iterator->aligned, length);
+
+      if (aligned == NULL)
+      {
+         return 1;
       }
 
-      decoded = calloc(1, sizeof(struct decoded_xlog_record));
+      iterator->aligned = aligned;
+      iterator->aligned_size = length;
+   }
+
+   memcpy(&header, record, SIZE_OF_XLOG_RECORD);
+   server_config = iterator->server_info;
+
+   if (decode_xlog_record(record + SIZE_OF_XLOG_RECORD, &iterator->decoded, &header, iterator->block_size,
+                          iterator->server_info, iterator))
+   {
+      pgmoneta_log_error("Could not decode record at %X/%X", LSN_FORMAT_ARGS(lsn));
+      return 1;
+   }
+
+   iterator->decoded.lsn = lsn;
+   iterator->decoded.next_lsn = next_lsn;
+   iterator->decoded.size = total_length;
+   iterator->record = &iterator->decoded;
+
+   return 0;
+}
+
+static char*
+wal_iterator_align(struct wal_iterator* iterator, char* ptr, size_t length, size_t* used)
+{
+   char* aligned = NULL;
+
+   if ((uintptr_t)ptr % MAXIMUM_ALIGNOF == 0)
+   {
+      return ptr;
+   }
+
+   aligned = iterator->aligned + *used;
+   memcpy(aligned, ptr, length);
+   *used += MAXALIGNTYPE(length);
+
+   return aligned;
+}
+
+static int
+copy_decoded_record(struct decoded_xlog_record* record, struct decoded_xlog_record** copy)
+{
+   struct decoded_xlog_record* c = NULL;
+
+   *copy = NULL;
+
+   c = calloc(1, sizeof(struct decoded_xlog_record));
+   if (c == NULL)
+   {
+      goto error;
+   }
+
+   c->size = record->size;
+   c->lsn = record->lsn;
+   c->next_lsn = record->next_lsn;
+   c->header = record->header;
+   c->record_origin = record->record_origin;
+   c->toplevel_xid = record->toplevel_xid;
+   c->main_data_len = record->main_data_len;
+   c->max_block_id = record->max_block_id;
 
-      if (pgmoneta_wal_decode_xlog_record(buffer, decoded, record, long_header->xlp_xlog_blcksz, server_info))
+   if (record->main_data_len > 0)
+   {
+      c->main_data = malloc(record->main_data_len);
+      if (c->main_data == NULL)
       {
-         pgmoneta_log_fatal("error in decoding\n");
          goto error;
       }
-      else
+      memcpy(c->main_data, record->main_data, record->main_data_len);
+   }
+
+   for (int i = 0; i <= record->max_block_id; i++)
+   {
+      struct decoded_bkp_block* blk = &c->blocks[i];
+
+      if (!record->blocks[i].in_use)
+      {
+         continue;
+      }
+
+      *blk = record->blocks[i];
+      blk->bkp_image = NULL;
+      blk->data = NULL;
+
+      if (blk->has_image)
+      {
+         blk->bkp_image = malloc(blk->bimg_len);
+         if (blk->bkp_image == NULL)
+         {
+            blk->has_image = false;
+            blk->has_data = false;
+            goto error;
+         }
+         memcpy(blk->bkp_image, record->blocks[i].bkp_image, blk->bimg_len);
+      }
+
+      if (blk->has_data)
       {
-         pgmoneta_wal_display_decoded_record(decoded, ++count, server_info);
-         if (pgmoneta_deque_add(wal_file->records, NULL, (uintptr_t) decoded, ValueRef))
+         blk->data = malloc(blk->data_len);
+         if (blk->data == NULL)
          {
+            blk->has_data = false;
             goto error;
          }
+         memcpy(blk->data, record->blocks[i].data, blk->data_len);
       }
-      free(buffer);
-      free(record);
    }
 
-   fclose(file);
+   *copy = c;
+
    return 0;
 
 error:
-   pgmoneta_log_fatal("Error: Could not parse WAL file\n");
-   fclose(file);
+   free_decoded_record(c);
+
    return 1;
 }
 
+static void
+free_decoded_record(struct decoded_xlog_record* record)
+{
+   if (record == NULL)
+   {
+      return;
+   }
+
+   free(record->main_data);
+
+   for (int i = 0; i <= record->max_block_id; i++)
+   {
+      if (record->blocks[i].has_data)
+      {
+         free(record->blocks[i].data);
+      }
+      if (record->blocks[i].has_image)
+      {
+         free(record->blocks[i].bkp_image);
+      }
+   }
+
+   free(record);
+}
+
 void
 pgmoneta_wal_display_decoded_record(struct decoded_xlog_record* record, int count, struct server* server_info)
 {
@@ -329,6 +916,13 @@ pgmoneta_wal_display_decoded_record(struct decoded_xlog_record* record, int coun
 
 int
 pgmoneta_wal_decode_xlog_record(char* buffer, struct decoded_xlog_record* decoded, struct xlog_record* record, uint32_t block_size, struct server* server_info)
+{
+   return decode_xlog_record(buffer, decoded, record, block_size, server_info, NULL);
+}
+
+static int
+decode_xlog_record(char* buffer, struct decoded_xlog_record* decoded, struct xlog_record* record, uint32_t block_size, struct server* server_info,
+                   struct wal_iterator* iterator)
 {
 #define COPY_HEADER_FIELD(_dst, _size)          \
         do {                                        \
@@ -354,6 +948,7 @@ pgmoneta_wal_decode_xlog_record(char* buffer, struct decoded_xlog_record* decode
    char* ptr = NULL;
    struct rel_file_locator* rlocator = NULL;
    uint8_t block_id;
+   size_t used = 0;
 
    remaining = record->xl_tot_len - SIZE_OF_XLOG_RECORD;
    ptr = buffer;
@@ -541,19 +1136,38 @@ pgmoneta_wal_decode_xlog_record(char* buffer, struct decoded_xlog_record* decode
       if (blk->has_image)
       {
          /* no need to align image */
-         blk->bkp_image = malloc(blk->bimg_len);
-         memcpy(blk->bkp_image, ptr, blk->bimg_len);
+         if (iterator != NULL)
+         {
+            blk->bkp_image = ptr;
+         }
+         else
+         {
+            blk->bkp_image = malloc(blk->bimg_len);
+            memcpy(blk->bkp_image, ptr, blk->bimg_len);
+         }
          ptr += blk->bimg_len;
       }
       if (blk->has_data)
       {
-         blk->data = malloc(blk->data_len);
-         memcpy(blk->data, ptr, blk->data_len);
+         if (iterator != NULL)
+         {
+            blk->data = wal_iterator_align(iterator, ptr, blk->data_len, &used);
+         }
+         else
+         {
+            blk->data = malloc(blk->data_len);
+            memcpy(blk->data, ptr, blk->data_len);
+         }
          ptr += blk->data_len;
       }
    }
 
-   if (decoded->main_data_len > 0)
+   if (decoded->main_data_len > 0 && iterator != NULL)
+   {
+      decoded->main_data = wal_iterator_align(iterator, ptr, decoded->main_data_len, &used);
+      ptr += decoded->main_data_len;
+   }
+   else if (decoded->main_data_len > 0)
    {
       decoded->main_data = malloc(decoded->main_data_len);
       if (decoded->main_data == NULL)
@@ -635,6 +1249,91 @@ pgmoneta_wal_get_record_length(struct decoded_xlog_record* record, uint32_t* rec
    *rec_len = record->header.xl_tot_len - *fpi_len;
 }
 
+bool
+pgmoneta_wal_is_segment(char* name)
+{
+   char* suffix = NULL;
+
+   if (strlen(name) < WAL_SEGMENT_NAME_SIZE ||
+       strspn(name, "0123456789ABCDEF") != WAL_SEGMENT_NAME_SIZE)
+   {
+      return false;
+   }
+
+   suffix = name + WAL_SEGMENT_NAME_SIZE;
+
+   if (pgmoneta_starts_with(suffix, ".zstd"))
+   {
+      suffix += strlen(".zstd");
+   }
+   else if (pgmoneta_starts_with(suffix, ".lz4") || pgmoneta_starts_with(suffix, ".bz2"))
+   {
+      suffix += strlen(".lz4");
+   }
+   else if (pgmoneta_starts_with(suffix, ".gz"))
+   {
+      suffix += strlen(".gz");
+   }
+
+   if (!strcmp(suffix, ".aes"))
+   {
+      suffix += strlen(".aes");
+   }
+
+   return *suffix == '\0';
+}
+
+char*
+pgmoneta_wal_get_next_segment(char* directory, char* name, int segsize, int number_of_files, char** files)
+{
+   uint32_t tli = 0;
+   uint32_t log = 0;
+   uint32_t seg = 0;
+   uint32_t segments_per_id = 0;
+   char next[WAL_SEGMENT_NAME_SIZE + 1];
+   char* path = NULL;
+
+   if (segsize <= 0 || sscanf(name, "%08X%08X%08X", &tli, &log, &seg) != 3)
+   {
+      return NULL;
+   }
+
+   segments_per_id = 0x100000000ULL / segsize;
+
+   seg++;
+   if (seg >= segments_per_id)
+   {
+      log++;
+      seg = 0;
+   }
+
+   memset(&next[0], 0, sizeof(next));
+   snprintf(&next[0], sizeof(next), "%08X%08X%08X", tli, log, seg);
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      if (pgmoneta_wal_is_segment(files[i]) && !strncmp(files[i], &next[0], WAL_SEGMENT_NAME_SIZE))
+      {
+         path = pgmoneta_append(path, directory);
+         if (!pgmoneta_ends_with(directory, "/"))
+         {
+            path = pgmoneta_append_char(path, '/');
+         }
+         path = pgmoneta_append(path, files[i]);
+
+         return path;
+      }
+   }
+
+   return NULL;
+}
+
+char*
+pgmoneta_wal_get_rmgr_name(uint8_t rmid)
+{
+   return RmgrTable[rmid].name;
+}
+
 char*
 pgmoneta_wal_get_record_block_ref_info(char* buf, struct decoded_xlog_record* record, bool pretty, bool detailed_format, uint32_t* fpi_len,
                                        struct server* server_info)
@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <logging.h>
+#include <utils.h>
+#include <workers.h>
+#include <walfile/wal_reader.h>
+#include <walfile/wal_scan.h>
+
+/* system */
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @struct wal_segment_scan
+ * Defines the scan of a WAL segment
+ */
+struct wal_segment_scan
+{
+   char* path;                       /**< The path of the WAL segment */
+   char* next_path;                  /**< The path of the next completed WAL segment */
+   bool newest;                      /**< Is it the newest completed WAL segment */
+   struct server* server_info;       /**< The server */
+   struct wal_consumer* consumer;    /**< The consumer */
+   void* state;                      /**< The state of the WAL segment */
+   uint64_t records;                 /**< The number of records */
+   bool incomplete;                  /**< Does the last record continue in the next WAL segment */
+   bool error;                       /**< Did the scan fail */
+};
+
+static void scan_segment(void* arg);
+
+int
+pgmoneta_wal_scan(int server, char* directory, int number_of_files, char** files, struct wal_consumer* consumer, int* number_of_merged)
+{
+   int number_of_workers = 0;
+   int number_of_segments = 0;
+   int merged = 0;
+   char* newest = NULL;
+   char** segments = NULL;
+   uint64_t records = 0;
+   bool error = false;
+   struct wal_segment_scan* scans = NULL;
+   struct workers* workers = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (number_of_merged != NULL)
+   {
+      *number_of_merged = 0;
+   }
+
+   if (number_of_files <= 0)
+   {
+      return 0;
+   }
+
+   if (pgmoneta_get_wal_files(directory, &number_of_segments, &segments))
+   {
+      goto error;
+   }
+
+   /* The WAL segments are named in the order of their timeline and LSN */
+   for (int i = 0; i < number_of_segments; i++)
+   {
+      if (pgmoneta_wal_is_segment(segments[i]))
+      {
+         newest = segments[i];
+      }
+   }
+
+   scans = calloc(number_of_files, sizeof(struct wal_segment_scan));
+   if (scans == NULL)
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      scans[i].path = pgmoneta_append(scans[i].path, directory);
+      if (!pgmoneta_ends_with(directory, "/"))
+      {
+         scans[i].path = pgmoneta_append(scans[i].path, "/");
+      }
+      scans[i].path = pgmoneta_append(scans[i].path, files[i]);
+      scans[i].server_info = &config->servers[server];
+      scans[i].consumer = consumer;
+   }
+
+   /* The record at the end of a WAL segment is completed from the next one,
+    * but never from the WAL segment that is still streamed */
+   for (int i = 0; i < number_of_files; i++)
+   {
+      scans[i].next_path = pgmoneta_wal_get_next_segment(directory, files[i], config->servers[server].wal_size,
+                                                         number_of_segments, segments);
+      scans[i].newest = newest != NULL && strncmp(files[i], newest, WAL_SEGMENT_NAME_SIZE) >= 0;
+   }
+
+   number_of_workers = MIN(pgmoneta_get_number_of_workers(server), number_of_files);
+
+   if (number_of_workers > 1)
+   {
+      if (pgmoneta_workers_initialize(number_of_workers, &workers))
+      {
+         goto error;
+      }
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      if (workers != NULL)
+      {
+         if (pgmoneta_workers_add(workers, scan_segment, &scans[i]))
+         {
+            scans[i].error = true;
+         }
+      }
+      else
+      {
+         scan_segment(&scans[i]);
+      }
+   }
+
+   if (workers != NULL)
+   {
+      pgmoneta_workers_wait(workers);
+      pgmoneta_workers_destroy(workers);
+      workers = NULL;
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      if (scans[i].error)
+      {
+         pgmoneta_log_error("WAL scan: Could not scan %s", scans[i].path);
+         error = true;
+      }
+   }
+
+   /* The states are merged in LSN order. The newest WAL segment waits for the
+    * next one when its last record continues there */
+   for (int i = 0; !error && i < number_of_files; i++)
+   {
+      if (number_of_merged != NULL && scans[i].newest && scans[i].incomplete && scans[i].next_path == NULL)
+      {
+         pgmoneta_log_debug("WAL scan: %s is scanned when the next WAL segment is completed", scans[i].path);
+         break;
+      }
+
+      if (consumer->merge != NULL && consumer->merge(consumer->data, scans[i].state))
+      {
+         error = true;
+      }
+      records += scans[i].records;
+      merged++;
+   }
+
+   pgmoneta_log_debug("WAL scan: %d segments, %" PRIu64 " records with %d workers", merged, records, number_of_workers);
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      if (scans[i].state != NULL && consumer->destroy != NULL)
+      {
+         consumer->destroy(scans[i].state);
+      }
+      free(scans[i].path);
+      free(scans[i].next_path);
+   }
+   free(scans);
+
+   for (int i = 0; i < number_of_segments; i++)
+   {
+      free(segments[i]);
+   }
+   free(segments);
+
+   if (number_of_merged != NULL)
+   {
+      *number_of_merged = merged;
+   }
+
+   return error ? 1 : 0;
+
+error:
+   if (scans != NULL)
+   {
+      for (int i = 0; i < number_of_files; i++)
+      {
+         free(scans[i].path);
+         free(scans[i].next_path);
+      }
+   }
+   free(scans);
+
+   for (int i = 0; i < number_of_segments; i++)
+   {
+      free(segments[i]);
+   }
+   free(segments);
+
+   return 1;
+}
+
+static void
+scan_segment(void* arg)
+{
+   struct wal_segment_scan* scan = (struct wal_segment_scan*)arg;
+   struct wal_iterator* iterator = NULL;
+
+   if (scan->consumer->create != NULL)
+   {
+      scan->state = scan->consumer->create(scan->consumer->data);
+
+      if (scan->state == NULL)
+      {
+         goto error;
+      }
+   }
+
+   if (pgmoneta_wal_iterator_create(scan->path, scan->server_info, &iterator))
+   {
+      goto error;
+   }
+
+   iterator->follow = scan->next_path;
+
+   while (pgmoneta_wal_iterator_next(iterator))
+   {
+      if (scan->consumer->record(scan->state, iterator->record))
+      {
+         goto error;
+      }
+      scan->records++;
+   }
+
+   if (iterator->error)
+   {
+      goto error;
+   }
+
+   scan->incomplete = iterator->incomplete;
+
+   pgmoneta_wal_iterator_destroy(iterator);
+
+   return;
+
+error:
+   pgmoneta_wal_iterator_destroy(iterator);
+
+   scan->error = true;
+}
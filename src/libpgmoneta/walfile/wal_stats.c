@@ -0,0 +1,1192 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <art.h>
+#include <json.h>
+#include <logging.h>
+#include <management.h>
+#include <network.h>
+#include <utils.h>
+#include <value.h>
+#include <walfile/wal_reader.h>
+#include <walfile/wal_scan.h>
+#include <walfile/wal_stats.h>
+#include <walfile/wal_time.h>
+
+/* system */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @struct wal_stats_segment
+ * Defines a WAL segment of a range
+ */
+struct wal_stats_segment
+{
+   char* name;                /**< The name of the WAL segment */
+   uint32_t timeline;         /**< The timeline */
+   uint64_t segno;            /**< The segment number */
+   bool decodable;            /**< Can the WAL segment be decoded */
+};
+
+static void* stats_create(void* data);
+static int stats_record(void* state, struct decoded_xlog_record* record);
+static int stats_merge(void* data, void* state);
+static void stats_destroy(void* state);
+static int scan_run(int server, char* directory, struct wal_stats_segment* segments, int number_of_segments, struct wal_stats* stats);
+static struct wal_stats_counter* get_relation(struct wal_stats* stats, struct rel_file_locator* rlocator);
+static struct wal_stats_counter* get_database(struct wal_stats* stats, oid dbOid);
+static void add_counter(struct wal_stats_counter* counter, uint64_t records, uint64_t record_bytes, uint64_t fpi_bytes);
+static bool parse_segment(char* name, uint64_t segsize, uint32_t* timeline, uint64_t* segno);
+static char* get_stats_path(int server);
+static int write_stats(char* path, struct wal_stats* stats);
+static int resolve_position(int server, char* position, bool end, xlog_rec_ptr* lsn);
+static int compare_segments(const void* a, const void* b);
+static int compare_relations(const void* a, const void* b);
+static struct json* create_counter_json(struct wal_stats_counter* counter);
+
+int
+pgmoneta_wal_stats_create(xlog_rec_ptr start, xlog_rec_ptr end, struct wal_stats** stats)
+{
+   struct wal_stats* s = NULL;
+
+   *stats = NULL;
+
+   s = (struct wal_stats*)calloc(1, sizeof(struct wal_stats));
+   if (s == NULL)
+   {
+      goto error;
+   }
+
+   s->start = start;
+   s->end = end;
+
+   if (pgmoneta_art_create(&s->relation_index) || pgmoneta_art_create(&s->database_index))
+   {
+      goto error;
+   }
+
+   *stats = s;
+
+   return 0;
+
+error:
+   pgmoneta_wal_stats_destroy(s);
+
+   return 1;
+}
+
+int
+pgmoneta_wal_stats_add(struct wal_stats* stats, struct decoded_xlog_record* record)
+{
+   uint8_t type;
+   uint32_t rec_len = 0;
+   uint32_t fpi_len = 0;
+   uint64_t data_bytes = 0;
+   uint64_t image_bytes = 0;
+   bool seen = false;
+   struct decoded_bkp_block* blk = NULL;
+   struct wal_stats_counter* counter = NULL;
+
+   if (record->lsn < stats->start || (stats->end != 0 && record->lsn >= stats->end))
+   {
+      return 0;
+   }
+
+   pgmoneta_wal_get_record_length(record, &rec_len, &fpi_len);
+
+   add_counter(&stats->total, 1, rec_len, fpi_len);
+
+   if (record->header.xl_rmid < RM_NEXT_ID)
+   {
+      type = (record->header.xl_info & ~XLR_INFO_MASK) >> 4;
+      add_counter(&stats->rmgrs[record->header.xl_rmid][type], 1, rec_len, fpi_len);
+   }
+
+   for (int block_id = 0; block_id <= record->max_block_id; block_id++)
+   {
+      blk = &record->blocks[block_id];
+
+      if (!blk->in_use)
+      {
+         continue;
+      }
+
+      /* A relation is counted once for every record */
+      seen = false;
+      for (int i = 0; !seen && i < block_id; i++)
+      {
+         seen = record->blocks[i].in_use &&
+                record->blocks[i].rlocator.spcOid == blk->rlocator.spcOid &&
+                record->blocks[i].rlocator.dbOid == blk->rlocator.dbOid &&
+                record->blocks[i].rlocator.relNumber == blk->rlocator.relNumber;
+      }
+
+      data_bytes = blk->has_data ? blk->data_len : 0;
+      image_bytes = blk->has_image ? blk->bimg_len : 0;
+
+      counter = get_relation(stats, &blk->rlocator);
+      if (counter == NULL)
+      {
+         return 1;
+      }
+      add_counter(counter, seen ? 0 : 1, data_bytes, image_bytes);
+
+      seen = false;
+      for (int i = 0; !seen && i < block_id; i++)
+      {
+         seen = record->blocks[i].in_use && record->blocks[i].rlocator.dbOid == blk->rlocator.dbOid;
+      }
+
+      counter = get_database(stats, blk->rlocator.dbOid);
+      if (counter == NULL)
+      {
+         return 1;
+      }
+      add_counter(counter, seen ? 0 : 1, data_bytes, image_bytes);
+   }
+
+   return 0;
+}
+
+int
+pgmoneta_wal_stats_merge(struct wal_stats* stats, struct wal_stats* other)
+{
+   struct wal_stats_counter* counter = NULL;
+
+   stats->segments += other->segments;
+   stats->skipped += other->skipped;
+
+   add_counter(&stats->total, other->total.records, other->total.record_bytes, other->total.fpi_bytes);
+
+   for (int rmid = 0; rmid < RM_NEXT_ID; rmid++)
+   {
+      for (int type = 0; type < WAL_STATS_RECORD_TYPES; type++)
+      {
+         add_counter(&stats->rmgrs[rmid][type], other->rmgrs[rmid][type].records,
+                     other->rmgrs[rmid][type].record_bytes, other->rmgrs[rmid][type].fpi_bytes);
+      }
+   }
+
+   for (uint32_t i = 0; i < other->number_of_relations; i++)
+   {
+      counter = get_relation(stats, &other->relations[i].rlocator);
+      if (counter == NULL)
+      {
+         return 1;
+      }
+      add_counter(counter, other->relations[i].counter.records,
+                  other->relations[i].counter.record_bytes, other->relations[i].counter.fpi_bytes);
+   }
+
+   for (uint32_t i = 0; i < other->number_of_databases; i++)
+   {
+      counter = get_database(stats, other->databases[i].dbOid);
+      if (counter == NULL)
+      {
+         return 1;
+      }
+      add_counter(counter, other->databases[i].counter.records,
+                  other->databases[i].counter.record_bytes, other->databases[i].counter.fpi_bytes);
+   }
+
+   return 0;
+}
+
+void
+pgmoneta_wal_stats_destroy(struct wal_stats* stats)
+{
+   if (stats == NULL)
+   {
+      return;
+   }
+
+   pgmoneta_art_destroy(stats->relation_index);
+   pgmoneta_art_destroy(stats->database_index);
+   free(stats->relations);
+   free(stats->databases);
+   free(stats);
+}
+
+int
+pgmoneta_wal_stats_collect(int server, char* directory, xlog_rec_ptr start, xlog_rec_ptr end, struct wal_stats** stats)
+{
+   char name[WAL_SEGMENT_NAME_SIZE + 1];
+   int number_of_files = 0;
+   int number_of_segments = 0;
+   int selected = 0;
+   int run = 0;
+   uint64_t segsize = 0;
+   char** files = NULL;
+   struct wal_stats_segment* segments = NULL;
+   struct wal_stats* s = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *stats = NULL;
+
+   if (pgmoneta_wal_stats_create(start, end, &s))
+   {
+      goto error;
+   }
+
+   segsize = (uint64_t)config->servers[server].wal_size;
+   if (segsize == 0)
+   {
+      pgmoneta_log_debug("WAL stats: The WAL segment size of %s isn't known yet", config->servers[server].name);
+      *stats = s;
+      return 0;
+   }
+
+   if (pgmoneta_get_wal_files(directory, &number_of_files, &files))
+   {
+      goto error;
+   }
+
+   if (number_of_files > 0)
+   {
+      segments = (struct wal_stats_segment*)calloc(number_of_files, sizeof(struct wal_stats_segment));
+      if (segments == NULL)
+      {
+         goto error;
+      }
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      if (strlen(files[i]) < WAL_SEGMENT_NAME_SIZE || strstr(files[i], ".backup") != NULL)
+      {
+         continue;
+      }
+
+      memset(&name[0], 0, sizeof(name));
+      memcpy(&name[0], files[i], WAL_SEGMENT_NAME_SIZE);
+
+      if (!parse_segment(&name[0], segsize, &segments[number_of_segments].timeline, &segments[number_of_segments].segno))
+      {
+         continue;
+      }
+
+      /* Only the WAL segments that overlap the range */
+      if ((segments[number_of_segments].segno + 1) * segsize <= start ||
+          (end != 0 && segments[number_of_segments].segno * segsize >= end))
+      {
+         continue;
+      }
+
+      segments[number_of_segments].name = files[i];
+      segments[number_of_segments].decodable = pgmoneta_wal_is_segment(files[i]);
+      number_of_segments++;
+   }
+
+   qsort(segments, number_of_segments, sizeof(struct wal_stats_segment), compare_segments);
+
+   /* The WAL segment of the latest timeline replaces the others */
+   for (int i = 0; i < number_of_segments; i++)
+   {
+      if (i + 1 < number_of_segments && segments[i + 1].segno == segments[i].segno)
+      {
+         continue;
+      }
+
+      segments[selected++] = segments[i];
+   }
+
+   /* A run of consecutive WAL segments is scanned together */
+   for (int i = 0; i < selected; i = run)
+   {
+      if (!segments[i].decodable)
+      {
+         s->skipped++;
+         run = i + 1;
+         continue;
+      }
+
+      run = i + 1;
+      while (run < selected && segments[run].decodable && segments[run].segno == segments[run - 1].segno + 1 &&
+             segments[run].timeline == segments[run - 1].timeline)
+      {
+         run++;
+      }
+
+      if (scan_run(server, directory, &segments[i], run - i, s))
+      {
+         goto error;
+      }
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+   free(segments);
+
+   *stats = s;
+
+   return 0;
+
+error:
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+   free(segments);
+   pgmoneta_wal_stats_destroy(s);
+
+   return 1;
+}
+
+int
+pgmoneta_wal_stats_update(int server, char* directory)
+{
+   int number_of_files = 0;
+   int number_of_new = 0;
+   int number_of_merged = 0;
+   char* path = NULL;
+   char** files = NULL;
+   char** new_files = NULL;
+   struct wal_stats* stats = NULL;
+   struct wal_consumer consumer;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (config->servers[server].wal_size == 0)
+   {
+      pgmoneta_log_debug("WAL stats: The WAL segment size of %s isn't known yet", config->servers[server].name);
+      return 0;
+   }
+
+   path = get_stats_path(server);
+
+   if (pgmoneta_wal_stats_read(server, &stats))
+   {
+      pgmoneta_log_warn("WAL stats: Could not read %s", path);
+   }
+
+   if (stats == NULL && pgmoneta_wal_stats_create(0, 0, &stats))
+   {
+      goto error;
+   }
+
+   if (pgmoneta_get_wal_files(directory, &number_of_files, &files))
+   {
+      goto error;
+   }
+
+   if (number_of_files > 0)
+   {
+      new_files = (char**)calloc(number_of_files, sizeof(char*));
+      if (new_files == NULL)
+      {
+         goto error;
+      }
+   }
+
+   /* The WAL segments are named in the order of their timeline and LSN */
+   for (int i = 0; i < number_of_files; i++)
+   {
+      if (pgmoneta_wal_is_segment(files[i]) && strncmp(files[i], stats->last, WAL_SEGMENT_NAME_SIZE) > 0)
+      {
+         /* A WAL segment that is both streamed and archived is added once */
+         if (number_of_new > 0 && !strncmp(files[i], new_files[number_of_new - 1], WAL_SEGMENT_NAME_SIZE))
+         {
+            continue;
+         }
+
+         new_files[number_of_new++] = files[i];
+      }
+   }
+
+   if (number_of_new > 0)
+   {
+      consumer.create = stats_create;
+      consumer.record = stats_record;
+      consumer.merge = stats_merge;
+      consumer.destroy = stats_destroy;
+      consumer.data = stats;
+
+      if (pgmoneta_wal_scan(server, directory, number_of_new, new_files, &consumer, &number_of_merged))
+      {
+         pgmoneta_log_error("WAL stats: Could not decode the WAL of %s", config->servers[server].name);
+         goto error;
+      }
+   }
+
+   /* The WAL segment that waits for the next one is added in a later cycle */
+   if (number_of_merged > 0)
+   {
+      memset(&stats->last[0], 0, sizeof(stats->last));
+      memcpy(&stats->last[0], new_files[number_of_merged - 1], WAL_SEGMENT_NAME_SIZE);
+
+      if (write_stats(path, stats))
+      {
+         pgmoneta_log_error("WAL stats: Could not write %s", path);
+         goto error;
+      }
+
+      pgmoneta_log_debug("WAL stats: %s: %d segments", config->servers[server].name, number_of_merged);
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+   free(new_files);
+   pgmoneta_wal_stats_destroy(stats);
+   free(path);
+
+   return 0;
+
+error:
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+   free(new_files);
+   pgmoneta_wal_stats_destroy(stats);
+   free(path);
+
+   return 1;
+}
+
+int
+pgmoneta_wal_stats_read(int server, struct wal_stats** stats)
+{
+   char line[MISC_LENGTH];
+   char name[MISC_LENGTH];
+   unsigned int rmid = 0;
+   unsigned int type = 0;
+   unsigned int dbOid = 0;
+   uint64_t records = 0;
+   uint64_t record_bytes = 0;
+   uint64_t fpi_bytes = 0;
+   char* path = NULL;
+   FILE* file = NULL;
+   struct wal_stats* s = NULL;
+   struct wal_stats_counter* counter = NULL;
+
+   *stats = NULL;
+
+   path = get_stats_path(server);
+
+   if (!pgmoneta_exists(path))
+   {
+      free(path);
+      return 0;
+   }
+
+   file = fopen(path, "r");
+   if (file == NULL)
+   {
+      goto error;
+   }
+
+   if (pgmoneta_wal_stats_create(0, 0, &s))
+   {
+      goto error;
+   }
+
+   memset(&line[0], 0, sizeof(line));
+   while (fgets(&line[0], sizeof(line), file) != NULL)
+   {
+      memset(&name[0], 0, sizeof(name));
+
+      if (sscanf(&line[0], "segment %127s", &name[0]) == 1 && pgmoneta_wal_is_segment(&name[0]))
+      {
+         memcpy(&s->last[0], &name[0], WAL_SEGMENT_NAME_SIZE);
+      }
+      else if (sscanf(&line[0], "rmgr %u %u %" SCNu64 " %" SCNu64 " %" SCNu64,
+                      &rmid, &type, &records, &record_bytes, &fpi_bytes) == 5 &&
+               rmid < RM_NEXT_ID && type < WAL_STATS_RECORD_TYPES)
+      {
+         add_counter(&s->rmgrs[rmid][type], records, record_bytes, fpi_bytes);
+         add_counter(&s->total, records, record_bytes, fpi_bytes);
+      }
+      else if (sscanf(&line[0], "database %u %" SCNu64 " %" SCNu64 " %" SCNu64,
+                      &dbOid, &records, &record_bytes, &fpi_bytes) == 4)
+      {
+         counter = get_database(s, (oid)dbOid);
+         if (counter == NULL)
+         {
+            goto error;
+         }
+         add_counter(counter, records, record_bytes, fpi_bytes);
+      }
+
+      memset(&line[0], 0, sizeof(line));
+   }
+
+   fclose(file);
+   free(path);
+
+   *stats = s;
+
+   return 0;
+
+error:
+   if (file != NULL)
+   {
+      fclose(file);
+   }
+   pgmoneta_wal_stats_destroy(s);
+   free(path);
+
+   return 1;
+}
+
+void
+pgmoneta_wal_stats_request(SSL* ssl, int client_fd, int server, struct json* payload)
+{
+   char lsn[MISC_LENGTH];
+   char* start_position = NULL;
+   char* end_position = NULL;
+   char* d = NULL;
+   char* name = NULL;
+   char* elapsed = NULL;
+   time_t start_time;
+   time_t end_time;
+   int total_seconds;
+   uint32_t number_of_relations = 0;
+   xlog_rec_ptr start = 0;
+   xlog_rec_ptr end = 0;
+   struct wal_stats* stats = NULL;
+   struct wal_stats_relation* relations = NULL;
+   struct json* req = NULL;
+   struct json* response = NULL;
+   struct json* rmgrs = NULL;
+   struct json* rmgr = NULL;
+   struct json* types = NULL;
+   struct json* type = NULL;
+   struct json* databases = NULL;
+   struct json* database = NULL;
+   struct json* rels = NULL;
+   struct json* rel = NULL;
+   struct wal_stats_counter sum;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   start_time = time(NULL);
+
+   req = (struct json*)pgmoneta_json_get(payload, MANAGEMENT_CATEGORY_REQUEST);
+   start_position = (char*)pgmoneta_json_get(req, MANAGEMENT_ARGUMENT_START);
+   end_position = (char*)pgmoneta_json_get(req, MANAGEMENT_ARGUMENT_END);
+
+   if (resolve_position(server, start_position, false, &start) || resolve_position(server, end_position, true, &end) ||
+       (end != 0 && end <= start))
+   {
+      pgmoneta_management_response_error(NULL, client_fd, config->servers[server].name, MANAGEMENT_ERROR_WAL_STATS_RANGE, payload);
+      pgmoneta_log_warn("WAL stats: Invalid range (%s - %s)", start_position != NULL ? start_position : "",
+                        end_position != NULL ? end_position : "");
+
+      goto error;
+   }
+
+   d = pgmoneta_get_server_wal(server);
+
+   if (pgmoneta_wal_stats_collect(server, d, start, end, &stats))
+   {
+      pgmoneta_management_response_error(NULL, client_fd, config->servers[server].name, MANAGEMENT_ERROR_WAL_STATS_ERROR, payload);
+      pgmoneta_log_error("WAL stats: Could not decode the WAL of %s", config->servers[server].name);
+
+      goto error;
+   }
+
+   if (pgmoneta_management_create_response(payload, server, &response))
+   {
+      pgmoneta_management_response_error(NULL, client_fd, config->servers[server].name, MANAGEMENT_ERROR_ALLOCATION, payload);
+      pgmoneta_log_error("WAL stats: Allocation error");
+
+      goto error;
+   }
+
+   memset(&lsn[0], 0, sizeof(lsn));
+   snprintf(&lsn[0], sizeof(lsn), "%X/%X", LSN_FORMAT_ARGS(start));
+   pgmoneta_json_put(response, MANAGEMENT_ARGUMENT_START, (uintptr_t)&lsn[0], ValueString);
+
+   memset(&lsn[0], 0, sizeof(lsn));
+   if (end != 0)
+   {
+      snprintf(&lsn[0], sizeof(lsn), "%X/%X", LSN_FORMAT_ARGS(end));
+   }
+   pgmoneta_json_put(response, MANAGEMENT_ARGUMENT_END, (uintptr_t)&lsn[0], ValueString);
+
+   pgmoneta_json_put(response, MANAGEMENT_ARGUMENT_SEGMENTS, (uintptr_t)stats->segments, ValueUInt32);
+   pgmoneta_json_put(response, MANAGEMENT_ARGUMENT_SKIPPED, (uintptr_t)stats->skipped, ValueUInt32);
+   pgmoneta_json_put(response, MANAGEMENT_ARGUMENT_RECORDS, (uintptr_t)stats->total.records, ValueUInt64);
+   pgmoneta_json_put(response, MANAGEMENT_ARGUMENT_RECORD_BYTES, (uintptr_t)stats->total.record_bytes, ValueUInt64);
+   pgmoneta_json_put(response, MANAGEMENT_ARGUMENT_FPI_BYTES, (uintptr_t)stats->total.fpi_bytes, ValueUInt64);
+
+   if (pgmoneta_json_create(&rmgrs))
+   {
+      goto allocation;
+   }
+
+   for (int rmid = 0; rmid < RM_NEXT_ID; rmid++)
+   {
+      memset(&sum, 0, sizeof(struct wal_stats_counter));
+      types = NULL;
+
+      for (int t = 0; t < WAL_STATS_RECORD_TYPES; t++)
+      {
+         if (stats->rmgrs[rmid][t].records == 0)
+         {
+            continue;
+         }
+
+         add_counter(&sum, stats->rmgrs[rmid][t].records, stats->rmgrs[rmid][t].record_bytes, stats->rmgrs[rmid][t].fpi_bytes);
+
+         if (types == NULL && pgmoneta_json_create(&types))
+         {
+            goto allocation;
+         }
+
+         type = create_counter_json(&stats->rmgrs[rmid][t]);
+         if (type == NULL)
+         {
+            pgmoneta_json_destroy(types);
+            goto allocation;
+         }
+
+         pgmoneta_json_put(type, MANAGEMENT_ARGUMENT_TYPE, (uintptr_t)(t << 4), ValueUInt8);
+         pgmoneta_json_append(types, (uintptr_t)type, ValueJSON);
+      }
+
+      if (sum.records == 0)
+      {
+         continue;
+      }
+
+      rmgr = create_counter_json(&sum);
+      if (rmgr == NULL)
+      {
+         pgmoneta_json_destroy(types);
+         goto allocation;
+      }
+
+      name = pgmoneta_wal_get_rmgr_name((uint8_t)rmid);
+      pgmoneta_json_put(rmgr, MANAGEMENT_ARGUMENT_RESOURCE_MANAGER, (uintptr_t)(name != NULL ? name : ""), ValueString);
+      pgmoneta_json_put(rmgr, MANAGEMENT_ARGUMENT_RECORD_TYPES, (uintptr_t)types, ValueJSON);
+      pgmoneta_json_append(rmgrs, (uintptr_t)rmgr, ValueJSON);
+   }
+
+   pgmoneta_json_put(response, MANAGEMENT_ARGUMENT_RESOURCE_MANAGERS, (uintptr_t)rmgrs, ValueJSON);
+
+   if (pgmoneta_json_create(&databases))
+   {
+      goto allocation;
+   }
+
+   for (uint32_t i = 0; i < stats->number_of_databases; i++)
+   {
+      database = create_counter_json(&stats->databases[i].counter);
+      if (database == NULL)
+      {
+         goto allocation;
+      }
+
+      pgmoneta_json_put(database, MANAGEMENT_ARGUMENT_DATABASE, (uintptr_t)stats->databases[i].dbOid, ValueUInt32);
+      pgmoneta_json_append(databases, (uintptr_t)database, ValueJSON);
+   }
+
+   pgmoneta_json_put(response, MANAGEMENT_ARGUMENT_DATABASES, (uintptr_t)databases, ValueJSON);
+
+   /* Only the relations with the most write volume */
+   if (pgmoneta_json_create(&rels))
+   {
+      goto allocation;
+   }
+
+   if (stats->number_of_relations > 0)
+   {
+      relations = (struct wal_stats_relation*)malloc(stats->number_of_relations * sizeof(struct wal_stats_relation));
+      if (relations == NULL)
+      {
+         goto allocation;
+      }
+
+      memcpy(relations, stats->relations, stats->number_of_relations * sizeof(struct wal_stats_relation));
+      qsort(relations, stats->number_of_relations, sizeof(struct wal_stats_relation), compare_relations);
+
+      number_of_relations = MIN(stats->number_of_relations, WAL_STATS_RELATIONS);
+   }
+
+   for (uint32_t i = 0; i < number_of_relations; i++)
+   {
+      rel = create_counter_json(&relations[i].counter);
+      if (rel == NULL)
+      {
+         goto allocation;
+      }
+
+      pgmoneta_json_put(rel, MANAGEMENT_ARGUMENT_TABLESPACE, (uintptr_t)relations[i].rlocator.spcOid, ValueUInt32);
+      pgmoneta_json_put(rel, MANAGEMENT_ARGUMENT_DATABASE, (uintptr_t)relations[i].rlocator.dbOid, ValueUInt32);
+      pgmoneta_json_put(rel, MANAGEMENT_ARGUMENT_RELATION, (uintptr_t)relations[i].rlocator.relNumber, ValueUInt32);
+      pgmoneta_json_append(rels, (uintptr_t)rel, ValueJSON);
+   }
+
+   pgmoneta_json_put(response, MANAGEMENT_ARGUMENT_RELATIONS, (uintptr_t)rels, ValueJSON);
+
+   end_time = time(NULL);
+
+   if (pgmoneta_management_response_ok(NULL, client_fd, start_time, end_time, payload))
+   {
+      pgmoneta_management_response_error(NULL, client_fd, config->servers[server].name, MANAGEMENT_ERROR_WAL_STATS_NETWORK, payload);
+      pgmoneta_log_error("WAL stats: Error sending response");
+
+      goto error;
+   }
+
+   elapsed = pgmoneta_get_timestamp_string(start_time, end_time, &total_seconds);
+
+   pgmoneta_log_info("WAL stats: %s (Elapsed: %s)", config->servers[server].name, elapsed);
+
+   pgmoneta_json_destroy(payload);
+   pgmoneta_wal_stats_destroy(stats);
+   free(relations);
+   free(elapsed);
+   free(d);
+
+   pgmoneta_disconnect(client_fd);
+
+   pgmoneta_stop_logging();
+
+   exit(0);
+
+allocation:
+
+   pgmoneta_management_response_error(NULL, client_fd, config->servers[server].name, MANAGEMENT_ERROR_ALLOCATION, payload);
+   pgmoneta_log_error("WAL stats: Allocation error");
+
+error:
+
+   pgmoneta_json_destroy(payload);
+   pgmoneta_wal_stats_destroy(stats);
+   free(relations);
+   free(elapsed);
+   free(d);
+
+   pgmoneta_disconnect(client_fd);
+
+   pgmoneta_stop_logging();
+
+   exit(1);
+}
+
+static void*
+stats_create(void* data)
+{
+   struct wal_stats* result = (struct wal_stats*)data;
+   struct wal_stats* stats = NULL;
+
+   if (pgmoneta_wal_stats_create(result->start, result->end, &stats))
+   {
+      return NULL;
+   }
+
+   stats->segments = 1;
+
+   return stats;
+}
+
+static int
+stats_record(void* state, struct decoded_xlog_record* record)
+{
+   return pgmoneta_wal_stats_add((struct wal_stats*)state, record);
+}
+
+static int
+stats_merge(void* data, void* state)
+{
+   return pgmoneta_wal_stats_merge((struct wal_stats*)data, (struct wal_stats*)state);
+}
+
+static void
+stats_destroy(void* state)
+{
+   pgmoneta_wal_stats_destroy((struct wal_stats*)state);
+}
+
+static int
+scan_run(int server, char* directory, struct wal_stats_segment* segments, int number_of_segments, struct wal_stats* stats)
+{
+   char** files = NULL;
+   struct wal_consumer consumer;
+
+   files = (char**)calloc(number_of_segments, sizeof(char*));
+   if (files == NULL)
+   {
+      return 1;
+   }
+
+   for (int i = 0; i < number_of_segments; i++)
+   {
+      files[i] = segments[i].name;
+   }
+
+   consumer.create = stats_create;
+   consumer.record = stats_record;
+   consumer.merge = stats_merge;
+   consumer.destroy = stats_destroy;
+   consumer.data = stats;
+
+   if (pgmoneta_wal_scan(server, directory, number_of_segments, files, &consumer, NULL))
+   {
+      free(files);
+      return 1;
+   }
+
+   free(files);
+
+   return 0;
+}
+
+static struct wal_stats_counter*
+get_relation(struct wal_stats* stats, struct rel_file_locator* rlocator)
+{
+   char key[MISC_LENGTH];
+   uint32_t index = 0;
+   struct wal_stats_relation* relations = NULL;
+
+   memset(&key[0], 0, sizeof(key));
+   snprintf(&key[0], sizeof(key), "%u/%u/%u", rlocator->spcOid, rlocator->dbOid, rlocator->relNumber);
+
+   index = (uint32_t)pgmoneta_art_search(stats->relation_index, (unsigned char*)&key[0], strlen(&key[0]) + 1);
+   if (index > 0)
+   {
+      return &stats->relations[index - 1].counter;
+   }
+
+   if (stats->number_of_relations == stats->relations_size)
+   {
+      uint32_t size = stats->relations_size == 0 ? 64 : stats->relations_size * 2;
+
+      relations = (struct wal_stats_relation*)realloc(stats->relations, size * sizeof(struct wal_stats_relation));
+      if (relations == NULL)
+      {
+         return NULL;
+      }
+
+      stats->relations = relations;
+      stats->relations_size = size;
+   }
+
+   memset(&stats->relations[stats->number_of_relations], 0, sizeof(struct wal_stats_relation));
+   memcpy(&stats->relations[stats->number_of_relations].rlocator, rlocator, sizeof(struct rel_file_locator));
+
+   if (pgmoneta_art_insert(stats->relation_index, (unsigned char*)&key[0], strlen(&key[0]) + 1,
+                           (uintptr_t)(stats->number_of_relations + 1), ValueUInt32))
+   {
+      return NULL;
+   }
+
+   return &stats->relations[stats->number_of_relations++].counter;
+}
+
+static struct wal_stats_counter*
+get_database(struct wal_stats* stats, oid dbOid)
+{
+   char key[MISC_LENGTH];
+   uint32_t index = 0;
+   struct wal_stats_database* databases = NULL;
+
+   memset(&key[0], 0, sizeof(key));
+   snprintf(&key[0], sizeof(key), "%u", dbOid);
+
+   index = (uint32_t)pgmoneta_art_search(stats->database_index, (unsigned char*)&key[0], strlen(&key[0]) + 1);
+   if (index > 0)
+   {
+      return &stats->databases[index - 1].counter;
+   }
+
+   if (stats->number_of_databases == stats->databases_size)
+   {
+      uint32_t size = stats->databases_size == 0 ? 8 : stats->databases_size * 2;
+
+      databases = (struct wal_stats_database*)realloc(stats->databases, size * sizeof(struct wal_stats_database));
+      if (databases == NULL)
+      {
+         return NULL;
+      }
+
+      stats->databases = databases;
+      stats->databases_size = size;
+   }
+
+   memset(&stats->databases[stats->number_of_databases], 0, sizeof(struct wal_stats_database));
+   stats->databases[stats->number_of_databases].dbOid = dbOid;
+
+   if (pgmoneta_art_insert(stats->database_index, (unsigned char*)&key[0], strlen(&key[0]) + 1,
+                           (uintptr_t)(stats->number_of_databases + 1), ValueUInt32))
+   {
+      return NULL;
+   }
+
+   return &stats->databases[stats->number_of_databases++].counter;
+}
+
+static void
+add_counter(struct wal_stats_counter* counter, uint64_t records, uint64_t record_bytes, uint64_t fpi_bytes)
+{
+   counter->records += records;
+   counter->record_bytes += record_bytes;
+   counter->fpi_bytes += fpi_bytes;
+}
+
+static bool
+parse_segment(char* name, uint64_t segsize, uint32_t* timeline, uint64_t* segno)
+{
+   uint32_t log = 0;
+   uint32_t seg = 0;
+
+   if (!pgmoneta_wal_is_segment(name) || sscanf(name, "%08X%08X%08X", timeline, &log, &seg) != 3)
+   {
+      return false;
+   }
+
+   *segno = (uint64_t)log * ((uint64_t)0x100000000 / segsize) + seg;
+
+   return true;
+}
+
+static char*
+get_stats_path(int server)
+{
+   char* path = NULL;
+
+   path = pgmoneta_get_server(server);
+   path = pgmoneta_append(path, "wal_stats");
+
+   return path;
+}
+
+static int
+write_stats(char* path, struct wal_stats* stats)
+{
+   char* tmp = NULL;
+   FILE* file = NULL;
+   struct wal_stats_counter* counter = NULL;
+
+   tmp = pgmoneta_append(tmp, path);
+   tmp = pgmoneta_append(tmp, ".tmp");
+
+   file = fopen(tmp, "w");
+   if (file == NULL)
+   {
+      goto error;
+   }
+
+   fprintf(file, "segment %s\n", &stats->last[0]);
+
+   for (int rmid = 0; rmid < RM_NEXT_ID; rmid++)
+   {
+      for (int type = 0; type < WAL_STATS_RECORD_TYPES; type++)
+      {
+         counter = &stats->rmgrs[rmid][type];
+
+         if (counter->records > 0)
+         {
+            fprintf(file, "rmgr %d %d %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                    rmid, type, counter->records, counter->record_bytes, counter->fpi_bytes);
+         }
+      }
+   }
+
+   for (uint32_t i = 0; i < stats->number_of_databases; i++)
+   {
+      counter = &stats->databases[i].counter;
+
+      fprintf(file, "database %u %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+              stats->databases[i].dbOid, counter->records, counter->record_bytes, counter->fpi_bytes);
+   }
+
+   fflush(file);
+   fclose(file);
+   file = NULL;
+
+   if (rename(tmp, path))
+   {
+      goto error;
+   }
+
+   free(tmp);
+
+   return 0;
+
+error:
+   if (file != NULL)
+   {
+      fclose(file);
+   }
+   free(tmp);
+
+   return 1;
+}
+
+static int
+resolve_position(int server, char* position, bool end, xlog_rec_ptr* lsn)
+{
+   uint32_t hi = 0;
+   uint32_t lo = 0;
+   int number_of_entries = 0;
+   bool zone = false;
+   bool found = false;
+   uint64_t segsize = 0;
+   timestamp_tz time = 0;
+   struct wal_time_entry* entries = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *lsn = 0;
+
+   if (position == NULL || strlen(position) == 0)
+   {
+      return 0;
+   }
+
+   if (strchr(position, '/') != NULL)
+   {
+      if (sscanf(position, "%X/%X", &hi, &lo) != 2)
+      {
+         return 1;
+      }
+
+      *lsn = ((uint64_t)hi << 32) + lo;
+
+      return 0;
+   }
+
+   /* A time is rounded out to the WAL segments of the time index */
+   if (pgmoneta_wal_time_parse(position, &time, &zone))
+   {
+      return 1;
+   }
+
+   segsize = (uint64_t)config->servers[server].wal_size;
+
+   if (segsize == 0 || pgmoneta_wal_time_index_read(server, &number_of_entries, &entries))
+   {
+      free(entries);
+      return 1;
+   }
+
+   for (int i = 0; i < number_of_entries; i++)
+   {
+      if (entries[i].transactions == 0)
+      {
+         continue;
+      }
+
+      if (!end && entries[i].last >= time)
+      {
+         *lsn = entries[i].start;
+         found = true;
+         break;
+      }
+
+      if (end && entries[i].first <= time)
+      {
+         *lsn = entries[i].start + segsize;
+         found = true;
+      }
+   }
+
+   free(entries);
+
+   if (!found)
+   {
+      return 1;
+   }
+
+   return 0;
+}
+
+static int
+compare_segments(const void* a, const void* b)
+{
+   const struct wal_stats_segment* x = (const struct wal_stats_segment*)a;
+   const struct wal_stats_segment* y = (const struct wal_stats_segment*)b;
+
+   if (x->segno != y->segno)
+   {
+      return x->segno < y->segno ? -1 : 1;
+   }
+
+   if (x->timeline != y->timeline)
+   {
+      return x->timeline < y->timeline ? -1 : 1;
+   }
+
+   return 0;
+}
+
+static int
+compare_relations(const void* a, const void* b)
+{
+   const struct wal_stats_relation* x = (const struct wal_stats_relation*)a;
+   const struct wal_stats_relation* y = (const struct wal_stats_relation*)b;
+   uint64_t vx = x->counter.record_bytes + x->counter.fpi_bytes;
+   uint64_t vy = y->counter.record_bytes + y->counter.fpi_bytes;
+
+   if (vx != vy)
+   {
+      return vx > vy ? -1 : 1;
+   }
+
+   return 0;
+}
+
+static struct json*
+create_counter_json(struct wal_stats_counter* counter)
+{
+   struct json* j = NULL;
+
+   if (pgmoneta_json_create(&j))
+   {
+      return NULL;
+   }
+
+   pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_RECORDS, (uintptr_t)counter->records, ValueUInt64);
+   pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_RECORD_BYTES, (uintptr_t)counter->record_bytes, ValueUInt64);
+   pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_FPI_BYTES, (uintptr_t)counter->fpi_bytes, ValueUInt64);
+
+   return j;
+}
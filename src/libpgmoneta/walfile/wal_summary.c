@@ -0,0 +1,1458 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <art.h>
+#include <logging.h>
+#include <security.h>
+#include <utils.h>
+#include <value.h>
+#include <walfile/rm.h>
+#include <walfile/rm_storage.h>
+#include <walfile/rm_xact.h>
+#include <walfile/wal_reader.h>
+#include <walfile/wal_scan.h>
+#include <walfile/wal_summary.h>
+
+/* system */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @struct wal_summary_build
+ * Defines the WAL summaries of a scan
+ */
+struct wal_summary_build
+{
+   int number_of_files;       /**< The number of WAL segments */
+   char** files;              /**< The names of the WAL segments */
+   uint64_t segsize;          /**< The size of a WAL segment */
+   char* directory;           /**< The summaries directory */
+   int number_of_summaries;   /**< The number of WAL summaries written */
+};
+
+/**
+ * @struct wal_summary_file
+ * Defines a WAL summary file
+ */
+struct wal_summary_file
+{
+   char* name;             /**< The name of the WAL summary */
+   uint32_t timeline;      /**< The timeline */
+   xlog_rec_ptr start;     /**< The start LSN */
+   xlog_rec_ptr end;       /**< The end LSN */
+};
+
+static struct block_ref_entry* get_or_create_entry(struct block_ref_table* table, struct rel_file_locator* rlocator, enum fork_number forknum);
+static void get_entry_key(struct rel_file_locator* rlocator, enum fork_number forknum, char* key, size_t size);
+static int grow_chunks(struct block_ref_entry* entry, uint32_t number_of_chunks);
+static bool chunk_contains(struct block_ref_chunk* chunk, uint16_t offset);
+static int chunk_add(struct block_ref_chunk* chunk, uint16_t offset);
+static void chunk_truncate(struct block_ref_chunk* chunk, uint16_t offset);
+static int compare_offsets(const void* a, const void* b);
+static void* summary_create(void* data);
+static int summary_record(void* state, struct decoded_xlog_record* record);
+static int summary_merge(void* data, void* state);
+static void summary_destroy(void* state);
+static void locator_from_node(struct rel_file_node* node, struct rel_file_locator* rlocator);
+static char* get_summaries_path(int server);
+static void get_segment_name(uint32_t timeline, xlog_rec_ptr start, uint64_t segsize, char* name);
+static int get_summaries(char* directory, int* number_of_summaries, struct wal_summary_file** summaries);
+static void free_summaries(int number_of_summaries, struct wal_summary_file* summaries);
+static int compare_summaries(const void* a, const void* b);
+static int write_data(FILE* file, void* data, size_t size, uint32_t* crc);
+static int read_data(char* buffer, size_t size, size_t* offset, void* data, size_t length);
+
+int
+pgmoneta_block_ref_table_create(struct block_ref_table** table)
+{
+   struct block_ref_table* t = NULL;
+
+   *table = NULL;
+
+   t = (struct block_ref_table*)calloc(1, sizeof(struct block_ref_table));
+   if (t == NULL)
+   {
+      goto error;
+   }
+
+   if (pgmoneta_art_create(&t->index))
+   {
+      goto error;
+   }
+
+   *table = t;
+
+   return 0;
+
+error:
+   free(t);
+
+   return 1;
+}
+
+int
+pgmoneta_block_ref_table_mark_block_modified(struct block_ref_table* table, struct rel_file_locator* rlocator,
+                                             enum fork_number forknum, block_number blkno)
+{
+   uint32_t chunkno;
+   struct block_ref_entry* entry = NULL;
+
+   entry = get_or_create_entry(table, rlocator, forknum);
+   if (entry == NULL)
+   {
+      return 1;
+   }
+
+   /* The whole relation fork from the limit block is modified already */
+   if (blkno >= entry->limit_block)
+   {
+      return 0;
+   }
+
+   chunkno = blkno / BLOCKS_PER_CHUNK;
+
+   if (grow_chunks(entry, chunkno + 1))
+   {
+      return 1;
+   }
+
+   return chunk_add(&entry->chunks[chunkno], (uint16_t)(blkno % BLOCKS_PER_CHUNK));
+}
+
+int
+pgmoneta_block_ref_table_set_limit_block(struct block_ref_table* table, struct rel_file_locator* rlocator,
+                                         enum fork_number forknum, block_number limit_block)
+{
+   uint32_t chunkno;
+   uint16_t offset;
+   struct block_ref_entry* entry = NULL;
+
+   entry = get_or_create_entry(table, rlocator, forknum);
+   if (entry == NULL)
+   {
+      return 1;
+   }
+
+   if (limit_block >= entry->limit_block)
+   {
+      return 0;
+   }
+
+   entry->limit_block = limit_block;
+
+   chunkno = limit_block / BLOCKS_PER_CHUNK;
+   offset = (uint16_t)(limit_block % BLOCKS_PER_CHUNK);
+
+   for (uint32_t i = chunkno; i < entry->number_of_chunks; i++)
+   {
+      if (i == chunkno && offset > 0)
+      {
+         chunk_truncate(&entry->chunks[i], offset);
+      }
+      else
+      {
+         free(entry->chunks[i].data);
+         memset(&entry->chunks[i], 0, sizeof(struct block_ref_chunk));
+      }
+   }
+
+   return 0;
+}
+
+struct block_ref_entry*
+pgmoneta_block_ref_table_get_entry(struct block_ref_table* table, struct rel_file_locator* rlocator, enum fork_number forknum)
+{
+   char key[MISC_LENGTH];
+   uintptr_t index;
+
+   if (table == NULL)
+   {
+      return NULL;
+   }
+
+   get_entry_key(rlocator, forknum, &key[0], sizeof(key));
+
+   index = pgmoneta_art_search(table->index, (unsigned char*)&key[0], strlen(&key[0]) + 1);
+   if (index == 0)
+   {
+      return NULL;
+   }
+
+   return &table->entries[index - 1];
+}
+
+int
+pgmoneta_block_ref_entry_get_blocks(struct block_ref_entry* entry, block_number start, block_number stop,
+                                    block_number** blocks, uint32_t* number_of_blocks)
+{
+   uint64_t total = 0;
+   uint32_t n = 0;
+   uint64_t base;
+   uint64_t blkno;
+   block_number* array = NULL;
+   struct block_ref_chunk* chunk = NULL;
+
+   *blocks = NULL;
+   *number_of_blocks = 0;
+
+   if (entry == NULL)
+   {
+      return 1;
+   }
+
+   total = pgmoneta_block_ref_entry_count(entry);
+   if (total == 0 || start >= stop)
+   {
+      return 0;
+   }
+
+   array = (block_number*)malloc(total * sizeof(block_number));
+   if (array == NULL)
+   {
+      return 1;
+   }
+
+   for (uint32_t i = 0; i < entry->number_of_chunks; i++)
+   {
+      chunk = &entry->chunks[i];
+      base = (uint64_t)i * BLOCKS_PER_CHUNK;
+
+      if (chunk->used == 0 || base >= stop || base + BLOCKS_PER_CHUNK <= start)
+      {
+         continue;
+      }
+
+      if (chunk->bitmap)
+      {
+         for (uint32_t j = 0; j < BLOCKS_PER_CHUNK; j++)
+         {
+            blkno = base + j;
+            if (blkno >= start && blkno < stop && chunk_contains(chunk, (uint16_t)j))
+            {
+               array[n++] = (block_number)blkno;
+            }
+         }
+      }
+      else
+      {
+         qsort(chunk->data, chunk->used, sizeof(uint16_t), compare_offsets);
+
+         for (uint32_t j = 0; j < chunk->used; j++)
+         {
+            blkno = base + chunk->data[j];
+            if (blkno >= start && blkno < stop)
+            {
+               array[n++] = (block_number)blkno;
+            }
+         }
+      }
+   }
+
+   if (n == 0)
+   {
+      free(array);
+      array = NULL;
+   }
+
+   *blocks = array;
+   *number_of_blocks = n;
+
+   return 0;
+}
+
+uint64_t
+pgmoneta_block_ref_entry_count(struct block_ref_entry* entry)
+{
+   uint64_t count = 0;
+
+   if (entry == NULL)
+   {
+      return 0;
+   }
+
+   for (uint32_t i = 0; i < entry->number_of_chunks; i++)
+   {
+      count += entry->chunks[i].used;
+   }
+
+   return count;
+}
+
+int
+pgmoneta_block_ref_table_merge(struct block_ref_table* table, struct block_ref_table* next)
+{
+   struct block_ref_entry* entry = NULL;
+   struct block_ref_chunk* chunk = NULL;
+   block_number base;
+
+   if (table == NULL || next == NULL)
+   {
+      return 1;
+   }
+
+   for (uint32_t i = 0; i < next->number_of_entries; i++)
+   {
+      entry = &next->entries[i];
+
+      /* The limit block came before the blocks that were modified after it */
+      if (entry->limit_block != InvalidBlockNumber)
+      {
+         if (pgmoneta_block_ref_table_set_limit_block(table, &entry->rlocator, entry->forknum, entry->limit_block))
+         {
+            return 1;
+         }
+      }
+      else if (get_or_create_entry(table, &entry->rlocator, entry->forknum) == NULL)
+      {
+         return 1;
+      }
+
+      for (uint32_t j = 0; j < entry->number_of_chunks; j++)
+      {
+         chunk = &entry->chunks[j];
+         base = j * BLOCKS_PER_CHUNK;
+
+         if (chunk->bitmap)
+         {
+            for (uint32_t k = 0; k < BLOCKS_PER_CHUNK; k++)
+            {
+               if (chunk_contains(chunk, (uint16_t)k) &&
+                   pgmoneta_block_ref_table_mark_block_modified(table, &entry->rlocator, entry->forknum, base + k))
+               {
+                  return 1;
+               }
+            }
+         }
+         else
+         {
+            for (uint32_t k = 0; k < chunk->used; k++)
+            {
+               if (pgmoneta_block_ref_table_mark_block_modified(table, &entry->rlocator, entry->forknum, base + chunk->data[k]))
+               {
+                  return 1;
+               }
+            }
+         }
+      }
+   }
+
+   return 0;
+}
+
+int
+pgmoneta_block_ref_table_write(struct block_ref_table* table, char* path, uint32_t timeline, xlog_rec_ptr start, xlog_rec_ptr end)
+{
+   uint32_t crc = 0;
+   uint32_t u32;
+   int32_t i32;
+   uint32_t number_of_chunks;
+   char* tmp = NULL;
+   FILE* file = NULL;
+   struct block_ref_entry* entry = NULL;
+   struct block_ref_chunk* chunk = NULL;
+
+   tmp = pgmoneta_append(tmp, path);
+   tmp = pgmoneta_append(tmp, ".tmp");
+
+   file = fopen(tmp, "wb");
+   if (file == NULL)
+   {
+      goto error;
+   }
+
+   u32 = WAL_SUMMARY_MAGIC;
+   if (write_data(file, &u32, sizeof(uint32_t), &crc))
+   {
+      goto error;
+   }
+
+   u32 = WAL_SUMMARY_VERSION;
+   if (write_data(file, &u32, sizeof(uint32_t), &crc) ||
+       write_data(file, &timeline, sizeof(uint32_t), &crc) ||
+       write_data(file, &table->number_of_entries, sizeof(uint32_t), &crc) ||
+       write_data(file, &start, sizeof(uint64_t), &crc) ||
+       write_data(file, &end, sizeof(uint64_t), &crc))
+   {
+      goto error;
+   }
+
+   for (uint32_t i = 0; i < table->number_of_entries; i++)
+   {
+      entry = &table->entries[i];
+
+      number_of_chunks = 0;
+      for (uint32_t j = 0; j < entry->number_of_chunks; j++)
+      {
+         if (entry->chunks[j].used > 0)
+         {
+            number_of_chunks++;
+         }
+      }
+
+      i32 = (int32_t)entry->forknum;
+      if (write_data(file, &entry->rlocator.spcOid, sizeof(uint32_t), &crc) ||
+          write_data(file, &entry->rlocator.dbOid, sizeof(uint32_t), &crc) ||
+          write_data(file, &entry->rlocator.relNumber, sizeof(uint32_t), &crc) ||
+          write_data(file, &i32, sizeof(int32_t), &crc) ||
+          write_data(file, &entry->limit_block, sizeof(uint32_t), &crc) ||
+          write_data(file, &number_of_chunks, sizeof(uint32_t), &crc))
+      {
+         goto error;
+      }
+
+      for (uint32_t j = 0; j < entry->number_of_chunks; j++)
+      {
+         chunk = &entry->chunks[j];
+
+         if (chunk->used == 0)
+         {
+            continue;
+         }
+
+         if (!chunk->bitmap)
+         {
+            qsort(chunk->data, chunk->used, sizeof(uint16_t), compare_offsets);
+         }
+
+         u32 = chunk->bitmap ? 1 : 0;
+         if (write_data(file, &j, sizeof(uint32_t), &crc) ||
+             write_data(file, &u32, sizeof(uint32_t), &crc) ||
+             write_data(file, &chunk->used, sizeof(uint32_t), &crc) ||
+             write_data(file, chunk->data, (chunk->bitmap ? MAX_ENTRIES_PER_CHUNK : chunk->used) * sizeof(uint16_t), &crc))
+         {
+            goto error;
+         }
+      }
+   }
+
+   if (fwrite(&crc, 1, sizeof(uint32_t), file) != sizeof(uint32_t))
+   {
+      goto error;
+   }
+
+   if (fflush(file))
+   {
+      goto error;
+   }
+
+   fclose(file);
+   file = NULL;
+
+   if (rename(tmp, path))
+   {
+      goto error;
+   }
+
+   free(tmp);
+
+   return 0;
+
+error:
+   if (file != NULL)
+   {
+      fclose(file);
+   }
+   if (tmp != NULL)
+   {
+      remove(tmp);
+   }
+   free(tmp);
+
+   return 1;
+}
+
+int
+pgmoneta_block_ref_table_read(char* path, struct block_ref_table** table)
+{
+   char* buffer = NULL;
+   long size = 0;
+   size_t offset = 0;
+   uint32_t crc = 0;
+   uint32_t stored = 0;
+   uint32_t magic = 0;
+   uint32_t version = 0;
+   uint32_t timeline = 0;
+   uint32_t number_of_entries = 0;
+   uint32_t number_of_chunks = 0;
+   uint32_t chunkno = 0;
+   uint32_t bitmap = 0;
+   uint32_t used = 0;
+   uint32_t length = 0;
+   int32_t forknum = 0;
+   block_number limit_block;
+   xlog_rec_ptr start = 0;
+   xlog_rec_ptr end = 0;
+   FILE* file = NULL;
+   struct rel_file_locator rlocator;
+   struct block_ref_table* t = NULL;
+   struct block_ref_entry* entry = NULL;
+   struct block_ref_chunk* chunk = NULL;
+
+   *table = NULL;
+
+   file = fopen(path, "rb");
+   if (file == NULL)
+   {
+      goto error;
+   }
+
+   if (fseek(file, 0, SEEK_END) || (size = ftell(file)) < 0 || fseek(file, 0, SEEK_SET))
+   {
+      goto error;
+   }
+
+   if ((size_t)size < 4 * sizeof(uint32_t) + 2 * sizeof(uint64_t) + sizeof(uint32_t))
+   {
+      pgmoneta_log_error("WAL summary: %s is too short", path);
+      goto error;
+   }
+
+   buffer = (char*)malloc(size);
+   if (buffer == NULL)
+   {
+      goto error;
+   }
+
+   if (fread(buffer, 1, size, file) != (size_t)size)
+   {
+      goto error;
+   }
+
+   fclose(file);
+   file = NULL;
+
+   size -= sizeof(uint32_t);
+   memcpy(&stored, buffer + size, sizeof(uint32_t));
+   pgmoneta_create_crc32c_buffer(buffer, size, &crc);
+
+   if (crc != stored)
+   {
+      pgmoneta_log_error("WAL summary: Invalid CRC of %s", path);
+      goto error;
+   }
+
+   if (read_data(buffer, size, &offset, &magic, sizeof(uint32_t)) ||
+       read_data(buffer, size, &offset, &version, sizeof(uint32_t)) ||
+       read_data(buffer, size, &offset, &timeline, sizeof(uint32_t)) ||
+       read_data(buffer, size, &offset, &number_of_entries, sizeof(uint32_t)) ||
+       read_data(buffer, size, &offset, &start, sizeof(uint64_t)) ||
+       read_data(buffer, size, &offset, &end, sizeof(uint64_t)))
+   {
+      goto corrupt;
+   }
+
+   if (magic != WAL_SUMMARY_MAGIC || version != WAL_SUMMARY_VERSION)
+   {
+      pgmoneta_log_error("WAL summary: %s isn't a WAL summary of version %d", path, WAL_SUMMARY_VERSION);
+      goto error;
+   }
+
+   if (pgmoneta_block_ref_table_create(&t))
+   {
+      goto error;
+   }
+
+   for (uint32_t i = 0; i < number_of_entries; i++)
+   {
+      if (read_data(buffer, size, &offset, &rlocator.spcOid, sizeof(uint32_t)) ||
+          read_data(buffer, size, &offset, &rlocator.dbOid, sizeof(uint32_t)) ||
+          read_data(buffer, size, &offset, &rlocator.relNumber, sizeof(uint32_t)) ||
+          read_data(buffer, size, &offset, &forknum, sizeof(int32_t)) ||
+          read_data(buffer, size, &offset, &limit_block, sizeof(uint32_t)) ||
+          read_data(buffer, size, &offset, &number_of_chunks, sizeof(uint32_t)))
+      {
+         goto corrupt;
+      }
+
+      if (forknum < MAIN_FORKNUM || forknum > INIT_FORKNUM)
+      {
+         goto corrupt;
+      }
+
+      if (pgmoneta_block_ref_table_set_limit_block(t, &rlocator, (enum fork_number)forknum, limit_block))
+      {
+         goto error;
+      }
+
+      entry = pgmoneta_block_ref_table_get_entry(t, &rlocator, (enum fork_number)forknum);
+      if (entry == NULL)
+      {
+         goto error;
+      }
+
+      for (uint32_t j = 0; j < number_of_chunks; j++)
+      {
+         if (read_data(buffer, size, &offset, &chunkno, sizeof(uint32_t)) ||
+             read_data(buffer, size, &offset, &bitmap, sizeof(uint32_t)) ||
+             read_data(buffer, size, &offset, &used, sizeof(uint32_t)))
+         {
+            goto corrupt;
+         }
+
+         length = bitmap ? MAX_ENTRIES_PER_CHUNK : used;
+
+         if (chunkno > InvalidBlockNumber / BLOCKS_PER_CHUNK || used == 0 ||
+             used > (bitmap ? BLOCKS_PER_CHUNK : MAX_ENTRIES_PER_CHUNK))
+         {
+            goto corrupt;
+         }
+
+         if (grow_chunks(entry, chunkno + 1))
+         {
+            goto error;
+         }
+
+         chunk = &entry->chunks[chunkno];
+         if (chunk->data != NULL)
+         {
+            goto corrupt;
+         }
+
+         chunk->data = (uint16_t*)malloc(length * sizeof(uint16_t));
+         if (chunk->data == NULL)
+         {
+            goto error;
+         }
+
+         chunk->bitmap = bitmap ? true : false;
+         chunk->used = used;
+         chunk->size = length;
+
+         if (read_data(buffer, size, &offset, chunk->data, length * sizeof(uint16_t)))
+         {
+            goto corrupt;
+         }
+      }
+   }
+
+   if (offset != (size_t)size)
+   {
+      goto corrupt;
+   }
+
+   free(buffer);
+
+   *table = t;
+
+   return 0;
+
+corrupt:
+   pgmoneta_log_error("WAL summary: %s is corrupt", path);
+
+error:
+   if (file != NULL)
+   {
+      fclose(file);
+   }
+   free(buffer);
+   pgmoneta_block_ref_table_destroy(t);
+
+   return 1;
+}
+
+void
+pgmoneta_block_ref_table_destroy(struct block_ref_table* table)
+{
+   if (table == NULL)
+   {
+      return;
+   }
+
+   for (uint32_t i = 0; i < table->number_of_entries; i++)
+   {
+      for (uint32_t j = 0; j < table->entries[i].number_of_chunks; j++)
+      {
+         free(table->entries[i].chunks[j].data);
+      }
+      free(table->entries[i].chunks);
+   }
+
+   free(table->entries);
+   pgmoneta_art_destroy(table->index);
+   free(table);
+}
+
+int
+pgmoneta_wal_summary_update(int server, char* directory)
+{
+   char name[WAL_SEGMENT_NAME_SIZE + 1];
+   int number_of_files = 0;
+   int number_of_summaries = 0;
+   int number_of_new = 0;
+   int number_of_merged = 0;
+   uint64_t segsize = 0;
+   char* path = NULL;
+   char* summary = NULL;
+   char** files = NULL;
+   char** new_files = NULL;
+   struct art* summarized = NULL;
+   struct art* present = NULL;
+   struct wal_summary_file* summaries = NULL;
+   struct wal_summary_build build;
+   struct wal_consumer consumer;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   memset(&build, 0, sizeof(struct wal_summary_build));
+
+   segsize = (uint64_t)config->servers[server].wal_size;
+   if (segsize == 0)
+   {
+      pgmoneta_log_debug("WAL summary: The WAL segment size of %s isn't known yet", config->servers[server].name);
+      return 0;
+   }
+
+   path = get_summaries_path(server);
+
+   if (!pgmoneta_exists(path) && pgmoneta_mkdir(path))
+   {
+      pgmoneta_log_error("WAL summary: Could not create %s", path);
+      goto error;
+   }
+
+   if (get_summaries(path, &number_of_summaries, &summaries))
+   {
+      pgmoneta_log_warn("WAL summary: Could not read %s", path);
+   }
+
+   if (pgmoneta_art_create(&summarized) || pgmoneta_art_create(&present))
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < number_of_summaries; i++)
+   {
+      get_segment_name(summaries[i].timeline, summaries[i].start, segsize, &name[0]);
+      pgmoneta_art_insert(summarized, (unsigned char*)&name[0], strlen(&name[0]) + 1, (uintptr_t)true, ValueBool);
+   }
+
+   if (pgmoneta_get_wal_files(directory, &number_of_files, &files))
+   {
+      goto error;
+   }
+
+   if (number_of_files > 0)
+   {
+      new_files = (char**)calloc(number_of_files, sizeof(char*));
+      if (new_files == NULL)
+      {
+         goto error;
+      }
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      if (pgmoneta_wal_is_segment(files[i]))
+      {
+         memset(&name[0], 0, sizeof(name));
+         memcpy(&name[0], files[i], WAL_SEGMENT_NAME_SIZE);
+         pgmoneta_art_insert(present, (unsigned char*)&name[0], strlen(&name[0]) + 1, (uintptr_t)true, ValueBool);
+      }
+
+      /* Compressed and encrypted WAL segments are decoded in memory, and a WAL
+       * segment that is both streamed and archived is summarized once */
+      if (pgmoneta_wal_is_segment(files[i]) &&
+          !pgmoneta_art_contains_key(summarized, (unsigned char*)&name[0], strlen(&name[0]) + 1))
+      {
+         new_files[number_of_new++] = files[i];
+         pgmoneta_art_insert(summarized, (unsigned char*)&name[0], strlen(&name[0]) + 1, (uintptr_t)true, ValueBool);
+      }
+   }
+
+   if (number_of_new > 0)
+   {
+      build.number_of_files = number_of_new;
+      build.files = new_files;
+      build.segsize = segsize;
+      build.directory = path;
+
+      consumer.create = summary_create;
+      consumer.record = summary_record;
+      consumer.merge = summary_merge;
+      consumer.destroy = summary_destroy;
+      consumer.data = &build;
+
+      if (pgmoneta_wal_scan(server, directory, number_of_new, new_files, &consumer, &number_of_merged))
+      {
+         pgmoneta_log_error("WAL summary: Could not summarize the WAL of %s", config->servers[server].name);
+         goto error;
+      }
+
+      pgmoneta_log_debug("WAL summary: %s: %d segments", config->servers[server].name, number_of_merged);
+   }
+
+   /* Forget the WAL segments that were removed by retention */
+   for (int i = 0; i < number_of_summaries; i++)
+   {
+      get_segment_name(summaries[i].timeline, summaries[i].start, segsize, &name[0]);
+
+      if (!pgmoneta_art_contains_key(present, (unsigned char*)&name[0], strlen(&name[0]) + 1))
+      {
+         summary = pgmoneta_append(NULL, path);
+         summary = pgmoneta_append(summary, summaries[i].name);
+
+         if (remove(summary))
+         {
+            pgmoneta_log_warn("WAL summary: Could not remove %s", summary);
+         }
+
+         free(summary);
+         summary = NULL;
+      }
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+   free(new_files);
+   free_summaries(number_of_summaries, summaries);
+   pgmoneta_art_destroy(summarized);
+   pgmoneta_art_destroy(present);
+   free(path);
+
+   return 0;
+
+error:
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+   free(new_files);
+   free_summaries(number_of_summaries, summaries);
+   pgmoneta_art_destroy(summarized);
+   pgmoneta_art_destroy(present);
+   free(path);
+
+   return 1;
+}
+
+int
+pgmoneta_wal_summary_read(int server, uint32_t timeline, xlog_rec_ptr start, xlog_rec_ptr end, struct block_ref_table** table)
+{
+   int number_of_summaries = 0;
+   xlog_rec_ptr covered = start;
+   char* path = NULL;
+   char* summary = NULL;
+   struct wal_summary_file* summaries = NULL;
+   struct block_ref_table* t = NULL;
+   struct block_ref_table* next = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *table = NULL;
+
+   path = get_summaries_path(server);
+
+   if (pgmoneta_block_ref_table_create(&t))
+   {
+      goto error;
+   }
+
+   if (get_summaries(path, &number_of_summaries, &summaries))
+   {
+      goto error;
+   }
+
+   /* The WAL summaries are sorted by start LSN, and must cover the range without a gap */
+   for (int i = 0; i < number_of_summaries && covered < end; i++)
+   {
+      if (summaries[i].timeline != timeline || summaries[i].end <= covered)
+      {
+         continue;
+      }
+
+      if (summaries[i].start > covered)
+      {
+         break;
+      }
+
+      summary = pgmoneta_append(NULL, path);
+      summary = pgmoneta_append(summary, summaries[i].name);
+
+      if (pgmoneta_block_ref_table_read(summary, &next))
+      {
+         goto error;
+      }
+
+      if (pgmoneta_block_ref_table_merge(t, next))
+      {
+         goto error;
+      }
+
+      pgmoneta_block_ref_table_destroy(next);
+      next = NULL;
+      free(summary);
+      summary = NULL;
+
+      covered = summaries[i].end;
+   }
+
+   if (covered < end)
+   {
+      pgmoneta_log_debug("WAL summary: %s: No WAL summary of %X/%X on timeline %u",
+                         config->servers[server].name, LSN_FORMAT_ARGS(covered), timeline);
+      goto error;
+   }
+
+   free_summaries(number_of_summaries, summaries);
+   free(path);
+
+   *table = t;
+
+   return 0;
+
+error:
+   free_summaries(number_of_summaries, summaries);
+   pgmoneta_block_ref_table_destroy(next);
+   pgmoneta_block_ref_table_destroy(t);
+   free(summary);
+   free(path);
+
+   return 1;
+}
+
+static struct block_ref_entry*
+get_or_create_entry(struct block_ref_table* table, struct rel_file_locator* rlocator, enum fork_number forknum)
+{
+   char key[MISC_LENGTH];
+   struct block_ref_entry* entry = NULL;
+
+   entry = pgmoneta_block_ref_table_get_entry(table, rlocator, forknum);
+   if (entry != NULL)
+   {
+      return entry;
+   }
+
+   if (table->number_of_entries == table->size)
+   {
+      struct block_ref_entry* entries = NULL;
+      uint32_t size = table->size == 0 ? 64 : table->size * 2;
+
+      entries = (struct block_ref_entry*)realloc(table->entries, size * sizeof(struct block_ref_entry));
+      if (entries == NULL)
+      {
+         return NULL;
+      }
+
+      table->entries = entries;
+      table->size = size;
+   }
+
+   entry = &table->entries[table->number_of_entries];
+   memset(entry, 0, sizeof(struct block_ref_entry));
+   memcpy(&entry->rlocator, rlocator, sizeof(struct rel_file_locator));
+   entry->forknum = forknum;
+   entry->limit_block = InvalidBlockNumber;
+
+   get_entry_key(rlocator, forknum, &key[0], sizeof(key));
+
+   if (pgmoneta_art_insert(table->index, (unsigned char*)&key[0], strlen(&key[0]) + 1,
+                           (uintptr_t)(table->number_of_entries + 1), ValueUInt32))
+   {
+      return NULL;
+   }
+
+   table->number_of_entries++;
+
+   return entry;
+}
+
+static void
+get_entry_key(struct rel_file_locator* rlocator, enum fork_number forknum, char* key, size_t size)
+{
+   memset(key, 0, size);
+   snprintf(key, size, "%u/%u/%u/%d", rlocator->spcOid, rlocator->dbOid, rlocator->relNumber, (int)forknum);
+}
+
+static int
+grow_chunks(struct block_ref_entry* entry, uint32_t number_of_chunks)
+{
+   struct block_ref_chunk* chunks = NULL;
+   uint32_t n;
+
+   if (number_of_chunks <= entry->number_of_chunks)
+   {
+      return 0;
+   }
+
+   n = entry->number_of_chunks * 2;
+   if (n < number_of_chunks)
+   {
+      n = number_of_chunks;
+   }
+
+   chunks = (struct block_ref_chunk*)realloc(entry->chunks, n * sizeof(struct block_ref_chunk));
+   if (chunks == NULL)
+   {
+      return 1;
+   }
+
+   memset(&chunks[entry->number_of_chunks], 0, (n - entry->number_of_chunks) * sizeof(struct block_ref_chunk));
+
+   entry->chunks = chunks;
+   entry->number_of_chunks = n;
+
+   return 0;
+}
+
+static bool
+chunk_contains(struct block_ref_chunk* chunk, uint16_t offset)
+{
+   if (chunk->bitmap)
+   {
+      return (chunk->data[offset / 16] & (1 << (offset % 16))) != 0;
+   }
+
+   for (uint32_t i = 0; i < chunk->used; i++)
+   {
+      if (chunk->data[i] == offset)
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static int
+chunk_add(struct block_ref_chunk* chunk, uint16_t offset)
+{
+   uint16_t* data = NULL;
+
+   if (chunk_contains(chunk, offset))
+   {
+      return 0;
+   }
+
+   /* A full array of offsets is as large as the bitmap */
+   if (!chunk->bitmap && chunk->used == MAX_ENTRIES_PER_CHUNK)
+   {
+      data = (uint16_t*)calloc(MAX_ENTRIES_PER_CHUNK, sizeof(uint16_t));
+      if (data == NULL)
+      {
+         return 1;
+      }
+
+      for (uint32_t i = 0; i < chunk->used; i++)
+      {
+         data[chunk->data[i] / 16] |= (uint16_t)(1 << (chunk->data[i] % 16));
+      }
+
+      free(chunk->data);
+      chunk->data = data;
+      chunk->size = MAX_ENTRIES_PER_CHUNK;
+      chunk->bitmap = true;
+   }
+
+   if (chunk->bitmap)
+   {
+      chunk->data[offset / 16] |= (uint16_t)(1 << (offset % 16));
+      chunk->used++;
+
+      return 0;
+   }
+
+   if (chunk->used == chunk->size)
+   {
+      uint32_t size = chunk->size == 0 ? 16 : chunk->size * 2;
+
+      data = (uint16_t*)realloc(chunk->data, size * sizeof(uint16_t));
+      if (data == NULL)
+      {
+         return 1;
+      }
+
+      chunk->data = data;
+      chunk->size = size;
+   }
+
+   chunk->data[chunk->used++] = offset;
+
+   return 0;
+}
+
+static void
+chunk_truncate(struct block_ref_chunk* chunk, uint16_t offset)
+{
+   uint32_t n = 0;
+
+   if (chunk->bitmap)
+   {
+      for (uint32_t i = offset; i < BLOCKS_PER_CHUNK; i++)
+      {
+         chunk->data[i / 16] &= (uint16_t)~(1 << (i % 16));
+      }
+
+      for (uint32_t i = 0; i < offset; i++)
+      {
+         if (chunk_contains(chunk, (uint16_t)i))
+         {
+            n++;
+         }
+      }
+   }
+   else
+   {
+      for (uint32_t i = 0; i < chunk->used; i++)
+      {
+         if (chunk->data[i] < offset)
+         {
+            chunk->data[n++] = chunk->data[i];
+         }
+      }
+   }
+
+   chunk->used = n;
+}
+
+static int
+compare_offsets(const void* a, const void* b)
+{
+   uint16_t x = *(const uint16_t*)a;
+   uint16_t y = *(const uint16_t*)b;
+
+   return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void*
+summary_create(void* data)
+{
+   struct block_ref_table* table = NULL;
+
+   if (pgmoneta_block_ref_table_create(&table))
+   {
+      return NULL;
+   }
+
+   return table;
+}
+
+static int
+summary_record(void* state, struct decoded_xlog_record* record)
+{
+   struct block_ref_table* table = (struct block_ref_table*)state;
+   uint8_t info = record->header.xl_info & ~XLR_INFO_MASK;
+   int nrels = 0;
+   struct rel_file_node* xnodes = NULL;
+   struct rel_file_locator rlocator;
+   enum fork_number forknum;
+   block_number blkno;
+
+   if (record->header.xl_rmid == RM_SMGR_ID && info == XLOG_SMGR_CREATE &&
+       record->main_data_len >= sizeof(struct xl_smgr_create))
+   {
+      struct xl_smgr_create* xlrec = (struct xl_smgr_create*)record->main_data;
+
+      /* A new relation fork is modified as a whole */
+      locator_from_node(&xlrec->rnode, &rlocator);
+      if (pgmoneta_block_ref_table_set_limit_block(table, &rlocator, xlrec->forkNum, 0))
+      {
+         return 1;
+      }
+   }
+   else if (record->header.xl_rmid == RM_SMGR_ID && info == XLOG_SMGR_TRUNCATE &&
+            record->main_data_len >= sizeof(struct xl_smgr_truncate))
+   {
+      struct xl_smgr_truncate* xlrec = (struct xl_smgr_truncate*)record->main_data;
+
+      locator_from_node(&xlrec->rnode, &rlocator);
+
+      if ((xlrec->flags & SMGR_TRUNCATE_HEAP) &&
+          pgmoneta_block_ref_table_set_limit_block(table, &rlocator, MAIN_FORKNUM, xlrec->blkno))
+      {
+         return 1;
+      }
+
+      /* The new sizes of the free space map and the visibility map aren't logged */
+      if ((xlrec->flags & SMGR_TRUNCATE_FSM) &&
+          pgmoneta_block_ref_table_set_limit_block(table, &rlocator, FSM_FORKNUM, 0))
+      {
+         return 1;
+      }
+
+      if ((xlrec->flags & SMGR_TRUNCATE_VM) &&
+          pgmoneta_block_ref_table_set_limit_block(table, &rlocator, VISIBILITYMAP_FORKNUM, 0))
+      {
+         return 1;
+      }
+   }
+   else if (record->header.xl_rmid == RM_XACT_ID &&
+            !pgmoneta_wal_xact_dropped_relations(record, &nrels, &xnodes))
+   {
+      for (int i = 0; i < nrels; i++)
+      {
+         locator_from_node(&xnodes[i], &rlocator);
+
+         for (int fork = MAIN_FORKNUM; fork <= INIT_FORKNUM; fork++)
+         {
+            if (pgmoneta_block_ref_table_set_limit_block(table, &rlocator, (enum fork_number)fork, 0))
+            {
+               return 1;
+            }
+         }
+      }
+   }
+
+   for (int block_id = 0; block_id <= record->max_block_id; block_id++)
+   {
+      if (!pgmoneta_wal_get_record_block_tag_extended(record, block_id, &rlocator, &forknum, &blkno, NULL))
+      {
+         continue;
+      }
+
+      if (pgmoneta_block_ref_table_mark_block_modified(table, &rlocator, forknum, blkno))
+      {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+static int
+summary_merge(void* data, void* state)
+{
+   struct wal_summary_build* build = (struct wal_summary_build*)data;
+   struct block_ref_table* table = (struct block_ref_table*)state;
+   char* name = build->files[build->number_of_summaries];
+   char* path = NULL;
+   char summary[MISC_LENGTH];
+   uint32_t timeline = 0;
+   uint32_t log = 0;
+   uint32_t seg = 0;
+   xlog_rec_ptr start;
+   xlog_rec_ptr end;
+
+   if (sscanf(name, "%08X%08X%08X", &timeline, &log, &seg) != 3)
+   {
+      return 1;
+   }
+
+   start = ((uint64_t)log << 32) + (uint64_t)seg * build->segsize;
+   end = start + build->segsize;
+
+   memset(&summary[0], 0, sizeof(summary));
+   snprintf(&summary[0], sizeof(summary), "%08X%08X%08X%08X%08X.summary",
+            timeline, LSN_FORMAT_ARGS(start), LSN_FORMAT_ARGS(end));
+
+   path = pgmoneta_append(path, build->directory);
+   path = pgmoneta_append(path, &summary[0]);
+
+   if (pgmoneta_block_ref_table_write(table, path, timeline, start, end))
+   {
+      pgmoneta_log_error("WAL summary: Could not write %s", path);
+      free(path);
+      return 1;
+   }
+
+   free(path);
+
+   build->number_of_summaries++;
+
+   return 0;
+}
+
+static void
+summary_destroy(void* state)
+{
+   pgmoneta_block_ref_table_destroy((struct block_ref_table*)state);
+}
+
+static void
+locator_from_node(struct rel_file_node* node, struct rel_file_locator* rlocator)
+{
+   rlocator->spcOid = node->spcNode;
+   rlocator->dbOid = node->dbNode;
+   rlocator->relNumber = node->relNode;
+}
+
+static char*
+get_summaries_path(int server)
+{
+   char* path = NULL;
+
+   path = pgmoneta_get_server(server);
+   path = pgmoneta_append(path, "summaries/");
+
+   return path;
+}
+
+static void
+get_segment_name(uint32_t timeline, xlog_rec_ptr start, uint64_t segsize, char* name)
+{
+   uint64_t segno = start / segsize;
+   uint64_t segments_per_id = (uint64_t)0x100000000 / segsize;
+
+   memset(name, 0, WAL_SEGMENT_NAME_SIZE + 1);
+   snprintf(name, WAL_SEGMENT_NAME_SIZE + 1, "%08X%08X%08X", timeline,
+            (uint32_t)(segno / segments_per_id), (uint32_t)(segno % segments_per_id));
+}
+
+static int
+get_summaries(char* directory, int* number_of_summaries, struct wal_summary_file** summaries)
+{
+   int number_of_files = 0;
+   int n = 0;
+   uint32_t start_hi = 0;
+   uint32_t start_lo = 0;
+   uint32_t end_hi = 0;
+   uint32_t end_lo = 0;
+   char** files = NULL;
+   struct wal_summary_file* array = NULL;
+
+   *number_of_summaries = 0;
+   *summaries = NULL;
+
+   if (!pgmoneta_exists(directory))
+   {
+      return 0;
+   }
+
+   if (pgmoneta_get_files(directory, &number_of_files, &files))
+   {
+      goto error;
+   }
+
+   if (number_of_files > 0)
+   {
+      array = (struct wal_summary_file*)calloc(number_of_files, sizeof(struct wal_summary_file));
+      if (array == NULL)
+      {
+         goto error;
+      }
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      if (strlen(files[i]) == 40 + strlen(".summary") &&
+          pgmoneta_ends_with(files[i], ".summary") &&
+          strspn(files[i], "0123456789ABCDEF") == 40 &&
+          sscanf(files[i], "%08X%08X%08X%08X%08X", &array[n].timeline, &start_hi, &start_lo, &end_hi, &end_lo) == 5)
+      {
+         array[n].start = ((uint64_t)start_hi << 32) + start_lo;
+         array[n].end = ((uint64_t)end_hi << 32) + end_lo;
+         array[n].name = files[i];
+         files[i] = NULL;
+         n++;
+      }
+      else
+      {
+         free(files[i]);
+      }
+   }
+
+   free(files);
+
+   if (n > 0)
+   {
+      qsort(array, n, sizeof(struct wal_summary_file), compare_summaries);
+   }
+
+   *number_of_summaries = n;
+   *summaries = array;
+
+   return 0;
+
+error:
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+   free(array);
+
+   return 1;
+}
+
+static void
+free_summaries(int number_of_summaries, struct wal_summary_file* summaries)
+{
+   for (int i = 0; i < number_of_summaries; i++)
+   {
+      free(summaries[i].name);
+   }
+   free(summaries);
+}
+
+static int
+compare_summaries(const void* a, const void* b)
+{
+   const struct wal_summary_file* x = (const struct wal_summary_file*)a;
+   const struct wal_summary_file* y = (const struct wal_summary_file*)b;
+
+   if (x->start != y->start)
+   {
+      return x->start < y->start ? -1 : 1;
+   }
+
+   if (x->timeline != y->timeline)
+   {
+      return x->timeline < y->timeline ? -1 : 1;
+   }
+
+   return 0;
+}
+
+static int
+write_data(FILE* file, void* data, size_t size, uint32_t* crc)
+{
+   if (size == 0)
+   {
+      return 0;
+   }
+
+   if (fwrite(data, 1, size, file) != size)
+   {
+      return 1;
+   }
+
+   return pgmoneta_create_crc32c_buffer(data, size, crc);
+}
+
+static int
+read_data(char* buffer, size_t size, size_t* offset, void* data, size_t length)
+{
+   if (length > size || *offset > size - length)
+   {
+      return 1;
+   }
+
+   memcpy(data, buffer + *offset, length);
+   *offset += length;
+
+   return 0;
+}
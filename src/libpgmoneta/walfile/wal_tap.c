@@ -0,0 +1,734 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <logging.h>
+#include <utils.h>
+#include <walfile.h>
+#include <walfile/pg_control.h>
+#include <walfile/rm.h>
+#include <walfile/wal_reader.h>
+#include <walfile/wal_tap.h>
+#include <walfile/wal_time.h>
+#include <walfile/wal_verify.h>
+
+/* system */
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+/* The record buffer is shrunk to this size after a large record */
+#define WAL_TAP_RECORD_SIZE     (1024 * 1024)
+/* The largest record of PostgreSQL */
+#define WAL_TAP_MAX_RECORD_SIZE (1020 * 1024 * 1024)
+
+static int tap_page_header(struct wal_tap* tap, xlog_rec_ptr lsn);
+static int tap_record(struct wal_tap* tap, xlog_rec_ptr end);
+static void tap_segment(struct wal_tap* tap, xlog_seg_no segno);
+static void tap_flush(struct wal_tap* tap);
+static void tap_error(struct wal_tap* tap);
+static void tap_unsync(struct wal_tap* tap);
+static void tap_reset_record(struct wal_tap* tap);
+static int lock_journal(int server, int flags, char** path);
+
+int
+pgmoneta_wal_tap_create(int server, char* directory, uint32_t timeline, struct wal_tap** tap)
+{
+   struct wal_tap* t = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *tap = NULL;
+
+   t = (struct wal_tap*)calloc(1, sizeof(struct wal_tap));
+   if (t == NULL)
+   {
+      goto error;
+   }
+
+   t->server = server;
+   t->directory = pgmoneta_append(t->directory, directory);
+   t->timeline = timeline;
+   t->segsize = config->servers[server].wal_size;
+
+   if (t->directory == NULL || t->segsize == 0)
+   {
+      goto error;
+   }
+
+   t->record_size = WAL_TAP_RECORD_SIZE;
+   t->record = (char*)malloc(t->record_size);
+   if (t->record == NULL)
+   {
+      goto error;
+   }
+
+   *tap = t;
+
+   return 0;
+
+error:
+   pgmoneta_wal_tap_destroy(t);
+
+   return 1;
+}
+
+int
+pgmoneta_wal_tap_feed(struct wal_tap* tap, xlog_rec_ptr lsn, char* data, size_t length)
+{
+   size_t position = 0;
+   size_t n = 0;
+   xlog_rec_ptr current = 0;
+   xlog_rec_ptr page_end = 0;
+
+   if (lsn != tap->lsn)
+   {
+      if (tap->segment_open)
+      {
+         pgmoneta_log_debug("WAL tap: Gap from %X/%X to %X/%X", LSN_FORMAT_ARGS(tap->lsn), LSN_FORMAT_ARGS(lsn));
+         tap->segment_valid = false;
+      }
+
+      tap_unsync(tap);
+   }
+
+   while (position < length)
+   {
+      current = lsn + position;
+
+      if (!tap->synced)
+      {
+         /* Page headers and records are only known from the start of a WAL segment */
+         if (current % tap->segsize != 0)
+         {
+            position += MIN(length - position, tap->segsize - current % tap->segsize);
+            continue;
+         }
+
+         tap->synced = true;
+      }
+
+      if (tap->header_size == 0 &&
+          (current % tap->segsize == 0 || (tap->block_size > 0 && current % tap->block_size == 0)))
+      {
+         if (current % tap->segsize == 0)
+         {
+            tap->header_size = SIZE_OF_XLOG_LONG_PHD;
+
+            /* A record that continues here belongs to the previous WAL segment */
+            if (tap->copied == 0)
+            {
+               tap_segment(tap, current / tap->segsize);
+            }
+         }
+         else
+         {
+            tap->header_size = SIZE_OF_XLOG_SHORT_PHD;
+         }
+
+         tap->header_length = 0;
+      }
+
+      if (tap->header_size > 0)
+      {
+         n = MIN(length - position, tap->header_size - tap->header_length);
+         memcpy(tap->header + tap->header_length, data + position, n);
+         tap->header_length += n;
+         position += n;
+
+         if (tap->header_length == tap->header_size)
+         {
+            tap->header_size = 0;
+
+            if (tap_page_header(tap, current + n - tap->header_length))
+            {
+               tap_error(tap);
+            }
+         }
+
+         continue;
+      }
+
+      page_end = (current / tap->block_size + 1) * tap->block_size;
+      n = MIN(length - position, page_end - current);
+
+      if (tap->skip > 0)
+      {
+         n = MIN(n, tap->skip);
+         tap->skip -= n;
+         position += n;
+         continue;
+      }
+
+      if (tap->copied == 0)
+      {
+         /* Records are aligned */
+         if (current != MAXALIGN(current))
+         {
+            position += MIN(n, MAXALIGN(current) - current);
+            continue;
+         }
+
+         tap->record_lsn = current;
+      }
+
+      /* The length comes first, and it never crosses a page */
+      if (tap->record_length == 0)
+      {
+         n = MIN(n, sizeof(uint32_t) - tap->copied);
+      }
+      else
+      {
+         n = MIN(n, tap->record_length - tap->copied);
+      }
+
+      memcpy(tap->record + tap->copied, data + position, n);
+      tap->copied += n;
+      position += n;
+
+      if (tap->record_length == 0 && tap->copied == sizeof(uint32_t))
+      {
+         memcpy(&tap->record_length, tap->record, sizeof(uint32_t));
+
+         if (tap->record_length == 0)
+         {
+            /* The rest of the WAL segment is empty */
+            tap_unsync(tap);
+            continue;
+         }
+
+         if (tap->record_length < SIZE_OF_XLOG_RECORD || tap->record_length > WAL_TAP_MAX_RECORD_SIZE)
+         {
+            pgmoneta_log_error("WAL tap: Invalid record length %u at %X/%X", tap->record_length,
+                               LSN_FORMAT_ARGS(tap->record_lsn));
+            tap_error(tap);
+            continue;
+         }
+
+         if (tap->record_length > tap->record_size)
+         {
+            char* record = (char*)realloc(tap->record, tap->record_length);
+
+            if (record == NULL)
+            {
+               goto error;
+            }
+
+            tap->record = record;
+            tap->record_size = tap->record_length;
+         }
+      }
+
+      if (tap->record_length > 0 && tap->copied == tap->record_length)
+      {
+         if (tap_record(tap, lsn + position))
+         {
+            tap_error(tap);
+         }
+      }
+   }
+
+   tap->lsn = lsn + length;
+
+   return 0;
+
+error:
+   tap->lsn = lsn + length;
+
+   return 1;
+}
+
+void
+pgmoneta_wal_tap_destroy(struct wal_tap* tap)
+{
+   if (tap == NULL)
+   {
+      return;
+   }
+
+   tap_flush(tap);
+
+   pgmoneta_wal_iterator_destroy(tap->iterator);
+   free(tap->record);
+   free(tap->directory);
+   free(tap);
+}
+
+int
+pgmoneta_wal_tap_merge(int server, char* directory)
+{
+   char buffer[8192];
+   char name[WAL_SEGMENT_NAME_SIZE + 1];
+   char* data = NULL;
+   char* line = NULL;
+   char* saveptr = NULL;
+   char* path = NULL;
+   char* names_data = NULL;
+   char** names = NULL;
+   ssize_t r = 0;
+   int fd = -1;
+   int indexed = 0;
+   int verified = 0;
+   int number_of_lines = 0;
+   int number_of_entries = 0;
+   int number_of_names = 0;
+   struct wal_time_entry entry;
+   struct wal_time_entry* entries = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   /* The WAL receiver only waits for the journal while it is read */
+   fd = lock_journal(server, O_RDWR, &path);
+   if (fd == -1)
+   {
+      pgmoneta_log_error("WAL tap: Could not lock %s", path);
+      goto error;
+   }
+
+   while ((r = read(fd, &buffer[0], sizeof(buffer) - 1)) > 0)
+   {
+      buffer[r] = '\0';
+      data = pgmoneta_append(data, &buffer[0]);
+   }
+
+   if (r == -1)
+   {
+      pgmoneta_log_error("WAL tap: Could not read %s", path);
+      goto error;
+   }
+
+   /* A segment that is lost from the journal is read from its file instead */
+   if (ftruncate(fd, 0) == -1)
+   {
+      pgmoneta_log_error("WAL tap: Could not truncate %s", path);
+      goto error;
+   }
+
+   close(fd);
+   fd = -1;
+
+   if (data == NULL)
+   {
+      free(path);
+
+      return 0;
+   }
+
+   for (char* c = data; *c != '\0'; c++)
+   {
+      if (*c == '\n')
+      {
+         number_of_lines++;
+      }
+   }
+
+   entries = (struct wal_time_entry*)calloc(number_of_lines + 1, sizeof(struct wal_time_entry));
+   names = (char**)calloc(number_of_lines + 1, sizeof(char*));
+   names_data = (char*)calloc(number_of_lines + 1, WAL_SEGMENT_NAME_SIZE + 1);
+
+   if (entries == NULL || names == NULL || names_data == NULL)
+   {
+      goto error;
+   }
+
+   line = strtok_r(data, "\n", &saveptr);
+   while (line != NULL)
+   {
+      memset(&name[0], 0, sizeof(name));
+      memset(&entry, 0, sizeof(struct wal_time_entry));
+
+      if (sscanf(line, "%24s %d %d %u %" SCNu64 " %" SCNd64 " %" SCNd64 " %" SCNu64 " %u %" SCNd64,
+                 &name[0], &indexed, &verified, &entry.timeline, &entry.start, &entry.first,
+                 &entry.last, &entry.end, &entry.transactions, &entry.checkpoint) != 10 ||
+          strlen(&name[0]) != WAL_SEGMENT_NAME_SIZE)
+      {
+         pgmoneta_log_warn("WAL tap: Invalid line in %s", path);
+      }
+      else
+      {
+         if (indexed)
+         {
+            memcpy(&entry.segment[0], &name[0], sizeof(name));
+            memcpy(&entries[number_of_entries++], &entry, sizeof(struct wal_time_entry));
+         }
+
+         if (verified)
+         {
+            names[number_of_names] = names_data + number_of_names * (WAL_SEGMENT_NAME_SIZE + 1);
+            memcpy(names[number_of_names], &name[0], sizeof(name));
+            number_of_names++;
+         }
+      }
+
+      line = strtok_r(NULL, "\n", &saveptr);
+   }
+
+   if (number_of_entries > 0 && pgmoneta_wal_time_index_add(server, directory, number_of_entries, entries))
+   {
+      pgmoneta_log_warn("WAL tap: Could not add to the time index of %s", config->servers[server].name);
+   }
+
+   if (number_of_names > 0 && pgmoneta_wal_verify_add(server, directory, number_of_names, names))
+   {
+      pgmoneta_log_warn("WAL tap: Could not add to the verified WAL of %s", config->servers[server].name);
+   }
+
+   free(entries);
+   free(names);
+   free(names_data);
+   free(data);
+   free(path);
+
+   return 0;
+
+error:
+   if (fd != -1)
+   {
+      close(fd);
+   }
+
+   free(entries);
+   free(names);
+   free(names_data);
+   free(data);
+   free(path);
+
+   return 1;
+}
+
+static int
+tap_page_header(struct wal_tap* tap, xlog_rec_ptr lsn)
+{
+   struct xlog_page_header_data* page_header = (struct xlog_page_header_data*)tap->header;
+   struct xlog_long_page_header_data* long_header = (struct xlog_long_page_header_data*)tap->header;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (lsn % tap->segsize == 0)
+   {
+      if (!(page_header->xlp_info & XLP_LONG_HEADER) ||
+          long_header->xlp_seg_size != tap->segsize ||
+          long_header->xlp_xlog_blcksz < SIZE_OF_XLOG_LONG_PHD ||
+          (long_header->xlp_xlog_blcksz & (long_header->xlp_xlog_blcksz - 1)) != 0 ||
+          (tap->block_size != 0 && long_header->xlp_xlog_blcksz != tap->block_size))
+      {
+         pgmoneta_log_error("WAL tap: Invalid long page header at %X/%X", LSN_FORMAT_ARGS(lsn));
+         return 1;
+      }
+
+      if (tap->iterator == NULL)
+      {
+         if (pgmoneta_wal_iterator_create_stream(long_header->xlp_xlog_blcksz, &config->servers[tap->server], &tap->iterator))
+         {
+            return 1;
+         }
+
+         tap->iterator->verify = config->verify_wal;
+         tap->block_size = long_header->xlp_xlog_blcksz;
+         tap->magic = page_header->xlp_magic;
+      }
+   }
+
+   if (page_header->xlp_magic != tap->magic || page_header->xlp_pageaddr != lsn)
+   {
+      pgmoneta_log_error("WAL tap: Invalid page header at %X/%X", LSN_FORMAT_ARGS(lsn));
+      return 1;
+   }
+
+   tap->skip = 0;
+
+   if (page_header->xlp_info & XLP_FIRST_IS_CONTRECORD)
+   {
+      if (tap->copied == 0)
+      {
+         /* The rest of a record that started before the tap did */
+         tap->skip = page_header->xlp_rem_len;
+      }
+      else if (page_header->xlp_rem_len != tap->record_length - tap->copied)
+      {
+         pgmoneta_log_error("WAL tap: Invalid continuation record at %X/%X", LSN_FORMAT_ARGS(lsn));
+         return 1;
+      }
+   }
+   else if (tap->copied > 0)
+   {
+      pgmoneta_log_error("WAL tap: Missing continuation record at %X/%X", LSN_FORMAT_ARGS(lsn));
+      return 1;
+   }
+
+   return 0;
+}
+
+static int
+tap_record(struct wal_tap* tap, xlog_rec_ptr end)
+{
+   uint32_t transactions = tap->entry.transactions;
+   uint32_t rec_len = 0;
+   uint32_t fpi_len = 0;
+   uint8_t info = 0;
+   bool switched = false;
+   struct decoded_xlog_record* record = NULL;
+   struct server* server_info = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+   server_info = &config->servers[tap->server];
+
+   if (pgmoneta_wal_iterator_decode(tap->iterator, tap->record, tap->record_lsn, MAXALIGN(end)))
+   {
+      return 1;
+   }
+
+   record = tap->iterator->record;
+
+   pgmoneta_wal_get_record_length(record, &rec_len, &fpi_len);
+
+   atomic_fetch_add(&server_info->wal_decoded_records, 1);
+   atomic_fetch_add(&server_info->wal_decoded_bytes, rec_len);
+   atomic_fetch_add(&server_info->wal_decoded_fpi_bytes, fpi_len);
+
+   if (pgmoneta_wal_time_index_record(&tap->entry, record))
+   {
+      return 1;
+   }
+
+   if (tap->entry.transactions != transactions)
+   {
+      atomic_store(&server_info->wal_last_commit_time, tap->entry.last / USECS_PER_SEC + POSTGRES_EPOCH_SECS);
+   }
+
+   info = record->header.xl_info & ~XLR_INFO_MASK;
+   switched = record->header.xl_rmid == RM_XLOG_ID && info == XLOG_SWITCH;
+
+   tap_reset_record(tap);
+
+   /* The WAL segment is complete once its last record is */
+   if ((end - 1) / tap->segsize != tap->segno)
+   {
+      tap_segment(tap, (end - 1) / tap->segsize);
+   }
+
+   /* The rest of the WAL segment is empty */
+   if (switched)
+   {
+      tap_unsync(tap);
+   }
+
+   return 0;
+}
+
+static void
+tap_segment(struct wal_tap* tap, xlog_seg_no segno)
+{
+   uint64_t segments_per_id = 0;
+   struct wal_tap_segment* segment = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (tap->segment_open && tap->segno == segno)
+   {
+      return;
+   }
+
+   if (tap->segment_open && tap->segment_valid && (config->wal_time_index || config->verify_wal))
+   {
+      if (tap->number_of_pending == WAL_TAP_PENDING)
+      {
+         /* The WAL processing reads the oldest WAL segment from its file instead */
+         memmove(&tap->pending[0], &tap->pending[1], (WAL_TAP_PENDING - 1) * sizeof(struct wal_tap_segment));
+         tap->number_of_pending--;
+      }
+
+      segment = &tap->pending[tap->number_of_pending++];
+      memset(segment, 0, sizeof(struct wal_tap_segment));
+
+      segments_per_id = 0x100000000ULL / tap->segsize;
+      snprintf(&segment->name[0], sizeof(segment->name), "%08X%08X%08X", tap->timeline,
+               (uint32_t)(tap->segno / segments_per_id), (uint32_t)(tap->segno % segments_per_id));
+
+      segment->indexed = config->wal_time_index;
+      segment->verified = config->verify_wal && tap->iterator->verify;
+
+      memcpy(&segment->entry, &tap->entry, sizeof(struct wal_time_entry));
+      memcpy(&segment->entry.segment[0], &segment->name[0], sizeof(segment->name));
+      segment->entry.timeline = tap->timeline;
+      segment->entry.start = tap->segno * tap->segsize;
+
+      tap_flush(tap);
+   }
+
+   tap->segno = segno;
+   tap->segment_open = true;
+   tap->segment_valid = true;
+   memset(&tap->entry, 0, sizeof(struct wal_time_entry));
+}
+
+static void
+tap_flush(struct wal_tap* tap)
+{
+   char line[MISC_LENGTH];
+   char* lines = NULL;
+   char* path = NULL;
+   size_t length = 0;
+   int fd = -1;
+   struct wal_time_entry* entry = NULL;
+
+   if (tap->number_of_pending == 0)
+   {
+      return;
+   }
+
+   for (int i = 0; i < tap->number_of_pending; i++)
+   {
+      entry = &tap->pending[i].entry;
+
+      memset(&line[0], 0, sizeof(line));
+      snprintf(&line[0], sizeof(line), "%s %d %d %u %" PRIu64 " %" PRId64 " %" PRId64 " %" PRIu64 " %u %" PRId64 "\n",
+               &tap->pending[i].name[0], tap->pending[i].indexed ? 1 : 0, tap->pending[i].verified ? 1 : 0,
+               entry->timeline, entry->start, entry->first, entry->last, entry->end,
+               entry->transactions, entry->checkpoint);
+
+      lines = pgmoneta_append(lines, &line[0]);
+   }
+
+   length = strlen(lines);
+
+   /* Retried after the next WAL segment, if the journal can't be written */
+   fd = lock_journal(tap->server, O_WRONLY | O_APPEND, &path);
+   if (fd == -1)
+   {
+      pgmoneta_log_warn("WAL tap: Could not lock %s", path);
+      goto error;
+   }
+
+   if (write(fd, lines, length) != (ssize_t)length)
+   {
+      pgmoneta_log_warn("WAL tap: Could not write %s", path);
+      goto error;
+   }
+
+   close(fd);
+   free(lines);
+   free(path);
+
+   tap->number_of_pending = 0;
+
+   return;
+
+error:
+   if (fd != -1)
+   {
+      close(fd);
+   }
+
+   free(lines);
+   free(path);
+}
+
+static void
+tap_error(struct wal_tap* tap)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   atomic_fetch_add(&config->servers[tap->server].wal_decode_errors, 1);
+
+   tap->segment_valid = false;
+   tap_unsync(tap);
+}
+
+static void
+tap_unsync(struct wal_tap* tap)
+{
+   tap->synced = false;
+   tap->header_size = 0;
+   tap->header_length = 0;
+   tap->skip = 0;
+   tap_reset_record(tap);
+}
+
+static void
+tap_reset_record(struct wal_tap* tap)
+{
+   tap->record_length = 0;
+   tap->copied = 0;
+
+   if (tap->record_size > WAL_TAP_RECORD_SIZE)
+   {
+      char* record = (char*)realloc(tap->record, WAL_TAP_RECORD_SIZE);
+
+      if (record != NULL)
+      {
+         tap->record = record;
+         tap->record_size = WAL_TAP_RECORD_SIZE;
+      }
+   }
+}
+
+static int
+lock_journal(int server, int flags, char** path)
+{
+   int fd = -1;
+
+   *path = pgmoneta_get_server(server);
+   *path = pgmoneta_append(*path, "wal_tap.journal");
+
+   fd = open(*path, flags | O_CREAT, 0600);
+   if (fd == -1)
+   {
+      goto error;
+   }
+
+   /* The lock is released by the kernel when the descriptor is closed */
+   if (flock(fd, LOCK_EX) == -1)
+   {
+      goto error;
+   }
+
+   return fd;
+
+error:
+   if (fd != -1)
+   {
+      close(fd);
+   }
+
+   return -1;
+}
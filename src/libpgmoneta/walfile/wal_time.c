@@ -0,0 +1,722 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <art.h>
+#include <logging.h>
+#include <utils.h>
+#include <value.h>
+#include <walfile/pg_control.h>
+#include <walfile/rm.h>
+#include <walfile/rm_xact.h>
+#include <walfile/rm_xlog.h>
+#include <walfile/wal_reader.h>
+#include <walfile/wal_scan.h>
+#include <walfile/wal_time.h>
+
+/* system */
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+/**
+ * @struct wal_time_build
+ * Defines the new entries of a time index
+ */
+struct wal_time_build
+{
+   int number_of_files;              /**< The number of WAL segments */
+   char** files;                     /**< The names of the WAL segments */
+   uint64_t segsize;                 /**< The size of a WAL segment */
+   int number_of_entries;            /**< The number of entries */
+   struct wal_time_entry* entries;   /**< The entries */
+};
+
+static void* time_create(void* data);
+static int time_record(void* state, struct decoded_xlog_record* record);
+static int time_merge(void* data, void* state);
+static void time_destroy(void* state);
+static char* get_index_path(int server);
+static int read_index(char* path, int* number_of_entries, struct wal_time_entry** entries);
+static int write_index(char* path, int number_of_entries, struct wal_time_entry* entries, int number_of_files, char** files);
+static int compare_entries(const void* a, const void* b);
+
+int
+pgmoneta_wal_time_index_update(int server, char* directory)
+{
+   int number_of_files = 0;
+   int number_of_entries = 0;
+   int number_of_new = 0;
+   int number_of_merged = 0;
+   uint64_t segsize = 0;
+   char name[WAL_SEGMENT_NAME_SIZE + 1];
+   char* path = NULL;
+   char** files = NULL;
+   char** new_files = NULL;
+   struct art* indexed = NULL;
+   struct wal_time_entry* entries = NULL;
+   struct wal_time_entry* all = NULL;
+   struct wal_time_build build;
+   struct wal_consumer consumer;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   memset(&build, 0, sizeof(struct wal_time_build));
+
+   segsize = (uint64_t)config->servers[server].wal_size;
+   if (segsize == 0)
+   {
+      pgmoneta_log_debug("WAL time index: The WAL segment size of %s isn't known yet", config->servers[server].name);
+      return 0;
+   }
+
+   path = get_index_path(server);
+
+   if (read_index(path, &number_of_entries, &entries))
+   {
+      pgmoneta_log_warn("WAL time index: Could not read %s", path);
+   }
+
+   if (pgmoneta_art_create(&indexed))
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < number_of_entries; i++)
+   {
+      pgmoneta_art_insert(indexed, (unsigned char*)entries[i].segment, strlen(entries[i].segment) + 1, (uintptr_t)true, ValueBool);
+   }
+
+   if (pgmoneta_get_wal_files(directory, &number_of_files, &files))
+   {
+      goto error;
+   }
+
+   if (number_of_files > 0)
+   {
+      new_files = (char**)calloc(number_of_files, sizeof(char*));
+      if (new_files == NULL)
+      {
+         goto error;
+      }
+   }
+
+   /* Compressed and encrypted WAL segments are decoded in memory */
+   for (int i = 0; i < number_of_files; i++)
+   {
+      if (!pgmoneta_wal_is_segment(files[i]))
+      {
+         continue;
+      }
+
+      memset(&name[0], 0, sizeof(name));
+      memcpy(&name[0], files[i], WAL_SEGMENT_NAME_SIZE);
+
+      /* A WAL segment that is both streamed and archived is indexed once */
+      if (!pgmoneta_art_contains_key(indexed, (unsigned char*)&name[0], strlen(&name[0]) + 1))
+      {
+         new_files[number_of_new++] = files[i];
+         pgmoneta_art_insert(indexed, (unsigned char*)&name[0], strlen(&name[0]) + 1, (uintptr_t)true, ValueBool);
+      }
+   }
+
+   if (number_of_new > 0)
+   {
+      build.number_of_files = number_of_new;
+      build.files = new_files;
+      build.segsize = segsize;
+      build.entries = (struct wal_time_entry*)calloc(number_of_new, sizeof(struct wal_time_entry));
+      if (build.entries == NULL)
+      {
+         goto error;
+      }
+
+      consumer.create = time_create;
+      consumer.record = time_record;
+      consumer.merge = time_merge;
+      consumer.destroy = time_destroy;
+      consumer.data = &build;
+
+      if (pgmoneta_wal_scan(server, directory, number_of_new, new_files, &consumer, &number_of_merged))
+      {
+         pgmoneta_log_error("WAL time index: Could not index the WAL of %s", config->servers[server].name);
+         goto error;
+      }
+
+      all = (struct wal_time_entry*)malloc((number_of_entries + build.number_of_entries) * sizeof(struct wal_time_entry));
+      if (all == NULL)
+      {
+         goto error;
+      }
+
+      if (number_of_entries > 0)
+      {
+         memcpy(all, entries, number_of_entries * sizeof(struct wal_time_entry));
+      }
+      memcpy(all + number_of_entries, build.entries, build.number_of_entries * sizeof(struct wal_time_entry));
+
+      if (write_index(path, number_of_entries + build.number_of_entries, all, number_of_files, files))
+      {
+         pgmoneta_log_error("WAL time index: Could not write %s", path);
+         goto error;
+      }
+
+      pgmoneta_log_debug("WAL time index: %s: %d segments", config->servers[server].name, number_of_merged);
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+   free(new_files);
+   free(entries);
+   free(build.entries);
+   free(all);
+   pgmoneta_art_destroy(indexed);
+   free(path);
+
+   return 0;
+
+error:
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+   free(new_files);
+   free(entries);
+   free(build.entries);
+   free(all);
+   pgmoneta_art_destroy(indexed);
+   free(path);
+
+   return 1;
+}
+
+int
+pgmoneta_wal_time_index_add(int server, char* directory, int number_of_new, struct wal_time_entry* new_entries)
+{
+   int number_of_files = 0;
+   int number_of_entries = 0;
+   int number_of_all = 0;
+   char* path = NULL;
+   char** files = NULL;
+   struct art* indexed = NULL;
+   struct wal_time_entry* entries = NULL;
+   struct wal_time_entry* all = NULL;
+
+   if (number_of_new <= 0)
+   {
+      return 0;
+   }
+
+   path = get_index_path(server);
+
+   if (read_index(path, &number_of_entries, &entries))
+   {
+      pgmoneta_log_warn("WAL time index: Could not read %s", path);
+   }
+
+   if (pgmoneta_art_create(&indexed))
+   {
+      goto error;
+   }
+
+   all = (struct wal_time_entry*)malloc((number_of_entries + number_of_new) * sizeof(struct wal_time_entry));
+   if (all == NULL)
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < number_of_entries; i++)
+   {
+      pgmoneta_art_insert(indexed, (unsigned char*)entries[i].segment, strlen(entries[i].segment) + 1, (uintptr_t)true, ValueBool);
+      all[number_of_all++] = entries[i];
+   }
+
+   /* The WAL segment may have been indexed from its file already */
+   for (int i = 0; i < number_of_new; i++)
+   {
+      if (!pgmoneta_art_contains_key(indexed, (unsigned char*)new_entries[i].segment, strlen(new_entries[i].segment) + 1))
+      {
+         pgmoneta_art_insert(indexed, (unsigned char*)new_entries[i].segment, strlen(new_entries[i].segment) + 1, (uintptr_t)true, ValueBool);
+         all[number_of_all++] = new_entries[i];
+      }
+   }
+
+   if (number_of_all > number_of_entries)
+   {
+      if (pgmoneta_get_wal_files(directory, &number_of_files, &files))
+      {
+         goto error;
+      }
+
+      if (write_index(path, number_of_all, all, number_of_files, files))
+      {
+         pgmoneta_log_error("WAL time index: Could not write %s", path);
+         goto error;
+      }
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+   free(entries);
+   free(all);
+   pgmoneta_art_destroy(indexed);
+   free(path);
+
+   return 0;
+
+error:
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+   free(entries);
+   free(all);
+   pgmoneta_art_destroy(indexed);
+   free(path);
+
+   return 1;
+}
+
+int
+pgmoneta_wal_time_index_record(struct wal_time_entry* entry, struct decoded_xlog_record* record)
+{
+   return time_record(entry, record);
+}
+
+int
+pgmoneta_wal_time_index_read(int server, int* number_of_entries, struct wal_time_entry** entries)
+{
+   char* path = NULL;
+   int ret;
+
+   path = get_index_path(server);
+   ret = read_index(path, number_of_entries, entries);
+   free(path);
+
+   return ret;
+}
+
+int
+pgmoneta_wal_time_parse(char* str, timestamp_tz* time, bool* zone)
+{
+   int year = 0;
+   int month = 0;
+   int day = 0;
+   int hour = 0;
+   int minute = 0;
+   int second = 0;
+   int hours = 0;
+   int minutes = 0;
+   int offset = 0;
+   int n = 0;
+   int64_t usecs = 0;
+   int64_t scale = 100000;
+   char* p = NULL;
+   struct tm tm;
+   time_t t;
+
+   *time = 0;
+   *zone = false;
+
+   if (str == NULL ||
+       sscanf(str, "%4d-%2d-%2d%*1[ T]%2d:%2d:%2d%n", &year, &month, &day, &hour, &minute, &second, &n) != 6)
+   {
+      return 1;
+   }
+
+   p = str + n;
+
+   if (*p == '.')
+   {
+      p++;
+      while (isdigit((unsigned char)*p))
+      {
+         usecs += (*p - '0') * scale;
+         scale /= 10;
+         p++;
+      }
+   }
+
+   while (*p == ' ')
+   {
+      p++;
+   }
+
+   if (*p == '\0')
+   {
+      /* The time zone of the server isn't known */
+   }
+   else if (!strcmp(p, "Z") || !strcasecmp(p, "UTC") || !strcasecmp(p, "GMT"))
+   {
+      *zone = true;
+   }
+   else if ((*p == '+' || *p == '-') && isdigit((unsigned char)*(p + 1)) && isdigit((unsigned char)*(p + 2)))
+   {
+      hours = (*(p + 1) - '0') * 10 + (*(p + 2) - '0');
+
+      if (*(p + 3) == ':')
+      {
+         n = sscanf(p + 4, "%2d", &minutes) == 1 ? 6 : -1;
+      }
+      else if (*(p + 3) != '\0')
+      {
+         n = sscanf(p + 3, "%2d", &minutes) == 1 ? 5 : -1;
+      }
+      else
+      {
+         n = 3;
+      }
+
+      if (n < 0 || strlen(p) != (size_t)n || hours > 15 || minutes > 59)
+      {
+         return 1;
+      }
+
+      offset = hours * 3600 + minutes * 60;
+      if (*p == '-')
+      {
+         offset = -offset;
+      }
+
+      *zone = true;
+   }
+   else
+   {
+      return 1;
+   }
+
+   memset(&tm, 0, sizeof(struct tm));
+   tm.tm_year = year - 1900;
+   tm.tm_mon = month - 1;
+   tm.tm_mday = day;
+   tm.tm_hour = hour;
+   tm.tm_min = minute;
+   tm.tm_sec = second;
+
+   t = timegm(&tm);
+   if (t == (time_t)-1)
+   {
+      return 1;
+   }
+
+   *time = ((int64_t)t - offset - POSTGRES_EPOCH_SECS) * USECS_PER_SEC + usecs;
+
+   return 0;
+}
+
+static void*
+time_create(void* data)
+{
+   return calloc(1, sizeof(struct wal_time_entry));
+}
+
+static int
+time_record(void* state, struct decoded_xlog_record* record)
+{
+   struct wal_time_entry* entry = (struct wal_time_entry*)state;
+   uint8_t info = record->header.xl_info & ~XLR_INFO_MASK;
+   timestamp_tz time = 0;
+
+   if (record->header.xl_rmid == RM_XACT_ID)
+   {
+      info &= XLOG_XACT_OPMASK;
+
+      /* Recovery to a time target stops at these records */
+      if ((info == XLOG_XACT_COMMIT || info == XLOG_XACT_COMMIT_PREPARED ||
+           info == XLOG_XACT_ABORT || info == XLOG_XACT_ABORT_PREPARED) &&
+          record->main_data != NULL && record->main_data_len >= sizeof(timestamp_tz))
+      {
+         memcpy(&time, record->main_data, sizeof(timestamp_tz));
+
+         if (entry->transactions == 0 || time < entry->first)
+         {
+            entry->first = time;
+         }
+         if (entry->transactions == 0 || time > entry->last)
+         {
+            entry->last = time;
+         }
+         if (record->next_lsn > entry->end)
+         {
+            entry->end = record->next_lsn;
+         }
+         entry->transactions++;
+      }
+   }
+   else if (record->header.xl_rmid == RM_XLOG_ID &&
+            (info == XLOG_CHECKPOINT_SHUTDOWN || info == XLOG_CHECKPOINT_ONLINE) &&
+            record->main_data != NULL &&
+            record->main_data_len >= (server_config->version >= 17 ? sizeof(struct check_point_v17) : sizeof(struct check_point_v16)))
+   {
+      struct check_point* checkpoint = create_check_point();
+      pg_time_t t;
+
+      if (checkpoint == NULL)
+      {
+         return 1;
+      }
+
+      checkpoint->parse(checkpoint, record->main_data);
+      t = server_config->version >= 17 ? checkpoint->data.v17.time : checkpoint->data.v16.time;
+      free(checkpoint);
+
+      entry->checkpoint = ((int64_t)t - POSTGRES_EPOCH_SECS) * USECS_PER_SEC;
+   }
+
+   return 0;
+}
+
+static int
+time_merge(void* data, void* state)
+{
+   struct wal_time_build* build = (struct wal_time_build*)data;
+   struct wal_time_entry* entry = &build->entries[build->number_of_entries];
+   char* name = build->files[build->number_of_entries];
+   uint32_t log = 0;
+   uint32_t seg = 0;
+
+   memcpy(entry, state, sizeof(struct wal_time_entry));
+
+   if (sscanf(name, "%08X%08X%08X", &entry->timeline, &log, &seg) != 3)
+   {
+      return 1;
+   }
+
+   memcpy(entry->segment, name, WAL_SEGMENT_NAME_SIZE);
+   entry->start = ((uint64_t)log << 32) + (uint64_t)seg * build->segsize;
+
+   build->number_of_entries++;
+
+   return 0;
+}
+
+static void
+time_destroy(void* state)
+{
+   free(state);
+}
+
+static char*
+get_index_path(int server)
+{
+   char* path = NULL;
+
+   path = pgmoneta_get_server(server);
+   path = pgmoneta_append(path, "wal_time_index");
+
+   return path;
+}
+
+static int
+read_index(char* path, int* number_of_entries, struct wal_time_entry** entries)
+{
+   char line[MISC_LENGTH * 2];
+   int n = 0;
+   int size = 0;
+   uint32_t start_hi = 0;
+   uint32_t start_lo = 0;
+   uint32_t end_hi = 0;
+   uint32_t end_lo = 0;
+   FILE* file = NULL;
+   struct wal_time_entry* array = NULL;
+   struct wal_time_entry entry;
+
+   *number_of_entries = 0;
+   *entries = NULL;
+
+   if (!pgmoneta_exists(path))
+   {
+      return 0;
+   }
+
+   file = fopen(path, "r");
+   if (file == NULL)
+   {
+      goto error;
+   }
+
+   memset(&line[0], 0, sizeof(line));
+   while (fgets(&line[0], sizeof(line), file) != NULL)
+   {
+      memset(&entry, 0, sizeof(struct wal_time_entry));
+
+      if (sscanf(&line[0], "%24s %X/%X %X/%X %" SCNd64 " %" SCNd64 " %u %" SCNd64,
+                 &entry.segment[0], &start_hi, &start_lo, &end_hi, &end_lo,
+                 &entry.first, &entry.last, &entry.transactions, &entry.checkpoint) == 9 &&
+          pgmoneta_wal_is_segment(&entry.segment[0]) &&
+          sscanf(&entry.segment[0], "%08X", &entry.timeline) == 1)
+      {
+         entry.start = ((uint64_t)start_hi << 32) + start_lo;
+         entry.end = ((uint64_t)end_hi << 32) + end_lo;
+
+         if (n == size)
+         {
+            struct wal_time_entry* a = NULL;
+
+            size = size == 0 ? 64 : size * 2;
+            a = (struct wal_time_entry*)realloc(array, size * sizeof(struct wal_time_entry));
+            if (a == NULL)
+            {
+               goto error;
+            }
+            array = a;
+         }
+
+         memcpy(&array[n++], &entry, sizeof(struct wal_time_entry));
+      }
+
+      memset(&line[0], 0, sizeof(line));
+   }
+
+   fclose(file);
+   file = NULL;
+
+   if (n > 0)
+   {
+      qsort(array, n, sizeof(struct wal_time_entry), compare_entries);
+   }
+
+   *number_of_entries = n;
+   *entries = array;
+
+   return 0;
+
+error:
+   if (file != NULL)
+   {
+      fclose(file);
+   }
+   free(array);
+
+   return 1;
+}
+
+static int
+write_index(char* path, int number_of_entries, struct wal_time_entry* entries, int number_of_files, char** files)
+{
+   char name[WAL_SEGMENT_NAME_SIZE + 1];
+   char* tmp = NULL;
+   FILE* file = NULL;
+   struct art* present = NULL;
+
+   /* Forget the WAL segments that were removed by retention */
+   if (pgmoneta_art_create(&present))
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      if (pgmoneta_wal_is_segment(files[i]))
+      {
+         memset(&name[0], 0, sizeof(name));
+         memcpy(&name[0], files[i], WAL_SEGMENT_NAME_SIZE);
+
+         pgmoneta_art_insert(present, (unsigned char*)&name[0], strlen(&name[0]) + 1, (uintptr_t)true, ValueBool);
+      }
+   }
+
+   qsort(entries, number_of_entries, sizeof(struct wal_time_entry), compare_entries);
+
+   tmp = pgmoneta_append(tmp, path);
+   tmp = pgmoneta_append(tmp, ".tmp");
+
+   file = fopen(tmp, "w");
+   if (file == NULL)
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < number_of_entries; i++)
+   {
+      if (pgmoneta_art_contains_key(present, (unsigned char*)entries[i].segment, strlen(entries[i].segment) + 1))
+      {
+         fprintf(file, "%s %X/%X %X/%X %" PRId64 " %" PRId64 " %u %" PRId64 "\n",
+                 entries[i].segment, LSN_FORMAT_ARGS(entries[i].start), LSN_FORMAT_ARGS(entries[i].end),
+                 entries[i].first, entries[i].last, entries[i].transactions, entries[i].checkpoint);
+      }
+   }
+
+   fflush(file);
+   fclose(file);
+   file = NULL;
+
+   /* The index is read by restores while it is updated */
+   if (rename(tmp, path))
+   {
+      goto error;
+   }
+
+   pgmoneta_art_destroy(present);
+   free(tmp);
+
+   return 0;
+
+error:
+   if (file != NULL)
+   {
+      fclose(file);
+   }
+   pgmoneta_art_destroy(present);
+   free(tmp);
+
+   return 1;
+}
+
+static int
+compare_entries(const void* a, const void* b)
+{
+   const struct wal_time_entry* x = (const struct wal_time_entry*)a;
+   const struct wal_time_entry* y = (const struct wal_time_entry*)b;
+
+   if (x->start != y->start)
+   {
+      return x->start < y->start ? -1 : 1;
+   }
+
+   if (x->timeline != y->timeline)
+   {
+      return x->timeline < y->timeline ? -1 : 1;
+   }
+
+   return 0;
+}
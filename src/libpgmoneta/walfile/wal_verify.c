@@ -0,0 +1,518 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <art.h>
+#include <logging.h>
+#include <utils.h>
+#include <value.h>
+#include <workers.h>
+#include <walfile/wal_reader.h>
+#include <walfile/wal_verify.h>
+
+/* system */
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @struct wal_segment_verify
+ * Defines the verification of a WAL segment
+ */
+struct wal_segment_verify
+{
+   char name[WAL_SEGMENT_NAME_SIZE + 1];  /**< The name of the WAL segment */
+   char* path;                              /**< The path of the WAL segment */
+   char* next_path;                         /**< The path of the next WAL segment */
+   struct server* server_info;              /**< The server */
+   uint64_t records;                        /**< The number of verified records */
+   bool corrupt;                            /**< Is the WAL segment corrupt */
+   bool incomplete;                         /**< Does the last record continue in a WAL segment that isn't completed */
+};
+
+static void verify_segment(void* arg);
+static int read_verified(char* path, struct art* verified);
+static int write_verified(char* path, struct art* verified, int number_of_files, char** files);
+
+int
+pgmoneta_wal_verify_segment(char* path, char* next_path, struct server* server_info, uint64_t* records, bool* incomplete)
+{
+   struct wal_iterator* iterator = NULL;
+
+   *records = 0;
+   *incomplete = false;
+
+   if (pgmoneta_wal_iterator_create(path, server_info, &iterator))
+   {
+      goto error;
+   }
+
+   iterator->follow = next_path;
+   iterator->verify = true;
+
+   while (pgmoneta_wal_iterator_next(iterator))
+   {
+      (*records)++;
+   }
+
+   if (iterator->error)
+   {
+      goto error;
+   }
+
+   if (iterator->incomplete)
+   {
+      /* A next WAL segment that doesn't continue this one is invalid */
+      if (next_path != NULL)
+      {
+         pgmoneta_log_error("WAL verify: %s doesn't continue %s", next_path, path);
+         goto error;
+      }
+
+      *incomplete = true;
+   }
+
+   pgmoneta_wal_iterator_destroy(iterator);
+
+   return 0;
+
+error:
+   pgmoneta_wal_iterator_destroy(iterator);
+
+   return 1;
+}
+
+int
+pgmoneta_wal_verify(int server, char* directory)
+{
+   char name[WAL_SEGMENT_NAME_SIZE + 1];
+   int number_of_files = 0;
+   int number_of_segments = 0;
+   int number_of_workers = 0;
+   int deferred = 0;
+   uint64_t records = 0;
+   bool corrupt = false;
+   char* path = NULL;
+   char** files = NULL;
+   struct art* verified = NULL;
+   struct wal_segment_verify* segments = NULL;
+   struct workers* workers = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   path = pgmoneta_get_server(server);
+   path = pgmoneta_append(path, "wal_verified");
+
+   if (pgmoneta_art_create(&verified))
+   {
+      goto error;
+   }
+
+   if (read_verified(path, verified))
+   {
+      pgmoneta_log_warn("WAL verify: Could not read %s", path);
+   }
+
+   if (pgmoneta_get_wal_files(directory, &number_of_files, &files))
+   {
+      goto error;
+   }
+
+   if (number_of_files > 0)
+   {
+      segments = (struct wal_segment_verify*)calloc(number_of_files, sizeof(struct wal_segment_verify));
+      if (segments == NULL)
+      {
+         goto error;
+      }
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      struct wal_segment_verify* segment = NULL;
+
+      /* Compressed and encrypted WAL segments are decoded in memory */
+      if (!pgmoneta_wal_is_segment(files[i]))
+      {
+         continue;
+      }
+
+      memset(&name[0], 0, sizeof(name));
+      memcpy(&name[0], files[i], WAL_SEGMENT_NAME_SIZE);
+
+      /* A WAL segment that is both streamed and archived is verified once */
+      if (pgmoneta_art_contains_key(verified, (unsigned char*)&name[0], strlen(&name[0]) + 1) ||
+          (number_of_segments > 0 && !strcmp(&name[0], segments[number_of_segments - 1].name)))
+      {
+         continue;
+      }
+
+      segment = &segments[number_of_segments++];
+
+      memcpy(&segment->name[0], &name[0], sizeof(name));
+      segment->path = pgmoneta_append(segment->path, directory);
+      if (!pgmoneta_ends_with(directory, "/"))
+      {
+         segment->path = pgmoneta_append_char(segment->path, '/');
+      }
+      segment->path = pgmoneta_append(segment->path, files[i]);
+      segment->next_path = pgmoneta_wal_get_next_segment(directory, files[i], config->servers[server].wal_size, number_of_files, files);
+      segment->server_info = &config->servers[server];
+   }
+
+   number_of_workers = MIN(pgmoneta_get_number_of_workers(server), number_of_segments);
+
+   if (number_of_workers > 1)
+   {
+      if (pgmoneta_workers_initialize(number_of_workers, &workers))
+      {
+         goto error;
+      }
+   }
+
+   for (int i = 0; i < number_of_segments; i++)
+   {
+      if (workers != NULL)
+      {
+         if (pgmoneta_workers_add(workers, verify_segment, &segments[i]))
+         {
+            verify_segment(&segments[i]);
+         }
+      }
+      else
+      {
+         verify_segment(&segments[i]);
+      }
+   }
+
+   if (workers != NULL)
+   {
+      pgmoneta_workers_wait(workers);
+      pgmoneta_workers_destroy(workers);
+      workers = NULL;
+   }
+
+   for (int i = 0; i < number_of_segments; i++)
+   {
+      if (segments[i].incomplete)
+      {
+         /* The last record is verified once the next WAL segment is completed */
+         deferred++;
+         continue;
+      }
+
+      if (segments[i].corrupt)
+      {
+         pgmoneta_log_error("WAL verify: %s/%s is corrupt", config->servers[server].name, segments[i].name);
+         atomic_fetch_add(&config->servers[server].wal_corrupt_segments, 1);
+         corrupt = true;
+      }
+      else
+      {
+         atomic_fetch_add(&config->servers[server].wal_verified_segments, 1);
+      }
+
+      pgmoneta_art_insert(verified, (unsigned char*)segments[i].name, strlen(segments[i].name) + 1,
+                          (uintptr_t)!segments[i].corrupt, ValueBool);
+      records += segments[i].records;
+   }
+
+   if (number_of_segments > deferred)
+   {
+      pgmoneta_log_debug("WAL verify: %s: %d segments, %" PRIu64 " records with %d workers",
+                         config->servers[server].name, number_of_segments - deferred, records, number_of_workers);
+
+      if (write_verified(path, verified, number_of_files, files))
+      {
+         pgmoneta_log_warn("WAL verify: Could not write %s", path);
+      }
+   }
+
+   for (int i = 0; i < number_of_segments; i++)
+   {
+      free(segments[i].path);
+      free(segments[i].next_path);
+   }
+   free(segments);
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+
+   pgmoneta_art_destroy(verified);
+   free(path);
+
+   return corrupt ? 1 : 0;
+
+error:
+   if (segments != NULL)
+   {
+      for (int i = 0; i < number_of_segments; i++)
+      {
+         free(segments[i].path);
+         free(segments[i].next_path);
+      }
+   }
+   free(segments);
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+
+   pgmoneta_art_destroy(verified);
+   free(path);
+
+   return 1;
+}
+
+int
+pgmoneta_wal_verify_add(int server, char* directory, int number_of_segments, char** names)
+{
+   int number_of_files = 0;
+   int added = 0;
+   char* path = NULL;
+   char** files = NULL;
+   struct art* verified = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (number_of_segments <= 0)
+   {
+      return 0;
+   }
+
+   path = pgmoneta_get_server(server);
+   path = pgmoneta_append(path, "wal_verified");
+
+   if (pgmoneta_art_create(&verified))
+   {
+      goto error;
+   }
+
+   if (read_verified(path, verified))
+   {
+      pgmoneta_log_warn("WAL verify: Could not read %s", path);
+   }
+
+   for (int i = 0; i < number_of_segments; i++)
+   {
+      if (!pgmoneta_art_contains_key(verified, (unsigned char*)names[i], strlen(names[i]) + 1))
+      {
+         pgmoneta_art_insert(verified, (unsigned char*)names[i], strlen(names[i]) + 1, (uintptr_t)true, ValueBool);
+         atomic_fetch_add(&config->servers[server].wal_verified_segments, 1);
+         added++;
+      }
+   }
+
+   if (added > 0)
+   {
+      if (pgmoneta_get_wal_files(directory, &number_of_files, &files))
+      {
+         goto error;
+      }
+
+      if (write_verified(path, verified, number_of_files, files))
+      {
+         pgmoneta_log_warn("WAL verify: Could not write %s", path);
+      }
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+
+   pgmoneta_art_destroy(verified);
+   free(path);
+
+   return 0;
+
+error:
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+
+   pgmoneta_art_destroy(verified);
+   free(path);
+
+   return 1;
+}
+
+int
+pgmoneta_wal_verify_read(int server, struct art** verified)
+{
+   char* path = NULL;
+   struct art* v = NULL;
+
+   *verified = NULL;
+
+   path = pgmoneta_get_server(server);
+   path = pgmoneta_append(path, "wal_verified");
+
+   if (pgmoneta_art_create(&v))
+   {
+      goto error;
+   }
+
+   if (read_verified(path, v))
+   {
+      goto error;
+   }
+
+   *verified = v;
+
+   free(path);
+
+   return 0;
+
+error:
+   pgmoneta_art_destroy(v);
+   free(path);
+
+   return 1;
+}
+
+static void
+verify_segment(void* arg)
+{
+   struct wal_segment_verify* segment = (struct wal_segment_verify*)arg;
+
+   if (pgmoneta_wal_verify_segment(segment->path, segment->next_path, segment->server_info, &segment->records, &segment->incomplete))
+   {
+      segment->corrupt = true;
+   }
+}
+
+static int
+read_verified(char* path, struct art* verified)
+{
+   char line[MISC_LENGTH];
+   char name[MISC_LENGTH];
+   char state[MISC_LENGTH];
+   FILE* file = NULL;
+
+   if (!pgmoneta_exists(path))
+   {
+      return 0;
+   }
+
+   file = fopen(path, "r");
+   if (file == NULL)
+   {
+      goto error;
+   }
+
+   memset(&line[0], 0, sizeof(line));
+   while (fgets(&line[0], sizeof(line), file) != NULL)
+   {
+      memset(&name[0], 0, sizeof(name));
+      memset(&state[0], 0, sizeof(state));
+
+      if (sscanf(&line[0], "%127s %127s", &name[0], &state[0]) == 2 && pgmoneta_wal_is_segment(&name[0]))
+      {
+         pgmoneta_art_insert(verified, (unsigned char*)&name[0], strlen(&name[0]) + 1,
+                             (uintptr_t)!strcmp(&state[0], "valid"), ValueBool);
+      }
+
+      memset(&line[0], 0, sizeof(line));
+   }
+
+   fclose(file);
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+static int
+write_verified(char* path, struct art* verified, int number_of_files, char** files)
+{
+   char name[WAL_SEGMENT_NAME_SIZE + 1];
+   FILE* file = NULL;
+   struct art* present = NULL;
+   struct art_iterator* iter = NULL;
+
+   /* Forget the WAL segments that were removed by retention */
+   if (pgmoneta_art_create(&present))
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      if (pgmoneta_wal_is_segment(files[i]))
+      {
+         memset(&name[0], 0, sizeof(name));
+         memcpy(&name[0], files[i], WAL_SEGMENT_NAME_SIZE);
+
+         pgmoneta_art_insert(present, (unsigned char*)&name[0], strlen(&name[0]) + 1, (uintptr_t)true, ValueBool);
+      }
+   }
+
+   file = fopen(path, "w");
+   if (file == NULL)
+   {
+      goto error;
+   }
+
+   pgmoneta_art_iterator_create(verified, &iter);
+   while (pgmoneta_art_iterator_next(iter))
+   {
+      if (pgmoneta_art_contains_key(present, iter->key, strlen((char*)iter->key) + 1))
+      {
+         fprintf(file, "%s %s\n", (char*)iter->key, (bool)iter->value->data ? "valid" : "corrupt");
+      }
+   }
+   pgmoneta_art_iterator_destroy(iter);
+
+   fflush(file);
+   fclose(file);
+
+   pgmoneta_art_destroy(present);
+
+   return 0;
+
+error:
+   pgmoneta_art_destroy(present);
+
+   return 1;
+}
@@ -37,6 +37,7 @@
 #include <security.h>
 #include <server.h>
 #include <tablespace.h>
+#include <tar_storage.h>
 #include <utils.h>
 #include <workflow.h>
 
@@ -329,7 +330,17 @@ basebackup_execute(int server, char* identifier, struct deque* nodes)
 
    d = pgmoneta_get_server_backup_identifier_data(server, identifier);
 
-   size = pgmoneta_directory_size(d);
+   if (pgmoneta_tar_storage_exists(d))
+   {
+      uint64_t tar_size = 0;
+
+      pgmoneta_tar_storage_size(d, &tar_size);
+      size = (unsigned long)tar_size;
+   }
+   else
+   {
+      size = pgmoneta_directory_size(d);
+   }
    pgmoneta_read_wal(d, &wal);
    pgmoneta_read_checkpoint_info(d, &chkptpos);
 
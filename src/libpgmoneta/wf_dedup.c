@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <dedup.h>
+#include <logging.h>
+#include <utils.h>
+#include <workers.h>
+#include <workflow.h>
+
+/* system */
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int dedup_setup(int, char*, struct deque*);
+static int dedup_execute(int, char*, struct deque*);
+static int dedup_teardown(int, char*, struct deque*);
+
+struct workflow*
+pgmoneta_workflow_create_dedup(void)
+{
+   struct workflow* wf = NULL;
+
+   wf = (struct workflow*)malloc(sizeof(struct workflow));
+
+   if (wf == NULL)
+   {
+      return NULL;
+   }
+
+   wf->setup = &dedup_setup;
+   wf->execute = &dedup_execute;
+   wf->teardown = &dedup_teardown;
+   wf->next = NULL;
+
+   return wf;
+}
+
+static int
+dedup_setup(int server, char* identifier, struct deque* nodes)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   pgmoneta_log_debug("Deduplication (setup): %s/%s", config->servers[server].name, identifier);
+   pgmoneta_deque_list(nodes);
+
+   return 0;
+}
+
+static int
+dedup_execute(int server, char* identifier, struct deque* nodes)
+{
+   char* root = NULL;
+   char* to = NULL;
+   char* tablespace = NULL;
+   DIR* dir = NULL;
+   struct dirent* entry;
+   time_t dedup_time;
+   int total_seconds;
+   int hours;
+   int minutes;
+   int seconds;
+   char elapsed[128];
+   int number_of_workers = 0;
+   struct workers* workers = NULL;
+   struct dedup_statistics statistics;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   pgmoneta_log_debug("Deduplication (execute): %s/%s", config->servers[server].name, identifier);
+   pgmoneta_deque_list(nodes);
+
+   dedup_time = time(NULL);
+
+   memset(&statistics, 0, sizeof(struct dedup_statistics));
+
+   root = (char*)pgmoneta_deque_get(nodes, "root");
+   to = (char*)pgmoneta_deque_get(nodes, "to");
+
+   number_of_workers = pgmoneta_get_number_of_workers(server);
+   if (number_of_workers > 0)
+   {
+      pgmoneta_workers_initialize(number_of_workers, &workers);
+   }
+
+   if (pgmoneta_dedup_directory(server, to, &statistics, workers))
+   {
+      goto error;
+   }
+
+   /* The tablespaces are next to the data directory */
+   if (root != NULL && (dir = opendir(root)) != NULL)
+   {
+      while ((entry = readdir(dir)) != NULL)
+      {
+         if (entry->d_type != DT_DIR || !strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") ||
+             !strcmp(entry->d_name, "data"))
+         {
+            continue;
+         }
+
+         tablespace = pgmoneta_append(tablespace, root);
+         if (!pgmoneta_ends_with(tablespace, "/"))
+         {
+            tablespace = pgmoneta_append(tablespace, "/");
+         }
+         tablespace = pgmoneta_append(tablespace, entry->d_name);
+
+         if (pgmoneta_dedup_directory(server, tablespace, &statistics, workers))
+         {
+            goto error;
+         }
+
+         free(tablespace);
+         tablespace = NULL;
+      }
+
+      closedir(dir);
+      dir = NULL;
+   }
+
+   if (number_of_workers > 0)
+   {
+      pgmoneta_workers_wait(workers);
+      pgmoneta_workers_destroy(workers);
+   }
+
+   total_seconds = (int)difftime(time(NULL), dedup_time);
+   hours = total_seconds / 3600;
+   minutes = (total_seconds % 3600) / 60;
+   seconds = total_seconds % 60;
+
+   memset(&elapsed[0], 0, sizeof(elapsed));
+   sprintf(&elapsed[0], "%02i:%02i:%02i", hours, minutes, seconds);
+
+   pgmoneta_log_debug("Deduplication: %s/%s (Elapsed: %s)", config->servers[server].name, identifier, &elapsed[0]);
+   pgmoneta_log_info("Deduplication: %s/%s %lu files, %lu of %lu chunks stored (%lu of %lu bytes)",
+                     config->servers[server].name, identifier,
+                     atomic_load(&statistics.files),
+                     atomic_load(&statistics.new_chunks), atomic_load(&statistics.chunks),
+                     atomic_load(&statistics.new_bytes), atomic_load(&statistics.bytes));
+
+   return 0;
+
+error:
+
+   if (dir != NULL)
+   {
+      closedir(dir);
+   }
+
+   if (number_of_workers > 0)
+   {
+      pgmoneta_workers_wait(workers);
+      pgmoneta_workers_destroy(workers);
+   }
+
+   free(tablespace);
+
+   return 1;
+}
+
+static int
+dedup_teardown(int server, char* identifier, struct deque* nodes)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   pgmoneta_log_debug("Deduplication (teardown): %s/%s", config->servers[server].name, identifier);
+   pgmoneta_deque_list(nodes);
+
+   return 0;
+}
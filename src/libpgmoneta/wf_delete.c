@@ -28,6 +28,7 @@
 
 /* pgmoneta */
 #include <pgmoneta.h>
+#include <dedup.h>
 #include <deque.h>
 #include <info.h>
 #include <link.h>
@@ -256,6 +257,10 @@ delete_backup_execute(int server, char* identifier, struct deque* nodes)
 
    pgmoneta_log_info("Delete: %s/%s", config->servers[server].name, backups[backup_index]->label);
 
+   /* The chunks and digests that were only used by the backup */
+   pgmoneta_dedup_collect(server);
+   pgmoneta_link_global_collect();
+
    for (int i = 0; i < number_of_backups; i++)
    {
       free(backups[i]);
@@ -174,7 +174,20 @@ encryption_execute(int server, char* identifier, struct deque* nodes)
 
       enc_file = pgmoneta_append(enc_file, tarfile);
       enc_file = pgmoneta_append(enc_file, compress_suffix);
-      pgmoneta_encrypt_file(enc_file, d);
+
+      /* The chunks of the archive are encrypted in parallel */
+      number_of_workers = pgmoneta_get_number_of_workers(server);
+      if (number_of_workers > 0)
+      {
+         pgmoneta_workers_initialize(number_of_workers, &workers);
+      }
+
+      pgmoneta_encrypt_file(enc_file, d, workers);
+
+      if (number_of_workers > 0)
+      {
+         pgmoneta_workers_destroy(workers);
+      }
    }
 
    total_seconds = (int)difftime(time(NULL), encrypt_time);
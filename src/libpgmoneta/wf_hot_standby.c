@@ -31,6 +31,7 @@
 #include <hot_standby.h>
 #include <logging.h>
 #include <manifest.h>
+#include <tar_storage.h>
 #include <utils.h>
 #include <workers.h>
 
@@ -82,6 +83,8 @@ hot_standby_execute(int server, char* identifier, struct deque* nodes)
    char* base = NULL;
    char* source = NULL;
    char* destination = NULL;
+   char* data = NULL;
+   bool tar = false;
    char* old_manifest = NULL;
    char* new_manifest = NULL;
    time_t start_time;
@@ -146,6 +149,10 @@ hot_standby_execute(int server, char* identifier, struct deque* nodes)
             source = pgmoneta_append_char(source, '/');
          }
 
+         data = pgmoneta_append(data, source);
+         data = pgmoneta_append(data, "data/");
+         tar = pgmoneta_tar_storage_exists(data);
+
          old_manifest = pgmoneta_append(old_manifest, base);
          if (!pgmoneta_ends_with(old_manifest, "/"))
          {
@@ -207,7 +214,18 @@ hot_standby_execute(int server, char* identifier, struct deque* nodes)
 
             pgmoneta_log_trace("hot_standby changed: %s -> %s", from, to);
 
-            pgmoneta_copy_file(from, to, workers);
+            if (tar)
+            {
+               if (pgmoneta_tar_storage_extract_file(data, (char*)changed_iter->key, to))
+               {
+                  pgmoneta_log_error("Hot standby: Could not extract %s", (char*)changed_iter->key);
+                  goto error;
+               }
+            }
+            else
+            {
+               pgmoneta_copy_file(from, to, workers);
+            }
 
             free(from);
             from = NULL;
@@ -234,7 +252,18 @@ hot_standby_execute(int server, char* identifier, struct deque* nodes)
 
             pgmoneta_log_trace("hot_standby new: %s -> %s", from, to);
 
-            pgmoneta_copy_file(from, to, workers);
+            if (tar)
+            {
+               if (pgmoneta_tar_storage_extract_file(data, (char*)added_iter->key, to))
+               {
+                  pgmoneta_log_error("Hot standby: Could not extract %s", (char*)added_iter->key);
+                  goto error;
+               }
+            }
+            else
+            {
+               pgmoneta_copy_file(from, to, workers);
+            }
 
             free(from);
             from = NULL;
@@ -258,7 +287,11 @@ hot_standby_execute(int server, char* identifier, struct deque* nodes)
          pgmoneta_mkdir(root);
          pgmoneta_mkdir(destination);
 
-         pgmoneta_copy_postgresql_hotstandby(source, destination, config->servers[server].hot_standby_tablespaces, backups[number_of_backups - 1], workers);
+         if (pgmoneta_copy_postgresql_hotstandby(source, destination, config->servers[server].hot_standby_tablespaces, backups[number_of_backups - 1], workers))
+         {
+            pgmoneta_log_error("Hot standby: Could not copy %s", source);
+            goto error;
+         }
       }
 
       pgmoneta_log_debug("hot_standby source:      %s", source);
@@ -320,8 +353,43 @@ hot_standby_execute(int server, char* identifier, struct deque* nodes)
    free(base);
    free(source);
    free(destination);
+   free(data);
 
    return 0;
+
+error:
+   if (workers != NULL)
+   {
+      pgmoneta_workers_wait(workers);
+      pgmoneta_workers_destroy(workers);
+   }
+
+   free(from);
+   free(to);
+   free(old_manifest);
+   free(new_manifest);
+
+   for (int i = 0; i < number_of_backups; i++)
+   {
+      free(backups[i]);
+   }
+   free(backups);
+
+   pgmoneta_art_iterator_destroy(deleted_iter);
+   pgmoneta_art_iterator_destroy(changed_iter);
+   pgmoneta_art_iterator_destroy(added_iter);
+
+   pgmoneta_art_destroy(deleted_files);
+   pgmoneta_art_destroy(changed_files);
+   pgmoneta_art_destroy(added_files);
+
+   free(root);
+   free(base);
+   free(source);
+   free(destination);
+   free(data);
+
+   return 1;
 }
 
 static int
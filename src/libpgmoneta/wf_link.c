@@ -172,6 +172,12 @@ link_execute(int server, char* identifier, struct deque* nodes)
       }
    }
 
+   /* Files that are still in the backup are shared with the backups of the other servers */
+   if (config->global_deduplication)
+   {
+      pgmoneta_link_global(server, identifier);
+   }
+
    for (int i = 0; i < number_of_backups; i++)
    {
       free(backups[i]);
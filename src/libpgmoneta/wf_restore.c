@@ -32,13 +32,20 @@
 #include <info.h>
 #include <logging.h>
 #include <restore.h>
+#include <stream.h>
 #include <string.h>
+#include <tar_storage.h>
 #include <utils.h>
+#include <wal.h>
 #include <workers.h>
 #include <workflow.h>
+#include <walfile/wal_index.h>
+#include <walfile/wal_reader.h>
+#include <walfile/wal_time.h>
 
 /* system */
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -56,6 +63,9 @@ static int restore_excluded_files_teardown(int, char*, struct deque*);
 
 static char* get_user_password(char* username);
 static void create_standby_signal(char* basedir);
+static int copy_wal_files(int server, struct backup* backup, bool immediate, char* lsn, char* target_time, char* timeline, char* from, char* to, struct workers* workers);
+static bool wal_file_needed(char* name, struct backup* backup, uint64_t end, uint32_t* timelines, uint64_t* begins, uint64_t* ends, int number_of_timelines, uint64_t segsize);
+static void resolve_time_target(int server, struct backup* backup, char* target_time, uint32_t* timelines, uint64_t* begins, uint64_t* ends, int number_of_timelines, uint64_t segsize, uint64_t* end);
 
 struct workflow*
 pgmoneta_workflow_create_restore(void)
@@ -137,13 +147,9 @@ restore_execute(int server, char* identifier, struct deque* nodes)
    char* directory = NULL;
    char* o = NULL;
    char* ident = NULL;
-   int number_of_backups = 0;
-   struct backup** backups = NULL;
    struct backup* backup = NULL;
    struct backup* verify = NULL;
-   char* d = NULL;
    char* root = NULL;
-   char* base = NULL;
    char* from = NULL;
    char* to = NULL;
    char* id = NULL;
@@ -162,81 +168,14 @@ restore_execute(int server, char* identifier, struct deque* nodes)
    position = (char*)pgmoneta_deque_get(nodes, "position");
    directory = (char*)pgmoneta_deque_get(nodes, "directory");
 
-   if (!strcmp(identifier, "oldest"))
-   {
-      d = pgmoneta_get_server_backup(server);
-
-      if (pgmoneta_get_backups(d, &number_of_backups, &backups))
-      {
-         goto error;
-      }
-
-      for (int i = 0; id == NULL && i < number_of_backups; i++)
-      {
-         if (backups[i]->valid == VALID_TRUE)
-         {
-            id = backups[i]->label;
-         }
-      }
-   }
-   else if (!strcmp(identifier, "latest") || !strcmp(identifier, "newest"))
-   {
-      d = pgmoneta_get_server_backup(server);
-
-      if (pgmoneta_get_backups(d, &number_of_backups, &backups))
-      {
-         goto error;
-      }
-
-      for (int i = number_of_backups - 1; id == NULL && i >= 0; i--)
-      {
-         if (backups[i]->valid == VALID_TRUE)
-         {
-            id = backups[i]->label;
-         }
-      }
-   }
-   else
-   {
-      id = identifier;
-   }
+   root = pgmoneta_get_server_backup(server);
 
-   if (id == NULL)
+   if (pgmoneta_get_backup_label(server, identifier, &id))
    {
       pgmoneta_log_error("Restore: No identifier for %s/%s", config->servers[server].name, identifier);
       goto error;
    }
 
-   root = pgmoneta_get_server_backup(server);
-
-   base = pgmoneta_get_server_backup_identifier(server, id);
-
-   if (!pgmoneta_exists(base))
-   {
-      if (pgmoneta_get_backups(root, &number_of_backups, &backups))
-      {
-         goto error;
-      }
-
-      bool prefix_found = false;
-
-      for (int i = 0; i < number_of_backups; i++)
-      {
-         if (backups[i]->valid == VALID_TRUE && pgmoneta_starts_with(backups[i]->label, id))
-         {
-            prefix_found = true;
-            id = backups[i]->label;
-            break;
-         }
-      }
-
-      if (!prefix_found)
-      {
-         pgmoneta_log_error("Restore: Unknown identifier for %s/%s", config->servers[server].name, id);
-         goto error;
-      }
-   }
-
    if (pgmoneta_get_backup(root, id, &verify))
    {
       pgmoneta_log_error("Restore: Unable to get backup for %s/%s", config->servers[server].name, id);
@@ -286,6 +225,10 @@ restore_execute(int server, char* identifier, struct deque* nodes)
          char tokens[512];
          bool primary = true;
          bool copy_wal = false;
+         bool immediate = false;
+         char lsn[256] = {0};
+         char target_time[256] = {0};
+         char timeline[256] = {0};
          char ver[MISC_LENGTH] = {0};
          char* ptr = NULL;
 
@@ -323,6 +266,19 @@ restore_execute(int server, char* identifier, struct deque* nodes)
                 !strcmp(&key[0], "time"))
             {
                copy_wal = true;
+
+               if (!strcmp(&key[0], "current") || !strcmp(&key[0], "immediate"))
+               {
+                  immediate = true;
+               }
+               else if (!strcmp(&key[0], "lsn"))
+               {
+                  memcpy(&lsn[0], &value[0], strlen(&value[0]));
+               }
+               else if (!strcmp(&key[0], "time"))
+               {
+                  memcpy(&target_time[0], &value[0], strlen(&value[0]));
+               }
             }
             else if (!strcmp(&key[0], "primary"))
             {
@@ -332,7 +288,11 @@ restore_execute(int server, char* identifier, struct deque* nodes)
             {
                primary = false;
             }
-            else if (!strcmp(&key[0], "inclusive") || !strcmp(&key[0], "timeline") || !strcmp(&key[0], "action"))
+            else if (!strcmp(&key[0], "timeline"))
+            {
+               memcpy(&timeline[0], &value[0], strlen(&value[0]));
+            }
+            else if (!strcmp(&key[0], "inclusive") || !strcmp(&key[0], "action"))
             {
                /* Ok */
             }
@@ -370,7 +330,11 @@ restore_execute(int server, char* identifier, struct deque* nodes)
             waltarget = pgmoneta_append(waltarget, id);
             waltarget = pgmoneta_append(waltarget, "/pg_wal/");
 
-            pgmoneta_copy_wal_files(waldir, waltarget, &backup->wal[0], workers);
+            if (copy_wal_files(server, backup, immediate, &lsn[0], &target_time[0], &timeline[0], waldir, waltarget, workers))
+            {
+               pgmoneta_log_error("Restore: Could not copy WAL for %s/%s", config->servers[server].name, id);
+               goto error;
+            }
          }
       }
       else
@@ -408,18 +372,11 @@ restore_execute(int server, char* identifier, struct deque* nodes)
       goto error;
    }
 
-   for (int i = 0; i < number_of_backups; i++)
-   {
-      free(backups[i]);
-   }
-   free(backups);
-
    free(backup);
    free(verify);
    free(root);
-   free(base);
    free(from);
-   free(d);
+   free(id);
    free(to);
    free(o);
    free(ident);
@@ -437,18 +394,11 @@ error:
       pgmoneta_workers_destroy(workers);
    }
 
-   for (int i = 0; i < number_of_backups; i++)
-   {
-      free(backups[i]);
-   }
-   free(backups);
-
    free(backup);
    free(verify);
    free(root);
-   free(base);
    free(from);
-   free(d);
+   free(id);
    free(to);
    free(o);
    free(ident);
@@ -856,9 +806,6 @@ restore_excluded_files_execute(int server, char* identifier, struct deque* nodes
    char* id = NULL;
    char* from = NULL;
    char* to = NULL;
-   int number_of_backups = 0;
-   struct backup** backups = NULL;
-   char* d = NULL;
    struct workers* workers = NULL;
    int number_of_workers = 0;
    char** restore_last_files_names = NULL;
@@ -873,43 +820,10 @@ restore_excluded_files_execute(int server, char* identifier, struct deque* nodes
       goto error;
    }
 
-   if (!strcmp(identifier, "oldest"))
-   {
-      d = pgmoneta_get_server_backup(server);
-
-      if (pgmoneta_get_backups(d, &number_of_backups, &backups))
-      {
-         goto error;
-      }
-
-      for (int i = 0; id == NULL && i < number_of_backups; i++)
-      {
-         if (backups[i]->valid == VALID_TRUE)
-         {
-            id = backups[i]->label;
-         }
-      }
-   }
-   else if (!strcmp(identifier, "latest") || !strcmp(identifier, "newest"))
-   {
-      d = pgmoneta_get_server_backup(server);
-
-      if (pgmoneta_get_backups(d, &number_of_backups, &backups))
-      {
-         goto error;
-      }
-
-      for (int i = number_of_backups - 1; id == NULL && i >= 0; i--)
-      {
-         if (backups[i]->valid == VALID_TRUE)
-         {
-            id = backups[i]->label;
-         }
-      }
-   }
-   else
+   if (pgmoneta_get_backup_label(server, identifier, &id))
    {
-      id = identifier;
+      pgmoneta_log_error("Excluded: No identifier for %s/%s", config->servers[server].name, identifier);
+      goto error;
    }
 
    directory = (char*)pgmoneta_deque_get(nodes, "directory");
@@ -926,10 +840,17 @@ restore_excluded_files_execute(int server, char* identifier, struct deque* nodes
    to = pgmoneta_append(to, id);
    to = pgmoneta_append(to, "/");
 
+   number_of_workers = pgmoneta_get_number_of_workers(server);
+   if (number_of_workers > 0)
+   {
+      pgmoneta_workers_initialize(number_of_workers, &workers);
+   }
+
    for (int i = 0; restore_last_files_names[i] != NULL; i++)
    {
       char* from_file = NULL;
       char* to_file = NULL;
+      char* stored = NULL;
 
       from_file = (char*)malloc((strlen(from) + strlen(restore_last_files_names[i])) * sizeof(char) + 1);
       if (from_file == NULL)
@@ -951,53 +872,61 @@ restore_excluded_files_execute(int server, char* identifier, struct deque* nodes
       to_file = strcpy(to_file, to);
       to_file = strcat(to_file, restore_last_files_names[i]);
 
-      number_of_workers = pgmoneta_get_number_of_workers(server);
-      if (number_of_workers > 0)
+      if (pgmoneta_tar_storage_exists(from))
       {
-         pgmoneta_workers_initialize(number_of_workers, &workers);
+         if (pgmoneta_tar_storage_extract_file(from, restore_last_files_names[i], to_file))
+         {
+            pgmoneta_log_error("Restore: Could not extract file %s to %s", from_file, to_file);
+            free(from_file);
+            free(to_file);
+            goto error;
+         }
       }
-
-      if (pgmoneta_copy_file(from_file, to_file, workers))
+      else if (pgmoneta_stream_get_stored_file(from_file, &stored) ||
+               pgmoneta_copy_stored_file(stored, to_file, workers))
       {
          pgmoneta_log_error("Restore: Could not copy file %s to %s", from_file, to_file);
+         free(stored);
          free(from_file);
          free(to_file);
          goto error;
       }
+      free(stored);
       free(from_file);
       free(to_file);
    }
 
-   for (int i = 0; i < number_of_backups; i++)
+   if (workers != NULL)
    {
-      free(backups[i]);
+      pgmoneta_workers_wait(workers);
+      pgmoneta_workers_destroy(workers);
    }
+
    for (int i = 0; restore_last_files_names[i] != NULL; i++)
    {
       free(restore_last_files_names[i]);
    }
-   free(backups);
    free(restore_last_files_names);
    free(from);
    free(to);
-   free(d);
+   free(id);
 
    return 0;
 
 error:
-   for (int i = 0; i < number_of_backups; i++)
+   if (workers != NULL)
    {
-      free(backups[i]);
+      pgmoneta_workers_wait(workers);
+      pgmoneta_workers_destroy(workers);
    }
    for (int i = 0; restore_last_files_names[i] != NULL; i++)
    {
       free(restore_last_files_names[i]);
    }
-   free(backups);
    free(restore_last_files_names);
    free(from);
    free(to);
-   free(d);
+   free(id);
 
    return 1;
 }
@@ -1058,3 +987,366 @@ create_standby_signal(char* basedir)
 
    free(f);
 }
+
+/**
+ * Copy the WAL needed to recover the backup to the requested position. The
+ * timeline history decides which timeline every part of the WAL comes from,
+ * and the segments after the target LSN, or after the target time in the
+ * WAL time index, are left out. The segments are decrypted and decompressed
+ * in parallel while they are copied
+ */
+static int
+copy_wal_files(int server, struct backup* backup, bool immediate, char* lsn, char* target_time, char* timeline, char* from, char* to, struct workers* workers)
+{
+   uint32_t target = 0;
+   uint32_t hi = 0;
+   uint32_t lo = 0;
+   uint64_t end = UINT64_MAX;
+   uint64_t segsize = 0;
+   int number_of_files = 0;
+   char** files = NULL;
+   char* plain = NULL;
+   char* ff = NULL;
+   char* tf = NULL;
+   int number_of_timelines = 0;
+   uint32_t* timelines = NULL;
+   uint64_t* begins = NULL;
+   uint64_t* ends = NULL;
+   struct timeline_history* history = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   segsize = (uint64_t)config->servers[server].wal_size;
+
+   if (pgmoneta_get_files(from, &number_of_files, &files))
+   {
+      goto error;
+   }
+
+   if (timeline == NULL || strlen(timeline) == 0 || !strcmp(timeline, "latest"))
+   {
+      for (int i = 0; i < number_of_files; i++)
+      {
+         uint32_t tli = 0;
+
+         if (strlen(files[i]) >= 8 && sscanf(files[i], "%08X", &tli) == 1 && tli > target)
+         {
+            target = tli;
+         }
+      }
+   }
+   else if (!strcmp(timeline, "current"))
+   {
+      target = backup->start_timeline;
+   }
+   else
+   {
+      target = (uint32_t)strtoul(timeline, NULL, 10);
+   }
+
+   if (target < backup->start_timeline)
+   {
+      target = backup->start_timeline;
+   }
+
+   if (immediate)
+   {
+      end = ((uint64_t)backup->end_lsn_hi32 << 32) + backup->end_lsn_lo32;
+   }
+   else if (lsn != NULL && strlen(lsn) > 0)
+   {
+      if (sscanf(lsn, "%X/%X", &hi, &lo) != 2)
+      {
+         pgmoneta_log_error("Restore: Invalid LSN %s", lsn);
+         goto error;
+      }
+
+      end = ((uint64_t)hi << 32) + lo;
+   }
+
+   if (pgmoneta_get_timeline_history(server, target, &history))
+   {
+      pgmoneta_log_warn("Restore: No history for timeline %u, copying all WAL", target);
+      history = NULL;
+      segsize = 0;
+   }
+
+   number_of_timelines = 1;
+   for (struct timeline_history* h = history; h != NULL; h = h->next)
+   {
+      number_of_timelines++;
+   }
+
+   timelines = (uint32_t*)malloc(number_of_timelines * sizeof(uint32_t));
+   begins = (uint64_t*)malloc(number_of_timelines * sizeof(uint64_t));
+   ends = (uint64_t*)malloc(number_of_timelines * sizeof(uint64_t));
+
+   if (timelines == NULL || begins == NULL || ends == NULL)
+   {
+      goto error;
+   }
+
+   /* Every history entry ends its parent timeline at the switch position */
+   number_of_timelines = 0;
+   for (struct timeline_history* h = history; h != NULL; h = h->next)
+   {
+      timelines[number_of_timelines] = h->parent_tli;
+      begins[number_of_timelines] = number_of_timelines == 0 ? 0 : ends[number_of_timelines - 1];
+      ends[number_of_timelines] = ((uint64_t)h->switchpos_hi << 32) + h->switchpos_lo;
+      number_of_timelines++;
+   }
+
+   timelines[number_of_timelines] = target;
+   begins[number_of_timelines] = number_of_timelines == 0 ? 0 : ends[number_of_timelines - 1];
+   ends[number_of_timelines] = UINT64_MAX;
+   number_of_timelines++;
+
+   if (!immediate && (lsn == NULL || strlen(lsn) == 0) && target_time != NULL && strlen(target_time) > 0 && segsize > 0)
+   {
+      resolve_time_target(server, backup, target_time, timelines, begins, ends, number_of_timelines, segsize, &end);
+   }
+
+   if (config->wal_index && segsize > 0)
+   {
+      bool restorable = false;
+      char* missing = NULL;
+      uint64_t start = ((uint64_t)backup->start_lsn_hi32 << 32) + backup->start_lsn_lo32;
+
+      if (!pgmoneta_wal_index_restorable(server, target, start, end, &restorable, &missing) && !restorable)
+      {
+         pgmoneta_log_warn("Restore: WAL segment %s of timeline %u is missing in the WAL index",
+                           missing != NULL ? missing : "", target);
+      }
+
+      free(missing);
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      plain = pgmoneta_stream_plain_name(files[i]);
+
+      if (pgmoneta_ends_with(plain, ".partial"))
+      {
+         plain[strlen(plain) - strlen(".partial")] = '\0';
+      }
+
+      if (wal_file_needed(plain, backup, end, timelines, begins, ends, number_of_timelines, segsize))
+      {
+         ff = pgmoneta_append(ff, from);
+         if (!pgmoneta_ends_with(ff, "/"))
+         {
+            ff = pgmoneta_append(ff, "/");
+         }
+         ff = pgmoneta_append(ff, files[i]);
+
+         tf = pgmoneta_append(tf, to);
+         if (!pgmoneta_ends_with(tf, "/"))
+         {
+            tf = pgmoneta_append(tf, "/");
+         }
+         tf = pgmoneta_append(tf, plain);
+
+         pgmoneta_log_trace("Restore: WAL %s", files[i]);
+
+         if (pgmoneta_copy_stored_file(ff, tf, workers))
+         {
+            goto error;
+         }
+      }
+
+      free(plain);
+      free(ff);
+      free(tf);
+
+      plain = NULL;
+      ff = NULL;
+      tf = NULL;
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+
+   free(timelines);
+   free(begins);
+   free(ends);
+   pgmoneta_free_timeline_history(history);
+
+   return 0;
+
+error:
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+
+   free(plain);
+   free(ff);
+   free(tf);
+   free(timelines);
+   free(begins);
+   free(ends);
+   pgmoneta_free_timeline_history(history);
+
+   return 1;
+}
+
+/**
+ * Resolve a recovery target time to the end of the WAL that recovery will
+ * read. With recovery_target_inclusive, which is the default, recovery applies
+ * the commits at the target and stops at the first commit or abort record
+ * after it, so that record is in the first WAL segment of the time index whose
+ * latest commit is after the target. The end stays unchanged unless the
+ * index covers every WAL segment from the start of the backup to that one
+ */
+static void
+resolve_time_target(int server, struct backup* backup, char* target_time, uint32_t* timelines, uint64_t* begins, uint64_t* ends, int number_of_timelines, uint64_t segsize, uint64_t* end)
+{
+   int number_of_entries = 0;
+   bool zone = false;
+   bool on_path = false;
+   bool partial = false;
+   timestamp_tz target = 0;
+   uint64_t start = 0;
+   uint64_t expected = 0;
+   struct wal_time_entry* entries = NULL;
+
+   if (pgmoneta_wal_time_parse(target_time, &target, &zone))
+   {
+      pgmoneta_log_warn("Restore: Could not resolve time %s, copying all WAL", target_time);
+      return;
+   }
+
+   if (!zone)
+   {
+      /* The time zone of the server isn't known, so assume the westernmost one */
+      target += (timestamp_tz)12 * 3600 * 1000000;
+   }
+
+   if (pgmoneta_wal_time_index_read(server, &number_of_entries, &entries) || number_of_entries == 0)
+   {
+      free(entries);
+      return;
+   }
+
+   start = ((uint64_t)backup->start_lsn_hi32 << 32) + backup->start_lsn_lo32;
+   expected = start - (start % segsize);
+
+   for (int i = 0; i < number_of_entries; i++)
+   {
+      if (entries[i].start + segsize <= start)
+      {
+         continue;
+      }
+
+      on_path = false;
+      partial = false;
+      for (int j = 0; j < number_of_timelines; j++)
+      {
+         if (timelines[j] == entries[i].timeline &&
+             entries[i].start + segsize > begins[j] && entries[i].start <= ends[j])
+         {
+            on_path = true;
+            /* The parent timeline goes on after the switch in this segment */
+            partial = entries[i].start + segsize > ends[j];
+         }
+      }
+
+      if (!on_path)
+      {
+         continue;
+      }
+
+      if (entries[i].start > expected)
+      {
+         pgmoneta_log_debug("Restore: The WAL time index has no %08X%08X%08X",
+                            entries[i].timeline, (uint32_t)(expected >> 32), (uint32_t)((expected & 0xFFFFFFFF) / segsize));
+         break;
+      }
+
+      expected = MAX(expected, entries[i].start + segsize);
+
+      if (!partial && entries[i].transactions > 0 && entries[i].last > target)
+      {
+         if (entries[i].end < *end)
+         {
+            *end = entries[i].end;
+         }
+
+         pgmoneta_log_debug("Restore: Time %s ends in %s at %X/%X", target_time, entries[i].segment, LSN_FORMAT_ARGS(entries[i].end));
+         break;
+      }
+   }
+
+   free(entries);
+}
+
+static bool
+wal_file_needed(char* name, struct backup* backup, uint64_t end, uint32_t* timelines, uint64_t* begins, uint64_t* ends, int number_of_timelines, uint64_t segsize)
+{
+   uint32_t tli = 0;
+   uint32_t log = 0;
+   uint32_t seg = 0;
+   uint64_t first = 0;
+   uint64_t last = 0;
+   uint64_t start = 0;
+
+   if (strlen(name) == 16 && pgmoneta_ends_with(name, ".history"))
+   {
+      if (sscanf(name, "%08X", &tli) != 1)
+      {
+         return false;
+      }
+
+      for (int i = 0; i < number_of_timelines; i++)
+      {
+         if (timelines[i] == tli)
+         {
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   if (!pgmoneta_wal_is_segment(name))
+   {
+      return false;
+   }
+
+   if (segsize == 0)
+   {
+      /* The segment size isn't known, so copy everything from the start of the backup */
+      return strcmp(name, backup->wal) >= 0;
+   }
+
+   if (sscanf(name, "%08X%08X%08X", &tli, &log, &seg) != 3)
+   {
+      return false;
+   }
+
+   first = ((uint64_t)log << 32) + (uint64_t)seg * segsize;
+   last = first + segsize - 1;
+   start = ((uint64_t)backup->start_lsn_hi32 << 32) + backup->start_lsn_lo32;
+
+   /* Recovery reads the record after the target, which may start in the next segment */
+   if (last < start || (end != UINT64_MAX && first > end + segsize))
+   {
+      return false;
+   }
+
+   for (int i = 0; i < number_of_timelines; i++)
+   {
+      if (timelines[i] == tli)
+      {
+         return last >= begins[i] && first <= ends[i];
+      }
+   }
+
+   return false;
+}
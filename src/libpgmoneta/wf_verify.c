@@ -28,11 +28,15 @@
 
 /* pgmoneta */
 #include <pgmoneta.h>
+#include <art.h>
 #include <csv.h>
 #include <deque.h>
+#include <info.h>
 #include <logging.h>
 #include <management.h>
 #include <security.h>
+#include <stream.h>
+#include <tar_storage.h>
 #include <utils.h>
 #include <verify.h>
 #include <workers.h>
@@ -50,11 +54,24 @@ struct payload
    struct deque* all;
 };
 
+struct tar_payload
+{
+   char* directory;
+   int hash_algorithm;
+   struct art* checksums;
+   struct deque* failed;
+   struct deque* all;
+};
+
 static int verify_setup(int, char*, struct deque*);
 static int verify_execute(int, char*, struct deque*);
 static int verify_teardown(int, char*, struct deque*);
 
 static void do_verify(void* arg);
+static int verify_tar(char* data, char* manifest_file, int hash_algorithm, struct deque* failed, struct deque* all);
+static int verify_tar_member(char* path, struct tar_storage_member* member, struct tar_storage_reader* reader, void* data);
+static void verify_add(char* directory, char* filename, char* original, int hash_algorithm, char* calculated,
+                       struct deque* failed, struct deque* all);
 
 struct workflow*
 pgmoneta_workflow_create_verify(void)
@@ -92,7 +109,9 @@ verify_setup(int server, char* identifier, struct deque* nodes)
 static int
 verify_execute(int server, char* identifier, struct deque* nodes)
 {
+   char* id = NULL;
    char* base = NULL;
+   char* data = NULL;
    char* info_file = NULL;
    char* manifest_file = NULL;
    int number_of_columns = 0;
@@ -110,7 +129,19 @@ verify_execute(int server, char* identifier, struct deque* nodes)
    pgmoneta_log_debug("Verify (execute): %s/%s", config->servers[server].name, identifier);
    pgmoneta_deque_list(nodes);
 
-   base = pgmoneta_get_server_backup_identifier(server, (char*)pgmoneta_deque_get(nodes, "identifier"));
+   if (pgmoneta_get_backup_label(server, identifier, &id))
+   {
+      pgmoneta_log_error("Verify: Unknown identifier for %s/%s", config->servers[server].name, identifier);
+      goto error;
+   }
+
+   if (pgmoneta_deque_add(nodes, "identifier", (uintptr_t)id, ValueString))
+   {
+      goto error;
+   }
+
+   base = pgmoneta_get_server_backup_identifier(server, id);
+   data = pgmoneta_get_server_backup_identifier_data(server, id);
 
    info_file = pgmoneta_append(info_file, base);
    if (!pgmoneta_ends_with(info_file, "/"))
@@ -126,7 +157,11 @@ verify_execute(int server, char* identifier, struct deque* nodes)
    }
    manifest_file = pgmoneta_append(manifest_file, "backup.manifest");
 
-   pgmoneta_get_backup_file(info_file, &backup);
+   if (pgmoneta_get_backup_file(info_file, &backup))
+   {
+      pgmoneta_log_error("Verify: Unable to get backup for %s/%s", config->servers[server].name, id);
+      goto error;
+   }
 
    if (pgmoneta_deque_create(true, &failed_deque))
    {
@@ -141,6 +176,17 @@ verify_execute(int server, char* identifier, struct deque* nodes)
       }
    }
 
+   if (pgmoneta_tar_storage_exists(data))
+   {
+      /* The members are read in order from the tar files, so the workers aren't used */
+      if (verify_tar(data, manifest_file, backup->hash_algoritm, failed_deque, all_deque))
+      {
+         goto error;
+      }
+
+      goto done;
+   }
+
    number_of_workers = pgmoneta_get_number_of_workers(server);
    if (number_of_workers > 0)
    {
@@ -171,7 +217,7 @@ verify_execute(int server, char* identifier, struct deque* nodes)
          goto error;
       }
 
-      pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_DIRECTORY, (uintptr_t)pgmoneta_deque_get(nodes, "to"), ValueString);
+      pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_DIRECTORY, (uintptr_t)data, ValueString);
       pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_FILENAME, (uintptr_t)columns[0], ValueString);
       pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_ORIGINAL, (uintptr_t)columns[1], ValueString);
       pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_HASH_ALGORITHM, (uintptr_t)backup->hash_algoritm, ValueInt32);
@@ -199,6 +245,8 @@ verify_execute(int server, char* identifier, struct deque* nodes)
       pgmoneta_workers_destroy(workers);
    }
 
+done:
+
    pgmoneta_deque_list(failed_deque);
    pgmoneta_deque_list(all_deque);
 
@@ -209,7 +257,9 @@ verify_execute(int server, char* identifier, struct deque* nodes)
 
    free(backup);
 
+   free(id);
    free(base);
+   free(data);
    free(info_file);
    free(manifest_file);
 
@@ -227,7 +277,9 @@ error:
 
    free(backup);
 
+   free(id);
    free(base);
+   free(data);
    free(info_file);
    free(manifest_file);
 
@@ -251,9 +303,9 @@ static void
 do_verify(void* arg)
 {
    char* f = NULL;
+   char* stored = NULL;
    char* hash_cal = NULL;
    bool failed = false;
-   int ha = 0;
    struct payload* p = NULL;
    struct json* j = NULL;
 
@@ -268,120 +320,212 @@ do_verify(void* arg)
    }
    f = pgmoneta_append(f, (char*)pgmoneta_json_get(j, MANAGEMENT_ARGUMENT_FILENAME));
 
-   if (!pgmoneta_exists(f))
+   /* The file is read once from the backup, and decrypted and decompressed in memory */
+   if (pgmoneta_stream_get_stored_file(f, &stored))
    {
-      goto error;
+      failed = true;
+   }
+   else if (pgmoneta_stream_create_file_hash((int)pgmoneta_json_get(j, MANAGEMENT_ARGUMENT_HASH_ALGORITHM), stored, &hash_cal))
+   {
+      failed = true;
+   }
+   else if (strcmp(hash_cal, (char*)pgmoneta_json_get(j, MANAGEMENT_ARGUMENT_ORIGINAL)))
+   {
+      failed = true;
    }
 
-   ha = (int)pgmoneta_json_get(j, MANAGEMENT_ARGUMENT_HASH_ALGORITHM);
-   if (ha == HASH_ALGORITHM_SHA256)
+   if (failed)
    {
-      if (!pgmoneta_create_sha256_file(f, &hash_cal))
+      if (hash_cal != NULL && strlen(hash_cal) > 0)
       {
-         if (strcmp(hash_cal, (char*)pgmoneta_json_get(j, MANAGEMENT_ARGUMENT_ORIGINAL)))
-         {
-            failed = true;
-         }
+         pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_CALCULATED, (uintptr_t)hash_cal, ValueString);
       }
       else
       {
-         failed = true;
+         pgmoneta_log_error("Unable to calculate hash for %s", f);
+         pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_CALCULATED, (uintptr_t)"Unknown", ValueString);
       }
+
+      pgmoneta_deque_add(p->failed, f, (uintptr_t)j, ValueJSON);
    }
-   else if (ha == HASH_ALGORITHM_SHA384)
+   else if (p->all != NULL)
    {
-      if (!pgmoneta_create_sha384_file(f, &hash_cal))
-      {
-         if (strcmp(hash_cal, (char*)pgmoneta_json_get(j, MANAGEMENT_ARGUMENT_ORIGINAL)))
-         {
-            failed = true;
-         }
-      }
-      else
-      {
-         failed = true;
-      }
+      pgmoneta_deque_add(p->all, f, (uintptr_t)j, ValueJSON);
    }
-   else if (ha == HASH_ALGORITHM_SHA512)
+   else
    {
-      if (!pgmoneta_create_sha512_file(f, &hash_cal))
-      {
-         if (strcmp(hash_cal, (char*)pgmoneta_json_get(j, MANAGEMENT_ARGUMENT_ORIGINAL)))
-         {
-            failed = true;
-         }
-      }
-      else
-      {
-         failed = true;
-      }
+      pgmoneta_json_destroy(j);
+   }
+
+   free(hash_cal);
+   free(stored);
+   free(f);
+   free(p);
+}
+
+static int
+verify_tar(char* data, char* manifest_file, int hash_algorithm, struct deque* failed, struct deque* all)
+{
+   int number_of_columns = 0;
+   char** columns = NULL;
+   struct art* checksums = NULL;
+   struct art_iterator* iter = NULL;
+   struct csv_reader* csv = NULL;
+   struct tar_payload payload;
+
+   if (pgmoneta_art_create(&checksums))
+   {
+      goto error;
    }
-   else if (ha == HASH_ALGORITHM_SHA224)
+
+   if (pgmoneta_csv_reader_init(manifest_file, &csv))
    {
-      if (!pgmoneta_create_sha224_file(f, &hash_cal))
-      {
-         if (strcmp(hash_cal, (char*)pgmoneta_json_get(j, MANAGEMENT_ARGUMENT_ORIGINAL)))
-         {
-            failed = true;
-         }
-      }
-      else
-      {
-         failed = true;
-      }
+      goto error;
    }
-   else if (ha == HASH_ALGORITHM_CRC32C)
+
+   while (pgmoneta_csv_next_row(csv, &number_of_columns, &columns))
    {
-      if (!pgmoneta_create_crc32c_file(f, &hash_cal))
-      {
-         if (strcmp(hash_cal, (char*)pgmoneta_json_get(j, MANAGEMENT_ARGUMENT_ORIGINAL)))
-         {
-            failed = true;
-         }
-      }
-      else
+      pgmoneta_art_insert(checksums, (unsigned char*)columns[0], strlen(columns[0]) + 1,
+                          (uintptr_t)columns[1], ValueString);
+
+      free(columns);
+      columns = NULL;
+   }
+
+   memset(&payload, 0, sizeof(struct tar_payload));
+   payload.directory = data;
+   payload.hash_algorithm = hash_algorithm;
+   payload.checksums = checksums;
+   payload.failed = failed;
+   payload.all = all;
+
+   if (pgmoneta_tar_storage_foreach(data, verify_tar_member, &payload))
+   {
+      goto error;
+   }
+
+   /* Anything left wasn't found in the tar files */
+   pgmoneta_art_iterator_create(checksums, &iter);
+   while (pgmoneta_art_iterator_next(iter))
+   {
+      pgmoneta_log_error("Verify: %s is missing from the tar files", (char*)iter->key);
+      verify_add(data, (char*)iter->key, (char*)pgmoneta_value_data(iter->value), hash_algorithm, NULL, failed, all);
+   }
+   pgmoneta_art_iterator_destroy(iter);
+
+   pgmoneta_csv_reader_destroy(csv);
+   pgmoneta_art_destroy(checksums);
+
+   return 0;
+
+error:
+
+   pgmoneta_csv_reader_destroy(csv);
+   pgmoneta_art_destroy(checksums);
+
+   return 1;
+}
+
+static int
+verify_tar_member(char* path, struct tar_storage_member* member, struct tar_storage_reader* reader, void* data)
+{
+   char buffer[8192];
+   size_t length = 0;
+   char* original = NULL;
+   char* hash_cal = NULL;
+   struct stream_hash* hash = NULL;
+   struct tar_payload* p = (struct tar_payload*)data;
+
+   if (member->type != '0' && member->type != '7')
+   {
+      return 0;
+   }
+
+   original = (char*)pgmoneta_art_search(p->checksums, (unsigned char*)path, strlen(path) + 1);
+   if (original == NULL)
+   {
+      return 0;
+   }
+
+   if (pgmoneta_stream_hash_init(p->hash_algorithm, &hash))
+   {
+      goto error;
+   }
+
+   do
+   {
+      if (pgmoneta_tar_storage_reader_read(reader, buffer, sizeof(buffer), &length) ||
+          pgmoneta_stream_hash_update(hash, buffer, length))
       {
-         failed = true;
+         goto error;
       }
    }
-   else
+   while (length > 0);
+
+   pgmoneta_stream_hash_final(hash, &hash_cal);
+
+   verify_add(p->directory, path, original, p->hash_algorithm, hash_cal, p->failed, p->all);
+
+   pgmoneta_art_delete(p->checksums, (unsigned char*)path, strlen(path) + 1);
+
+   pgmoneta_stream_hash_destroy(hash);
+   free(hash_cal);
+
+   return 0;
+
+error:
+
+   pgmoneta_stream_hash_destroy(hash);
+   free(hash_cal);
+
+   return 1;
+}
+
+static void
+verify_add(char* directory, char* filename, char* original, int hash_algorithm, char* calculated,
+           struct deque* failed, struct deque* all)
+{
+   char* f = NULL;
+   struct json* j = NULL;
+
+   if (pgmoneta_json_create(&j))
    {
-      goto error;
+      return;
    }
 
-   if (failed)
+   pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_DIRECTORY, (uintptr_t)directory, ValueString);
+   pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_FILENAME, (uintptr_t)filename, ValueString);
+   pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_ORIGINAL, (uintptr_t)original, ValueString);
+   pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_HASH_ALGORITHM, (uintptr_t)hash_algorithm, ValueInt32);
+
+   f = pgmoneta_append(f, directory);
+   if (!pgmoneta_ends_with(f, "/"))
    {
-      if (hash_cal != NULL && strlen(hash_cal) > 0)
+      f = pgmoneta_append(f, "/");
+   }
+   f = pgmoneta_append(f, filename);
+
+   if (calculated == NULL || strcmp(calculated, original))
+   {
+      if (calculated != NULL && strlen(calculated) > 0)
       {
-         pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_CALCULATED, (uintptr_t)hash_cal, ValueString);
+         pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_CALCULATED, (uintptr_t)calculated, ValueString);
       }
       else
       {
-         failed = true;
          pgmoneta_json_put(j, MANAGEMENT_ARGUMENT_CALCULATED, (uintptr_t)"Unknown", ValueString);
       }
 
-      pgmoneta_deque_add(p->failed, f, (uintptr_t)j, ValueJSON);
+      pgmoneta_deque_add(failed, f, (uintptr_t)j, ValueJSON);
    }
-   else if (p->all != NULL)
+   else if (all != NULL)
    {
-      pgmoneta_deque_add(p->all, f, (uintptr_t)j, ValueJSON);
+      pgmoneta_deque_add(all, f, (uintptr_t)j, ValueJSON);
    }
    else
    {
       pgmoneta_json_destroy(j);
    }
 
-   free(hash_cal);
-   free(f);
-   free(p);
-
-   return;
-
-error:
-   pgmoneta_log_error("Unable to calculate hash for %s", f);
-
-   free(hash_cal);
    free(f);
-   free(p);
 }
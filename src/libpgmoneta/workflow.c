@@ -42,6 +42,7 @@ static struct workflow* wf_verify(void);
 static struct workflow* wf_archive(void);
 static struct workflow* wf_delete_backup(void);
 static struct workflow* wf_retention(void);
+static struct workflow* wf_fetch(int workflow_type);
 
 struct workflow*
 pgmoneta_workflow_create(int workflow_type)
@@ -120,25 +121,38 @@ wf_backup(void)
    current->next = pgmoneta_create_hot_standby();
    current = current->next;
 
-   if (config->compression_type == COMPRESSION_CLIENT_GZIP || config->compression_type == COMPRESSION_SERVER_GZIP)
+   // the files are split into chunks before they are compressed and encrypted,
+   // the remote storage engines copy the backup directory without the chunk store
+   if (config->storage_format == STORAGE_FORMAT_DIRECTORY && config->deduplication != DEDUPLICATION_OFF &&
+       config->storage_engine == STORAGE_ENGINE_LOCAL)
    {
-      current->next = pgmoneta_workflow_create_gzip(true);
+      current->next = pgmoneta_workflow_create_dedup();
       current = current->next;
    }
-   else if (config->compression_type == COMPRESSION_CLIENT_ZSTD || config->compression_type == COMPRESSION_SERVER_ZSTD)
-   {
-      current->next = pgmoneta_workflow_create_zstd(true);
-      current = current->next;
-   }
-   else if (config->compression_type == COMPRESSION_CLIENT_LZ4 || config->compression_type == COMPRESSION_SERVER_LZ4)
-   {
-      current->next = pgmoneta_workflow_create_lz4(true);
-      current = current->next;
-   }
-   else if (config->compression_type == COMPRESSION_CLIENT_BZIP2)
+
+   // the tar storage format is compressed while it is received
+   if (config->storage_format == STORAGE_FORMAT_DIRECTORY)
    {
-      current->next = pgmoneta_workflow_create_bzip2(true);
-      current = current->next;
+      if (config->compression_type == COMPRESSION_CLIENT_GZIP || config->compression_type == COMPRESSION_SERVER_GZIP)
+      {
+         current->next = pgmoneta_workflow_create_gzip(true);
+         current = current->next;
+      }
+      else if (config->compression_type == COMPRESSION_CLIENT_ZSTD || config->compression_type == COMPRESSION_SERVER_ZSTD)
+      {
+         current->next = pgmoneta_workflow_create_zstd(true);
+         current = current->next;
+      }
+      else if (config->compression_type == COMPRESSION_CLIENT_LZ4 || config->compression_type == COMPRESSION_SERVER_LZ4)
+      {
+         current->next = pgmoneta_workflow_create_lz4(true);
+         current = current->next;
+      }
+      else if (config->compression_type == COMPRESSION_CLIENT_BZIP2)
+      {
+         current->next = pgmoneta_workflow_create_bzip2(true);
+         current = current->next;
+      }
    }
 
    if (config->encryption != ENCRYPTION_NONE)
@@ -147,8 +161,11 @@ wf_backup(void)
       current = current->next;
    }
 
-   current->next = pgmoneta_workflow_create_link();
-   current = current->next;
+   if (config->storage_format == STORAGE_FORMAT_DIRECTORY)
+   {
+      current->next = pgmoneta_workflow_create_link();
+      current = current->next;
+   }
 
    current->next = pgmoneta_workflow_create_permissions(PERMISSION_TYPE_BACKUP);
    current = current->next;
@@ -164,13 +181,13 @@ wf_backup(void)
 
    if (config->storage_engine & STORAGE_ENGINE_S3)
    {
-      current->next = pgmoneta_storage_create_s3();
+      current->next = pgmoneta_storage_create_s3(WORKFLOW_TYPE_BACKUP);
       current = current->next;
    }
 
    if (config->storage_engine & STORAGE_ENGINE_AZURE)
    {
-      current->next = pgmoneta_storage_create_azure();
+      current->next = pgmoneta_storage_create_azure(WORKFLOW_TYPE_BACKUP);
       current = current->next;
    }
 
@@ -182,37 +199,20 @@ wf_restore(void)
 {
    struct workflow* head = NULL;
    struct workflow* current = NULL;
-   struct configuration* config = NULL;
 
-   config = (struct configuration*)shmem;
-
-   head = pgmoneta_workflow_create_restore();
+   /* A backup that was uploaded is downloaded first */
+   head = wf_fetch(WORKFLOW_TYPE_RESTORE);
    current = head;
 
-   if (config->encryption != ENCRYPTION_NONE)
-   {
-      current->next = pgmoneta_workflow_encryption(false);
-      current = current->next;
-   }
-
-   if (config->compression_type == COMPRESSION_CLIENT_GZIP || config->compression_type == COMPRESSION_SERVER_GZIP)
-   {
-      current->next = pgmoneta_workflow_create_gzip(false);
-      current = current->next;
-   }
-   else if (config->compression_type == COMPRESSION_CLIENT_ZSTD || config->compression_type == COMPRESSION_SERVER_ZSTD)
-   {
-      current->next = pgmoneta_workflow_create_zstd(false);
-      current = current->next;
-   }
-   else if (config->compression_type == COMPRESSION_CLIENT_LZ4 || config->compression_type == COMPRESSION_SERVER_LZ4)
+   /* Files are decrypted and decompressed while they are copied */
+   if (head == NULL)
    {
-      current->next = pgmoneta_workflow_create_lz4(false);
-      current = current->next;
+      head = pgmoneta_workflow_create_restore();
+      current = head;
    }
-   else if (config->compression_type == COMPRESSION_CLIENT_BZIP2)
+   else
    {
-      current->next = pgmoneta_workflow_create_bzip2(false);
+      current->next = pgmoneta_workflow_create_restore();
       current = current->next;
    }
 
@@ -235,51 +235,43 @@ static struct workflow*
 wf_verify(void)
 {
    struct workflow* head = NULL;
-   struct workflow* current = NULL;
-   struct configuration* config = NULL;
 
-   config = (struct configuration*)shmem;
+   head = wf_fetch(WORKFLOW_TYPE_VERIFY);
 
-   head = pgmoneta_workflow_create_restore();
-   current = head;
-
-   if (config->encryption != ENCRYPTION_NONE)
+   if (head == NULL)
    {
-      current->next = pgmoneta_workflow_encryption(false);
-      current = current->next;
+      head = pgmoneta_workflow_create_verify();
    }
-
-   if (config->compression_type == COMPRESSION_CLIENT_GZIP || config->compression_type == COMPRESSION_SERVER_GZIP)
+   else
    {
-      current->next = pgmoneta_workflow_create_gzip(false);
-      current = current->next;
+      head->next = pgmoneta_workflow_create_verify();
    }
-   else if (config->compression_type == COMPRESSION_CLIENT_ZSTD || config->compression_type == COMPRESSION_SERVER_ZSTD)
+
+   return head;
+}
+
+static struct workflow*
+wf_fetch(int workflow_type)
+{
+   struct configuration* config = NULL;
+
+   config = (struct configuration*)shmem;
+
+   // the first remote storage engine of the backup workflow has the data of the backup
+   if (config->storage_engine & STORAGE_ENGINE_SSH)
    {
-      current->next = pgmoneta_workflow_create_zstd(false);
-      current = current->next;
+      return pgmoneta_storage_create_ssh(workflow_type);
    }
-   else if (config->compression_type == COMPRESSION_CLIENT_LZ4 || config->compression_type == COMPRESSION_SERVER_LZ4)
+   else if (config->storage_engine & STORAGE_ENGINE_S3)
    {
-      current->next = pgmoneta_workflow_create_lz4(false);
-      current = current->next;
+      return pgmoneta_storage_create_s3(workflow_type);
    }
-   else if (config->compression_type == COMPRESSION_CLIENT_BZIP2)
+   else if (config->storage_engine & STORAGE_ENGINE_AZURE)
    {
-      current->next = pgmoneta_workflow_create_bzip2(false);
-      current = current->next;
+      return pgmoneta_storage_create_azure(workflow_type);
    }
 
-   current->next = pgmoneta_restore_excluded_files();
-   current = current->next;
-
-   current->next = pgmoneta_workflow_create_permissions(PERMISSION_TYPE_RESTORE);
-   current = current->next;
-
-   current->next = pgmoneta_workflow_create_verify();
-   current = current->next;
-
-   return head;
+   return NULL;
 }
 
 static struct workflow*
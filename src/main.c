@@ -54,6 +54,12 @@
 #include <utils.h>
 #include <verify.h>
 #include <wal.h>
+#include <walfile/wal_index.h>
+#include <walfile/wal_stats.h>
+#include <walfile/wal_summary.h>
+#include <walfile/wal_tap.h>
+#include <walfile/wal_time.h>
+#include <walfile/wal_verify.h>
 #include <zstandard_compression.h>
 
 /* system */
@@ -1483,6 +1489,47 @@ accept_mgt_cb(struct ev_loop* loop, struct ev_io* watcher, int revents)
          goto error;
       }
    }
+   else if (id == MANAGEMENT_WAL_STATS)
+   {
+      server = (char*)pgmoneta_json_get(request, MANAGEMENT_ARGUMENT_SERVER);
+
+      srv = -1;
+      for (int i = 0; srv == -1 && i < config->number_of_servers; i++)
+      {
+         if (!strcmp(config->servers[i].name, server))
+         {
+            srv = i;
+         }
+      }
+
+      if (srv != -1)
+      {
+         pid = fork();
+         if (pid == -1)
+         {
+            pgmoneta_management_response_error(NULL, client_fd, server, MANAGEMENT_ERROR_WAL_STATS_NOFORK, payload);
+            pgmoneta_log_error("WAL stats: No fork %s (%d)", server, MANAGEMENT_ERROR_WAL_STATS_NOFORK);
+            goto error;
+         }
+         else if (pid == 0)
+         {
+            struct json* pyl = NULL;
+
+            shutdown_ports();
+
+            pgmoneta_json_clone(payload, &pyl);
+
+            pgmoneta_set_proc_title(1, ai->argv, "wal-stats", config->servers[srv].name);
+            pgmoneta_wal_stats_request(NULL, client_fd, srv, pyl);
+         }
+      }
+      else
+      {
+         pgmoneta_management_response_error(NULL, client_fd, server, MANAGEMENT_ERROR_WAL_STATS_NOSERVER, payload);
+         pgmoneta_log_error("WAL stats: No server %s (%d)", server, MANAGEMENT_ERROR_WAL_STATS_NOSERVER);
+         goto error;
+      }
+   }
    else
    {
       pgmoneta_management_response_error(NULL, client_fd, NULL, MANAGEMENT_ERROR_UNKNOWN_COMMAND, payload);
@@ -1710,6 +1757,32 @@ wal_cb(struct ev_loop* loop, ev_periodic* w, int revents)
          {
             d = pgmoneta_get_server_wal(i);
 
+            if (config->wal_tap)
+            {
+               pgmoneta_wal_tap_merge(i, d);
+            }
+
+            /* The WAL is verified and indexed while it is still uncompressed */
+            if (config->verify_wal)
+            {
+               pgmoneta_wal_verify(i, d);
+            }
+
+            if (config->wal_time_index)
+            {
+               pgmoneta_wal_time_index_update(i, d);
+            }
+
+            if (config->wal_summary)
+            {
+               pgmoneta_wal_summary_update(i, d);
+            }
+
+            if (config->wal_stats)
+            {
+               pgmoneta_wal_stats_update(i, d);
+            }
+
             if (config->compression_type == COMPRESSION_CLIENT_GZIP || config->compression_type == COMPRESSION_SERVER_GZIP)
             {
                pgmoneta_gzip_wal(d);
@@ -1732,6 +1805,11 @@ wal_cb(struct ev_loop* loop, ev_periodic* w, int revents)
                pgmoneta_encrypt_wal(d);
             }
 
+            if (config->wal_index)
+            {
+               pgmoneta_wal_index_update(i, d);
+            }
+
             free(d);
 
             atomic_store(&config->servers[i].wal, false);
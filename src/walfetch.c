@@ -0,0 +1,782 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <configuration.h>
+#include <logging.h>
+#include <shmem.h>
+#include <stream.h>
+#include <utils.h>
+#include <workers.h>
+#include <walfile/wal_reader.h>
+
+/* system */
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define DEFAULT_PREFETCH 8
+#define HELPER_IDLE_TIMEOUT 60
+#define HELPER_POLL_INTERVAL 100000
+
+#define SPOOL_NEXT "walfetch.next"
+#define SPOOL_PID  "walfetch.pid"
+
+static void version(void);
+static void usage(void);
+static int find_server(char* name);
+static int find_stored(int server, char* name, char** stored);
+static int fetch(char* from, char* to);
+static int write_next(char* spool, char* name);
+static void start_helper(int server, char* spool, int prefetch);
+static void helper(int server, char* spool, int prefetch);
+static void prefetch_segment(void* arg);
+static char* spool_file(char* spool, char* name);
+static void drop_spool(char* spool);
+
+static void
+version(void)
+{
+   printf("pgmoneta-walfetch %s\n", VERSION);
+   exit(1);
+}
+
+static void
+usage(void)
+{
+   printf("pgmoneta-walfetch %s\n", VERSION);
+   printf("  restore_command for pgmoneta\n");
+   printf("\n");
+
+   printf("Usage:\n");
+   printf("  pgmoneta-walfetch [ -c CONFIG_FILE ] [ OPTIONS ] <server> <wal file> <path>\n");
+   printf("\n");
+   printf("Options:\n");
+   printf("  -c, --config CONFIG_FILE Set the path to the pgmoneta.conf file\n");
+   printf("  -d, --directory DIR      Set the spool directory for prefetched segments, which enables prefetching\n");
+   printf("  -n, --prefetch NUMBER    Number of segments to prefetch into the spool (default %d, 0 to disable)\n", DEFAULT_PREFETCH);
+   printf("  -L, --logfile FILE       Set the log file\n");
+   printf("  -V, --version            Display version information\n");
+   printf("  -?, --help               Display help\n");
+   printf("\n");
+   printf("Example:\n");
+   printf("  restore_command = 'pgmoneta-walfetch -c /etc/pgmoneta/pgmoneta.conf primary %%f %%p'\n");
+   printf("\n");
+   printf("pgmoneta: %s\n", PGMONETA_HOMEPAGE);
+   printf("Report bugs: %s\n", PGMONETA_ISSUES);
+}
+
+int
+main(int argc, char** argv)
+{
+   int c;
+   int ret;
+   int server = -1;
+   int prefetch = DEFAULT_PREFETCH;
+   int exit_code = 1;
+   int option_index = 0;
+   char* configuration_path = NULL;
+   char* logfile = NULL;
+   char* spool = NULL;
+   char* name = NULL;
+   char* path = NULL;
+   char* spooled = NULL;
+   char* stored = NULL;
+   size_t size;
+   struct configuration* config = NULL;
+
+   while (1)
+   {
+      static struct option long_options[] =
+      {
+         {"config", required_argument, 0, 'c'},
+         {"directory", required_argument, 0, 'd'},
+         {"prefetch", required_argument, 0, 'n'},
+         {"logfile", required_argument, 0, 'L'},
+         {"version", no_argument, 0, 'V'},
+         {"help", no_argument, 0, '?'}
+      };
+
+      c = getopt_long(argc, argv, "V?c:d:n:L:",
+                      long_options, &option_index);
+
+      if (c == -1)
+      {
+         break;
+      }
+
+      switch (c)
+      {
+         case 'c':
+            configuration_path = optarg;
+            break;
+         case 'd':
+            spool = pgmoneta_append(spool, optarg);
+            break;
+         case 'n':
+            prefetch = atoi(optarg);
+            break;
+         case 'L':
+            logfile = optarg;
+            break;
+         case 'V':
+            version();
+            break;
+         case '?':
+            usage();
+            exit(1);
+            break;
+         default:
+            break;
+      }
+   }
+
+   if (getuid() == 0)
+   {
+      errx(1, "pgmoneta-walfetch: Using the root account is not allowed");
+   }
+
+   if (argc - optind != 3)
+   {
+      usage();
+      exit(1);
+   }
+
+   if (configuration_path == NULL)
+   {
+      configuration_path = "/etc/pgmoneta/pgmoneta.conf";
+   }
+
+   size = sizeof(struct configuration);
+   if (pgmoneta_create_shared_memory(size, HUGEPAGE_OFF, &shmem))
+   {
+      errx(1, "pgmoneta-walfetch: Error creating shared memory");
+   }
+   pgmoneta_init_configuration(shmem);
+
+   ret = pgmoneta_read_configuration(shmem, configuration_path);
+   if (ret)
+   {
+      errx(1, "pgmoneta-walfetch: Configuration not found: %s", configuration_path);
+   }
+
+   config = (struct configuration*)shmem;
+
+   if (logfile)
+   {
+      config->log_type = PGMONETA_LOGGING_TYPE_FILE;
+      memset(&config->log_path[0], 0, MISC_LENGTH);
+      memcpy(&config->log_path[0], logfile, MIN(MISC_LENGTH - 1, strlen(logfile)));
+   }
+
+   if (pgmoneta_start_logging())
+   {
+      exit(1);
+   }
+
+   server = find_server(argv[optind]);
+   name = argv[optind + 1];
+   path = argv[optind + 2];
+
+   if (server == -1)
+   {
+      pgmoneta_log_error("pgmoneta-walfetch: Unknown server %s", argv[optind]);
+      goto done;
+   }
+
+   /* PostgreSQL owns the data directory, so there is no default spool next to pg_wal */
+   if (spool == NULL)
+   {
+      prefetch = 0;
+   }
+
+   if (pgmoneta_wal_is_segment(name) && prefetch > 0)
+   {
+      if (pgmoneta_mkdir(spool) || write_next(spool, name))
+      {
+         pgmoneta_log_warn("pgmoneta-walfetch: Could not use %s", spool);
+         prefetch = 0;
+      }
+   }
+
+   if (prefetch > 0)
+   {
+      spooled = spool_file(spool, name);
+   }
+
+   if (prefetch > 0 && pgmoneta_exists(spooled) && rename(spooled, path) == 0)
+   {
+      pgmoneta_log_debug("pgmoneta-walfetch: %s from %s", name, spool);
+      exit_code = 0;
+   }
+   else if (!find_stored(server, name, &stored))
+   {
+      if (!fetch(stored, path))
+      {
+         pgmoneta_log_debug("pgmoneta-walfetch: %s from %s", name, stored);
+         exit_code = 0;
+      }
+   }
+
+   if (prefetch > 0 && pgmoneta_wal_is_segment(name))
+   {
+      start_helper(server, spool, prefetch);
+   }
+
+done:
+
+   free(spool);
+   free(spooled);
+   free(stored);
+
+   pgmoneta_stop_logging();
+   pgmoneta_destroy_shared_memory(shmem, size);
+
+   return exit_code;
+}
+
+static int
+find_server(char* name)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   for (int i = 0; i < config->number_of_servers; i++)
+   {
+      if (!strcmp(config->servers[i].name, name))
+      {
+         return i;
+      }
+   }
+
+   return -1;
+}
+
+/**
+ * Find the stored version of a WAL file, falling back to the partial
+ * segment pgmoneta was streaming into
+ */
+static int
+find_stored(int server, char* name, char** stored)
+{
+   char* f = NULL;
+   char* wal = NULL;
+
+   *stored = NULL;
+
+   wal = pgmoneta_get_server_wal(server);
+
+   f = pgmoneta_append(f, wal);
+   f = pgmoneta_append(f, name);
+
+   if (pgmoneta_stream_get_stored_file(f, stored))
+   {
+      f = pgmoneta_append(f, ".partial");
+
+      if (pgmoneta_stream_get_stored_file(f, stored))
+      {
+         goto error;
+      }
+   }
+
+   free(f);
+   free(wal);
+
+   return 0;
+
+error:
+
+   free(f);
+   free(wal);
+
+   return 1;
+}
+
+/**
+ * Decrypt and decompress a stored file. The result is written to a temporary
+ * file which is renamed once it is complete
+ */
+static int
+fetch(char* from, char* to)
+{
+   int fd = -1;
+   char* tmp = NULL;
+   char* buffer = NULL;
+   size_t length = 0;
+   size_t offset = 0;
+   ssize_t written = 0;
+   struct stream_reader* reader = NULL;
+
+   tmp = pgmoneta_append(tmp, to);
+   tmp = pgmoneta_append(tmp, ".tmp");
+
+   if (pgmoneta_stream_reader_init(from, &reader))
+   {
+      goto error;
+   }
+
+   buffer = (char*)malloc(DEFAULT_BUFFER_SIZE);
+
+   if (buffer == NULL)
+   {
+      goto error;
+   }
+
+   fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+   if (fd < 0)
+   {
+      pgmoneta_log_error("pgmoneta-walfetch: Could not create %s: %s", tmp, strerror(errno));
+      goto error;
+   }
+
+   do
+   {
+      if (pgmoneta_stream_reader_read(reader, buffer, DEFAULT_BUFFER_SIZE, &length))
+      {
+         pgmoneta_log_error("pgmoneta-walfetch: Could not read %s", from);
+         goto error;
+      }
+
+      offset = 0;
+
+      while (offset < length)
+      {
+         written = write(fd, buffer + offset, length - offset);
+
+         if (written < 0)
+         {
+            if (errno == EINTR)
+            {
+               continue;
+            }
+
+            pgmoneta_log_error("pgmoneta-walfetch: Could not write %s: %s", tmp, strerror(errno));
+            goto error;
+         }
+
+         offset += written;
+      }
+   }
+   while (length > 0);
+
+   if (close(fd) < 0)
+   {
+      fd = -1;
+      goto error;
+   }
+   fd = -1;
+
+   if (rename(tmp, to))
+   {
+      goto error;
+   }
+
+   pgmoneta_stream_reader_destroy(reader);
+   free(buffer);
+   free(tmp);
+
+   return 0;
+
+error:
+
+   if (fd >= 0)
+   {
+      close(fd);
+   }
+
+   unlink(tmp);
+
+   pgmoneta_stream_reader_destroy(reader);
+   free(buffer);
+   free(tmp);
+
+   return 1;
+}
+
+/**
+ * Tell the helper which segment is being replayed
+ */
+static int
+write_next(char* spool, char* name)
+{
+   FILE* file = NULL;
+   char* f = NULL;
+   char* tmp = NULL;
+
+   f = spool_file(spool, SPOOL_NEXT);
+   tmp = pgmoneta_append(tmp, f);
+   tmp = pgmoneta_append(tmp, ".tmp");
+
+   file = fopen(tmp, "w");
+
+   if (file == NULL)
+   {
+      goto error;
+   }
+
+   fputs(name, file);
+   fclose(file);
+
+   if (rename(tmp, f))
+   {
+      goto error;
+   }
+
+   free(f);
+   free(tmp);
+
+   return 0;
+
+error:
+
+   free(f);
+   free(tmp);
+
+   return 1;
+}
+
+/**
+ * Start the helper unless it is already running. The helper is detached
+ * from PostgreSQL, which waits for the restore_command to finish
+ */
+static void
+start_helper(int server, char* spool, int prefetch)
+{
+   pid_t pid;
+   pid_t running = 0;
+   int fd = -1;
+   char* f = NULL;
+   FILE* file = NULL;
+
+   f = spool_file(spool, SPOOL_PID);
+
+   file = fopen(f, "r");
+
+   if (file != NULL)
+   {
+      if (fscanf(file, "%d", &running) != 1)
+      {
+         running = 0;
+      }
+      fclose(file);
+
+      if (running > 0 && kill(running, 0) == 0)
+      {
+         free(f);
+         return;
+      }
+
+      unlink(f);
+   }
+
+   pid = fork();
+
+   if (pid == -1)
+   {
+      pgmoneta_log_warn("pgmoneta-walfetch: Could not start the helper: %s", strerror(errno));
+   }
+   else if (pid > 0)
+   {
+      waitpid(pid, NULL, 0);
+   }
+   else
+   {
+      setsid();
+
+      if (fork() != 0)
+      {
+         _exit(0);
+      }
+
+      fd = open(f, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+      if (fd < 0)
+      {
+         /* Another helper got there first */
+         _exit(0);
+      }
+
+      dprintf(fd, "%d\n", getpid());
+      close(fd);
+
+      fd = open("/dev/null", O_RDWR);
+      if (fd >= 0)
+      {
+         dup2(fd, STDIN_FILENO);
+         dup2(fd, STDOUT_FILENO);
+         dup2(fd, STDERR_FILENO);
+         if (fd > STDERR_FILENO)
+         {
+            close(fd);
+         }
+      }
+
+      helper(server, spool, prefetch);
+
+      unlink(f);
+      free(f);
+
+      pgmoneta_stop_logging();
+
+      _exit(0);
+   }
+
+   free(f);
+}
+
+/**
+ * Keep the segments after the one being replayed decoded in the spool. The
+ * helper stops when no segment has been requested for a while
+ */
+static void
+helper(int server, char* spool, int prefetch)
+{
+   int number_of_workers = 0;
+   int number_of_files = 0;
+   int scheduled = 0;
+   char** files = NULL;
+   char* wal = NULL;
+   char* f = NULL;
+   char* plain = NULL;
+   char* from = NULL;
+   char* to = NULL;
+   char next[MISC_LENGTH];
+   FILE* file = NULL;
+   struct stat st;
+   struct workers* workers = NULL;
+   struct worker_input* wi = NULL;
+
+   wal = pgmoneta_get_server_wal(server);
+   f = spool_file(spool, SPOOL_NEXT);
+
+   number_of_workers = pgmoneta_get_number_of_workers(server);
+   if (number_of_workers > 0)
+   {
+      pgmoneta_workers_initialize(number_of_workers, &workers);
+   }
+
+   while (true)
+   {
+      if (stat(f, &st) || time(NULL) - st.st_mtime > HELPER_IDLE_TIMEOUT)
+      {
+         break;
+      }
+
+      memset(&next[0], 0, sizeof(next));
+
+      file = fopen(f, "r");
+      if (file == NULL || fgets(&next[0], sizeof(next), file) == NULL || !pgmoneta_wal_is_segment(&next[0]))
+      {
+         if (file != NULL)
+         {
+            fclose(file);
+         }
+         break;
+      }
+      fclose(file);
+
+      /* Segments before the one being replayed, or of another timeline, won't be asked for again */
+      if (!pgmoneta_get_files(spool, &number_of_files, &files))
+      {
+         for (int i = 0; i < number_of_files; i++)
+         {
+            if (pgmoneta_wal_is_segment(files[i]) &&
+                (strncmp(files[i], &next[0], 8) || strcmp(files[i], &next[0]) < 0))
+            {
+               to = spool_file(spool, files[i]);
+               unlink(to);
+               free(to);
+               to = NULL;
+            }
+            free(files[i]);
+         }
+         free(files);
+         files = NULL;
+      }
+
+      scheduled = 0;
+
+      if (!pgmoneta_get_files(wal, &number_of_files, &files))
+      {
+         int found = 0;
+
+         for (int i = 0; i < number_of_files && found < prefetch; i++)
+         {
+            plain = pgmoneta_stream_plain_name(files[i]);
+
+            /* A segment that is still streamed would be served incomplete from the spool, and
+               recovery asks for the segments of another timeline only after it follows its history */
+            if (pgmoneta_wal_is_segment(plain) && !strncmp(plain, &next[0], 8) && strcmp(plain, &next[0]) > 0)
+            {
+               found++;
+
+               to = spool_file(spool, plain);
+
+               if (!pgmoneta_exists(to))
+               {
+                  from = pgmoneta_append(from, wal);
+                  from = pgmoneta_append(from, files[i]);
+
+                  if (!pgmoneta_create_worker_input(NULL, from, to, 0, workers, &wi))
+                  {
+                     if (workers != NULL)
+                     {
+                        pgmoneta_workers_add(workers, prefetch_segment, (void*)wi);
+                     }
+                     else
+                     {
+                        prefetch_segment(wi);
+                     }
+                     scheduled++;
+                  }
+
+                  free(from);
+                  from = NULL;
+               }
+
+               free(to);
+               to = NULL;
+            }
+
+            free(plain);
+            plain = NULL;
+         }
+
+         for (int i = 0; i < number_of_files; i++)
+         {
+            free(files[i]);
+         }
+         free(files);
+         files = NULL;
+      }
+
+      if (workers != NULL)
+      {
+         pgmoneta_workers_wait(workers);
+      }
+
+      if (scheduled == 0)
+      {
+         usleep(HELPER_POLL_INTERVAL);
+      }
+   }
+
+   if (workers != NULL)
+   {
+      pgmoneta_workers_destroy(workers);
+   }
+
+   /* Nothing more will be replayed, so drop the spool */
+   drop_spool(spool);
+
+   free(wal);
+   free(f);
+}
+
+static void
+prefetch_segment(void* arg)
+{
+   struct worker_input* wi = (struct worker_input*)arg;
+
+   if (fetch(wi->from, wi->to))
+   {
+      pgmoneta_log_warn("pgmoneta-walfetch: Could not prefetch %s", wi->from);
+   }
+
+   free(wi);
+}
+
+static char*
+spool_file(char* spool, char* name)
+{
+   char* f = NULL;
+
+   f = pgmoneta_append(f, spool);
+   if (!pgmoneta_ends_with(f, "/"))
+   {
+      f = pgmoneta_append(f, "/");
+   }
+   f = pgmoneta_append(f, name);
+
+   return f;
+}
+
+/**
+ * Remove the files of the helper from the spool, and the spool itself when
+ * nothing else is in it
+ */
+static void
+drop_spool(char* spool)
+{
+   int number_of_files = 0;
+   char** files = NULL;
+   char* plain = NULL;
+   char* f = NULL;
+
+   if (!pgmoneta_get_files(spool, &number_of_files, &files))
+   {
+      for (int i = 0; i < number_of_files; i++)
+      {
+         plain = pgmoneta_append(plain, files[i]);
+         if (pgmoneta_ends_with(plain, ".tmp"))
+         {
+            plain[strlen(plain) - 4] = '\0';
+         }
+
+         if (pgmoneta_wal_is_segment(plain) || !strcmp(files[i], SPOOL_NEXT) || !strcmp(files[i], SPOOL_PID))
+         {
+            f = spool_file(spool, files[i]);
+            unlink(f);
+            free(f);
+            f = NULL;
+         }
+
+         free(plain);
+         plain = NULL;
+
+         free(files[i]);
+      }
+      free(files);
+   }
+
+   rmdir(spool);
+}
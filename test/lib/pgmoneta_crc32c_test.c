@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "pgmoneta_crc32c_test.h"
+
+/* pgmoneta */
+#include <crc32c.h>
+#include <security.h>
+
+/* system */
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BUFFER_SIZE 4096
+
+static uint32_t crc32c(void* buffer, size_t size, bool software);
+static void fill(unsigned char* buffer, size_t size);
+
+// known answers from RFC 3720, and the check value of CRC-32C
+START_TEST(test_crc32c_known_answers)
+{
+   unsigned char zeros[32];
+   unsigned char ones[32];
+   unsigned char increasing[32];
+   unsigned char decreasing[32];
+   char* check = "123456789";
+
+   memset(zeros, 0, sizeof(zeros));
+   memset(ones, 0xFF, sizeof(ones));
+
+   for (int i = 0; i < 32; i++)
+   {
+      increasing[i] = (unsigned char)i;
+      decreasing[i] = (unsigned char)(31 - i);
+   }
+
+   for (int i = 0; i < 2; i++)
+   {
+      bool software = i == 1;
+
+      ck_assert_uint_eq(crc32c(check, strlen(check), software), 0xE3069283);
+      ck_assert_uint_eq(crc32c(zeros, sizeof(zeros), software), 0x8A9136AA);
+      ck_assert_uint_eq(crc32c(ones, sizeof(ones), software), 0x62A8AB43);
+      ck_assert_uint_eq(crc32c(increasing, sizeof(increasing), software), 0x46DD794E);
+      ck_assert_uint_eq(crc32c(decreasing, sizeof(decreasing), software), 0x113FDB5C);
+      ck_assert_uint_eq(crc32c(check, 0, software), 0);
+   }
+}
+END_TEST
+// a buffer calculated in parts has the same value as in one call
+START_TEST(test_crc32c_parts)
+{
+   unsigned char buffer[BUFFER_SIZE];
+   uint32_t expected = 0;
+   uint32_t crc = 0;
+   size_t parts[] = {1, 3, 7, 8, 9, 63, 64, 65, 1000};
+   size_t offset = 0;
+
+   fill(buffer, sizeof(buffer));
+
+   ck_assert_int_eq(pgmoneta_create_crc32c_buffer_software(buffer, sizeof(buffer), &expected), 0);
+
+   for (int i = 0; offset < sizeof(buffer); i = (i + 1) % (int)(sizeof(parts) / sizeof(parts[0])))
+   {
+      size_t length = parts[i];
+
+      if (offset + length > sizeof(buffer))
+      {
+         length = sizeof(buffer) - offset;
+      }
+
+      ck_assert_int_eq(pgmoneta_create_crc32c_buffer(buffer + offset, length, &crc), 0);
+      offset += length;
+   }
+
+   ck_assert_uint_eq(crc, expected);
+}
+END_TEST
+// the CRC32C instructions agree with slicing-by-8 on any alignment and size
+START_TEST(test_crc32c_hardware)
+{
+   unsigned char buffer[BUFFER_SIZE + 8];
+   uint32_t hardware;
+   uint32_t software;
+
+   if (!pgmoneta_crc32c_hardware_available())
+   {
+      return;
+   }
+
+   fill(buffer, sizeof(buffer));
+
+   for (size_t offset = 0; offset < 8; offset++)
+   {
+      for (size_t size = 0; size <= 256; size++)
+      {
+         hardware = ~pgmoneta_crc32c_hardware(~0U, buffer + offset, size);
+         software = crc32c(buffer + offset, size, true);
+
+         ck_assert_uint_eq(hardware, software);
+      }
+
+      hardware = ~pgmoneta_crc32c_hardware(~0U, buffer + offset, BUFFER_SIZE);
+      software = crc32c(buffer + offset, BUFFER_SIZE, true);
+
+      ck_assert_uint_eq(hardware, software);
+   }
+}
+END_TEST
+
+Suite*
+pgmoneta_crc32c_suite(void)
+{
+   Suite* s;
+   TCase* tc_core;
+
+   s = suite_create("pgmoneta_crc32c");
+
+   tc_core = tcase_create("Core");
+
+   tcase_add_test(tc_core, test_crc32c_known_answers);
+   tcase_add_test(tc_core, test_crc32c_parts);
+   tcase_add_test(tc_core, test_crc32c_hardware);
+   suite_add_tcase(s, tc_core);
+
+   return s;
+}
+
+static uint32_t
+crc32c(void* buffer, size_t size, bool software)
+{
+   uint32_t crc = 0;
+
+   if (software)
+   {
+      pgmoneta_create_crc32c_buffer_software(buffer, size, &crc);
+   }
+   else
+   {
+      pgmoneta_create_crc32c_buffer(buffer, size, &crc);
+   }
+
+   return crc;
+}
+
+static void
+fill(unsigned char* buffer, size_t size)
+{
+   uint32_t x = 0x12345678;
+
+   for (size_t i = 0; i < size; i++)
+   {
+      x = x * 1103515245 + 12345;
+      buffer[i] = (unsigned char)(x >> 16);
+   }
+}
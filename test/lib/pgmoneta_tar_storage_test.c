@@ -0,0 +1,404 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "pgmoneta_tar_storage_test.h"
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <configuration.h>
+#include <shmem.h>
+#include <tar_storage.h>
+#include <utils.h>
+
+/* system */
+#include <dirent.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#define PG_CONTROL_SIZE 8292
+#define LONG_PATH_SIZE  700
+#define CHUNK_SIZE      100
+
+static void setup(void);
+static void teardown(void);
+static char* create_directory(void);
+static size_t add_member(char* tar, char* name, char type, void* data, size_t size);
+static size_t create_tar(char* tar, bool complete);
+static void write_tar(struct tar_storage_writer* writer, char* tar, size_t size);
+static bool has_content(char* path, void* data, size_t size);
+static bool is_empty(char* directory);
+
+static char pg_control[PG_CONTROL_SIZE];
+static char long_path_data[LONG_PATH_SIZE];
+static char long_path[MAX_PATH];
+static char* pg_version = "16\n";
+static char* backup_label = "START WAL LOCATION: 0/2000028 (file 000000010000000000000002)\n";
+
+// write a tar stream, look up its members through the index, and extract it
+START_TEST(test_tar_storage_round_trip)
+{
+   char* directory = NULL;
+   char* restore = NULL;
+   char* path = NULL;
+   char* tar = NULL;
+   char buffer[1000];
+   char* data = NULL;
+   char* excluded[] = {"/backup_label", NULL};
+   size_t size = 0;
+   size_t length = 0;
+   uint64_t total = 0;
+   struct stat st;
+   struct tar_storage_member* member = NULL;
+   struct tar_storage_reader* reader = NULL;
+   struct tar_storage_writer* writer = NULL;
+
+   directory = create_directory();
+   ck_assert_ptr_nonnull(directory);
+
+   tar = (char*)malloc(64 * 1024);
+   ck_assert_ptr_nonnull(tar);
+   size = create_tar(tar, true);
+
+   ck_assert_int_eq(pgmoneta_tar_storage_writer_init(directory, "base", &writer), 0);
+   write_tar(writer, tar, size);
+   ck_assert_int_eq(pgmoneta_tar_storage_writer_destroy(writer), 0);
+
+   ck_assert(pgmoneta_tar_storage_exists(directory));
+
+   path = pgmoneta_append(NULL, directory);
+   path = pgmoneta_append(path, "/backup_label");
+   ck_assert(has_content(path, backup_label, strlen(backup_label)));
+   free(path);
+   path = NULL;
+
+   ck_assert_int_eq(pgmoneta_tar_storage_size(directory, &total), 0);
+   ck_assert_uint_eq(total, strlen(pg_version) + PG_CONTROL_SIZE + LONG_PATH_SIZE + strlen(backup_label));
+
+   /* Lookups through the index */
+   ck_assert_int_eq(pgmoneta_tar_storage_reader_init(directory, &reader), 0);
+
+   ck_assert_int_eq(pgmoneta_tar_storage_reader_find(reader, "global/pg_control", &member), 0);
+   ck_assert_int_eq(member->type, '0');
+   ck_assert_uint_eq(member->size, PG_CONTROL_SIZE);
+
+   data = (char*)malloc(PG_CONTROL_SIZE);
+   ck_assert_ptr_nonnull(data);
+   total = 0;
+
+   do
+   {
+      ck_assert_int_eq(pgmoneta_tar_storage_reader_read(reader, buffer, sizeof(buffer), &length), 0);
+      ck_assert_uint_eq(total + length <= PG_CONTROL_SIZE, 1);
+      memcpy(data + total, buffer, length);
+      total += length;
+   }
+   while (length > 0);
+
+   ck_assert_uint_eq(total, PG_CONTROL_SIZE);
+   ck_assert_mem_eq(data, pg_control, PG_CONTROL_SIZE);
+
+   ck_assert_int_eq(pgmoneta_tar_storage_reader_find(reader, long_path, &member), 0);
+   ck_assert_uint_eq(member->size, LONG_PATH_SIZE);
+   ck_assert_int_eq(pgmoneta_tar_storage_reader_read(reader, buffer, sizeof(buffer), &length), 0);
+   ck_assert_uint_eq(length, LONG_PATH_SIZE);
+   ck_assert_mem_eq(buffer, long_path_data, LONG_PATH_SIZE);
+
+   ck_assert_int_eq(pgmoneta_tar_storage_reader_find(reader, "PG_VERSION", &member), 0);
+   ck_assert_uint_eq(member->size, strlen(pg_version));
+
+   ck_assert_int_ne(pgmoneta_tar_storage_reader_find(reader, "global/pg_filenode.map", &member), 0);
+
+   ck_assert_int_eq(pgmoneta_tar_storage_reader_destroy(reader), 0);
+   reader = NULL;
+
+   /* Extract the whole tar file */
+   restore = pgmoneta_append(NULL, directory);
+   restore = pgmoneta_append(restore, "/restore");
+
+   ck_assert_int_eq(pgmoneta_tar_storage_extract(directory, restore, excluded), 0);
+
+   path = pgmoneta_append(NULL, restore);
+   path = pgmoneta_append(path, "/global");
+   ck_assert_int_eq(stat(path, &st), 0);
+   ck_assert(S_ISDIR(st.st_mode));
+   path = pgmoneta_append(path, "/pg_control");
+   ck_assert(has_content(path, pg_control, PG_CONTROL_SIZE));
+   free(path);
+
+   path = pgmoneta_append(NULL, restore);
+   path = pgmoneta_append(path, "/PG_VERSION");
+   ck_assert(has_content(path, pg_version, strlen(pg_version)));
+   free(path);
+
+   path = pgmoneta_append(NULL, restore);
+   path = pgmoneta_append(path, "/");
+   path = pgmoneta_append(path, long_path);
+   ck_assert(has_content(path, long_path_data, LONG_PATH_SIZE));
+   free(path);
+
+   path = pgmoneta_append(NULL, restore);
+   path = pgmoneta_append(path, "/backup_label");
+   ck_assert(!pgmoneta_exists(path));
+   free(path);
+
+   /* Extract a single file */
+   path = pgmoneta_append(NULL, directory);
+   path = pgmoneta_append(path, "/pg_control.copy");
+   ck_assert_int_eq(pgmoneta_tar_storage_extract_file(directory, "/global/pg_control", path), 0);
+   ck_assert(has_content(path, pg_control, PG_CONTROL_SIZE));
+   free(path);
+   path = NULL;
+
+   pgmoneta_delete_directory(directory);
+
+   free(data);
+   free(tar);
+   free(restore);
+   free(directory);
+}
+END_TEST
+// incomplete tar data removes the stored tar file and the extracted backup label
+START_TEST(test_tar_storage_incomplete)
+{
+   char* directory = NULL;
+   char* tar = NULL;
+   size_t size = 0;
+   struct tar_storage_writer* writer = NULL;
+
+   directory = create_directory();
+   ck_assert_ptr_nonnull(directory);
+
+   tar = (char*)malloc(64 * 1024);
+   ck_assert_ptr_nonnull(tar);
+   size = create_tar(tar, false);
+
+   ck_assert_int_eq(pgmoneta_tar_storage_writer_init(directory, "base", &writer), 0);
+   write_tar(writer, tar, size);
+   ck_assert_int_ne(pgmoneta_tar_storage_writer_destroy(writer), 0);
+
+   ck_assert(!pgmoneta_tar_storage_exists(directory));
+   ck_assert(is_empty(directory));
+
+   pgmoneta_delete_directory(directory);
+
+   free(tar);
+   free(directory);
+}
+END_TEST
+
+Suite*
+pgmoneta_tar_storage_suite(void)
+{
+   Suite* s;
+   TCase* tc_core;
+
+   s = suite_create("pgmoneta_tar_storage");
+
+   tc_core = tcase_create("Core");
+
+   tcase_add_checked_fixture(tc_core, setup, teardown);
+   tcase_add_test(tc_core, test_tar_storage_round_trip);
+   tcase_add_test(tc_core, test_tar_storage_incomplete);
+   suite_add_tcase(s, tc_core);
+
+   return s;
+}
+
+static void
+setup(void)
+{
+   struct configuration* config;
+
+   pgmoneta_create_shared_memory(sizeof(struct configuration), HUGEPAGE_OFF, &shmem);
+   pgmoneta_init_configuration(shmem);
+
+   config = (struct configuration*)shmem;
+   config->compression_type = COMPRESSION_NONE;
+
+   for (int i = 0; i < PG_CONTROL_SIZE; i++)
+   {
+      pg_control[i] = (char)(i * 7);
+   }
+
+   for (int i = 0; i < LONG_PATH_SIZE; i++)
+   {
+      long_path_data[i] = (char)(i * 13);
+   }
+
+   /* Longer than the name field, so it is sent as a GNU long name */
+   memset(long_path, 0, sizeof(long_path));
+   snprintf(long_path, sizeof(long_path), "base/1/");
+   memset(long_path + strlen(long_path), 'a', 150);
+}
+
+static void
+teardown(void)
+{
+   pgmoneta_destroy_shared_memory(shmem, sizeof(struct configuration));
+   shmem = NULL;
+}
+
+static char*
+create_directory(void)
+{
+   char template[] = "/tmp/pgmoneta_tar_storage_XXXXXX";
+
+   if (mkdtemp(template) == NULL)
+   {
+      return NULL;
+   }
+
+   return pgmoneta_append(NULL, template);
+}
+
+static size_t
+add_member(char* tar, char* name, char type, void* data, size_t size)
+{
+   unsigned int checksum = 0;
+   size_t length = TAR_BLOCK_SIZE;
+
+   memset(tar, 0, TAR_BLOCK_SIZE);
+
+   memcpy(tar, name, MIN(strlen(name), 100));
+   snprintf(tar + 100, 8, "%07o", type == '5' ? 0700 : 0600);
+   snprintf(tar + 108, 8, "%07o", 0);
+   snprintf(tar + 116, 8, "%07o", 0);
+   snprintf(tar + 124, 12, "%011zo", size);
+   snprintf(tar + 136, 12, "%011o", 0);
+   tar[156] = type;
+   memcpy(tar + 257, "ustar", 6);
+   memcpy(tar + 263, "00", 2);
+
+   memset(tar + 148, ' ', 8);
+   for (int i = 0; i < TAR_BLOCK_SIZE; i++)
+   {
+      checksum += (unsigned char)tar[i];
+   }
+   snprintf(tar + 148, 8, "%06o", checksum);
+
+   if (size > 0)
+   {
+      memcpy(tar + length, data, size);
+      length += size;
+
+      /* The data is padded to a block */
+      memset(tar + length, 0, (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+      length += (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+   }
+
+   return length;
+}
+
+static size_t
+create_tar(char* tar, bool complete)
+{
+   size_t size = 0;
+
+   /* Like the server, without the end of the archive */
+   size += add_member(tar + size, "backup_label", '0', backup_label, strlen(backup_label));
+   size += add_member(tar + size, "global/", '5', NULL, 0);
+   size += add_member(tar + size, "PG_VERSION", '0', pg_version, strlen(pg_version));
+   size += add_member(tar + size, "global/pg_control", '0', pg_control, PG_CONTROL_SIZE);
+
+   if (!complete)
+   {
+      return size - 1000;
+   }
+
+   size += add_member(tar + size, "././@LongLink", 'L', long_path, strlen(long_path) + 1);
+   size += add_member(tar + size, long_path, '0', long_path_data, LONG_PATH_SIZE);
+
+   return size;
+}
+
+static void
+write_tar(struct tar_storage_writer* writer, char* tar, size_t size)
+{
+   /* The messages from the server don't follow the tar blocks */
+   for (size_t offset = 0; offset < size; offset += CHUNK_SIZE)
+   {
+      ck_assert_int_eq(pgmoneta_tar_storage_writer_write(writer, tar + offset, MIN(CHUNK_SIZE, size - offset)), 0);
+   }
+}
+
+static bool
+has_content(char* path, void* data, size_t size)
+{
+   char* buffer = NULL;
+   size_t length = 0;
+   bool equal = false;
+   FILE* file = NULL;
+
+   file = fopen(path, "r");
+
+   if (file == NULL)
+   {
+      return false;
+   }
+
+   buffer = (char*)malloc(size + 1);
+
+   if (buffer != NULL)
+   {
+      length = fread(buffer, 1, size + 1, file);
+      equal = length == size && !memcmp(buffer, data, size);
+   }
+
+   free(buffer);
+   fclose(file);
+
+   return equal;
+}
+
+static bool
+is_empty(char* directory)
+{
+   int entries = 0;
+   DIR* dir = NULL;
+   struct dirent* entry = NULL;
+
+   dir = opendir(directory);
+
+   if (dir == NULL)
+   {
+      return false;
+   }
+
+   while ((entry = readdir(dir)) != NULL)
+   {
+      if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+      {
+         entries++;
+      }
+   }
+
+   closedir(dir);
+
+   return entries == 0;
+}
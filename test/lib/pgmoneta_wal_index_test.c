@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "pgmoneta_wal_index_test.h"
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <configuration.h>
+#include <shmem.h>
+#include <utils.h>
+#include <walfile/wal_index.h>
+
+/* system */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define WAL_SIZE (16 * 1024 * 1024)
+
+static void setup(void);
+static void teardown(void);
+static void create_segment(xlog_seg_no segno);
+static void remove_segment(xlog_seg_no segno);
+static xlog_rec_ptr lsn(xlog_seg_no segno, uint32_t offset);
+static void check_restorable(xlog_rec_ptr start, xlog_rec_ptr end, char* missing);
+
+static char base_dir[MAX_PATH];
+static char* wal_dir = NULL;
+
+// a WAL segment without a file is a gap, and the WAL after it isn't restorable
+START_TEST(test_wal_index_gap)
+{
+   int number_of_entries = 0;
+   struct wal_index_entry* entries = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   create_segment(1);
+   create_segment(2);
+   create_segment(4);
+
+   ck_assert_int_eq(pgmoneta_wal_index_update(0, wal_dir), 0);
+   ck_assert_uint_eq(atomic_load(&config->servers[0].wal_missing_segments), 1);
+
+   ck_assert_int_eq(pgmoneta_wal_index_read(0, &number_of_entries, &entries), 0);
+   ck_assert_int_eq(number_of_entries, 3);
+   ck_assert_uint_eq(entries[0].segno, 1);
+   ck_assert_uint_eq(entries[1].segno, 2);
+   ck_assert_uint_eq(entries[2].segno, 4);
+   free(entries);
+
+   /* Recovery reads the WAL segment after the end */
+   check_restorable(lsn(1, 0x28), lsn(1, 0x100), NULL);
+   check_restorable(lsn(1, 0x28), lsn(2, 0x100), "000000010000000000000003");
+   check_restorable(lsn(1, 0x28), lsn(4, 0x100), "000000010000000000000003");
+   check_restorable(lsn(4, 0x28), UINT64_MAX, NULL);
+   check_restorable(lsn(1, 0x28), UINT64_MAX, "000000010000000000000003");
+
+   create_segment(3);
+
+   ck_assert_int_eq(pgmoneta_wal_index_update(0, wal_dir), 0);
+   ck_assert_uint_eq(atomic_load(&config->servers[0].wal_missing_segments), 0);
+
+   check_restorable(lsn(1, 0x28), lsn(3, 0x100), NULL);
+   check_restorable(lsn(1, 0x28), lsn(4, 0x100), "000000010000000000000005");
+   check_restorable(lsn(1, 0x28), UINT64_MAX, NULL);
+}
+END_TEST
+// WAL segments removed by retention are removed from the index
+START_TEST(test_wal_index_retention)
+{
+   int number_of_entries = 0;
+   struct wal_index_entry* entries = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   for (xlog_seg_no segno = 1; segno <= 4; segno++)
+   {
+      create_segment(segno);
+   }
+
+   ck_assert_int_eq(pgmoneta_wal_index_update(0, wal_dir), 0);
+   ck_assert_uint_eq(atomic_load(&config->servers[0].wal_missing_segments), 0);
+
+   /* The oldest WAL segment, and one in the middle */
+   remove_segment(1);
+   remove_segment(3);
+
+   ck_assert_int_eq(pgmoneta_wal_index_update(0, wal_dir), 0);
+   ck_assert_uint_eq(atomic_load(&config->servers[0].wal_missing_segments), 1);
+
+   ck_assert_int_eq(pgmoneta_wal_index_read(0, &number_of_entries, &entries), 0);
+   ck_assert_int_eq(number_of_entries, 2);
+   ck_assert_uint_eq(entries[0].segno, 2);
+   ck_assert_uint_eq(entries[1].segno, 4);
+   free(entries);
+
+   check_restorable(lsn(1, 0x28), lsn(1, 0x100), "000000010000000000000001");
+   check_restorable(lsn(2, 0x28), lsn(2, 0x100), "000000010000000000000003");
+}
+END_TEST
+// the journal of the WAL receiver is merged into the index
+START_TEST(test_wal_index_journal)
+{
+   int number_of_entries = 0;
+   char* journal = NULL;
+   struct wal_index_entry* entries = NULL;
+
+   create_segment(1);
+   create_segment(2);
+
+   ck_assert_int_eq(pgmoneta_wal_index_add(0, 1, 1, 0xDEADBEEF), 0);
+   ck_assert_int_eq(pgmoneta_wal_index_add(0, 1, 2, 0x01020304), 0);
+
+   ck_assert_int_eq(pgmoneta_wal_index_update(0, wal_dir), 0);
+
+   ck_assert_int_eq(pgmoneta_wal_index_read(0, &number_of_entries, &entries), 0);
+   ck_assert_int_eq(number_of_entries, 2);
+   ck_assert(entries[0].has_checksum);
+   ck_assert_uint_eq(entries[0].checksum, 0xDEADBEEF);
+   ck_assert(entries[1].has_checksum);
+   ck_assert_uint_eq(entries[1].checksum, 0x01020304);
+   free(entries);
+
+   journal = pgmoneta_get_server(0);
+   journal = pgmoneta_append(journal, "wal_index.journal");
+   ck_assert_int_eq(pgmoneta_get_file_size(journal), 0);
+   free(journal);
+
+   check_restorable(lsn(1, 0x28), lsn(1, 0x100), NULL);
+}
+END_TEST
+
+Suite*
+pgmoneta_wal_index_suite(void)
+{
+   Suite* s;
+   TCase* tc_core;
+
+   s = suite_create("pgmoneta_wal_index");
+
+   tc_core = tcase_create("Core");
+
+   tcase_add_checked_fixture(tc_core, setup, teardown);
+   tcase_add_test(tc_core, test_wal_index_gap);
+   tcase_add_test(tc_core, test_wal_index_retention);
+   tcase_add_test(tc_core, test_wal_index_journal);
+   suite_add_tcase(s, tc_core);
+
+   return s;
+}
+
+static void
+setup(void)
+{
+   char template[] = "/tmp/pgmoneta_wal_index_XXXXXX";
+   struct configuration* config;
+
+   pgmoneta_create_shared_memory(sizeof(struct configuration), HUGEPAGE_OFF, &shmem);
+   pgmoneta_init_configuration(shmem);
+
+   ck_assert_ptr_nonnull(mkdtemp(template));
+   snprintf(base_dir, sizeof(base_dir), "%s", template);
+
+   config = (struct configuration*)shmem;
+
+   snprintf(config->base_dir, sizeof(config->base_dir), "%s", base_dir);
+   snprintf(config->servers[0].name, sizeof(config->servers[0].name), "primary");
+   config->servers[0].wal_size = WAL_SIZE;
+   config->number_of_servers = 1;
+
+   wal_dir = pgmoneta_get_server_wal(0);
+   ck_assert_int_eq(pgmoneta_mkdir(wal_dir), 0);
+}
+
+static void
+teardown(void)
+{
+   pgmoneta_delete_directory(base_dir);
+
+   free(wal_dir);
+   wal_dir = NULL;
+
+   pgmoneta_destroy_shared_memory(shmem, sizeof(struct configuration));
+   shmem = NULL;
+}
+
+static void
+create_segment(xlog_seg_no segno)
+{
+   char path[MAX_PATH];
+   FILE* file = NULL;
+
+   snprintf(path, sizeof(path), "%s%08X%08X%08X", wal_dir, 1, 0, (uint32_t)segno);
+
+   file = fopen(path, "w");
+   ck_assert_ptr_nonnull(file);
+   fclose(file);
+}
+
+static void
+remove_segment(xlog_seg_no segno)
+{
+   char path[MAX_PATH];
+
+   snprintf(path, sizeof(path), "%s%08X%08X%08X", wal_dir, 1, 0, (uint32_t)segno);
+
+   ck_assert_int_eq(unlink(path), 0);
+}
+
+static xlog_rec_ptr
+lsn(xlog_seg_no segno, uint32_t offset)
+{
+   return segno * WAL_SIZE + offset;
+}
+
+static void
+check_restorable(xlog_rec_ptr start, xlog_rec_ptr end, char* missing)
+{
+   bool restorable = false;
+   char* first_missing = NULL;
+
+   ck_assert_int_eq(pgmoneta_wal_index_restorable(0, 1, start, end, &restorable, &first_missing), 0);
+
+   if (missing == NULL)
+   {
+      ck_assert(restorable);
+      ck_assert_ptr_null(first_missing);
+   }
+   else
+   {
+      ck_assert(!restorable);
+      ck_assert_str_eq(first_missing, missing);
+   }
+
+   free(first_missing);
+}
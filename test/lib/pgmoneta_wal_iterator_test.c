@@ -0,0 +1,368 @@
+/*
+ * Copyright (C) 2024 The pgmoneta community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "pgmoneta_wal_iterator_test.h"
+
+/* pgmoneta */
+#include <pgmoneta.h>
+#include <security.h>
+#include <utils.h>
+#include <walfile.h>
+#include <walfile/rm.h>
+#include <walfile/wal_reader.h>
+
+/* system */
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BLOCK_SIZE         8192
+#define SEGMENT_SIZE       (4 * BLOCK_SIZE)
+#define NUMBER_OF_SEGMENTS 2
+#define START_LSN          ((xlog_rec_ptr)64 * SEGMENT_SIZE)
+#define MAX_RECORDS        64
+
+static void setup(void);
+static void teardown(void);
+static void add_record(uint32_t length);
+static void fill(char* data, uint32_t length, int record);
+static int write_segment(int segment, char* path);
+static int iterate(char* path, char* follow, struct wal_iterator** iterator);
+
+static char wal[NUMBER_OF_SEGMENTS * SEGMENT_SIZE];
+static size_t position;
+static xlog_rec_ptr prev;
+
+static int number_of_records;
+static xlog_rec_ptr lsns[MAX_RECORDS + 1];
+static uint32_t lengths[MAX_RECORDS];
+
+/* The record crossing into the second WAL segment */
+static int crossing;
+
+static char directory[MAX_PATH];
+static char first[MAX_PATH];
+static char second[MAX_PATH];
+static struct server server_info;
+
+// records crossing pages, and the record completed from the next WAL segment
+START_TEST(test_wal_iterator_follow)
+{
+   struct wal_iterator* iterator = NULL;
+
+   ck_assert_int_eq(iterate(first, second, &iterator), crossing + 1);
+
+   ck_assert(!iterator->error);
+   ck_assert(!iterator->incomplete);
+   ck_assert(iterator->followed);
+
+   pgmoneta_wal_iterator_destroy(iterator);
+}
+END_TEST
+// the record crossing into the next WAL segment is incomplete without it
+START_TEST(test_wal_iterator_incomplete)
+{
+   struct wal_iterator* iterator = NULL;
+
+   ck_assert_int_eq(iterate(first, NULL, &iterator), crossing);
+
+   ck_assert(!iterator->error);
+   ck_assert(iterator->incomplete);
+
+   pgmoneta_wal_iterator_destroy(iterator);
+}
+END_TEST
+// the rest of the record from the previous WAL segment is skipped
+START_TEST(test_wal_iterator_continuation)
+{
+   struct wal_iterator* iterator = NULL;
+
+   ck_assert_int_eq(iterate(second, NULL, &iterator), number_of_records - crossing - 1);
+
+   ck_assert(!iterator->error);
+   ck_assert(!iterator->incomplete);
+
+   pgmoneta_wal_iterator_destroy(iterator);
+}
+END_TEST
+// the iteration stops at a record with an invalid CRC
+START_TEST(test_wal_iterator_crc)
+{
+   struct wal_iterator* iterator = NULL;
+
+   /* The second record crosses pages, its data is changed on the second page */
+   wal[BLOCK_SIZE + 100] ^= 0x01;
+   ck_assert_int_eq(write_segment(0, first), 0);
+
+   ck_assert_int_eq(iterate(first, second, &iterator), 1);
+
+   ck_assert(iterator->error);
+
+   pgmoneta_wal_iterator_destroy(iterator);
+}
+END_TEST
+
+Suite*
+pgmoneta_wal_iterator_suite(void)
+{
+   Suite* s;
+   TCase* tc_core;
+
+   s = suite_create("pgmoneta_wal_iterator");
+
+   tc_core = tcase_create("Core");
+
+   tcase_add_checked_fixture(tc_core, setup, teardown);
+   tcase_add_test(tc_core, test_wal_iterator_follow);
+   tcase_add_test(tc_core, test_wal_iterator_incomplete);
+   tcase_add_test(tc_core, test_wal_iterator_continuation);
+   tcase_add_test(tc_core, test_wal_iterator_crc);
+   suite_add_tcase(s, tc_core);
+
+   return s;
+}
+
+static void
+setup(void)
+{
+   char template[] = "/tmp/pgmoneta_wal_iterator_XXXXXX";
+   struct xlog_long_page_header_data* long_header = NULL;
+   struct xlog_page_header_data* page_header = NULL;
+
+   memset(wal, 0, sizeof(wal));
+   memset(&server_info, 0, sizeof(server_info));
+   server_info.version = 17;
+
+   for (size_t page = 0; page < sizeof(wal) / BLOCK_SIZE; page++)
+   {
+      page_header = (struct xlog_page_header_data*)(wal + page * BLOCK_SIZE);
+
+      page_header->xlp_magic = XLOG_PAGE_MAGIC;
+      page_header->xlp_tli = 1;
+      page_header->xlp_pageaddr = START_LSN + page * BLOCK_SIZE;
+
+      if ((page * BLOCK_SIZE) % SEGMENT_SIZE == 0)
+      {
+         long_header = (struct xlog_long_page_header_data*)page_header;
+
+         long_header->std.xlp_info = XLP_LONG_HEADER;
+         long_header->xlp_sysid = 7000000000000000000ULL;
+         long_header->xlp_seg_size = SEGMENT_SIZE;
+         long_header->xlp_xlog_blcksz = BLOCK_SIZE;
+      }
+   }
+
+   position = 0;
+   prev = 0;
+   number_of_records = 0;
+
+   add_record(100);
+
+   /* Crosses two page boundaries */
+   add_record(20000);
+
+   while (position % SEGMENT_SIZE + 2000 < SEGMENT_SIZE - BLOCK_SIZE / 2)
+   {
+      add_record(1000);
+   }
+
+   crossing = number_of_records;
+   add_record(SEGMENT_SIZE - position % SEGMENT_SIZE + 3000);
+
+   add_record(200);
+   add_record(300);
+
+   lsns[number_of_records] = START_LSN + position;
+
+   ck_assert_ptr_nonnull(mkdtemp(template));
+
+   snprintf(directory, sizeof(directory), "%s", template);
+   snprintf(first, sizeof(first), "%s/%08X%08X%08X", template, 1, 0, (uint32_t)(START_LSN / SEGMENT_SIZE));
+   snprintf(second, sizeof(second), "%s/%08X%08X%08X", template, 1, 0, (uint32_t)(START_LSN / SEGMENT_SIZE) + 1);
+
+   ck_assert_int_eq(write_segment(0, first), 0);
+   ck_assert_int_eq(write_segment(1, second), 0);
+}
+
+static void
+teardown(void)
+{
+   pgmoneta_delete_directory(directory);
+}
+
+static void
+add_record(uint32_t length)
+{
+   char* record = NULL;
+   uint32_t total_length = 0;
+   uint32_t copied = 0;
+   uint32_t crc = 0;
+   size_t header = 0;
+   size_t data = 0;
+   size_t n = 0;
+   struct xlog_record* r = NULL;
+   struct xlog_page_header_data* page_header = NULL;
+
+   ck_assert_int_gt(MAX_RECORDS, number_of_records);
+
+   header = length <= UINT8_MAX ? 2 : 5;
+   total_length = SIZE_OF_XLOG_RECORD + header + length;
+
+   record = (char*)calloc(1, total_length);
+   ck_assert_ptr_nonnull(record);
+
+   r = (struct xlog_record*)record;
+   r->xl_tot_len = total_length;
+   r->xl_xid = 1000 + number_of_records;
+   r->xl_prev = prev;
+   r->xl_info = 0;
+   r->xl_rmid = RM_XLOG_ID;
+
+   data = SIZE_OF_XLOG_RECORD;
+   if (length <= UINT8_MAX)
+   {
+      record[data] = (char)XLR_BLOCK_ID_DATA_SHORT;
+      record[data + 1] = (char)length;
+   }
+   else
+   {
+      record[data] = (char)XLR_BLOCK_ID_DATA_LONG;
+      memcpy(record + data + 1, &length, sizeof(uint32_t));
+   }
+   fill(record + data + header, length, number_of_records);
+
+   /* Like PostgreSQL, the CRC covers the data and then the header up to xl_crc */
+   pgmoneta_create_crc32c_buffer(record + SIZE_OF_XLOG_RECORD, total_length - SIZE_OF_XLOG_RECORD, &crc);
+   pgmoneta_create_crc32c_buffer(record, offsetof(struct xlog_record, xl_crc), &crc);
+   r->xl_crc = crc;
+
+   if (position % BLOCK_SIZE == 0)
+   {
+      position += position % SEGMENT_SIZE == 0 ? SIZE_OF_XLOG_LONG_PHD : SIZE_OF_XLOG_SHORT_PHD;
+   }
+
+   lsns[number_of_records] = START_LSN + position;
+   lengths[number_of_records] = length;
+
+   while (copied < total_length)
+   {
+      if (position % BLOCK_SIZE == 0)
+      {
+         ck_assert_int_gt(sizeof(wal), position);
+
+         page_header = (struct xlog_page_header_data*)(wal + position);
+         page_header->xlp_info |= XLP_FIRST_IS_CONTRECORD;
+         page_header->xlp_rem_len = total_length - copied;
+
+         position += position % SEGMENT_SIZE == 0 ? SIZE_OF_XLOG_LONG_PHD : SIZE_OF_XLOG_SHORT_PHD;
+      }
+
+      n = MIN(total_length - copied, BLOCK_SIZE - position % BLOCK_SIZE);
+      memcpy(wal + position, record + copied, n);
+      copied += n;
+      position += n;
+   }
+
+   position = MAXALIGN(position);
+   prev = lsns[number_of_records];
+   number_of_records++;
+
+   free(record);
+}
+
+static void
+fill(char* data, uint32_t length, int record)
+{
+   for (uint32_t i = 0; i < length; i++)
+   {
+      data[i] = (char)(i * 31 + record);
+   }
+}
+
+static int
+write_segment(int segment, char* path)
+{
+   FILE* file = NULL;
+   size_t written = 0;
+
+   file = fopen(path, "w");
+
+   if (file == NULL)
+   {
+      return 1;
+   }
+
+   written = fwrite(wal + segment * SEGMENT_SIZE, 1, SEGMENT_SIZE, file);
+
+   fclose(file);
+
+   return written == SEGMENT_SIZE ? 0 : 1;
+}
+
+static int
+iterate(char* path, char* follow, struct wal_iterator** iterator)
+{
+   char* expected = NULL;
+   int record = 0;
+   int number = 0;
+   struct wal_iterator* it = NULL;
+
+   ck_assert_int_eq(pgmoneta_wal_iterator_create(path, &server_info, &it), 0);
+
+   it->follow = follow;
+   it->verify = true;
+
+   /* The first record that starts in the WAL segment */
+   while (record < number_of_records && lsns[record] < it->segment_start)
+   {
+      record++;
+   }
+
+   while (pgmoneta_wal_iterator_next(it))
+   {
+      ck_assert_int_gt(number_of_records, record);
+
+      ck_assert_uint_eq(it->record->lsn, lsns[record]);
+      ck_assert_uint_eq(it->record->next_lsn, lsns[record + 1]);
+      ck_assert_uint_eq(it->record->header.xl_xid, 1000 + record);
+      ck_assert_uint_eq(it->record->main_data_len, lengths[record]);
+
+      expected = (char*)malloc(lengths[record]);
+      ck_assert_ptr_nonnull(expected);
+      fill(expected, lengths[record], record);
+      ck_assert_mem_eq(it->record->main_data, expected, lengths[record]);
+      free(expected);
+
+      record++;
+      number++;
+   }
+
+   *iterator = it;
+
+   return number;
+}
@@ -28,7 +28,11 @@
  */
 
 #include "pgmoneta_test.h"
+#include "pgmoneta_crc32c_test.h"
 #include "pgmoneta_ext_test.h"
+#include "pgmoneta_tar_storage_test.h"
+#include "pgmoneta_wal_index_test.h"
+#include "pgmoneta_wal_iterator_test.h"
 
 int
 main(void)
@@ -36,13 +40,25 @@ main(void)
    int number_failed;
    Suite* s1;
    Suite* s2;
+   Suite* s3;
+   Suite* s4;
+   Suite* s5;
+   Suite* s6;
    SRunner* sr;
 
    s1 = pgmoneta_suite();
    s2 = pgmoneta_ext_suite();
+   s3 = pgmoneta_crc32c_suite();
+   s4 = pgmoneta_tar_storage_suite();
+   s5 = pgmoneta_wal_iterator_suite();
+   s6 = pgmoneta_wal_index_suite();
 
    sr = srunner_create(s1);
    srunner_add_suite(sr, s2);
+   srunner_add_suite(sr, s3);
+   srunner_add_suite(sr, s4);
+   srunner_add_suite(sr, s5);
+   srunner_add_suite(sr, s6);
 
    // Run the tests in verbose mode
    srunner_run_all(sr, CK_VERBOSE);